@@ -26,9 +26,14 @@
 #include "tcmu-runner.h"
 #include "tcmur_device.h"
 #include "tcmur_work.h"
+#include "tcmur_stats.h"
 #include "target.h"
 #include "alua.h"
 
+#define TCMU_ALUA_DEF_CACHE_SECS 5
+
+static unsigned int alua_cache_secs = TCMU_ALUA_DEF_CACHE_SECS;
+
 static char *tcmu_get_alua_str_setting(struct alua_grp *group,
 				       const char *setting)
 {
@@ -336,6 +341,181 @@ free_names:
 	return ret;
 }
 
+/*
+ * How long a configfs ALUA snapshot is served before it is rescanned. 0
+ * rescans configfs for every command, like before there was a snapshot.
+ */
+void tcmu_alua_set_cache_secs(unsigned int secs)
+{
+	__atomic_store_n(&alua_cache_secs, secs, __ATOMIC_RELAXED);
+}
+
+/**
+ * tcmu_lock_alua_grps: Get the device's snapshot of its port groups.
+ * @dev: device to get groups for.
+ *
+ * Multipath tools poll INQUIRY and RTPG on every path every few seconds,
+ * so instead of scanning configfs for each of them the groups are kept
+ * on the device. The snapshot is rebuilt when it was invalidated, by a
+ * reconfig or a reopen, or when it is older than alua_cache_secs, which
+ * bounds how long changes made directly in configfs take to show up.
+ * Transitions the runner makes itself update the snapshot's groups in
+ * place, so they are seen right away.
+ *
+ * Returns the group list with rdev->alua_lock held, or NULL if configfs
+ * could not be read. alua_lock nests outside state_lock. The caller must
+ * call tcmu_unlock_alua_grps when it is done with a non NULL list, and
+ * must not hold on to the groups.
+ */
+struct list_head *tcmu_lock_alua_grps(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	unsigned int secs = __atomic_load_n(&alua_cache_secs, __ATOMIC_RELAXED);
+	uint64_t now = tcmur_now_ns();
+	uint32_t gen;
+
+	pthread_mutex_lock(&rdev->alua_lock);
+	gen = __atomic_load_n(&rdev->alua_grps_gen, __ATOMIC_ACQUIRE);
+	if (rdev->alua_grps_valid && rdev->alua_grps_snap_gen == gen &&
+	    now - rdev->alua_grps_ns < secs * 1000000000ULL)
+		return &rdev->alua_grps;
+
+	tcmu_release_alua_grps(&rdev->alua_grps);
+	rdev->alua_grps_valid = false;
+
+	if (tcmu_get_alua_grps(dev, &rdev->alua_grps)) {
+		pthread_mutex_unlock(&rdev->alua_lock);
+		return NULL;
+	}
+
+	rdev->alua_grps_valid = true;
+	rdev->alua_grps_snap_gen = gen;
+	rdev->alua_grps_ns = now;
+	return &rdev->alua_grps;
+}
+
+void tcmu_unlock_alua_grps(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	pthread_mutex_unlock(&rdev->alua_lock);
+}
+
+static struct alua_grp *alua_grp_dup(struct alua_grp *group)
+{
+	struct tgt_port *port, *new_port;
+	struct alua_grp *new;
+
+	new = malloc(sizeof(*new));
+	if (!new)
+		return NULL;
+	*new = *group;
+	new->state_changed = false;
+	list_head_init(&new->tgt_ports);
+	list_node_init(&new->entry);
+	new->name = strdup(group->name);
+	if (!new->name)
+		goto free_group;
+
+	list_for_each(&group->tgt_ports, port, entry) {
+		new_port = malloc(sizeof(*new_port));
+		if (!new_port)
+			goto free_group;
+		*new_port = *port;
+		new_port->grp = new;
+		new_port->wwn = port->wwn ? strdup(port->wwn) : NULL;
+		new_port->fabric = port->fabric ? strdup(port->fabric) : NULL;
+		list_add_tail(&new->tgt_ports, &new_port->entry);
+		if ((port->wwn && !new_port->wwn) ||
+		    (port->fabric && !new_port->fabric))
+			goto free_group;
+	}
+	return new;
+
+free_group:
+	tcmu_free_alua_grp(new);
+	return NULL;
+}
+
+/**
+ * tcmu_copy_alua_grps: Copy the device's snapshot of its port groups.
+ * @dev: device to get groups for.
+ * @group_list: empty list the copies are added to.
+ *
+ * For STPG, whose transition can block on the handler's lock callouts.
+ * Working on a copy keeps alua_lock from being held meanwhile, which
+ * would stall INQUIRY and RTPG. tcmu_update_alua_grps publishes the
+ * resulting states, and the copy is freed with tcmu_release_alua_grps.
+ */
+int tcmu_copy_alua_grps(struct tcmu_device *dev, struct list_head *group_list)
+{
+	struct list_head *snap;
+	struct alua_grp *group, *new;
+	int ret = 0;
+
+	snap = tcmu_lock_alua_grps(dev);
+	if (!snap)
+		return -EIO;
+
+	list_for_each(snap, group, entry) {
+		new = alua_grp_dup(group);
+		if (!new) {
+			tcmu_release_alua_grps(group_list);
+			ret = -ENOMEM;
+			break;
+		}
+		list_add_tail(group_list, &new->entry);
+	}
+	tcmu_unlock_alua_grps(dev);
+	return ret;
+}
+
+/*
+ * Set the states of a copy from tcmu_copy_alua_grps on the snapshot
+ * after a transition. Only the groups the transition changed are
+ * written, so a newer state from an implicit transition or a configfs
+ * rescan of the others is kept. The snapshot may have been rebuilt
+ * meanwhile, so groups are matched by id, and one that went away is
+ * left alone.
+ */
+void tcmu_update_alua_grps(struct tcmu_device *dev,
+			   struct list_head *group_list)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct alua_grp *group, *snap_group;
+
+	pthread_mutex_lock(&rdev->alua_lock);
+	if (!rdev->alua_grps_valid)
+		goto unlock;
+
+	list_for_each(group_list, group, entry) {
+		if (!group->state_changed)
+			continue;
+
+		list_for_each(&rdev->alua_grps, snap_group, entry) {
+			if (snap_group->id != group->id)
+				continue;
+			snap_group->state = group->state;
+			snap_group->status = group->status;
+			break;
+		}
+	}
+unlock:
+	pthread_mutex_unlock(&rdev->alua_lock);
+}
+
+/*
+ * Have the next tcmu_lock_alua_grps rescan configfs. This does not take
+ * alua_lock, so it can be called from paths that run under it, like the
+ * reopen STPG can do when it takes the device lock.
+ */
+void tcmu_invalidate_alua_grps(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	__atomic_add_fetch(&rdev->alua_grps_gen, 1, __ATOMIC_RELEASE);
+}
+
 /*
  * tcmu does not pass up the target port that the command was
  * received on, so if a LUN is exported through multiple ports
@@ -382,6 +562,7 @@ static int alua_set_state(struct tcmu_device *dev, struct alua_grp *group,
 
 	group->state = new_state;
 	group->status = alua_status;
+	group->state_changed = true;
 	return TCMU_STS_OK;
 }
 
@@ -435,7 +616,7 @@ static int alua_sync_state(struct tcmu_device *dev,
 				pthread_mutex_lock(&rdev->state_lock);
 				if (rdev->lock_state == TCMUR_DEV_LOCK_WRITE_LOCKED) {
 					tcmu_dev_dbg(dev, "Dropping lock\n");
-					rdev->lock_state = TCMUR_DEV_LOCK_UNLOCKED;
+					tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_UNLOCKED);
 				}
 				pthread_mutex_unlock(&rdev->state_lock);
 			}
@@ -560,6 +741,13 @@ int alua_implicit_transition(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 	if (!lock_is_required(dev))
 		return ret;
 
+	/*
+	 * Fast path for the common case. The state_lock is only needed to
+	 * start or wait on a transition.
+	 */
+	if (tcmur_dev_peek_lock_state(rdev) == TCMUR_DEV_LOCK_WRITE_LOCKED)
+		return ret;
+
 	pthread_mutex_lock(&rdev->state_lock);
 	if (rdev->lock_state == TCMUR_DEV_LOCK_WRITE_LOCKED) {
 		/* For both read/write cases in this state is good */
@@ -587,7 +775,7 @@ int alua_implicit_transition(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 		 *
 		 * Will not acquire the lock, just reopen the device.
 		 */
-		rdev->lock_state = TCMUR_DEV_LOCK_READ_LOCKING;
+		tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_READ_LOCKING);
 	} else {
 		tcmu_dev_info(dev, "Starting write lock acquisition operation.\n");
 
@@ -600,7 +788,7 @@ int alua_implicit_transition(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 		 *
 		 * May will reopen the deivce and Will acquire the lock later.
 		 */
-		rdev->lock_state = TCMUR_DEV_LOCK_WRITE_LOCKING;
+		tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_WRITE_LOCKING);
 	}
 
 	/*
@@ -610,7 +798,7 @@ int alua_implicit_transition(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 	if (tcmur_run_work(rdev->event_work, dev, alua_event_work_fn)) {
 		tcmu_dev_err(dev, "Could not start implicit transition thread:%s\n",
 			     strerror(errno));
-		rdev->lock_state = TCMUR_DEV_LOCK_UNLOCKED;
+		tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_UNLOCKED);
 		ret = TCMU_STS_IMPL_TRANSITION_ERR;
 	} else {
 		ret = TCMU_STS_BUSY;
@@ -796,7 +984,8 @@ int alua_check_state(struct tcmu_device *dev, struct tcmulib_cmd *cmd, bool is_r
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 
 	if (rdev->failover_type == TCMUR_DEV_FAILOVER_EXPLICIT) {
-		if (rdev->lock_state != TCMUR_DEV_LOCK_WRITE_LOCKED) {
+		if (tcmur_dev_peek_lock_state(rdev) !=
+		    TCMUR_DEV_LOCK_WRITE_LOCKED) {
 			tcmu_dev_dbg(dev, "device lock not held.\n");
 			return TCMU_STS_FENCED;
 		}
@@ -31,6 +31,8 @@ struct alua_grp {
 
 	struct tcmu_device *dev;
 	uint8_t num_tgt_ports;
+	/* state was set on this copy, see tcmu_update_alua_grps() */
+	bool state_changed;
 	/* entry on list returned by lib */
 	struct list_node entry;
 	struct list_head tgt_ports;
@@ -45,6 +47,13 @@ int tcmu_emulate_set_tgt_port_grps(struct tcmu_device *dev,
 struct tgt_port *tcmu_get_enabled_port(struct list_head *);
 int tcmu_get_alua_grps(struct tcmu_device *, struct list_head *);
 void tcmu_release_alua_grps(struct list_head *);
+struct list_head *tcmu_lock_alua_grps(struct tcmu_device *dev);
+void tcmu_unlock_alua_grps(struct tcmu_device *dev);
+int tcmu_copy_alua_grps(struct tcmu_device *dev, struct list_head *group_list);
+void tcmu_update_alua_grps(struct tcmu_device *dev,
+			   struct list_head *group_list);
+void tcmu_invalidate_alua_grps(struct tcmu_device *dev);
+void tcmu_alua_set_cache_secs(unsigned int secs);
 int alua_implicit_transition(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 			     bool is_read);
 bool lock_is_required(struct tcmu_device *dev);
@@ -116,13 +116,20 @@ off_t tcmu_iovec_compare(void *mem, struct iovec *iovec, size_t size)
 			char *dpos = iovec->iov_base;
 
 			/*
-			 * Data differed, this is assumed to be 'rare'
-			 * so use a much more expensive byte-by-byte
-			 * comparison to find out at which offset the
-			 * data differs.
+			 * Data differed, this is assumed to be 'rare'.
+			 * Skip matching words, then find the byte within
+			 * the first mismatching one.
 			 */
-			for (pos = 0; pos < part && *spos++ == *dpos++;
-			     pos++)
+			for (pos = 0; pos + sizeof(uint64_t) <= part;
+			     pos += sizeof(uint64_t)) {
+				uint64_t sw, dw;
+
+				memcpy(&sw, spos + pos, sizeof(sw));
+				memcpy(&dw, dpos + pos, sizeof(dw));
+				if (sw != dw)
+					break;
+			}
+			for (; pos < part && spos[pos] == dpos[pos]; pos++)
 				;
 
 			return pos + mem_off;
@@ -228,28 +235,41 @@ void tcmu_iovec_zero(struct iovec *iovec, size_t iov_cnt)
 	}
 }
 
+/* Bytes checked one by one before handing the rest to memcmp */
+#define TCMU_ZEROED_HEAD 64
+
+/*
+ * Once the first TCMU_ZEROED_HEAD bytes are known to be zero, the buffer
+ * is all zero iff it equals itself shifted by that many bytes. That lets
+ * the libc memcmp, which is vectorized and picked for the running CPU,
+ * do the bulk of the work instead of a byte loop.
+ */
 static inline bool tcmu_zeroed_mem(const char *buf, size_t size)
 {
-    int i;
+	size_t i, head = min(size, (size_t)TCMU_ZEROED_HEAD);
+	char acc = 0;
 
-    for (i = 0; i < size; i++) {
-        if (buf[i])
+	for (i = 0; i < head; i++)
+		acc |= buf[i];
+	if (acc)
 		return false;
-    }
 
-    return true;
+	if (size == head)
+		return true;
+
+	return !memcmp(buf, buf + head, size - head);
 }
 
 bool tcmu_iovec_zeroed(struct iovec *iovec, size_t iov_cnt)
 {
-    int i;
+	size_t i;
 
-    for (i = 0; i < iov_cnt; i++) {
-        if (!tcmu_zeroed_mem(iovec[i].iov_base, iovec[i].iov_len))
-		return false;
-    }
+	for (i = 0; i < iov_cnt; i++) {
+		if (!tcmu_zeroed_mem(iovec[i].iov_base, iovec[i].iov_len))
+			return false;
+	}
 
-    return true;
+	return true;
 }
 
 /*
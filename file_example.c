@@ -31,16 +31,70 @@
 #include <endian.h>
 #include <errno.h>
 #include <scsi/scsi.h>
+#include <linux/falloc.h>
+#ifdef HAVE_LINUX_IO_URING
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 #include "scsi_defs.h"
 #include "libtcmu.h"
 #include "tcmu-runner.h"
 #include "tcmur_device.h"
 
+struct file_uring;
+
 struct file_state {
 	int fd;
+	/* <file>.pi, with the PI tuples of the blocks, or -1 */
+	int pi_fd;
+	struct file_uring *uring;
+	/* RWF_NOWAIT reads are not supported by the file's filesystem */
+	bool no_nowait;
 };
 
+#ifdef HAVE_LINUX_IO_URING
+static int file_uring_open(struct tcmu_device *dev);
+static void file_uring_close(struct tcmu_device *dev);
+#endif
+
+static int file_pi_open(struct tcmu_device *dev, const char *path)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+	char *pi_path;
+
+	if (asprintf(&pi_path, "%s.pi", path) < 0)
+		return -ENOMEM;
+
+	state->pi_fd = open(pi_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+	if (state->pi_fd == -1) {
+		tcmu_dev_err(dev, "could not open %s: %m\n", pi_path);
+		free(pi_path);
+		return -EINVAL;
+	}
+
+	tcmu_dev_dbg(dev, "PI tuples in %s\n", pi_path);
+	free(pi_path);
+	return 0;
+}
+
+/*
+ * Punching a hole past the end of the file loses nothing, so it tells if
+ * the filesystem can unmap without touching the data.
+ */
+static bool file_can_punch_hole(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return false;
+
+	return !fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			  st.st_size, 4096) || errno != EOPNOTSUPP;
+}
+
 static int file_open(struct tcmu_device *dev, bool reopen)
 {
 	struct file_state *state;
@@ -49,6 +103,7 @@ static int file_open(struct tcmu_device *dev, bool reopen)
 	state = calloc(1, sizeof(*state));
 	if (!state)
 		return -ENOMEM;
+	state->pi_fd = -1;
 
 	tcmur_dev_set_private(dev, state);
 
@@ -67,6 +122,32 @@ static int file_open(struct tcmu_device *dev, bool reopen)
 		goto err;
 	}
 
+	/*
+	 * Unmapped blocks are reported to read back zeroes (LBPRZ), so only
+	 * take UNMAP if the filesystem can punch holes.
+	 */
+	if (!file_can_punch_hole(state->fd)) {
+		tcmu_dev_info(dev, "%s cannot punch holes, disabling unmap\n",
+			      config);
+		tcmu_dev_set_unmap_enabled(dev, false);
+	}
+
+	/*
+	 * The tuples live in a side file, so the image keeps its layout
+	 * and can be resized or used without PI.
+	 */
+	if (tcmu_dev_get_pi_enabled(dev) && file_pi_open(dev, config)) {
+		close(state->fd);
+		goto err;
+	}
+
+#ifdef HAVE_LINUX_IO_URING
+	if (tcmur_dev_async_io(dev) && file_uring_open(dev)) {
+		tcmu_dev_warn(dev, "io_uring setup failed, doing I/O inline\n");
+		tcmur_dev_set_blocking_io(dev);
+	}
+#endif
+
 	tcmu_dbg("config %s\n", tcmu_dev_get_cfgstring(dev));
 
 	return 0;
@@ -80,6 +161,12 @@ static void file_close(struct tcmu_device *dev)
 {
 	struct file_state *state = tcmur_dev_get_private(dev);
 
+#ifdef HAVE_LINUX_IO_URING
+	if (state->uring)
+		file_uring_close(dev);
+#endif
+	if (state->pi_fd != -1)
+		close(state->pi_fd);
 	close(state->fd);
 	free(state);
 }
@@ -115,6 +202,35 @@ done:
 	return ret;
 }
 
+#ifdef RWF_NOWAIT
+/*
+ * Complete the read from the cmdproc thread if all of it is in the page
+ * cache. Short reads, EOF included, and errors are retried by file_read
+ * from the IO threads.
+ */
+static int file_read_nowait(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			    struct iovec *iov, size_t iov_cnt, size_t length,
+			    off_t offset)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+	ssize_t ret;
+
+	if (state->no_nowait)
+		return TCMU_STS_NOT_HANDLED;
+
+	ret = preadv2(state->fd, iov, iov_cnt, offset, RWF_NOWAIT);
+	if (ret == length)
+		return TCMU_STS_OK;
+
+	if (ret < 0 && errno == EOPNOTSUPP) {
+		tcmu_dev_dbg(dev, "RWF_NOWAIT reads not supported\n");
+		state->no_nowait = true;
+	}
+
+	return TCMU_STS_NOT_HANDLED;
+}
+#endif
+
 static int file_write(struct tcmu_device *dev, struct tcmur_cmd *cmd,
 		      struct iovec *iov, size_t iov_cnt, size_t length,
 		      off_t offset)
@@ -139,6 +255,17 @@ done:
 	return ret;
 }
 
+static int file_flush_pi(struct tcmu_device *dev)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+
+	if (state->pi_fd != -1 && fsync(state->pi_fd)) {
+		tcmu_dev_err(dev, "PI sync failed: %m\n");
+		return TCMU_STS_WR_ERR;
+	}
+	return TCMU_STS_OK;
+}
+
 static int file_flush(struct tcmu_device *dev, struct tcmur_cmd *cmd)
 {
 	struct file_state *state = tcmur_dev_get_private(dev);
@@ -149,11 +276,871 @@ static int file_flush(struct tcmu_device *dev, struct tcmur_cmd *cmd)
 		ret = TCMU_STS_WR_ERR;
 		goto done;
 	}
-	ret = TCMU_STS_OK;
+	ret = file_flush_pi(dev);
 done:
 	return ret;
 }
 
+/* The tuples of blocks past the end of the PI file read back as zeros */
+static int file_read_pi(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			struct tcmu_pi_tuple *pi, uint64_t lba,
+			uint32_t nr_blocks)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+	size_t remaining = nr_blocks * sizeof(*pi);
+	off_t offset = lba * sizeof(*pi);
+	char *buf = (char *)pi;
+	ssize_t ret;
+
+	while (remaining) {
+		ret = pread(state->pi_fd, buf, remaining, offset);
+		if (ret < 0) {
+			tcmu_dev_err(dev, "PI read failed: %m\n");
+			return TCMU_STS_RD_ERR;
+		}
+
+		if (ret == 0) {
+			memset(buf, 0, remaining);
+			break;
+		}
+
+		buf += ret;
+		offset += ret;
+		remaining -= ret;
+	}
+
+	return TCMU_STS_OK;
+}
+
+static int file_write_pi(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			 const struct tcmu_pi_tuple *pi, uint64_t lba,
+			 uint32_t nr_blocks)
+{
+	static const char zeros[4096];
+	struct file_state *state = tcmur_dev_get_private(dev);
+	size_t remaining = nr_blocks * sizeof(*pi);
+	off_t offset = lba * sizeof(*pi);
+	const char *buf = (const char *)pi;
+	size_t len;
+	ssize_t ret;
+
+	/* Clearing leaves zeros, which is a tuple that is not checked */
+	if (!pi) {
+		if (!fallocate(state->pi_fd,
+			       FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			       offset, remaining))
+			return TCMU_STS_OK;
+		if (errno != EOPNOTSUPP) {
+			tcmu_dev_err(dev, "PI clear failed: %m\n");
+			return TCMU_STS_WR_ERR;
+		}
+	}
+
+	while (remaining) {
+		if (pi) {
+			ret = pwrite(state->pi_fd, buf, remaining, offset);
+		} else {
+			len = remaining < sizeof(zeros) ? remaining :
+							  sizeof(zeros);
+			ret = pwrite(state->pi_fd, zeros, len, offset);
+		}
+		if (ret < 0) {
+			tcmu_dev_err(dev, "PI write failed: %m\n");
+			return TCMU_STS_WR_ERR;
+		}
+
+		if (pi)
+			buf += ret;
+		offset += ret;
+		remaining -= ret;
+	}
+
+	return TCMU_STS_OK;
+}
+
+/* Punch out every range of an UNMAP from the worker thread in one go */
+static int file_unmap_vec(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			  struct tcmur_unmap_range *ranges,
+			  unsigned int nr_ranges)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+	unsigned int i;
+
+	for (i = 0; i < nr_ranges; i++) {
+		if (fallocate(state->fd,
+			      FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      ranges[i].offset, ranges[i].length)) {
+			/* the runner writes zeroes instead */
+			if (errno == EOPNOTSUPP)
+				return TCMU_STS_NOT_HANDLED;
+			tcmu_dev_err(dev, "unmap failed: %m\n");
+			return TCMU_STS_WR_ERR;
+		}
+	}
+
+	return TCMU_STS_OK;
+}
+
+/* Devices with PI have the runner pass unmap ranges one at a time */
+static int file_unmap(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+		      uint64_t off, uint64_t len)
+{
+	struct tcmur_unmap_range range = { .offset = off, .length = len };
+
+	return file_unmap_vec(dev, cmd, &range, 1);
+}
+
+static int file_write_zeroes(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			     uint64_t off, uint64_t len)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+
+	if (fallocate(state->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+		      off, len)) {
+		if (errno == EOPNOTSUPP)
+			return TCMU_STS_NOT_HANDLED;
+
+		tcmu_dev_err(dev, "zero range failed: %m\n");
+		return TCMU_STS_WR_ERR;
+	}
+
+	return TCMU_STS_OK;
+}
+
+/* Let the kernel (or the filesystem) do the EXTENDED COPY for us */
+static int file_copy(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+		     uint64_t src_off, uint64_t dst_off, uint64_t len)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+	off64_t in = src_off, out = dst_off;
+	ssize_t ret;
+
+	while (len) {
+		ret = copy_file_range(state->fd, &in, state->fd, &out, len, 0);
+		if (ret <= 0) {
+			/*
+			 * Not supported, or the src is past the end of a
+			 * sparse file, so let the runner read the zeros.
+			 */
+			if (in == src_off &&
+			    (!ret || errno == ENOSYS || errno == EOPNOTSUPP ||
+			     errno == EXDEV || errno == EINVAL))
+				return TCMU_STS_NOT_HANDLED;
+
+			tcmu_dev_err(dev, "copy_file_range failed: %m\n");
+			return TCMU_STS_WR_ERR;
+		}
+		len -= ret;
+	}
+
+	return TCMU_STS_OK;
+}
+
+#ifdef HAVE_LINUX_IO_URING
+/*
+ * io_uring engine
+ *
+ * Devices opened with tcmur_async_io run without worker threads. Their
+ * reads, writes, flushes and unmaps are queued to a per device ring from
+ * the cmdproc thread (or the completion context for compound commands),
+ * and a reaper thread completes them with tcmur_cmd_complete(). The
+ * callouts below pass the cmds of other devices to the synchronous
+ * callouts above.
+ *
+ * The UIO data area is registered as a fixed buffer, so single segment
+ * I/O goes straight between the file and the pinned ring pages. The
+ * cookie tracking each sqe comes from a free list allocated with the
+ * ring, one per cq entry, so the cq can never overflow.
+ */
+#define FILE_URING_DEPTH 256
+/* Times an sqe is retried after the kernel was busy, reaping in between */
+#define FILE_URING_SUBMIT_TRIES 8
+
+enum {
+	FILE_URING_READ,
+	FILE_URING_WRITE,
+	FILE_URING_FLUSH,
+	FILE_URING_UNMAP,
+	FILE_URING_ZERO,
+};
+
+struct file_uring_cookie {
+	struct tcmur_cmd *tcmur_cmd;
+	int op;
+	struct iovec *iov;
+	size_t iov_cnt;
+	size_t length;
+	off_t offset;
+	struct file_uring_cookie *next;	/* on the free list */
+};
+
+struct file_uring {
+	int fd;
+	pthread_t reaper;
+
+	/* protects the sq */
+	pthread_mutex_t sq_lock;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+
+	/* protects cq_head, the reaper and busy submitters both reap */
+	pthread_mutex_t cq_lock;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* protects free_cookies */
+	pthread_mutex_t cookie_lock;
+	struct file_uring_cookie *cookies;
+	struct file_uring_cookie *free_cookies;
+
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+
+	/* registered UIO data area */
+	bool fixed;
+	char *buf_base;
+	size_t buf_len;
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+			  unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+			     unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Must be called with sq_lock held */
+static struct io_uring_sqe *file_uring_get_sqe(struct file_uring *ring)
+{
+	unsigned head, tail;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	tail = *ring->sq_tail;
+	if (tail - head > *ring->sq_mask)
+		return NULL;
+
+	ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+	return memset(&ring->sqes[tail & *ring->sq_mask], 0,
+		      sizeof(struct io_uring_sqe));
+}
+
+/*
+ * Must be called with sq_lock held. If the kernel does not take the sqe
+ * it is withdrawn from the sq again, so a later submission cannot pick it
+ * up after the caller has given up on it.
+ */
+static int file_uring_submit(struct file_uring *ring)
+{
+	int ret;
+
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+
+	do {
+		ret = io_uring_enter(ring->fd, 1, 0, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret == 1)
+		return 0;
+
+	ret = ret < 0 ? -errno : -EAGAIN;
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail - 1, __ATOMIC_RELEASE);
+	return ret;
+}
+
+static struct file_uring_cookie *file_uring_get_cookie(struct file_uring *ring)
+{
+	struct file_uring_cookie *cookie;
+
+	pthread_mutex_lock(&ring->cookie_lock);
+	cookie = ring->free_cookies;
+	if (cookie)
+		ring->free_cookies = cookie->next;
+	pthread_mutex_unlock(&ring->cookie_lock);
+
+	return cookie;
+}
+
+static void file_uring_put_cookie(struct file_uring *ring,
+				  struct file_uring_cookie *cookie)
+{
+	pthread_mutex_lock(&ring->cookie_lock);
+	cookie->next = ring->free_cookies;
+	ring->free_cookies = cookie;
+	pthread_mutex_unlock(&ring->cookie_lock);
+}
+
+/* Take the next completion off the cq, false if there is none */
+static bool file_uring_next_cqe(struct file_uring *ring, uint64_t *user_data,
+				int *res)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head;
+	bool found = false;
+
+	pthread_mutex_lock(&ring->cq_lock);
+	head = *ring->cq_head;
+	if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		*user_data = cqe->user_data;
+		*res = cqe->res;
+		__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+		found = true;
+	}
+	pthread_mutex_unlock(&ring->cq_lock);
+
+	return found;
+}
+
+static void file_uring_complete(struct tcmu_device *dev,
+				struct file_uring_cookie *cookie, int res)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+	struct tcmur_cmd *tcmur_cmd = cookie->tcmur_cmd;
+	int ret = TCMU_STS_OK;
+
+	if (res < 0) {
+		switch (cookie->op) {
+		case FILE_URING_READ:
+			tcmu_dev_err(dev, "read failed: %d\n", res);
+			ret = TCMU_STS_RD_ERR;
+			break;
+		case FILE_URING_UNMAP:
+		case FILE_URING_ZERO:
+			/* Let the runner write the zeroes instead */
+			if (res == -EOPNOTSUPP) {
+				ret = TCMU_STS_NOT_HANDLED;
+				break;
+			}
+			/* fall through */
+		default:
+			tcmu_dev_err(dev, "op %d failed: %d\n", cookie->op, res);
+			ret = TCMU_STS_WR_ERR;
+		}
+	} else if (cookie->op == FILE_URING_FLUSH) {
+		/* The PI file is small next to the image, sync it inline */
+		ret = file_flush_pi(dev);
+	} else if ((size_t)res < cookie->length) {
+		/* Short read/write, finish it off the synchronous way */
+		tcmu_iovec_seek(cookie->iov, res);
+
+		if (cookie->op == FILE_URING_READ)
+			ret = file_read(dev, tcmur_cmd, cookie->iov,
+					cookie->iov_cnt, cookie->length - res,
+					cookie->offset + res);
+		else if (cookie->op == FILE_URING_WRITE)
+			ret = file_write(dev, tcmur_cmd, cookie->iov,
+					 cookie->iov_cnt, cookie->length - res,
+					 cookie->offset + res);
+	}
+
+	file_uring_put_cookie(state->uring, cookie);
+	tcmur_cmd_complete(dev, tcmur_cmd, ret);
+}
+
+static void *file_uring_reaper(void *arg)
+{
+	struct tcmu_device *dev = arg;
+	struct file_state *state = tcmur_dev_get_private(dev);
+	struct file_uring *ring = state->uring;
+	uint64_t user_data;
+	int res;
+
+	tcmu_set_thread_name("uring", dev);
+
+	while (1) {
+		if (!file_uring_next_cqe(ring, &user_data, &res)) {
+			if (io_uring_enter(ring->fd, 0, 1,
+					   IORING_ENTER_GETEVENTS) < 0 &&
+			    errno != EINTR)
+				tcmu_dev_err(dev, "io_uring_enter failed: %m\n");
+			continue;
+		}
+
+		/* file_uring_close's NOP */
+		if (!user_data)
+			break;
+
+		file_uring_complete(dev,
+			(struct file_uring_cookie *)(uintptr_t)user_data, res);
+	}
+
+	return NULL;
+}
+
+/*
+ * The kernel refuses new sqes while the cq is full, so a submitter that
+ * got EBUSY completes what is there itself instead of waiting on the
+ * reaper. Cannot see the NOP, since file_uring_close runs with nothing
+ * left in flight.
+ */
+static void file_uring_reap(struct tcmu_device *dev, struct file_uring *ring)
+{
+	uint64_t user_data;
+	int res;
+
+	while (file_uring_next_cqe(ring, &user_data, &res))
+		file_uring_complete(dev,
+			(struct file_uring_cookie *)(uintptr_t)user_data, res);
+}
+
+/* Must be called with sq_lock held */
+static void file_uring_prep(struct file_state *state, struct file_uring *ring,
+			    struct io_uring_sqe *sqe,
+			    struct file_uring_cookie *cookie)
+{
+	struct iovec *iov = cookie->iov;
+	size_t length = cookie->length;
+	char *base;
+
+	sqe->fd = state->fd;
+	sqe->user_data = (uintptr_t)cookie;
+
+	switch (cookie->op) {
+	case FILE_URING_READ:
+	case FILE_URING_WRITE:
+		base = cookie->iov_cnt == 1 ? iov[0].iov_base : NULL;
+		if (ring->fixed && base >= ring->buf_base &&
+		    base + length <= ring->buf_base + ring->buf_len) {
+			sqe->opcode = cookie->op == FILE_URING_READ ?
+				IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+			sqe->addr = (uintptr_t)base;
+			sqe->len = length;
+			sqe->buf_index = 0;
+		} else {
+			sqe->opcode = cookie->op == FILE_URING_READ ?
+				IORING_OP_READV : IORING_OP_WRITEV;
+			sqe->addr = (uintptr_t)iov;
+			sqe->len = cookie->iov_cnt;
+		}
+		sqe->off = cookie->offset;
+		break;
+	case FILE_URING_FLUSH:
+		sqe->opcode = IORING_OP_FSYNC;
+		break;
+	case FILE_URING_UNMAP:
+		sqe->opcode = IORING_OP_FALLOCATE;
+		sqe->off = cookie->offset;
+		sqe->addr = length;
+		sqe->len = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+		break;
+	case FILE_URING_ZERO:
+		sqe->opcode = IORING_OP_FALLOCATE;
+		sqe->off = cookie->offset;
+		sqe->addr = length;
+		sqe->len = FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE;
+		break;
+	}
+}
+
+static int file_uring_queue(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			    int op, struct iovec *iov, size_t iov_cnt,
+			    size_t length, off_t offset)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+	struct file_uring *ring = state->uring;
+	struct file_uring_cookie *cookie;
+	struct io_uring_sqe *sqe;
+	int ret, tries;
+
+	/* as many cmds are in flight as the cq can take */
+	cookie = file_uring_get_cookie(ring);
+	if (!cookie)
+		return TCMU_STS_NO_RESOURCE;
+	cookie->tcmur_cmd = cmd;
+	cookie->op = op;
+	cookie->iov = iov;
+	cookie->iov_cnt = iov_cnt;
+	cookie->length = length;
+	cookie->offset = offset;
+
+	for (tries = 0; ; tries++) {
+		pthread_mutex_lock(&ring->sq_lock);
+		sqe = file_uring_get_sqe(ring);
+		if (!sqe) {
+			pthread_mutex_unlock(&ring->sq_lock);
+			file_uring_put_cookie(ring, cookie);
+			return TCMU_STS_NO_RESOURCE;
+		}
+		file_uring_prep(state, ring, sqe, cookie);
+		ret = file_uring_submit(ring);
+		pthread_mutex_unlock(&ring->sq_lock);
+
+		if (!ret)
+			return TCMU_STS_OK;
+		if ((ret != -EBUSY && ret != -EAGAIN) ||
+		    tries == FILE_URING_SUBMIT_TRIES)
+			break;
+
+		file_uring_reap(dev, ring);
+	}
+
+	/* The sqe was withdrawn, so the cookie is still ours */
+	file_uring_put_cookie(ring, cookie);
+	tcmu_dev_err(dev, "Could not submit to io_uring: %d\n", ret);
+	if (ret == -EBUSY || ret == -EAGAIN)
+		return TCMU_STS_NO_RESOURCE;
+	return TCMU_STS_HW_ERR;
+}
+
+static void file_uring_register_data_area(struct tcmu_device *dev,
+					  struct file_uring *ring)
+{
+	struct iovec iov;
+	char *mmap_name;
+	off_t offset;
+
+	mmap_name = tcmu_dev_get_memory_info(dev, &iov.iov_base, &iov.iov_len,
+					     &offset);
+	if (!mmap_name)
+		return;
+	free(mmap_name);
+
+	/* This pins the data area, so it may fail for RLIMIT_MEMLOCK */
+	if (io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+		tcmu_dev_dbg(dev, "Could not register data area: %m\n");
+		return;
+	}
+
+	ring->buf_base = iov.iov_base;
+	ring->buf_len = iov.iov_len;
+	ring->fixed = true;
+}
+
+static int file_uring_open(struct tcmu_device *dev)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+	struct io_uring_params p;
+	struct file_uring *ring;
+	unsigned int i;
+	int ret;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return -ENOMEM;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = io_uring_setup(FILE_URING_DEPTH, &p);
+	if (ring->fd < 0) {
+		ret = -errno;
+		goto free_ring;
+	}
+
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_sz = p.cq_off.cqes +
+			   p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_sz > ring->sq_ring_sz)
+			ring->sq_ring_sz = ring->cq_ring_sz;
+		ring->cq_ring_sz = ring->sq_ring_sz;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ret = -errno;
+		goto close_fd;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_sz,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ret = -errno;
+			goto unmap_sq;
+		}
+	}
+
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ret = -errno;
+		goto unmap_cq;
+	}
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+
+	ret = pthread_mutex_init(&ring->sq_lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto unmap_sqes;
+	}
+
+	ret = pthread_mutex_init(&ring->cq_lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto destroy_sq_lock;
+	}
+
+	ret = pthread_mutex_init(&ring->cookie_lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto destroy_cq_lock;
+	}
+
+	ring->cookies = calloc(p.cq_entries, sizeof(*ring->cookies));
+	if (!ring->cookies) {
+		ret = -ENOMEM;
+		goto destroy_cookie_lock;
+	}
+	for (i = 0; i < p.cq_entries; i++) {
+		ring->cookies[i].next = ring->free_cookies;
+		ring->free_cookies = &ring->cookies[i];
+	}
+
+	file_uring_register_data_area(dev, ring);
+
+	state->uring = ring;
+	ret = pthread_create(&ring->reaper, NULL, file_uring_reaper, dev);
+	if (ret) {
+		ret = -ret;
+		state->uring = NULL;
+		goto free_cookies;
+	}
+
+	tcmu_dev_dbg(dev, "Using io_uring with %u entries%s\n", p.sq_entries,
+		     ring->fixed ? " and fixed buffers" : "");
+	return 0;
+
+free_cookies:
+	free(ring->cookies);
+destroy_cookie_lock:
+	pthread_mutex_destroy(&ring->cookie_lock);
+destroy_cq_lock:
+	pthread_mutex_destroy(&ring->cq_lock);
+destroy_sq_lock:
+	pthread_mutex_destroy(&ring->sq_lock);
+unmap_sqes:
+	munmap(ring->sqes, ring->sqes_sz);
+unmap_cq:
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+unmap_sq:
+	munmap(ring->sq_ring, ring->sq_ring_sz);
+close_fd:
+	close(ring->fd);
+free_ring:
+	free(ring);
+	return ret;
+}
+
+static void file_uring_close(struct tcmu_device *dev)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+	struct file_uring *ring = state->uring;
+	struct io_uring_sqe *sqe;
+
+	/*
+	 * All cmds have completed by the time we are closed, so a NOP
+	 * with no cookie is the last completion the reaper will see.
+	 */
+	pthread_mutex_lock(&ring->sq_lock);
+	sqe = file_uring_get_sqe(ring);
+	if (sqe) {
+		sqe->opcode = IORING_OP_NOP;
+		sqe->user_data = 0;
+		if (file_uring_submit(ring))
+			sqe = NULL;
+	}
+	pthread_mutex_unlock(&ring->sq_lock);
+
+	if (sqe)
+		pthread_join(ring->reaper, NULL);
+	else
+		tcmu_thread_cancel(ring->reaper);
+
+	free(ring->cookies);
+	pthread_mutex_destroy(&ring->cookie_lock);
+	pthread_mutex_destroy(&ring->cq_lock);
+	pthread_mutex_destroy(&ring->sq_lock);
+	munmap(ring->sqes, ring->sqes_sz);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+	munmap(ring->sq_ring, ring->sq_ring_sz);
+	/* Closing the ring also drops the registered buffer */
+	close(ring->fd);
+	free(ring);
+	state->uring = NULL;
+}
+
+/*
+ * Async devices that could not set up a ring do their I/O inline from
+ * the calling context, since they have no worker threads.
+ */
+static int file_uring_read(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			   struct iovec *iov, size_t iov_cnt, size_t length,
+			   off_t offset)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+
+	if (!tcmur_dev_async_io(dev))
+		return file_read(dev, cmd, iov, iov_cnt, length, offset);
+
+	if (!state->uring) {
+		tcmur_cmd_complete(dev, cmd, file_read(dev, cmd, iov, iov_cnt,
+						       length, offset));
+		return TCMU_STS_OK;
+	}
+
+	return file_uring_queue(dev, cmd, FILE_URING_READ, iov, iov_cnt,
+				length, offset);
+}
+
+static int file_uring_write(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			    struct iovec *iov, size_t iov_cnt, size_t length,
+			    off_t offset)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+
+	if (!tcmur_dev_async_io(dev))
+		return file_write(dev, cmd, iov, iov_cnt, length, offset);
+
+	if (!state->uring) {
+		tcmur_cmd_complete(dev, cmd, file_write(dev, cmd, iov, iov_cnt,
+							length, offset));
+		return TCMU_STS_OK;
+	}
+
+	return file_uring_queue(dev, cmd, FILE_URING_WRITE, iov, iov_cnt,
+				length, offset);
+}
+
+static int file_uring_flush(struct tcmu_device *dev, struct tcmur_cmd *cmd)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+
+	if (!tcmur_dev_async_io(dev))
+		return file_flush(dev, cmd);
+
+	if (!state->uring) {
+		tcmur_cmd_complete(dev, cmd, file_flush(dev, cmd));
+		return TCMU_STS_OK;
+	}
+
+	return file_uring_queue(dev, cmd, FILE_URING_FLUSH, NULL, 0, 0, 0);
+}
+
+static int file_uring_unmap(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			    uint64_t off, uint64_t len)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+
+	if (!tcmur_dev_async_io(dev))
+		return file_unmap(dev, cmd, off, len);
+
+	if (!state->uring) {
+		tcmur_cmd_complete(dev, cmd, file_unmap(dev, cmd, off, len));
+		return TCMU_STS_OK;
+	}
+
+	return file_uring_queue(dev, cmd, FILE_URING_UNMAP, NULL, 0, len, off);
+}
+
+static int file_uring_write_zeroes(struct tcmu_device *dev,
+				   struct tcmur_cmd *cmd,
+				   uint64_t off, uint64_t len)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+
+	if (!tcmur_dev_async_io(dev))
+		return file_write_zeroes(dev, cmd, off, len);
+
+	if (!state->uring) {
+		tcmur_cmd_complete(dev, cmd, file_write_zeroes(dev, cmd, off,
+							       len));
+		return TCMU_STS_OK;
+	}
+
+	return file_uring_queue(dev, cmd, FILE_URING_ZERO, NULL, 0, len, off);
+}
+
+/*
+ * The tuples are a fraction of the data, so they are read and written
+ * inline instead of taking up ring slots.
+ */
+static int file_uring_read_pi(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			      struct tcmu_pi_tuple *pi, uint64_t lba,
+			      uint32_t nr_blocks)
+{
+	if (!tcmur_dev_async_io(dev))
+		return file_read_pi(dev, cmd, pi, lba, nr_blocks);
+
+	tcmur_cmd_complete(dev, cmd, file_read_pi(dev, cmd, pi, lba,
+						  nr_blocks));
+	return TCMU_STS_OK;
+}
+
+static int file_uring_write_pi(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			       const struct tcmu_pi_tuple *pi, uint64_t lba,
+			       uint32_t nr_blocks)
+{
+	if (!tcmur_dev_async_io(dev))
+		return file_write_pi(dev, cmd, pi, lba, nr_blocks);
+
+	tcmur_cmd_complete(dev, cmd, file_write_pi(dev, cmd, pi, lba,
+						   nr_blocks));
+	return TCMU_STS_OK;
+}
+
+/*
+ * Hole punching is a metadata update, so the ranges of one UNMAP are
+ * punched inline instead of being split up over the ring.
+ */
+static int file_uring_unmap_vec(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+				struct tcmur_unmap_range *ranges,
+				unsigned int nr_ranges)
+{
+	if (!tcmur_dev_async_io(dev))
+		return file_unmap_vec(dev, cmd, ranges, nr_ranges);
+
+	tcmur_cmd_complete(dev, cmd, file_unmap_vec(dev, cmd, ranges,
+						    nr_ranges));
+	return TCMU_STS_OK;
+}
+
+/* copy_file_range would block the cmdproc thread */
+static int file_uring_copy(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			   uint64_t src_off, uint64_t dst_off, uint64_t len)
+{
+	if (!tcmur_dev_async_io(dev))
+		return file_copy(dev, cmd, src_off, dst_off, len);
+
+	return TCMU_STS_NOT_HANDLED;
+}
+#endif /* HAVE_LINUX_IO_URING */
+
 static int file_reconfig(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
 {
 	switch (cfg->type) {
@@ -181,9 +1168,32 @@ static struct tcmur_handler file_handler = {
 
 	.open = file_open,
 	.close = file_close,
+#ifdef RWF_NOWAIT
+	.read_nowait = file_read_nowait,
+#endif
+#ifdef HAVE_LINUX_IO_URING
+	/* These pick the engine per device, see file_uring_read */
+	.read = file_uring_read,
+	.write = file_uring_write,
+	.flush = file_uring_flush,
+	.unmap = file_uring_unmap,
+	.unmap_vec = file_uring_unmap_vec,
+	.write_zeroes = file_uring_write_zeroes,
+	.copy = file_uring_copy,
+	.read_pi = file_uring_read_pi,
+	.write_pi = file_uring_write_pi,
+	.async_io = true,
+#else
 	.read = file_read,
 	.write = file_write,
 	.flush = file_flush,
+	.unmap = file_unmap,
+	.unmap_vec = file_unmap_vec,
+	.write_zeroes = file_write_zeroes,
+	.copy = file_copy,
+	.read_pi = file_read_pi,
+	.write_pi = file_write_pi,
+#endif
 	.name = "File-backed Handler (example code)",
 	.subtype = "file",
 	.nr_threads = 2,
@@ -73,8 +73,26 @@ struct fbo_state {
 	uint8_t async_cache_count;
 	pthread_mutex_t state_mtx;
 	int curr_handler;
+
+	/*
+	 * Background worker for immediate SYNCHRONIZE CACHE. Requests that
+	 * arrive while a sync is already pending are merged into it.
+	 * Protected by state_mtx.
+	 */
+	pthread_t sync_thread;
+	pthread_cond_t sync_cond;
+	bool sync_pending;
+	bool sync_stop;
+
+	/* Bounded buffer reused by verify, allocated on first use */
+	pthread_mutex_t verify_mtx;
+	uint8_t *verify_buf;
 };
 
+#define FBO_VERIFY_BUF_SIZE	(1024 * 1024)
+
+static void *fbo_sync_thread(void *arg);
+
 static void fbo_report_op_change(struct tcmu_device *dev, uint8_t code)
 {
 	struct fbo_state *state = tcmur_dev_get_private(dev);
@@ -166,12 +184,25 @@ static int fbo_open(struct tcmu_device *dev, bool reopen)
 	tcmu_dbg("FBO Open: fd %d\n", state->fd);
 
 	pthread_mutex_init(&state->state_mtx, NULL);
+	pthread_mutex_init(&state->verify_mtx, NULL);
+	pthread_cond_init(&state->sync_cond, NULL);
+
+	ret = pthread_create(&state->sync_thread, NULL, fbo_sync_thread, dev);
+	if (ret) {
+		tcmu_err("could not start sync thread: %d\n", ret);
+		goto destroy;
+	}
 
 	/* Record that we've changed our Operational state */
 	fbo_report_op_change(dev, 0x02);
 
 	return 0;
 
+destroy:
+	pthread_cond_destroy(&state->sync_cond);
+	pthread_mutex_destroy(&state->verify_mtx);
+	pthread_mutex_destroy(&state->state_mtx);
+	close(state->fd);
 err:
 	free(state);
 	return -EINVAL;
@@ -181,7 +212,17 @@ static void fbo_close(struct tcmu_device *dev)
 {
 	struct fbo_state *state = tcmur_dev_get_private(dev);
 
+	/* The worker runs a still pending sync before it exits */
+	pthread_mutex_lock(&state->state_mtx);
+	state->sync_stop = true;
+	pthread_cond_signal(&state->sync_cond);
+	pthread_mutex_unlock(&state->state_mtx);
+	pthread_join(state->sync_thread, NULL);
+
+	pthread_cond_destroy(&state->sync_cond);
+	pthread_mutex_destroy(&state->verify_mtx);
 	pthread_mutex_destroy(&state->state_mtx);
+	free(state->verify_buf);
 	close(state->fd);
 	free(state);
 }
@@ -998,7 +1039,7 @@ static int fbo_do_sync(struct fbo_state *state, uint8_t *sense)
 	return TCMU_STS_OK;
 }
 
-static void *fbo_async_sync_cache(void *arg)
+static void *fbo_sync_thread(void *arg)
 {
 	struct tcmu_device *dev = (struct tcmu_device *)arg;
 	struct fbo_state *state = tcmur_dev_get_private(dev);
@@ -1007,17 +1048,27 @@ static void *fbo_async_sync_cache(void *arg)
 	tcmu_set_thread_name("fbo-cache", dev);
 
 	pthread_mutex_lock(&state->state_mtx);
-	state->async_cache_count++;
-	state->flags |= FBO_BUSY_EVENT;
-	pthread_mutex_unlock(&state->state_mtx);
+	for (;;) {
+		while (!state->sync_pending && !state->sync_stop)
+			pthread_cond_wait(&state->sync_cond, &state->state_mtx);
+		if (!state->sync_pending)
+			break;
 
-	/* We don't do deferred sense data, so ignore errors */
-	(void)fbo_do_sync(state, sense);
+		/* Requests queued from here on need another sync */
+		state->sync_pending = false;
+		pthread_mutex_unlock(&state->state_mtx);
 
-	pthread_mutex_lock(&state->state_mtx);
-	state->async_cache_count--;
-	/* A Busy Event also applies when we go from "busy" to "not busy" */
-	state->flags |= FBO_BUSY_EVENT;
+		/* We don't do deferred sense data, so ignore errors */
+		(void)fbo_do_sync(state, sense);
+
+		pthread_mutex_lock(&state->state_mtx);
+		state->async_cache_count--;
+		/*
+		 * A Busy Event also applies when we go from "busy" to
+		 * "not busy"
+		 */
+		state->flags |= FBO_BUSY_EVENT;
+	}
 	pthread_mutex_unlock(&state->state_mtx);
 
 	return NULL;
@@ -1027,7 +1078,6 @@ static int fbo_synchronize_cache(struct tcmu_device *dev, uint8_t *cdb,
 				 uint8_t *sense)
 {
 	struct fbo_state *state = tcmur_dev_get_private(dev);
-	pthread_t thr;
 
 	// TBD: If we simulate start/stop, then fail if stopped
 	/* Reserved bit */
@@ -1036,7 +1086,14 @@ static int fbo_synchronize_cache(struct tcmu_device *dev, uint8_t *cdb,
 
 	if (cdb[1] & 0x02) {
 		/* Immediate Bit set */
-		pthread_create(&thr, NULL, fbo_async_sync_cache, dev);
+		pthread_mutex_lock(&state->state_mtx);
+		if (!state->sync_pending) {
+			state->sync_pending = true;
+			state->async_cache_count++;
+			state->flags |= FBO_BUSY_EVENT;
+			pthread_cond_signal(&state->sync_cond);
+		}
+		pthread_mutex_unlock(&state->state_mtx);
 
 		return TCMU_STS_OK;
 	}
@@ -1124,22 +1181,36 @@ static void fbo_cleanup_buffer(void *buf)
 	free(buf);
 }
 
+static void fbo_cleanup_verify(void *arg)
+{
+	struct fbo_state *state = arg;
+
+	pthread_mutex_unlock(&state->verify_mtx);
+}
+
+/*
+ * Compare the data at offset with the iovec, reading it into a bounded
+ * buffer one chunk at a time so large verifies use constant memory.
+ */
 static int fbo_do_verify(struct fbo_state *state, struct iovec *iovec,
 			 size_t iov_cnt, uint64_t offset, int length,
 			 uint8_t *sense)
 {
 	ssize_t ret;
-	uint32_t cmp_offset;
-	void *buf;
+	off_t cmp_offset;
 	int rc = TCMU_STS_OK;
-	int remaining;
+	int remaining, done = 0;
 
-	buf = malloc(length);
-	if (!buf)
-		return TCMU_STS_NO_RESOURCE;
+	pthread_mutex_lock(&state->verify_mtx);
+	pthread_cleanup_push(fbo_cleanup_verify, state);
 
-	pthread_cleanup_push(fbo_cleanup_buffer, buf);
-	memset(buf, 0, length);
+	if (!state->verify_buf) {
+		state->verify_buf = malloc(FBO_VERIFY_BUF_SIZE);
+		if (!state->verify_buf) {
+			rc = TCMU_STS_NO_RESOURCE;
+			goto unlock;
+		}
+	}
 
 	pthread_mutex_lock(&state->state_mtx);
 	state->cur_lba = offset / state->block_size;
@@ -1149,22 +1220,27 @@ static int fbo_do_verify(struct fbo_state *state, struct iovec *iovec,
 	remaining = length;
 
 	while (remaining) {
-		ret = pread(state->fd, buf, remaining, offset);
-		if (ret < 0) {
-			tcmu_err("read failed: %m\n");
+		ret = pread(state->fd, state->verify_buf,
+			    min(remaining, FBO_VERIFY_BUF_SIZE), offset);
+		if (ret <= 0) {
+			if (ret < 0)
+				tcmu_err("read failed: %m\n");
+			else
+				tcmu_err("read failed: unexpected end of file\n");
 			rc = TCMU_STS_RD_ERR;
 			break;
 		}
 
-		cmp_offset = tcmu_iovec_compare(buf, iovec, ret);
+		cmp_offset = tcmu_iovec_compare(state->verify_buf, iovec, ret);
 		if (cmp_offset != -1) {
 			rc = TCMU_STS_MISCOMPARE;
-			tcmu_sense_set_info(sense, cmp_offset);
+			tcmu_sense_set_info(sense, done + cmp_offset);
 			break;
 		}
 		tcmu_iovec_seek(iovec, ret);
 
 		offset += ret;
+		done += ret;
 		remaining -= ret;
 	}
 
@@ -1172,8 +1248,8 @@ static int fbo_do_verify(struct fbo_state *state, struct iovec *iovec,
 	state->flags &= ~FBO_DEV_IO;
 	pthread_mutex_unlock(&state->state_mtx);
 
-	free(buf);
-	pthread_cleanup_pop(0);
+unlock:
+	pthread_cleanup_pop(1);
 
 	return rc;
 }
@@ -17,11 +17,14 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <endian.h>
 #include <errno.h>
@@ -97,6 +100,11 @@ enum zbc_zone_cond {
 	ZBC_ZONE_COND_OFFLINE	= 0xF,
 };
 
+#define ZBC_NR_ZONE_COND	(ZBC_ZONE_COND_OFFLINE + 1)
+#define ZBC_COND_MASK(c)	(1U << (c))
+#define ZBC_OPEN_COND_MASK	(ZBC_COND_MASK(ZBC_ZONE_COND_IMP_OPEN) | \
+				 ZBC_COND_MASK(ZBC_ZONE_COND_EXP_OPEN))
+
 /*
  * Metadata zone descriptor.
  */
@@ -256,6 +264,10 @@ struct zbc_dev_config {
 #define ZBC_CONF_DEFAULT_CONV_NUM	(unsigned int)(-1)
 #define ZBC_CONF_DEFAULT_OPEN_NUM	128
 
+#define ZBC_BITS_PER_LONG		(8 * sizeof(unsigned long))
+#define ZBC_BITMAP_WORDS(nr_bits)	\
+	(((nr_bits) + ZBC_BITS_PER_LONG - 1) / ZBC_BITS_PER_LONG)
+
 /*
  * Emulated device descriptor private data.
  */
@@ -282,6 +294,30 @@ struct zbc_dev {
 	unsigned int		nr_imp_open;
 	unsigned int		nr_exp_open;
 
+	/*
+	 * Zone conditions, write pointers and the open zone counters are
+	 * protected by zone_state_lock. Writes, finish and reset also hold
+	 * the lock of each zone they touch, taken in ascending zone order,
+	 * for the whole operation so that IOs to different zones can run in
+	 * parallel while those to the same zone are serialized.
+	 */
+	pthread_mutex_t		zone_state_lock;
+	pthread_mutex_t		*zone_locks;
+
+	/*
+	 * Bitmaps of the zones in each condition and number of zones in
+	 * each condition, so that reports and zone resource checks do not
+	 * need to scan all zones. Also protected by zone_state_lock.
+	 */
+	unsigned long		*cond_maps;
+	size_t			map_words;
+	unsigned int		nr_cond[ZBC_NR_ZONE_COND];
+
+	/* Metadata pages modified since the last flush */
+	unsigned long		*dirty_map;
+	size_t			page_size;
+	size_t			nr_meta_pages;
+
 };
 
 static char *zbc_parse_model(char *val, struct zbc_dev_config *cfg, char **msg)
@@ -489,6 +525,24 @@ static int zbc_map_meta(struct zbc_dev *zdev)
 
 	zdev->zones = (struct zbc_zone *)(zdev->meta + 1);
 
+	/* Zone condition index and dirty metadata pages */
+	zdev->map_words = ZBC_BITMAP_WORDS(zdev->nr_zones);
+	zdev->cond_maps = calloc(ZBC_NR_ZONE_COND * zdev->map_words,
+				 sizeof(unsigned long));
+	zdev->page_size = sysconf(_SC_PAGESIZE);
+	zdev->nr_meta_pages = (zdev->meta_size + zdev->page_size - 1) /
+		zdev->page_size;
+	zdev->dirty_map = calloc(ZBC_BITMAP_WORDS(zdev->nr_meta_pages),
+				 sizeof(unsigned long));
+	if (!zdev->cond_maps || !zdev->dirty_map) {
+		free(zdev->cond_maps);
+		free(zdev->dirty_map);
+		zdev->cond_maps = zdev->dirty_map = NULL;
+		munmap(zdev->meta, zdev->meta_size);
+		zdev->meta = NULL;
+		return -ENOMEM;
+	}
+
 	tcmu_dev_dbg(zdev->dev, "Mapped %zu B of metadata at %p\n",
 		     zdev->meta_size, zdev->meta);
 
@@ -504,16 +558,200 @@ static void zbc_unmap_meta(struct zbc_dev *zdev)
 		munmap(zdev->meta, zdev->meta_size);
 		zdev->meta = NULL;
 	}
+
+	free(zdev->cond_maps);
+	zdev->cond_maps = NULL;
+	free(zdev->dirty_map);
+	zdev->dirty_map = NULL;
+}
+
+static inline bool zbc_test_bit(const unsigned long *map, size_t bit)
+{
+	return map[bit / ZBC_BITS_PER_LONG] & (1UL << (bit % ZBC_BITS_PER_LONG));
+}
+
+static inline void zbc_set_bit(unsigned long *map, size_t bit)
+{
+	map[bit / ZBC_BITS_PER_LONG] |= 1UL << (bit % ZBC_BITS_PER_LONG);
+}
+
+static inline void zbc_clear_bit(unsigned long *map, size_t bit)
+{
+	map[bit / ZBC_BITS_PER_LONG] &= ~(1UL << (bit % ZBC_BITS_PER_LONG));
 }
 
 /*
- * Flush metadata.
+ * Return the first bit set at or after start, or nr_bits if there is none.
  */
-static int zbc_flush_meta(struct zbc_dev *zdev)
+static size_t zbc_next_bit(const unsigned long *map, size_t nr_bits,
+			   size_t start)
 {
+	size_t i = start / ZBC_BITS_PER_LONG;
+	unsigned long word;
+
+	if (start >= nr_bits)
+		return nr_bits;
+
+	word = map[i] & (~0UL << (start % ZBC_BITS_PER_LONG));
+	while (!word) {
+		if (++i >= ZBC_BITMAP_WORDS(nr_bits))
+			return nr_bits;
+		word = map[i];
+	}
+
+	start = i * ZBC_BITS_PER_LONG + __builtin_ctzl(word);
+	return start < nr_bits ? start : nr_bits;
+}
+
+/*
+ * Return the number of bits set at or after start.
+ */
+static size_t zbc_count_bits(const unsigned long *map, size_t nr_bits,
+			     size_t start)
+{
+	size_t i = start / ZBC_BITS_PER_LONG;
+	size_t count;
+
+	if (start >= nr_bits)
+		return 0;
+
+	count = __builtin_popcountl(map[i] &
+				    (~0UL << (start % ZBC_BITS_PER_LONG)));
+	for (i++; i < ZBC_BITMAP_WORDS(nr_bits); i++)
+		count += __builtin_popcountl(map[i]);
+
+	return count;
+}
+
+static inline unsigned long *zbc_cond_map(struct zbc_dev *zdev,
+					  unsigned int cond)
+{
+	return zdev->cond_maps + cond * zdev->map_words;
+}
+
+/*
+ * Return the first zone at or after zno with a condition in cond_mask,
+ * or nr_zones if there is none.
+ */
+static unsigned int zbc_next_zone(struct zbc_dev *zdev, unsigned int zno,
+				  uint32_t cond_mask)
+{
+	unsigned int cond, next = zdev->nr_zones;
+
+	for (cond = 0; cond < ZBC_NR_ZONE_COND; cond++) {
+		if (!(cond_mask & ZBC_COND_MASK(cond)) || !zdev->nr_cond[cond])
+			continue;
+		next = min(next, (unsigned int)zbc_next_bit(zbc_cond_map(zdev, cond),
+							     next, zno));
+	}
+
+	return next;
+}
+
+/*
+ * Mark the metadata page(s) of a zone descriptor dirty.
+ */
+static void zbc_dirty_zone(struct zbc_dev *zdev, struct zbc_zone *zone)
+{
+	size_t start = (uint8_t *)zone - (uint8_t *)zdev->meta;
+
+	zbc_set_bit(zdev->dirty_map, start / zdev->page_size);
+	zbc_set_bit(zdev->dirty_map,
+		    (start + sizeof(*zone) - 1) / zdev->page_size);
+}
+
+/*
+ * Change the condition of a zone. Called with zone_state_lock held.
+ */
+static void zbc_set_cond(struct zbc_dev *zdev, struct zbc_zone *zone,
+			 enum zbc_zone_cond cond)
+{
+	unsigned int zno = zone - zdev->zones;
+
+	if (zone->cond == cond)
+		return;
+
+	zbc_clear_bit(zbc_cond_map(zdev, zone->cond), zno);
+	zdev->nr_cond[zone->cond]--;
+	zbc_set_bit(zbc_cond_map(zdev, cond), zno);
+	zdev->nr_cond[cond]++;
+
+	zone->cond = cond;
+	zbc_dirty_zone(zdev, zone);
+}
+
+/*
+ * Set a zone write pointer. Called with zone_state_lock held, but reads
+ * sample it without the lock.
+ */
+static inline void zbc_set_wp(struct zbc_dev *zdev, struct zbc_zone *zone,
+			      uint64_t wp)
+{
+	__atomic_store_n(&zone->wp, wp, __ATOMIC_RELEASE);
+	zbc_dirty_zone(zdev, zone);
+}
+
+/*
+ * Build the zone condition index from the zone descriptors.
+ */
+static void zbc_index_zones(struct zbc_dev *zdev)
+{
+	unsigned int i;
+
+	memset(zdev->cond_maps, 0,
+	       ZBC_NR_ZONE_COND * zdev->map_words * sizeof(unsigned long));
+	memset(zdev->nr_cond, 0, sizeof(zdev->nr_cond));
+
+	for (i = 0; i < zdev->nr_zones; i++) {
+		zbc_set_bit(zbc_cond_map(zdev, zdev->zones[i].cond), i);
+		zdev->nr_cond[zdev->zones[i].cond]++;
+	}
+}
+
+/*
+ * Allocate and initialize the per zone locks.
+ */
+static int zbc_init_zone_locks(struct zbc_dev *zdev)
+{
+	unsigned int i;
+
+	zdev->zone_locks = calloc(zdev->nr_zones, sizeof(pthread_mutex_t));
+	if (!zdev->zone_locks)
+		return -ENOMEM;
+
+	for (i = 0; i < zdev->nr_zones; i++)
+		pthread_mutex_init(&zdev->zone_locks[i], NULL);
+
+	return 0;
+}
+
+/*
+ * Free the per zone locks.
+ */
+static void zbc_free_zone_locks(struct zbc_dev *zdev)
+{
+	unsigned int i;
+
+	if (!zdev->zone_locks)
+		return;
+
+	for (i = 0; i < zdev->nr_zones; i++)
+		pthread_mutex_destroy(&zdev->zone_locks[i]);
+	free(zdev->zone_locks);
+	zdev->zone_locks = NULL;
+}
+
+/*
+ * Write back a range of metadata pages.
+ */
+static int __zbc_sync_meta(struct zbc_dev *zdev, size_t first, size_t last)
+{
+	size_t start = first * zdev->page_size;
+	size_t end = min(last * zdev->page_size, zdev->meta_size);
 	int ret;
 
-	ret = msync(zdev->meta, zdev->meta_size, MS_SYNC | MS_INVALIDATE);
+	ret = msync((uint8_t *)zdev->meta + start, end - start,
+		    MS_SYNC | MS_INVALIDATE);
 	if (ret) {
 		ret = -errno;
 		tcmu_dev_err(zdev->dev, "msync metadata failed (%m)\n");
@@ -523,6 +761,45 @@ static int zbc_flush_meta(struct zbc_dev *zdev)
 	return 0;
 }
 
+/*
+ * Flush metadata. Only the pages modified since the last flush are
+ * written back, each run of dirty pages with a single msync.
+ */
+static int zbc_flush_meta(struct zbc_dev *zdev)
+{
+	size_t first = 0, last, i;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&zdev->zone_state_lock);
+
+		first = zbc_next_bit(zdev->dirty_map, zdev->nr_meta_pages,
+				     first);
+		for (last = first; last < zdev->nr_meta_pages; last++) {
+			if (!zbc_test_bit(zdev->dirty_map, last))
+				break;
+			zbc_clear_bit(zdev->dirty_map, last);
+		}
+
+		pthread_mutex_unlock(&zdev->zone_state_lock);
+
+		if (first == last)
+			return 0;
+
+		ret = __zbc_sync_meta(zdev, first, last);
+		if (ret) {
+			/* Make sure the pages are written by the next flush */
+			pthread_mutex_lock(&zdev->zone_state_lock);
+			for (i = first; i < last; i++)
+				zbc_set_bit(zdev->dirty_map, i);
+			pthread_mutex_unlock(&zdev->zone_state_lock);
+			return ret;
+		}
+
+		first = last;
+	}
+}
+
 /*
  * Check a zone metadata.
  */
@@ -556,6 +833,9 @@ static bool zbc_check_zone(struct zbc_dev *zdev,
 	if (zbc_zone_conv(&zone) && zone.cond != ZBC_ZONE_COND_NOT_WP)
 		return false;
 
+	if (zone.cond >= ZBC_NR_ZONE_COND)
+		return false;
+
 	if (zone.start % meta->zone_size ||
 	    zone.len > meta->zone_size)
 		return false;
@@ -731,7 +1011,9 @@ static int zbc_format_meta(struct zbc_dev *zdev)
 
 	}
 
-	ret = zbc_flush_meta(zdev);
+	zbc_index_zones(zdev);
+
+	ret = __zbc_sync_meta(zdev, 0, zdev->nr_meta_pages);
 	if (ret) {
 		zbc_unmap_meta(zdev);
 		return ret;
@@ -756,6 +1038,8 @@ static int zbc_init_meta(struct zbc_dev *zdev)
 	if (ret)
 		return ret;
 
+	zbc_index_zones(zdev);
+
 	/* Close all zones */
 	zone = zdev->zones;
 	for (i = 0; i < zdev->nr_zones; i++) {
@@ -812,6 +1096,12 @@ static int zbc_open_backstore(struct tcmu_device *dev)
 	if (ret)
 		goto err;
 
+	ret = zbc_init_zone_locks(zdev);
+	if (ret) {
+		zbc_unmap_meta(zdev);
+		goto err;
+	}
+
 	tcmu_dev_set_block_size(dev, zdev->lba_size);
 	tcmu_dev_set_num_lbas(dev, zdev->capacity);
 
@@ -876,6 +1166,7 @@ static int zbc_open(struct tcmu_device *dev, bool reopen)
 
 	tcmur_dev_set_private(dev, zdev);
 	zdev->dev = dev;
+	pthread_mutex_init(&zdev->zone_state_lock, NULL);
 
 	/* Parse config */
 	if (!zbc_parse_config(tcmu_dev_get_cfgstring(dev), &zdev->cfg, &err)) {
@@ -902,6 +1193,7 @@ static int zbc_open(struct tcmu_device *dev, bool reopen)
 	return 0;
 
 err:
+	pthread_mutex_destroy(&zdev->zone_state_lock);
 	free(zdev->cfg.path);
 	free(zdev);
 	return ret;
@@ -915,8 +1207,10 @@ static void zbc_close(struct tcmu_device *dev)
 	struct zbc_dev *zdev = tcmur_dev_get_private(dev);
 
 	zbc_unmap_meta(zdev);
+	zbc_free_zone_locks(zdev);
 
 	close(zdev->fd);
+	pthread_mutex_destroy(&zdev->zone_state_lock);
 	free(zdev->cfg.path);
 	free(zdev);
 }
@@ -1211,6 +1505,55 @@ static struct zbc_zone *zbc_get_zone(struct zbc_dev *zdev, uint64_t lba,
 	return zone;
 }
 
+/*
+ * Lock the zones first to last, in ascending order.
+ */
+static void zbc_lock_zones(struct zbc_dev *zdev, unsigned int first,
+			   unsigned int last)
+{
+	unsigned int i;
+
+	for (i = first; i <= last; i++)
+		pthread_mutex_lock(&zdev->zone_locks[i]);
+}
+
+static void zbc_unlock_zones(struct zbc_dev *zdev, unsigned int first,
+			     unsigned int last)
+{
+	unsigned int i;
+
+	for (i = last + 1; i > first; i--)
+		pthread_mutex_unlock(&zdev->zone_locks[i - 1]);
+}
+
+/*
+ * Call fn for each zone in one of the conditions of cond_mask, with the
+ * zone lock and zone_state_lock held. fn must check the zone condition
+ * again since it may change before the zone is locked.
+ */
+static void zbc_for_each_zone(struct zbc_dev *zdev, uint32_t cond_mask,
+			      void (*fn)(struct zbc_dev *zdev,
+					 struct zbc_zone *zone))
+{
+	unsigned int zno = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&zdev->zone_state_lock);
+		zno = zbc_next_zone(zdev, zno, cond_mask);
+		pthread_mutex_unlock(&zdev->zone_state_lock);
+		if (zno >= zdev->nr_zones)
+			return;
+
+		zbc_lock_zones(zdev, zno, zno);
+		pthread_mutex_lock(&zdev->zone_state_lock);
+		fn(zdev, &zdev->zones[zno]);
+		pthread_mutex_unlock(&zdev->zone_state_lock);
+		zbc_unlock_zones(zdev, zno, zno);
+
+		zno++;
+	}
+}
+
 /*
  * Test if a zone must be reported.
  */
@@ -1247,6 +1590,78 @@ static bool zbc_should_report_zone(struct zbc_zone *zone,
 	}
 }
 
+/*
+ * Return the zone condition selected by a reporting option, or -1 if the
+ * zones to report cannot be found with the zone condition index.
+ */
+static int zbc_report_cond(enum zbc_reporting_options ro)
+{
+	switch (ro) {
+	case ZBC_RO_EMPTY:
+		return ZBC_ZONE_COND_EMPTY;
+	case ZBC_RO_IMP_OPEN:
+		return ZBC_ZONE_COND_IMP_OPEN;
+	case ZBC_RO_EXP_OPEN:
+		return ZBC_ZONE_COND_EXP_OPEN;
+	case ZBC_RO_CLOSED:
+		return ZBC_ZONE_COND_CLOSED;
+	case ZBC_RO_FULL:
+		return ZBC_ZONE_COND_FULL;
+	case ZBC_RO_READONLY:
+		return ZBC_ZONE_COND_READONLY;
+	case ZBC_RO_OFFLINE:
+		return ZBC_ZONE_COND_OFFLINE;
+	case ZBC_RO_NOT_WP:
+		return ZBC_ZONE_COND_NOT_WP;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Return the first zone at or after zno to report, or nr_zones if
+ * there is none.
+ */
+static unsigned int zbc_next_report_zone(struct zbc_dev *zdev,
+					 unsigned int zno, uint8_t ro, int cond)
+{
+	if (cond >= 0)
+		return zbc_next_zone(zdev, zno, ZBC_COND_MASK(cond));
+
+	while (zno < zdev->nr_zones &&
+	       !zbc_should_report_zone(&zdev->zones[zno], ro))
+		zno++;
+
+	return zno;
+}
+
+/*
+ * Count the zones at or after zno to report, up to max.
+ */
+static unsigned int zbc_count_report_zones(struct zbc_dev *zdev,
+					   unsigned int zno, uint8_t ro,
+					   int cond, unsigned int max)
+{
+	unsigned int count = 0;
+
+	if (cond >= 0) {
+		if (!zno)
+			count = zdev->nr_cond[cond];
+		else
+			count = zbc_count_bits(zbc_cond_map(zdev, cond),
+					       zdev->nr_zones, zno);
+	} else if (ro == ZBC_RO_ALL) {
+		count = zdev->nr_zones - zno;
+	} else {
+		for (zno = zbc_next_report_zone(zdev, zno, ro, cond);
+		     zno < zdev->nr_zones && count < max;
+		     zno = zbc_next_report_zone(zdev, zno + 1, ro, cond))
+			count++;
+	}
+
+	return min(count, max);
+}
+
 /*
  * Report zones command emulation.
  */
@@ -1259,11 +1674,13 @@ static int zbc_report_zones(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	size_t iov_cnt = cmd->iov_cnt;
 	bool partial = cdb[14] & ZBC_RO_PARTIAL;
 	uint8_t ro = cdb[14] & (~ZBC_RO_PARTIAL);
-	unsigned int nr_zones = 0;
+	unsigned int nr_zones, max_zones = UINT_MAX;
+	unsigned int zno, start_zno;
 	uint8_t data[64];
 	uint32_t val32;
 	uint64_t lba, val64;
 	size_t len;
+	int cond;
 
 	/* Check reporting option */
 	switch (ro) {
@@ -1291,29 +1708,20 @@ static int zbc_report_zones(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 					   ILLEGAL_REQUEST,
 					   ASC_LBA_OUT_OF_RANGE);
 
-	/* First pass: count zones */
-	len = tcmu_cdb_get_xfer_length(cdb);
-	if (len > 64)
-		len -= 64;
-	else
-		len = 0;
-	zone = zbc_get_zone(zdev, lba, false);
-	while (lba < zdev->capacity) {
+	start_zno = lba / zdev->zone_size;
+	cond = zbc_report_cond(ro);
 
-		if (zbc_should_report_zone(zone, ro)) {
-			if (partial && len < 64)
-				break;
-			if (len > 64)
-				len -= 64;
-			else
-				len = 0;
-			nr_zones++;
-		}
+	/* A partial report only counts the zones that fit */
+	if (partial) {
+		len = tcmu_cdb_get_xfer_length(cdb);
+		max_zones = len > 64 ? (len - 64) / 64 : 0;
+	}
 
-		lba = zone->start + zone->len;
-		zone++;
+	pthread_mutex_lock(&zdev->zone_state_lock);
 
-	}
+	/* Count zones */
+	nr_zones = zbc_count_report_zones(zdev, start_zno, ro, cond,
+					  max_zones);
 
 	/* Setup report header */
 	memset(data, 0, sizeof(data));
@@ -1325,37 +1733,33 @@ static int zbc_report_zones(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	if (len < 64)
 		goto out;
 
-	/* Second pass: get zone information */
+	/* Get zone information */
 	len = tcmu_iovec_length(iovec, iov_cnt);
-	lba = tcmu_cdb_get_lba(cdb);
-	zone = zbc_get_zone(zdev, lba, false);
-	while (lba < zdev->capacity && len >= 64) {
-
-		if (zbc_should_report_zone(zone, ro)) {
-
-			memset(data, 0, sizeof(data));
-			data[0] = zone->type & 0x0f;
-			data[1] = (zone->cond << 4) & 0xf0;
-			if (zone->reset)
-				data[1] |= 0x01;
-			if (zone->non_seq)
-				data[1] |= 0x02;
-			val64 = htobe64(zone->len);
-			memcpy(&data[8], &val64, 8);
-			val64 = htobe64(zone->start);
-			memcpy(&data[16], &val64, 8);
-			val64 = htobe64(zone->wp);
-			memcpy(&data[24], &val64, 8);
-
-			tcmu_memcpy_into_iovec(iovec, iov_cnt, data, 64);
-			len -= 64;
-		}
+	for (zno = zbc_next_report_zone(zdev, start_zno, ro, cond);
+	     zno < zdev->nr_zones && len >= 64;
+	     zno = zbc_next_report_zone(zdev, zno + 1, ro, cond)) {
+
+		zone = &zdev->zones[zno];
+		memset(data, 0, sizeof(data));
+		data[0] = zone->type & 0x0f;
+		data[1] = (zone->cond << 4) & 0xf0;
+		if (zone->reset)
+			data[1] |= 0x01;
+		if (zone->non_seq)
+			data[1] |= 0x02;
+		val64 = htobe64(zone->len);
+		memcpy(&data[8], &val64, 8);
+		val64 = htobe64(zone->start);
+		memcpy(&data[16], &val64, 8);
+		val64 = htobe64(zone->wp);
+		memcpy(&data[24], &val64, 8);
 
-		lba = zone->start + zone->len;
-		zone++;
+		tcmu_memcpy_into_iovec(iovec, iov_cnt, data, 64);
+		len -= 64;
 	}
 
 out:
+	pthread_mutex_unlock(&zdev->zone_state_lock);
 	return TCMU_STS_OK;
 }
 
@@ -1377,9 +1781,9 @@ static void __zbc_close_zone(struct zbc_dev *zdev, struct zbc_zone *zone)
 		zdev->nr_exp_open--;
 
 	if (zone->wp == zone->start)
-		zone->cond = ZBC_ZONE_COND_EMPTY;
+		zbc_set_cond(zdev, zone, ZBC_ZONE_COND_EMPTY);
 	else
-		zone->cond = ZBC_ZONE_COND_CLOSED;
+		zbc_set_cond(zdev, zone, ZBC_ZONE_COND_CLOSED);
 }
 
 /*
@@ -1387,14 +1791,30 @@ static void __zbc_close_zone(struct zbc_dev *zdev, struct zbc_zone *zone)
  */
 static void __zbc_close_imp_open_zone(struct zbc_dev *zdev)
 {
-	int i;
+	unsigned long *map = zbc_cond_map(zdev, ZBC_ZONE_COND_IMP_OPEN);
+	struct zbc_zone *victim = NULL;
+	unsigned int i;
 
-	for (i = 0; i < zdev->nr_zones; i++) {
-		if (zbc_zone_imp_open(&zdev->zones[i])) {
+	for (i = zbc_next_bit(map, zdev->nr_zones, 0); i < zdev->nr_zones;
+	     i = zbc_next_bit(map, zdev->nr_zones, i + 1)) {
+
+		/*
+		 * Prefer a zone without a write in flight. Only trylock
+		 * here since zone locks are normally taken before
+		 * zone_state_lock.
+		 */
+		if (!pthread_mutex_trylock(&zdev->zone_locks[i])) {
 			__zbc_close_zone(zdev, &zdev->zones[i]);
+			pthread_mutex_unlock(&zdev->zone_locks[i]);
 			return;
 		}
+
+		if (!victim)
+			victim = &zdev->zones[i];
 	}
+
+	if (victim)
+		__zbc_close_zone(zdev, victim);
 }
 
 /*
@@ -1413,12 +1833,12 @@ static void __zbc_open_zone(struct zbc_dev *zdev, struct zbc_zone *zone,
 		__zbc_close_imp_open_zone(zdev);
 
 	if (explicit) {
-		zone->cond = ZBC_ZONE_COND_EXP_OPEN;
+		zbc_set_cond(zdev, zone, ZBC_ZONE_COND_EXP_OPEN);
 		zdev->nr_exp_open++;
 		return;
 	}
 
-	zone->cond = ZBC_ZONE_COND_IMP_OPEN;
+	zbc_set_cond(zdev, zone, ZBC_ZONE_COND_IMP_OPEN);
 	zdev->nr_imp_open++;
 }
 
@@ -1431,30 +1851,31 @@ static int zbc_open_zone(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	struct zbc_zone *zone;
 	uint8_t *cdb = cmd->cdb;
 	bool all = cdb[14] & 0x01;
+	int ret = TCMU_STS_OK;
 	uint64_t lba;
 	int i;
 
 	if (all) {
-		unsigned int nr_closed = 0;
+		uint32_t closed = ZBC_COND_MASK(ZBC_ZONE_COND_CLOSED);
+		unsigned int nr_closed;
+
+		pthread_mutex_lock(&zdev->zone_state_lock);
 
 		/* Check if all closed zones can be open */
-		for (i = 0; i < zdev->nr_zones; i++) {
-			if (zbc_zone_closed(&zdev->zones[i]))
-				nr_closed++;
+		nr_closed = zdev->nr_cond[ZBC_ZONE_COND_CLOSED];
+		if ((zdev->nr_exp_open + nr_closed) > zdev->nr_open_zones) {
+			ret = tcmu_sense_set_data(cmd->sense_buf,
+					DATA_PROTECT,
+					ASC_INSUFFICIENT_ZONE_RESOURCES);
+			goto unlock;
 		}
 
-		if ((zdev->nr_exp_open + nr_closed) > zdev->nr_open_zones)
-			return tcmu_sense_set_data(cmd->sense_buf,
-					   DATA_PROTECT,
-					   ASC_INSUFFICIENT_ZONE_RESOURCES);
-
 		/* Open all closed zones */
-		for (i = 0; i < zdev->nr_zones; i++) {
-			if (zbc_zone_closed(&zdev->zones[i]))
-				__zbc_open_zone(zdev, &zdev->zones[i], true);
-		}
+		for (i = zbc_next_zone(zdev, 0, closed); i < zdev->nr_zones;
+		     i = zbc_next_zone(zdev, i + 1, closed))
+			__zbc_open_zone(zdev, &zdev->zones[i], true);
 
-		return TCMU_STS_OK;
+		goto unlock;
 	}
 
 	/* Open the specified zone */
@@ -1470,20 +1891,26 @@ static int zbc_open_zone(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 					   ILLEGAL_REQUEST,
 					   ASC_INVALID_FIELD_IN_CDB);
 
+	pthread_mutex_lock(&zdev->zone_state_lock);
+
 	if (zbc_zone_exp_open(zone) || zbc_zone_full(zone))
-		return TCMU_STS_OK;
+		goto unlock;
 
-	if ((zdev->nr_exp_open + 1) > zdev->nr_open_zones)
-		return tcmu_sense_set_data(cmd->sense_buf,
-					   DATA_PROTECT,
-					   ASC_INSUFFICIENT_ZONE_RESOURCES);
+	if ((zdev->nr_exp_open + 1) > zdev->nr_open_zones) {
+		ret = tcmu_sense_set_data(cmd->sense_buf,
+					  DATA_PROTECT,
+					  ASC_INSUFFICIENT_ZONE_RESOURCES);
+		goto unlock;
+	}
 
 	if (zbc_zone_imp_open(zone))
 		__zbc_close_zone(zdev, zone);
 
 	__zbc_open_zone(zdev, zone, true);
 
-	return TCMU_STS_OK;
+unlock:
+	pthread_mutex_unlock(&zdev->zone_state_lock);
+	return ret;
 }
 
 /*
@@ -1500,8 +1927,12 @@ static int zbc_close_zone(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 
 	if (all) {
 		/* Close all open zones */
-		for (i = 0; i < zdev->nr_zones; i++)
+		pthread_mutex_lock(&zdev->zone_state_lock);
+		for (i = zbc_next_zone(zdev, 0, ZBC_OPEN_COND_MASK);
+		     i < zdev->nr_zones;
+		     i = zbc_next_zone(zdev, i + 1, ZBC_OPEN_COND_MASK))
 			__zbc_close_zone(zdev, &zdev->zones[i]);
+		pthread_mutex_unlock(&zdev->zone_state_lock);
 		return TCMU_STS_OK;
 	}
 
@@ -1518,7 +1949,9 @@ static int zbc_close_zone(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 					   ILLEGAL_REQUEST,
 					   ASC_INVALID_FIELD_IN_CDB);
 
+	pthread_mutex_lock(&zdev->zone_state_lock);
 	__zbc_close_zone(zdev, zone);
+	pthread_mutex_unlock(&zdev->zone_state_lock);
 
 	return TCMU_STS_OK;
 }
@@ -1540,14 +1973,19 @@ static void __zbc_finish_zone(struct zbc_dev *zdev, struct zbc_zone *zone,
 		if (zbc_zone_is_open(zone))
 			__zbc_close_zone(zdev, zone);
 
-		zone->wp = zone->start + zone->len;
-		zone->cond = ZBC_ZONE_COND_FULL;
+		zbc_set_wp(zdev, zone, zone->start + zone->len);
+		zbc_set_cond(zdev, zone, ZBC_ZONE_COND_FULL);
 		zone->non_seq = 0;
 		zone->reset = 0;
 
 	}
 }
 
+static void __zbc_finish_all_zone(struct zbc_dev *zdev, struct zbc_zone *zone)
+{
+	__zbc_finish_zone(zdev, zone, false);
+}
+
 /*
  * Finish zone command emulation.
  */
@@ -1561,9 +1999,10 @@ static int zbc_finish_zone(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	int i;
 
 	if (all) {
-		/* Finish all zones */
-		for (i = 0; i < zdev->nr_zones; i++)
-			__zbc_finish_zone(zdev, &zdev->zones[i], false);
+		/* Finish all closed and open zones */
+		zbc_for_each_zone(zdev, ZBC_OPEN_COND_MASK |
+				  ZBC_COND_MASK(ZBC_ZONE_COND_CLOSED),
+				  __zbc_finish_all_zone);
 		return TCMU_STS_OK;
 	}
 
@@ -1580,7 +2019,12 @@ static int zbc_finish_zone(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 					   ILLEGAL_REQUEST,
 					   ASC_INVALID_FIELD_IN_CDB);
 
+	i = zone - zdev->zones;
+	zbc_lock_zones(zdev, i, i);
+	pthread_mutex_lock(&zdev->zone_state_lock);
 	__zbc_finish_zone(zdev, zone, true);
+	pthread_mutex_unlock(&zdev->zone_state_lock);
+	zbc_unlock_zones(zdev, i, i);
 
 	return TCMU_STS_OK;
 }
@@ -1597,8 +2041,8 @@ static void __zbc_reset_wp(struct zbc_dev *zdev, struct zbc_zone *zone)
 	if (zbc_zone_is_open(zone))
 		__zbc_close_zone(zdev, zone);
 
-	zone->wp = zone->start;
-	zone->cond = ZBC_ZONE_COND_EMPTY;
+	zbc_set_wp(zdev, zone, zone->start);
+	zbc_set_cond(zdev, zone, ZBC_ZONE_COND_EMPTY);
 	zone->non_seq = 0;
 	zone->reset = 0;
 }
@@ -1616,9 +2060,10 @@ static int zbc_reset_wp(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	int i;
 
 	if (all) {
-		/* Reset all zones */
-		for (i = 0; i < zdev->nr_zones; i++)
-			__zbc_reset_wp(zdev, &zdev->zones[i]);
+		/* Reset all zones that are not empty */
+		zbc_for_each_zone(zdev, ~(ZBC_COND_MASK(ZBC_ZONE_COND_NOT_WP) |
+					  ZBC_COND_MASK(ZBC_ZONE_COND_EMPTY)),
+				  __zbc_reset_wp);
 		return TCMU_STS_OK;
 	}
 
@@ -1635,7 +2080,12 @@ static int zbc_reset_wp(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 					   ILLEGAL_REQUEST,
 					   ASC_INVALID_FIELD_IN_CDB);
 
+	i = zone - zdev->zones;
+	zbc_lock_zones(zdev, i, i);
+	pthread_mutex_lock(&zdev->zone_state_lock);
 	__zbc_reset_wp(zdev, zone);
+	pthread_mutex_unlock(&zdev->zone_state_lock);
+	zbc_unlock_zones(zdev, i, i);
 
 	return TCMU_STS_OK;
 }
@@ -1908,80 +2358,116 @@ static int zbc_check_rdwr(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 }
 
 /*
- * Read data. As we go, check that we do not cross a
- * conventional to sequential zone boundary.
+ * Limit an iovec to bytes and at most IOV_MAX vectors. Return the number
+ * of vectors to use and in *trim the length removed from the last one,
+ * which the caller must give back once done.
  */
-static ssize_t __zbc_read(struct zbc_dev *zdev, void *buf,
-			  size_t nr_lbas, uint64_t lba,
-			  int *zone_type)
+static size_t zbc_iov_trim(struct iovec *iovec, size_t iov_cnt,
+			   size_t bytes, size_t *trim)
 {
-	struct zbc_zone *zone;
-	uint64_t boundary;
-	ssize_t ret;
-	size_t count, bytes, lba_count = nr_lbas;
+	size_t cnt = 0, len = 0;
 
-	while (lba_count) {
+	while (cnt < iov_cnt && cnt < IOV_MAX && len < bytes) {
+		len += iovec[cnt].iov_len;
+		cnt++;
+	}
 
-		zone = zbc_get_zone(zdev, lba, false);
+	*trim = 0;
+	if (len > bytes) {
+		*trim = len - bytes;
+		iovec[cnt - 1].iov_len -= *trim;
+	}
 
-		if (zdev->model == ZBC_HM) {
-			/* Check conv -> seq boundary violation */
-			if (!*zone_type) {
-				*zone_type = zone->type;
-			} else if (*zone_type != zone->type) {
-				*zone_type = 0;
-				return -EIO;
-			}
-		}
+	return cnt;
+}
 
-		if (zbc_zone_seq(zone) && lba >= zone->wp) {
-			/* Read zeroes */
-			bytes = lba_count * zdev->lba_size;
-			memset(buf, 0, bytes);
-			break;
-		}
+/*
+ * Read or write bytes of data at lba using as few preadv/pwritev calls
+ * as possible. The iovec is consumed as data is transferred.
+ */
+static int zbc_rw_iovec(struct zbc_dev *zdev, struct iovec **iovec,
+			size_t *iov_cnt, size_t bytes, uint64_t lba,
+			bool write)
+{
+	off_t offset = zdev->meta_size + lba * zdev->lba_size;
+	size_t cnt, seek, trim;
+	ssize_t ret;
 
-		if (zbc_zone_seq(zone))
-			boundary = zone->wp;
-		else
-			boundary = zone->start + zone->len;
-		if (lba + nr_lbas > boundary)
-			count = boundary - lba;
-		else
-			count = lba_count;
-		bytes = count * zdev->lba_size;
-
-		/* Read written data */
-		ret = pread(zdev->fd, buf, bytes,
-			    zdev->meta_size + lba * zdev->lba_size);
-		if (ret != bytes) {
-			tcmu_dev_err(zdev->dev, "Read failed %zd / %zu B\n",
-				     ret, bytes);
+	while (bytes) {
+		cnt = zbc_iov_trim(*iovec, *iov_cnt, bytes, &trim);
+		if (!cnt)
 			return -EIO;
-		}
 
-		lba_count -= count;
-		lba += count;
-		buf += bytes;
+		if (write)
+			ret = pwritev(zdev->fd, *iovec, cnt, offset);
+		else
+			ret = preadv(zdev->fd, *iovec, cnt, offset);
+		if (ret < 0)
+			ret = -errno;
+		(*iovec)[cnt - 1].iov_len += trim;
 
+		if (ret == -EINTR)
+			continue;
+		if (ret <= 0) {
+			tcmu_dev_err(zdev->dev, "%s of %zu B at %lld failed %zd\n",
+				     write ? "Write" : "Read", bytes,
+				     (long long)offset, ret);
+			return ret ? ret : -EIO;
+		}
+
+		seek = tcmu_iovec_seek(*iovec, ret);
+		*iovec += seek;
+		*iov_cnt -= seek;
+		bytes -= ret;
+		offset += ret;
 	}
 
-	return nr_lbas;
+	return 0;
+}
+
+/*
+ * Zero fill bytes of an iovec and consume them.
+ */
+static void zbc_zero_iovec(struct iovec **iovec, size_t *iov_cnt,
+			   size_t bytes)
+{
+	size_t cnt, len, seek, trim;
+
+	while (bytes) {
+		cnt = zbc_iov_trim(*iovec, *iov_cnt, bytes, &trim);
+		if (!cnt)
+			return;
+
+		len = tcmu_iovec_length(*iovec, cnt);
+		tcmu_iovec_zero(*iovec, cnt);
+		(*iovec)[cnt - 1].iov_len += trim;
+
+		seek = tcmu_iovec_seek(*iovec, len);
+		*iovec += seek;
+		*iov_cnt -= seek;
+		bytes -= len;
+	}
 }
 
 /*
- * Read command emulation.
+ * Read command emulation. As we go, check that we do not cross a
+ * conventional to sequential zone boundary. Written data of consecutive
+ * zones is read with a single preadv and unwritten sectors past the
+ * write pointer of sequential zones are zero filled.
  */
 static int zbc_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	struct zbc_dev *zdev = tcmur_dev_get_private(dev);
 	uint8_t *cdb = cmd->cdb;
 	uint64_t lba = tcmu_cdb_get_lba(cdb);
+	size_t nr_lbas = tcmu_cdb_get_xfer_length(cdb);
 	struct iovec *iovec = cmd->iovec;
 	size_t iov_cnt = cmd->iov_cnt;
+	uint64_t rd_lba = lba, end, wp;
+	size_t count, valid, rd_count = 0;
+	struct zbc_zone *zone;
 	int zone_type = 0;
-	ssize_t ret;
-	int i;
+	int ret;
 
 	tcmu_dev_dbg(dev, "Read LBA %llu+%u, %zu vectors\n",
 		     (unsigned long long)lba,
@@ -1992,22 +2478,63 @@ static int zbc_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	if (ret != TCMU_STS_OK)
 		return ret;
 
-	for (i = 0; i < iov_cnt; i++) {
-		ret = __zbc_read(zdev, iovec[i].iov_base,
-				 iovec[i].iov_len / zdev->lba_size, lba,
-				 &zone_type);
-		if (ret <= 0) {
+	while (nr_lbas) {
+
+		zone = zbc_get_zone(zdev, lba, false);
+
+		if (zdev->model == ZBC_HM) {
+			/* Check conv -> seq boundary violation */
 			if (!zone_type)
+				zone_type = zone->type;
+			else if (zone_type != zone->type)
 				return tcmu_sense_set_data(cmd->sense_buf,
-						   ILLEGAL_REQUEST,
-						   ASC_ATTEMPT_TO_READ_INVALID_DATA);
-			return tcmu_sense_set_data(cmd->sense_buf,
-						   MEDIUM_ERROR,
-						   ASC_READ_ERROR);
+						ILLEGAL_REQUEST,
+						ASC_ATTEMPT_TO_READ_INVALID_DATA);
+		}
+
+		end = zone->start + zone->len;
+		if (lba + nr_lbas > end)
+			count = end - lba;
+		else
+			count = nr_lbas;
+
+		valid = count;
+		if (zbc_zone_seq(zone)) {
+			wp = __atomic_load_n(&zone->wp, __ATOMIC_ACQUIRE);
+			if (lba >= wp)
+				valid = 0;
+			else if (lba + count > wp)
+				valid = wp - lba;
+		}
+		rd_count += valid;
+
+		if (valid < count) {
+			/* Read written data so far and zero fill the rest */
+			if (rd_count &&
+			    zbc_rw_iovec(zdev, &iovec, &iov_cnt,
+					 rd_count * zdev->lba_size, rd_lba,
+					 false))
+				return tcmu_sense_set_data(cmd->sense_buf,
+							   MEDIUM_ERROR,
+							   ASC_READ_ERROR);
+			zbc_zero_iovec(&iovec, &iov_cnt,
+				       (count - valid) * zdev->lba_size);
+			rd_count = 0;
+			rd_lba = lba + count;
 		}
-		lba += ret;
+
+		lba += count;
+		nr_lbas -= count;
+
 	}
 
+	if (rd_count &&
+	    zbc_rw_iovec(zdev, &iovec, &iov_cnt, rd_count * zdev->lba_size,
+			 rd_lba, false))
+		return tcmu_sense_set_data(cmd->sense_buf,
+					   MEDIUM_ERROR,
+					   ASC_READ_ERROR);
+
 	return TCMU_STS_OK;
 }
 
@@ -2097,7 +2624,41 @@ static int zbc_write_check_zones(struct tcmu_device *dev,
 }
 
 /*
- * Write command emulation.
+ * Advance the write pointer of a zone after count LBAs were written at lba.
+ * Called with zone_state_lock held.
+ */
+static void __zbc_write_done(struct zbc_dev *zdev, struct zbc_zone *zone,
+			     uint64_t lba, size_t count)
+{
+	uint64_t end = zone->start + zone->len;
+	uint64_t wp = zone->wp;
+
+	if (zbc_zone_conv(zone))
+		return;
+
+	if (zbc_zone_seq_req(zone))
+		wp += count;
+	else if (lba + count > wp)
+		wp = lba + count;
+
+	if (wp >= end) {
+		if (zbc_zone_is_open(zone))
+			__zbc_close_zone(zdev, zone);
+		zbc_set_wp(zdev, zone, end);
+		zbc_set_cond(zdev, zone, ZBC_ZONE_COND_FULL);
+		return;
+	}
+
+	zbc_set_wp(zdev, zone, wp);
+
+	/* The zone may have been implicitly closed while we were writing */
+	if (!zbc_zone_is_open(zone))
+		zbc_set_cond(zdev, zone, ZBC_ZONE_COND_CLOSED);
+}
+
+/*
+ * Write command emulation. The zones written to are locked for the
+ * duration of the command and the data is written with a single pwritev.
  */
 static int zbc_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
@@ -2105,10 +2666,13 @@ static int zbc_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	uint8_t *cdb = cmd->cdb;
 	uint64_t lba = tcmu_cdb_get_lba(cdb);
 	size_t nr_lbas = tcmu_cdb_get_xfer_length(cdb);
-	size_t count, lba_count;
 	struct iovec *iovec = cmd->iovec;
+	size_t iov_cnt = cmd->iov_cnt;
+	unsigned int first, last, i;
 	struct zbc_zone *zone;
-	ssize_t ret;
+	size_t count, left;
+	uint64_t zlba, end;
+	int ret;
 
 	tcmu_dev_dbg(dev, "Write LBA %llu+%u, %zu vectors\n",
 		     (unsigned long long)lba,
@@ -2116,73 +2680,75 @@ static int zbc_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 
 	/* Check LBA and length */
 	ret = zbc_check_rdwr(dev, cmd);
-	if (ret != TCMU_STS_OK)
+	if (ret != TCMU_STS_OK || !nr_lbas)
 		return ret;
 
-	/* Check zone boundary crossing */
-	ret = zbc_write_check_zones(dev, cmd, nr_lbas, lba);
-	if (ret != TCMU_STS_OK)
-		return ret;
+	first = lba / zdev->zone_size;
+	last = (lba + nr_lbas - 1) / zdev->zone_size;
+	zbc_lock_zones(zdev, first, last);
 
-	/* Do write */
-	while (nr_lbas) {
+	pthread_mutex_lock(&zdev->zone_state_lock);
 
-		/* Get the zone of the current LBA */
-		zone = zbc_get_zone(zdev, lba, false);
+	/* Check zone boundary crossing */
+	ret = zbc_write_check_zones(dev, cmd, nr_lbas, lba);
+	if (ret != TCMU_STS_OK) {
+		pthread_mutex_unlock(&zdev->zone_state_lock);
+		goto unlock;
+	}
 
-		/* If the zone is not open, implicitly open it */
-		if (zbc_zone_seq(zone) && !zbc_zone_is_open(zone)) {
-			/* Too many explicit open ? */
-			if (zdev->nr_exp_open >= zdev->nr_open_zones)
-				return tcmu_sense_set_data(cmd->sense_buf,
-							   DATA_PROTECT,
-							   ASC_INSUFFICIENT_ZONE_RESOURCES);
-			__zbc_open_zone(zdev, zone, false);
+	/* If the zones are not open, implicitly open them */
+	for (i = first; i <= last; i++) {
+		zone = &zdev->zones[i];
+		if (!zbc_zone_seq(zone) || zbc_zone_is_open(zone))
+			continue;
+
+		/* Too many explicit open ? */
+		if (zdev->nr_exp_open >= zdev->nr_open_zones) {
+			pthread_mutex_unlock(&zdev->zone_state_lock);
+			ret = tcmu_sense_set_data(cmd->sense_buf,
+						  DATA_PROTECT,
+						  ASC_INSUFFICIENT_ZONE_RESOURCES);
+			goto unlock;
 		}
+		__zbc_open_zone(zdev, zone, false);
+	}
 
-		/* Do write */
-		if (lba + nr_lbas > zone->start + zone->len)
-			count = zone->start + zone->len - lba;
-		else
-			count = nr_lbas;
-		lba_count = iovec->iov_len / zdev->lba_size;
-		if (lba_count < count)
-			count = lba_count;
+	pthread_mutex_unlock(&zdev->zone_state_lock);
 
-		ret = pwrite(zdev->fd, iovec->iov_base, count * zdev->lba_size,
-			     zdev->meta_size + lba * zdev->lba_size);
-		if (ret <= 0) {
-			tcmu_dev_err(dev, "Write failed: %m\n");
-			return tcmu_sense_set_data(cmd->sense_buf,
-						   MEDIUM_ERROR,
-						   ASC_WRITE_ERROR);
-		}
-
-		iovec += tcmu_iovec_seek(iovec, ret);
-		count = ret / zdev->lba_size;
+	/* Do write */
+	if (zbc_rw_iovec(zdev, &iovec, &iov_cnt, nr_lbas * zdev->lba_size,
+			 lba, true)) {
+		ret = tcmu_sense_set_data(cmd->sense_buf,
+					  MEDIUM_ERROR,
+					  ASC_WRITE_ERROR);
+		goto unlock;
+	}
 
-		/* Adjust write pointer */
-		if (zbc_zone_seq_req(zone)) {
-			zone->wp += count;
-		} else if (zbc_zone_seq_pref(zone)) {
-			if (lba + count >= zone->wp)
-				zone->wp = lba + count;
-		}
+	/* Adjust write pointers */
+	pthread_mutex_lock(&zdev->zone_state_lock);
 
-		if (zbc_zone_seq(zone) &&
-		    zone->wp >= zone->start + zone->len) {
-			if (zbc_zone_is_open(zone))
-				__zbc_close_zone(zdev, zone);
-			zone->wp = zone->start + zone->len;
-			zone->cond = ZBC_ZONE_COND_FULL;
-		}
+	zlba = lba;
+	left = nr_lbas;
+	for (i = first; i <= last; i++) {
+		zone = &zdev->zones[i];
+		end = zone->start + zone->len;
+		if (zlba + left > end)
+			count = end - zlba;
+		else
+			count = left;
 
-		lba += count;
-		nr_lbas -= count;
+		__zbc_write_done(zdev, zone, zlba, count);
 
+		zlba += count;
+		left -= count;
 	}
 
-	return TCMU_STS_OK;
+	pthread_mutex_unlock(&zdev->zone_state_lock);
+
+unlock:
+	zbc_unlock_zones(zdev, first, last);
+
+	return ret;
 }
 
 /*
@@ -2294,7 +2860,7 @@ static struct tcmur_handler zbc_handler = {
 	.open = zbc_open,
 	.close = zbc_close,
 	.handle_cmd = zbc_handle_cmd,
-	.nr_threads = 0,
+	.nr_threads = 4,
 };
 
 /*
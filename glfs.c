@@ -26,6 +26,7 @@
 #include "libtcmu.h"
 #include "tcmur_device.h"
 #include "tcmur_cmd_handler.h"
+#include "libtcmu_trace.h"
 #include "version.h"
 
 #define ALLOWED_BSOFLAGS (O_DIRECT | O_RDWR | O_LARGEFILE)
@@ -69,6 +70,7 @@ typedef struct gluster_server {
 	char *volname;     /* volume name*/
 	char *path;        /* path of file in the volume */
 	gluster_hostdef *server; /* gluster server definition */
+	unsigned int nr_shards; /* max glfs_t instances devices spread over */
 } gluster_server;
 
 struct glfs_state {
@@ -97,14 +99,24 @@ typedef struct glfs_cbk_cookie {
 	} op;
 } glfs_cbk_cookie;
 
+/*
+ * Connections are hashed by volume and server so a device open only
+ * looks at the glfs_t instances for its own volume. A volume can have
+ * up to nr_shards instances (shards=N in the cfgstring), each with its
+ * own client graph and event threads, and devices are spread over them.
+ */
+#define GLUSTER_CACHE_BUCKETS 64
+#define GLUSTER_MAX_SHARDS 16
+
 struct gluster_cacheconn {
 	char *volname;
 	gluster_hostdef *server;
+	uint32_t hash;
 	glfs_t *fs;
 	darray(char *) cfgstring;
 } gluster_cacheconn;
 
-static darray(struct gluster_cacheconn *) glfs_cache;
+static darray(struct gluster_cacheconn *) glfs_cache[GLUSTER_CACHE_BUCKETS];
 
 const char *const gluster_transport_lookup[] = {
 	[GLUSTER_TRANSPORT_TCP] = "tcp",
@@ -157,6 +169,48 @@ gluster_compare_hosts(gluster_hostdef *src_server, gluster_hostdef *dst_server)
 	return false;
 }
 
+static uint32_t gluster_hash_str(uint32_t hash, const char *str)
+{
+	/* FNV-1a, including the terminating NUL as a separator */
+	do {
+		hash ^= (unsigned char)*str;
+		hash *= 16777619;
+	} while (*str++);
+
+	return hash;
+}
+
+static uint32_t gluster_cache_hash(gluster_server *dst)
+{
+	uint32_t hash = 2166136261u;
+
+	hash = gluster_hash_str(hash, dst->volname);
+	hash ^= dst->server->type;
+	hash *= 16777619;
+
+	switch (dst->server->type) {
+	case GLUSTER_TRANSPORT_UNIX:
+		hash = gluster_hash_str(hash, dst->server->u.uds.socket);
+		break;
+	case GLUSTER_TRANSPORT_TCP:
+	case GLUSTER_TRANSPORT_RDMA:
+		hash = gluster_hash_str(hash, dst->server->u.inet.addr);
+		hash = gluster_hash_str(hash, dst->server->u.inet.port);
+		break;
+	case GLUSTER_TRANSPORT__MAX:
+		break;
+	}
+
+	return hash;
+}
+
+static bool gluster_cache_match(struct gluster_cacheconn *entry,
+				gluster_server *dst, uint32_t hash)
+{
+	return entry->hash == hash && !strcmp(entry->volname, dst->volname) &&
+	       gluster_compare_hosts(entry->server, dst->server);
+}
+
 static int gluster_cache_add(gluster_server *dst, glfs_t *fs, char* cfgstring)
 {
 	struct gluster_cacheconn *entry;
@@ -181,13 +235,14 @@ static int gluster_cache_add(gluster_server *dst, glfs_t *fs, char* cfgstring)
 		entry->server->u.inet.port = strdup(dst->server->u.inet.port);
 	}
 
+	entry->hash = gluster_cache_hash(dst);
 	entry->fs = fs;
 
 	cfg_copy = strdup(cfgstring);
 	darray_init(entry->cfgstring);
 	darray_append(entry->cfgstring, cfg_copy);
 
-	darray_append(glfs_cache, entry);
+	darray_append(glfs_cache[entry->hash % GLUSTER_CACHE_BUCKETS], entry);
 
 	return 0;
 
@@ -203,65 +258,79 @@ static bool tcmu_glfs_update_logdir(void)
 {
 	struct gluster_cacheconn **entry;
 	char logfilepath[PATH_MAX];
-	int ret;
-
-	darray_foreach(entry, glfs_cache) {
-		ret = tcmu_make_absolute_logfile(logfilepath, TCMU_GLFS_LOG_FILENAME);
-		if (ret < 0) {
-			tcmu_err("tcmu_make_absolute_logfile failed: %d\n", ret);
-			return false;
-		}
+	int ret, i;
+
+	for (i = 0; i < GLUSTER_CACHE_BUCKETS; i++) {
+		darray_foreach(entry, glfs_cache[i]) {
+			ret = tcmu_make_absolute_logfile(logfilepath, TCMU_GLFS_LOG_FILENAME);
+			if (ret < 0) {
+				tcmu_err("tcmu_make_absolute_logfile failed: %d\n", ret);
+				return false;
+			}
 
-		if (glfs_set_logging((*entry)->fs, logfilepath, TCMU_GLFS_DEBUG_LEVEL)) {
-			tcmu_err("glfs_set_logging() on %s failed[%s]",
-				 (*entry)->volname, strerror(errno));
-			return false;
+			if (glfs_set_logging((*entry)->fs, logfilepath, TCMU_GLFS_DEBUG_LEVEL)) {
+				tcmu_err("glfs_set_logging() on %s failed[%s]",
+					 (*entry)->volname, strerror(errno));
+				return false;
+			}
 		}
 	}
 
 	return true;
 }
 
+/*
+ * Returns the glfs_t to use for cfgstring, or NULL if the caller should
+ * create a new one: either the volume has none yet, or it has fewer
+ * than dst->nr_shards and cfgstring is not already using one of them.
+ * Otherwise the least loaded instance is picked.
+ */
 static glfs_t* gluster_cache_query(gluster_server *dst, char *cfgstring)
 {
-	struct gluster_cacheconn **entry;
+	uint32_t hash = gluster_cache_hash(dst);
+	struct gluster_cacheconn **entry, *best = NULL;
 	char** config;
 	char* cfg_copy = NULL;
-	bool cfgmatch = false;
+	unsigned int nr_shards = 0;
 
-	darray_foreach(entry, glfs_cache) {
-		if (strcmp((*entry)->volname, dst->volname))
+	darray_foreach(entry, glfs_cache[hash % GLUSTER_CACHE_BUCKETS]) {
+		if (!gluster_cache_match(*entry, dst, hash))
 			continue;
-		if (gluster_compare_hosts((*entry)->server, dst->server)) {
 
-			darray_foreach(config, (*entry)->cfgstring) {
-				if (!strcmp(*config, cfgstring)) {
-					cfgmatch = true;
-					break;
-				}
-			}
-			if (!cfgmatch) {
-				cfg_copy = strdup(cfgstring);
-				darray_append((*entry)->cfgstring, cfg_copy);
-			}
-			return (*entry)->fs;
+		darray_foreach(config, (*entry)->cfgstring) {
+			if (!strcmp(*config, cfgstring))
+				return (*entry)->fs;
 		}
+
+		nr_shards++;
+		if (!best || darray_size((*entry)->cfgstring) <
+			     darray_size(best->cfgstring))
+			best = *entry;
 	}
 
-	return NULL;
+	if (!best || nr_shards < dst->nr_shards)
+		return NULL;
+
+	cfg_copy = strdup(cfgstring);
+	darray_append(best->cfgstring, cfg_copy);
+	return best->fs;
 }
 
-static void gluster_cache_refresh(glfs_t *fs, const char *cfgstring)
+static void gluster_cache_refresh(gluster_server *dst, glfs_t *fs,
+				  const char *cfgstring)
 {
 	struct gluster_cacheconn **entry;
 	char** config;
 	size_t i = 0;
 	size_t j = 0;
+	uint32_t bucket;
 
 	if (!fs)
 		return;
 
-	darray_foreach(entry, glfs_cache) {
+	pthread_mutex_lock(&glfs_lock);
+	bucket = gluster_cache_hash(dst) % GLUSTER_CACHE_BUCKETS;
+	darray_foreach(entry, glfs_cache[bucket]) {
 		if ((*entry)->fs == fs) {
 			if (cfgstring) {
 				darray_foreach(config, (*entry)->cfgstring) {
@@ -275,7 +344,7 @@ static void gluster_cache_refresh(glfs_t *fs, const char *cfgstring)
 			}
 
 			if (darray_size((*entry)->cfgstring))
-				return;
+				break;
 
 			free((*entry)->volname);
 			glfs_fini((*entry)->fs);
@@ -283,14 +352,16 @@ static void gluster_cache_refresh(glfs_t *fs, const char *cfgstring)
 			gluster_free_host((*entry)->server);
 			free((*entry)->server);
 			(*entry)->server = NULL;
+			darray_free((*entry)->cfgstring);
 			free((*entry));
 
-			darray_remove(glfs_cache, i);
-			return;
+			darray_remove(glfs_cache[bucket], i);
+			break;
 		} else {
 			i++;
 		}
 	}
+	pthread_mutex_unlock(&glfs_lock);
 }
 
 static void gluster_thread_cleanup(void *arg)
@@ -359,6 +430,7 @@ static int parse_imagepath(char *cfgstring, gluster_server **hosts)
 	gluster_server *entry = NULL;
 	char *origp = strdup(cfgstring);
 	char *p, *sep;
+	int nr_shards;
 
 	if (!origp)
 		goto fail;
@@ -396,12 +468,32 @@ static int parse_imagepath(char *cfgstring, gluster_server **hosts)
 		goto fail;
 	entry->server->u.inet.port = strdup(GLUSTER_PORT); /* FIXME: Get port dynamically */
 
-	/* The rest is the path name */
+	/* The rest is the path name, followed by optional ;key=value pairs */
 	p = sep + 1;
+	sep = strchr(p, ';');
+	if (sep)
+		*sep = '\0';
 	entry->path = strdup(p);
 	if (!entry->path)
 		goto fail;
 
+	entry->nr_shards = 1;
+	while (sep) {
+		p = sep + 1;
+		sep = strchr(p, ';');
+		if (sep)
+			*sep = '\0';
+
+		if (!strncmp(p, "shards=", 7)) {
+			nr_shards = atoi(p + 7);
+			if (nr_shards < 1)
+				nr_shards = 1;
+			if (nr_shards > GLUSTER_MAX_SHARDS)
+				nr_shards = GLUSTER_MAX_SHARDS;
+			entry->nr_shards = nr_shards;
+		}
+	}
+
 	if (entry->server->type == GLUSTER_TRANSPORT_UNIX) {
 		if (!strlen(entry->server->u.uds.socket) ||
 		    !strlen(entry->volname) || !strlen(entry->path))
@@ -481,7 +573,7 @@ static glfs_t* tcmu_create_glfs_object(struct tcmu_device *dev,
 	return fs;
 
 unref:
-	gluster_cache_refresh(fs, config);
+	gluster_cache_refresh(entry, fs, config);
 
 fail:
 	gluster_free_server(hosts);
@@ -583,7 +675,7 @@ out:
 close:
 	glfs_close(gfsp->gfd);
 unref:
-	gluster_cache_refresh(gfsp->fs, tcmu_get_path(dev));
+	gluster_cache_refresh(gfsp->hosts, gfsp->fs, tcmu_get_path(dev));
 	gluster_free_server(&gfsp->hosts);
 fail:
 	free(gfsp);
@@ -591,12 +683,25 @@ fail:
 	return ret;
 }
 
+/* Devices on the same cached glfs_t instance recover together */
+static int tcmu_glfs_get_conn_key(struct tcmu_device *dev, char *key,
+				  size_t len)
+{
+	struct glfs_state *gfsp = tcmur_dev_get_private(dev);
+
+	if (!gfsp || !gfsp->fs)
+		return -ENOENT;
+
+	snprintf(key, len, "glfs:%p", (void *)gfsp->fs);
+	return 0;
+}
+
 static void tcmu_glfs_close(struct tcmu_device *dev)
 {
 	struct glfs_state *gfsp = tcmur_dev_get_private(dev);
 
 	glfs_close(gfsp->gfd);
-	gluster_cache_refresh(gfsp->fs, tcmu_get_path(dev));
+	gluster_cache_refresh(gfsp->hosts, gfsp->fs, tcmu_get_path(dev));
 	gluster_free_server(&gfsp->hosts);
 	free(gfsp);
 }
@@ -619,6 +724,8 @@ static void glfs_async_cbk(glfs_fd_t *fd, ssize_t ret, void *data)
 	size_t length = cookie->length;
 	int err = -errno;
 
+	TCMU_TRACE3(glfs_aio_done, dev, tcmur_cmd->lib_cmd, ret);
+
 	if (ret < 0) {
 		switch (err) {
 		case -ETIMEDOUT:
@@ -944,13 +1051,19 @@ static int tcmu_glfs_unlock(struct tcmu_device *dev)
 
 static int tcmu_glfs_init(void)
 {
-	darray_init(glfs_cache);
+	int i;
+
+	for (i = 0; i < GLUSTER_CACHE_BUCKETS; i++)
+		darray_init(glfs_cache[i]);
 	return 0;
 }
 
 static void tcmu_glfs_destroy(void)
 {
-	darray_free(glfs_cache);
+	int i;
+
+	for (i = 0; i < GLUSTER_CACHE_BUCKETS; i++)
+		darray_free(glfs_cache[i]);
 }
 
 /*
@@ -959,19 +1072,22 @@ static void tcmu_glfs_destroy(void)
  * Specify volume, hostname and filepath e.g,
  *
  * $ targetcli /backstores/user:glfs create $blockname $size \
- *   $volume@$hostname/$filepath
+ *   $volume@$hostname/$filepath[;shards=N]
  *
  * volume: must be the name of an existing Gluster volume.
  * hostname: the hostname or the IP address
  * filepath: is the path of the backing file in Gluster volume.
+ * shards: optional, spread the volume's devices over up to N (max 16)
+ *         gluster client instances instead of sharing one.
  */
 static const char glfs_cfg_desc[] =
 	"glfs config string is of the form:\n"
-	"\"$volume@$hostname/$filepath\"\n"
+	"\"$volume@$hostname/$filepath[;shards=N]\"\n"
 	"where:\n"
 	"  volume:    The volume on the Gluster server\n"
 	"  hostname:  The server's hostname\n"
-	"  filepath:  The path of the backing file";
+	"  filepath:  The path of the backing file\n"
+	"  shards:    Spread the volume's devices over up to N client instances";
 
 struct tcmur_handler glfs_handler = {
 	.name           = "Gluster glfs handler",
@@ -983,6 +1099,7 @@ struct tcmur_handler glfs_handler = {
 	.read           = tcmu_glfs_read,
 	.write          = tcmu_glfs_write,
 	.reconfig       = tcmu_glfs_reconfig,
+	.get_conn_key   = tcmu_glfs_get_conn_key,
 	.flush          = tcmu_glfs_flush,
 	.unmap          = tcmu_glfs_discard,
 	.writesame      = tcmu_glfs_writesame,
@@ -28,6 +28,7 @@
 #include "libtcmu.h"
 #include "libtcmu_log.h"
 #include "libtcmu_priv.h"
+#include "libtcmu_trace.h"
 #include "scsi_defs.h"
 
 #define TCMU_NL_VERSION 2
@@ -137,6 +138,36 @@ lookup_dev_by_name(struct tcmulib_context *ctx, char *dev_name, int *index)
 	return NULL;
 }
 
+struct tcmu_device *tcmulib_lookup_dev(struct tcmulib_context *ctx,
+				       const char *name)
+{
+	struct tcmu_device **dev_ptr;
+	struct tcmu_device *dev;
+
+	darray_foreach(dev_ptr, ctx->devices) {
+		dev = *dev_ptr;
+
+		if (!strcmp(dev->dev_name, name) ||
+		    !strcmp(dev->tcm_dev_name, name))
+			return dev;
+	}
+
+	return NULL;
+}
+
+int tcmulib_get_devs(struct tcmulib_context *ctx, struct tcmu_device ***devs)
+{
+	size_t nr_devs = darray_size(ctx->devices);
+
+	*devs = malloc(sizeof(**devs) * (nr_devs ? nr_devs : 1));
+	if (!*devs)
+		return -ENOMEM;
+
+	if (nr_devs)
+		memcpy(*devs, ctx->devices.item, sizeof(**devs) * nr_devs);
+	return nr_devs;
+}
+
 static const char *const tcmulib_cfg_type_lookup[] = {
 	[TCMULIB_CFG_DEV_CFGSTR]  = "TCMULIB_CFG_DEV_CFGSTR",
 	[TCMULIB_CFG_DEV_SIZE]    = "TCMULIB_CFG_DEV_SIZE",
@@ -543,8 +574,146 @@ err_fail:
 	return false;
 }
 
-static int device_add(struct tcmulib_context *ctx, char *dev_name,
-		      char *cfgstring, bool reopen)
+static int cmd_pool_init(struct tcmu_device *dev)
+{
+	struct tcmu_cmd_pool *pool = &dev->cmd_pool;
+	int depth, ret;
+
+	memset(pool, 0, sizeof(*pool));
+
+	/*
+	 * LIO will not send more than hw_queue_depth commands to us at
+	 * once, so that is the most objects we will have in flight
+	 * unless the kernel timed out commands we are still executing.
+	 */
+	depth = tcmu_cfgfs_dev_get_attr_int(dev, "hw_queue_depth");
+	if (depth <= 0)
+		depth = TCMU_CMD_POOL_DEF_DEPTH;
+	pool->depth = depth;
+
+	ret = pthread_spin_init(&pool->lock, 0);
+	if (ret)
+		return -ret;
+	return 0;
+}
+
+static void cmd_pool_destroy(struct tcmu_device *dev)
+{
+	struct tcmu_cmd_pool *pool = &dev->cmd_pool;
+
+	pthread_spin_destroy(&pool->lock);
+	free(pool->slab);
+	pool->slab = NULL;
+}
+
+static bool cmd_pool_owns(struct tcmu_cmd_pool *pool, struct tcmulib_cmd *cmd)
+{
+	char *obj = (char *)cmd;
+
+	return pool->slab && obj >= pool->slab &&
+	       obj < pool->slab + pool->obj_size * pool->depth;
+}
+
+/* Called from the ring processing thread only */
+static bool cmd_pool_fill(struct tcmu_device *dev, int hm_cmd_size)
+{
+	struct tcmu_cmd_pool *pool = &dev->cmd_pool;
+	struct tcmu_cmd_pool_entry *entry;
+	size_t obj_size;
+	uint32_t i;
+
+	/* Keep hm_private 8 byte aligned and objects on their own lines */
+	obj_size = sizeof(struct tcmulib_cmd) +
+		   sizeof(struct iovec) * TCMU_CMD_POOL_MAX_IOV_CNT +
+		   TCMU_CMD_POOL_MAX_CDB_LEN + hm_cmd_size;
+	obj_size = round_up(obj_size, (size_t)ALIGN_SIZE);
+
+	if (posix_memalign((void **)&pool->slab, ALIGN_SIZE,
+			   obj_size * pool->depth)) {
+		tcmu_dev_warn(dev, "Could not allocate cmd pool of %u entries. Using heap for cmds.\n",
+			      pool->depth);
+		pool->slab = NULL;
+		pool->depth = 0;
+		return false;
+	}
+	pool->obj_size = obj_size;
+	pool->hm_cmd_size = hm_cmd_size;
+
+	pthread_spin_lock(&pool->lock);
+	for (i = 0; i < pool->depth; i++) {
+		entry = (struct tcmu_cmd_pool_entry *)(pool->slab + i * obj_size);
+		entry->next = pool->free_list;
+		pool->free_list = entry;
+	}
+	pthread_spin_unlock(&pool->lock);
+
+	tcmu_dev_dbg(dev, "cmd pool has %u entries of %zu bytes\n",
+		     pool->depth, obj_size);
+	return true;
+}
+
+static struct tcmulib_cmd *cmd_pool_get(struct tcmu_device *dev,
+					int hm_cmd_size, int cdb_len,
+					uint32_t iov_cnt)
+{
+	struct tcmu_cmd_pool *pool = &dev->cmd_pool;
+	struct tcmu_cmd_pool_entry *entry;
+	struct tcmulib_cmd *cmd;
+
+	if (cdb_len > TCMU_CMD_POOL_MAX_CDB_LEN ||
+	    iov_cnt > TCMU_CMD_POOL_MAX_IOV_CNT)
+		return NULL;
+
+	if (!pool->slab) {
+		if (!pool->depth || !cmd_pool_fill(dev, hm_cmd_size))
+			return NULL;
+	} else if (hm_cmd_size != pool->hm_cmd_size) {
+		return NULL;
+	}
+
+	pthread_spin_lock(&pool->lock);
+	entry = pool->free_list;
+	if (entry)
+		pool->free_list = entry->next;
+	pthread_spin_unlock(&pool->lock);
+
+	if (!entry)
+		return NULL;
+
+	cmd = (struct tcmulib_cmd *)entry;
+	cmd->iovec = (struct iovec *) (cmd + 1);
+	cmd->cdb = (uint8_t *) (cmd->iovec + TCMU_CMD_POOL_MAX_IOV_CNT);
+	cmd->hm_private = hm_cmd_size ?
+				cmd->cdb + TCMU_CMD_POOL_MAX_CDB_LEN : NULL;
+	return cmd;
+}
+
+static void cmd_pool_put(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmu_cmd_pool *pool = &dev->cmd_pool;
+	struct tcmu_cmd_pool_entry *entry;
+
+	if (!cmd_pool_owns(pool, cmd)) {
+		free(cmd);
+		return;
+	}
+
+	entry = (struct tcmu_cmd_pool_entry *)cmd;
+
+	pthread_spin_lock(&pool->lock);
+	entry->next = pool->free_list;
+	pool->free_list = entry;
+	pthread_spin_unlock(&pool->lock);
+}
+
+/*
+ * Open a device and run the handler's added callback, but do not make it
+ * visible in ctx->devices. This is the part of device_add that is safe to
+ * run for several devices at the same time.
+ */
+static int __device_add(struct tcmulib_context *ctx, char *dev_name,
+			char *cfgstring, bool reopen,
+			struct tcmu_device **devp)
 {
 	struct tcmu_device *dev;
 	char *reason = NULL;
@@ -605,19 +774,26 @@ static int device_add(struct tcmulib_context *ctx, char *dev_name,
 	dev->cmd_tail = dev->map->cmd_tail;
 	dev->ctx = ctx;
 
+	rc = cmd_pool_init(dev);
+	if (rc) {
+		tcmu_err("could not init cmd pool for %s\n", dev->dev_name);
+		goto err_closeshm;
+	}
+
 	rc = dev->handler->added(dev);
 	if (rc != 0) {
 		tcmu_err("handler open failed for %s\n", dev->dev_name);
-		goto err_closeshm;
+		goto err_destroy_pool;
 	}
 
-	darray_append(ctx->devices, dev);
-
 	if (reopen && reset_supp)
 		tcmu_cfgfs_dev_exec_action(dev, "block_dev", 0);
 
+	*devp = dev;
 	return 0;
 
+err_destroy_pool:
+	cmd_pool_destroy(dev);
 err_closeshm:
 	device_close_shm(dev);
 err_unblock:
@@ -628,6 +804,20 @@ err_free:
 	return -ENOENT;
 }
 
+static int device_add(struct tcmulib_context *ctx, char *dev_name,
+		      char *cfgstring, bool reopen)
+{
+	struct tcmu_device *dev;
+	int rc;
+
+	rc = __device_add(ctx, dev_name, cfgstring, reopen, &dev);
+	if (rc)
+		return rc;
+
+	darray_append(ctx->devices, dev);
+	return 0;
+}
+
 static void close_devices(struct tcmulib_context *ctx)
 {
 	struct tcmu_device **dev_ptr;
@@ -665,6 +855,7 @@ static void device_remove(struct tcmulib_context *ctx, char *dev_name,
 
 	dev->handler->removed(dev);
 
+	cmd_pool_destroy(dev);
 	device_close_shm(dev);
 
 	if (should_block)
@@ -732,35 +923,97 @@ out:
 	return ret;
 }
 
-static int open_devices(struct tcmulib_context *ctx)
-{
+/* Devices found at startup, opened by up to nr_threads open_devices_fn */
+struct open_devices_info {
+	struct tcmulib_context *ctx;
 	struct dirent **dirent_list;
 	int num_devs;
+	int next;	/* next dirent_list index to open */
+	struct tcmu_device **devs;
+};
+
+static void *open_devices_fn(void *arg)
+{
+	struct open_devices_info *info = arg;
+	char *dev_name;
+	int i;
+
+	while ((i = __atomic_fetch_add(&info->next, 1, __ATOMIC_RELAXED)) <
+	       info->num_devs) {
+		dev_name = NULL;
+		if (read_uio_name(info->dirent_list[i]->d_name, &dev_name))
+			continue;
+
+		/* Failures only affect this device, it is left out below */
+		__device_add(info->ctx, info->dirent_list[i]->d_name, dev_name,
+			     true, &info->devs[i]);
+		free(dev_name);
+	}
+
+	return NULL;
+}
+
+/*
+ * Open the devices that already exist from up to nr_threads threads,
+ * including the caller's. This runs before the netlink socket is serviced,
+ * so device events and their replies are still handled one at a time and
+ * in order once we return. Devices are added to ctx->devices in the same
+ * order as when they are opened serially.
+ */
+static int open_devices(struct tcmulib_context *ctx, unsigned int nr_threads)
+{
+	struct open_devices_info info;
+	pthread_t *threads = NULL;
+	unsigned int nr_started = 0;
 	int num_good_devs = 0;
 	int i;
 
-	num_devs = scandir("/dev", &dirent_list, is_uio, alphasort);
-	if (num_devs == -1)
+	memset(&info, 0, sizeof(info));
+	info.ctx = ctx;
+	info.num_devs = scandir("/dev", &info.dirent_list, is_uio, alphasort);
+	if (info.num_devs == -1)
 		return -1;
 
-	for (i = 0; i < num_devs; i++) {
-		char *dev_name = NULL;
+	info.devs = calloc(info.num_devs ? info.num_devs : 1,
+			   sizeof(*info.devs));
+	if (!info.devs) {
+		num_good_devs = -1;
+		goto free_dirents;
+	}
 
-		if (read_uio_name(dirent_list[i]->d_name, &dev_name))
-			continue;
+	if (nr_threads > info.num_devs)
+		nr_threads = info.num_devs;
+	if (nr_threads > 1) {
+		threads = calloc(nr_threads - 1, sizeof(*threads));
+		for (; threads && nr_started < nr_threads - 1; nr_started++) {
+			if (pthread_create(&threads[nr_started], NULL,
+					   open_devices_fn, &info)) {
+				tcmu_warn("Could only start %u device open threads\n",
+					  nr_started);
+				break;
+			}
+		}
+	}
+
+	open_devices_fn(&info);
 
-		if (device_add(ctx, dirent_list[i]->d_name, dev_name, true) < 0) {
-			free (dev_name);
+	while (nr_started)
+		pthread_join(threads[--nr_started], NULL);
+	free(threads);
+
+	for (i = 0; i < info.num_devs; i++) {
+		if (!info.devs[i])
 			continue;
-		}
-		free(dev_name);
 
+		darray_append(ctx->devices, info.devs[i]);
 		num_good_devs++;
 	}
+	free(info.devs);
 
-	for (i = 0; i < num_devs; i++)
-		free(dirent_list[i]);
-	free(dirent_list);
+free_dirents:
+	for (i = 0; i < info.num_devs; i++)
+		free(info.dirent_list[i]);
+	free(info.dirent_list);
 
 	return num_good_devs;
 }
@@ -773,9 +1026,10 @@ static void release_resources(struct tcmulib_context *ctx)
 	free(ctx);
 }
 
-struct tcmulib_context *tcmulib_initialize(
+struct tcmulib_context *tcmulib_initialize_parallel(
 	struct tcmulib_handler *handlers,
-	size_t handler_count)
+	size_t handler_count,
+	unsigned int nr_open_threads)
 {
 	struct tcmulib_context *ctx;
 	int ret;
@@ -800,7 +1054,7 @@ struct tcmulib_context *tcmulib_initialize(
 		darray_append(ctx->handlers, handler);
 	}
 
-	ret = open_devices(ctx);
+	ret = open_devices(ctx, nr_open_threads);
 	if (ret < 0) {
 		release_resources(ctx);
 		return NULL;
@@ -809,6 +1063,13 @@ struct tcmulib_context *tcmulib_initialize(
 	return ctx;
 }
 
+struct tcmulib_context *tcmulib_initialize(
+	struct tcmulib_handler *handlers,
+	size_t handler_count)
+{
+	return tcmulib_initialize_parallel(handlers, handler_count, 1);
+}
+
 void tcmulib_close(struct tcmulib_context *ctx)
 {
 	close_devices(ctx);
@@ -878,6 +1139,8 @@ void tcmu_set_thread_name(const char *prefix, struct tcmu_device *dev)
 
 	if (pthread_setname_np(pthread_self(), pname))
 		tcmu_dev_err(dev, "Could not set thread name to %s\n", pname);
+	else
+		tcmu_log_reset_thread_name();
 	free(pname);
 }
 
@@ -1025,6 +1288,16 @@ bool tcmu_dev_get_unmap_enabled(struct tcmu_device *dev)
 	return dev->unmap_enabled;
 }
 
+void tcmu_dev_set_pi_enabled(struct tcmu_device *dev, bool enabled)
+{
+	dev->pi_enabled = enabled;
+}
+
+bool tcmu_dev_get_pi_enabled(struct tcmu_device *dev)
+{
+	return dev->pi_enabled;
+}
+
 int tcmu_dev_get_fd(struct tcmu_device *dev)
 {
 	return dev->fd;
@@ -1099,90 +1372,135 @@ struct tcmulib_handler *tcmu_dev_get_handler(struct tcmu_device *dev)
 }
 
 static inline struct tcmu_cmd_entry *
-device_cmd_head(struct tcmu_device *dev)
+ring_entry(struct tcmu_mailbox *mb, uint32_t off)
 {
-	struct tcmu_mailbox *mb = dev->map;
+	return (struct tcmu_cmd_entry *) ((char *) mb + mb->cmdr_off + off);
+}
 
-	return (struct tcmu_cmd_entry *) ((char *) mb + mb->cmdr_off + mb->cmd_head);
+/* ring offset of the entry following ent at off */
+static inline uint32_t
+ring_next(struct tcmu_mailbox *mb, uint32_t off, struct tcmu_cmd_entry *ent)
+{
+	return (off + tcmu_hdr_get_len(ent->hdr.len_op)) % mb->cmdr_size;
 }
 
-static inline struct tcmu_cmd_entry *
-device_cmd_tail(struct tcmu_device *dev)
+/*
+ * Build a cmd for a TCMU_OP_CMD entry. *cmdp is set to NULL if the entry
+ * should be dropped. Returns -ENOMEM, without consuming the entry, if the
+ * cmd could not be allocated.
+ */
+static int ring_entry_to_cmd(struct tcmu_device *dev,
+			     struct tcmu_cmd_entry *ent, int hm_cmd_size,
+			     struct tcmulib_cmd **cmdp)
 {
 	struct tcmu_mailbox *mb = dev->map;
+	struct tcmulib_cmd *cmd;
+	uint8_t *cdb = (uint8_t *) mb + ent->req.cdb_off;
+	int cdb_len = tcmu_cdb_get_length(cdb);
+	int i;
 
-	return (struct tcmu_cmd_entry *) ((char *) mb + mb->cmdr_off + dev->cmd_tail);
-}
+	*cmdp = NULL;
+	if (cdb_len < 0) {
+		/*
+		 * This should never happen so just drop cmd
+		 * for now instead of adding a lock in the
+		 * main IO path.
+		 */
+		return 0;
+	}
 
-/* update the tcmu_device's tail */
-#define TCMU_UPDATE_DEV_TAIL(dev, mb, ent) \
-do { \
-	dev->cmd_tail = (dev->cmd_tail + tcmu_hdr_get_len((ent)->hdr.len_op)) % mb->cmdr_size; \
-} while (0)
+	cmd = cmd_pool_get(dev, hm_cmd_size, cdb_len, ent->req.iov_cnt);
+	if (!cmd) {
+		/*
+		 * Pool is exhausted or the cmd is too large
+		 * for it. Alloc memory for cmd itself, iovec
+		 * and cdb.
+		 */
+		cmd = malloc(sizeof(*cmd) + hm_cmd_size + cdb_len +
+			     sizeof(*cmd->iovec) * ent->req.iov_cnt);
+		if (!cmd)
+			return -ENOMEM;
+		cmd->iovec = (struct iovec *) (cmd + 1);
+		cmd->cdb = (uint8_t *) (cmd->iovec + ent->req.iov_cnt);
+		/* handler memory area after iovecs and cdb */
+		cmd->hm_private = hm_cmd_size ? cmd->cdb + cdb_len : NULL;
+	}
+	cmd->cmd_id = ent->hdr.cmd_id;
+
+	/* Convert iovec addrs in-place to not be offsets */
+	cmd->iov_cnt = ent->req.iov_cnt;
+	for (i = 0; i < ent->req.iov_cnt; i++) {
+		cmd->iovec[i].iov_base = (void *) mb +
+			(size_t) ent->req.iov[i].iov_base;
+		cmd->iovec[i].iov_len = ent->req.iov[i].iov_len;
+	}
 
-struct tcmulib_cmd *tcmulib_get_next_command(struct tcmu_device *dev,
-					     int hm_cmd_size)
+	/* Copy cdb that currently points to the command ring */
+	memcpy(cmd->cdb, cdb, cdb_len);
+
+	TCMU_TRACE4(cmd_fetch, dev, cmd, cmd->cmd_id, cmd->cdb[0]);
+	*cmdp = cmd;
+	return 0;
+}
+
+int tcmulib_get_next_commands(struct tcmu_device *dev,
+			      struct tcmulib_cmd **cmds, int max,
+			      int hm_cmd_size)
 {
 	struct tcmu_mailbox *mb = dev->map;
-	struct tcmu_cmd_entry *ent;
+	struct tcmu_cmd_entry *ent, *next = NULL;
+	uint32_t head, tail, next_tail;
+	int nr_cmds = 0;
+
+	head = __atomic_load_n(&mb->cmd_head, __ATOMIC_ACQUIRE);
+	tail = dev->cmd_tail;
+	if (tail == head || max <= 0)
+		return 0;
 
-	while ((ent = device_cmd_tail(dev)) != device_cmd_head(dev)) {
+	ent = ring_entry(mb, tail);
+	while (nr_cmds < max) {
+		/* Start pulling in the next entry while we parse this one */
+		next_tail = ring_next(mb, tail, ent);
+		if (next_tail != head) {
+			next = ring_entry(mb, next_tail);
+			__builtin_prefetch(next);
+		}
 
 		switch (tcmu_hdr_get_op(ent->hdr.len_op)) {
 		case TCMU_OP_PAD:
 			/* do nothing */
 			break;
-		case TCMU_OP_CMD: {
-			int i;
-			struct tcmulib_cmd *cmd;
-			uint8_t *cdb = (uint8_t *) mb + ent->req.cdb_off;
-			int cdb_len = tcmu_cdb_get_length(cdb);
-
-			if (cdb_len < 0) {
-				/*
-				 * This should never happen so just drop cmd
-				 * for now instead of adding a lock in the
-				 * main IO path.
-				 */
-				break;
-			}
-
-			/* Alloc memory for cmd itself, iovec and cdb */
-			cmd = malloc(sizeof(*cmd) + hm_cmd_size + cdb_len +
-				     sizeof(*cmd->iovec) * ent->req.iov_cnt);
-			if (!cmd)
-				return NULL;
-			cmd->cmd_id = ent->hdr.cmd_id;
-
-			/* Convert iovec addrs in-place to not be offsets */
-			cmd->iov_cnt = ent->req.iov_cnt;
-			cmd->iovec = (struct iovec *) (cmd + 1);
-			for (i = 0; i < ent->req.iov_cnt; i++) {
-				cmd->iovec[i].iov_base = (void *) mb +
-					(size_t) ent->req.iov[i].iov_base;
-				cmd->iovec[i].iov_len = ent->req.iov[i].iov_len;
-			}
-
-			/* Copy cdb that currently points to the command ring */
-			cmd->cdb = (uint8_t *) (cmd->iovec + cmd->iov_cnt);
-			memcpy(cmd->cdb, (void *) mb + ent->req.cdb_off, cdb_len);
-
-			/* Setup handler memory area after iovecs and cdb */
-			if (hm_cmd_size)
-				cmd->hm_private = cmd->cdb + cdb_len;
-
-			TCMU_UPDATE_DEV_TAIL(dev, mb, ent);
-			return cmd;
-		}
+		case TCMU_OP_CMD:
+			if (ring_entry_to_cmd(dev, ent, hm_cmd_size,
+					      &cmds[nr_cmds]))
+				goto done;
+			if (cmds[nr_cmds])
+				nr_cmds++;
+			break;
 		default:
 			/* We don't even know how to handle this TCMU opcode. */
 			ent->hdr.uflags |= TCMU_UFLAG_UNKNOWN_OP;
 		}
 
-		TCMU_UPDATE_DEV_TAIL(dev, mb, ent);
+		tail = next_tail;
+		if (tail == head)
+			break;
+		ent = next;
 	}
 
-	return NULL;
+done:
+	dev->cmd_tail = tail;
+	return nr_cmds;
+}
+
+struct tcmulib_cmd *tcmulib_get_next_command(struct tcmu_device *dev,
+					     int hm_cmd_size)
+{
+	struct tcmulib_cmd *cmd;
+
+	if (tcmulib_get_next_commands(dev, &cmd, 1, hm_cmd_size) != 1)
+		return NULL;
+	return cmd;
 }
 
 static int tcmu_sts_to_scsi(int tcmu_sts, uint8_t *sense)
@@ -1286,6 +1604,14 @@ static int tcmu_sts_to_scsi(int tcmu_sts, uint8_t *sense)
 		/* Saving params not supported */
 		tcmu_sense_set_data(sense, ILLEGAL_REQUEST, 0x3900);
 		break;
+	case TCMU_STS_PI_GUARD_ERR:
+		/* Logical block guard check failed */
+		__tcmu_sense_set_data(sense, ABORTED_COMMAND, 0x1001);
+		break;
+	case TCMU_STS_PI_REF_ERR:
+		/* Logical block reference tag check failed */
+		__tcmu_sense_set_data(sense, ABORTED_COMMAND, 0x1003);
+		break;
 	case TCMU_STS_FRMT_IN_PROGRESS:
 		/* Format in progress */
 		__tcmu_sense_set_data(sense, NOT_READY, 0x0404);
@@ -1303,41 +1629,61 @@ static int tcmu_sts_to_scsi(int tcmu_sts, uint8_t *sense)
 	return SAM_STAT_CHECK_CONDITION;
 }
 
-/* update the ring buffer's tail */
-#define TCMU_UPDATE_RB_TAIL(mb, ent) \
-do { \
-	mb->cmd_tail = (mb->cmd_tail + tcmu_hdr_get_len((ent)->hdr.len_op)) % mb->cmdr_size; \
-} while (0)
-
-void tcmulib_command_complete(
-	struct tcmu_device *dev,
-	struct tcmulib_cmd *cmd,
-	int result)
+void tcmulib_commands_complete(struct tcmu_device *dev,
+			       struct tcmulib_cmd **cmds, int *results,
+			       int nr_cmds)
 {
 	struct tcmu_mailbox *mb = dev->map;
-	struct tcmu_cmd_entry *ent = (void *) mb + mb->cmdr_off + mb->cmd_tail;
+	struct tcmu_cmd_entry *ent;
+	struct tcmulib_cmd *cmd;
+	uint32_t head, tail;
+	int i;
 
-	/* current command could be PAD in async case */
-	while (ent != (void *) mb + mb->cmdr_off + mb->cmd_head) {
-		if (tcmu_hdr_get_op(ent->hdr.len_op) == TCMU_OP_CMD)
-			break;
-		TCMU_UPDATE_RB_TAIL(mb, ent);
-		ent = (void *) mb + mb->cmdr_off + mb->cmd_tail;
-	}
+	if (nr_cmds <= 0)
+		return;
 
-	/* cmd_id could be different in async case */
-	if (cmd->cmd_id != ent->hdr.cmd_id) {
-		ent->hdr.cmd_id = cmd->cmd_id;
-	}
+	head = __atomic_load_n(&mb->cmd_head, __ATOMIC_ACQUIRE);
+	tail = mb->cmd_tail;
+
+	for (i = 0; i < nr_cmds; i++) {
+		cmd = cmds[i];
+		ent = ring_entry(mb, tail);
+
+		/* current command could be PAD in async case */
+		while (tail != head &&
+		       tcmu_hdr_get_op(ent->hdr.len_op) != TCMU_OP_CMD) {
+			tail = ring_next(mb, tail, ent);
+			ent = ring_entry(mb, tail);
+		}
+
+		/* cmd_id could be different in async case */
+		if (cmd->cmd_id != ent->hdr.cmd_id) {
+			ent->hdr.cmd_id = cmd->cmd_id;
+		}
+
+		ent->rsp.scsi_status = tcmu_sts_to_scsi(results[i],
+							cmd->sense_buf);
+		if (ent->rsp.scsi_status == SAM_STAT_CHECK_CONDITION) {
+			memcpy(ent->rsp.sense_buffer, cmd->sense_buf,
+			       TCMU_SENSE_BUFFERSIZE);
+		}
+		TCMU_TRACE4(cmd_complete, dev, cmd, cmd->cmd_id,
+			    ent->rsp.scsi_status);
 
-	ent->rsp.scsi_status = tcmu_sts_to_scsi(result, cmd->sense_buf);
-	if (ent->rsp.scsi_status == SAM_STAT_CHECK_CONDITION) {
-		memcpy(ent->rsp.sense_buffer, cmd->sense_buf,
-		       TCMU_SENSE_BUFFERSIZE);
+		tail = ring_next(mb, tail, ent);
+		cmd_pool_put(dev, cmd);
 	}
 
-	TCMU_UPDATE_RB_TAIL(mb, ent);
-	free(cmd);
+	/* Publish the responses above with a single tail update */
+	__atomic_store_n(&mb->cmd_tail, tail, __ATOMIC_RELEASE);
+}
+
+void tcmulib_command_complete(
+	struct tcmu_device *dev,
+	struct tcmulib_cmd *cmd,
+	int result)
+{
+	tcmulib_commands_complete(dev, &cmd, &result, 1);
 }
 
 void tcmulib_processing_start(struct tcmu_device *dev)
@@ -1354,6 +1700,13 @@ void tcmulib_processing_start(struct tcmu_device *dev)
 			 dev->dev_name, errno);
 }
 
+bool tcmulib_has_next_command(struct tcmu_device *dev)
+{
+	struct tcmu_mailbox *mb = dev->map;
+
+	return __atomic_load_n(&mb->cmd_head, __ATOMIC_ACQUIRE) != dev->cmd_tail;
+}
+
 void tcmulib_processing_complete(struct tcmu_device *dev)
 {
 	int r;
@@ -89,6 +89,17 @@ struct tcmulib_context *tcmulib_initialize(
 	struct tcmulib_handler *handlers,
 	size_t handler_count);
 
+/*
+ * Same as tcmulib_initialize, but the devices that already exist are
+ * opened by up to nr_open_threads threads at the same time, so the
+ * handlers' added callbacks must be safe to call concurrently. 0 or 1
+ * opens them one at a time.
+ */
+struct tcmulib_context *tcmulib_initialize_parallel(
+	struct tcmulib_handler *handlers,
+	size_t handler_count,
+	unsigned int nr_open_threads);
+
 /* Register to TCMU DBus service, for the claimed subtypes to be configurable
  * in targetcli. */
 void tcmulib_register(struct tcmulib_context *ctx);
@@ -102,12 +113,31 @@ int tcmulib_get_master_fd(struct tcmulib_context *ctx);
  */
 int tcmulib_master_fd_ready(struct tcmulib_context *ctx);
 
+/*
+ * Look up a device by its uio name (e.g. "uio0") or by its LIO backstore
+ * name. Devices are added and removed from tcmulib_master_fd_ready(), so
+ * call this from the same thread.
+ */
+struct tcmu_device *tcmulib_lookup_dev(struct tcmulib_context *ctx,
+				       const char *name);
+
+/*
+ * Return the number of devices and, in *devs, a malloc()ed array of them
+ * that the caller frees, or -ENOMEM. Same threading rules as
+ * tcmulib_lookup_dev.
+ */
+int tcmulib_get_devs(struct tcmulib_context *ctx, struct tcmu_device ***devs);
+
 /*
  * When a device fd becomes ready, call this to get SCSI cmd info in
  * 'cmd' struct. libtcmu will allocate hm_cmd_size bytes for each cmd
  * that can be accessed via cmd->hm_private pointer. The memory at
  * hm_private will be freed in tcmulib_command_complete.
  *
+ * cmds are taken from a per device pool sized from the device's
+ * hw_queue_depth, so callers should use the same hm_cmd_size on every
+ * call. Must only be called from one thread per device.
+ *
  * Repeat until it returns false.
  */
 struct tcmulib_cmd *tcmulib_get_next_command(struct tcmu_device *dev,
@@ -122,9 +152,32 @@ struct tcmulib_cmd *tcmulib_get_next_command(struct tcmu_device *dev,
  */
 void tcmulib_command_complete(struct tcmu_device *dev, struct tcmulib_cmd *cmd, int result);
 
+/*
+ * Batched versions of tcmulib_get_next_command and
+ * tcmulib_command_complete. tcmulib_get_next_commands fills cmds with up to
+ * max cmds from the ring and returns how many it got, 0 when the ring is
+ * empty. tcmulib_commands_complete completes nr_cmds cmds, cmds[i] with
+ * results[i], with one update of the ring's tail.
+ *
+ * The same rules as for the single cmd calls apply.
+ */
+int tcmulib_get_next_commands(struct tcmu_device *dev,
+			      struct tcmulib_cmd **cmds, int max,
+			      int hm_cmd_size);
+void tcmulib_commands_complete(struct tcmu_device *dev,
+			       struct tcmulib_cmd **cmds, int *results,
+			       int nr_cmds);
+
 /* Call when start processing commands (before calling tcmulib_get_next_command()) */
 void tcmulib_processing_start(struct tcmu_device *dev);
 
+/*
+ * Returns true if the kernel has queued commands that have not been
+ * returned by tcmulib_get_next_command() yet. It only reads the mailbox's
+ * cmd_head, so it is cheap enough to spin on instead of polling the fd.
+ */
+bool tcmulib_has_next_command(struct tcmu_device *dev);
+
 /* Call when complete processing commands (tcmulib_get_next_command() returned NULL) */
 void tcmulib_processing_complete(struct tcmu_device *dev);
 
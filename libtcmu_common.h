@@ -60,6 +60,9 @@ enum {
 	TCMU_STS_INVALID_CP_TGT_DEV_TYPE,
 	TCMU_STS_TOO_MANY_SEG_DESC,
 	TCMU_STS_TOO_MANY_TGT_DESC,
+	/* T10-PI check failures, the sense info is set to the LBA */
+	TCMU_STS_PI_GUARD_ERR,
+	TCMU_STS_PI_REF_ERR,
 };
 
 #define TCMU_THREAD_NAME_LEN 16
@@ -137,6 +140,8 @@ void tcmu_dev_set_solid_state_media(struct tcmu_device *dev, bool solid_state);
 bool tcmu_dev_get_solid_state_media(struct tcmu_device *dev);
 void tcmu_dev_set_unmap_enabled(struct tcmu_device *dev, bool enabled);
 bool tcmu_dev_get_unmap_enabled(struct tcmu_device *dev);
+void tcmu_dev_set_pi_enabled(struct tcmu_device *dev, bool enabled);
+bool tcmu_dev_get_pi_enabled(struct tcmu_device *dev);
 struct tcmulib_handler *tcmu_dev_get_handler(struct tcmu_device *dev);
 void tcmu_dev_flush_ring(struct tcmu_device *dev);
 bool tcmu_dev_oooc_supported(struct tcmu_device* dev);
@@ -173,6 +178,27 @@ void tcmu_iovec_zero(struct iovec *iovec, size_t iov_cnt);
 bool tcmu_iovec_zeroed(struct iovec *iovec, size_t iov_cnt);
 size_t tcmu_iovec_length(struct iovec *iovec, size_t iov_cnt);
 
+/*
+ * T10-PI type 1 protection information tuple of a logical block, big
+ * endian: the T10-DIF CRC of the block's data, an application tag and
+ * the low 32 bits of its LBA.
+ */
+struct tcmu_pi_tuple {
+	uint16_t guard;
+	uint16_t app_tag;
+	uint32_t ref_tag;
+};
+
+/* Checksums and PI tuples */
+uint32_t tcmu_crc32c(uint32_t crc, const void *buf, size_t len);
+uint16_t tcmu_crc_t10dif(uint16_t crc, const void *buf, size_t len);
+void tcmu_pi_generate(struct tcmu_pi_tuple *pi, struct iovec *iovec,
+		      size_t iov_cnt, uint32_t block_size, uint64_t lba,
+		      uint32_t nr_blocks);
+int tcmu_pi_verify(const struct tcmu_pi_tuple *pi, struct iovec *iovec,
+		   size_t iov_cnt, uint32_t block_size, uint64_t lba,
+		   uint32_t nr_blocks, uint32_t *bad_block);
+
 /* memory mangement */
 size_t tcmu_memcpy_into_iovec(struct iovec *iovec, size_t iov_cnt, void *src,
 			      size_t len);
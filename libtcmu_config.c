@@ -191,6 +191,56 @@ static void tcmu_conf_set_options(struct tcmu_config *cfg)
 	TCMU_PARSE_CFG_STR(cfg, log_dir);
 	tcmu_resetup_log_file(cfg, cfg->log_dir);
 
+	/* set default io worker thread count, used for new devices */
+	TCMU_PARSE_CFG_INT(cfg, nr_threads);
+	if (cfg->nr_threads < 0)
+		cfg->nr_threads = 0;
+
+	/* set default thread placement policy, used for new devices */
+	TCMU_PARSE_CFG_STR(cfg, affinity);
+
+	/* set startup device open concurrency, only used at startup */
+	TCMU_PARSE_CFG_INT(cfg, nr_open_threads);
+	if (cfg->nr_open_threads < 1)
+		cfg->nr_open_threads = 1;
+
+	/* set shared cmdproc thread count, only used at startup */
+	TCMU_PARSE_CFG_INT(cfg, reactor_threads);
+	if (cfg->reactor_threads < 0)
+		cfg->reactor_threads = 0;
+
+	/* set device recovery reopen concurrency */
+	TCMU_PARSE_CFG_INT(cfg, recovery_max_reopens);
+	if (cfg->recovery_max_reopens < 1)
+		cfg->recovery_max_reopens = 1;
+
+	/* set ALUA group snapshot lifetime */
+	TCMU_PARSE_CFG_INT(cfg, alua_cache_secs);
+	if (cfg->alua_cache_secs < 0)
+		cfg->alua_cache_secs = 0;
+
+	/* set the memory budget for growing saturated data areas */
+	TCMU_PARSE_CFG_INT(cfg, data_area_budget_mb);
+	if (cfg->data_area_budget_mb < 0)
+		cfg->data_area_budget_mb = 0;
+
+	/* set the default per device QoS limits */
+	TCMU_PARSE_CFG_INT(cfg, qos_read_iops);
+	if (cfg->qos_read_iops < 0)
+		cfg->qos_read_iops = 0;
+	TCMU_PARSE_CFG_INT(cfg, qos_write_iops);
+	if (cfg->qos_write_iops < 0)
+		cfg->qos_write_iops = 0;
+	TCMU_PARSE_CFG_INT(cfg, qos_read_kibps);
+	if (cfg->qos_read_kibps < 0)
+		cfg->qos_read_kibps = 0;
+	TCMU_PARSE_CFG_INT(cfg, qos_write_kibps);
+	if (cfg->qos_write_kibps < 0)
+		cfg->qos_write_kibps = 0;
+	TCMU_PARSE_CFG_INT(cfg, qos_burst_ms);
+	if (cfg->qos_burst_ms < 0)
+		cfg->qos_burst_ms = 0;
+
 	/* add your new config options */
 }
 
@@ -486,6 +536,13 @@ struct tcmu_config* tcmu_initialize_config(void)
 	snprintf(cfg->def_log_dir, PATH_MAX, "%s",
 		 log_dir ? log_dir : TCMU_LOG_DIR_DEFAULT);
 	cfg->def_log_level = TCMU_CONF_LOG_INFO;
+	snprintf(cfg->def_affinity, sizeof(cfg->def_affinity), "%s",
+		 TCMU_CONF_AFFINITY_DEFAULT);
+	cfg->def_nr_open_threads = TCMU_CONF_NR_OPEN_THREADS_DEFAULT;
+	cfg->def_recovery_max_reopens = TCMU_CONF_RECOVERY_MAX_REOPENS_DEFAULT;
+	cfg->def_alua_cache_secs = TCMU_CONF_ALUA_CACHE_SECS_DEFAULT;
+	cfg->def_data_area_budget_mb = TCMU_CONF_DATA_AREA_BUDGET_MB_DEFAULT;
+	cfg->def_qos_burst_ms = TCMU_CONF_QOS_BURST_MS_DEFAULT;
 
 	return cfg;
 }
@@ -14,6 +14,13 @@
 
 #include "ccan/list/list.h"
 
+#define TCMU_CONF_AFFINITY_DEFAULT "spread"
+#define TCMU_CONF_NR_OPEN_THREADS_DEFAULT 8
+#define TCMU_CONF_RECOVERY_MAX_REOPENS_DEFAULT 8
+#define TCMU_CONF_ALUA_CACHE_SECS_DEFAULT 5
+#define TCMU_CONF_DATA_AREA_BUDGET_MB_DEFAULT 0
+#define TCMU_CONF_QOS_BURST_MS_DEFAULT 1000
+
 struct tcmu_config {
 	pthread_t thread_id;
 
@@ -23,6 +30,46 @@ struct tcmu_config {
 	char log_dir[PATH_MAX];
 	char def_log_dir[PATH_MAX];
 
+	/* io worker threads per device, 0 means use the handler's default */
+	int nr_threads;
+	int def_nr_threads;
+
+	/* cmdproc/io thread placement policy, see tcmur_affinity.h */
+	char affinity[256];
+	char def_affinity[256];
+
+	/* threads opening the existing devices at startup */
+	int nr_open_threads;
+	int def_nr_open_threads;
+
+	/* threads running the devices' cmdproc loops, 0 is one per device */
+	int reactor_threads;
+	int def_reactor_threads;
+
+	/* handler opens run at the same time by device recovery */
+	int recovery_max_reopens;
+	int def_recovery_max_reopens;
+
+	/* secs an ALUA group snapshot is used before configfs is rescanned */
+	int alua_cache_secs;
+	int def_alua_cache_secs;
+
+	/* MiB all data areas may be grown to, 0 disables growing them */
+	int data_area_budget_mb;
+	int def_data_area_budget_mb;
+
+	/* per device QoS limits, 0 is unlimited, see tcmur_qos.c */
+	int qos_read_iops;
+	int def_qos_read_iops;
+	int qos_write_iops;
+	int def_qos_write_iops;
+	int qos_read_kibps;
+	int def_qos_read_kibps;
+	int qos_write_kibps;
+	int def_qos_write_kibps;
+	int qos_burst_ms;
+	int def_qos_burst_ms;
+
 	struct tcmulib_context *ctx;
 };
 
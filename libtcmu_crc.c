@@ -0,0 +1,381 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Checksums and T10-PI tuples.
+ *
+ * CRC32C uses the SSE4.2 or ARMv8 CRC instructions when the CPU (or, on
+ * ARM, the build) has them. The T10-DIF CRC16 folds 64 bytes at a time
+ * with carry-less multiplies when the CPU has PCLMULQDQ. Both fall back
+ * to slicing-by-8 tables.
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <endian.h>
+#include <sys/uio.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "libtcmu_common.h"
+
+#define CRC32C_POLY	0x82f63b78	/* reflected */
+#define CRC_T10DIF_POLY	0x8bb7
+
+static uint32_t crc32c_table[8][256];
+static uint16_t crc_t10dif_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static bool crc32c_have_hw;
+static bool crc_t10dif_have_hw;
+
+#if defined(__x86_64__)
+/* x^n mod P for the T10-DIF folding constants */
+static uint64_t crc_t10dif_xpow(unsigned int n)
+{
+	uint32_t r = 1;
+
+	while (n--) {
+		r <<= 1;
+		if (r & 0x10000)
+			r ^= 0x10000 | CRC_T10DIF_POLY;
+	}
+	return r;
+}
+
+static uint64_t crc_t10dif_k[4];
+#endif
+
+static void crc_init(void)
+{
+	uint32_t i, j, crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[0][i] = crc;
+
+		crc = i << 8;
+		for (j = 0; j < 8; j++)
+			crc = crc & 0x8000 ? (crc << 1) ^ CRC_T10DIF_POLY :
+					     crc << 1;
+		crc_t10dif_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++) {
+			crc = crc32c_table[j - 1][i];
+			crc32c_table[j][i] = (crc >> 8) ^
+					     crc32c_table[0][crc & 0xff];
+
+			crc = crc_t10dif_table[j - 1][i];
+			crc_t10dif_table[j][i] = (crc << 8) ^
+					crc_t10dif_table[0][crc >> 8];
+		}
+	}
+
+#if defined(__x86_64__)
+	crc32c_have_hw = __builtin_cpu_supports("sse4.2");
+	crc_t10dif_have_hw = __builtin_cpu_supports("pclmul") &&
+			     __builtin_cpu_supports("ssse3");
+
+	/* Fold by 512 bits in the 4-way loop, by 128 bits otherwise */
+	crc_t10dif_k[0] = crc_t10dif_xpow(512 + 64);
+	crc_t10dif_k[1] = crc_t10dif_xpow(512);
+	crc_t10dif_k[2] = crc_t10dif_xpow(128 + 64);
+	crc_t10dif_k[3] = crc_t10dif_xpow(128);
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+	crc32c_have_hw = true;
+#endif
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len >= 8) {
+		crc ^= p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+		crc = crc32c_table[7][crc & 0xff] ^
+		      crc32c_table[6][(crc >> 8) & 0xff] ^
+		      crc32c_table[5][(crc >> 16) & 0xff] ^
+		      crc32c_table[4][crc >> 24] ^
+		      crc32c_table[3][p[4]] ^ crc32c_table[2][p[5]] ^
+		      crc32c_table[1][p[6]] ^ crc32c_table[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	unsigned long long crc64 = crc, v;
+
+	while (len >= 8) {
+		memcpy(&v, p, sizeof(v));
+		crc64 = __builtin_ia32_crc32di(crc64, v);
+		p += 8;
+		len -= 8;
+	}
+	crc = crc64;
+	while (len--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	return crc;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t v;
+
+	while (len >= 8) {
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32cd(crc, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = __crc32cb(crc, *p++);
+	return crc;
+}
+#endif
+
+/*
+ * tcmu_crc32c - update a CRC32C (Castagnoli)
+ *
+ * This is the raw update: callers start from ~0 and invert the result.
+ */
+uint32_t tcmu_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc_once, crc_init);
+
+#if defined(__x86_64__) || \
+    (defined(__aarch64__) && defined(__ARM_FEATURE_CRC32))
+	if (crc32c_have_hw)
+		return crc32c_hw(crc, buf, len);
+#endif
+	return crc32c_sw(crc, buf, len);
+}
+
+static uint16_t crc_t10dif_sw(uint16_t crc, const unsigned char *p,
+			      size_t len)
+{
+	while (len >= 8) {
+		crc = crc_t10dif_table[7][(p[0] ^ (crc >> 8)) & 0xff] ^
+		      crc_t10dif_table[6][(p[1] ^ crc) & 0xff] ^
+		      crc_t10dif_table[5][p[2]] ^ crc_t10dif_table[4][p[3]] ^
+		      crc_t10dif_table[3][p[4]] ^ crc_t10dif_table[2][p[5]] ^
+		      crc_t10dif_table[1][p[6]] ^ crc_t10dif_table[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = (crc << 8) ^
+		      crc_t10dif_table[0][((crc >> 8) ^ *p++) & 0xff];
+	return crc;
+}
+
+#if defined(__x86_64__)
+/*
+ * The CRC is not reflected, so with the bytes reversed a 128 bit lane is
+ * the polynomial of the 16 message bytes it holds, and x^n mod P times
+ * each half moves it n bits further down the message.
+ */
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i crc_t10dif_fold(__m128i x, __m128i k, __m128i next)
+{
+	return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+					   _mm_clmulepi64_si128(x, k, 0x11)),
+			     next);
+}
+
+__attribute__((target("pclmul,ssse3")))
+static uint16_t crc_t10dif_hw(uint16_t crc, const unsigned char *p,
+			      size_t len)
+{
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+					   11, 12, 13, 14, 15);
+	const __m128i k512 = _mm_set_epi64x(crc_t10dif_k[0], crc_t10dif_k[1]);
+	const __m128i k128 = _mm_set_epi64x(crc_t10dif_k[2], crc_t10dif_k[3]);
+	__m128i x0, x1, x2, x3;
+	unsigned char rest[16];
+
+#define LOAD(off) _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + (off))), bswap)
+
+	/* The initial CRC goes into the first 16 bits of the message */
+	x0 = _mm_xor_si128(LOAD(0), _mm_set_epi64x((uint64_t)crc << 48, 0));
+
+	if (len >= 64) {
+		x1 = LOAD(16);
+		x2 = LOAD(32);
+		x3 = LOAD(48);
+		p += 64;
+		len -= 64;
+
+		while (len >= 64) {
+			x0 = crc_t10dif_fold(x0, k512, LOAD(0));
+			x1 = crc_t10dif_fold(x1, k512, LOAD(16));
+			x2 = crc_t10dif_fold(x2, k512, LOAD(32));
+			x3 = crc_t10dif_fold(x3, k512, LOAD(48));
+			p += 64;
+			len -= 64;
+		}
+
+		x1 = crc_t10dif_fold(x0, k128, x1);
+		x2 = crc_t10dif_fold(x1, k128, x2);
+		x0 = crc_t10dif_fold(x2, k128, x3);
+	} else {
+		p += 16;
+		len -= 16;
+	}
+
+	while (len >= 16) {
+		x0 = crc_t10dif_fold(x0, k128, LOAD(0));
+		p += 16;
+		len -= 16;
+	}
+#undef LOAD
+
+	/* What is left reduces like any other 16 bytes of message */
+	_mm_storeu_si128((__m128i *)rest, _mm_shuffle_epi8(x0, bswap));
+	crc = crc_t10dif_sw(0, rest, sizeof(rest));
+	return crc_t10dif_sw(crc, p, len);
+}
+#endif
+
+/*
+ * tcmu_crc_t10dif - update the CRC16 used as the T10-PI guard tag
+ *
+ * Start from 0, and pass the result back in to continue it over more
+ * data.
+ */
+uint16_t tcmu_crc_t10dif(uint16_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc_once, crc_init);
+
+#if defined(__x86_64__)
+	if (crc_t10dif_have_hw && len >= 16)
+		return crc_t10dif_hw(crc, buf, len);
+#endif
+	return crc_t10dif_sw(crc, buf, len);
+}
+
+/* Walks an iovec block by block without consuming it */
+struct pi_iter {
+	struct iovec *iov;
+	size_t iov_cnt;
+	size_t off;
+};
+
+/*
+ * Steps over a block, computing its guard in crc if it is not NULL.
+ * Returns false if the iovec ends before the block does.
+ */
+static bool pi_block_crc(struct pi_iter *it, uint32_t block_size,
+			 uint16_t *crc)
+{
+	size_t n;
+
+	if (crc)
+		*crc = 0;
+	while (block_size) {
+		if (!it->iov_cnt)
+			return false;
+
+		n = it->iov->iov_len - it->off;
+		if (n > block_size)
+			n = block_size;
+		if (crc)
+			*crc = tcmu_crc_t10dif(*crc,
+					(char *)it->iov->iov_base + it->off, n);
+		block_size -= n;
+		it->off += n;
+		if (it->off == it->iov->iov_len) {
+			it->iov++;
+			it->iov_cnt--;
+			it->off = 0;
+		}
+	}
+	return true;
+}
+
+/*
+ * tcmu_pi_generate - build the T10-PI type 1 tuples of a buffer
+ * @pi: nr_blocks tuples to fill in
+ * @lba: LBA of the first block, the low 32 bits become its reference tag
+ *
+ * The iovec is not consumed. The application tag is left 0.
+ */
+void tcmu_pi_generate(struct tcmu_pi_tuple *pi, struct iovec *iovec,
+		      size_t iov_cnt, uint32_t block_size, uint64_t lba,
+		      uint32_t nr_blocks)
+{
+	struct pi_iter it = { .iov = iovec, .iov_cnt = iov_cnt };
+	uint16_t crc;
+	uint32_t i;
+
+	for (i = 0; i < nr_blocks; i++) {
+		if (!pi_block_crc(&it, block_size, &crc)) {
+			memset(&pi[i], 0, (nr_blocks - i) * sizeof(*pi));
+			return;
+		}
+
+		pi[i].guard = htobe16(crc);
+		pi[i].app_tag = 0;
+		pi[i].ref_tag = htobe32((uint32_t)(lba + i));
+	}
+}
+
+/*
+ * tcmu_pi_verify - check a buffer against its T10-PI type 1 tuples
+ * @bad_block: set to the index of the first block that failed
+ *
+ * Blocks whose tuple is all zeros, which is what a tuple store returns
+ * for blocks that were never written with PI, and ones with the 0xffff
+ * escape application tag are not checked. Returns TCMU_STS_OK,
+ * TCMU_STS_PI_GUARD_ERR or TCMU_STS_PI_REF_ERR.
+ */
+int tcmu_pi_verify(const struct tcmu_pi_tuple *pi, struct iovec *iovec,
+		   size_t iov_cnt, uint32_t block_size, uint64_t lba,
+		   uint32_t nr_blocks, uint32_t *bad_block)
+{
+	static const struct tcmu_pi_tuple unset;
+	struct pi_iter it = { .iov = iovec, .iov_cnt = iov_cnt };
+	uint16_t crc;
+	uint32_t i;
+
+	for (i = 0; i < nr_blocks; i++) {
+		if (!memcmp(&pi[i], &unset, sizeof(unset)) ||
+		    pi[i].app_tag == 0xffff) {
+			if (!pi_block_crc(&it, block_size, NULL))
+				break;
+			continue;
+		}
+
+		if (!pi_block_crc(&it, block_size, &crc))
+			break;
+
+		if (be16toh(pi[i].guard) != crc) {
+			*bad_block = i;
+			return TCMU_STS_PI_GUARD_ERR;
+		}
+		if (be32toh(pi[i].ref_tag) != (uint32_t)(lba + i)) {
+			*bad_block = i;
+			return TCMU_STS_PI_REF_ERR;
+		}
+	}
+
+	return TCMU_STS_OK;
+}
@@ -16,6 +16,9 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/eventfd.h>
 
 #include "libtcmu_log.h"
 #include "libtcmu_config.h"
@@ -24,16 +27,16 @@
 #include "libtcmu.h"
 #include "string_priv.h"
 
-/* tcmu ring buffer for log */
-#define LOG_ENTRY_LEN 256 /* rb[0] is reserved for pri */
+/* per thread tcmu ring buffers for log */
+#define LOG_ENTRY_LEN 256
 #define LOG_MSG_LEN (LOG_ENTRY_LEN - 1) /* the length of the log message */
-#define LOG_ENTRYS (1024 * 32)
+#define LOG_ENTRYS 512 /* per thread, must be a power of 2 */
 
 #define TCMU_LOG_FILENAME_MAX	32
 #define TCMU_LOG_FILENAME	"tcmu-runner.log"
 
 typedef int (*log_output_fn_t)(int priority, const char *timestamp,
-			       const char *str, void *data);
+			       const char *pname, const char *str, void *data);
 typedef void (*log_close_fn_t)(void *data);
 
 struct log_output {
@@ -43,15 +46,47 @@ struct log_output {
 	void *data;
 };
 
-struct log_buf {
-	pthread_cond_t cond;
-	pthread_mutex_t lock;
+struct log_entry {
+	struct timeval tv;
+	uint8_t pri;
+	char pname[TCMU_THREAD_NAME_LEN];
+	char msg[LOG_MSG_LEN];
+};
 
-	bool thread_active;
+/*
+ * Single producer, single consumer ring. Only the owning thread formats
+ * messages into it and moves head, and only the log thread moves tail.
+ * When the ring is full new messages are dropped and counted.
+ */
+struct log_ring {
+	struct log_ring *next;
 
 	unsigned int head;
 	unsigned int tail;
-	char buf[LOG_ENTRYS][LOG_ENTRY_LEN];
+	unsigned int dropped;
+	bool exited;
+
+	/* Cached name of the owning thread, only used by that thread */
+	char pname[TCMU_THREAD_NAME_LEN];
+	bool pname_valid;
+
+	struct log_entry entries[LOG_ENTRYS];
+};
+
+struct log_buf {
+	/*
+	 * Producers write to efd when they queue a msg while thread_active
+	 * is false.
+	 */
+	int efd;
+	bool thread_active;
+	bool stop;
+
+	/* Every thread that has logged, newest first */
+	pthread_mutex_t rings_lock;
+	struct log_ring *rings;
+	pthread_key_t ring_key;
+
 	struct log_output *syslog_out;
 	struct log_output *file_out;
 	pthread_mutex_t file_out_lock;
@@ -61,6 +96,14 @@ struct log_buf {
 static int tcmu_log_level = TCMU_LOG_INFO;
 static struct log_buf *tcmu_logbuf;
 
+/*
+ * The calling thread's ring. log_cleanup frees the rings of all threads
+ * and bumps tcmu_log_gen, so a pointer from an older generation is stale.
+ */
+static __thread struct log_ring *tcmu_log_ring;
+static __thread unsigned int tcmu_log_ring_gen;
+static unsigned int tcmu_log_gen;
+
 static char *tcmu_log_dir;
 static pthread_mutex_t tcmu_log_dir_lock = PTHREAD_MUTEX_INITIALIZER;
 
@@ -107,45 +150,6 @@ void tcmu_set_log_level(int level)
 	tcmu_log_level = to_syslog_level(level);
 }
 
-static inline uint8_t rb_get_pri(struct log_buf *logbuf, unsigned int cur)
-{
-	return logbuf->buf[cur][0];
-}
-
-static inline void rb_set_pri(struct log_buf *logbuf, unsigned int cur, uint8_t pri)
-{
-	logbuf->buf[cur][0] = (char)pri;
-}
-
-static inline char *rb_get_msg(struct log_buf *logbuf, unsigned int cur)
-{
-	return logbuf->buf[cur] + 1;
-}
-
-static inline bool rb_is_empty(struct log_buf *logbuf)
-{
-	return logbuf->tail == logbuf->head;
-}
-
-static inline bool rb_is_full(struct log_buf *logbuf)
-{
-	return logbuf->tail == (logbuf->head + 1) % LOG_ENTRYS;
-}
-
-static inline void rb_update_tail(struct log_buf *logbuf)
-{
-	logbuf->tail = (logbuf->tail + 1) % LOG_ENTRYS;
-}
-
-static inline void rb_update_head(struct log_buf *logbuf)
-{
-	/* when the ring buffer is full, the oldest log will be dropped */
-	if (rb_is_full(logbuf))
-		rb_update_tail(logbuf);
-
-	logbuf->head = (logbuf->head + 1) % LOG_ENTRYS;
-}
-
 static void log_cleanup_output(struct log_output *output)
 {
 	if (output->close_fn != NULL)
@@ -164,9 +168,20 @@ static void tcmu_log_dir_free(void)
 static void log_cleanup(void *arg)
 {
 	struct log_buf *logbuf = arg;
+	struct log_ring *ring;
+
+	if (tcmu_logbuf == logbuf)
+		tcmu_logbuf = NULL;
+	__atomic_add_fetch(&tcmu_log_gen, 1, __ATOMIC_RELEASE);
+	tcmu_log_ring = NULL;
 
-	pthread_cond_destroy(&logbuf->cond);
-	pthread_mutex_destroy(&logbuf->lock);
+	while ((ring = logbuf->rings)) {
+		logbuf->rings = ring->next;
+		free(ring);
+	}
+	pthread_key_delete(logbuf->ring_key);
+	close(logbuf->efd);
+	pthread_mutex_destroy(&logbuf->rings_lock);
 	pthread_mutex_destroy(&logbuf->file_out_lock);
 
 	if (logbuf->syslog_out)
@@ -178,37 +193,81 @@ static void log_cleanup(void *arg)
 	tcmu_log_dir_free();
 }
 
-static void log_output(struct log_buf *logbuf, int pri, const char *msg,
-		       struct log_output *output)
+static void log_output(struct log_buf *logbuf, struct log_entry *entry,
+		       const char *timestamp, struct log_output *output)
 {
-	char timestamp[TCMU_TIME_STRING_BUFLEN] = {0, };
-
 	if (!output)
 		return;
 
-	if (time_string_now(timestamp) < 0)
-		return;
+	output->output_fn(entry->pri, timestamp, entry->pname, entry->msg,
+			  output->data);
+}
 
-	output->output_fn(pri, timestamp, msg, output->data);
+static void log_ring_exit(void *arg)
+{
+	struct log_ring *ring = arg;
+
+	/* The log thread frees it once it has been drained */
+	__atomic_store_n(&ring->exited, true, __ATOMIC_RELEASE);
 }
 
-static void log_queue_msg(struct log_buf *logbuf, int pri, char *buf)
+static struct log_ring *log_cur_ring(void)
 {
-	unsigned int head;
-	char *msg;
+	if (tcmu_log_ring_gen != __atomic_load_n(&tcmu_log_gen,
+						 __ATOMIC_ACQUIRE))
+		tcmu_log_ring = NULL;
+	return tcmu_log_ring;
+}
 
-	pthread_mutex_lock(&logbuf->lock);
+static struct log_ring *log_get_ring(struct log_buf *logbuf)
+{
+	struct log_ring *ring = log_cur_ring();
+
+	if (ring)
+		return ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	if (pthread_setspecific(logbuf->ring_key, ring)) {
+		free(ring);
+		return NULL;
+	}
+
+	tcmu_log_ring_gen = __atomic_load_n(&tcmu_log_gen, __ATOMIC_ACQUIRE);
+	pthread_mutex_lock(&logbuf->rings_lock);
+	ring->next = logbuf->rings;
+	logbuf->rings = ring;
+	pthread_mutex_unlock(&logbuf->rings_lock);
+
+	tcmu_log_ring = ring;
+	return ring;
+}
 
-	head = logbuf->head;
-	rb_set_pri(logbuf, head, pri);
-	msg = rb_get_msg(logbuf, head);
-	memcpy(msg, buf, LOG_MSG_LEN);
-	rb_update_head(logbuf);
+/*
+ * Called when the thread is renamed so the next msg picks up the new
+ * name.
+ */
+void tcmu_log_reset_thread_name(void)
+{
+	struct log_ring *ring = log_cur_ring();
 
-	if (logbuf->thread_active == false)
-		pthread_cond_signal(&logbuf->cond);
+	if (ring)
+		ring->pname_valid = false;
+}
+
+static void log_wake_thread(struct log_buf *logbuf)
+{
+	uint64_t val = 1;
+
+	/* pairs with the recheck in log_thread_start */
+	if (__atomic_load_n(&logbuf->thread_active, __ATOMIC_SEQ_CST))
+		return;
 
-	pthread_mutex_unlock(&logbuf->lock);
+	if (write(logbuf->efd, &val, sizeof(val)) < 0) {
+		/* eventfd only fails here if the counter would overflow */
+	}
 }
 
 static void cleanup_file_out_lock(void *arg)
@@ -218,13 +277,22 @@ static void cleanup_file_out_lock(void *arg)
 	pthread_mutex_unlock(&logbuf->file_out_lock);
 }
 
+/*
+ * The msg is formatted by the calling thread straight into its own ring,
+ * since the arguments may not outlive the call, and then the log thread
+ * does the output. No lock is taken except the first time a thread logs.
+ */
 static void
 log_internal(int pri, struct tcmu_device *dev, const char *funcname,
 	     int linenr, const char *fmt, va_list args)
 {
-	char buf[LOG_MSG_LEN];
-	int n;
+	struct log_buf *logbuf = tcmu_logbuf;
 	struct tcmulib_handler *handler;
+	struct log_entry *entry;
+	struct log_ring *ring;
+	unsigned int head;
+	char *buf;
+	int n;
 
 	if (pri > tcmu_log_level)
 		return;
@@ -232,37 +300,81 @@ log_internal(int pri, struct tcmu_device *dev, const char *funcname,
 	if (!fmt)
 		return;
 
-	if (!tcmu_logbuf) {
+	if (!logbuf) {
 		/* handle early log calls by config and deamon setup */
 		vfprintf(stderr, fmt, args);
 		return;
 	}
 
+	ring = log_get_ring(logbuf);
+	if (!ring)
+		return;
+
+	head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+	    LOG_ENTRYS) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		log_wake_thread(logbuf);
+		return;
+	}
+	entry = &ring->entries[head & (LOG_ENTRYS - 1)];
+	buf = entry->msg;
+
+	gettimeofday(&entry->tv, NULL);
+	entry->pri = pri;
+
+	if (!ring->pname_valid) {
+		if (pthread_getname_np(pthread_self(), ring->pname,
+				       TCMU_THREAD_NAME_LEN))
+			ring->pname[0] = '\0';
+		ring->pname_valid = true;
+	}
+	memcpy(entry->pname, ring->pname, TCMU_THREAD_NAME_LEN);
+
 	/* Format the log msg */
 	if (dev) {
 		handler = tcmu_dev_get_handler(dev);
-		n = sprintf(buf, "%s:%d %s/%s: ", funcname, linenr,
-		            handler ? handler->subtype: "",
-		            dev ? dev->tcm_dev_name: "");
+		n = snprintf(buf, LOG_MSG_LEN, "%s:%d %s/%s: ", funcname,
+			     linenr, handler ? handler->subtype: "",
+			     dev ? dev->tcm_dev_name: "");
 	} else {
-		n = sprintf(buf, "%s:%d: ", funcname, linenr);
+		n = snprintf(buf, LOG_MSG_LEN, "%s:%d: ", funcname, linenr);
 	}
 
-	vsnprintf(buf + n, LOG_MSG_LEN - n, fmt, args);
+	if (n >= 0 && n < LOG_MSG_LEN)
+		vsnprintf(buf + n, LOG_MSG_LEN - n, fmt, args);
 
-	/*
-	 * Avoid overflowing the log buf with SCSI CDBs.
-	 */
-	if (pri < TCMU_LOG_DEBUG_SCSI_CMD)
-		log_queue_msg(tcmu_logbuf, pri, buf);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+	log_wake_thread(logbuf);
+}
+
+bool tcmu_log_ratelimit(struct tcmu_log_ratelimit *rl, const char *funcname,
+			int linenr)
+{
+	struct timespec now;
+	unsigned int missed;
+	long window;
 
-	pthread_cleanup_push(cleanup_file_out_lock, tcmu_logbuf);
-	pthread_mutex_lock(&tcmu_logbuf->file_out_lock);
+	if (clock_gettime(CLOCK_MONOTONIC_COARSE, &now))
+		return true;
 
-	log_output(tcmu_logbuf, pri, buf, tcmu_logbuf->file_out);
+	window = now.tv_sec / TCMU_LOG_RATELIMIT_INTERVAL;
+	if (__atomic_load_n(&rl->window, __ATOMIC_RELAXED) != window) {
+		__atomic_store_n(&rl->window, window, __ATOMIC_RELAXED);
+		__atomic_store_n(&rl->printed, 0, __ATOMIC_RELAXED);
 
-	pthread_mutex_unlock(&tcmu_logbuf->file_out_lock);
-	pthread_cleanup_pop(0);
+		missed = __atomic_exchange_n(&rl->missed, 0, __ATOMIC_RELAXED);
+		if (missed)
+			tcmu_warn_message(NULL, funcname, linenr,
+					  "%u messages suppressed\n", missed);
+	}
+
+	if (__atomic_add_fetch(&rl->printed, 1, __ATOMIC_RELAXED) <=
+	    TCMU_LOG_RATELIMIT_BURST)
+		return true;
+
+	__atomic_add_fetch(&rl->missed, 1, __ATOMIC_RELAXED);
+	return false;
 }
 
 void tcmu_crit_message(struct tcmu_device *dev, const char *funcname,
@@ -345,7 +457,7 @@ create_output(log_output_fn_t output_fn, log_close_fn_t close_fn, void *data,
 }
 
 static int output_to_syslog(int pri, const char *timestamp,
-                            const char *str, void *data)
+			    const char *pname, const char *str, void *data)
 {
 	/* convert tcmu-runner private level to system level */
 	if (pri > TCMU_LOG_DEBUG)
@@ -398,12 +510,11 @@ static const char *loglevel_string(int priority)
 }
 
 static int output_to_fd(int pri, const char *timestamp,
-                        const char *str,void *data)
+			const char *pname, const char *str, void *data)
 {
 	int fd = (intptr_t) data;
 	char *buf, *msg;
 	int count, ret, written = 0, r, pid = 0;
-	char pname[TCMU_THREAD_NAME_LEN];
 
 	if (fd == -1)
 		return -1;
@@ -412,9 +523,6 @@ static int output_to_fd(int pri, const char *timestamp,
 	if (pid <= 0)
 		return -1;
 
-	if (pthread_getname_np(pthread_self(), pname, TCMU_THREAD_NAME_LEN))
-		return -1;
-
 	/*
 	 * format: timestamp pid [loglevel] msg
 	 */
@@ -490,51 +598,131 @@ static int create_file_output(struct log_buf *logbuf, int pri,
 	return 0;
 }
 
-static bool log_dequeue_msg(struct log_buf *logbuf)
+static void log_output_entry(struct log_buf *logbuf, struct log_entry *entry)
 {
-	unsigned int tail;
-	uint8_t pri;
-	char *msg, buf[LOG_MSG_LEN];
-
-	pthread_mutex_lock(&logbuf->lock);
-	if (rb_is_empty(logbuf)) {
-		logbuf->thread_active = false;
-		pthread_mutex_unlock(&logbuf->lock);
-		return false;
-	}
+	char timestamp[TCMU_TIME_STRING_BUFLEN] = {0, };
 
-	tail = logbuf->tail;
-	pri = rb_get_pri(logbuf, tail);
-	msg = rb_get_msg(logbuf, tail);
-	memcpy(buf, msg, LOG_MSG_LEN);
-	rb_update_tail(logbuf);
-	pthread_mutex_unlock(&logbuf->lock);
+	if (time_string(timestamp, &entry->tv) < 0)
+		return;
 
 	/*
 	 * This may block due to rsyslog and syslog-ng, etc.
 	 * And the log productors could still insert their log
-	 * messages into the ring buffer without blocking. But
-	 * the ring buffer may lose some old log rbs if the
-	 * ring buffer is full.
+	 * messages into their ring buffers without blocking. But
+	 * a ring buffer may drop new msgs if it is full.
+	 *
+	 * Avoid overflowing syslog with SCSI CDBs.
 	 */
-	log_output(logbuf, pri, buf, logbuf->syslog_out);
+	if (entry->pri < TCMU_LOG_DEBUG_SCSI_CMD)
+		log_output(logbuf, entry, timestamp, logbuf->syslog_out);
 
-	return true;
+	pthread_cleanup_push(cleanup_file_out_lock, logbuf);
+	pthread_mutex_lock(&logbuf->file_out_lock);
+
+	log_output(logbuf, entry, timestamp, logbuf->file_out);
+
+	pthread_mutex_unlock(&logbuf->file_out_lock);
+	pthread_cleanup_pop(0);
+}
+
+static bool log_drain_ring(struct log_buf *logbuf, struct log_ring *ring)
+{
+	struct log_entry *entry, dropped_entry;
+	unsigned int tail, dropped;
+	bool drained = false;
+
+	tail = ring->tail;
+	while (tail != __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST)) {
+		entry = &ring->entries[tail & (LOG_ENTRYS - 1)];
+		log_output_entry(logbuf, entry);
+		__atomic_store_n(&ring->tail, ++tail, __ATOMIC_RELEASE);
+		drained = true;
+	}
+
+	dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+	if (dropped) {
+		memset(&dropped_entry, 0, sizeof(dropped_entry));
+		gettimeofday(&dropped_entry.tv, NULL);
+		dropped_entry.pri = TCMU_LOG_WARN;
+		snprintf(dropped_entry.msg, LOG_MSG_LEN,
+			 "%u log messages dropped, log ring full\n", dropped);
+		log_output_entry(logbuf, &dropped_entry);
+		drained = true;
+	}
+
+	return drained;
+}
+
+/*
+ * Output every queued msg and free the rings of exited threads. Returns
+ * true if anything was output.
+ */
+static bool log_drain(struct log_buf *logbuf)
+{
+	struct log_ring *ring, **prev;
+	bool drained = false, reap = false;
+
+	pthread_mutex_lock(&logbuf->rings_lock);
+	ring = logbuf->rings;
+	pthread_mutex_unlock(&logbuf->rings_lock);
+
+	/* New rings are only added at the head, so the rest can be walked */
+	for (; ring; ring = ring->next) {
+		if (log_drain_ring(logbuf, ring))
+			drained = true;
+		if (__atomic_load_n(&ring->exited, __ATOMIC_ACQUIRE))
+			reap = true;
+	}
+
+	if (!reap)
+		return drained;
+
+	pthread_mutex_lock(&logbuf->rings_lock);
+	prev = &logbuf->rings;
+	while ((ring = *prev)) {
+		if (__atomic_load_n(&ring->exited, __ATOMIC_ACQUIRE)) {
+			/* The thread is gone, so nothing new can be queued */
+			log_drain_ring(logbuf, ring);
+			*prev = ring->next;
+			free(ring);
+			continue;
+		}
+		prev = &ring->next;
+	}
+	pthread_mutex_unlock(&logbuf->rings_lock);
+
+	return drained;
 }
 
 static void *log_thread_start(void *arg)
 {
+	struct log_buf *logbuf = arg;
+	uint64_t val;
+
 	tcmu_set_thread_name("logger", NULL);
 
 	pthread_cleanup_push(log_cleanup, arg);
 
 	while (1) {
-		pthread_mutex_lock(&tcmu_logbuf->lock);
-		pthread_cond_wait(&tcmu_logbuf->cond, &tcmu_logbuf->lock);
-		tcmu_logbuf->thread_active = true;
-		pthread_mutex_unlock(&tcmu_logbuf->lock);
+		while (log_drain(logbuf));
 
-		while (log_dequeue_msg(tcmu_logbuf));
+		/* tcmu_destroy_log wants everything queued so far written */
+		if (__atomic_load_n(&logbuf->stop, __ATOMIC_ACQUIRE))
+			break;
+
+		__atomic_store_n(&logbuf->thread_active, false,
+				 __ATOMIC_SEQ_CST);
+		/*
+		 * Recheck so a msg queued before the producer could see
+		 * thread_active go false is not left behind.
+		 */
+		if (!log_drain(logbuf)) {
+			if (read(logbuf->efd, &val, sizeof(val)) < 0 &&
+			    errno != EINTR)
+				break;
+		}
+		__atomic_store_n(&logbuf->thread_active, true,
+				 __ATOMIC_RELAXED);
 	}
 
 	pthread_cleanup_pop(1);
@@ -679,11 +867,15 @@ int tcmu_setup_log(char *log_dir)
 	if (!logbuf)
 		goto free_log_dir;
 
+	logbuf->efd = eventfd(0, EFD_CLOEXEC);
+	if (logbuf->efd < 0)
+		goto free_logbuf;
+
+	if (pthread_key_create(&logbuf->ring_key, log_ring_exit))
+		goto close_efd;
+
 	logbuf->thread_active = false;
-	logbuf->head = 0;
-	logbuf->tail = 0;
-	pthread_cond_init(&logbuf->cond, NULL);
-	pthread_mutex_init(&logbuf->lock, NULL);
+	pthread_mutex_init(&logbuf->rings_lock, NULL);
 	pthread_mutex_init(&logbuf->file_out_lock, NULL);
 
 	ret = create_syslog_output(logbuf, TCMU_LOG_INFO, NULL);
@@ -706,6 +898,10 @@ int tcmu_setup_log(char *log_dir)
 
 	return 0;
 
+close_efd:
+	close(logbuf->efd);
+free_logbuf:
+	free(logbuf);
 free_log_dir:
 	tcmu_log_dir_free();
 	return -ENOMEM;
@@ -775,11 +971,18 @@ int tcmu_resetup_log_file(struct tcmu_config *cfg, char *log_dir)
 
 void tcmu_destroy_log()
 {
+	struct log_buf *logbuf = tcmu_logbuf;
 	pthread_t thread;
 	void *join_retval;
+	uint64_t val = 1;
+
+	if (!logbuf)
+		return;
 
-	thread = tcmu_logbuf->thread_id;
-	if (pthread_cancel(thread))
+	thread = logbuf->thread_id;
+	__atomic_store_n(&logbuf->stop, true, __ATOMIC_RELEASE);
+	if (write(logbuf->efd, &val, sizeof(val)) < 0 &&
+	    pthread_cancel(thread))
 		return;
 
 	pthread_join(thread, &join_retval);
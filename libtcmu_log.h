@@ -47,18 +47,54 @@ void tcmu_dbg_message(struct tcmu_device *dev, const char *funcname, int linenr,
 __attribute__ ((format (printf, 4, 5)))
 void tcmu_dbg_scsi_cmd_message(struct tcmu_device *dev, const char *funcname, int linenr, const char *fmt, ...);
 
-#define tcmu_dev_crit(dev, ...)  do { tcmu_crit_message(dev, __func__, __LINE__, __VA_ARGS__);} while (0)
-#define tcmu_dev_err(dev, ...)  do { tcmu_err_message(dev, __func__, __LINE__, __VA_ARGS__);} while (0)
-#define tcmu_dev_warn(dev, ...) do { tcmu_warn_message(dev, __func__, __LINE__, __VA_ARGS__);} while (0)
-#define tcmu_dev_info(dev, ...) do { tcmu_info_message(dev, __func__, __LINE__, __VA_ARGS__);} while (0)
-#define tcmu_dev_dbg(dev, ...)  do { tcmu_dbg_message(dev, __func__, __LINE__, __VA_ARGS__);} while (0)
-#define tcmu_dev_dbg_scsi_cmd(dev, ...)  do { tcmu_dbg_scsi_cmd_message(dev, __func__, __LINE__, __VA_ARGS__);} while (0)
+/*
+ * Per call site rate limit for the error and warning macros. At most
+ * TCMU_LOG_RATELIMIT_BURST messages are logged from one call site every
+ * TCMU_LOG_RATELIMIT_INTERVAL seconds, and the number suppressed is
+ * logged when the call site logs again.
+ */
+#define TCMU_LOG_RATELIMIT_INTERVAL	5
+#define TCMU_LOG_RATELIMIT_BURST	100
+
+struct tcmu_log_ratelimit {
+	long window;
+	unsigned int printed;
+	unsigned int missed;
+};
+
+bool tcmu_log_ratelimit(struct tcmu_log_ratelimit *rl, const char *funcname,
+			int linenr);
+
+/* Checked before the arguments are evaluated or anything is formatted */
+#define tcmu_log_enabled(pri) ((int)(pri) <= (int)tcmu_get_log_level())
+
+#define __tcmu_log(pri, fn, dev, ...)					\
+	do {								\
+		if (tcmu_log_enabled(pri))				\
+			fn(dev, __func__, __LINE__, __VA_ARGS__);	\
+	} while (0)
+
+#define __tcmu_log_ratelimited(pri, fn, dev, ...)			\
+	do {								\
+		static struct tcmu_log_ratelimit __tcmu_rl;		\
+									\
+		if (tcmu_log_enabled(pri) &&				\
+		    tcmu_log_ratelimit(&__tcmu_rl, __func__, __LINE__))	\
+			fn(dev, __func__, __LINE__, __VA_ARGS__);	\
+	} while (0)
+
+#define tcmu_dev_crit(dev, ...) __tcmu_log(TCMU_LOG_CRIT, tcmu_crit_message, dev, __VA_ARGS__)
+#define tcmu_dev_err(dev, ...) __tcmu_log_ratelimited(TCMU_LOG_ERROR, tcmu_err_message, dev, __VA_ARGS__)
+#define tcmu_dev_warn(dev, ...) __tcmu_log_ratelimited(TCMU_LOG_WARN, tcmu_warn_message, dev, __VA_ARGS__)
+#define tcmu_dev_info(dev, ...) __tcmu_log(TCMU_LOG_INFO, tcmu_info_message, dev, __VA_ARGS__)
+#define tcmu_dev_dbg(dev, ...) __tcmu_log(TCMU_LOG_DEBUG, tcmu_dbg_message, dev, __VA_ARGS__)
+#define tcmu_dev_dbg_scsi_cmd(dev, ...) __tcmu_log(TCMU_LOG_DEBUG_SCSI_CMD, tcmu_dbg_scsi_cmd_message, dev, __VA_ARGS__)
 
 
-#define tcmu_crit(...) do { tcmu_crit_message(NULL, __func__, __LINE__, __VA_ARGS__);} while (0)
-#define tcmu_err(...)  do { tcmu_err_message(NULL, __func__, __LINE__, __VA_ARGS__);} while (0)
-#define tcmu_warn(...) do { tcmu_warn_message(NULL, __func__, __LINE__, __VA_ARGS__);} while (0)
-#define tcmu_info(...) do { tcmu_info_message(NULL, __func__, __LINE__, __VA_ARGS__);} while (0)
-#define tcmu_dbg(...)  do { tcmu_dbg_message(NULL, __func__, __LINE__, __VA_ARGS__);} while (0)
-#define tcmu_dbg_scsi_cmd(...)  do { tcmu_dbg_scsi_cmd_message(NULL, __func__, __LINE__, __VA_ARGS__);} while (0)
+#define tcmu_crit(...) tcmu_dev_crit(NULL, __VA_ARGS__)
+#define tcmu_err(...) tcmu_dev_err(NULL, __VA_ARGS__)
+#define tcmu_warn(...) tcmu_dev_warn(NULL, __VA_ARGS__)
+#define tcmu_info(...) tcmu_dev_info(NULL, __VA_ARGS__)
+#define tcmu_dbg(...) tcmu_dev_dbg(NULL, __VA_ARGS__)
+#define tcmu_dbg_scsi_cmd(...) tcmu_dev_dbg_scsi_cmd(NULL, __VA_ARGS__)
 #endif /* __TCMU_LOG_H */
@@ -23,6 +23,33 @@
 
 #define KERN_IFACE_VER 2
 
+/*
+ * Commands whose cdb or iovec do not fit in a pool object are allocated
+ * from the heap instead.
+ */
+#define TCMU_CMD_POOL_MAX_CDB_LEN	32
+#define TCMU_CMD_POOL_MAX_IOV_CNT	16
+#define TCMU_CMD_POOL_DEF_DEPTH		128
+
+struct tcmu_cmd_pool_entry {
+	struct tcmu_cmd_pool_entry *next;
+};
+
+/*
+ * Per device cache of tcmulib_cmds. The slab is carved up when the first
+ * command is fetched, because that is when we learn hm_cmd_size, and the
+ * objects are recycled through free_list after that.
+ */
+struct tcmu_cmd_pool {
+	pthread_spinlock_t lock;
+	struct tcmu_cmd_pool_entry *free_list;
+
+	char *slab;
+	size_t obj_size;
+	uint32_t depth;
+	int hm_cmd_size;
+};
+
 // The full (private) declaration
 struct tcmulib_context {
 	darray(struct tcmulib_handler) handlers;
@@ -43,6 +70,8 @@ struct tcmu_device {
 
 	uint32_t cmd_tail;
 
+	struct tcmu_cmd_pool cmd_pool;
+
 	uint64_t num_lbas;
 	uint32_t block_size;
 	uint32_t block_size_shift;
@@ -55,6 +84,7 @@ struct tcmu_device {
 	unsigned int write_cache_enabled:1;
 	unsigned int solid_state_media:1;
 	unsigned int unmap_enabled:1;
+	unsigned int pi_enabled:1;
 
 	char dev_name[16]; /* e.g. "uio14" */
 	char tcm_hba_name[16]; /* e.g. "user_8" */
@@ -67,4 +97,7 @@ struct tcmu_device {
 	void *hm_private; /* private ptr for handler module */
 };
 
+/* Drop the thread name cached by the logger after renaming a thread */
+void tcmu_log_reset_thread_name(void);
+
 #endif
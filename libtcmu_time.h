@@ -20,7 +20,10 @@
     (4 + 1 + 2 + 1 + 2 + 1 + 2 + 1 + 2 + 1 + 2 + 1 + 3 + 1)
 /*   Yr      Mon     Day     Hour    Min     Sec     Ms  NULL */
 
+struct timeval;
+
 /* generate localtime string into buf */
 int time_string_now(char* buf);
+int time_string(char *buf, const struct timeval *tv);
 
 #endif /* __TCMU_TIME_H */
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * USDT probes along the command lifecycle, for use with bpftrace, perf
+ * or systemtap. All probes are in the "tcmu" provider, and pass the
+ * tcmu_device and the tcmulib_cmd as their first two arguments, so a
+ * cmd can be followed from the ring fetch to its completion:
+ *
+ * cmd_fetch(dev, cmd, cmd_id, opcode)		libtcmu, ring entry parsed
+ * cmd_dispatch(dev, cmd, opcode)		runner, cmd handed to the cmd ops
+ * aio_enqueue(dev, cmd, overflow, prio)	runner, cmd queued to the io threads
+ * aio_dequeue(dev, cmd, worker)		runner, cmd picked up by an io thread
+ * handler_submit(dev, cmd)			runner, handler callout called
+ * handler_done(dev, cmd, sts)			runner, tcmur_cmd_complete called
+ * rbd_aio_done(dev, cmd, ret)			rbd, librbd completion callback
+ * glfs_aio_done(dev, cmd, ret)			glfs, gfapi completion callback
+ * cmd_complete(dev, cmd, cmd_id, scsi_status)	libtcmu, response put on ring
+ *
+ * Without sys/sdt.h at build time the probes compile away. With it, a
+ * disabled probe is a single nop.
+ */
+
+#ifndef __LIBTCMU_TRACE_H
+#define __LIBTCMU_TRACE_H
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define TCMU_TRACE2(name, a1, a2) \
+	DTRACE_PROBE2(tcmu, name, a1, a2)
+#define TCMU_TRACE3(name, a1, a2, a3) \
+	DTRACE_PROBE3(tcmu, name, a1, a2, a3)
+#define TCMU_TRACE4(name, a1, a2, a3, a4) \
+	DTRACE_PROBE4(tcmu, name, a1, a2, a3, a4)
+
+#else
+
+#define TCMU_TRACE2(name, a1, a2) do { } while (0)
+#define TCMU_TRACE3(name, a1, a2, a3) do { } while (0)
+#define TCMU_TRACE4(name, a1, a2, a3, a4) do { } while (0)
+
+#endif
+
+#endif
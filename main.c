@@ -34,6 +34,8 @@
 #include <scsi/scsi.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #include <libkmod.h>
 #include <sys/utsname.h>
@@ -49,11 +51,21 @@
 #include "libtcmu_config.h"
 #include "libtcmu_log.h"
 #include "tcmur_work.h"
+#include "tcmur_affinity.h"
+#include "tcmur_stats.h"
+#include "tcmur_data_area.h"
+#include "tcmur_qos.h"
+#include "tcmur_reactor.h"
 
 #define TCMU_LOCK_FILE   "/run/tcmu.lock"
 
 static char *handler_path = DEFAULT_HANDLER_PATH;
 
+/* Prometheus text file the device stats are written to, if set */
+#define TCMUR_STATS_FILE_INTERVAL 10
+static char *stats_file;
+static unsigned int stats_interval = TCMUR_STATS_FILE_INTERVAL;
+
 static struct tcmu_config *tcmu_cfg;
 
 darray(struct tcmur_handler *) g_runner_handlers = darray_new();
@@ -233,6 +245,60 @@ static gboolean handle_sighup(gpointer user_data)
 	return G_SOURCE_CONTINUE;
 }
 
+/*
+ * Runs from the main loop, like device add/remove, so the device list
+ * cannot change under us. The file is replaced atomically so scrapers
+ * never see a partial one.
+ */
+static gboolean write_stats_file(gpointer user_data)
+{
+	struct tcmulib_context *ctx = user_data;
+	struct tcmu_device **devs;
+	char tmp[PATH_MAX];
+	int nr_devs, ret;
+	FILE *fp;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", stats_file) >= sizeof(tmp))
+		return G_SOURCE_CONTINUE;
+
+	nr_devs = tcmulib_get_devs(ctx, &devs);
+	if (nr_devs < 0)
+		return G_SOURCE_CONTINUE;
+
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		tcmu_err("Could not open stats file %s: %m\n", tmp);
+		goto free_devs;
+	}
+
+	tcmur_stats_print_prom(fp, devs, nr_devs);
+
+	ret = fclose(fp);
+	if (ret || rename(tmp, stats_file)) {
+		tcmu_err("Could not write stats file %s: %m\n", stats_file);
+		unlink(tmp);
+	}
+
+free_devs:
+	free(devs);
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean check_data_area(gpointer user_data)
+{
+	struct tcmulib_context *ctx = user_data;
+	struct tcmu_device **devs;
+	int nr_devs;
+
+	nr_devs = tcmulib_get_devs(ctx, &devs);
+	if (nr_devs < 0)
+		return G_SOURCE_CONTINUE;
+
+	tcmur_data_area_check(devs, nr_devs);
+	free(devs);
+	return G_SOURCE_CONTINUE;
+}
+
 gboolean tcmulib_callback(GIOChannel *source,
 			  GIOCondition condition,
 			  gpointer data)
@@ -271,6 +337,137 @@ on_check_config(TCMUService1 *interface,
 	return TRUE;
 }
 
+static gboolean
+on_get_latency_stats(TCMUService1 *interface,
+		     GDBusMethodInvocation *invocation,
+		     gchar *dev_name,
+		     gpointer user_data)
+{
+	struct tcmur_handler *handler = user_data;
+	struct tcmur_latency_hist *hist;
+	struct tcmur_device *rdev = NULL;
+	struct tcmu_device *dev;
+	GVariantBuilder builder;
+	int cls, stage;
+
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a(sstttttt)"));
+
+	dev = tcmulib_lookup_dev(tcmu_cfg->ctx, dev_name);
+	if (dev && tcmu_get_runner_handler(dev) == handler)
+		rdev = tcmu_dev_get_private(dev);
+
+	for (cls = 0; rdev && rdev->stats && cls < TCMUR_STATS_NR_CLASSES;
+	     cls++) {
+		for (stage = 0; stage < TCMUR_STATS_NR_STAGES; stage++) {
+			hist = &rdev->stats->lat[cls][stage];
+			if (!hist->count)
+				continue;
+
+			g_variant_builder_add(&builder, "(sstttttt)",
+				tcmur_stats_class_name(cls),
+				tcmur_stats_stage_name(stage),
+				hist->count, hist->sum_ns / hist->count,
+				tcmur_hist_percentile(hist, 50),
+				tcmur_hist_percentile(hist, 99),
+				tcmur_hist_percentile(hist, 99.9),
+				hist->max_ns);
+		}
+	}
+
+	g_dbus_method_invocation_return_value(invocation,
+		    g_variant_new("(ba(sstttttt))", rdev != NULL, &builder));
+
+	return TRUE;
+}
+
+static gboolean
+on_get_io_stats(TCMUService1 *interface,
+		GDBusMethodInvocation *invocation,
+		gchar *dev_name,
+		gpointer user_data)
+{
+	struct tcmur_handler *handler = user_data;
+	struct tcmur_device *rdev = NULL;
+	struct tcmur_dev_stats *stats;
+	GVariantBuilder ops, sts, gauges;
+	struct tcmu_device *dev;
+	int i;
+
+	g_variant_builder_init(&ops, G_VARIANT_TYPE("a(yttt)"));
+	g_variant_builder_init(&sts, G_VARIANT_TYPE("a(st)"));
+	g_variant_builder_init(&gauges, G_VARIANT_TYPE("a(st)"));
+
+	dev = tcmulib_lookup_dev(tcmu_cfg->ctx, dev_name);
+	if (dev && tcmu_get_runner_handler(dev) == handler)
+		rdev = tcmu_dev_get_private(dev);
+
+	stats = rdev ? rdev->stats : NULL;
+	for (i = 0; stats && i < 256; i++) {
+		if (!stats->ops[i].cmds)
+			continue;
+
+		g_variant_builder_add(&ops, "(yttt)", (guchar)i,
+				      stats->ops[i].cmds, stats->ops[i].bytes,
+				      stats->ops[i].errors);
+	}
+
+	for (i = -1; stats && i < TCMUR_STATS_NR_STS; i++) {
+		uint64_t val = i < 0 ? stats->not_handled : stats->sts[i];
+
+		if (val)
+			g_variant_builder_add(&sts, "(st)",
+					      tcmur_stats_sts_name(i), val);
+	}
+
+	if (stats) {
+		g_variant_builder_add(&gauges, "(st)", "queue_depth",
+				      (guint64)stats->queue_depth);
+		g_variant_builder_add(&gauges, "(st)", "queue_depth_max",
+				      (guint64)stats->queue_depth_max);
+		g_variant_builder_add(&gauges, "(st)", "data_area_size",
+				      stats->data_area_size);
+		g_variant_builder_add(&gauges, "(st)", "data_area_used",
+				      stats->data_bytes);
+		g_variant_builder_add(&gauges, "(st)", "data_area_used_max",
+				      stats->data_bytes_max);
+		g_variant_builder_add(&gauges, "(st)", "data_area_full",
+				      stats->data_full_cnt);
+		g_variant_builder_add(&gauges, "(st)", "data_area_full_ms",
+				      tcmur_stats_data_full_ns(stats,
+						tcmur_now_ns()) / 1000000);
+		g_variant_builder_add(&gauges, "(st)", "ring_size",
+				      (guint64)stats->ring_size);
+		g_variant_builder_add(&gauges, "(st)", "ring_used",
+				      (guint64)tcmur_stats_ring_bytes(stats));
+		g_variant_builder_add(&gauges, "(st)", "ring_used_max",
+				      (guint64)stats->ring_bytes_max);
+	}
+	if (rdev) {
+		g_variant_builder_add(&gauges, "(st)", "qos_read_throttled",
+				      rdev->qos.dirs[TCMUR_QOS_READ].throttled);
+		g_variant_builder_add(&gauges, "(st)", "qos_write_throttled",
+				      rdev->qos.dirs[TCMUR_QOS_WRITE].throttled);
+		g_variant_builder_add(&gauges, "(st)", "qos_deferred",
+				      (guint64)rdev->qos.nr_deferred);
+		g_variant_builder_add(&gauges, "(st)", "aio_depth",
+				      (guint64)rdev->track_queue.tracked_aio_ops);
+		g_variant_builder_add(&gauges, "(st)", "aio_depth_max",
+				      (guint64)rdev->track_queue.tracked_aio_max);
+		g_variant_builder_add(&gauges, "(st)", "lock_lost",
+				      rdev->lock_lost_cnt);
+		g_variant_builder_add(&gauges, "(st)", "conn_lost",
+				      rdev->conn_lost_cnt);
+		g_variant_builder_add(&gauges, "(st)", "cmd_timed_out",
+				      rdev->cmd_timed_out_cnt);
+	}
+
+	g_dbus_method_invocation_return_value(invocation,
+		    g_variant_new("(ba(yttt)a(st)a(st))", rdev != NULL, &ops,
+				  &sts, &gauges));
+
+	return TRUE;
+}
+
 static void
 dbus_export_handler(struct tcmur_handler *handler, GCallback check_config)
 {
@@ -287,6 +484,14 @@ dbus_export_handler(struct tcmur_handler *handler, GCallback check_config)
 			 "handle-check-config",
 			 check_config,
 			 handler); /* user_data */
+	g_signal_connect(interface,
+			 "handle-get-latency-stats",
+			 G_CALLBACK(on_get_latency_stats),
+			 handler); /* user_data */
+	g_signal_connect(interface,
+			 "handle-get-io-stats",
+			 G_CALLBACK(on_get_io_stats),
+			 handler); /* user_data */
 	tcmuservice1_set_config_desc(interface, handler->cfg_desc);
 	g_dbus_object_manager_server_export(manager, G_DBUS_OBJECT_SKELETON(object));
 	g_object_unref(object);
@@ -650,77 +855,58 @@ static void tcmur_stop_device(void *arg)
 	tcmu_dev_dbg(dev, "cmdproc cleanup done\n");
 }
 
-int tcmur_get_time(struct tcmu_device *dev, struct timespec *time)
-{
-	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
-	int ret;
-
-	ret = clock_gettime(CLOCK_MONOTONIC_COARSE, time);
-	if (!ret) {
-		tcmu_dev_dbg(dev, "Current time %lu secs.\n", time->tv_sec);
-		return 0;
-	}
-
-	tcmu_dev_err(dev, "Could not get time. Error %d. Command timeout feature disabled.\n",
-		     ret);
-	rdev->cmd_time_out = 0;
-	return ret;
-}
-
+/*
+ * Every cmd on a device gets the same timeout and cmds are added to
+ * cmds_list in arrival order, so the list is sorted by deadline and only
+ * the head has to be looked at. Cmds that have timed out are moved to
+ * timed_out_cmds until they complete.
+ *
+ * Both lists are only accessed from the cmdproc thread.
+ */
 static bool get_next_cmd_timeout(struct tcmu_device *dev,
 				 struct timespec *curr_time,
 				 struct timespec *tmo)
 {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
-	int run_time, cmd_tmo = rdev->cmd_time_out;
 	struct tcmur_cmd *tcmur_cmd;
-	bool has_timeout = false;
+	int64_t left_ms;
 
-	if (!cmd_tmo)
+	if (!rdev->cmd_time_out)
 		return false;
 
-	memset(tmo, 0, sizeof(*tmo));
-
-	pthread_spin_lock(&rdev->lock);
-	list_for_each(&rdev->cmds_list, tcmur_cmd, cmds_list_entry) {
-		if (tcmur_cmd->timed_out)
-			continue;
-
-		has_timeout = true;
-		run_time = difftime(curr_time->tv_sec,
-				    tcmur_cmd->start_time.tv_sec);
-		if (cmd_tmo > run_time) {
-			tmo->tv_sec = cmd_tmo - run_time;
-		} else {
-			/*
-			 * We do not do a clock call for every command, so
-			 * cmds can time out while we were processing new
-			 * cmds. Force a recheck.
-			 */
-			tmo->tv_sec = 0;
-		}
-
-		tcmu_dev_dbg(dev, "Next cmd id %hu timeout in %lu secs. Current time %lu. Start time %lu\n",
-			     tcmur_cmd->lib_cmd->cmd_id, tmo->tv_sec,
-			     curr_time->tv_sec, tcmur_cmd->start_time.tv_sec);
-		break;
-	}
-	pthread_spin_unlock(&rdev->lock);
+	tcmur_cmd = list_top(&rdev->cmds_list, struct tcmur_cmd,
+			     cmds_list_entry);
+	if (!tcmur_cmd)
+		return false;
 
-	return has_timeout;
+	/*
+	 * We do not do a clock call for every command, so cmds can time
+	 * out while we were processing new cmds. In that case this is 0
+	 * and forces a recheck.
+	 */
+	left_ms = rdev->cmd_time_out -
+		  tcmur_time_diff_ms(curr_time, &tcmur_cmd->start_time);
+	if (left_ms < 0)
+		left_ms = 0;
+
+	tmo->tv_sec = left_ms / 1000;
+	tmo->tv_nsec = (left_ms % 1000) * 1000000;
+
+	tcmu_dev_dbg(dev, "Next cmd id %hu timeout in %"PRId64" msecs. Current time %lu. Start time %lu\n",
+		     tcmur_cmd->lib_cmd->cmd_id, left_ms,
+		     curr_time->tv_sec, tcmur_cmd->start_time.tv_sec);
+	return true;
 }
 
 static void check_for_timed_out_cmds(struct tcmu_device *dev)
 {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
-	int cmd_tmo = rdev->cmd_time_out;
 	struct tcmur_cmd *tcmur_cmd;
 	struct timespec curr_time;
 	struct tcmulib_cmd *cmd;
-	int run_time;
 	uint8_t *cdb;
 
-	if (!cmd_tmo)
+	if (!rdev->cmd_time_out)
 		return;
 
 	memset(&curr_time, 0, sizeof(curr_time));
@@ -728,15 +914,15 @@ static void check_for_timed_out_cmds(struct tcmu_device *dev)
 	if (tcmur_get_time(dev, &curr_time))
 		return;
 
-	pthread_spin_lock(&rdev->lock);
-	list_for_each(&rdev->cmds_list, tcmur_cmd, cmds_list_entry) {
-		if (tcmur_cmd->timed_out)
-			continue;
+	while ((tcmur_cmd = list_top(&rdev->cmds_list, struct tcmur_cmd,
+				     cmds_list_entry))) {
+		if (tcmur_time_diff_ms(&curr_time, &tcmur_cmd->start_time) <
+		    rdev->cmd_time_out)
+			break;
 
-		run_time = difftime(curr_time.tv_sec,
-				    tcmur_cmd->start_time.tv_sec);
-		if (run_time < cmd_tmo)
-			continue;
+		list_del(&tcmur_cmd->cmds_list_entry);
+		list_add_tail(&rdev->timed_out_cmds,
+			      &tcmur_cmd->cmds_list_entry);
 
 		cmd = tcmur_cmd->lib_cmd;
 
@@ -758,7 +944,6 @@ static void check_for_timed_out_cmds(struct tcmu_device *dev)
 		 */
 	       tcmu_notify_cmd_timed_out(dev);
 	}
-	pthread_spin_unlock(&rdev->lock);
 }
 
 static void tcmur_tcmulib_cmd_start(struct tcmu_device *dev,
@@ -770,51 +955,117 @@ static void tcmur_tcmulib_cmd_start(struct tcmu_device *dev,
 
 	memset(tcmur_cmd, 0, sizeof(*tcmur_cmd));
 	tcmur_cmd->lib_cmd = cmd;
+	tcmur_cmd->start_ns = tcmur_now_ns();
+	__atomic_store_n(&rdev->last_cmd_ns, tcmur_cmd->start_ns,
+			 __ATOMIC_RELAXED);
 	list_node_init(&tcmur_cmd->cmds_list_entry);
+	tcmur_stats_cmd_start(dev, cmd);
 
 	if (rdev->cmd_time_out) {
-		tcmur_cmd->start_time.tv_sec = curr_time->tv_sec;
-
-		pthread_spin_lock(&rdev->lock);
+		tcmur_cmd->start_time = *curr_time;
 		list_add_tail(&rdev->cmds_list, &tcmur_cmd->cmds_list_entry);
-		pthread_spin_unlock(&rdev->lock);
 	}
 }
 
-static void *tcmur_cmdproc_thread(void *arg)
+#define TCMUR_POLL_USECS_MAX 1000
+#define TCMUR_MERGE_MAX_KB 4096
+#define TCMUR_XCOPY_WINDOW 4
+#define TCMUR_XCOPY_WINDOW_MAX 32
+#define TCMUR_MAX_NR_THREADS 64
+
+/*
+ * Spin on the ring and the completion list for up to poll_window usecs
+ * before the cmdproc thread goes to sleep in ppoll. The window is halved
+ * every time it expires without work showing up, down to 1/16 of the
+ * configured value, and reset to the full value on a hit, so idle devices
+ * do not keep burning a CPU.
+ */
+static bool tcmur_cmdproc_busy_poll(struct tcmu_device *dev)
 {
-	struct tcmu_device *dev = arg;
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
-	struct pollfd pfd;
-	int ret;
-	bool dev_stopping = false;
+	struct timespec start, now;
+	long elapsed;
 
-	tcmu_set_thread_name("cmdproc", dev);
+	if (!rdev->poll_usecs)
+		return false;
 
-	pthread_cleanup_push(tcmur_stop_device, dev);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		if (tcmulib_has_next_command(dev) ||
+		    __atomic_load_n(&rdev->compl_list, __ATOMIC_RELAXED)) {
+			rdev->poll_window = rdev->poll_usecs;
+			rdev->poll_hits++;
+			return true;
+		}
 
-	while (1) {
-		int completed = 0;
-		struct tcmulib_cmd *cmd;
-		struct timespec tmo, curr_time;
-		bool set_tmo;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000000 +
+			  (now.tv_nsec - start.tv_nsec) / 1000;
+	} while (elapsed < rdev->poll_window);
+
+	if (rdev->poll_window > rdev->poll_usecs / 16)
+		rdev->poll_window /= 2;
+	if (!rdev->poll_window)
+		rdev->poll_window = 1;
+	rdev->poll_sleeps++;
+	return false;
+}
 
-		tcmulib_processing_start(dev);
+/* Max cmds the cmdproc thread pulls off the ring at a time */
+#define TCMUR_CMD_BATCH 32
 
-		if (rdev->cmd_time_out)
-			tcmur_get_time(dev, &curr_time);
+static bool tcmur_cmdproc_stopping(struct tcmur_device *rdev)
+{
+	bool stopping;
+
+	/*
+	 * LIO will wait for outstanding requests and prevent new ones
+	 * from being sent to runner during device removal, but if the
+	 * tcmu cmd_time_out has fired tcmu-runner may still be executing
+	 * requests that LIO has completed. We only need to wait for replies
+	 * for outstanding requests so throttle the cmdproc loop now.
+	 */
+	pthread_mutex_lock(&rdev->state_lock);
+	stopping = rdev->flags & TCMUR_DEV_FLAG_STOPPING;
+	pthread_mutex_unlock(&rdev->state_lock);
+	return stopping;
+}
+
+/*
+ * One pass of the cmdproc loop: send on the new cmds on the ring and the
+ * ones QoS let through, and complete what finished. Run by the device's
+ * cmdproc thread or by its reactor. Returns the nsecs after which the
+ * pass must be run again even if no fd fired, or -1.
+ */
+static int64_t tcmur_cmdproc_run(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmulib_cmd *cmds[TCMUR_CMD_BATCH], *cmd;
+	struct timespec tmo, curr_time;
+	int completed = 0, nr_cmds, i, ret;
+	bool dev_stopping, set_tmo;
+	uint64_t qos_ns;
 
-		while (!dev_stopping &&
-		       (cmd = tcmulib_get_next_command(dev,
-					sizeof(struct tcmur_cmd))) != NULL) {
+	dev_stopping = tcmur_cmdproc_stopping(rdev);
+
+	tcmulib_processing_start(dev);
+
+	if (rdev->cmd_time_out)
+		tcmur_get_time(dev, &curr_time);
+
+	while (!dev_stopping &&
+	       (nr_cmds = tcmulib_get_next_commands(dev, cmds,
+				TCMUR_CMD_BATCH,
+				sizeof(struct tcmur_cmd))) > 0) {
+		for (i = 0; i < nr_cmds; i++) {
+			cmd = cmds[i];
 
 			tcmur_tcmulib_cmd_start(dev, cmd, &curr_time);
 
 			if (tcmu_get_log_level() == TCMU_LOG_DEBUG_SCSI_CMD)
 				tcmu_cdb_print_info(dev, cmd, NULL);
 
-			if (tcmur_handler_is_passthrough_only(rhandler))
+			if (rdev->passthrough_only)
 				ret = tcmur_cmd_passthrough_handler(dev, cmd);
 			else
 				ret = tcmur_generic_handle_cmd(dev, cmd);
@@ -834,24 +1085,98 @@ static void *tcmur_cmdproc_thread(void *arg)
 				tcmur_tcmulib_cmd_complete(dev, cmd, ret);
 			}
 		}
+	}
+
+	/*
+	 * Send on the cmds that were over the QoS limits and have
+	 * the credits now. Once the device is stopping they are failed
+	 * instead, as the io threads are going away.
+	 */
+	while ((cmd = tcmur_qos_next_cmd(dev, dev_stopping))) {
+		if (dev_stopping)
+			ret = TCMU_STS_BUSY;
+		else
+			ret = tcmur_generic_dispatch_cmd(dev, cmd);
+
+		if (ret == TCMU_STS_NOT_HANDLED)
+			tcmu_cdb_print_info(dev, cmd, "is not supported");
+		if (ret != TCMU_STS_ASYNC_HANDLED) {
+			completed = 1;
+			tcmur_tcmulib_cmd_complete(dev, cmd, ret);
+		}
+	}
+
+	/* Send the last run of sequential cmds from this drain */
+	tcmur_merge_flush(dev);
+
+	/*
+	 * Pick up the async completions that came in while we were
+	 * busy, so they share the ring lock and kernel kick above.
+	 */
+	if (tcmur_complete_queued_cmds(dev))
+		completed = 1;
+
+	if (completed)
+		tcmulib_processing_complete(dev);
+
+	set_tmo = get_next_cmd_timeout(dev, &curr_time, &tmo);
+	if (tcmur_qos_get_timeout(dev, &qos_ns) &&
+	    (!set_tmo || qos_ns < (uint64_t)tmo.tv_sec * 1000000000 +
+				  tmo.tv_nsec))
+		return qos_ns;
+	if (!set_tmo)
+		return -1;
+	return (int64_t)tmo.tv_sec * 1000000000 + tmo.tv_nsec;
+}
+
+static void tcmur_cmdproc_timed_out(struct tcmu_device *dev)
+{
+	check_for_timed_out_cmds(dev);
+}
 
-		if (completed)
-			tcmulib_processing_complete(dev);
+static const struct tcmur_reactor_ops tcmur_cmdproc_reactor_ops = {
+	.run = tcmur_cmdproc_run,
+	.timed_out = tcmur_cmdproc_timed_out,
+};
 
-		set_tmo = get_next_cmd_timeout(dev, &curr_time, &tmo);
+static void *tcmur_cmdproc_thread(void *arg)
+{
+	struct tcmu_device *dev = arg;
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct pollfd pfd[2];
+	struct timespec tmo;
+	int64_t tmo_ns;
+	int ret;
 
-		pfd.fd = tcmu_dev_get_fd(dev);
-		pfd.events = POLLIN;
-		pfd.revents = 0;
+	tcmu_set_thread_name("cmdproc", dev);
+	tcmur_affinity_bind_thread(dev);
+	tcmur_cmdproc_rdev = rdev;
+
+	pthread_cleanup_push(tcmur_stop_device, dev);
+
+	while (1) {
+		tmo_ns = tcmur_cmdproc_run(dev);
+
+		pfd[0].fd = tcmu_dev_get_fd(dev);
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+
+		pfd[1].fd = rdev->compl_efd;
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
 
 		/* Use ppoll instead poll to avoid poll call reschedules during signal
 		 * handling. If we were removing a device, then the uio device's memory
 		 * could be freed, but the poll would be rescheduled and end up accessing
 		 * the released device. */
-		if (set_tmo) {
-			ret = ppoll(&pfd, 1, &tmo, NULL);
+		if (!tcmur_cmdproc_stopping(rdev) && tcmur_cmdproc_busy_poll(dev)) {
+			ret = 1;
+		} else if (tmo_ns >= 0) {
+			tmo.tv_sec = tmo_ns / 1000000000;
+			tmo.tv_nsec = tmo_ns % 1000000000;
+			ret = ppoll(pfd, 2, &tmo, NULL);
 		} else {
-			ret = ppoll(&pfd, 1, NULL, NULL);
+			ret = ppoll(pfd, 2, NULL, NULL);
 		}
 		if (ret == -1) {
 			tcmu_err("ppoll() returned %d\n", ret);
@@ -860,22 +1185,12 @@ static void *tcmur_cmdproc_thread(void *arg)
 
 		if (!ret) {
 			check_for_timed_out_cmds(dev);
-		} else if (pfd.revents != POLLIN) {
-			tcmu_err("ppoll received unexpected revent: 0x%x\n", pfd.revents);
+		} else if ((pfd[0].revents & ~POLLIN) ||
+			   (pfd[1].revents & ~POLLIN)) {
+			tcmu_err("ppoll received unexpected revent: 0x%x 0x%x\n",
+				 pfd[0].revents, pfd[1].revents);
 			break;
 		}
-
-		/*
-		 * LIO will wait for outstanding requests and prevent new ones
-		 * from being sent to runner during device removal, but if the
-		 * tcmu cmd_time_out has fired tcmu-runner may still be executing
-		 * requests that LIO has completed. We only need to wait for replies
-		 * for outstanding requests so throttle the cmdproc thread now.
-		 */
-		pthread_mutex_lock(&rdev->state_lock);
-		if (rdev->flags & TCMUR_DEV_FLAG_STOPPING)
-			dev_stopping = true;
-		pthread_mutex_unlock(&rdev->state_lock);
 	}
 
 	/*
@@ -887,6 +1202,76 @@ static void *tcmur_cmdproc_thread(void *arg)
 	return NULL;
 }
 
+static void tcmur_qos_conf_limits(struct tcmur_qos_limits *limits)
+{
+	limits->iops[TCMUR_QOS_READ] = tcmu_cfg->qos_read_iops;
+	limits->iops[TCMUR_QOS_WRITE] = tcmu_cfg->qos_write_iops;
+	limits->kibps[TCMUR_QOS_READ] = tcmu_cfg->qos_read_kibps;
+	limits->kibps[TCMUR_QOS_WRITE] = tcmu_cfg->qos_write_kibps;
+	limits->burst_ms = tcmu_cfg->qos_burst_ms;
+}
+
+/* Remove the tcmur_qos_ arguments from cfgstring, parsing them into limits */
+static void strip_qos_args(char *cfgstring, struct tcmur_qos_limits *limits)
+{
+	struct tcmur_qos_limits ignored;
+	char *arg = cfgstring, *arg_end;
+
+	if (!limits)
+		limits = &ignored;
+
+	while ((arg = strchr(arg, ';'))) {
+		if (!tcmur_qos_parse_arg(limits, arg + 1)) {
+			arg++;
+			continue;
+		}
+
+		arg_end = strchrnul(arg + 1, ';');
+		memmove(arg, arg_end, strlen(arg_end) + 1);
+	}
+}
+
+/*
+ * If a new cfgstring only changes the tcmur_qos_ arguments, the limits
+ * are updated live and the handler is not involved. Returns false if
+ * anything else changed.
+ */
+static bool dev_reconfig_qos(struct tcmu_device *dev, const char *cfgstring)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_qos_limits limits;
+	char *new_cfg, *old_cfg = NULL, *orig;
+	bool qos_only = false;
+
+	new_cfg = strdup(cfgstring);
+	if (!new_cfg)
+		return false;
+	old_cfg = strdup(rdev->orig_cfgstring);
+	if (!old_cfg)
+		goto free_new;
+
+	tcmur_qos_conf_limits(&limits);
+	strip_qos_args(new_cfg, &limits);
+	strip_qos_args(old_cfg, NULL);
+	if (strcmp(new_cfg, old_cfg))
+		goto free_old;
+
+	orig = strdup(cfgstring);
+	if (!orig)
+		goto free_old;
+	free(rdev->orig_cfgstring);
+	rdev->orig_cfgstring = orig;
+
+	tcmur_qos_set_limits(dev, &limits);
+	qos_only = true;
+
+free_old:
+	free(old_cfg);
+free_new:
+	free(new_cfg);
+	return qos_only;
+}
+
 static int dev_resize(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
@@ -908,22 +1293,34 @@ static int dev_resize(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
 static int dev_reconfig(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	int ret;
+
+	if (cfg->type == TCMULIB_CFG_DEV_CFGSTR &&
+	    dev_reconfig_qos(dev, cfg->data.dev_cfgstring))
+		return 0;
 
 	if (!rhandler->reconfig)
 		return -EOPNOTSUPP;
 
 	switch (cfg->type) {
 	case TCMULIB_CFG_DEV_SIZE:
-		return dev_resize(dev, cfg);
+		ret = dev_resize(dev, cfg);
+		break;
 	default:
-		return rhandler->reconfig(dev, cfg);
+		ret = rhandler->reconfig(dev, cfg);
 	}
+
+	if (!ret)
+		tcmu_invalidate_alua_grps(dev);
+	return ret;
 }
 
-static void parse_tcmu_runner_args(struct tcmu_device *dev)
+static void parse_tcmu_runner_args(struct tcmu_device *dev, char **affinity,
+				   struct tcmur_qos_limits *qos_limits)
 {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	char *arg, *cfg_str, *arg_end, *cfg_end;
+	int merge_kb, window;
 	bool found;
 
 	cfg_str = tcmu_dev_get_cfgstring(dev);
@@ -935,11 +1332,89 @@ static void parse_tcmu_runner_args(struct tcmu_device *dev)
 		arg++;
 
 		if (!strncmp(arg, "tcmur_cmd_time_out=", 19)) {
-			rdev->cmd_time_out = atoi(arg + 19);
+			/* Fractions of a second are allowed, e.g. 0.5 */
+			rdev->cmd_time_out = strtod(arg + 19, NULL) * 1000;
+			if (rdev->cmd_time_out < 0)
+				rdev->cmd_time_out = 0;
 
-			tcmu_dev_dbg(dev, "Using tcmur_cmd_timeout %d\n",
+			tcmu_dev_dbg(dev, "Using tcmur_cmd_timeout %d msecs\n",
 				     rdev->cmd_time_out);
 			found = true;
+		} else if (!strncmp(arg, "tcmur_nr_threads=", 17)) {
+			rdev->nr_threads = atoi(arg + 17);
+			if (rdev->nr_threads < 0)
+				rdev->nr_threads = 0;
+			if (rdev->nr_threads > TCMUR_MAX_NR_THREADS)
+				rdev->nr_threads = TCMUR_MAX_NR_THREADS;
+
+			tcmu_dev_dbg(dev, "Using tcmur_nr_threads %d\n",
+				     rdev->nr_threads);
+			found = true;
+		} else if (!strncmp(arg, "tcmur_affinity=", 15)) {
+			free(*affinity);
+			*affinity = strndup(arg + 15, strcspn(arg + 15, ";"));
+
+			tcmu_dev_dbg(dev, "Using tcmur_affinity %s\n",
+				     *affinity);
+			found = true;
+		} else if (!strncmp(arg, "tcmur_poll_usecs=", 17)) {
+			rdev->poll_usecs = atoi(arg + 17);
+			if (rdev->poll_usecs > TCMUR_POLL_USECS_MAX)
+				rdev->poll_usecs = TCMUR_POLL_USECS_MAX;
+			rdev->poll_window = rdev->poll_usecs;
+
+			tcmu_dev_dbg(dev, "Using tcmur_poll_usecs %u\n",
+				     rdev->poll_usecs);
+			found = true;
+		} else if (!strncmp(arg, "tcmur_merge_max_kb=", 19)) {
+			merge_kb = atoi(arg + 19);
+			if (merge_kb < 0)
+				merge_kb = 0;
+			if (merge_kb > TCMUR_MERGE_MAX_KB)
+				merge_kb = TCMUR_MERGE_MAX_KB;
+			rdev->merge_max_bytes = merge_kb * 1024;
+
+			tcmu_dev_dbg(dev, "Using tcmur_merge_max_kb %d\n",
+				     merge_kb);
+			found = true;
+		} else if (!strncmp(arg, "tcmur_async_io=", 15)) {
+			rdev->async_io = atoi(arg + 15) > 0;
+
+			tcmu_dev_dbg(dev, "Using tcmur_async_io %d\n",
+				     rdev->async_io);
+			found = true;
+		} else if (!strncmp(arg, "tcmur_read_nowait=", 18)) {
+			rdev->read_nowait = atoi(arg + 18) > 0;
+
+			tcmu_dev_dbg(dev, "Using tcmur_read_nowait %d\n",
+				     rdev->read_nowait);
+			found = true;
+		} else if (!strncmp(arg, "tcmur_reactor=", 14)) {
+			rdev->no_reactor = !atoi(arg + 14);
+
+			tcmu_dev_dbg(dev, "Using tcmur_reactor %d\n",
+				     !rdev->no_reactor);
+			found = true;
+		} else if (!strncmp(arg, "tcmur_pi=", 9)) {
+			rdev->pi = atoi(arg + 9) > 0;
+
+			tcmu_dev_dbg(dev, "Using tcmur_pi %d\n", rdev->pi);
+			found = true;
+		} else if (!strncmp(arg, "tcmur_xcopy_window=", 19)) {
+			window = atoi(arg + 19);
+			if (window < 1)
+				window = 1;
+			if (window > TCMUR_XCOPY_WINDOW_MAX)
+				window = TCMUR_XCOPY_WINDOW_MAX;
+			rdev->xcopy_window = window;
+
+			tcmu_dev_dbg(dev, "Using tcmur_xcopy_window %d\n",
+				     window);
+			found = true;
+		} else if (tcmur_qos_parse_arg(qos_limits, arg)) {
+			tcmu_dev_dbg(dev, "Using %.*s\n",
+				     (int)strcspn(arg, ";"), arg);
+			found = true;
 		}
 
 		arg_end = strstr(arg, ";");
@@ -960,25 +1435,97 @@ static void parse_tcmu_runner_args(struct tcmu_device *dev)
 		     tcmu_dev_get_cfgstring(dev));
 }
 
+/*
+ * A reactor runs the passes of all its devices, so a device whose cmds
+ * can block the pass gets a cmdproc thread of its own. Those are sync
+ * handlers whose handle_cmd is tried first from the pass, handlers that
+ * said from open that they do blocking I/O inline, and devices that busy
+ * poll.
+ */
+static bool tcmur_dev_use_reactor(struct tcmu_device *dev)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	if (!tcmur_reactors_enabled() || rdev->no_reactor || rdev->poll_usecs)
+		return false;
+
+	if (rdev->blocking_io ||
+	    (rhandler->handle_cmd && rdev->nr_threads &&
+	     !tcmur_handler_is_passthrough_only(rhandler))) {
+		tcmu_dev_info(dev, "Handler can block the cmdproc loop, not using a reactor\n");
+		return false;
+	}
+
+	return true;
+}
+
 static int dev_added(struct tcmu_device *dev)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
-	struct list_head group_list;
+	struct tcmur_qos_limits qos_limits;
 	struct tcmur_device *rdev;
+	char *affinity = NULL;
 	int32_t block_size, max_sectors;
 	int64_t dev_size;
 	int ret;
 
-	rdev = calloc(1, sizeof(*rdev));
-	if (!rdev)
+	if (posix_memalign((void **)&rdev, TCMUR_CACHELINE_SIZE,
+			   sizeof(*rdev)))
 		return -ENOMEM;
+	memset(rdev, 0, sizeof(*rdev));
 
 	tcmu_dev_set_private(dev, rdev);
 	list_node_init(&rdev->recovery_entry);
 	list_head_init(&rdev->cmds_list);
+	list_head_init(&rdev->timed_out_cmds);
 	rdev->dev = dev;
+	rdev->xcopy_window = TCMUR_XCOPY_WINDOW;
 
-	parse_tcmu_runner_args(dev);
+	rdev->orig_cfgstring = strdup(tcmu_dev_get_cfgstring(dev));
+	if (!rdev->orig_cfgstring) {
+		free(rdev);
+		return -ENOMEM;
+	}
+
+	tcmur_qos_conf_limits(&qos_limits);
+	parse_tcmu_runner_args(dev, &affinity, &qos_limits);
+
+	if (rdev->async_io && !rhandler->async_io) {
+		tcmu_dev_warn(dev, "Ignoring tcmur_async_io for handler without an async engine\n");
+		rdev->async_io = false;
+	}
+
+	/*
+	 * Async handlers, and devices using the handler's async engine, do
+	 * their own queueing and always run without worker threads. For
+	 * the rest the cfgstring overrides tcmu.conf, which overrides the
+	 * handler's default.
+	 */
+	if (!rhandler->nr_threads || rdev->async_io) {
+		if (rdev->nr_threads)
+			tcmu_dev_warn(dev, "Ignoring tcmur_nr_threads for handler without worker threads\n");
+		rdev->nr_threads = 0;
+	} else if (!rdev->nr_threads) {
+		rdev->nr_threads = tcmu_cfg->nr_threads;
+		if (!rdev->nr_threads)
+			rdev->nr_threads = rhandler->nr_threads;
+		if (rdev->nr_threads > TCMUR_MAX_NR_THREADS)
+			rdev->nr_threads = TCMUR_MAX_NR_THREADS;
+	}
+
+	if (affinity) {
+		ret = tcmur_affinity_setup(dev, affinity);
+		free(affinity);
+		if (ret)
+			goto free_rdev;
+	} else if (tcmur_affinity_setup(dev, tcmu_cfg->affinity)) {
+		tcmu_dev_warn(dev, "Ignoring tcmu.conf affinity\n");
+	}
+
+	ret = tcmur_stats_init(dev);
+	if (ret)
+		goto free_rdev;
 
 	ret = -EINVAL;
 	block_size = tcmu_cfgfs_dev_get_attr_int(dev, "hw_block_size");
@@ -1014,7 +1561,16 @@ static int dev_added(struct tcmu_device *dev)
 	 */
 	tcmu_dev_set_opt_xcopy_rw_len(dev, max_sectors);
 
-	if (rhandler->unmap)
+	if (rdev->pi) {
+		if (rhandler->read_pi && rhandler->write_pi)
+			tcmu_dev_set_pi_enabled(dev, true);
+		else
+			tcmu_dev_warn(dev, "Ignoring tcmur_pi for handler without a PI store\n");
+	}
+
+	/* Only single range unmaps keep the PI tuples in sync */
+	if (rhandler->unmap ||
+	    (rhandler->unmap_vec && !tcmu_dev_get_pi_enabled(dev)))
 		tcmu_dev_set_unmap_enabled(dev, true);
 
 	tcmu_dev_dbg(dev, "Got block_size %d, size in bytes %"PRId64"\n",
@@ -1026,16 +1582,18 @@ static int dev_added(struct tcmu_device *dev)
 		goto free_rdev;
 	}
 
-	ret = pthread_mutex_init(&rdev->caw_lock, NULL);
+	ret = pthread_mutex_init(&rdev->range_lock, NULL);
 	if (ret) {
 		ret = -ret;
 		goto cleanup_dev_lock;
 	}
+	list_head_init(&rdev->range_locks);
+	list_head_init(&rdev->range_waiters);
 
 	ret = pthread_mutex_init(&rdev->format_lock, NULL);
 	if (ret) {
 		ret = -ret;
-		goto cleanup_caw_lock;
+		goto cleanup_range_lock;
 	}
 
 	ret = pthread_mutex_init(&rdev->state_lock, NULL);
@@ -1044,9 +1602,42 @@ static int dev_added(struct tcmu_device *dev)
 		goto cleanup_format_lock;
 	}
 
+	ret = pthread_mutex_init(&rdev->flush_lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto cleanup_state_lock;
+	}
+
+	ret = pthread_mutex_init(&rdev->alua_lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto cleanup_flush_lock;
+	}
+	list_head_init(&rdev->alua_grps);
+
+	ret = tcmur_state_pool_init(dev);
+	if (ret)
+		goto cleanup_alua_lock;
+
+	ret = tcmur_qos_init(dev, &qos_limits);
+	if (ret)
+		goto cleanup_state_pool;
+	/*
+	 * Writes from before we started may still be in a cache, so the
+	 * first flush always goes to the handler.
+	 */
+	rdev->write_epoch = 1;
+
+	rdev->compl_list = NULL;
+	rdev->compl_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rdev->compl_efd < 0) {
+		ret = -errno;
+		goto cleanup_qos;
+	}
+
 	ret = setup_io_work_queue(dev);
 	if (ret < 0)
-		goto cleanup_state_lock;
+		goto close_compl_efd;
 
 	ret = setup_aio_tracking(rdev);
 	if (ret < 0)
@@ -1055,13 +1646,15 @@ static int dev_added(struct tcmu_device *dev)
 	ret = rhandler->open(dev, false);
 	if (ret)
 		goto cleanup_aio_tracking;
+	if (rdev->pi && rhandler->read_pi && !tcmu_dev_get_pi_enabled(dev))
+		tcmu_dev_warn(dev, "Handler could not set up its PI store, running without PI\n");
+	tcmur_dev_build_cmd_ops(dev);
 	/*
 	 * On the initial creation ALUA will probably not yet have been setup,
 	 * but for reopens it will be so we need to sync our failover state.
 	 */
-	list_head_init(&group_list);
-	tcmu_get_alua_grps(dev, &group_list);
-	tcmu_release_alua_grps(&group_list);
+	if (tcmu_lock_alua_grps(dev))
+		tcmu_unlock_alua_grps(dev);
 
 	rdev->flags |= TCMUR_DEV_FLAG_IS_OPEN;
 
@@ -1071,11 +1664,17 @@ static int dev_added(struct tcmu_device *dev)
 		goto close_dev;
 	}
 
-	ret = pthread_create(&rdev->cmdproc_thread, NULL, tcmur_cmdproc_thread,
-			     dev);
-	if (ret) {
-		ret = -ret;
-		goto cleanup_event_work;
+	if (tcmur_dev_use_reactor(dev)) {
+		ret = tcmur_reactor_add_dev(dev);
+		if (ret)
+			goto cleanup_event_work;
+	} else {
+		ret = pthread_create(&rdev->cmdproc_thread, NULL,
+				     tcmur_cmdproc_thread, dev);
+		if (ret) {
+			ret = -ret;
+			goto cleanup_event_work;
+		}
 	}
 
 	return 0;
@@ -1088,15 +1687,29 @@ cleanup_aio_tracking:
 	cleanup_aio_tracking(rdev);
 cleanup_io_work_queue:
 	cleanup_io_work_queue(dev, true);
+close_compl_efd:
+	close(rdev->compl_efd);
+cleanup_qos:
+	tcmur_qos_cleanup(dev);
+cleanup_state_pool:
+	tcmur_state_pool_cleanup(dev);
+cleanup_alua_lock:
+	tcmu_release_alua_grps(&rdev->alua_grps);
+	pthread_mutex_destroy(&rdev->alua_lock);
+cleanup_flush_lock:
+	pthread_mutex_destroy(&rdev->flush_lock);
 cleanup_state_lock:
 	pthread_mutex_destroy(&rdev->state_lock);
 cleanup_format_lock:
 	pthread_mutex_destroy(&rdev->format_lock);
-cleanup_caw_lock:
-	pthread_mutex_destroy(&rdev->caw_lock);
+cleanup_range_lock:
+	pthread_mutex_destroy(&rdev->range_lock);
 cleanup_dev_lock:
 	pthread_spin_destroy(&rdev->lock);
 free_rdev:
+	tcmur_stats_cleanup(dev);
+	tcmur_affinity_cleanup(dev);
+	free(rdev->orig_cfgstring);
 	free(rdev);
 	return ret;
 }
@@ -1104,6 +1717,8 @@ free_rdev:
 static void dev_removed(struct tcmu_device *dev)
 {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmulib_cmd *cmd;
+	int completed = 0;
 	int ret;
 
 	pthread_mutex_lock(&rdev->state_lock);
@@ -1122,14 +1737,58 @@ static void dev_removed(struct tcmu_device *dev)
 	if (aio_wait_for_empty_queue(rdev))
 		tcmu_dev_err(dev, "could not flush queue.\n");
 
-	tcmu_thread_cancel(rdev->cmdproc_thread);
+	if (rdev->reactor)
+		tcmur_reactor_remove_dev(dev);
+	else
+		tcmu_thread_cancel(rdev->cmdproc_thread);
+
+	/* Waits for the STPGs running from event work to complete */
 	tcmur_stop_device(dev);
 
+	/*
+	 * Fail the cmds still waiting on the QoS limits, and flush the
+	 * completions that raced with the cmdproc loop stopping.
+	 */
+	while ((cmd = tcmur_qos_next_cmd(dev, true))) {
+		tcmur_tcmulib_cmd_complete(dev, cmd, TCMU_STS_BUSY);
+		completed = 1;
+	}
+	if (tcmur_complete_queued_cmds(dev))
+		completed = 1;
+	if (completed)
+		tcmulib_processing_complete(dev);
+	close(rdev->compl_efd);
+
 	cleanup_io_work_queue(dev, false);
 	cleanup_aio_tracking(rdev);
 
 	tcmur_destroy_work(rdev->event_work);
 
+	if (rdev->poll_usecs)
+		tcmu_dev_info(dev, "Busy poll hits %"PRIu64" sleeps %"PRIu64"\n",
+			      rdev->poll_hits, rdev->poll_sleeps);
+	if (rdev->merge_max_bytes)
+		tcmu_dev_info(dev, "Merged %"PRIu64" cmds into %"PRIu64" requests\n",
+			      rdev->merged_cmds, rdev->merge_reqs);
+	if (rdev->flushes_elided || rdev->flushes_coalesced)
+		tcmu_dev_info(dev, "Elided %"PRIu64" and coalesced %"PRIu64" flushes\n",
+			      rdev->flushes_elided, rdev->flushes_coalesced);
+	if (rdev->read_nowait)
+		tcmu_dev_info(dev, "Completed %"PRIu64" reads inline, deferred %"PRIu64"\n",
+			      rdev->nowait_reads, rdev->nowait_deferred);
+
+	ret = pthread_mutex_destroy(&rdev->flush_lock);
+	if (ret != 0)
+		tcmu_err("could not cleanup flush lock %d\n", ret);
+
+	tcmur_qos_cleanup(dev);
+	tcmur_state_pool_cleanup(dev);
+
+	tcmu_release_alua_grps(&rdev->alua_grps);
+	ret = pthread_mutex_destroy(&rdev->alua_lock);
+	if (ret != 0)
+		tcmu_err("could not cleanup alua lock %d\n", ret);
+
 	ret = pthread_mutex_destroy(&rdev->state_lock);
 	if (ret != 0)
 		tcmu_err("could not cleanup state lock %d\n", ret);
@@ -1138,14 +1797,17 @@ static void dev_removed(struct tcmu_device *dev)
 	if (ret != 0)
 		tcmu_err("could not cleanup format lock %d\n", ret);
 
-	ret = pthread_mutex_destroy(&rdev->caw_lock);
+	ret = pthread_mutex_destroy(&rdev->range_lock);
 	if (ret != 0)
-		tcmu_err("could not cleanup caw lock %d\n", ret);
+		tcmu_err("could not cleanup range lock %d\n", ret);
 
 	ret = pthread_spin_destroy(&rdev->lock);
 	if (ret != 0)
 		tcmu_err("could not cleanup mailbox lock %d\n", ret);
 
+	tcmur_stats_cleanup(dev);
+	tcmur_affinity_cleanup(dev);
+	free(rdev->orig_cfgstring);
 	free(rdev);
 
 	tcmu_dev_dbg(dev, "removed from tcmu-runner\n");
@@ -1207,6 +1869,10 @@ static void usage(void) {
 	printf("\t\tdefault is %s\n", DEFAULT_HANDLER_PATH);
 	printf("\t-l, --tcmu-log-dir: tcmu log dir\n");
 	printf("\t\tdefault is %s\n", TCMU_LOG_DIR_DEFAULT);
+	printf("\t--stats-file: periodically write device stats to this file\n");
+	printf("\t\tin the Prometheus text format, disabled by default\n");
+	printf("\t--stats-interval: secs between stats file updates\n");
+	printf("\t\tdefault is %d\n", TCMUR_STATS_FILE_INTERVAL);
 	printf("\n");
 }
 
@@ -1217,6 +1883,8 @@ static struct option long_options[] = {
 	{"nofile", required_argument, 0, 'f'},
 	{"help", no_argument, 0, 'h'},
 	{"version", no_argument, 0, 'V'},
+	{"stats-file", required_argument, 0, 0},
+	{"stats-interval", required_argument, 0, 0},
 	{0, 0, 0, 0},
 };
 
@@ -1229,7 +1897,7 @@ int main(int argc, char **argv)
 	GMainLoop *loop;
 	GIOChannel *libtcmu_gio;
 	guint reg_id;
-	guint watch_id;
+	guint watch_id, stats_id = 0, data_area_id = 0;
 	bool reset_nl_supp = false;
 	bool new_path = false;
 	bool watching_cfg = false;
@@ -1244,7 +1912,7 @@ int main(int argc, char **argv)
 
 	while (1) {
 		int option_index = 0;
-		int c, nr_files;
+		int c, nr_files, interval;
 
 		c = getopt_long(argc, argv, "df:hl:V",
 				long_options, &option_index);
@@ -1256,6 +1924,17 @@ int main(int argc, char **argv)
 			if (option_index == 1) {
 				handler_path = strdup(optarg);
 				new_path = true;
+			} else if (option_index == 6) {
+				free(stats_file);
+				stats_file = strdup(optarg);
+			} else if (option_index == 7) {
+				interval = atoi(optarg);
+				if (interval < 1) {
+					tcmu_err("--stats-interval=%s should be at least 1\n",
+						 optarg);
+					goto free_config;
+				}
+				stats_interval = interval;
 			}
 			break;
 		case 'l':
@@ -1299,6 +1978,10 @@ int main(int argc, char **argv)
 	if (tcmu_setup_log(tcmu_cfg->log_dir))
 		goto free_config;
 
+	tcmur_recovery_set_max_reopens(tcmu_cfg->recovery_max_reopens);
+	tcmu_alua_set_cache_secs(tcmu_cfg->alua_cache_secs);
+	tcmur_data_area_set_budget_mb(tcmu_cfg->data_area_budget_mb);
+
 	tcmu_crit("Starting...\n");
 
 	fd = creat(TCMU_LOCK_FILE, S_IRUSR | S_IWUSR);
@@ -1380,7 +2063,19 @@ int main(int argc, char **argv)
 		darray_append(handlers, tmp_handler);
 	}
 
-	tcmulib_context = tcmulib_initialize(handlers.item, handlers.size);
+	if (tcmur_reactors_init(tcmu_cfg->reactor_threads,
+				&tcmur_cmdproc_reactor_ops)) {
+		tcmu_err("Could not start the reactors\n");
+		goto err_free_handlers;
+	}
+
+	/*
+	 * Restarts with many devices spend most of their time in the
+	 * handlers' open calls, so bring the existing devices up in parallel.
+	 */
+	tcmulib_context = tcmulib_initialize_parallel(handlers.item,
+						      handlers.size,
+						      tcmu_cfg->nr_open_threads);
 	if (!tcmulib_context) {
 		tcmu_err("tcmulib_initialize failed\n");
 		goto err_free_handlers;
@@ -1405,6 +2100,15 @@ int main(int argc, char **argv)
 	libtcmu_gio = g_io_channel_unix_new(tcmulib_get_master_fd(tcmulib_context));
 	watch_id = g_io_add_watch(libtcmu_gio, G_IO_IN, tcmulib_callback, tcmulib_context);
 
+	if (stats_file)
+		stats_id = g_timeout_add_seconds(stats_interval,
+						 write_stats_file,
+						 tcmulib_context);
+	if (tcmur_data_area_get_budget_mb())
+		data_area_id = g_timeout_add_seconds(TCMUR_DATA_AREA_INTERVAL,
+						     check_data_area,
+						     tcmulib_context);
+
 	/* Set up DBus name, see callback */
 	reg_id = g_bus_own_name(G_BUS_TYPE_SYSTEM,
 				"org.kernel.TCMUService1",
@@ -1426,6 +2130,10 @@ int main(int argc, char **argv)
 	g_bus_unown_name(reg_id);
 	g_main_loop_unref(loop);
 	g_source_remove(watch_id);
+	if (stats_id)
+		g_source_remove(stats_id);
+	if (data_area_id)
+		g_source_remove(data_area_id);
 	g_io_channel_shutdown(libtcmu_gio, TRUE, NULL);
 	g_io_channel_unref (libtcmu_gio);
 	g_object_unref(manager);
@@ -1437,6 +2145,7 @@ unwatch_cfg:
 		tcmu_unwatch_config(tcmu_cfg);
 	tcmulib_close(tcmulib_context);
 err_free_handlers:
+	tcmur_reactors_cleanup();
 	tcmur_unregister_all_dbus_handlers();
 
 	darray_foreach(handler, handlers) {
@@ -1461,6 +2170,7 @@ free_config:
 	tcmu_free_config(tcmu_cfg);
 	if (new_path)
 		free(handler_path);
+	free(stats_file);
 
 	if (ret)
 		exit(EXIT_FAILURE);
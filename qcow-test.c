@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Metadata ordering test for the qcow handler.
+ *
+ * Writer threads allocate clusters all over a fresh qcow2 image while
+ * another thread keeps flushing the metadata caches, as SYNCHRONIZE
+ * CACHE and eviction do. After every flush the image is read back from
+ * the file, bypassing the caches, and every cluster mapped by an L2
+ * table on disk must have a nonzero refcount on disk. Otherwise a crash
+ * at that point would leave a mapped cluster the allocator hands out
+ * again. At the end the image is reopened and the data checked.
+ *
+ * The handler's static functions are tested directly, so qcow.c is
+ * built into this program.
+ */
+
+#include "qcow.c"
+
+#define QT_CLUSTER_BITS		12
+#define QT_CLUSTER_SIZE		(1U << QT_CLUSTER_BITS)
+#define QT_IMAGE_SIZE		(64ULL << 20)
+#define QT_NR_CLUSTERS		(QT_IMAGE_SIZE / QT_CLUSTER_SIZE)
+/* one L2 table maps 2 MiB, one refcount block 8 MiB */
+#define QT_L1_SIZE		(QT_IMAGE_SIZE >> (2 * QT_CLUSTER_BITS - 3))
+#define QT_RC_TABLE_OFFSET	(1 * QT_CLUSTER_SIZE)
+#define QT_REFBLOCK_OFFSET	(2 * QT_CLUSTER_SIZE)
+#define QT_L1_OFFSET		(3 * QT_CLUSTER_SIZE)
+#define QT_NR_WRITERS		4
+
+struct qt_writer {
+	struct bdev *bdev;
+	unsigned int id;
+	unsigned int seed;
+	int ret;
+};
+
+static unsigned int qt_writers_running = QT_NR_WRITERS;
+
+/* the handler registers itself from handler_init, which is not run */
+int tcmur_register_handler(struct tcmur_handler *handler)
+{
+	return 0;
+}
+
+void tcmur_dev_set_private(struct tcmu_device *dev, void *private)
+{
+}
+
+void *tcmur_dev_get_private(struct tcmu_device *dev)
+{
+	return NULL;
+}
+
+/*
+ * Write an empty qcow2 version 2 image: header, refcount table, one
+ * refcount block and the L1 table, each in a cluster of its own.
+ */
+static int qt_create_image(const char *path)
+{
+	struct qcow2_header h;
+	uint8_t *buf;
+	uint16_t *rc;
+	int fd, i, ret = -1;
+
+	buf = calloc(4, QT_CLUSTER_SIZE);
+	if (!buf)
+		return -1;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = htobe32(QCOW2_MAGIC);
+	h.version = htobe32(2);
+	h.cluster_bits = htobe32(QT_CLUSTER_BITS);
+	h.size = htobe64(QT_IMAGE_SIZE);
+	h.l1_size = htobe32(QT_L1_SIZE);
+	h.l1_table_offset = htobe64(QT_L1_OFFSET);
+	h.refcount_table_offset = htobe64(QT_RC_TABLE_OFFSET);
+	h.refcount_table_clusters = htobe32(1);
+	memcpy(buf, &h, sizeof(h));
+
+	*(uint64_t *)(buf + QT_RC_TABLE_OFFSET) = htobe64(QT_REFBLOCK_OFFSET);
+	rc = (uint16_t *)(buf + QT_REFBLOCK_OFFSET);
+	for (i = 0; i < 4; i++)
+		rc[i] = htobe16(1);
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		goto free_buf;
+	if (pwrite(fd, buf, 4 * QT_CLUSTER_SIZE, 0) == 4 * QT_CLUSTER_SIZE)
+		ret = 0;
+	close(fd);
+free_buf:
+	free(buf);
+	return ret;
+}
+
+static int qt_open(struct bdev *bdev, const char *path)
+{
+	memset(bdev, 0, sizeof(*bdev));
+	bdev->size = QT_IMAGE_SIZE;
+	bdev->block_size = 512;
+	/* the smallest caches, so eviction flushes tables too */
+	bdev->l2_cache_size = 1;
+	bdev->rc_cache_size = 1;
+	return bdev_open(bdev, AT_FDCWD, path, O_RDWR);
+}
+
+/*
+ * Every writer owns the clusters whose number is its id modulo writers,
+ * and fills them with their number plus one, so no data is all zeroes.
+ */
+static void qt_fill(uint8_t *buf, uint64_t cluster)
+{
+	unsigned int i;
+
+	for (i = 0; i < QT_CLUSTER_SIZE / sizeof(cluster); i++)
+		((uint64_t *)buf)[i] = cluster + 1;
+}
+
+static void *qt_writer(void *arg)
+{
+	struct qt_writer *w = arg;
+	uint8_t buf[QT_CLUSTER_SIZE];
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+	uint64_t cluster;
+	unsigned int i;
+
+	for (i = 0; i < QT_NR_CLUSTERS / QT_NR_WRITERS; i++) {
+		cluster = rand_r(&w->seed) % (QT_NR_CLUSTERS / QT_NR_WRITERS);
+		cluster = cluster * QT_NR_WRITERS + w->id;
+		qt_fill(buf, cluster);
+		if (w->bdev->ops->pwritev(w->bdev, &iov, 1,
+					  cluster * QT_CLUSTER_SIZE) !=
+		    QT_CLUSTER_SIZE) {
+			fprintf(stderr, "write of cluster %"PRIu64" failed\n",
+				cluster);
+			w->ret = -1;
+			break;
+		}
+	}
+	__atomic_sub_fetch(&qt_writers_running, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static uint64_t qt_read64(int fd, uint64_t off)
+{
+	uint64_t val = 0;
+
+	if (pread(fd, &val, sizeof(val), off) != sizeof(val))
+		return 0;
+	return be64toh(val);
+}
+
+static uint64_t qt_refcount(int fd, uint64_t offset)
+{
+	uint64_t cluster = offset >> QT_CLUSTER_BITS;
+	uint64_t refblock;
+	uint16_t rc = 0;
+
+	refblock = qt_read64(fd, QT_RC_TABLE_OFFSET +
+			     (cluster / (QT_CLUSTER_SIZE / 2)) * 8);
+	if (!refblock)
+		return 0;
+	if (pread(fd, &rc, sizeof(rc),
+		  refblock + (cluster % (QT_CLUSTER_SIZE / 2)) * 2) !=
+	    sizeof(rc))
+		return 0;
+	return be16toh(rc);
+}
+
+/*
+ * Check the image as a crash right now would leave it. The L2 tables are
+ * all read before any refcount, and refcounts only go up in this test,
+ * so a refcount read after its L2 entry is never older than it.
+ */
+static int qt_check_disk(int fd)
+{
+	static uint64_t l2[QT_L1_SIZE][QT_CLUSTER_SIZE / 8];
+	uint64_t l2_offsets[QT_L1_SIZE] = { 0 };
+	uint64_t l2_offset, offset;
+	unsigned int i, j;
+	int ret = 0;
+
+	for (i = 0; i < QT_L1_SIZE; i++) {
+		l2_offset = qt_read64(fd, QT_L1_OFFSET + i * 8) &
+			    ~QCOW2_OFLAG_COPIED;
+		memset(l2[i], 0, sizeof(l2[i]));
+		if (!l2_offset)
+			continue;
+		if (pread(fd, l2[i], sizeof(l2[i]), l2_offset) != sizeof(l2[i]))
+			return -1;
+		l2_offsets[i] = l2_offset;
+	}
+
+	for (i = 0; i < QT_L1_SIZE; i++) {
+		if (l2_offsets[i] && !qt_refcount(fd, l2_offsets[i])) {
+			fprintf(stderr, "L2 table at %"PRIx64" has refcount 0\n",
+				l2_offsets[i]);
+			ret = -1;
+		}
+		for (j = 0; j < QT_CLUSTER_SIZE / 8; j++) {
+			offset = be64toh(l2[i][j]) & ~QCOW2_OFLAG_COPIED;
+			if (!offset || qt_refcount(fd, offset))
+				continue;
+			fprintf(stderr, "cluster at %"PRIx64" mapped with refcount 0\n",
+				offset);
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+static int qt_check_data(struct bdev *bdev)
+{
+	uint8_t buf[QT_CLUSTER_SIZE], want[QT_CLUSTER_SIZE], zero[QT_CLUSTER_SIZE];
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+	unsigned int written = 0;
+	uint64_t cluster;
+
+	memset(zero, 0, sizeof(zero));
+	for (cluster = 0; cluster < QT_NR_CLUSTERS; cluster++) {
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(buf);
+		if (bdev->ops->preadv(bdev, &iov, 1, cluster * QT_CLUSTER_SIZE) !=
+		    QT_CLUSTER_SIZE)
+			return -1;
+		if (!memcmp(buf, zero, sizeof(buf)))
+			continue;
+		qt_fill(want, cluster);
+		if (memcmp(buf, want, sizeof(buf))) {
+			fprintf(stderr, "cluster %"PRIu64" has wrong data\n",
+				cluster);
+			return -1;
+		}
+		written++;
+	}
+	printf("%u clusters written\n", written);
+	return written ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct qt_writer writers[QT_NR_WRITERS];
+	pthread_t threads[QT_NR_WRITERS];
+	char path[] = "/tmp/qcow-test.XXXXXX";
+	unsigned int i, flushes = 0;
+	struct bdev bdev;
+	int fd, ret = 1;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+
+	if (qt_create_image(path) < 0 || qt_open(&bdev, path) < 0) {
+		fprintf(stderr, "could not create image %s\n", path);
+		goto unlink;
+	}
+
+	for (i = 0; i < QT_NR_WRITERS; i++) {
+		writers[i].bdev = &bdev;
+		writers[i].id = i;
+		writers[i].seed = i + 1;
+		writers[i].ret = 0;
+		pthread_create(&threads[i], NULL, qt_writer, &writers[i]);
+	}
+
+	ret = 0;
+	while (__atomic_load_n(&qt_writers_running, __ATOMIC_ACQUIRE)) {
+		if (bdev.ops->flush(&bdev) < 0 || qt_check_disk(bdev.fd) < 0) {
+			ret = 1;
+			break;
+		}
+		flushes++;
+	}
+	for (i = 0; i < QT_NR_WRITERS; i++) {
+		pthread_join(threads[i], NULL);
+		if (writers[i].ret)
+			ret = 1;
+	}
+	printf("%u flushes checked\n", flushes);
+	bdev.ops->close(&bdev);
+
+	if (!ret) {
+		if (qt_open(&bdev, path) < 0) {
+			ret = 1;
+		} else {
+			if (qt_check_disk(bdev.fd) < 0 || qt_check_data(&bdev) < 0)
+				ret = 1;
+			bdev.ops->close(&bdev);
+		}
+	}
+
+unlink:
+	unlink(path);
+	printf("%s\n", ret ? "FAIL" : "PASS");
+	return ret;
+}
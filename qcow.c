@@ -55,6 +55,7 @@
 #include <scsi/scsi.h>
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <zlib.h>
 #if defined(HAVE_LINUX_FALLOC)
@@ -84,6 +85,11 @@ struct bdev {
 	uint32_t block_size;
 
 	int fd;		/* image file descriptor */
+
+	/* metadata cache sizes in bytes, 0 for the defaults */
+	size_t l2_cache_size;
+	size_t rc_cache_size;
+	size_t cluster_cache_size;
 };
 
 struct bdev_ops {
@@ -92,6 +98,8 @@ struct bdev_ops {
 	void (*close) (struct bdev *dev);
 	ssize_t (*preadv) (struct bdev *bdev, struct iovec *iov, int iovcnt, off_t offset);
 	ssize_t (*pwritev) (struct bdev *bdev, struct iovec *iov, int iovcnt, off_t offset);
+	/* optional, write back cached metadata before the image is synced */
+	int (*flush) (struct bdev *bdev);
 };
 
 static int bdev_open(struct bdev *bdev, int dirfd, const char *pathname, int flags)
@@ -189,7 +197,74 @@ static void qcow2_header_bswap(struct qcow2_header *be, struct qcow2_header *dst
 	}
 }
 
-#define RC_CACHE_SIZE L2_CACHE_SIZE
+/*
+ * Metadata table cache, used for both the L2 tables and the refcount
+ * blocks. Tables are found through a hash of their file offset and
+ * evicted with the CLOCK algorithm, so lookups stay O(1) however many
+ * tables are cached.
+ *
+ * A table returned by qcow_cache_get() is pinned and is not evicted
+ * until it is released with qcow_cache_put(). Entries in the table may
+ * be read with atomic loads while pinned. Changing them, and writing
+ * them back, requires the entry lock.
+ *
+ * Tables are written back lazily. Changed tables are marked dirty and
+ * only written by qcow_cache_flush(), on SYNCHRONIZE CACHE, on close or
+ * when the cache runs out of clean tables to evict. A cache that
+ * depends on another one, like the L2 cache on the refcount cache, has
+ * that one flushed and synced first, so a table on disk never points
+ * at a cluster whose refcount or data has not reached the disk.
+ *
+ * Tables can change while a flush is running. Each dirty table records
+ * the dependency generation it was last changed in, and one changed
+ * after the flush synced its dependencies has them flushed again before
+ * it is written.
+ *
+ * The same cache also holds decompressed clusters. Those are keyed by
+ * their L2 entry and filled in by a load callout instead of a pread.
+ */
+struct qcow_cache_entry {
+	pthread_mutex_t lock;
+	void *table;
+	bool dirty;		/* protected by the entry lock */
+	uint64_t dep_gen;	/* protected by the entry lock */
+
+	/* below are protected by the cache lock */
+	uint64_t offset;	/* 0 if the entry is unused */
+	int next;		/* hash chain, -1 terminated */
+	unsigned int pins;
+	bool loading;
+	bool referenced;
+};
+
+struct qcow_cache {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* signalled when loading or pins finish */
+
+	int fd;
+	struct qcow_cache *depends;
+	/* bumped each time a flush starts syncing the depends cache */
+	uint64_t dep_gen;
+	unsigned int nr_dirty;
+
+	/*
+	 * Optional, fills in e->table for the key in e->offset. Called
+	 * without the cache lock held. Tables are read from fd if not set.
+	 */
+	int (*load)(struct qcow_cache *c, struct qcow_cache_entry *e);
+	void *private;
+
+	uint8_t *tables;
+	size_t table_size;
+	unsigned int nr_entries;
+	struct qcow_cache_entry *entries;
+	int *buckets;
+	unsigned int hash_mask;
+	unsigned int hand;
+
+	uint64_t hits;
+	uint64_t misses;
+};
 
 struct qcow_state
 {
@@ -208,14 +283,10 @@ struct qcow_state
 	uint64_t *l1_table;
 
 	/* L2 cache */
-	uint64_t *l2_cache;
-	uint64_t l2_cache_offsets[L2_CACHE_SIZE];
-	int l2_cache_counts[L2_CACHE_SIZE];
+	struct qcow_cache l2_cache;
 
-	/* cluster decompression cache */
-	uint8_t *cluster_cache;
-	uint8_t *cluster_data;
-	uint64_t cluster_cache_offset;
+	/* decompressed cluster cache */
+	struct qcow_cache cluster_cache;
 
 	struct bdev *backing_image;
 	uint64_t cluster_compressed;
@@ -229,14 +300,49 @@ struct qcow_state
 
 	/* refcount block cache */
 	unsigned int refcount_order;
-	void *rc_cache;
-	uint64_t rc_cache_offsets[RC_CACHE_SIZE];
-	int rc_cache_counts[RC_CACHE_SIZE];
+	struct qcow_cache rc_cache;
 
 	uint64_t (*block_alloc) (struct qcow_state *s, size_t size);
 	int (*set_refcount) (struct qcow_state *s, uint64_t cluster_offset, uint64_t value);
 
 	uint64_t first_free_cluster;
+	/* zeroed clusters reserved by qcow2_block_alloc, not yet handed out */
+	uint64_t prealloc_next;
+	uint64_t prealloc_end;
+
+	/*
+	 * Metadata updates can come from several worker threads at once.
+	 * l1_lock serializes L2 table allocation, refcount_lock refcount
+	 * block allocation, and alloc_lock the cluster allocator and its
+	 * preallocated extent. L1 and refcount table entries are read with
+	 * atomic loads and need no lock.
+	 */
+	pthread_mutex_t l1_lock;
+	pthread_mutex_t refcount_lock;
+	pthread_mutex_t alloc_lock;
+
+	/*
+	 * Sequential access detection. Once lookups have moved on to the
+	 * next L2 table QCOW_PREFETCH_TRIGGER times in a row, the following
+	 * L2 tables, and for writes the next refcount block, are queued
+	 * for the prefetch thread to read into the caches.
+	 */
+	unsigned int last_l1_index;
+	unsigned int seq_streak;
+	unsigned int prefetch_l1_next;	/* first L1 index not yet queued */
+
+	pthread_t prefetch_thread;
+	bool prefetch_running;
+	bool prefetch_stop;
+	pthread_mutex_t prefetch_lock;
+	pthread_cond_t prefetch_cond;
+	struct {
+		struct qcow_cache *cache;
+		uint64_t offset;
+	} prefetch_queue[QCOW_PREFETCH_QUEUE];
+	unsigned int prefetch_head;
+	unsigned int prefetch_tail;
+	uint64_t prefetched;
 };
 
 static uint64_t qcow_block_alloc(struct qcow_state *s, size_t size);
@@ -247,6 +353,352 @@ static int qcow_no_refcount(struct qcow_state *s, uint64_t cluster_offset, uint6
 }
 static int qcow2_set_refcount(struct qcow_state *s, uint64_t cluster_offset, uint64_t value);
 
+static struct qcow_state *qcow_state_alloc(void)
+{
+	struct qcow_state *s;
+
+	s = calloc(1, sizeof(struct qcow_state));
+	if (!s)
+		return NULL;
+
+	pthread_mutex_init(&s->l1_lock, NULL);
+	pthread_mutex_init(&s->refcount_lock, NULL);
+	pthread_mutex_init(&s->alloc_lock, NULL);
+	pthread_mutex_init(&s->prefetch_lock, NULL);
+	pthread_cond_init(&s->prefetch_cond, NULL);
+	return s;
+}
+
+static void qcow_state_free(struct qcow_state *s)
+{
+	pthread_cond_destroy(&s->prefetch_cond);
+	pthread_mutex_destroy(&s->prefetch_lock);
+	pthread_mutex_destroy(&s->alloc_lock);
+	pthread_mutex_destroy(&s->refcount_lock);
+	pthread_mutex_destroy(&s->l1_lock);
+	free(s);
+}
+
+/* metadata cache */
+
+static int qcow_cache_init(struct qcow_cache *c, int fd, size_t cache_size,
+			   size_t table_size, unsigned int max_entries)
+{
+	unsigned int nr_entries;
+	unsigned int nr_buckets;
+	unsigned int i;
+
+	nr_entries = min(cache_size / table_size, (size_t)UINT_MAX);
+	nr_entries = max(nr_entries, (unsigned int)L2_CACHE_SIZE);
+	/* no point caching more tables than the image can have */
+	nr_entries = min(nr_entries, max(max_entries, 1U));
+
+	nr_buckets = 1;
+	while (nr_buckets < nr_entries)
+		nr_buckets <<= 1;
+
+	c->tables = calloc(nr_entries, table_size);
+	c->entries = calloc(nr_entries, sizeof(*c->entries));
+	c->buckets = malloc(nr_buckets * sizeof(*c->buckets));
+	if (!c->tables || !c->entries || !c->buckets)
+		goto free_bufs;
+
+	for (i = 0; i < nr_buckets; i++)
+		c->buckets[i] = -1;
+	for (i = 0; i < nr_entries; i++) {
+		c->entries[i].table = c->tables + (size_t)i * table_size;
+		c->entries[i].next = -1;
+		pthread_mutex_init(&c->entries[i].lock, NULL);
+	}
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+
+	c->fd = fd;
+	c->depends = NULL;
+	c->dep_gen = 0;
+	c->load = NULL;
+	c->private = NULL;
+	c->nr_dirty = 0;
+	c->table_size = table_size;
+	c->nr_entries = nr_entries;
+	c->hash_mask = nr_buckets - 1;
+	c->hand = 0;
+	c->hits = 0;
+	c->misses = 0;
+	return 0;
+
+free_bufs:
+	free(c->tables);
+	free(c->entries);
+	free(c->buckets);
+	memset(c, 0, sizeof(*c));
+	return -1;
+}
+
+static void qcow_cache_free(struct qcow_cache *c)
+{
+	unsigned int i;
+
+	if (!c->nr_entries)
+		return;
+
+	for (i = 0; i < c->nr_entries; i++)
+		pthread_mutex_destroy(&c->entries[i].lock);
+	pthread_cond_destroy(&c->cond);
+	pthread_mutex_destroy(&c->lock);
+	free(c->tables);
+	free(c->entries);
+	free(c->buckets);
+	memset(c, 0, sizeof(*c));
+}
+
+static unsigned int qcow_cache_hash(struct qcow_cache *c, uint64_t offset)
+{
+	/* the multiply moves the varying bits of aligned offsets up */
+	return (offset * 0x9E3779B97F4A7C15ULL >> 32) & c->hash_mask;
+}
+
+/* Called with the cache lock held */
+static struct qcow_cache_entry *qcow_cache_find(struct qcow_cache *c,
+						uint64_t offset)
+{
+	struct qcow_cache_entry *e;
+	int i;
+
+	for (i = c->buckets[qcow_cache_hash(c, offset)]; i != -1; i = e->next) {
+		e = &c->entries[i];
+		if (e->offset == offset)
+			return e;
+	}
+	return NULL;
+}
+
+/* Called with the cache lock held */
+static void qcow_cache_unhash(struct qcow_cache *c, struct qcow_cache_entry *e)
+{
+	int index = e - c->entries;
+	int *p;
+
+	if (!e->offset)
+		return;
+
+	for (p = &c->buckets[qcow_cache_hash(c, e->offset)]; *p != -1;
+	     p = &c->entries[*p].next) {
+		if (*p == index) {
+			*p = e->next;
+			break;
+		}
+	}
+	e->next = -1;
+	e->offset = 0;
+}
+
+/*
+ * Called with the cache lock held. Returns a clean unpinned entry to
+ * reuse, giving every entry a second chance before evicting it, or NULL
+ * if every entry is pinned or dirty.
+ */
+static struct qcow_cache_entry *qcow_cache_evict(struct qcow_cache *c)
+{
+	struct qcow_cache_entry *e;
+	unsigned int n;
+
+	for (n = 0; n < 2 * c->nr_entries; n++) {
+		e = &c->entries[c->hand];
+		c->hand = (c->hand + 1) % c->nr_entries;
+
+		/* unpinned entries are only made dirty under a pin */
+		if (e->pins || e->loading || e->dirty)
+			continue;
+		if (e->offset && e->referenced) {
+			e->referenced = false;
+			continue;
+		}
+		qcow_cache_unhash(c, e);
+		return e;
+	}
+	return NULL;
+}
+
+static int qcow_cache_flush(struct qcow_cache *c);
+
+/*
+ * Return the pinned cache entry for the table at offset, reading it in
+ * if needed. Misses are read without the cache lock held, so other
+ * tables can be looked up meanwhile.
+ */
+static struct qcow_cache_entry *qcow_cache_get(struct qcow_cache *c,
+					       uint64_t offset)
+{
+	struct qcow_cache_entry *e;
+	unsigned int bucket;
+	int ret;
+
+	pthread_mutex_lock(&c->lock);
+again:
+	e = qcow_cache_find(c, offset);
+	if (e) {
+		if (e->loading) {
+			pthread_cond_wait(&c->cond, &c->lock);
+			goto again;
+		}
+		e->referenced = true;
+		e->pins++;
+		c->hits++;
+		pthread_mutex_unlock(&c->lock);
+		return e;
+	}
+
+	e = qcow_cache_evict(c);
+	if (!e) {
+		if (__atomic_load_n(&c->nr_dirty, __ATOMIC_RELAXED)) {
+			/* make room by writing back the dirty tables */
+			pthread_mutex_unlock(&c->lock);
+			if (qcow_cache_flush(c) < 0)
+				return NULL;
+			pthread_mutex_lock(&c->lock);
+		} else {
+			pthread_cond_wait(&c->cond, &c->lock);
+		}
+		goto again;
+	}
+	c->misses++;
+
+	bucket = qcow_cache_hash(c, offset);
+	e->offset = offset;
+	e->referenced = false;
+	e->loading = true;
+	e->pins = 1;
+	e->next = c->buckets[bucket];
+	c->buckets[bucket] = e - c->entries;
+	pthread_mutex_unlock(&c->lock);
+
+	if (c->load)
+		ret = c->load(c, e);
+	else
+		ret = pread(c->fd, e->table, c->table_size, offset) ==
+			c->table_size ? 0 : -1;
+
+	pthread_mutex_lock(&c->lock);
+	e->loading = false;
+	if (ret < 0) {
+		qcow_cache_unhash(c, e);
+		e->pins = 0;
+		e = NULL;
+	}
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+	return e;
+}
+
+static void qcow_cache_put(struct qcow_cache *c, struct qcow_cache_entry *e)
+{
+	pthread_mutex_lock(&c->lock);
+	if (!--e->pins)
+		pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* Called with the entry lock held after changing a pinned table */
+static void qcow_cache_mark_dirty(struct qcow_cache *c, struct qcow_cache_entry *e)
+{
+	/*
+	 * Updates of the depends cache made for this change, like the
+	 * refcount of a newly mapped cluster, are already done here, so
+	 * they are covered by any dependency flush starting after this.
+	 */
+	if (c->depends)
+		e->dep_gen = __atomic_load_n(&c->dep_gen, __ATOMIC_SEQ_CST);
+	if (!e->dirty) {
+		e->dirty = true;
+		__atomic_add_fetch(&c->nr_dirty, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Flush and sync the cache c depends on. Tables of c last changed in a
+ * generation up to the one returned in gen may be written back after.
+ */
+static int qcow_cache_flush_depends(struct qcow_cache *c, uint64_t *gen)
+{
+	*gen = __atomic_fetch_add(&c->dep_gen, 1, __ATOMIC_SEQ_CST);
+	if (qcow_cache_flush(c->depends) < 0)
+		return -1;
+	/* data written under the new mappings must be stable too */
+	return fdatasync(c->fd);
+}
+
+/*
+ * Write back all dirty tables, after flushing the cache this one
+ * depends on, and sync them. Returns 0 or -1 if a write failed.
+ */
+static int qcow_cache_flush(struct qcow_cache *c)
+{
+	struct qcow_cache_entry *e;
+	bool written = false;
+	uint64_t gen = 0;
+	unsigned int i;
+	ssize_t ret;
+	int rc = 0;
+
+	if (!__atomic_load_n(&c->nr_dirty, __ATOMIC_RELAXED))
+		return 0;
+
+	if (c->depends && qcow_cache_flush_depends(c, &gen) < 0)
+		return -1;
+
+	for (i = 0; i < c->nr_entries; i++) {
+		e = &c->entries[i];
+
+		pthread_mutex_lock(&c->lock);
+		if (!e->offset || e->loading) {
+			pthread_mutex_unlock(&c->lock);
+			continue;
+		}
+		e->pins++;
+		pthread_mutex_unlock(&c->lock);
+
+		pthread_mutex_lock(&e->lock);
+		/*
+		 * Changed since the dependencies were synced, maybe to map
+		 * a cluster whose refcount is still dirty. The table cannot
+		 * change while its lock is held, so one more dependency
+		 * flush covers it.
+		 */
+		if (e->dirty && c->depends && e->dep_gen > gen &&
+		    qcow_cache_flush_depends(c, &gen) < 0) {
+			rc = -1;
+		} else if (e->dirty) {
+			ret = pwrite(c->fd, e->table, c->table_size, e->offset);
+			if (ret != c->table_size) {
+				tcmu_err("%s: error, table writeback at %"PRIx64" failed (%zd)\n",
+					 __func__, e->offset, ret);
+				rc = -1;
+			} else {
+				e->dirty = false;
+				__atomic_sub_fetch(&c->nr_dirty, 1, __ATOMIC_RELAXED);
+				written = true;
+			}
+		}
+		pthread_mutex_unlock(&e->lock);
+
+		qcow_cache_put(c, e);
+	}
+
+	if (written && fdatasync(c->fd) < 0)
+		rc = -1;
+	return rc;
+}
+
+static void qcow_cache_report(struct qcow_cache *c, const char *name)
+{
+	if (!c->nr_entries)
+		return;
+
+	tcmu_info("%s cache: %u x %zu bytes, %"PRIu64" hits, %"PRIu64" misses\n",
+		  name, c->nr_entries, c->table_size, c->hits, c->misses);
+}
+
 static int qcow_probe(struct bdev *bdev, int dirfd, const char *pathname)
 {
 	int fd;
@@ -410,6 +862,9 @@ static int qcow_setup_backing_file(struct bdev *bdev, struct qcow_header *header
 	/* backing file settings copied from overlay */
 	s->backing_image->size = bdev->size;
 	s->backing_image->block_size = bdev->block_size;
+	s->backing_image->l2_cache_size = bdev->l2_cache_size;
+	s->backing_image->rc_cache_size = bdev->rc_cache_size;
+	s->backing_image->cluster_cache_size = bdev->cluster_cache_size;
 
 	/* backing file pathname may be relative to the overlay image */
 	dirfd = get_dirfd(bdev->fd);
@@ -433,6 +888,165 @@ static int qcow2_setup_backing_file(struct bdev *bdev, struct qcow2_header *head
 	return qcow_setup_backing_file(bdev, (struct qcow_header *) header);
 }
 
+/* L2 table and refcount block prefetch */
+
+static void *qcow_prefetch_thread(void *arg)
+{
+	struct qcow_state *s = arg;
+	struct qcow_cache_entry *e;
+	struct qcow_cache *c;
+	uint64_t offset;
+
+	tcmu_set_thread_name("qcow-prefetch", NULL);
+
+	pthread_mutex_lock(&s->prefetch_lock);
+	while (!s->prefetch_stop) {
+		if (s->prefetch_head == s->prefetch_tail) {
+			pthread_cond_wait(&s->prefetch_cond, &s->prefetch_lock);
+			continue;
+		}
+		c = s->prefetch_queue[s->prefetch_tail % QCOW_PREFETCH_QUEUE].cache;
+		offset = s->prefetch_queue[s->prefetch_tail % QCOW_PREFETCH_QUEUE].offset;
+		s->prefetch_tail++;
+		pthread_mutex_unlock(&s->prefetch_lock);
+
+		/* just load it, prefetched tables start out unreferenced */
+		e = qcow_cache_get(c, offset);
+		if (e)
+			qcow_cache_put(c, e);
+
+		pthread_mutex_lock(&s->prefetch_lock);
+		s->prefetched++;
+	}
+	pthread_mutex_unlock(&s->prefetch_lock);
+	return NULL;
+}
+
+/* Called with prefetch_lock held. Drops the request if the queue is full. */
+static bool qcow_prefetch_queue(struct qcow_state *s, struct qcow_cache *c,
+				uint64_t offset)
+{
+	if (s->prefetch_head - s->prefetch_tail == QCOW_PREFETCH_QUEUE)
+		return false;
+
+	s->prefetch_queue[s->prefetch_head % QCOW_PREFETCH_QUEUE].cache = c;
+	s->prefetch_queue[s->prefetch_head % QCOW_PREFETCH_QUEUE].offset = offset;
+	s->prefetch_head++;
+	return true;
+}
+
+/* Queue the refcount block after the one clusters are allocated from */
+static void qcow_prefetch_refblock(struct qcow_state *s)
+{
+	unsigned int refcount_bits;
+	uint64_t rc_index;
+	uint64_t refblock_offset;
+
+	/* the allocator may be busy scanning, skip it this time */
+	if (pthread_mutex_trylock(&s->alloc_lock))
+		return;
+	refcount_bits = s->cluster_bits - s->refcount_order + 3;
+	rc_index = (s->first_free_cluster >> (s->cluster_bits + refcount_bits)) + 1;
+	pthread_mutex_unlock(&s->alloc_lock);
+
+	if (rc_index >= s->refcount_table_size)
+		return;
+	refblock_offset = be64toh(__atomic_load_n(&s->refcount_table[rc_index],
+						  __ATOMIC_ACQUIRE));
+	if (refblock_offset)
+		qcow_prefetch_queue(s, &s->rc_cache, refblock_offset);
+}
+
+/*
+ * Called on every cluster lookup. Lookups from several workers can race
+ * here, which at worst makes the detection miss a beat.
+ */
+static void qcow_prefetch_hint(struct qcow_state *s, unsigned int l1_index,
+			       bool allocate)
+{
+	unsigned int last, depth, i;
+	uint64_t l2_offset;
+	bool queued = false;
+
+	if (!s->prefetch_running)
+		return;
+
+	last = __atomic_exchange_n(&s->last_l1_index, l1_index, __ATOMIC_RELAXED);
+	if (l1_index == last)
+		return;
+	if (l1_index != last + 1) {
+		__atomic_store_n(&s->seq_streak, 0, __ATOMIC_RELAXED);
+		return;
+	}
+	if (__atomic_add_fetch(&s->seq_streak, 1, __ATOMIC_RELAXED) <
+	    QCOW_PREFETCH_TRIGGER)
+		return;
+
+	/* never let read ahead take over more than a quarter of the cache */
+	depth = min((unsigned int)QCOW_PREFETCH_TABLES,
+		    max(s->l2_cache.nr_entries / 4, 1U));
+
+	pthread_mutex_lock(&s->prefetch_lock);
+	/* skip the tables already queued for this stream */
+	i = l1_index + 1;
+	if (s->prefetch_l1_next > i && s->prefetch_l1_next <= i + depth)
+		i = s->prefetch_l1_next;
+	s->prefetch_l1_next = l1_index + 1 + depth;
+	for (; i < l1_index + 1 + depth && i < s->l1_size; i++) {
+		l2_offset = be64toh(__atomic_load_n(&s->l1_table[i],
+						    __ATOMIC_ACQUIRE)) & s->cluster_mask;
+		if (l2_offset && qcow_prefetch_queue(s, &s->l2_cache, l2_offset))
+			queued = true;
+	}
+	if (allocate && s->rc_cache.nr_entries) {
+		qcow_prefetch_refblock(s);
+		queued = true;
+	}
+	if (queued)
+		pthread_cond_signal(&s->prefetch_cond);
+	pthread_mutex_unlock(&s->prefetch_lock);
+}
+
+static void qcow_prefetch_start(struct qcow_state *s)
+{
+	s->last_l1_index = UINT_MAX - 1;
+	if (pthread_create(&s->prefetch_thread, NULL, qcow_prefetch_thread, s)) {
+		tcmu_warn("Could not start L2 prefetch thread, continuing without it\n");
+		return;
+	}
+	s->prefetch_running = true;
+}
+
+static void qcow_prefetch_stop(struct qcow_state *s)
+{
+	if (!s->prefetch_running)
+		return;
+
+	pthread_mutex_lock(&s->prefetch_lock);
+	s->prefetch_stop = true;
+	pthread_cond_signal(&s->prefetch_cond);
+	pthread_mutex_unlock(&s->prefetch_lock);
+	pthread_join(s->prefetch_thread, NULL);
+	s->prefetch_running = false;
+
+	tcmu_info("prefetch: %"PRIu64" tables read ahead\n", s->prefetched);
+}
+
+static int decompress_cluster(struct qcow_cache *c, struct qcow_cache_entry *e);
+
+static int qcow_cluster_cache_init(struct bdev *bdev)
+{
+	struct qcow_state *s = bdev->private;
+
+	if (qcow_cache_init(&s->cluster_cache, bdev->fd,
+			    bdev->cluster_cache_size ? : QCOW_CLUSTER_CACHE_DEFAULT,
+			    s->cluster_size, UINT_MAX) < 0)
+		return -1;
+	s->cluster_cache.load = decompress_cluster;
+	s->cluster_cache.private = s;
+	return 0;
+}
+
 static int qcow_image_open(struct bdev *bdev, int dirfd, const char *pathname, int flags)
 {
 	struct qcow_header buf;
@@ -442,7 +1056,7 @@ static int qcow_image_open(struct bdev *bdev, int dirfd, const char *pathname, i
 	unsigned int shift;
 	ssize_t read;
 
-	s = calloc(1, sizeof(struct qcow_state));
+	s = qcow_state_alloc();
 	if (!s)
 		return -1;
 	bdev->private = s;
@@ -513,17 +1127,14 @@ static int qcow_image_open(struct bdev *bdev, int dirfd, const char *pathname, i
 		goto fail;
 	}
 
-	s->l2_cache = calloc(L2_CACHE_SIZE, s->l2_size * sizeof(uint64_t));
-	if (s->l2_cache == NULL) {
+	if (qcow_cache_init(&s->l2_cache, bdev->fd,
+			    bdev->l2_cache_size ? : QCOW_L2_CACHE_DEFAULT,
+			    s->l2_size * sizeof(uint64_t), s->l1_size) < 0) {
 		tcmu_err("Failed to allocate L2 cache\n");
 		goto fail;
 	}
 
-	/* cluster decompression cache */
-	s->cluster_cache = calloc(1, s->cluster_size);
-	s->cluster_data = calloc(1, s->cluster_size);
-	s->cluster_cache_offset = -1;
-	if (!s->cluster_cache || !s->cluster_data) {
+	if (qcow_cluster_cache_init(bdev) < 0) {
 		tcmu_err("Failed to allocate cluster decompression space\n");
 		goto fail;
 	}
@@ -536,16 +1147,16 @@ static int qcow_image_open(struct bdev *bdev, int dirfd, const char *pathname, i
 
 	s->block_alloc = qcow_block_alloc;
 	s->set_refcount = qcow_no_refcount;
+	qcow_prefetch_start(s);
 	tcmu_dbg("%d: %s\n", bdev->fd, pathname);
 	return 0;
 fail:
 	close(bdev->fd);
-	free(s->cluster_cache);
-	free(s->cluster_data);
-	free(s->l2_cache);
+	qcow_cache_free(&s->cluster_cache);
+	qcow_cache_free(&s->l2_cache);
 	free(s->l1_table);
 fail_nofd:
-	free(s);
+	qcow_state_free(s);
 	return -1;
 }
 
@@ -558,7 +1169,7 @@ static int qcow2_image_open(struct bdev *bdev, int dirfd, const char *pathname,
 	unsigned int shift;
 	ssize_t read;
 
-	s = calloc(1, sizeof(struct qcow_state));
+	s = qcow_state_alloc();
 	if (!s)
 		return -1;
 	bdev->private = s;
@@ -634,22 +1245,19 @@ static int qcow2_image_open(struct bdev *bdev, int dirfd, const char *pathname,
 		goto fail;
 	}
 
-	s->l2_cache = calloc(L2_CACHE_SIZE, s->l2_size * sizeof(uint64_t));
-	if (s->l2_cache == NULL) {
+	if (qcow_cache_init(&s->l2_cache, bdev->fd,
+			    bdev->l2_cache_size ? : QCOW_L2_CACHE_DEFAULT,
+			    s->l2_size * sizeof(uint64_t), s->l1_size) < 0) {
 		tcmu_err("Failed to allocate L2 cache\n");
 		goto fail;
 	}
-	tcmu_dbg("s->l2_cache = %p\n", s->l2_cache);
+	tcmu_dbg("s->l2_cache = %u tables\n", s->l2_cache.nr_entries);
 
-	/* cluster decompression cache */
-	s->cluster_cache = calloc(1, s->cluster_size);
-	s->cluster_data = calloc(1, s->cluster_size);
-	s->cluster_cache_offset = -1;
-	if (!s->cluster_cache || !s->cluster_data) {
+	if (qcow_cluster_cache_init(bdev) < 0) {
 		tcmu_err("Failed to allocate cluster decompression space\n");
 		goto fail;
 	}
-	tcmu_dbg("s->cluster_cache = %p\n", s->cluster_cache);
+	tcmu_dbg("s->cluster_cache = %u clusters\n", s->cluster_cache.nr_entries);
 
 	/* refcount table */
 	s->refcount_table_offset = header.refcount_table_offset;
@@ -667,12 +1275,15 @@ static int qcow2_image_open(struct bdev *bdev, int dirfd, const char *pathname,
 	}
 
 	s->refcount_order = header.refcount_order;
-	s->rc_cache = calloc(RC_CACHE_SIZE, s->cluster_size);
-	if (s->rc_cache == NULL) {
+	if (qcow_cache_init(&s->rc_cache, bdev->fd,
+			    bdev->rc_cache_size ? : QCOW_RC_CACHE_DEFAULT,
+			    s->cluster_size, s->refcount_table_size) < 0) {
 		tcmu_err("Failed to allocate refcount cache\n");
 		goto fail;
 	}
-	tcmu_dbg("s->rc_cache = %p\n", s->rc_cache);
+	/* refcounts must reach the disk before the L2 entries using them */
+	s->l2_cache.depends = &s->rc_cache;
+	tcmu_dbg("s->rc_cache = %u tables\n", s->rc_cache.nr_entries);
 
 	if (qcow2_setup_backing_file(bdev, &header) == -1)
 		goto fail;
@@ -683,75 +1294,57 @@ static int qcow2_image_open(struct bdev *bdev, int dirfd, const char *pathname,
 
 	s->block_alloc = qcow2_block_alloc;
 	s->set_refcount = qcow2_set_refcount;
+	qcow_prefetch_start(s);
 	tcmu_dbg("%d: %s\n", bdev->fd, pathname);
 	return 0;
 fail:
 	close(bdev->fd);
-	free(s->cluster_cache);
-	free(s->cluster_data);
-	free(s->rc_cache);
+	qcow_cache_free(&s->cluster_cache);
+	qcow_cache_free(&s->rc_cache);
 	free(s->refcount_table);
-	free(s->l2_cache);
+	qcow_cache_free(&s->l2_cache);
 	free(s->l1_table);
 fail_nofd:
-	free(s);
+	qcow_state_free(s);
 	return -1;
 }
 
+static int qcow_image_flush(struct bdev *bdev)
+{
+	struct qcow_state *s = bdev->private;
+
+	/* the L2 cache flushes the refcounts it depends on first */
+	if (qcow_cache_flush(&s->l2_cache) < 0)
+		return -1;
+	return qcow_cache_flush(&s->rc_cache);
+}
+
 static void qcow_image_close(struct bdev *bdev)
 {
 	struct qcow_state *s = bdev->private;
 
+	qcow_prefetch_stop(s);
 	if (s->backing_image) {
 		s->backing_image->ops->close(s->backing_image);
 		free(s->backing_image);
 	}
+	if (qcow_image_flush(bdev) < 0 || fdatasync(bdev->fd) < 0)
+		tcmu_err("Failed to write back metadata on close\n");
 	close(bdev->fd);
-	free(s->cluster_cache);
-	free(s->cluster_data);
+	qcow_cache_report(&s->cluster_cache, "compressed cluster");
+	qcow_cache_free(&s->cluster_cache);
 	free(s->l1_table);
-	free(s->l2_cache);
+	qcow_cache_report(&s->l2_cache, "L2");
+	qcow_cache_free(&s->l2_cache);
 	free(s->refcount_table);
-	free(s->rc_cache);
-	free(s);
+	qcow_cache_report(&s->rc_cache, "refcount");
+	qcow_cache_free(&s->rc_cache);
+	qcow_state_free(s);
 }
 
-static uint64_t *l2_cache_lookup(struct qcow_state *s, uint64_t l2_offset)
+static struct qcow_cache_entry *l2_cache_get(struct qcow_state *s, uint64_t l2_offset)
 {
-	int i, j;
-	int min_index = 0;
-	int min_count = INT_MAX;
-	uint64_t *l2_table;
-	ssize_t read;
-
-	/* l2 cache lookup */
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (l2_offset == s->l2_cache_offsets[i]) {
-			if (++s->l2_cache_counts[i] == INT_MAX) {
-				for (j = 0; i < L2_CACHE_SIZE; j++) {
-					s->l2_cache_counts[j] >>= 1;
-				}
-			}
-			l2_table = s->l2_cache + (i << s->l2_bits);
-			tcmu_dbg("%s: l2 hit %"PRIx64" at index %d\n", __func__, *l2_table, i);
-			return l2_table;
-		}
-	}
-	/* not found, evict least used entry */
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (s->l2_cache_counts[i] < min_count) {
-			min_count = s->l2_cache_counts[i];
-			min_index = i;
-		}
-	}
-	l2_table = s->l2_cache + (min_index << s->l2_bits);
-	read = pread(s->fd, l2_table, s->l2_size * sizeof(uint64_t), l2_offset);
-	if (read != s->l2_size * sizeof(uint64_t))
-		return NULL;
-	s->l2_cache_offsets[min_index] = l2_offset;
-	s->l2_cache_counts[min_index] = 1;
-
-	return l2_table;
+	return qcow_cache_get(&s->l2_cache, l2_offset);
 }
 
 static uint64_t qcow_cluster_alloc(struct qcow_state *s)
@@ -763,15 +1356,18 @@ static uint64_t qcow_cluster_alloc(struct qcow_state *s)
 /* qcow 1 simply grows the file as new clusters or L2 blocks are needed */
 static uint64_t qcow_block_alloc(struct qcow_state *s, size_t size)
 {
-	uint64_t offset;
+	uint64_t offset = 0;
 	off_t off;
 
+	pthread_mutex_lock(&s->alloc_lock);
 	off = lseek(s->fd, 0, SEEK_END);
 	if (off == -1)
-		return 0;
+		goto unlock;
 	offset = (off + size - 1) & ~(size - 1);
 	if (ftruncate(s->fd, offset + size) == -1)
-		return 0;
+		offset = 0;
+unlock:
+	pthread_mutex_unlock(&s->alloc_lock);
 	return offset;
 }
 
@@ -786,7 +1382,8 @@ static int l1_table_update(struct qcow_state *s, unsigned int l1_index, uint64_t
 	ssize_t ret;
 
 	tcmu_dbg("%s: setting L1[%u] to %"PRIx64"\n", __func__, l1_index, l2_offset);
-	s->l1_table[l1_index] = htobe64(l2_offset);
+	__atomic_store_n(&s->l1_table[l1_index], htobe64(l2_offset),
+			 __ATOMIC_RELEASE);
 
 	ret = pwrite(s->fd,
 		&s->l1_table[l1_index],
@@ -796,7 +1393,7 @@ static int l1_table_update(struct qcow_state *s, unsigned int l1_index, uint64_t
 	if (ret != sizeof(uint64_t))
 		tcmu_err("%s: error, L1 writeback failed (%zd)\n", __func__, ret);
 
-	fdatasync(s->fd);
+	/* the new L2 table is zeroed, it is synced on the next flush */
 	return ret;
 }
 
@@ -860,41 +1457,9 @@ static void set_refcount(unsigned int order, void *rcblock, size_t index, uint64
 	}
 }
 
-static void *rc_cache_lookup(struct qcow_state *s, uint64_t rc_offset)
+static struct qcow_cache_entry *rc_cache_get(struct qcow_state *s, uint64_t rc_offset)
 {
-	int i, j;
-	int min_index = 0;
-	int min_count = INT_MAX;
-	void *rc_table;
-	ssize_t read;
-
-	/* rc cache lookup */
-	for (i = 0; i < RC_CACHE_SIZE; i++) {
-		if (rc_offset == s->rc_cache_offsets[i]) {
-			if (++s->rc_cache_counts[i] == INT_MAX) {
-				for (j = 0; i < RC_CACHE_SIZE; j++) {
-					s->rc_cache_counts[j] >>= 1;
-				}
-			}
-			rc_table = s->rc_cache + (i << s->cluster_bits);
-			return rc_table;
-		}
-	}
-	/* not found, evict least used entry */
-	for (i = 0; i < RC_CACHE_SIZE; i++) {
-		if (s->rc_cache_counts[i] < min_count) {
-			min_count = s->rc_cache_counts[i];
-			min_index = i;
-		}
-	}
-	rc_table = s->rc_cache + (min_index << s->cluster_bits);
-	read = pread(s->fd, rc_table, 1 << s->cluster_bits, rc_offset);
-	if (read != 1 << s->cluster_bits)
-		return NULL;
-	s->rc_cache_offsets[min_index] = rc_offset;
-	s->rc_cache_counts[min_index] = 1;
-
-	return rc_table;
+	return qcow_cache_get(&s->rc_cache, rc_offset);
 }
 
 static uint64_t qcow2_get_refcount(struct qcow_state *s, int64_t cluster_offset)
@@ -903,21 +1468,26 @@ static uint64_t qcow2_get_refcount(struct qcow_state *s, int64_t cluster_offset)
 	uint64_t rc_index;
 	uint64_t refblock_offset;
 	uint64_t refblock_index;
-	void *refblock;
+	struct qcow_cache_entry *refblock;
 	uint64_t rc;
 
 	refcount_bits = s->cluster_bits - s->refcount_order + 3;
 	rc_index = cluster_offset >> (s->cluster_bits + refcount_bits);
-	refblock_offset = be64toh(s->refcount_table[rc_index]);
+	refblock_offset = be64toh(__atomic_load_n(&s->refcount_table[rc_index],
+						  __ATOMIC_ACQUIRE));
 	if (!refblock_offset)
 		return 0;
 
-	refblock = rc_cache_lookup(s, refblock_offset);
+	refblock = rc_cache_get(s, refblock_offset);
 	if (!refblock)
 		return 0;
 
 	refblock_index = (cluster_offset >> s->cluster_bits) & ((1 << refcount_bits) - 1);
-	rc = get_refcount(s->refcount_order, refblock, refblock_index);
+	/* sub-byte refcounts are updated with read-modify-write */
+	pthread_mutex_lock(&refblock->lock);
+	rc = get_refcount(s->refcount_order, refblock->table, refblock_index);
+	pthread_mutex_unlock(&refblock->lock);
+	qcow_cache_put(&s->rc_cache, refblock);
 	return rc;
 }
 
@@ -926,7 +1496,8 @@ static int rc_table_update(struct qcow_state *s, unsigned int rc_index, uint64_t
 	ssize_t ret;
 
 	tcmu_dbg("%s: setting RC[%u] to %"PRIx64"\n", __func__, rc_index, refblock_offset);
-	s->refcount_table[rc_index] = htobe64(refblock_offset);
+	__atomic_store_n(&s->refcount_table[rc_index], htobe64(refblock_offset),
+			 __ATOMIC_RELEASE);
 
 	ret = pwrite(s->fd,
 		&s->refcount_table[rc_index],
@@ -946,40 +1517,51 @@ static int qcow2_set_refcount(struct qcow_state *s, uint64_t cluster_offset, uin
 	uint64_t rc_index;
 	uint64_t refblock_offset;
 	uint64_t refblock_index;
-	void *refblock;
-	ssize_t ret;
+	struct qcow_cache_entry *refblock;
+	bool new_refblock = false;
 
 	refcount_bits = s->cluster_bits - s->refcount_order + 3;
 	rc_index = cluster_offset >> (s->cluster_bits + refcount_bits);
-	refblock_offset = be64toh(s->refcount_table[rc_index]);
+	refblock_offset = be64toh(__atomic_load_n(&s->refcount_table[rc_index],
+						  __ATOMIC_ACQUIRE));
 	refblock_index = (cluster_offset >> s->cluster_bits) & ((1 << refcount_bits) - 1);
 
 	tcmu_dbg("%s: rc[%"PRIu64"][%"PRIu64"] = %"PRIx64"[%"PRIu64"] = %"PRIu64"\n",
 		__func__, rc_index, refblock_index, refblock_offset, refblock_index, value);
 
 	if (!refblock_offset) {
-		if (!(refblock_offset = qcow_cluster_alloc(s))) {
-			tcmu_err("refblock allocation failure\n");
-			return -1;
+		pthread_mutex_lock(&s->refcount_lock);
+		/* recheck, another thread may have allocated it meanwhile */
+		refblock_offset = be64toh(s->refcount_table[rc_index]);
+		if (!refblock_offset) {
+			if (!(refblock_offset = qcow_cluster_alloc(s))) {
+				pthread_mutex_unlock(&s->refcount_lock);
+				tcmu_err("refblock allocation failure\n");
+				return -1;
+			}
+			rc_table_update(s, rc_index, refblock_offset);
+			new_refblock = true;
 		}
-		rc_table_update(s, rc_index, refblock_offset);
-		qcow2_set_refcount(s, refblock_offset, 1);
+		pthread_mutex_unlock(&s->refcount_lock);
+
+		/* the refblock's own refcount may need yet another refblock */
+		if (new_refblock)
+			qcow2_set_refcount(s, refblock_offset, 1);
 	}
 
-	refblock = rc_cache_lookup(s, refblock_offset);
+	refblock = rc_cache_get(s, refblock_offset);
 	if (!refblock) {
 		tcmu_err("refblock cache failure\n");
 		return -1;
 	}
 
-	set_refcount(s->refcount_order, refblock, refblock_index, value);
-
-	/* for now this writes back the entire block */
-	ret = pwrite(s->fd, refblock, s->cluster_size, refblock_offset);
-	if (ret != s->cluster_size)
-		tcmu_err("%s: error, refblock writeback failed (%zd)\n", __func__, ret);
-	fdatasync(s->fd);
-	return ret;
+	/* the block is written back on the next cache flush */
+	pthread_mutex_lock(&refblock->lock);
+	set_refcount(s->refcount_order, refblock->table, refblock_index, value);
+	qcow_cache_mark_dirty(&s->rc_cache, refblock);
+	pthread_mutex_unlock(&refblock->lock);
+	qcow_cache_put(&s->rc_cache, refblock);
+	return 0;
 }
 
 /* qcow 2 uses the refcount table to find free clusters */
@@ -993,43 +1575,61 @@ static uint64_t qcow2_block_alloc(struct qcow_state *s, size_t size)
 	/* all allocations for qcow2 should be of the same size */
 	assert(size == s->cluster_size);
 
-	cluster = s->first_free_cluster;
-	while (qcow2_get_refcount(s, cluster)) {
-		cluster += s->cluster_size;
-	}
-
-	ret = fallocate(s->fd, FALLOC_FL_ZERO_RANGE, cluster, s->cluster_size);
-	if (ret) {
-		tcmu_err("fallocate failed: %m\n");
-		return 0;
+	/*
+	 * The refcount of the new cluster is only set by the caller, so
+	 * first_free_cluster must move past it before anyone else scans.
+	 */
+	pthread_mutex_lock(&s->alloc_lock);
+	if (s->prealloc_next == s->prealloc_end) {
+		/*
+		 * Reserve and zero a run of up to QCOW2_PREALLOC_CLUSTERS
+		 * free clusters at once. Clusters left over when the image
+		 * is closed still have a zero refcount, so nothing leaks.
+		 */
+		cluster = s->first_free_cluster;
+		while (qcow2_get_refcount(s, cluster)) {
+			cluster += s->cluster_size;
+		}
+		s->prealloc_next = cluster;
+		s->prealloc_end = cluster + s->cluster_size;
+		while (s->prealloc_end - cluster <
+		       QCOW2_PREALLOC_CLUSTERS * s->cluster_size &&
+		       !qcow2_get_refcount(s, s->prealloc_end))
+			s->prealloc_end += s->cluster_size;
+
+		ret = fallocate(s->fd, FALLOC_FL_ZERO_RANGE, cluster,
+				s->prealloc_end - cluster);
+		if (ret) {
+			s->prealloc_next = s->prealloc_end = 0;
+			pthread_mutex_unlock(&s->alloc_lock);
+			tcmu_err("fallocate failed: %m\n");
+			return 0;
+		}
+		s->first_free_cluster = s->prealloc_end;
 	}
-	s->first_free_cluster = cluster + s->cluster_size;
+	cluster = s->prealloc_next;
+	s->prealloc_next += s->cluster_size;
+	pthread_mutex_unlock(&s->alloc_lock);
 	// this causes a nasty loop
 	// qcow2_set_refcount(s, cluster, 1);
 	tcmu_dbg("  allocating cluster %"PRIu64"\n", cluster / s->cluster_size);
 	return cluster;
 }
 
-static int l2_table_update(struct qcow_state *s,
-			   uint64_t *l2_table, uint64_t l2_table_offset,
-			   unsigned int l2_index, uint64_t cluster_offset)
+/*
+ * Called with the L2 table's cache entry lock held. The table is
+ * written back on the next cache flush.
+ */
+static void l2_table_update(struct qcow_state *s, struct qcow_cache_entry *l2,
+			    unsigned int l2_index, uint64_t cluster_offset)
 {
-	ssize_t ret;
+	uint64_t *l2_table = l2->table;
 
 	tcmu_dbg("%s: setting %"PRIx64"[%u] to %"PRIx64"\n",
-		__func__, l2_table_offset, l2_index, cluster_offset);
-	l2_table[l2_index] = htobe64(cluster_offset);
-
-	ret = pwrite(s->fd,
-		&(l2_table[l2_index]),
-		sizeof(uint64_t),
-		l2_table_offset + (l2_index * sizeof(uint64_t)));
-
-	if (ret != sizeof(uint64_t))
-		tcmu_err("%s: error, L2 writeback failed (%zd)\n", __func__, ret);
-
-	fdatasync(s->fd);
-	return ret;
+		__func__, l2->offset, l2_index, cluster_offset);
+	__atomic_store_n(&l2_table[l2_index], htobe64(cluster_offset),
+			 __ATOMIC_RELEASE);
+	qcow_cache_mark_dirty(&s->l2_cache, l2);
 }
 
 static int decompress_buffer(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size)
@@ -1057,27 +1657,109 @@ static int decompress_buffer(uint8_t *dst, size_t dst_size, const uint8_t *src,
 	return 0;
 }
 
-static int decompress_cluster(struct qcow_state *s, uint64_t cluster_offset)
+/*
+ * Cluster cache load callout. The entry is keyed by the compressed
+ * cluster's L2 entry, which holds both its offset and its size.
+ */
+static int decompress_cluster(struct qcow_cache *c, struct qcow_cache_entry *e)
 {
+	struct qcow_state *s = c->private;
+	uint64_t cluster_offset = e->offset;
+	uint8_t *cluster_data;
 	uint64_t coffset;
 	size_t csize;
 	ssize_t ret;
 
 	coffset = cluster_offset & s->cluster_offset_mask;
-	if (s->cluster_cache_offset != coffset) {
-		csize = cluster_offset >> (63 - s->cluster_bits);
-		csize &= (s->cluster_size -1);
-		ret = pread(s->fd, s->cluster_data, csize, coffset);
-		if (ret != csize)
-			return -1;
-		ret = decompress_buffer(s->cluster_cache, s->cluster_size, s->cluster_data, csize);
-		if (ret < 0)
-			return -1;
-		s->cluster_cache_offset = coffset;
+	csize = cluster_offset >> (63 - s->cluster_bits);
+	csize &= (s->cluster_size -1);
+
+	cluster_data = malloc(csize);
+	if (!cluster_data)
+		return -1;
+	ret = pread(s->fd, cluster_data, csize, coffset);
+	if (ret == csize)
+		ret = decompress_buffer(e->table, s->cluster_size, cluster_data, csize);
+	else
+		ret = -1;
+	free(cluster_data);
+	return ret < 0 ? -1 : 0;
+}
+
+static struct qcow_cache_entry *cluster_cache_get(struct qcow_state *s,
+						  uint64_t cluster_offset)
+{
+	return qcow_cache_get(&s->cluster_cache, cluster_offset);
+}
+
+/*
+ * Allocate a cluster for writing to L2 entry l2_index, which currently
+ * maps to cluster_offset. Returns the new L2 entry, or 0 on failure.
+ *
+ * Called with the L2 table's cache entry lock held.
+ */
+static uint64_t l2_entry_alloc(struct qcow_state *s, struct qcow_cache_entry *l2,
+			       unsigned int l2_index, uint64_t cluster_offset)
+{
+	struct qcow_cache_entry *cluster;
+	uint64_t old_offset;
+	uint8_t *cow_buffer = NULL;
+	ssize_t ret;
+
+	if (!cluster_offset) {
+		/* sector not allocated in image file */
+		if (!(cluster_offset = qcow_cluster_alloc(s)))
+			return 0;
+	} else if (cluster_offset & s->cluster_compressed) {
+		tcmu_err("re-allocating compressed cluster for writing\n");
+		/* reallocate a compressed cluster for writing */
+		old_offset = cluster_offset;
+		if (!(cluster_offset = qcow_cluster_alloc(s)))
+			return 0;
+		if (!(cluster = cluster_cache_get(s, old_offset)))
+			return 0;
+		ret = pwrite(s->fd, cluster->table, s->cluster_size, cluster_offset);
+		qcow_cache_put(&s->cluster_cache, cluster);
+		if (ret != s->cluster_size)
+			return 0;
+	} else {
+		// TODO what if this is compressed?
+		old_offset = cluster_offset & s->cluster_mask;
+
+		tcmu_err("re-allocating shared cluster for writing\n");
+		/* refcount > 1 (the copied bit means refcount == 1)
+		 * need to make a new copy if this is for a write */
+		if (!(cow_buffer = malloc(s->cluster_size)))
+			goto fail;
+		if (!(cluster_offset = qcow_cluster_alloc(s)))
+			goto fail;
+		if (pread(s->fd, cow_buffer, s->cluster_size, old_offset) != s->cluster_size)
+			goto fail;
+		if (pwrite(s->fd, cow_buffer, s->cluster_size, cluster_offset) != s->cluster_size)
+			goto fail;
+		free(cow_buffer);
+		// TODO drop refcount on old cluster
 	}
+
+	/* the refcount must be set before the L2 table can be written back */
+	s->set_refcount(s, cluster_offset, 1);
+	l2_table_update(s, l2, l2_index, cluster_offset | s->cluster_copied);
+	return cluster_offset | s->cluster_copied;
+fail:
+	tcmu_err("CoW failed\n");
+	free(cow_buffer);
 	return 0;
 }
 
+/* true if a write to a cluster with this L2 entry needs a new cluster */
+static bool l2_entry_needs_alloc(struct qcow_state *s, uint64_t cluster_offset)
+{
+	if (!cluster_offset || (cluster_offset & s->cluster_compressed))
+		return true;
+	/* qcow has no copied flag, its clusters are never shared */
+	return s->cluster_copied && !(cluster_offset & s->cluster_copied);
+}
+
 /**
  * get_cluster_offset()
  * returns the file offset for the start of a cluster containing a sector
@@ -1086,84 +1768,75 @@ static int decompress_cluster(struct qcow_state *s, uint64_t cluster_offset)
  *
  * offset: virtual image sector offset
  * allocate: true if new cluster and L2 table allocations should happen (writes)
+ *
+ * Lookups of allocated clusters only take the cache lock for as long as
+ * it takes to pin the L2 table. Allocations are serialized on the L1
+ * table for new L2 tables, and otherwise only on the L2 table updated.
  */
 static uint64_t get_cluster_offset(struct qcow_state *s, const uint64_t offset, bool allocate)
 {
 	unsigned int l1_index;
 	unsigned int l2_index;
 	uint64_t l2_offset;
+	struct qcow_cache_entry *l2;
 	uint64_t *l2_table;
 	uint64_t cluster_offset;
 
 	tcmu_dbg("%s: %"PRIx64" %s\n", __func__, offset, allocate ? "write" : "read");
 
 	l1_index = offset >> (s->l2_bits + s->cluster_bits);
-	l2_offset = be64toh(s->l1_table[l1_index]) & s->cluster_mask;
+	l2_offset = be64toh(__atomic_load_n(&s->l1_table[l1_index],
+					    __ATOMIC_ACQUIRE)) & s->cluster_mask;
 	l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+	qcow_prefetch_hint(s, l1_index, allocate);
 	// TODO, check refcount on L2 table and handle CoW for metadata updates
 	tcmu_dbg("  l1_index = %d\n", l1_index);
 	tcmu_dbg("  l2_offset = %"PRIx64"\n", l2_offset);
 	tcmu_dbg("  l2_index = %d\n", l2_index);
 
 	if (!l2_offset) {
-		if (!allocate || !(l2_offset = l2_table_alloc(s)))
+		if (!allocate)
+			return 0;
+
+		pthread_mutex_lock(&s->l1_lock);
+		/* recheck, another thread may have allocated it meanwhile */
+		l2_offset = be64toh(s->l1_table[l1_index]) & s->cluster_mask;
+		if (!l2_offset && (l2_offset = l2_table_alloc(s))) {
+			/*
+			 * L1 updates are written through, so the L2 table's
+			 * refcount has to reach the disk first.
+			 */
+			s->set_refcount(s, l2_offset, 1);
+			if (qcow_cache_flush(&s->rc_cache) < 0)
+				l2_offset = 0;
+			else
+				l1_table_update(s, l1_index, l2_offset | s->cluster_copied);
+		}
+		pthread_mutex_unlock(&s->l1_lock);
+		if (!l2_offset)
 			return 0;
-		l1_table_update(s, l1_index, l2_offset | s->cluster_copied);
-		s->set_refcount(s, l2_offset, 1);
 	}
 
-	l2_table = l2_cache_lookup(s, l2_offset);
-	if (!l2_table)
+	l2 = l2_cache_get(s, l2_offset);
+	if (!l2)
 		return 0;
+	l2_table = l2->table;
 
-	cluster_offset = be64toh(l2_table[l2_index]); // & s->cluster_mask;
+	cluster_offset = be64toh(__atomic_load_n(&l2_table[l2_index],
+						 __ATOMIC_ACQUIRE)); // & s->cluster_mask;
 	tcmu_dbg("  l2_table @ %p\n", l2_table);
 	tcmu_dbg("  cluster offset = %" PRIx64 "\n", cluster_offset);
 
-	if (!cluster_offset) {
-		/* sector not allocated in image file */
-		if (!allocate || !(cluster_offset = qcow_cluster_alloc(s)))
-			return 0;
-		l2_table_update(s, l2_table, l2_offset, l2_index, cluster_offset | s->cluster_copied);
-		s->set_refcount(s, cluster_offset, 1);
-	} else if ((cluster_offset & s->cluster_compressed) && allocate) {
-		tcmu_err("re-allocating compressed cluster for writing\n");
-		/* reallocate a compressed cluster for writing */
-		if (decompress_cluster(s, cluster_offset) < 0)
-			return 0;
-		if (!(cluster_offset = qcow_cluster_alloc(s)))
-			return 0;
-		if (pwrite(s->fd, s->cluster_cache, s->cluster_size, cluster_offset) != s->cluster_size)
-			return 0;
-		l2_table_update(s, l2_table, l2_offset, l2_index, cluster_offset | s->cluster_copied);
-		s->set_refcount(s, cluster_offset, 1);
-	} else if (!(cluster_offset & s->cluster_copied) && allocate) {
-		uint64_t old_offset = cluster_offset & s->cluster_mask;
-		// TODO what if this is compressed?
-		uint8_t *cow_buffer;
-
-		tcmu_err("re-allocating shared cluster for writing\n");
-		/* refcount > 1 (the copied bit means refcount == 1)
-		 * need to make a new copy if this is for a write */
-		if (!(cow_buffer = malloc(s->cluster_size)))
-			goto fail;
-		if (!(cluster_offset = qcow_cluster_alloc(s)))
-			goto fail;
-		if (pread(s->fd, cow_buffer, s->cluster_size, old_offset) != s->cluster_size)
-			goto fail;
-		if (pwrite(s->fd, cow_buffer, s->cluster_size, cluster_offset) != s->cluster_size)
-			goto fail;
-		free(cow_buffer);
-		l2_table_update(s, l2_table, l2_offset, l2_index, cluster_offset | s->cluster_copied);
-		s->set_refcount(s, cluster_offset, 1);
-		// TODO drop refcount on old cluster
-		goto out;
-	fail:
-		tcmu_err("CoW failed\n");
-		free(cow_buffer);
-		return 0;
+	if (allocate && l2_entry_needs_alloc(s, cluster_offset)) {
+		pthread_mutex_lock(&l2->lock);
+		cluster_offset = be64toh(l2_table[l2_index]);
+		if (l2_entry_needs_alloc(s, cluster_offset))
+			cluster_offset = l2_entry_alloc(s, l2, l2_index,
+							cluster_offset);
+		pthread_mutex_unlock(&l2->lock);
 	}
-out:
+	qcow_cache_put(&s->l2_cache, l2);
+
 	return cluster_offset & ~(s->cluster_copied);
 }
 
@@ -1207,9 +1880,85 @@ static void iovec_memset(struct iovec *iov, int iovcnt, int c, size_t len)
 	}
 }
 
-static ssize_t qcow_preadv(struct bdev *bdev, struct iovec *iov, int iovcnt, off_t offset)
+/* Kinds of runs a request is split into by qcow_map_extent() */
+enum {
+	QCOW_EXTENT_DATA,	/* allocated, at offset in the image file */
+	QCOW_EXTENT_ZERO,	/* reads as zeros */
+	QCOW_EXTENT_BACKING,	/* unallocated, read from the backing image */
+	QCOW_EXTENT_COMPRESSED,	/* one compressed cluster, L2 entry in offset */
+};
+
+struct qcow_extent {
+	int type;
+	uint64_t offset;
+	uint64_t sectors;
+};
+
+static int qcow_extent_type(struct qcow_state *s, uint64_t cluster_offset)
 {
+	if (!cluster_offset)
+		return s->backing_image ? QCOW_EXTENT_BACKING : QCOW_EXTENT_ZERO;
+	if (cluster_offset == QCOW2_OFLAG_ZERO)
+		return QCOW_EXTENT_ZERO;
+	if (cluster_offset & s->cluster_compressed)
+		return QCOW_EXTENT_COMPRESSED;
+	return QCOW_EXTENT_DATA;
+}
+
+/*
+ * Map up to sector_count sectors starting at sector_num to the longest
+ * run of clusters of the same kind. Data clusters are only merged when
+ * they are contiguous in the image file, so each run can be done with
+ * one syscall. Compressed clusters are never merged.
+ *
+ * With allocate, every cluster in the run is allocated for writing and
+ * the run is always QCOW_EXTENT_DATA. Returns 0, or -1 if allocation
+ * failed.
+ */
+static int qcow_map_extent(struct qcow_state *s, uint64_t sector_num,
+			   uint64_t sector_count, bool allocate,
+			   struct qcow_extent *ext)
+{
+	uint64_t sector_index;
 	uint64_t cluster_offset;
+	uint64_t n;
+
+	sector_index = sector_num & (s->cluster_sectors - 1);
+	n = min(sector_count, (s->cluster_sectors - sector_index));
+
+	cluster_offset = get_cluster_offset(s, sector_num << 9, allocate);
+	if (allocate && !cluster_offset)
+		return -1;
+
+	ext->type = qcow_extent_type(s, cluster_offset);
+	if (ext->type == QCOW_EXTENT_DATA)
+		ext->offset = cluster_offset + (sector_index * 512);
+	else if (ext->type == QCOW_EXTENT_COMPRESSED)
+		ext->offset = cluster_offset;
+	else
+		ext->offset = 0;
+
+	while (n < sector_count && ext->type != QCOW_EXTENT_COMPRESSED) {
+		/* sector_num + n is cluster aligned from here on */
+		cluster_offset = get_cluster_offset(s, (sector_num + n) << 9,
+						    allocate);
+		if (allocate && !cluster_offset)
+			break;
+		if (qcow_extent_type(s, cluster_offset) != ext->type)
+			break;
+		if (ext->type == QCOW_EXTENT_DATA &&
+		    cluster_offset != ext->offset + n * 512)
+			break;
+		n += min(sector_count - n, (uint64_t)s->cluster_sectors);
+	}
+	ext->sectors = n;
+	return 0;
+}
+
+static ssize_t qcow_preadv(struct bdev *bdev, struct iovec *iov, int iovcnt, off_t offset)
+{
+	struct qcow_cache_entry *cluster;
+	struct qcow_extent ext;
 	uint64_t sector_index;
 	uint64_t sector_count;
 	uint64_t sector_num, n;
@@ -1228,49 +1977,51 @@ static ssize_t qcow_preadv(struct bdev *bdev, struct iovec *iov, int iovcnt, off
 	sector_num = offset >> 9;
 
 	while (sector_count) {
-		sector_index = sector_num & (s->cluster_sectors - 1);
-		n = min(sector_count, (s->cluster_sectors - sector_index));
+		qcow_map_extent(s, sector_num, sector_count, false, &ext);
+		n = ext.sectors;
 
 		_cnt = iovec_segment(iov, _iov, _off, n * 512);
 
-		cluster_offset = get_cluster_offset(s, sector_num << 9, false);
-		if (!cluster_offset) {
-			if (!s->backing_image) {
-				/* read unallocated sectors as 0s */
-				iovec_memset(_iov, _cnt, 0, 512 * n);
-			} else {
-				/* pass through to backing file */
-				read = s->backing_image->ops->preadv(s->backing_image,
-								    _iov, _cnt,
-								    (off_t) sector_num * 512);
-				if (read != n * 512)
-					break;
-			}
-		} else if (cluster_offset == QCOW2_OFLAG_ZERO) {
-			/* cluster discarded, read as 0s */
+		switch (ext.type) {
+		case QCOW_EXTENT_ZERO:
+			/* unallocated without a backing file, or discarded */
 			iovec_memset(_iov, _cnt, 0, 512 * n);
-		} else if (cluster_offset & s->cluster_compressed) {
-			if (decompress_cluster(s, cluster_offset) < 0) {
+			break;
+		case QCOW_EXTENT_BACKING:
+			/* pass through to backing file */
+			read = s->backing_image->ops->preadv(s->backing_image,
+							    _iov, _cnt,
+							    (off_t) sector_num * 512);
+			if (read != n * 512)
+				goto done;
+			break;
+		case QCOW_EXTENT_COMPRESSED:
+			sector_index = sector_num & (s->cluster_sectors - 1);
+			cluster = cluster_cache_get(s, ext.offset);
+			if (!cluster) {
 				tcmu_err("decompression failure\n");
 				return -1;
 			}
-			tcmu_memcpy_into_iovec(_iov, _cnt, s->cluster_cache + sector_index * 512, 512 * n);
-		} else {
-			read = preadv(bdev->fd, _iov, _cnt, cluster_offset + (sector_index * 512));
+			tcmu_memcpy_into_iovec(_iov, _cnt, cluster->table + sector_index * 512, 512 * n);
+			qcow_cache_put(&s->cluster_cache, cluster);
+			break;
+		default:
+			read = preadv(bdev->fd, _iov, _cnt, ext.offset);
 			if (read != n * 512)
-				break;
+				goto done;
+			break;
 		}
 		sector_count -= n;
 		sector_num += n;
 		_off += n * 512;
 	}
+done:
 	return _off ? _off : -1;
 }
 
 static ssize_t qcow_pwritev(struct bdev *bdev, struct iovec *iov, int iovcnt, off_t offset)
 {
-	uint64_t cluster_offset;
-	uint64_t sector_index;
+	struct qcow_extent ext;
 	uint64_t sector_count;
 	uint64_t sector_num, n;
 	ssize_t written;
@@ -1293,25 +2044,22 @@ static ssize_t qcow_pwritev(struct bdev *bdev, struct iovec *iov, int iovcnt, of
 	sector_count = min(sector_count, s->size / 512 - sector_num);
 
 	while (sector_count) {
-		sector_index = sector_num & (s->cluster_sectors - 1);
-		n = min(sector_count, (s->cluster_sectors - sector_index));
-
-		_cnt = iovec_segment(iov, _iov, _off, n * 512);
-
-		cluster_offset = get_cluster_offset(s, sector_num << 9, true);
-		if (!cluster_offset) {
+		if (qcow_map_extent(s, sector_num, sector_count, true, &ext) < 0) {
 			tcmu_err("cluster not allocated for writes\n");
 			return -1;
-		} else if (cluster_offset & QCOW_OFLAG_COMPRESSED) {
+		} else if (ext.type != QCOW_EXTENT_DATA) {
 			/* compressed clusters should be copied and inflated in
 			 * get_cluster_offset() with alloc=true */
 			tcmu_err("cluster decompression CoW failure\n");
 			return -1;
-		} else {
-			written = pwritev(bdev->fd, _iov, _cnt, cluster_offset + (sector_index * 512));
-			if (written < 0)
-				break;
 		}
+		n = ext.sectors;
+
+		_cnt = iovec_segment(iov, _iov, _off, n * 512);
+
+		written = pwritev(bdev->fd, _iov, _cnt, ext.offset);
+		if (written < 0)
+			break;
 		sector_count -= n;
 		sector_num += n;
 		_off += n * 512;
@@ -1325,6 +2073,7 @@ static struct bdev_ops qcow_ops = {
 	.close = qcow_image_close,
 	.preadv = qcow_preadv,
 	.pwritev = qcow_pwritev,
+	.flush = qcow_image_flush,
 };
 
 static struct bdev_ops qcow2_ops = {
@@ -1333,6 +2082,7 @@ static struct bdev_ops qcow2_ops = {
 	.close = qcow_image_close,
 	.preadv = qcow_preadv,
 	.pwritev = qcow_pwritev,
+	.flush = qcow_image_flush,
 };
 
 /* raw image support for backing files */
@@ -1385,10 +2135,45 @@ static struct bdev_ops raw_ops = {
 
 /* TCMU QCOW Handler */
 
+/*
+ * Parse a size in bytes, optionally followed by a K, M or G suffix.
+ */
+static int qcow_parse_size(const char *str, size_t *size)
+{
+	unsigned long long val;
+	char *end;
+
+	errno = 0;
+	val = strtoull(str, &end, 10);
+	if (errno || end == str)
+		return -1;
+
+	switch (*end) {
+	case 'G':
+	case 'g':
+		val <<= 10;
+		/* fall through */
+	case 'M':
+	case 'm':
+		val <<= 10;
+		/* fall through */
+	case 'K':
+	case 'k':
+		val <<= 10;
+		end++;
+		break;
+	}
+	if (*end != '\0' || !val)
+		return -1;
+	*size = val;
+	return 0;
+}
+
 static int qcow_open(struct tcmu_device *dev, bool reopen)
 {
 	struct bdev *bdev;
-	char *config;
+	char *config, *path = NULL;
+	char *opt, *next;
 	int ret;
 
 	bdev = calloc(1, sizeof(*bdev));
@@ -1414,15 +2199,53 @@ static int qcow_open(struct tcmu_device *dev, bool reopen)
 	tcmu_dbg("%s\n", tcmu_dev_get_cfgstring(dev));
 	tcmu_dbg("%s\n", config);
 
+	/* the path may be followed by optional ;key=value pairs */
+	path = strdup(config);
+	if (!path)
+		goto err;
+
+	opt = strchr(path, ';');
+	if (opt)
+		*opt++ = '\0';
+	while (opt) {
+		next = strchr(opt, ';');
+		if (next)
+			*next++ = '\0';
+
+		if (!strncmp(opt, "l2_cache_size=", 14)) {
+			if (qcow_parse_size(opt + 14, &bdev->l2_cache_size) < 0) {
+				tcmu_err("invalid l2_cache_size %s\n", opt + 14);
+				goto err;
+			}
+		} else if (!strncmp(opt, "refcount_cache_size=", 20)) {
+			if (qcow_parse_size(opt + 20, &bdev->rc_cache_size) < 0) {
+				tcmu_err("invalid refcount_cache_size %s\n",
+					 opt + 20);
+				goto err;
+			}
+		} else if (!strncmp(opt, "cluster_cache_size=", 19)) {
+			if (qcow_parse_size(opt + 19, &bdev->cluster_cache_size) < 0) {
+				tcmu_err("invalid cluster_cache_size %s\n",
+					 opt + 19);
+				goto err;
+			}
+		} else if (*opt) {
+			tcmu_warn("ignoring unknown option %s\n", opt);
+		}
+		opt = next;
+	}
+
 	/*
 	 * Force WCE=1 until we support reconfig for WCE
 	 */
 	tcmu_dev_set_write_cache_enabled(dev, 1);
 
-	if (bdev_open(bdev, AT_FDCWD, config, O_RDWR) == -1)
+	if (bdev_open(bdev, AT_FDCWD, path, O_RDWR) == -1)
 		goto err;
+	free(path);
 	return 0;
 err:
+	free(path);
 	free(bdev);
 	return -1;
 }
@@ -1488,6 +2311,12 @@ static int qcow_flush(struct tcmu_device *dev, struct tcmur_cmd *cmd)
 	struct bdev *bdev = tcmur_dev_get_private(dev);
 	int ret;
 
+	if (bdev->ops->flush && bdev->ops->flush(bdev) < 0) {
+		tcmu_dev_err(dev, "metadata writeback failed\n");
+		ret = TCMU_STS_WR_ERR;
+		goto done;
+	}
+
 	if (fsync(bdev->fd)) {
 		tcmu_dev_err(dev, "sync failed\n");
 		ret = TCMU_STS_WR_ERR;
@@ -1498,7 +2327,11 @@ done:
 	return ret;
 }
 
-static const char qcow_cfg_desc[] = "The path to the QEMU QCOW image file.";
+static const char qcow_cfg_desc[] =
+	"The path to the QEMU QCOW image file, optionally followed by:\n"
+	";l2_cache_size=N[K|M|G] L2 table cache size in bytes\n"
+	";refcount_cache_size=N[K|M|G] Refcount block cache size in bytes\n"
+	";cluster_cache_size=N[K|M|G] Decompressed cluster cache size in bytes";
 
 static struct tcmur_handler qcow_handler = {
 	.name = "QEMU Copy-On-Write image file",
@@ -1510,7 +2343,7 @@ static struct tcmur_handler qcow_handler = {
 	.write = qcow_write,
 	.flush = qcow_flush,
 	.read = qcow_read,
-	.nr_threads = 1,
+	.nr_threads = 2,
 };
 
 /* Entry point must be named "handler_init". */
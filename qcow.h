@@ -27,6 +27,23 @@ struct qcow_header
     uint64_t l1_table_offset;
 } __attribute__((__packed__));
 
+/* Minimum number of tables kept by the L2 and refcount caches */
 #define L2_CACHE_SIZE 16
 
+/* Default metadata cache sizes in bytes, settable from the cfgstring */
+#define QCOW_L2_CACHE_DEFAULT (1024 * 1024)
+#define QCOW_RC_CACHE_DEFAULT (256 * 1024)
+#define QCOW_CLUSTER_CACHE_DEFAULT (4 * 1024 * 1024)
+
+/* Number of zeroed qcow2 clusters reserved by each allocator refill */
+#define QCOW2_PREALLOC_CLUSTERS 32
+
+/*
+ * Sequential L2 table crossings before prefetching starts, how many L2
+ * tables to read ahead, and how many prefetches can be queued.
+ */
+#define QCOW_PREFETCH_TRIGGER 2
+#define QCOW_PREFETCH_TABLES 4
+#define QCOW_PREFETCH_QUEUE 16
+
 #endif /* _QCOW_H_ */
@@ -30,6 +30,10 @@
 #include "tcmur_cmd_handler.h"
 #include "libtcmu.h"
 #include "tcmur_device.h"
+#include "libtcmu_trace.h"
+#include "rbd_wb.h"
+#include "rbd_pcache.h"
+#include "rbd_pi.h"
 
 #include <rbd/librbd.h>
 #include <rados/librados.h>
@@ -67,11 +71,87 @@
 #endif
 #endif
 
+/* defined in librbd.h if supported */
+#ifdef LIBRBD_SUPPORTS_WRITE_ZEROES
+#if LIBRBD_SUPPORTS_WRITE_ZEROES
+#define RBD_WRITE_ZEROES_SUPPORT
+#endif
+#endif
+
 #define TCMU_RBD_LOCKER_TAG_KEY "tcmu_rbd_locker_tag"
 #define TCMU_RBD_LOCKER_TAG_FMT "tcmu_tag=%hu,rbd_client=%s"
 #define TCMU_RBD_LOCKER_BUF_LEN 256
+/* Set while the image has writes in a gateway's write-back log */
+#define TCMU_RBD_WB_OWNER_KEY "tcmu_rbd_wb_owner"
+
+/* Blacklist entries removed in parallel by the cleanup thread */
+#define TCMU_RBD_BL_RM_WORKERS	4
+
+/*
+ * Bounce buffers are only needed when librbd cannot take the UIO data
+ * area iovecs directly (no vectored API, writesame/CAW patterns that
+ * span several iovecs). They are recycled through a small per-device
+ * pool of power-of-two size classes from 4K to 4M so that the hot path
+ * does not hit the heap on every IO. Larger requests fall back to
+ * malloc/free.
+ */
+#define TCMU_RBD_BUF_MIN_SHIFT	12
+#define TCMU_RBD_BUF_MAX_SHIFT	22
+#define TCMU_RBD_BUF_NR_CLASSES	(TCMU_RBD_BUF_MAX_SHIFT - TCMU_RBD_BUF_MIN_SHIFT + 1)
+#define TCMU_RBD_BUF_CACHE_MAX	16
+
+/* Writes the write-back log flusher keeps in flight */
+#define TCMU_RBD_WB_AIO_WINDOW	64
+
+struct tcmu_rbd_buf {
+	struct tcmu_rbd_buf *next;
+};
+
+struct tcmu_rbd_buf_pool {
+	pthread_mutex_t lock;
+	struct tcmu_rbd_buf *free[TCMU_RBD_BUF_NR_CLASSES];
+	unsigned int nr_free[TCMU_RBD_BUF_NR_CLASSES];
+};
+
+/*
+ * Devices that use the same ceph config, client id, pool and osd op
+ * timeout share one rados client and ioctx, so a gateway exporting many
+ * images from a pool does not pay for a messenger, OSD sessions and
+ * threads per image.
+ *
+ * The client is also the unit that is fenced: a peer breaking the lock
+ * of one image blacklists the client, and with it every image it has
+ * open. See tcmu_rbd_conn_set_blacklisted.
+ */
+struct tcmu_rbd_conn {
+	char *conf_path;
+	char *id;
+	char *pool_name;
+	char *osd_op_timeout;	/* as passed in the cfgstring */
+
+	rados_t cluster;
+	rados_ioctx_t io_ctx;
+
+	int ref_cnt;
+	/* rados_connect is still in progress, wait on rbd_conn_cache_cond */
+	bool connecting;
+	/* client has been fenced, it is no longer handed out */
+	bool blacklisted;
+	/* the ceph service daemon can only be registered once per client */
+	bool service_registered;
+	/* device reporting service status for this client */
+	struct tcmu_device *service_dev;
+	/* device class of the pool's crush rule, looked up once */
+	bool media_checked;
+	bool solid_state_media;
+	/* entity addrs, blacklist entries to remove once the client is gone */
+	char *addrs;
+	/* devices using the client, protected by rbd_conn_users_lock */
+	darray(struct tcmu_device *) devs;
+};
 
 struct tcmu_rbd_state {
+	struct tcmu_rbd_conn *conn;
 	rados_t cluster;
 	rados_ioctx_t io_ctx;
 	rbd_image_t image;
@@ -82,6 +162,17 @@ struct tcmu_rbd_state {
 	char *conf_path;
 	char *id;
 	char *addrs;
+
+	char *wb_log_path;
+	uint64_t wb_log_size_mb;
+	struct rbd_wb *wb;
+
+	uint64_t parent_cache_mb;
+	struct rbd_pc_dev *pcache;
+
+	struct rbd_pi *pi;
+
+	struct tcmu_rbd_buf_pool buf_pool;
 };
 
 enum rbd_aio_type {
@@ -90,9 +181,16 @@ enum rbd_aio_type {
 	RBD_AIO_TYPE_CAW
 };
 
+/* Shared by the discards of one vectored unmap, see tcmu_rbd_unmap_vec */
+struct rbd_aio_vec {
+	int pending;
+	int status;
+};
+
 struct rbd_aio_cb {
 	struct tcmu_device *dev;
 	struct tcmur_cmd *tcmur_cmd;
+	struct rbd_aio_vec *vec;
 
 	enum rbd_aio_type type;
 	union {
@@ -105,16 +203,171 @@ struct rbd_aio_cb {
 		} caw;
 	};
 	char *bounce_buffer;
+	size_t bounce_len;
 	struct iovec *iov;
 	size_t iov_cnt;
+	/* write-back log data to copy over what a read got from the image */
+	struct rbd_wb_overlay *overlay;
 };
 
+/* A discard waiting for the write-back log, see tcmu_rbd_wb_deferred */
+struct rbd_wb_discard {
+	struct rbd_wb_waiter waiter;
+	struct tcmu_device *dev;
+	struct tcmur_cmd *tcmur_cmd;
+	struct tcmur_unmap_range range;
+	struct tcmur_unmap_range *ranges;
+	unsigned int nr_ranges;
+};
+
+typedef darray(char *) darray_str;
+
+/*
+ * Blacklist entries of closed rados clients are removed by a cleanup
+ * thread, using the client of the next device that is opened, so opens
+ * do not wait on the mon commands or on each other.
+ */
 static pthread_mutex_t blacklist_caches_lock = PTHREAD_MUTEX_INITIALIZER;
-static darray(char *) blacklist_caches;
+static pthread_cond_t blacklist_caches_cond = PTHREAD_COND_INITIALIZER;
+static darray_str blacklist_caches;
+/* client, with a reference held, for the cleanup thread to use */
+static struct tcmu_rbd_conn *blacklist_conn;
+static pthread_t blacklist_cleaner;
+static bool blacklist_cleaner_running;
+static bool blacklist_cleaner_stop;
+
+static pthread_mutex_t rbd_conn_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rbd_conn_cache_cond = PTHREAD_COND_INITIALIZER;
+static darray(struct tcmu_rbd_conn *) rbd_conn_cache;
+/*
+ * Taken before the runner's state_lock of the devices, so it must not be
+ * taken with rbd_conn_cache_lock held.
+ */
+static pthread_mutex_t rbd_conn_users_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int tcmu_rbd_buf_class(size_t len)
+{
+	int shift = TCMU_RBD_BUF_MIN_SHIFT;
+
+	while (shift <= TCMU_RBD_BUF_MAX_SHIFT && ((size_t)1 << shift) < len)
+		shift++;
+	if (shift > TCMU_RBD_BUF_MAX_SHIFT)
+		return -1;
+	return shift - TCMU_RBD_BUF_MIN_SHIFT;
+}
+
+static void tcmu_rbd_buf_pool_init(struct tcmu_rbd_buf_pool *pool)
+{
+	pthread_mutex_init(&pool->lock, NULL);
+}
+
+static void tcmu_rbd_buf_pool_destroy(struct tcmu_rbd_buf_pool *pool)
+{
+	struct tcmu_rbd_buf *buf;
+	int i;
+
+	for (i = 0; i < TCMU_RBD_BUF_NR_CLASSES; i++) {
+		while ((buf = pool->free[i])) {
+			pool->free[i] = buf->next;
+			free(buf);
+		}
+		pool->nr_free[i] = 0;
+	}
+	pthread_mutex_destroy(&pool->lock);
+}
+
+/*
+ * Get a buffer of at least len bytes. The caller must hand the same
+ * len back to tcmu_rbd_buf_put so the buffer lands in the right class.
+ */
+static char *tcmu_rbd_buf_get(struct tcmu_rbd_state *state, size_t len)
+{
+	struct tcmu_rbd_buf_pool *pool = &state->buf_pool;
+	struct tcmu_rbd_buf *buf = NULL;
+	int class = tcmu_rbd_buf_class(len);
+
+	if (class < 0)
+		return malloc(len);
+
+	pthread_mutex_lock(&pool->lock);
+	buf = pool->free[class];
+	if (buf) {
+		pool->free[class] = buf->next;
+		pool->nr_free[class]--;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (buf)
+		return (char *)buf;
+	return malloc((size_t)1 << (class + TCMU_RBD_BUF_MIN_SHIFT));
+}
+
+static void tcmu_rbd_buf_put(struct tcmu_rbd_state *state, char *ptr,
+			     size_t len)
+{
+	struct tcmu_rbd_buf_pool *pool = &state->buf_pool;
+	struct tcmu_rbd_buf *buf = (struct tcmu_rbd_buf *)ptr;
+	int class = tcmu_rbd_buf_class(len);
+
+	if (!ptr)
+		return;
+
+	if (class >= 0) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->nr_free[class] < TCMU_RBD_BUF_CACHE_MAX) {
+			buf->next = pool->free[class];
+			pool->free[class] = buf;
+			pool->nr_free[class]++;
+			buf = NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	free(buf);
+}
+
+static int tcmu_rbd_bounce_alloc(struct tcmu_device *dev,
+				 struct rbd_aio_cb *aio_cb, size_t len)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+
+	aio_cb->bounce_buffer = tcmu_rbd_buf_get(state, len);
+	if (!aio_cb->bounce_buffer) {
+		tcmu_dev_err(dev, "Could not allocate bounce buffer.\n");
+		return -ENOMEM;
+	}
+	aio_cb->bounce_len = len;
+	return 0;
+}
+
+static void tcmu_rbd_bounce_free(struct tcmu_device *dev,
+				 struct rbd_aio_cb *aio_cb)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+
+	tcmu_rbd_buf_put(state, aio_cb->bounce_buffer, aio_cb->bounce_len);
+	aio_cb->bounce_buffer = NULL;
+}
 
 #ifdef LIBRADOS_SUPPORTS_SERVICES
 
 #ifdef RBD_LOCK_ACQUIRE_SUPPORT
+/*
+ * The service daemon belongs to the rados client, so with a shared
+ * client only one of its devices reports status.
+ */
+static bool tcmu_rbd_is_service_dev(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	bool is_service_dev;
+
+	pthread_mutex_lock(&rbd_conn_cache_lock);
+	is_service_dev = state->conn && state->conn->service_dev == dev;
+	pthread_mutex_unlock(&rbd_conn_cache_lock);
+
+	return is_service_dev;
+}
+
 static int tcmu_rbd_service_status_update(struct tcmu_device *dev,
 					  bool has_lock)
 {
@@ -123,6 +376,9 @@ static int tcmu_rbd_service_status_update(struct tcmu_device *dev,
 	char *status_buf = NULL;
 	int ret;
 
+	if (!tcmu_rbd_is_service_dev(dev))
+		return 0;
+
 	ret = asprintf(&status_buf,
 		       "%s%c%s%c%s%c%"PRIu64"%c%s%c%"PRIu64"%c%s%c%"PRIu64"%c",
 		       "lock_owner", '\0', has_lock ? "true" : "false", '\0',
@@ -166,19 +422,34 @@ static int tcmu_rbd_service_register(struct tcmu_device *dev)
 	char *daemon_buf = NULL;
 	char *metadata_buf = NULL;
 	char *image_id_buf = NULL;
+	bool registered;
 	int ret;
 
+	pthread_mutex_lock(&rbd_conn_cache_lock);
+	registered = state->conn->service_registered;
+	if (!registered)
+		state->conn->service_registered = true;
+	else if (!state->conn->service_dev)
+		state->conn->service_dev = dev;
+	pthread_mutex_unlock(&rbd_conn_cache_lock);
+
+	if (registered) {
+		tcmu_dev_dbg(dev, "Ceph service already registered for shared rados client.\n");
+		return 0;
+	}
+
 	ret = uname(&u);
 	if (ret < 0) {
 		ret = -errno;
 		tcmu_dev_err(dev, "Could not query uname. (Err %d)\n", ret);
-		return ret;
+		goto free_image_id_buf;
 	}
 
 	image_id_buf = malloc(RBD_MAX_BLOCK_NAME_SIZE);
 	if (image_id_buf == NULL) {
 		tcmu_dev_err(dev, "Could not allocate image id buf.\n");
-		return -ENOMEM;
+		ret = -ENOMEM;
+		goto free_image_id_buf;
 	}
 
 	ret = rbd_get_id(state->image, image_id_buf, RBD_MAX_BLOCK_NAME_SIZE);
@@ -215,6 +486,10 @@ static int tcmu_rbd_service_register(struct tcmu_device *dev)
 		goto free_meta_buf;
 	}
 
+	pthread_mutex_lock(&rbd_conn_cache_lock);
+	state->conn->service_dev = dev;
+	pthread_mutex_unlock(&rbd_conn_cache_lock);
+
 	ret = tcmu_rbd_report_event(dev);
 	if (ret < 0)
 		tcmu_dev_err(dev, "Could not update status. (Err %d)\n", ret);
@@ -225,6 +500,12 @@ free_daemon_buf:
 	free(daemon_buf);
 free_image_id_buf:
 	free(image_id_buf);
+
+	/* Let the next device sharing the client try again */
+	pthread_mutex_lock(&rbd_conn_cache_lock);
+	if (ret < 0 && !state->conn->service_dev)
+		state->conn->service_registered = false;
+	pthread_mutex_unlock(&rbd_conn_cache_lock);
 	return ret;
 }
 
@@ -247,12 +528,11 @@ static void tcmu_rbd_service_status_update(struct tcmu_device *dev,
 #endif /* LIBRADOS_SUPPORTS_SERVICES */
 
 #if defined LIBRADOS_SUPPORTS_GETADDRS || defined RBD_LOCK_ACQUIRE_SUPPORT
-static void tcmu_rbd_rm_stale_entry_from_blacklist(struct tcmu_device *dev, char *addrs)
+/* Split an entity addrs string into the addresses to unblacklist */
+static void tcmu_rbd_split_blacklist_entry(const char *addrs, darray_str *out)
 {
-	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
 	const char *p, *q, *end;
-	char *cmd, *addr;
-	int ret;
+	char *addr;
 
 	/*
 	 * Just skip extra chars before '[' if there has
@@ -274,7 +554,7 @@ static void tcmu_rbd_rm_stale_entry_from_blacklist(struct tcmu_device *dev, char
 			/* Skip "[" and white spaces */
 			while (*p != '\0' && !isalnum(*p)) p++;
 			if (*p == '\0') {
-				tcmu_dev_warn(dev, "Get an invalid address '%s'!\n", addrs);
+				tcmu_warn("Get an invalid address '%s'!\n", addrs);
 				return;
 			}
 
@@ -283,7 +563,7 @@ static void tcmu_rbd_rm_stale_entry_from_blacklist(struct tcmu_device *dev, char
 				end = strchr(p, ']');
 
 			if (!end) {
-				tcmu_dev_warn(dev, "Get an invalid address '%s'!\n", addrs);
+				tcmu_warn("Get an invalid address '%s'!\n", addrs);
 				return;
 			}
 
@@ -291,7 +571,7 @@ static void tcmu_rbd_rm_stale_entry_from_blacklist(struct tcmu_device *dev, char
 
 			while (*q != '\0' && !isalnum(*q)) q--;
 			if (*q == '\0') {
-				tcmu_dev_warn(dev, "Get an invalid address '%s'!\n", addrs);
+				tcmu_warn("Get an invalid address '%s'!\n", addrs);
 				return;
 			}
 
@@ -303,53 +583,87 @@ static void tcmu_rbd_rm_stale_entry_from_blacklist(struct tcmu_device *dev, char
 			p = NULL;
 		}
 
-		ret = asprintf(&cmd,
-			       "{\"prefix\": \"osd blacklist\","
-			       "\"blacklistop\": \"rm\","
-			       "\"addr\": \"%s\"}",
-			       addr);
-		free(addr);
-		if (ret < 0) {
-			tcmu_dev_warn(dev, "Could not allocate command. (Err %d)\n",
-				      ret);
-			return;
-		}
-		ret = rados_mon_command(state->cluster, (const char**)&cmd, 1, NULL, 0,
-					NULL, NULL, NULL, NULL);
-		free(cmd);
-		if (ret < 0) {
-			tcmu_dev_err(dev, "Could not rm blacklist entry '%s'. (Err %d)\n",
-				     addr, ret);
+		if (!addr) {
+			tcmu_warn("Could not allocate address.\n");
 			return;
 		}
+		darray_append(*out, addr);
 	}
 }
 
-static int tcmu_rbd_rm_stale_entries_from_blacklist(struct tcmu_device *dev)
+static void tcmu_rbd_rm_blacklist_addr(rados_t cluster, const char *addr)
 {
-	char **entry, *tmp_entry;
-	int ret = 0;
-	int i;
+	char *cmd;
+	int ret;
 
-	pthread_mutex_lock(&blacklist_caches_lock);
-	if (darray_empty(blacklist_caches))
-		goto unlock;
+	ret = asprintf(&cmd,
+		       "{\"prefix\": \"osd blacklist\","
+		       "\"blacklistop\": \"rm\","
+		       "\"addr\": \"%s\"}",
+		       addr);
+	if (ret < 0) {
+		tcmu_warn("Could not allocate command. (Err %d)\n", ret);
+		return;
+	}
+	ret = rados_mon_command(cluster, (const char**)&cmd, 1, NULL, 0,
+				NULL, NULL, NULL, NULL);
+	free(cmd);
+	if (ret < 0)
+		tcmu_err("Could not rm blacklist entry '%s'. (Err %d)\n",
+			 addr, ret);
+}
 
-	/* Try to remove all the stale blacklist entities */
-	darray_foreach(entry, blacklist_caches) {
-		tcmu_dev_info(dev, "removing addrs: {%s}\n", *entry);
-		tcmu_rbd_rm_stale_entry_from_blacklist(dev, *entry);
+/* Addresses being removed, shared by the cleanup workers */
+struct tcmu_rbd_bl_rm {
+	rados_t cluster;
+	darray_str addrs;
+	size_t next;
+};
+
+static void *tcmu_rbd_bl_rm_worker(void *arg)
+{
+	struct tcmu_rbd_bl_rm *rm = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&rm->next, 1, __ATOMIC_RELAXED)) <
+	       darray_size(rm->addrs))
+		tcmu_rbd_rm_blacklist_addr(rm->cluster,
+					   darray_item(rm->addrs, i));
+	return NULL;
+}
+
+/*
+ * Each entry needs its own mon command, so send them from a few threads
+ * at once instead of waiting for each round trip in turn.
+ */
+static void tcmu_rbd_rm_blacklist_entries(rados_t cluster,
+					  darray_str *entries)
+{
+	pthread_t workers[TCMU_RBD_BL_RM_WORKERS - 1];
+	struct tcmu_rbd_bl_rm rm = { .cluster = cluster };
+	int i, nr_workers = 0;
+	char **entry;
+
+	darray_init(rm.addrs);
+	darray_foreach(entry, *entries) {
+		tcmu_info("removing addrs: {%s}\n", *entry);
+		tcmu_rbd_split_blacklist_entry(*entry, &rm.addrs);
 	}
 
-unlock:
-	for (i = darray_size(blacklist_caches) - 1; i >= 0; i--) {
-		tmp_entry = darray_item(blacklist_caches, i);
-		darray_remove(blacklist_caches, i);
-		free(tmp_entry);
+	for (i = 1; i < TCMU_RBD_BL_RM_WORKERS && i < darray_size(rm.addrs);
+	     i++) {
+		if (pthread_create(&workers[nr_workers], NULL,
+				   tcmu_rbd_bl_rm_worker, &rm))
+			break;
+		nr_workers++;
 	}
+	tcmu_rbd_bl_rm_worker(&rm);
+	for (i = 0; i < nr_workers; i++)
+		pthread_join(workers[i], NULL);
 
-	pthread_mutex_unlock(&blacklist_caches_lock);
-	return ret;
+	darray_foreach(entry, rm.addrs)
+		free(*entry);
+	darray_free(rm.addrs);
 }
 #endif // LIBRADOS_SUPPORTS_GETADDRS || RBD_LOCK_ACQUIRE_SUPPORT
 
@@ -418,7 +732,11 @@ static bool tcmu_rbd_match_device_class(struct tcmu_device *dev,
 	return match;
 }
 
-static void tcmu_rbd_detect_device_class(struct tcmu_device *dev)
+/*
+ * Returns 1 if the crush rule of the pool uses a solid state device
+ * class, 0 if it does not, or -errno if the lookup failed.
+ */
+static int tcmu_rbd_pool_is_solid_state(struct tcmu_device *dev)
 {
 	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
 	char *mon_cmd_bufs[2] = {NULL, NULL};
@@ -435,7 +753,7 @@ static void tcmu_rbd_detect_device_class(struct tcmu_device *dev)
 			"\"format\": \"json\"}", state->pool_name);
 	if (ret < 0) {
 		tcmu_dev_warn(dev, "Could not allocate crush rule command.\n");
-		return;
+		return -ENOMEM;
 	}
 
 	ret = rados_mon_command(state->cluster, (const char **)mon_cmd_bufs, 1,
@@ -445,7 +763,7 @@ static void tcmu_rbd_detect_device_class(struct tcmu_device *dev)
 	if (ret < 0 || !mon_buf) {
 		tcmu_dev_warn(dev, "Could not retrieve pool crush rule (Err %d)\n",
 			      ret);
-		return;
+		return ret < 0 ? ret : -EIO;
 	}
 	rados_buffer_free(mon_status_buf);
 
@@ -455,7 +773,7 @@ static void tcmu_rbd_detect_device_class(struct tcmu_device *dev)
 	if (!crush_rule) {
 		tcmu_dev_warn(dev, "Could not locate crush rule key\n");
 		rados_buffer_free(mon_buf);
-		return;
+		return -EINVAL;
 	}
 
 	/* skip past key to the start of the quoted rule name */
@@ -464,36 +782,59 @@ static void tcmu_rbd_detect_device_class(struct tcmu_device *dev)
 	if (!crush_rule_end) {
 		tcmu_dev_warn(dev, "Could not extract crush rule\n");
 		rados_buffer_free(mon_buf);
-		return;
+		return -EINVAL;
 	}
 
 	*(crush_rule_end + 1) = '\0';
 	crush_rule = strdup(crush_rule);
 	rados_buffer_free(mon_buf);
+	if (!crush_rule)
+		return -ENOMEM;
 	tcmu_dev_dbg(dev, "Pool %s using crush rule %s\n", state->pool_name,
 		     crush_rule);
 
+	ret = 0;
 	if (tcmu_rbd_match_device_class(dev, crush_rule, "ssd") ||
 	    tcmu_rbd_match_device_class(dev, crush_rule, "nvme")) {
 		tcmu_dev_dbg(dev, "Pool %s associated to solid state device class.\n",
 			     state->pool_name);
-		tcmu_dev_set_solid_state_media(dev, true);
+		ret = 1;
 	}
 
 	free(crush_rule);
+	return ret;
 }
 
-static void tcmu_rbd_image_close(struct tcmu_device *dev)
+/*
+ * The rados client is per pool, so the device class is only looked up
+ * by its first device. A failed lookup is retried by the next one.
+ */
+static void tcmu_rbd_detect_device_class(struct tcmu_device *dev)
 {
 	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	struct tcmu_rbd_conn *conn = state->conn;
+	bool checked, solid_state;
+	int ret;
 
-	rbd_close(state->image);
-	rados_ioctx_destroy(state->io_ctx);
-	rados_shutdown(state->cluster);
+	pthread_mutex_lock(&rbd_conn_cache_lock);
+	checked = conn->media_checked;
+	solid_state = conn->solid_state_media;
+	pthread_mutex_unlock(&rbd_conn_cache_lock);
 
-	state->cluster = NULL;
-	state->io_ctx = NULL;
-	state->image = NULL;
+	if (!checked) {
+		ret = tcmu_rbd_pool_is_solid_state(dev);
+		if (ret < 0)
+			return;
+		solid_state = ret;
+
+		pthread_mutex_lock(&rbd_conn_cache_lock);
+		conn->media_checked = true;
+		conn->solid_state_media = solid_state;
+		pthread_mutex_unlock(&rbd_conn_cache_lock);
+	}
+
+	if (solid_state)
+		tcmu_dev_set_solid_state_media(dev, true);
 }
 
 static int timer_check_and_set_def(struct tcmu_device *dev)
@@ -567,26 +908,79 @@ set:
 			      state->osd_op_timeout);
 }
 
-static int tcmu_rbd_image_open(struct tcmu_device *dev)
+static bool tcmu_rbd_str_match(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a == b;
+	return !strcmp(a, b);
+}
+
+static bool tcmu_rbd_conn_match(struct tcmu_rbd_conn *conn,
+				struct tcmu_rbd_state *state)
+{
+	return tcmu_rbd_str_match(conn->pool_name, state->pool_name) &&
+	       tcmu_rbd_str_match(conn->id, state->id) &&
+	       tcmu_rbd_str_match(conn->conf_path, state->conf_path) &&
+	       tcmu_rbd_str_match(conn->osd_op_timeout, state->osd_op_timeout);
+}
+
+static int tcmu_rbd_conn_strdup(char **dst, const char *src)
+{
+	if (!src)
+		return 0;
+
+	*dst = strdup(src);
+	if (!*dst)
+		return -ENOMEM;
+	return 0;
+}
+
+static void tcmu_rbd_conn_free(struct tcmu_rbd_conn *conn)
+{
+	free(conn->conf_path);
+	free(conn->id);
+	free(conn->pool_name);
+	free(conn->osd_op_timeout);
+	free(conn->addrs);
+	darray_free(conn->devs);
+	free(conn);
+}
+
+/* Must be called with rbd_conn_cache_lock held */
+static void tcmu_rbd_conn_cache_remove(struct tcmu_rbd_conn *conn)
+{
+	size_t i;
+
+	for (i = 0; i < darray_size(rbd_conn_cache); i++) {
+		if (darray_item(rbd_conn_cache, i) == conn) {
+			darray_remove(rbd_conn_cache, i);
+			return;
+		}
+	}
+}
+
+static int tcmu_rbd_conn_connect(struct tcmu_device *dev,
+				 struct tcmu_rbd_conn *conn)
 {
 	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
 	int ret;
 
-	ret = rados_create(&state->cluster, state->id);
+	ret = rados_create(&conn->cluster, state->id);
 	if (ret < 0) {
 		tcmu_dev_err(dev, "Could not create cluster. (Err %d)\n", ret);
 		return ret;
 	}
+	state->cluster = conn->cluster;
 
 	/* Try default location when conf_path=NULL, but ignore failure */
-	ret = rados_conf_read_file(state->cluster, state->conf_path);
+	ret = rados_conf_read_file(conn->cluster, state->conf_path);
 	if (state->conf_path && ret < 0) {
 		tcmu_dev_err(dev, "Could not read config %s (Err %d)",
 			     state->conf_path, ret);
 		goto rados_shutdown;
 	}
 
-	rados_conf_set(state->cluster, "rbd_cache", "false");
+	rados_conf_set(conn->cluster, "rbd_cache", "false");
 
 	ret = timer_check_and_set_def(dev);
 	if (ret)
@@ -594,97 +988,395 @@ static int tcmu_rbd_image_open(struct tcmu_device *dev)
 			      "Could not set rados osd op timeout to %s (Err %d. Failover may be delayed.)\n",
 			      state->osd_op_timeout, ret);
 
-	ret = rados_connect(state->cluster);
+	ret = rados_connect(conn->cluster);
 	if (ret < 0) {
 		tcmu_dev_err(dev, "Could not connect to cluster. (Err %d)\n",
 			     ret);
 		goto rados_shutdown;
 	}
 
-	tcmu_rbd_detect_device_class(dev);
-	ret = rados_ioctx_create(state->cluster, state->pool_name,
-				 &state->io_ctx);
+	ret = rados_ioctx_create(conn->cluster, state->pool_name,
+				 &conn->io_ctx);
 	if (ret < 0) {
 		tcmu_dev_err(dev, "Could not create ioctx for pool %s. (Err %d)\n",
 			     state->pool_name, ret);
 		goto rados_shutdown;
 	}
 
-	ret = rbd_open(state->io_ctx, state->image_name, &state->image, NULL);
-	if (ret < 0) {
-		tcmu_dev_err(dev, "Could not open image %s. (Err %d)\n",
-			     state->image_name, ret);
-		goto rados_destroy;
-	}
-
-	ret = tcmu_rbd_service_register(dev);
-	if (ret < 0)
-		goto rbd_close;
-
 	return 0;
 
-rbd_close:
-	rbd_close(state->image);
-	state->image = NULL;
-rados_destroy:
-	rados_ioctx_destroy(state->io_ctx);
-	state->io_ctx = NULL;
 rados_shutdown:
-	rados_shutdown(state->cluster);
+	rados_shutdown(conn->cluster);
+	conn->cluster = NULL;
 	state->cluster = NULL;
 	return ret;
 }
 
-#ifdef RBD_LOCK_ACQUIRE_SUPPORT
-
 /*
- * Returns:
- * 0 = client is not owner.
- * 1 = client is owner.
- * -ESHUTDOWN/-EBLACKLISTED(-108) = client is blacklisted.
- * -ETIMEDOUT = rados osd op timeout has expired.
- * -EIO = misc error.
+ * Attach the device to a cached rados client matching its cfgstring,
+ * or connect a new one. Concurrent opens for the same key wait for the
+ * first connect to finish instead of racing to create their own.
  */
-static int tcmu_rbd_has_lock(struct tcmu_device *dev)
+static int tcmu_rbd_conn_get(struct tcmu_device *dev)
 {
 	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
-	int ret, is_owner;
-
-	ret = rbd_is_exclusive_lock_owner(state->image, &is_owner);
-	if (ret < 0) {
-		if (ret == -ESHUTDOWN) {
-			tcmu_dev_dbg(dev, "Client is blacklisted. Could not check lock ownership.\n");
-		} else {
-			tcmu_dev_err(dev, "Could not check lock ownership. Error: %s.\n",
-				     strerror(-ret));
+	struct tcmu_rbd_conn **entry, *conn;
+	int ret, ref_cnt;
+
+	pthread_mutex_lock(&rbd_conn_cache_lock);
+retry:
+	darray_foreach(entry, rbd_conn_cache) {
+		conn = *entry;
+		if (conn->blacklisted || !tcmu_rbd_conn_match(conn, state))
+			continue;
+
+		if (conn->connecting) {
+			pthread_cond_wait(&rbd_conn_cache_cond,
+					  &rbd_conn_cache_lock);
+			goto retry;
 		}
 
-		if (ret == -ESHUTDOWN || ret == -ETIMEDOUT)
-			return ret;
+		ref_cnt = ++conn->ref_cnt;
+		pthread_mutex_unlock(&rbd_conn_cache_lock);
 
-		/* let initiator figure things out */
-		return -EIO;
-	} else if (is_owner) {
-		tcmu_dev_dbg(dev, "Is owner\n");
-		return 1;
+		tcmu_dev_dbg(dev, "Sharing rados client with %d other device(s).\n",
+			     ref_cnt - 1);
+		goto done;
 	}
-	tcmu_dev_dbg(dev, "Not owner\n");
 
-	return 0;
-}
+	conn = calloc(1, sizeof(*conn));
+	if (!conn) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
 
-static int tcmu_rbd_get_lock_state(struct tcmu_device *dev)
-{
-	int ret;
+	if (tcmu_rbd_conn_strdup(&conn->conf_path, state->conf_path) ||
+	    tcmu_rbd_conn_strdup(&conn->id, state->id) ||
+	    tcmu_rbd_conn_strdup(&conn->pool_name, state->pool_name) ||
+	    tcmu_rbd_conn_strdup(&conn->osd_op_timeout,
+				 state->osd_op_timeout)) {
+		tcmu_dev_err(dev, "Could not allocate rados client cache entry.\n");
+		ret = -ENOMEM;
+		goto free_conn;
+	}
 
-	ret = tcmu_rbd_has_lock(dev);
-	if (ret == 1)
-		return TCMUR_DEV_LOCK_WRITE_LOCKED;
-	else if (ret == 0 || ret == -ESHUTDOWN)
-		return TCMUR_DEV_LOCK_UNLOCKED;
-	else
-		return TCMUR_DEV_LOCK_UNKNOWN;
-}
+	conn->ref_cnt = 1;
+	conn->connecting = true;
+	darray_append(rbd_conn_cache, conn);
+	pthread_mutex_unlock(&rbd_conn_cache_lock);
+
+	ret = tcmu_rbd_conn_connect(dev, conn);
+
+	pthread_mutex_lock(&rbd_conn_cache_lock);
+	conn->connecting = false;
+	if (ret < 0)
+		tcmu_rbd_conn_cache_remove(conn);
+	pthread_cond_broadcast(&rbd_conn_cache_cond);
+	pthread_mutex_unlock(&rbd_conn_cache_lock);
+
+	if (ret < 0) {
+		tcmu_rbd_conn_free(conn);
+		return ret;
+	}
+
+done:
+	pthread_mutex_lock(&rbd_conn_users_lock);
+	darray_append(conn->devs, dev);
+	pthread_mutex_unlock(&rbd_conn_users_lock);
+
+	state->conn = conn;
+	state->cluster = conn->cluster;
+	state->io_ctx = conn->io_ctx;
+	return 0;
+
+free_conn:
+	tcmu_rbd_conn_free(conn);
+unlock:
+	pthread_mutex_unlock(&rbd_conn_cache_lock);
+	return ret;
+}
+
+/* Drop a reference on a rados client, and shut it down after the last */
+static void tcmu_rbd_conn_release(struct tcmu_rbd_conn *conn)
+{
+	bool last;
+
+	pthread_mutex_lock(&rbd_conn_cache_lock);
+	last = --conn->ref_cnt == 0;
+	if (last)
+		tcmu_rbd_conn_cache_remove(conn);
+	pthread_mutex_unlock(&rbd_conn_cache_lock);
+
+	if (!last)
+		return;
+
+	rados_ioctx_destroy(conn->io_ctx);
+	rados_shutdown(conn->cluster);
+
+	/*
+	 * The client may already be blacklisted by other tcmu nodes.
+	 * Let's just save the entity addrs into the blacklist_caches,
+	 * and let any other new device help remove it.
+	 *
+	 * This must wait until the client is gone, or another device
+	 * could unblacklist a client that is still in use.
+	 */
+	if (conn->addrs) {
+		pthread_mutex_lock(&blacklist_caches_lock);
+		darray_append(blacklist_caches, conn->addrs);
+		pthread_mutex_unlock(&blacklist_caches_lock);
+		conn->addrs = NULL;
+	}
+	tcmu_rbd_conn_free(conn);
+}
+
+static void tcmu_rbd_conn_put(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	struct tcmu_rbd_conn *conn = state->conn;
+	size_t i;
+
+	if (!conn)
+		return;
+
+	state->conn = NULL;
+	state->cluster = NULL;
+	state->io_ctx = NULL;
+
+	pthread_mutex_lock(&rbd_conn_users_lock);
+	for (i = 0; i < darray_size(conn->devs); i++) {
+		if (darray_item(conn->devs, i) == dev) {
+			darray_remove(conn->devs, i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&rbd_conn_users_lock);
+
+	pthread_mutex_lock(&rbd_conn_cache_lock);
+	if (conn->service_dev == dev)
+		conn->service_dev = NULL;
+	/* the addrs are the client's, whichever device found them */
+	if (!conn->addrs) {
+		conn->addrs = state->addrs;
+		state->addrs = NULL;
+	}
+	pthread_mutex_unlock(&rbd_conn_cache_lock);
+
+	tcmu_rbd_conn_release(conn);
+}
+
+/*
+ * Devices still being added, or already being reopened, are left to find
+ * out on their first IO.
+ */
+static bool tcmu_rbd_dev_is_open(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	bool open;
+
+	pthread_mutex_lock(&rdev->state_lock);
+	open = (rdev->flags & TCMUR_DEV_FLAG_IS_OPEN) && rdev->event_work;
+	pthread_mutex_unlock(&rdev->state_lock);
+
+	return open;
+}
+
+/*
+ * A fenced client is dead for every device sharing it, including the
+ * ones whose lock nobody took, since the blacklist is per client and
+ * not per image. Stop handing it out, and have the runner drop the lock
+ * and reopen the other users now, rather than when each one next hits
+ * -ESHUTDOWN. Their reopens share a backoff through get_conn_key, and
+ * the first one to connect creates the client the rest then share.
+ * dev itself is already being handled by the caller.
+ */
+static void tcmu_rbd_conn_set_blacklisted(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	struct tcmu_rbd_conn *conn = state->conn;
+	struct tcmu_device **entry;
+	bool retired = false;
+
+	if (!conn)
+		return;
+
+	pthread_mutex_lock(&rbd_conn_cache_lock);
+	if (!conn->blacklisted) {
+		conn->blacklisted = true;
+		tcmu_rbd_conn_cache_remove(conn);
+		retired = true;
+	}
+	pthread_mutex_unlock(&rbd_conn_cache_lock);
+
+	if (!retired)
+		return;
+
+	pthread_mutex_lock(&rbd_conn_users_lock);
+	tcmu_dev_warn(dev, "rados client is blacklisted, reopening the %zu device(s) using it.\n",
+		      darray_size(conn->devs));
+	darray_foreach(entry, conn->devs) {
+		if (*entry == dev || !tcmu_rbd_dev_is_open(*entry))
+			continue;
+		tcmu_notify_lock_lost(*entry);
+		tcmu_notify_conn_lost(*entry);
+	}
+	pthread_mutex_unlock(&rbd_conn_users_lock);
+}
+
+#if defined LIBRADOS_SUPPORTS_GETADDRS || defined RBD_LOCK_ACQUIRE_SUPPORT
+static void *tcmu_rbd_blacklist_cleaner_fn(void *arg)
+{
+	struct tcmu_rbd_conn *conn;
+	darray_str entries;
+	char **entry;
+
+	tcmu_set_thread_name("rbd-blrm", NULL);
+
+	pthread_mutex_lock(&blacklist_caches_lock);
+	while (!blacklist_cleaner_stop) {
+		if (!blacklist_conn) {
+			pthread_cond_wait(&blacklist_caches_cond,
+					  &blacklist_caches_lock);
+			continue;
+		}
+
+		conn = blacklist_conn;
+		entries = blacklist_caches;
+		darray_init(blacklist_caches);
+		pthread_mutex_unlock(&blacklist_caches_lock);
+
+		tcmu_rbd_rm_blacklist_entries(conn->cluster, &entries);
+		darray_foreach(entry, entries)
+			free(*entry);
+		darray_free(entries);
+		tcmu_rbd_conn_release(conn);
+
+		pthread_mutex_lock(&blacklist_caches_lock);
+		blacklist_conn = NULL;
+	}
+	pthread_mutex_unlock(&blacklist_caches_lock);
+
+	return NULL;
+}
+
+/* Have the cleanup thread remove the cached entries with dev's client */
+static void tcmu_rbd_blacklist_cleanup(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	struct tcmu_rbd_conn *conn = state->conn;
+
+	pthread_mutex_lock(&blacklist_caches_lock);
+	if (!blacklist_cleaner_running || blacklist_conn ||
+	    darray_empty(blacklist_caches))
+		goto unlock;
+
+	pthread_mutex_lock(&rbd_conn_cache_lock);
+	if (!conn->blacklisted) {
+		conn->ref_cnt++;
+		blacklist_conn = conn;
+	}
+	pthread_mutex_unlock(&rbd_conn_cache_lock);
+
+	if (blacklist_conn)
+		pthread_cond_signal(&blacklist_caches_cond);
+unlock:
+	pthread_mutex_unlock(&blacklist_caches_lock);
+}
+#endif /* LIBRADOS_SUPPORTS_GETADDRS || RBD_LOCK_ACQUIRE_SUPPORT */
+
+static void tcmu_rbd_image_close(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+
+	rbd_close(state->image);
+	state->image = NULL;
+
+	tcmu_rbd_conn_put(dev);
+}
+
+static int tcmu_rbd_image_open(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	int ret;
+
+	ret = tcmu_rbd_conn_get(dev);
+	if (ret < 0)
+		return ret;
+
+	tcmu_rbd_detect_device_class(dev);
+
+	ret = rbd_open(state->io_ctx, state->image_name, &state->image, NULL);
+	if (ret < 0) {
+		tcmu_dev_err(dev, "Could not open image %s. (Err %d)\n",
+			     state->image_name, ret);
+		goto conn_put;
+	}
+
+	ret = tcmu_rbd_service_register(dev);
+	if (ret < 0)
+		goto rbd_close;
+
+	return 0;
+
+rbd_close:
+	rbd_close(state->image);
+	state->image = NULL;
+conn_put:
+	tcmu_rbd_conn_put(dev);
+	return ret;
+}
+
+#ifdef RBD_LOCK_ACQUIRE_SUPPORT
+
+/*
+ * Returns:
+ * 0 = client is not owner.
+ * 1 = client is owner.
+ * -ESHUTDOWN/-EBLACKLISTED(-108) = client is blacklisted.
+ * -ETIMEDOUT = rados osd op timeout has expired.
+ * -EIO = misc error.
+ */
+static int tcmu_rbd_has_lock(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	int ret, is_owner;
+
+	ret = rbd_is_exclusive_lock_owner(state->image, &is_owner);
+	if (ret < 0) {
+		if (ret == -ESHUTDOWN) {
+			tcmu_dev_dbg(dev, "Client is blacklisted. Could not check lock ownership.\n");
+			tcmu_rbd_conn_set_blacklisted(dev);
+		} else {
+			tcmu_dev_err(dev, "Could not check lock ownership. Error: %s.\n",
+				     strerror(-ret));
+		}
+
+		if (ret == -ESHUTDOWN || ret == -ETIMEDOUT)
+			return ret;
+
+		/* let initiator figure things out */
+		return -EIO;
+	} else if (is_owner) {
+		tcmu_dev_dbg(dev, "Is owner\n");
+		return 1;
+	}
+	tcmu_dev_dbg(dev, "Not owner\n");
+
+	return 0;
+}
+
+static int tcmu_rbd_get_lock_state(struct tcmu_device *dev)
+{
+	int ret;
+
+	ret = tcmu_rbd_has_lock(dev);
+	if (ret == 1)
+		return TCMUR_DEV_LOCK_WRITE_LOCKED;
+	else if (ret == 0 || ret == -ESHUTDOWN)
+		return TCMUR_DEV_LOCK_UNLOCKED;
+	else
+		return TCMUR_DEV_LOCK_UNKNOWN;
+}
 
 /**
  * tcmu_rbd_lock_break - break rbd exclusive lock if needed
@@ -860,11 +1552,53 @@ free_owners:
 	return ret;
 }
 
+static int tcmu_rbd_wb_get_owner(struct tcmu_device *dev, char *owner,
+				 size_t len);
+
+/*
+ * Returns 0 if the image has no writes in another gateway's write-back
+ * log, -EBUSY if it does, or -errno. Until they are written back, the
+ * image must not be taken over.
+ */
+static int tcmu_rbd_check_wb_owner(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	char owner[RBD_WB_OWNER_LEN];
+	int ret;
+
+	ret = tcmu_rbd_wb_get_owner(dev, owner, sizeof(owner));
+	if (ret == -ENOENT)
+		return 0;
+	if (ret < 0) {
+		tcmu_dev_err(dev, "Could not get write-back log owner. Err %d.\n",
+			     ret);
+		return ret;
+	}
+
+	if (state->wb && rbd_wb_owns(state->wb, owner))
+		return 0;
+
+	tcmu_dev_err(dev, "Image has writes in write-back log %s that are not written back yet. Not taking the lock.\n",
+		     owner);
+	return -EBUSY;
+}
+
 static int tcmu_rbd_unlock(struct tcmu_device *dev)
 {
 	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
 	int ret;
 
+	/*
+	 * The next lock owner must see everything we completed, so the
+	 * write-back log is written back first, and the lock is kept if
+	 * it cannot be. Until we get the lock again new writes go to the
+	 * image directly.
+	 */
+	if (state->wb && rbd_wb_drain(state->wb)) {
+		tcmu_dev_err(dev, "Not releasing lock with data left in the write-back log.\n");
+		return TCMU_STS_HW_ERR;
+	}
+
 	ret = tcmu_rbd_has_lock(dev);
 	if (ret == 0)
 		return TCMU_STS_OK;
@@ -900,6 +1634,10 @@ static int tcmu_rbd_lock(struct tcmu_device *dev, uint16_t tag)
 	} else if (ret)
 		goto done;
 
+	ret = tcmu_rbd_check_wb_owner(dev);
+	if (ret)
+		goto done;
+
 	ret = tcmu_rbd_lock_break(dev);
 	if (ret)
 		goto done;
@@ -908,6 +1646,16 @@ static int tcmu_rbd_lock(struct tcmu_device *dev, uint16_t tag)
 	if (ret)
 		goto done;
 
+	/*
+	 * The owner we fenced may have marked the image after we checked.
+	 * It cannot anymore, so this check is final.
+	 */
+	ret = tcmu_rbd_check_wb_owner(dev);
+	if (ret) {
+		rbd_lock_release(state->image);
+		goto done;
+	}
+
 #if !defined LIBRADOS_SUPPORTS_GETADDRS && defined RBD_LOCK_ACQUIRE_SUPPORT
 	ret = rbd_lock_get_owners(state->image, &lock_mode, owners1,
 				  &num_owners1);
@@ -947,8 +1695,15 @@ set_lock_tag:
 	tcmu_dev_warn(dev, "Acquired exclusive lock.\n");
 	if (tag != TCMU_INVALID_LOCK_TAG)
 		ret = tcmu_rbd_set_lock_tag(dev, tag);
+	/* The previous owner may have written to parts of a clone */
+	if (!ret && state->pcache)
+		rbd_pc_refresh(state->pcache, state->image);
+	if (!ret && state->wb)
+		rbd_wb_resume(state->wb);
 
 done:
+	if (ret == -ESHUTDOWN)
+		tcmu_rbd_conn_set_blacklisted(dev);
 	tcmu_rbd_service_status_update(dev, ret == 0 ? true : false);
 	return tcmu_rbd_to_sts(ret);
 }
@@ -993,6 +1748,9 @@ static void tcmu_rbd_state_free(struct tcmu_rbd_state *state)
 		free(state->id);
 	if (state->addrs)
 		free(state->addrs);
+	if (state->wb_log_path)
+		free(state->wb_log_path);
+	tcmu_rbd_buf_pool_destroy(&state->buf_pool);
 	free(state);
 }
 
@@ -1018,6 +1776,13 @@ static int tcmu_rbd_check_image_size(struct tcmu_device *dev, uint64_t new_size)
 	return 0;
 }
 
+static const struct rbd_wb_ops tcmu_rbd_wb_ops;
+static int tcmu_rbd_read_direct(struct tcmu_device *dev,
+				struct tcmur_cmd *tcmur_cmd,
+				struct iovec *iov, size_t iov_cnt,
+				size_t length, off_t offset);
+static int tcmu_rbd_pi_err(struct tcmu_device *dev, int ret, bool read);
+
 static int tcmu_rbd_open(struct tcmu_device *dev, bool reopen)
 {
 	rbd_image_info_t image_info;
@@ -1031,6 +1796,7 @@ static int tcmu_rbd_open(struct tcmu_device *dev, bool reopen)
 	state = calloc(1, sizeof(*state));
 	if (!state)
 		return -ENOMEM;
+	tcmu_rbd_buf_pool_init(&state->buf_pool);
 	tcmur_dev_set_private(dev, state);
 
 	dev_cfg_dup = strdup(tcmu_dev_get_cfgstring(dev));
@@ -1104,6 +1870,33 @@ static int tcmu_rbd_open(struct tcmu_device *dev, bool reopen)
 				tcmu_dev_err(dev, "Could not copy id.\n");
 				goto free_config;
 			}
+		} else if (!strncmp(next_opt, "wb_log=", 7)) {
+			state->wb_log_path = strdup(next_opt + 7);
+			if (!state->wb_log_path ||
+			    !strlen(state->wb_log_path)) {
+				ret = -ENOMEM;
+				tcmu_dev_err(dev, "Could not copy write-back log path.\n");
+				goto free_config;
+			}
+		} else if (!strncmp(next_opt, "wb_log_size_mb=", 15)) {
+			state->wb_log_size_mb = strtoull(next_opt + 15, NULL,
+							 10);
+			if (state->wb_log_size_mb < RBD_WB_LOG_SIZE_MB_MIN) {
+				ret = -EINVAL;
+				tcmu_dev_err(dev, "Invalid write-back log size %s, the minimum is %u MiB.\n",
+					     next_opt + 15,
+					     RBD_WB_LOG_SIZE_MB_MIN);
+				goto free_config;
+			}
+		} else if (!strncmp(next_opt, "parent_cache_mb=", 16)) {
+			state->parent_cache_mb = strtoull(next_opt + 16, NULL,
+							  10);
+			if (!state->parent_cache_mb) {
+				ret = -EINVAL;
+				tcmu_dev_err(dev, "Invalid parent cache size %s.\n",
+					     next_opt + 16);
+				goto free_config;
+			}
 		}
 		next_opt = strtok(NULL, ";");
 	}
@@ -1152,8 +1945,43 @@ static int tcmu_rbd_open(struct tcmu_device *dev, bool reopen)
 	tcmu_dev_set_unmap_gran_align(dev, unmap_gran);
 	tcmu_dev_set_write_cache_enabled(dev, 0);
 
+	/*
+	 * The log only completes writes once they are stable on it, so the
+	 * write cache stays reported as disabled.
+	 */
+	if (state->wb_log_path) {
+		snprintf(buf, sizeof(buf), "%s/%s", state->pool_name,
+			 state->image_name);
+		ret = rbd_wb_open(dev, state->wb_log_path,
+				  state->wb_log_size_mb ?
+				  state->wb_log_size_mb :
+				  RBD_WB_LOG_SIZE_MB_DEFAULT,
+				  buf, &tcmu_rbd_wb_ops, &state->wb);
+		if (ret)
+			goto stop_image;
+	}
+
+	/* Not being able to use the cache is not an error */
+	if (state->parent_cache_mb)
+		rbd_pc_open(dev, state->cluster, state->image,
+			    state->parent_cache_mb, tcmu_rbd_read_direct,
+			    &state->pcache);
+
+	/* Without a PI store the device runs without PI */
+	if (tcmu_dev_get_pi_enabled(dev)) {
+		ret = rbd_get_id(state->image, buf, RBD_MAX_BLOCK_NAME_SIZE);
+		if (!ret)
+			ret = rbd_pi_open(dev, state->io_ctx, buf,
+					  tcmu_rbd_pi_err, &state->pi);
+		if (ret) {
+			tcmu_dev_warn(dev, "Could not set up PI objects. Err %d.\n",
+				      ret);
+			tcmu_dev_set_pi_enabled(dev, false);
+		}
+	}
+
 #if defined LIBRADOS_SUPPORTS_GETADDRS || defined RBD_LOCK_ACQUIRE_SUPPORT
-	tcmu_rbd_rm_stale_entries_from_blacklist(dev);
+	tcmu_rbd_blacklist_cleanup(dev);
 #endif
 
 #ifdef LIBRADOS_SUPPORTS_GETADDRS
@@ -1176,25 +2004,36 @@ free_state:
 	return ret;
 }
 
-static void tcmu_rbd_close(struct tcmu_device *dev)
+/* Devices sharing a rados client, see tcmu_rbd_conn_match, recover together */
+static int tcmu_rbd_get_conn_key(struct tcmu_device *dev, char *key,
+				 size_t len)
 {
 	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
 
-	tcmu_rbd_image_close(dev);
+	if (!state || !state->conn)
+		return -ENOENT;
 
-	/*
-	 * Since we are closing the device, but current device maybe
-	 * already blacklisted by other tcmu nodes. Let's just save
-	 * the entity addrs into the blacklist_caches, and let any
-	 * other new device help remove it.
-	 */
-	if (state->addrs) {
-		pthread_mutex_lock(&blacklist_caches_lock);
-		darray_append(blacklist_caches, state->addrs);
-		pthread_mutex_unlock(&blacklist_caches_lock);
-		state->addrs = NULL;
-	}
+	snprintf(key, len, "rbd:%s:%s:%s:%s",
+		 state->conf_path ? state->conf_path : "",
+		 state->id ? state->id : "",
+		 state->pool_name ? state->pool_name : "",
+		 state->osd_op_timeout ? state->osd_op_timeout : "");
+	return 0;
+}
+
+static void tcmu_rbd_close(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+
+	if (state->wb)
+		rbd_wb_close(state->wb);
+	if (state->pcache)
+		rbd_pc_close(state->pcache);
+	if (state->pi)
+		rbd_pi_close(state->pi);
 
+	/* The client's blacklist entry is cached once its last user is gone */
+	tcmu_rbd_image_close(dev);
 	tcmu_rbd_state_free(state);
 }
 
@@ -1234,12 +2073,46 @@ static int tcmu_rbd_handle_timedout_cmd(struct tcmu_device *dev)
 	return TCMU_STS_TIMEOUT;
 }
 
-#ifdef RBD_IOVEC_SUPPORT
+static int tcmu_rbd_pi_err(struct tcmu_device *dev, int ret, bool read)
+{
+	if (ret == -ETIMEDOUT)
+		return tcmu_rbd_handle_timedout_cmd(dev);
 
-static rbd_image_t tcmu_dev_to_image(struct tcmu_device *dev)
+	if (ret == -ESHUTDOWN || ret == -EROFS) {
+		if (ret == -ESHUTDOWN)
+			tcmu_rbd_conn_set_blacklisted(dev);
+		return tcmu_rbd_handle_blacklisted_cmd(dev);
+	}
+
+	return read ? TCMU_STS_RD_ERR : TCMU_STS_WR_ERR;
+}
+
+static int tcmu_rbd_read_pi(struct tcmu_device *dev,
+			    struct tcmur_cmd *tcmur_cmd,
+			    struct tcmu_pi_tuple *pi, uint64_t lba,
+			    uint32_t nr_blocks)
 {
 	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
-	return state->image;
+
+	return rbd_pi_read(state->pi, tcmur_cmd, pi, lba, nr_blocks);
+}
+
+static int tcmu_rbd_write_pi(struct tcmu_device *dev,
+			     struct tcmur_cmd *tcmur_cmd,
+			     const struct tcmu_pi_tuple *pi, uint64_t lba,
+			     uint32_t nr_blocks)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+
+	return rbd_pi_write(state->pi, tcmur_cmd, pi, lba, nr_blocks);
+}
+
+#ifdef RBD_IOVEC_SUPPORT
+
+static rbd_image_t tcmu_dev_to_image(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	return state->image;
 }
 
 #define tcmu_rbd_aio_read(dev, aio_cb, completion, iov, iov_cnt, length, offset) \
@@ -1250,6 +2123,11 @@ static rbd_image_t tcmu_dev_to_image(struct tcmu_device *dev)
 
 #else
 
+/*
+ * Without the vectored API a single iovec can still be handed to librbd
+ * directly, since the UIO data area stays mapped until the command is
+ * completed. Only scattered requests need to go through a bounce buffer.
+ */
 static int tcmu_rbd_aio_read(struct tcmu_device *dev, struct rbd_aio_cb *aio_cb,
 			     rbd_completion_t completion, struct iovec *iov,
 			     size_t iov_cnt, size_t length, off_t offset)
@@ -1257,16 +2135,18 @@ static int tcmu_rbd_aio_read(struct tcmu_device *dev, struct rbd_aio_cb *aio_cb,
 	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
 	int ret;
 
-	aio_cb->bounce_buffer = malloc(length);
-	if (!aio_cb->bounce_buffer) {
-		tcmu_dev_err(dev, "Could not allocate bounce buffer.\n");
-		return -ENOMEM;
-	}
+	if (iov_cnt == 1)
+		return rbd_aio_read(state->image, offset, length,
+				    iov->iov_base, completion);
+
+	ret = tcmu_rbd_bounce_alloc(dev, aio_cb, length);
+	if (ret < 0)
+		return ret;
 
 	ret = rbd_aio_read(state->image, offset, length, aio_cb->bounce_buffer,
 			   completion);
 	if (ret < 0)
-		free(aio_cb->bounce_buffer);
+		tcmu_rbd_bounce_free(dev, aio_cb);
 	return ret;
 }
 
@@ -1277,23 +2157,45 @@ static int tcmu_rbd_aio_write(struct tcmu_device *dev, struct rbd_aio_cb *aio_cb
 	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
 	int ret;
 
-	aio_cb->bounce_buffer = malloc(length);
-	if (!aio_cb->bounce_buffer) {
-		tcmu_dev_err(dev, "Failed to allocate bounce buffer.\n");
-		return -ENOMEM;;
-	}
+	if (iov_cnt == 1)
+		return rbd_aio_write(state->image, offset, length,
+				     iov->iov_base, completion);
+
+	ret = tcmu_rbd_bounce_alloc(dev, aio_cb, length);
+	if (ret < 0)
+		return ret;
 
 	tcmu_memcpy_from_iovec(aio_cb->bounce_buffer, length, iov, iov_cnt);
 
 	ret = rbd_aio_write(state->image, offset, length, aio_cb->bounce_buffer,
 			    completion);
 	if (ret < 0)
-		free(aio_cb->bounce_buffer);
+		tcmu_rbd_bounce_free(dev, aio_cb);
 	return ret;
 }
 
 #endif
 
+/*
+ * Drop a reference on a vectored request, recording the first error seen.
+ * Returns true for the last reference with *tcmu_r set to the final status.
+ */
+static bool tcmu_rbd_aio_vec_put(struct rbd_aio_vec *vec, int *tcmu_r)
+{
+	int ok = TCMU_STS_OK;
+
+	if (*tcmu_r != TCMU_STS_OK)
+		__atomic_compare_exchange_n(&vec->status, &ok, *tcmu_r, false,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+	if (__atomic_sub_fetch(&vec->pending, 1, __ATOMIC_ACQ_REL))
+		return false;
+
+	*tcmu_r = vec->status;
+	free(vec);
+	return true;
+}
+
 /*
  * NOTE: RBD async APIs almost always return 0 (success), except
  * when allocation (via new) fails - which is not caught. So,
@@ -1307,16 +2209,20 @@ static void rbd_finish_aio_generic(rbd_completion_t completion,
 	struct tcmur_cmd *tcmur_cmd = aio_cb->tcmur_cmd;
 	struct iovec *iov = aio_cb->iov;
 	size_t iov_cnt = aio_cb->iov_cnt;
+	struct iovec bounce_iov;
 	uint32_t cmp_offset;
 	int64_t ret;
 	int tcmu_r;
 
 	ret = rbd_aio_get_return_value(completion);
 	rbd_aio_release(completion);
+	TCMU_TRACE3(rbd_aio_done, dev, tcmur_cmd->lib_cmd, ret);
 
 	if (ret == -ETIMEDOUT) {
 		tcmu_r = tcmu_rbd_handle_timedout_cmd(dev);
 	} else if (ret == -ESHUTDOWN || ret == -EROFS) {
+		if (ret == -ESHUTDOWN)
+			tcmu_rbd_conn_set_blacklisted(dev);
 		tcmu_r = tcmu_rbd_handle_blacklisted_cmd(dev);
 	} else if (ret == -EILSEQ && aio_cb->type == RBD_AIO_TYPE_CAW) {
 		cmp_offset = aio_cb->caw.miscompare_offset - aio_cb->caw.offset;
@@ -1338,22 +2244,34 @@ static void rbd_finish_aio_generic(rbd_completion_t completion,
 		tcmu_r = TCMU_STS_OK;
 		if (aio_cb->type == RBD_AIO_TYPE_READ &&
 		    aio_cb->bounce_buffer) {
+			bounce_iov.iov_base = aio_cb->bounce_buffer;
+			bounce_iov.iov_len = aio_cb->read.length;
+			if (aio_cb->overlay)
+				rbd_wb_overlay_apply(aio_cb->overlay,
+						     &bounce_iov, 1);
 			tcmu_memcpy_into_iovec(iov, iov_cnt,
 					       aio_cb->bounce_buffer,
 					       aio_cb->read.length);
+		} else if (aio_cb->overlay) {
+			rbd_wb_overlay_apply(aio_cb->overlay, iov, iov_cnt);
 		}
 	}
+	if (aio_cb->overlay)
+		rbd_wb_overlay_free(aio_cb->overlay);
 
-	tcmur_cmd_complete(dev, tcmur_cmd, tcmu_r);
+	if (!aio_cb->vec || tcmu_rbd_aio_vec_put(aio_cb->vec, &tcmu_r))
+		tcmur_cmd_complete(dev, tcmur_cmd, tcmu_r);
 
-	if (aio_cb->bounce_buffer)
-		free(aio_cb->bounce_buffer);
+	tcmu_rbd_bounce_free(dev, aio_cb);
 	free(aio_cb);
 }
 
-static int tcmu_rbd_read(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
-			     struct iovec *iov, size_t iov_cnt, size_t length,
-			     off_t offset)
+/* Read from the image, and copy overlay, if set, over what was read */
+static int tcmu_rbd_read_image(struct tcmu_device *dev,
+			       struct tcmur_cmd *tcmur_cmd,
+			       struct iovec *iov, size_t iov_cnt,
+			       size_t length, off_t offset,
+			       struct rbd_wb_overlay *overlay)
 {
 	struct rbd_aio_cb *aio_cb;
 	rbd_completion_t completion;
@@ -1371,6 +2289,7 @@ static int tcmu_rbd_read(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
 	aio_cb->tcmur_cmd = tcmur_cmd;
 	aio_cb->iov = iov;
 	aio_cb->iov_cnt = iov_cnt;
+	aio_cb->overlay = overlay;
 
 	ret = rbd_aio_create_completion
 		(aio_cb, (rbd_callback_t) rbd_finish_aio_generic, &completion);
@@ -1390,12 +2309,62 @@ out_release_tracked_aio:
 out_free_aio_cb:
 	free(aio_cb);
 out:
+	if (overlay)
+		rbd_wb_overlay_free(overlay);
 	return TCMU_STS_NO_RESOURCE;
 }
 
-static int tcmu_rbd_write(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
-			  struct iovec *iov, size_t iov_cnt, size_t length,
-			  off_t offset)
+static int tcmu_rbd_read_direct(struct tcmu_device *dev,
+				struct tcmur_cmd *tcmur_cmd,
+				struct iovec *iov, size_t iov_cnt,
+				size_t length, off_t offset)
+{
+	return tcmu_rbd_read_image(dev, tcmur_cmd, iov, iov_cnt, length,
+				   offset, NULL);
+}
+
+static int tcmu_rbd_read(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			     struct iovec *iov, size_t iov_cnt, size_t length,
+			     off_t offset)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	struct rbd_wb_overlay *overlay = NULL;
+	int ret;
+
+	if (state->wb) {
+		ret = rbd_wb_read(state->wb, tcmur_cmd, iov, iov_cnt, length,
+				  offset, &overlay);
+		if (ret != TCMU_STS_NOT_HANDLED)
+			return ret;
+	}
+
+	/* Blocks in the log are not the parent's any more */
+	if (!overlay && state->pcache) {
+		ret = rbd_pc_read(state->pcache, tcmur_cmd, iov, iov_cnt,
+				  length, offset);
+		if (ret != TCMU_STS_NOT_HANDLED)
+			return ret;
+	}
+
+	return tcmu_rbd_read_image(dev, tcmur_cmd, iov, iov_cnt, length,
+				   offset, overlay);
+}
+
+/*
+ * Every change to a clone must be marked before it is sent, so reads
+ * after it no longer come from the parent cache.
+ */
+static void tcmu_rbd_pc_mark(struct tcmu_rbd_state *state, uint64_t offset,
+			     uint64_t length)
+{
+	if (state->pcache)
+		rbd_pc_mark_written(state->pcache, offset, length);
+}
+
+static int tcmu_rbd_write_direct(struct tcmu_device *dev,
+				 struct tcmur_cmd *tcmur_cmd,
+				 struct iovec *iov, size_t iov_cnt,
+				 size_t length, off_t offset)
 {
 	struct rbd_aio_cb *aio_cb;
 	rbd_completion_t completion;
@@ -1433,9 +2402,122 @@ out:
 	return TCMU_STS_NO_RESOURCE;
 }
 
+static int tcmu_rbd_write(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			  struct iovec *iov, size_t iov_cnt, size_t length,
+			  off_t offset)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	int ret;
+
+	tcmu_rbd_pc_mark(state, offset, length);
+	if (state->wb) {
+		ret = rbd_wb_write(state->wb, tcmur_cmd, iov, iov_cnt, length,
+				   offset);
+		if (ret != TCMU_STS_NOT_HANDLED)
+			return ret;
+	}
+
+	return tcmu_rbd_write_direct(dev, tcmur_cmd, iov, iov_cnt, length,
+				     offset);
+}
+
+/*
+ * Write back extents of the write-back log, from its flusher thread, and
+ * return once they are stable on the image.
+ */
+static int tcmu_rbd_wb_write_sync(struct tcmu_device *dev,
+				  struct rbd_wb_extent *ext, int nr_ext)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	rbd_completion_t completions[TCMU_RBD_WB_AIO_WINDOW];
+	int i, j, nr, ret = 0;
+	ssize_t r;
+
+	for (i = 0; i < nr_ext && !ret; i += nr) {
+		nr = nr_ext - i;
+		if (nr > TCMU_RBD_WB_AIO_WINDOW)
+			nr = TCMU_RBD_WB_AIO_WINDOW;
+
+		for (j = 0; j < nr; j++) {
+			ret = rbd_aio_create_completion(NULL, NULL,
+							&completions[j]);
+			if (ret < 0)
+				break;
+			ret = rbd_aio_write(state->image, ext[i + j].offset,
+					    ext[i + j].length, ext[i + j].buf,
+					    completions[j]);
+			if (ret < 0) {
+				rbd_aio_release(completions[j]);
+				break;
+			}
+		}
+
+		/* Wait for everything submitted, even after an error */
+		nr = j;
+		for (j = 0; j < nr; j++) {
+			rbd_aio_wait_for_complete(completions[j]);
+			r = rbd_aio_get_return_value(completions[j]);
+			rbd_aio_release(completions[j]);
+			if (r < 0 && !ret)
+				ret = r;
+		}
+	}
+
+	if (!ret)
+		ret = rbd_flush(state->image);
+
+	if (ret == -ESHUTDOWN)
+		tcmu_rbd_conn_set_blacklisted(dev);
+	if (ret)
+		tcmu_dev_err(dev, "Could not write back write-back log. Err %d.\n",
+			     ret);
+	return ret;
+}
+
+static int tcmu_rbd_wb_set_owner(struct tcmu_device *dev, const char *owner)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	int ret;
+
+	if (owner) {
+		ret = rbd_metadata_set(state->image, TCMU_RBD_WB_OWNER_KEY,
+				       owner);
+	} else {
+		ret = rbd_metadata_remove(state->image, TCMU_RBD_WB_OWNER_KEY);
+		if (ret == -ENOENT)
+			ret = 0;
+	}
+
+	if (ret == -ESHUTDOWN)
+		tcmu_rbd_conn_set_blacklisted(dev);
+	return ret;
+}
+
+static int tcmu_rbd_wb_get_owner(struct tcmu_device *dev, char *owner,
+				 size_t len)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	int ret;
+
+	memset(owner, 0, len);
+	ret = rbd_metadata_get(state->image, TCMU_RBD_WB_OWNER_KEY, owner,
+			       &len);
+	if (ret == -ESHUTDOWN)
+		tcmu_rbd_conn_set_blacklisted(dev);
+	return ret;
+}
+
+static const struct rbd_wb_ops tcmu_rbd_wb_ops = {
+	.write_sync	= tcmu_rbd_wb_write_sync,
+	.write_direct	= tcmu_rbd_write_direct,
+	.set_owner	= tcmu_rbd_wb_set_owner,
+	.get_owner	= tcmu_rbd_wb_get_owner,
+};
+
 #ifdef RBD_DISCARD_SUPPORT
-static int tcmu_rbd_unmap(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
-			  uint64_t off, uint64_t len)
+static int tcmu_rbd_unmap_direct(struct tcmu_device *dev,
+				 struct tcmur_cmd *tcmur_cmd,
+				 uint64_t off, uint64_t len)
 {
 	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
 	struct rbd_aio_cb *aio_cb;
@@ -1471,6 +2553,174 @@ out_free_aio_cb:
 out:
 	return TCMU_STS_NO_RESOURCE;
 }
+
+/*
+ * Issue a discard for every range up front, so they are all in flight in
+ * librbd at once, and complete the cmd when the last one finishes.
+ */
+static int tcmu_rbd_unmap_vec_direct(struct tcmu_device *dev,
+				     struct tcmur_cmd *tcmur_cmd,
+				     struct tcmur_unmap_range *ranges,
+				     unsigned int nr_ranges)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	struct rbd_aio_cb *aio_cb;
+	struct rbd_aio_vec *vec;
+	rbd_completion_t completion;
+	int tcmu_r = TCMU_STS_OK;
+	unsigned int i;
+	ssize_t ret;
+
+	vec = calloc(1, sizeof(*vec));
+	if (!vec) {
+		tcmu_dev_err(dev, "Could not allocate aio_vec.\n");
+		return TCMU_STS_NO_RESOURCE;
+	}
+	/* released below when done submitting */
+	vec->pending = 1;
+	vec->status = TCMU_STS_OK;
+
+	for (i = 0; i < nr_ranges; i++) {
+		aio_cb = calloc(1, sizeof(*aio_cb));
+		if (!aio_cb) {
+			tcmu_dev_err(dev, "Could not allocate aio_cb.\n");
+			goto out_submit_err;
+		}
+
+		aio_cb->dev = dev;
+		aio_cb->tcmur_cmd = tcmur_cmd;
+		aio_cb->vec = vec;
+		aio_cb->type = RBD_AIO_TYPE_WRITE;
+
+		ret = rbd_aio_create_completion
+			(aio_cb, (rbd_callback_t) rbd_finish_aio_generic,
+			 &completion);
+		if (ret < 0)
+			goto out_free_aio_cb;
+
+		__atomic_add_fetch(&vec->pending, 1, __ATOMIC_RELAXED);
+		ret = rbd_aio_discard(state->image, ranges[i].offset,
+				      ranges[i].length, completion);
+		if (ret < 0) {
+			__atomic_sub_fetch(&vec->pending, 1, __ATOMIC_RELAXED);
+			rbd_aio_release(completion);
+			goto out_free_aio_cb;
+		}
+	}
+	goto done;
+
+out_free_aio_cb:
+	free(aio_cb);
+out_submit_err:
+	if (!i) {
+		/* Nothing in flight, so let the caller fail the cmd */
+		free(vec);
+		return TCMU_STS_NO_RESOURCE;
+	}
+	tcmu_r = TCMU_STS_NO_RESOURCE;
+done:
+	if (tcmu_rbd_aio_vec_put(vec, &tcmu_r))
+		tcmur_cmd_complete(dev, tcmur_cmd, tcmu_r);
+	return TCMU_STS_OK;
+}
+
+/* Called from the write-back log flusher */
+static void tcmu_rbd_wb_discard_fn(struct rbd_wb_waiter *waiter)
+{
+	struct rbd_wb_discard *discard = container_of(waiter,
+						      struct rbd_wb_discard,
+						      waiter);
+	int ret;
+
+	if (discard->ranges)
+		ret = tcmu_rbd_unmap_vec_direct(discard->dev,
+						discard->tcmur_cmd,
+						discard->ranges,
+						discard->nr_ranges);
+	else
+		ret = tcmu_rbd_unmap_direct(discard->dev, discard->tcmur_cmd,
+					    discard->range.offset,
+					    discard->range.length);
+	if (ret != TCMU_STS_OK)
+		tcmur_cmd_complete(discard->dev, discard->tcmur_cmd, ret);
+	free(discard);
+}
+
+/*
+ * A discard must not be overwritten by older data the write-back log
+ * still has for its ranges, so it waits until that is written back.
+ * Returns TCMU_STS_NOT_HANDLED if it can be sent right away.
+ */
+static int tcmu_rbd_wb_defer_discard(struct tcmu_device *dev,
+				     struct tcmur_cmd *tcmur_cmd,
+				     struct tcmur_unmap_range *ranges,
+				     unsigned int nr_ranges, bool vec)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	struct rbd_wb_discard *discard;
+	unsigned int i;
+
+	for (i = 0; i < nr_ranges; i++)
+		tcmu_rbd_pc_mark(state, ranges[i].offset, ranges[i].length);
+
+	if (!state->wb)
+		return TCMU_STS_NOT_HANDLED;
+
+	for (i = 0; i < nr_ranges; i++) {
+		if (rbd_wb_range_dirty(state->wb, ranges[i].offset,
+				       ranges[i].length))
+			break;
+	}
+	if (i == nr_ranges)
+		return TCMU_STS_NOT_HANDLED;
+
+	discard = calloc(1, sizeof(*discard));
+	if (!discard) {
+		tcmu_dev_err(dev, "Could not allocate discard.\n");
+		return TCMU_STS_NO_RESOURCE;
+	}
+	discard->waiter.fn = tcmu_rbd_wb_discard_fn;
+	discard->dev = dev;
+	discard->tcmur_cmd = tcmur_cmd;
+	/* The ranges of a vectored unmap live until the cmd completes */
+	if (vec) {
+		discard->ranges = ranges;
+		discard->nr_ranges = nr_ranges;
+	} else {
+		discard->range = ranges[0];
+	}
+
+	rbd_wb_defer(state->wb, &discard->waiter);
+	return TCMU_STS_OK;
+}
+
+static int tcmu_rbd_unmap(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			  uint64_t off, uint64_t len)
+{
+	struct tcmur_unmap_range range = { .offset = off, .length = len };
+	int ret;
+
+	ret = tcmu_rbd_wb_defer_discard(dev, tcmur_cmd, &range, 1, false);
+	if (ret != TCMU_STS_NOT_HANDLED)
+		return ret;
+
+	return tcmu_rbd_unmap_direct(dev, tcmur_cmd, off, len);
+}
+
+static int tcmu_rbd_unmap_vec(struct tcmu_device *dev,
+			      struct tcmur_cmd *tcmur_cmd,
+			      struct tcmur_unmap_range *ranges,
+			      unsigned int nr_ranges)
+{
+	int ret;
+
+	ret = tcmu_rbd_wb_defer_discard(dev, tcmur_cmd, ranges, nr_ranges,
+					true);
+	if (ret != TCMU_STS_NOT_HANDLED)
+		return ret;
+
+	return tcmu_rbd_unmap_vec_direct(dev, tcmur_cmd, ranges, nr_ranges);
+}
 #endif /* RBD_DISCARD_SUPPORT */
 
 #ifdef LIBRBD_SUPPORTS_AIO_FLUSH
@@ -1514,6 +2764,94 @@ out:
 	return TCMU_STS_NO_RESOURCE;
 }
 
+/* The write of a WRITE AND VERIFY is done, flush it out of the rbd cache */
+static void rbd_finish_aio_write_verify(rbd_completion_t completion,
+					struct rbd_aio_cb *aio_cb)
+{
+	struct tcmu_device *dev = aio_cb->dev;
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	rbd_completion_t flush_completion;
+	ssize_t ret;
+
+	if (rbd_aio_get_return_value(completion) < 0) {
+		rbd_finish_aio_generic(completion, aio_cb);
+		return;
+	}
+	rbd_aio_release(completion);
+	tcmu_rbd_bounce_free(dev, aio_cb);
+
+	ret = rbd_aio_create_completion
+		(aio_cb, (rbd_callback_t) rbd_finish_aio_generic,
+		 &flush_completion);
+	if (ret < 0)
+		goto out_free_aio_cb;
+
+	ret = rbd_aio_flush(state->image, flush_completion);
+	if (ret < 0)
+		goto out_release_tracked_aio;
+	return;
+
+out_release_tracked_aio:
+	rbd_aio_release(flush_completion);
+out_free_aio_cb:
+	tcmur_cmd_complete(dev, aio_cb->tcmur_cmd, TCMU_STS_NO_RESOURCE);
+	free(aio_cb);
+}
+
+/*
+ * RADOS only acks a write once every replica in the acting set has it,
+ * and the OSDs checksum what they store, so reading the data back to
+ * compare it adds nothing. WRITE AND VERIFY is a write followed by a
+ * flush, for when the rbd cache is in writeback mode.
+ */
+static int tcmu_rbd_write_verify(struct tcmu_device *dev,
+				 struct tcmur_cmd *tcmur_cmd,
+				 struct iovec *iov, size_t iov_cnt,
+				 size_t length, off_t offset)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	struct rbd_aio_cb *aio_cb;
+	rbd_completion_t completion;
+	ssize_t ret;
+
+	/* The data would only reach the local log */
+	if (state->wb)
+		return TCMU_STS_NOT_HANDLED;
+
+	aio_cb = calloc(1, sizeof(*aio_cb));
+	if (!aio_cb) {
+		tcmu_dev_err(dev, "Could not allocate aio_cb.\n");
+		goto out;
+	}
+
+	aio_cb->dev = dev;
+	aio_cb->type = RBD_AIO_TYPE_WRITE;
+	aio_cb->tcmur_cmd = tcmur_cmd;
+
+	ret = rbd_aio_create_completion
+		(aio_cb, (rbd_callback_t) rbd_finish_aio_write_verify,
+		 &completion);
+	if (ret < 0) {
+		goto out_free_aio_cb;
+	}
+
+	tcmu_rbd_pc_mark(state, offset, length);
+	ret = tcmu_rbd_aio_write(dev, aio_cb, completion, iov, iov_cnt,
+				 length, offset);
+	if (ret < 0) {
+		goto out_release_tracked_aio;
+	}
+
+	return TCMU_STS_OK;
+
+out_release_tracked_aio:
+	rbd_aio_release(completion);
+out_free_aio_cb:
+	free(aio_cb);
+out:
+	return TCMU_STS_NO_RESOURCE;
+}
+
 #endif
 
 #ifdef RBD_WRITE_SAME_SUPPORT
@@ -1526,8 +2864,14 @@ static int tcmu_rbd_aio_writesame(struct tcmu_device *dev,
 	struct rbd_aio_cb *aio_cb;
 	rbd_completion_t completion;
 	size_t length = tcmu_iovec_length(iov, iov_cnt);
+	char *buf;
 	ssize_t ret;
 
+	/* Let the runner emulate it with writes through the log */
+	tcmu_rbd_pc_mark(state, off, len);
+	if (state->wb && rbd_wb_range_dirty(state->wb, off, len))
+		return TCMU_STS_NOT_HANDLED;
+
 	aio_cb = calloc(1, sizeof(*aio_cb));
 	if (!aio_cb) {
 		tcmu_dev_err(dev, "Could not allocate aio_cb.\n");
@@ -1538,14 +2882,17 @@ static int tcmu_rbd_aio_writesame(struct tcmu_device *dev,
 	aio_cb->tcmur_cmd = tcmur_cmd;
 	aio_cb->type = RBD_AIO_TYPE_WRITE;
 
-	aio_cb->bounce_buffer = malloc(length);
-	if (!aio_cb->bounce_buffer) {
-		tcmu_dev_err(dev, "Failed to allocate bounce buffer.\n");
-		goto out_free_aio_cb;
+	/* The pattern is usually one block in a single data area iovec */
+	if (iov_cnt == 1) {
+		buf = iov->iov_base;
+	} else {
+		if (tcmu_rbd_bounce_alloc(dev, aio_cb, length) < 0)
+			goto out_free_aio_cb;
+		tcmu_memcpy_from_iovec(aio_cb->bounce_buffer, length, iov,
+				       iov_cnt);
+		buf = aio_cb->bounce_buffer;
 	}
 
-	tcmu_memcpy_from_iovec(aio_cb->bounce_buffer, length, iov, iov_cnt);
-
 	ret = rbd_aio_create_completion
 		(aio_cb, (rbd_callback_t) rbd_finish_aio_generic, &completion);
 	if (ret < 0)
@@ -1553,8 +2900,8 @@ static int tcmu_rbd_aio_writesame(struct tcmu_device *dev,
 
 	tcmu_dev_dbg(dev, "Start write same off:%"PRIu64", len:%"PRIu64"\n", off, len);
 
-	ret = rbd_aio_writesame(state->image, off, len, aio_cb->bounce_buffer,
-				length, completion, 0);
+	ret = rbd_aio_writesame(state->image, off, len, buf, length,
+				completion, 0);
 	if (ret < 0)
 		goto out_remove_tracked_aio;
 
@@ -1563,7 +2910,7 @@ static int tcmu_rbd_aio_writesame(struct tcmu_device *dev,
 out_remove_tracked_aio:
 	rbd_aio_release(completion);
 out_free_bounce_buffer:
-	free(aio_cb->bounce_buffer);
+	tcmu_rbd_bounce_free(dev, aio_cb);
 out_free_aio_cb:
 	free(aio_cb);
 out:
@@ -1571,6 +2918,57 @@ out:
 }
 #endif /* RBD_WRITE_SAME_SUPPORT */
 
+#ifdef RBD_WRITE_ZEROES_SUPPORT
+static int tcmu_rbd_aio_write_zeroes(struct tcmu_device *dev,
+				     struct tcmur_cmd *tcmur_cmd,
+				     uint64_t off, uint64_t len)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	struct rbd_aio_cb *aio_cb;
+	rbd_completion_t completion;
+	ssize_t ret;
+
+	tcmu_rbd_pc_mark(state, off, len);
+	if (state->wb && rbd_wb_range_dirty(state->wb, off, len))
+		return TCMU_STS_NOT_HANDLED;
+
+	aio_cb = calloc(1, sizeof(*aio_cb));
+	if (!aio_cb) {
+		tcmu_dev_err(dev, "Could not allocate aio_cb.\n");
+		goto out;
+	}
+
+	aio_cb->dev = dev;
+	aio_cb->tcmur_cmd = tcmur_cmd;
+	aio_cb->type = RBD_AIO_TYPE_WRITE;
+
+	ret = rbd_aio_create_completion
+		(aio_cb, (rbd_callback_t) rbd_finish_aio_generic, &completion);
+	if (ret < 0)
+		goto out_free_aio_cb;
+
+	tcmu_dev_dbg(dev, "Start write zeroes off:%"PRIu64", len:%"PRIu64"\n",
+		     off, len);
+
+	/*
+	 * Unlike discard this is not skipped for partial objects, and
+	 * librbd deallocates whole objects where it can.
+	 */
+	ret = rbd_aio_write_zeroes(state->image, off, len, completion, 0, 0);
+	if (ret < 0)
+		goto out_remove_tracked_aio;
+
+	return TCMU_STS_OK;
+
+out_remove_tracked_aio:
+	rbd_aio_release(completion);
+out_free_aio_cb:
+	free(aio_cb);
+out:
+	return TCMU_STS_NO_RESOURCE;
+}
+#endif /* RBD_WRITE_ZEROES_SUPPORT */
+
 #ifdef RBD_COMPARE_AND_WRITE_SUPPORT
 static int tcmu_rbd_aio_caw(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
 			    uint64_t off, uint64_t len, struct iovec *iov,
@@ -1580,8 +2978,14 @@ static int tcmu_rbd_aio_caw(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd
 	struct rbd_aio_cb *aio_cb;
 	rbd_completion_t completion;
 	uint64_t buffer_length = 2 * len;
+	char *cmp_buf, *write_buf;
 	ssize_t ret;
 
+	/* The compare must see the log's data, so the runner emulates it */
+	tcmu_rbd_pc_mark(state, off, len);
+	if (state->wb && rbd_wb_range_dirty(state->wb, off, len))
+		return TCMU_STS_NOT_HANDLED;
+
 	aio_cb = calloc(1, sizeof(*aio_cb));
 	if (!aio_cb) {
 		tcmu_dev_err(dev, "Could not allocate aio_cb.\n");
@@ -1593,16 +2997,26 @@ static int tcmu_rbd_aio_caw(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd
 	aio_cb->type = RBD_AIO_TYPE_CAW;
 	aio_cb->caw.offset = off;
 
-	aio_cb->bounce_buffer = malloc(buffer_length);
-	if (!aio_cb->bounce_buffer) {
-		tcmu_dev_err(dev, "Failed to allocate bounce buffer.\n");
-		goto out_free_aio_cb;
+	/*
+	 * The compare buffer is followed by the write buffer. Use the data
+	 * area in place when each half is contiguous in one iovec.
+	 */
+	if (iov[0].iov_len >= buffer_length) {
+		cmp_buf = iov[0].iov_base;
+		write_buf = cmp_buf + len;
+	} else if (iov_cnt >= 2 && iov[0].iov_len == len &&
+		   iov[1].iov_len >= len) {
+		cmp_buf = iov[0].iov_base;
+		write_buf = iov[1].iov_base;
+	} else {
+		if (tcmu_rbd_bounce_alloc(dev, aio_cb, buffer_length) < 0)
+			goto out_free_aio_cb;
+		tcmu_memcpy_from_iovec(aio_cb->bounce_buffer, buffer_length,
+				       iov, iov_cnt);
+		cmp_buf = aio_cb->bounce_buffer;
+		write_buf = cmp_buf + len;
 	}
 
-	/* compare followed by write buffer are combined */
-	tcmu_memcpy_from_iovec(aio_cb->bounce_buffer, buffer_length, iov,
-			       iov_cnt);
-
 	ret = rbd_aio_create_completion(
 		aio_cb, (rbd_callback_t) rbd_finish_aio_generic, &completion);
 	if (ret < 0) {
@@ -1611,9 +3025,8 @@ static int tcmu_rbd_aio_caw(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd
 
 	tcmu_dev_dbg(dev, "Start CAW off: %"PRIu64", len: %"PRIu64"\n",
 		     off, len);
-	ret = rbd_aio_compare_and_write(state->image, off, len,
-					aio_cb->bounce_buffer,
-					aio_cb->bounce_buffer + len, completion,
+	ret = rbd_aio_compare_and_write(state->image, off, len, cmp_buf,
+					write_buf, completion,
 					&aio_cb->caw.miscompare_offset, 0);
 	if (ret < 0)
 		goto out_remove_tracked_aio;
@@ -1623,7 +3036,7 @@ static int tcmu_rbd_aio_caw(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd
 out_remove_tracked_aio:
 	rbd_aio_release(completion);
 out_free_bounce_buffer:
-	free(aio_cb->bounce_buffer);
+	tcmu_rbd_bounce_free(dev, aio_cb);
 out_free_aio_cb:
 	free(aio_cb);
 out:
@@ -1634,13 +3047,24 @@ out:
 static int tcmu_rbd_reconfig(struct tcmu_device *dev,
 			     struct tcmulib_cfg_info *cfg)
 {
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	uint64_t old_lbas, new_lbas;
+
 	switch (cfg->type) {
 	case TCMULIB_CFG_DEV_SIZE:
 		/*
 		 * Apps will already have resized on the ceph side, so no
 		 * need to double check and have to also handle unblacklisting
 		 * the client from this context.
+		 *
+		 * The device still has its old size here. Growing back gives
+		 * zeroed blocks, so the tuples of the cut off ones go too.
 		 */
+		old_lbas = tcmu_dev_get_num_lbas(dev);
+		new_lbas = cfg->data.dev_size / tcmu_dev_get_block_size(dev);
+		if (state->pi && new_lbas < old_lbas)
+			return rbd_pi_clear_sync(state->pi, new_lbas,
+						 old_lbas - new_lbas);
 		return 0;
 	case TCMULIB_CFG_DEV_CFGSTR:
 	case TCMULIB_CFG_WRITE_CACHE:
@@ -1652,6 +3076,16 @@ static int tcmu_rbd_reconfig(struct tcmu_device *dev,
 static int tcmu_rbd_init(void)
 {
 	darray_init(blacklist_caches);
+	darray_init(rbd_conn_cache);
+
+#if defined LIBRADOS_SUPPORTS_GETADDRS || defined RBD_LOCK_ACQUIRE_SUPPORT
+	/* Without it, stale entries are just left to expire */
+	if (pthread_create(&blacklist_cleaner, NULL,
+			   tcmu_rbd_blacklist_cleaner_fn, NULL))
+		tcmu_warn("Could not start blacklist cleanup thread.\n");
+	else
+		blacklist_cleaner_running = true;
+#endif
 	return 0;
 }
 
@@ -1660,6 +3094,21 @@ static void tcmu_rbd_destroy(void)
 	char **entry;
 
 	tcmu_info("destroying the rbd handler\n");
+
+	if (blacklist_cleaner_running) {
+		pthread_mutex_lock(&blacklist_caches_lock);
+		blacklist_cleaner_stop = true;
+		pthread_cond_signal(&blacklist_caches_cond);
+		pthread_mutex_unlock(&blacklist_caches_lock);
+		pthread_join(blacklist_cleaner, NULL);
+		blacklist_cleaner_running = false;
+
+		if (blacklist_conn) {
+			tcmu_rbd_conn_release(blacklist_conn);
+			blacklist_conn = NULL;
+		}
+	}
+
 	pthread_mutex_lock(&blacklist_caches_lock);
 	if (darray_empty(blacklist_caches))
 		goto unlock;
@@ -1693,7 +3142,12 @@ static const char tcmu_rbd_cfg_desc[] =
 	"devicename:	Name of the RBD image\n"
 	"optionN:	Like: \"osd_op_timeout=30\" in secs\n"
 	"                     \"conf=/etc/ceph/cluster.conf\"\n"
-	"                     \"id=user\"\n";
+	"                     \"id=user\"\n"
+	"                     \"wb_log=/dev/nvme0n1p1\" write-back log\n"
+	"                     \"wb_log_size_mb=1024\" if wb_log is a file\n"
+	"                     \"parent_cache_mb=256\" cache clone parents\n"
+	"T10-PI tuples, with tcmur_pi=1, are kept in rbd_pi.<image id>.*\n"
+	"objects of the pool, which are not removed with the image.\n";
 
 struct tcmur_handler tcmu_rbd_handler = {
 	.name	       = "Ceph RBD handler",
@@ -1704,18 +3158,26 @@ struct tcmur_handler tcmu_rbd_handler = {
 	.read	       = tcmu_rbd_read,
 	.write	       = tcmu_rbd_write,
 	.reconfig      = tcmu_rbd_reconfig,
+	.get_conn_key  = tcmu_rbd_get_conn_key,
 #ifdef LIBRADOS_SUPPORTS_SERVICES
 	.report_event  = tcmu_rbd_report_event,
 #endif
 #ifdef LIBRBD_SUPPORTS_AIO_FLUSH
 	.flush	       = tcmu_rbd_flush,
+	.write_verify  = tcmu_rbd_write_verify,
 #endif
+	.read_pi       = tcmu_rbd_read_pi,
+	.write_pi      = tcmu_rbd_write_pi,
 #ifdef RBD_DISCARD_SUPPORT
 	.unmap         = tcmu_rbd_unmap,
+	.unmap_vec     = tcmu_rbd_unmap_vec,
 #endif
 #ifdef RBD_WRITE_SAME_SUPPORT
 	.writesame     = tcmu_rbd_aio_writesame,
 #endif
+#ifdef RBD_WRITE_ZEROES_SUPPORT
+	.write_zeroes  = tcmu_rbd_aio_write_zeroes,
+#endif
 #ifdef RBD_COMPARE_AND_WRITE_SUPPORT
 	.caw           = tcmu_rbd_aio_caw,
 #endif
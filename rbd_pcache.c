@@ -0,0 +1,757 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Host-wide read cache of the parent images of rbd clones.
+ *
+ * Clones of one golden image share its data until they write over it, so
+ * during a boot storm every LUN reads the same parent objects. Devices
+ * that use the cache open the parent snapshot of their image once per
+ * rados client, and reads of clone extents that still come from the
+ * parent are served from chunks of it cached in memory. A missing chunk
+ * is read from the parent once, however many LUNs are waiting for it.
+ *
+ * A snapshot never changes, so cached chunks never go stale. What does
+ * change is which parts of the clone still come from the parent: each
+ * device keeps a bitmap of the clone's objects that exist in the clone
+ * itself, built from the object map when it is opened and when it gets
+ * the exclusive lock, and set before every write, discard or other
+ * change it sends. Reads that touch such an object, or go past the
+ * parent overlap, are sent to the clone as usual.
+ *
+ * The size of the cache is the largest one asked for by the devices using
+ * it. The least recently used chunks are dropped to stay within it.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ccan/list/list.h"
+
+#include "libtcmu.h"
+#include "libtcmu_log.h"
+#include "tcmu-runner.h"
+#include "rbd_pcache.h"
+
+/*
+ * rbd_get_parent and the snapshot and namespace aware open it needs were
+ * added in librbd 1.12.0
+ */
+#if LIBRBD_VERSION_CODE >= LIBRBD_VERSION(1, 12, 0)
+#define RBD_PC_SUPPORT
+#endif
+
+#define RBD_PC_CHUNK_SHIFT	16
+#define RBD_PC_CHUNK_SIZE	(1 << RBD_PC_CHUNK_SHIFT)
+/* Larger reads, usually sequential, are not worth caching */
+#define RBD_PC_MAX_READ		(1024 * 1024)
+#define RBD_PC_HASH_BITS	14
+#define RBD_PC_HASH_SIZE	(1 << RBD_PC_HASH_BITS)
+
+#define BITS_PER_LONG		(8 * sizeof(unsigned long))
+
+/* A parent snapshot, shared by the devices of one rados client */
+struct rbd_pc_parent {
+	struct list_node entry;
+	rados_t cluster;
+	int64_t pool_id;
+	char *pool_ns;
+	char *image_id;
+	uint64_t snap_id;
+
+	rados_ioctx_t io_ctx;
+	rbd_image_t image;
+	uint64_t size;
+	int ref_cnt;
+};
+
+struct rbd_pc_chunk {
+	struct rbd_pc_chunk *hash_next;
+	/* on pc_lru once it has been read */
+	struct list_node lru;
+	struct rbd_pc_parent *parent;
+	uint64_t offset;
+	size_t length;
+	char *buf;
+	bool ready;
+	/* readers copying out of buf, it is not dropped until they are done */
+	int refs;
+	/* reads waiting for the chunk to be read */
+	struct list_head waiters;
+};
+
+struct rbd_pc_req;
+
+struct rbd_pc_wait {
+	struct list_node entry;
+	struct rbd_pc_req *req;
+	struct rbd_pc_chunk *chunk;
+	/* what to do with the chunk once pc_lock is dropped */
+	bool copy;
+	bool submit;
+};
+
+/* A read served from the cache */
+struct rbd_pc_req {
+	struct rbd_pc_dev *pd;
+	struct tcmur_cmd *tcmur_cmd;
+	struct iovec *iov;
+	size_t iov_cnt;
+	size_t length;
+	off_t offset;
+	int pending;
+	bool failed;
+	struct rbd_pc_wait waits[];
+};
+
+struct rbd_pc_dev {
+	struct tcmu_device *dev;
+	struct rbd_pc_parent *parent;
+	rbd_pc_read_fn_t read_direct;
+
+	/* bytes of the clone that can come from the parent, only shrinks */
+	uint64_t overlap;
+	uint64_t obj_size;
+	uint64_t nr_objs;
+	/* objects that exist in the clone, which are never read from here */
+	unsigned long *owned;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t fallbacks;
+};
+
+/* Protects the parent list and ref counts, held while opening parents */
+static pthread_mutex_t pc_parent_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(pc_parents);
+
+/* Protects the chunks */
+static pthread_mutex_t pc_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(pc_lru);
+static struct rbd_pc_chunk *pc_hash[RBD_PC_HASH_SIZE];
+static uint64_t pc_used;
+static uint64_t pc_limit;
+
+static unsigned int pc_hash_idx(struct rbd_pc_parent *parent, uint64_t offset)
+{
+	uint64_t h = ((uintptr_t)parent >> 4) ^ (offset >> RBD_PC_CHUNK_SHIFT);
+
+	h *= 0x9e3779b97f4a7c15ULL;
+	return h >> (64 - RBD_PC_HASH_BITS);
+}
+
+static struct rbd_pc_chunk *pc_lookup(struct rbd_pc_parent *parent,
+				      uint64_t offset)
+{
+	struct rbd_pc_chunk *chunk;
+
+	for (chunk = pc_hash[pc_hash_idx(parent, offset)]; chunk;
+	     chunk = chunk->hash_next) {
+		if (chunk->parent == parent && chunk->offset == offset)
+			return chunk;
+	}
+	return NULL;
+}
+
+static void pc_unhash(struct rbd_pc_chunk *chunk)
+{
+	struct rbd_pc_chunk **p;
+
+	for (p = &pc_hash[pc_hash_idx(chunk->parent, chunk->offset)]; *p;
+	     p = &(*p)->hash_next) {
+		if (*p == chunk) {
+			*p = chunk->hash_next;
+			return;
+		}
+	}
+}
+
+static void pc_chunk_free(struct rbd_pc_chunk *chunk)
+{
+	free(chunk->buf);
+	free(chunk);
+}
+
+/* Must be called with pc_lock held */
+static void pc_evict(void)
+{
+	struct rbd_pc_chunk *chunk, *next;
+
+	list_for_each_safe(&pc_lru, chunk, next, lru) {
+		if (pc_used <= pc_limit)
+			break;
+		if (chunk->refs)
+			continue;
+		pc_unhash(chunk);
+		list_del(&chunk->lru);
+		pc_used -= RBD_PC_CHUNK_SIZE;
+		pc_chunk_free(chunk);
+	}
+}
+
+/* Copy the part of the chunk the read covers, without consuming its iovec */
+static void pc_copy(struct rbd_pc_req *req, struct rbd_pc_chunk *chunk)
+{
+	uint64_t start = chunk->offset, end = chunk->offset + chunk->length;
+	struct iovec *iov = req->iov;
+	size_t iov_cnt = req->iov_cnt, off, len, n;
+	const char *buf;
+
+	if (start < (uint64_t)req->offset)
+		start = req->offset;
+	if (end > req->offset + req->length)
+		end = req->offset + req->length;
+	if (start >= end)
+		return;
+
+	buf = chunk->buf + (start - chunk->offset);
+	off = start - req->offset;
+	len = end - start;
+
+	for (; iov_cnt && off >= iov->iov_len; iov++, iov_cnt--)
+		off -= iov->iov_len;
+	for (; len && iov_cnt; iov++, iov_cnt--) {
+		n = iov->iov_len - off;
+		if (n > len)
+			n = len;
+		memcpy((char *)iov->iov_base + off, buf, n);
+		buf += n;
+		len -= n;
+		off = 0;
+	}
+}
+
+static void pc_req_put(struct rbd_pc_req *req)
+{
+	struct rbd_pc_dev *pd = req->pd;
+	int ret = TCMU_STS_OK;
+
+	if (__atomic_sub_fetch(&req->pending, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	/* The parent could not be read, try the clone itself */
+	if (req->failed) {
+		__atomic_add_fetch(&pd->fallbacks, 1, __ATOMIC_RELAXED);
+		ret = pd->read_direct(pd->dev, req->tcmur_cmd, req->iov,
+				      req->iov_cnt, req->length, req->offset);
+		if (ret == TCMU_STS_OK)
+			goto free_req;
+	}
+	tcmur_cmd_complete(pd->dev, req->tcmur_cmd, ret);
+free_req:
+	free(req);
+}
+
+/*
+ * A chunk read from the parent finished. The waiting reads are only
+ * completed once the chunk is no longer used here, so that their device
+ * and the parent can go away right after.
+ */
+static void pc_chunk_done(struct rbd_pc_chunk *chunk, ssize_t ret)
+{
+	struct rbd_pc_wait *wait, *next;
+	struct list_head waiters;
+	int nr = 0;
+
+	list_head_init(&waiters);
+
+	pthread_mutex_lock(&pc_lock);
+	list_append_list(&waiters, &chunk->waiters);
+	if (ret >= 0) {
+		list_for_each(&waiters, wait, entry)
+			nr++;
+		chunk->ready = true;
+		chunk->refs += nr;
+		list_add_tail(&pc_lru, &chunk->lru);
+		pc_used += RBD_PC_CHUNK_SIZE;
+		pc_evict();
+	} else {
+		pc_unhash(chunk);
+	}
+	pthread_mutex_unlock(&pc_lock);
+
+	if (ret < 0) {
+		tcmu_warn("Could not read parent image at %"PRIu64". Err %zd.\n",
+			  chunk->offset, ret);
+		list_for_each(&waiters, wait, entry)
+			wait->req->failed = true;
+		pc_chunk_free(chunk);
+	} else {
+		list_for_each(&waiters, wait, entry)
+			pc_copy(wait->req, chunk);
+
+		pthread_mutex_lock(&pc_lock);
+		chunk->refs -= nr;
+		pc_evict();
+		pthread_mutex_unlock(&pc_lock);
+	}
+
+	list_for_each_safe(&waiters, wait, next, entry)
+		pc_req_put(wait->req);
+}
+
+#ifdef RBD_PC_SUPPORT
+
+static void pc_chunk_read_cbk(rbd_completion_t completion,
+			      struct rbd_pc_chunk *chunk)
+{
+	ssize_t ret;
+
+	ret = rbd_aio_get_return_value(completion);
+	rbd_aio_release(completion);
+	pc_chunk_done(chunk, ret);
+}
+
+static void pc_chunk_read(struct rbd_pc_chunk *chunk)
+{
+	rbd_completion_t completion;
+	int ret;
+
+	ret = rbd_aio_create_completion(chunk,
+					(rbd_callback_t) pc_chunk_read_cbk,
+					&completion);
+	if (ret < 0)
+		goto fail;
+
+	ret = rbd_aio_read(chunk->parent->image, chunk->offset, chunk->length,
+			   chunk->buf, completion);
+	if (ret < 0) {
+		rbd_aio_release(completion);
+		goto fail;
+	}
+	return;
+
+fail:
+	pc_chunk_done(chunk, ret);
+}
+
+#else
+
+static void pc_chunk_read(struct rbd_pc_chunk *chunk)
+{
+	pc_chunk_done(chunk, -EOPNOTSUPP);
+}
+
+#endif /* RBD_PC_SUPPORT */
+
+static bool pc_owned(struct rbd_pc_dev *pd, uint64_t offset, uint64_t length)
+{
+	uint64_t obj = offset / pd->obj_size;
+	uint64_t last = (offset + length - 1) / pd->obj_size;
+
+	for (; obj <= last; obj++) {
+		if (__atomic_load_n(&pd->owned[obj / BITS_PER_LONG],
+				    __ATOMIC_ACQUIRE) &
+		    (1UL << (obj % BITS_PER_LONG)))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Mark the objects of a change to the clone as no longer coming from the
+ * parent. Must be called before the change is sent.
+ */
+void rbd_pc_mark_written(struct rbd_pc_dev *pd, uint64_t offset,
+			 uint64_t length)
+{
+	uint64_t overlap = __atomic_load_n(&pd->overlap, __ATOMIC_ACQUIRE);
+	uint64_t obj, last;
+
+	if (!length || offset >= overlap)
+		return;
+	if (offset + length > overlap)
+		length = overlap - offset;
+
+	obj = offset / pd->obj_size;
+	last = (offset + length - 1) / pd->obj_size;
+	for (; obj <= last; obj++)
+		__atomic_fetch_or(&pd->owned[obj / BITS_PER_LONG],
+				  1UL << (obj % BITS_PER_LONG),
+				  __ATOMIC_RELEASE);
+}
+
+/*
+ * Serve a read of the clone from the parent cache. Returns
+ * TCMU_STS_NOT_HANDLED if it has to be read from the clone.
+ */
+int rbd_pc_read(struct rbd_pc_dev *pd, struct tcmur_cmd *tcmur_cmd,
+		struct iovec *iov, size_t iov_cnt, size_t length,
+		off_t offset)
+{
+	uint64_t overlap = __atomic_load_n(&pd->overlap, __ATOMIC_ACQUIRE);
+	struct rbd_pc_parent *parent = pd->parent;
+	struct rbd_pc_chunk *chunk;
+	struct rbd_pc_wait *wait;
+	struct rbd_pc_req *req;
+	uint64_t first, off;
+	unsigned int i, nr;
+	bool miss = false;
+
+	if (!length || length > RBD_PC_MAX_READ ||
+	    offset + length > overlap || pc_owned(pd, offset, length))
+		return TCMU_STS_NOT_HANDLED;
+
+	first = offset >> RBD_PC_CHUNK_SHIFT;
+	nr = ((offset + length - 1) >> RBD_PC_CHUNK_SHIFT) - first + 1;
+
+	req = calloc(1, sizeof(*req) + nr * sizeof(*wait));
+	if (!req)
+		return TCMU_STS_NOT_HANDLED;
+	req->pd = pd;
+	req->tcmur_cmd = tcmur_cmd;
+	req->iov = iov;
+	req->iov_cnt = iov_cnt;
+	req->length = length;
+	req->offset = offset;
+	/* dropped once all the chunks are found or submitted */
+	req->pending = 1;
+
+	pthread_mutex_lock(&pc_lock);
+	for (i = 0; i < nr; i++) {
+		wait = &req->waits[i];
+		wait->req = req;
+		off = (first + i) << RBD_PC_CHUNK_SHIFT;
+
+		chunk = pc_lookup(parent, off);
+		if (chunk && chunk->ready) {
+			list_del(&chunk->lru);
+			list_add_tail(&pc_lru, &chunk->lru);
+			chunk->refs++;
+			wait->chunk = chunk;
+			wait->copy = true;
+			continue;
+		}
+
+		miss = true;
+		if (!chunk) {
+			chunk = calloc(1, sizeof(*chunk));
+			if (chunk)
+				chunk->buf = malloc(RBD_PC_CHUNK_SIZE);
+			if (!chunk || !chunk->buf) {
+				free(chunk);
+				req->failed = true;
+				continue;
+			}
+			chunk->parent = parent;
+			chunk->offset = off;
+			chunk->length = RBD_PC_CHUNK_SIZE;
+			if (off + chunk->length > parent->size)
+				chunk->length = parent->size - off;
+			list_head_init(&chunk->waiters);
+			chunk->hash_next = pc_hash[pc_hash_idx(parent, off)];
+			pc_hash[pc_hash_idx(parent, off)] = chunk;
+			wait->chunk = chunk;
+			wait->submit = true;
+		}
+		list_add_tail(&chunk->waiters, &wait->entry);
+		req->pending++;
+	}
+	pthread_mutex_unlock(&pc_lock);
+
+	if (miss)
+		__atomic_add_fetch(&pd->misses, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_add_fetch(&pd->hits, 1, __ATOMIC_RELAXED);
+
+	for (i = 0; i < nr; i++) {
+		wait = &req->waits[i];
+		if (wait->submit) {
+			pc_chunk_read(wait->chunk);
+		} else if (wait->copy) {
+			pc_copy(req, wait->chunk);
+			pthread_mutex_lock(&pc_lock);
+			wait->chunk->refs--;
+			pthread_mutex_unlock(&pc_lock);
+		}
+	}
+
+	pc_req_put(req);
+	return TCMU_STS_OK;
+}
+
+#ifdef RBD_PC_SUPPORT
+
+static void pc_parent_free(struct rbd_pc_parent *parent)
+{
+	if (parent->image)
+		rbd_close(parent->image);
+	if (parent->io_ctx)
+		rados_ioctx_destroy(parent->io_ctx);
+	free(parent->pool_ns);
+	free(parent->image_id);
+	free(parent);
+}
+
+static struct rbd_pc_parent *pc_parent_get(struct tcmu_device *dev,
+					   rados_t cluster,
+					   rbd_linked_image_spec_t *spec,
+					   rbd_snap_spec_t *snap)
+{
+	struct rbd_pc_parent *parent;
+	int ret;
+
+	pthread_mutex_lock(&pc_parent_lock);
+	list_for_each(&pc_parents, parent, entry) {
+		if (parent->cluster == cluster &&
+		    parent->pool_id == spec->pool_id &&
+		    parent->snap_id == snap->id &&
+		    !strcmp(parent->pool_ns, spec->pool_namespace) &&
+		    !strcmp(parent->image_id, spec->image_id)) {
+			parent->ref_cnt++;
+			goto unlock;
+		}
+	}
+
+	parent = calloc(1, sizeof(*parent));
+	if (!parent)
+		goto unlock;
+	parent->cluster = cluster;
+	parent->pool_id = spec->pool_id;
+	parent->snap_id = snap->id;
+	parent->pool_ns = strdup(spec->pool_namespace);
+	parent->image_id = strdup(spec->image_id);
+	if (!parent->pool_ns || !parent->image_id)
+		goto free_parent;
+
+	ret = rados_ioctx_create2(cluster, spec->pool_id, &parent->io_ctx);
+	if (ret < 0) {
+		tcmu_dev_warn(dev, "Could not open pool %s of parent image. Err %d.\n",
+			      spec->pool_name, ret);
+		parent->io_ctx = NULL;
+		goto free_parent;
+	}
+	rados_ioctx_set_namespace(parent->io_ctx, spec->pool_namespace);
+
+	ret = rbd_open_by_id_read_only(parent->io_ctx, spec->image_id,
+				       &parent->image, NULL);
+	if (ret < 0) {
+		tcmu_dev_warn(dev, "Could not open parent image %s/%s. Err %d.\n",
+			      spec->pool_name, spec->image_name, ret);
+		parent->image = NULL;
+		goto free_parent;
+	}
+
+	ret = rbd_snap_set_by_id(parent->image, snap->id);
+	if (!ret)
+		ret = rbd_get_size(parent->image, &parent->size);
+	if (ret < 0) {
+		tcmu_dev_warn(dev, "Could not open snapshot %s of parent image %s/%s. Err %d.\n",
+			      snap->name, spec->pool_name, spec->image_name,
+			      ret);
+		goto free_parent;
+	}
+
+	parent->ref_cnt = 1;
+	list_add_tail(&pc_parents, &parent->entry);
+	tcmu_dev_info(dev, "Caching parent image %s/%s@%s.\n",
+		      spec->pool_name, spec->image_name, snap->name);
+	goto unlock;
+
+free_parent:
+	pc_parent_free(parent);
+	parent = NULL;
+unlock:
+	pthread_mutex_unlock(&pc_parent_lock);
+	return parent;
+}
+
+static void pc_parent_put(struct rbd_pc_parent *parent)
+{
+	struct rbd_pc_chunk *chunk, *next;
+
+	pthread_mutex_lock(&pc_parent_lock);
+	if (--parent->ref_cnt) {
+		pthread_mutex_unlock(&pc_parent_lock);
+		return;
+	}
+	list_del(&parent->entry);
+
+	/*
+	 * The devices using the parent are closed, so none of its chunks
+	 * is being read or copied any more.
+	 */
+	pthread_mutex_lock(&pc_lock);
+	list_for_each_safe(&pc_lru, chunk, next, lru) {
+		if (chunk->parent != parent)
+			continue;
+		pc_unhash(chunk);
+		list_del(&chunk->lru);
+		pc_used -= RBD_PC_CHUNK_SIZE;
+		pc_chunk_free(chunk);
+	}
+	pthread_mutex_unlock(&pc_lock);
+	pthread_mutex_unlock(&pc_parent_lock);
+
+	pc_parent_free(parent);
+}
+
+static int pc_diff_cb(uint64_t offset, size_t length, int exists, void *arg)
+{
+	rbd_pc_mark_written(arg, offset, length);
+	return 0;
+}
+
+/* Mark the objects that exist in the clone itself */
+static int pc_scan(struct rbd_pc_dev *pd, rbd_image_t image)
+{
+	uint64_t overlap;
+	int ret;
+
+	ret = rbd_get_overlap(image, &overlap);
+	if (ret < 0)
+		return ret;
+	if (overlap < __atomic_load_n(&pd->overlap, __ATOMIC_ACQUIRE))
+		__atomic_store_n(&pd->overlap, overlap, __ATOMIC_RELEASE);
+
+	return rbd_diff_iterate2(image, NULL, 0, overlap, 0, 1, pc_diff_cb,
+				 pd);
+}
+
+/*
+ * rbd_pc_open - use the parent cache for a clone
+ * @dev: device of the clone
+ * @cluster: rados client the clone was opened with
+ * @image: the clone
+ * @size_mb: size of the cache this device asks for
+ * @read_direct: read from the clone, if the parent cannot be read
+ * @pdp: returns the device's use of the cache
+ *
+ * *pdp is set to NULL when the image is not a clone, or the cache cannot
+ * tell which parts of it still come from the parent cheaply.
+ */
+int rbd_pc_open(struct tcmu_device *dev, rados_t cluster, rbd_image_t image,
+		uint64_t size_mb, rbd_pc_read_fn_t read_direct,
+		struct rbd_pc_dev **pdp)
+{
+	rbd_linked_image_spec_t spec;
+	rbd_snap_spec_t snap;
+	rbd_image_info_t info;
+	uint64_t features, flags, overlap;
+	struct rbd_pc_dev *pd;
+	int ret;
+
+	*pdp = NULL;
+
+	ret = rbd_get_parent(image, &spec, &snap);
+	if (ret == -ENOENT)
+		return 0;
+	if (ret < 0) {
+		tcmu_dev_warn(dev, "Could not get parent image. Err %d. Not using the parent cache.\n",
+			      ret);
+		return 0;
+	}
+
+	/* Without fast-diff finding the clone's own objects stats them all */
+	ret = rbd_get_features(image, &features);
+	if (!ret)
+		ret = rbd_get_flags(image, &flags);
+	if (ret < 0 || !(features & RBD_FEATURE_FAST_DIFF) ||
+	    flags & RBD_FLAG_FAST_DIFF_INVALID) {
+		tcmu_dev_warn(dev, "Parent cache needs a valid fast-diff object map. Not using it.\n");
+		goto cleanup_spec;
+	}
+
+	ret = rbd_get_overlap(image, &overlap);
+	if (!ret)
+		ret = rbd_stat(image, &info, sizeof(info));
+	if (ret < 0 || !overlap)
+		goto cleanup_spec;
+
+	pd = calloc(1, sizeof(*pd));
+	if (!pd)
+		goto cleanup_spec;
+	pd->dev = dev;
+	pd->read_direct = read_direct;
+	pd->overlap = overlap;
+	pd->obj_size = info.obj_size;
+	pd->nr_objs = (overlap + info.obj_size - 1) / info.obj_size;
+	pd->owned = calloc((pd->nr_objs + BITS_PER_LONG - 1) / BITS_PER_LONG,
+			   sizeof(unsigned long));
+	if (!pd->owned)
+		goto free_pd;
+
+	ret = pc_scan(pd, image);
+	if (ret < 0) {
+		tcmu_dev_warn(dev, "Could not scan clone objects. Err %d. Not using the parent cache.\n",
+			      ret);
+		goto free_pd;
+	}
+
+	pd->parent = pc_parent_get(dev, cluster, &spec, &snap);
+	if (!pd->parent)
+		goto free_pd;
+
+	pthread_mutex_lock(&pc_lock);
+	if (pc_limit < size_mb << 20)
+		pc_limit = size_mb << 20;
+	pthread_mutex_unlock(&pc_lock);
+
+	*pdp = pd;
+	goto cleanup_spec;
+
+free_pd:
+	free(pd->owned);
+	free(pd);
+cleanup_spec:
+	rbd_linked_image_spec_cleanup(&spec);
+	rbd_snap_spec_cleanup(&snap);
+	return 0;
+}
+
+/*
+ * Called when the exclusive lock was acquired, since the clone may have
+ * been changed by the gateway that had it before.
+ */
+void rbd_pc_refresh(struct rbd_pc_dev *pd, rbd_image_t image)
+{
+	int ret;
+
+	ret = pc_scan(pd, image);
+	if (ret < 0) {
+		tcmu_dev_warn(pd->dev, "Could not scan clone objects. Err %d. Not using the parent cache.\n",
+			      ret);
+		__atomic_store_n(&pd->overlap, 0, __ATOMIC_RELEASE);
+	}
+}
+
+void rbd_pc_close(struct rbd_pc_dev *pd)
+{
+	tcmu_dev_info(pd->dev, "Parent cache: %"PRIu64" reads hit, %"PRIu64" missed, %"PRIu64" read from the clone after errors.\n",
+		      pd->hits, pd->misses, pd->fallbacks);
+
+	pc_parent_put(pd->parent);
+	free(pd->owned);
+	free(pd);
+}
+
+#else
+
+int rbd_pc_open(struct tcmu_device *dev, rados_t cluster, rbd_image_t image,
+		uint64_t size_mb, rbd_pc_read_fn_t read_direct,
+		struct rbd_pc_dev **pdp)
+{
+	tcmu_dev_warn(dev, "Parent cache not supported by this librbd.\n");
+	*pdp = NULL;
+	return 0;
+}
+
+void rbd_pc_refresh(struct rbd_pc_dev *pd, rbd_image_t image)
+{
+}
+
+void rbd_pc_close(struct rbd_pc_dev *pd)
+{
+}
+
+#endif /* RBD_PC_SUPPORT */
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __RBD_PCACHE_H
+#define __RBD_PCACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <rbd/librbd.h>
+#include <rados/librados.h>
+
+struct tcmu_device;
+struct tcmur_cmd;
+struct rbd_pc_dev;
+
+/* Default host-wide size of the parent cache */
+#define RBD_PC_SIZE_MB_DEFAULT	256
+
+/*
+ * Read from the clone itself, like the handler's read callout. Used when
+ * reading the parent failed.
+ */
+typedef int (*rbd_pc_read_fn_t)(struct tcmu_device *dev,
+				struct tcmur_cmd *tcmur_cmd,
+				struct iovec *iov, size_t iov_cnt,
+				size_t length, off_t offset);
+
+int rbd_pc_open(struct tcmu_device *dev, rados_t cluster, rbd_image_t image,
+		uint64_t size_mb, rbd_pc_read_fn_t read_direct,
+		struct rbd_pc_dev **pdp);
+void rbd_pc_close(struct rbd_pc_dev *pd);
+void rbd_pc_refresh(struct rbd_pc_dev *pd, rbd_image_t image);
+
+void rbd_pc_mark_written(struct rbd_pc_dev *pd, uint64_t offset,
+			 uint64_t length);
+int rbd_pc_read(struct rbd_pc_dev *pd, struct tcmur_cmd *tcmur_cmd,
+		struct iovec *iov, size_t iov_cnt, size_t length,
+		off_t offset);
+
+#endif
@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * T10-PI store of the rbd handler.
+ *
+ * An rbd image has no room for the 8 bytes of protection information of
+ * each block, so the tuples are kept in rados objects of their own next
+ * to the image's data objects, in the image's pool. Object N of the image
+ * with id ID is named rbd_pi.ID.N and holds the tuples of blocks
+ * N * RBD_PI_OBJ_TUPLES to (N + 1) * RBD_PI_OBJ_TUPLES - 1, at 8 times
+ * the block's offset in the object. The objects are created sparse by the
+ * first write to them, and a missing object or extent reads as zero
+ * tuples, which the runner does not check.
+ *
+ * The objects are not known to rbd: they are not snapshotted, cloned or
+ * removed with the image. Removing them is left to whoever removes the
+ * image.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rbd/librbd.h>
+
+#include "libtcmu.h"
+#include "libtcmu_log.h"
+#include "tcmu-runner.h"
+#include "rbd_pi.h"
+
+#define RBD_PI_OBJ_SHIFT	22
+#define RBD_PI_OBJ_SIZE		(1ULL << RBD_PI_OBJ_SHIFT)
+#define RBD_PI_OBJ_TUPLES	(RBD_PI_OBJ_SIZE / sizeof(struct tcmu_pi_tuple))
+/* rbd_pi.<image id>.<16 hex digits> */
+#define RBD_PI_OID_MAX		(RBD_MAX_BLOCK_NAME_SIZE + 32)
+
+struct rbd_pi {
+	struct tcmu_device *dev;
+	rados_ioctx_t io_ctx;
+	char prefix[RBD_MAX_BLOCK_NAME_SIZE + 8];
+	rbd_pi_err_fn_t err_fn;
+};
+
+/* The rados op on one object of a PI read or write */
+struct rbd_pi_op {
+	struct rbd_pi_io *io;
+	char *buf;
+	size_t len;
+	rados_write_op_t write_op;
+};
+
+/* One PI read or write, split over the objects it spans */
+struct rbd_pi_io {
+	struct rbd_pi *pi;
+	struct tcmur_cmd *tcmur_cmd;
+	bool read;
+	/* ops in flight, plus one held by the submitter */
+	int pending;
+	/* first error */
+	int ret;
+	struct rbd_pi_op ops[];
+};
+
+static void rbd_pi_oid(struct rbd_pi *pi, uint64_t objno, char *oid)
+{
+	snprintf(oid, RBD_PI_OID_MAX, "%s.%016" PRIx64, pi->prefix, objno);
+}
+
+static void rbd_pi_io_set_err(struct rbd_pi_io *io, int ret)
+{
+	int zero = 0;
+
+	__atomic_compare_exchange_n(&io->ret, &zero, ret, false,
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static void rbd_pi_io_put(struct rbd_pi_io *io)
+{
+	struct rbd_pi *pi = io->pi;
+	int ret = TCMU_STS_OK;
+
+	if (__atomic_sub_fetch(&io->pending, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	if (io->ret < 0) {
+		tcmu_dev_err(pi->dev, "PI %s failed. Err %d.\n",
+			     io->read ? "read" : "write", io->ret);
+		ret = pi->err_fn(pi->dev, io->ret, io->read);
+	}
+	tcmur_cmd_complete(pi->dev, io->tcmur_cmd, ret);
+	free(io);
+}
+
+static void rbd_pi_op_done(rados_completion_t c, void *arg)
+{
+	struct rbd_pi_op *op = arg;
+	struct rbd_pi_io *io = op->io;
+	int ret;
+
+	ret = rados_aio_get_return_value(c);
+	rados_aio_release(c);
+	if (op->write_op)
+		rados_release_write_op(op->write_op);
+
+	/* Tuples never written are zero, and clearing them is a no-op */
+	if (ret == -ENOENT)
+		ret = 0;
+	if (ret >= 0 && io->read && (size_t)ret < op->len)
+		memset(op->buf + ret, 0, op->len - ret);
+
+	if (ret < 0)
+		rbd_pi_io_set_err(io, ret);
+	rbd_pi_io_put(io);
+}
+
+static int rbd_pi_op_submit(struct rbd_pi *pi, struct rbd_pi_op *op,
+			    uint64_t objno, uint64_t off)
+{
+	char oid[RBD_PI_OID_MAX];
+	rados_completion_t c;
+	int ret;
+
+	rbd_pi_oid(pi, objno, oid);
+
+	ret = rados_aio_create_completion(op, rbd_pi_op_done, NULL, &c);
+	if (ret < 0)
+		return ret;
+
+	if (op->io->read) {
+		ret = rados_aio_read(pi->io_ctx, oid, c, op->buf, op->len,
+				     off);
+	} else if (op->buf) {
+		ret = rados_aio_write(pi->io_ctx, oid, c, op->buf, op->len,
+				      off);
+	} else {
+		op->write_op = rados_create_write_op();
+		if (!op->write_op) {
+			ret = -ENOMEM;
+		} else {
+			rados_write_op_zero(op->write_op, off, op->len);
+			ret = rados_aio_write_op_operate(op->write_op,
+							 pi->io_ctx, c, oid,
+							 NULL, 0);
+		}
+	}
+	if (ret < 0) {
+		if (op->write_op)
+			rados_release_write_op(op->write_op);
+		rados_aio_release(c);
+	}
+	return ret;
+}
+
+static int rbd_pi_io(struct rbd_pi *pi, struct tcmur_cmd *tcmur_cmd,
+		     char *buf, bool read, uint64_t lba, uint32_t nr_blocks)
+{
+	uint64_t first = lba / RBD_PI_OBJ_TUPLES;
+	uint64_t last = (lba + nr_blocks - 1) / RBD_PI_OBJ_TUPLES;
+	size_t nr_ops = last - first + 1;
+	struct rbd_pi_io *io;
+	struct rbd_pi_op *op;
+	uint64_t off;
+	uint32_t nr;
+	int ret;
+
+	io = calloc(1, sizeof(*io) + nr_ops * sizeof(*op));
+	if (!io)
+		return TCMU_STS_NO_RESOURCE;
+	io->pi = pi;
+	io->tcmur_cmd = tcmur_cmd;
+	io->read = read;
+	io->pending = 1;
+
+	for (op = io->ops; nr_blocks; op++) {
+		off = lba % RBD_PI_OBJ_TUPLES;
+		nr = nr_blocks;
+		if (nr > RBD_PI_OBJ_TUPLES - off)
+			nr = RBD_PI_OBJ_TUPLES - off;
+
+		op->io = io;
+		op->buf = buf;
+		op->len = nr * sizeof(struct tcmu_pi_tuple);
+
+		__atomic_add_fetch(&io->pending, 1, __ATOMIC_ACQ_REL);
+		ret = rbd_pi_op_submit(pi, op, lba / RBD_PI_OBJ_TUPLES,
+				       off * sizeof(struct tcmu_pi_tuple));
+		if (ret < 0) {
+			__atomic_sub_fetch(&io->pending, 1, __ATOMIC_ACQ_REL);
+			rbd_pi_io_set_err(io, ret);
+			break;
+		}
+
+		if (buf)
+			buf += op->len;
+		lba += nr;
+		nr_blocks -= nr;
+	}
+
+	/* Completed by the last op, or here if none is left in flight */
+	rbd_pi_io_put(io);
+	return TCMU_STS_OK;
+}
+
+int rbd_pi_read(struct rbd_pi *pi, struct tcmur_cmd *tcmur_cmd,
+		struct tcmu_pi_tuple *tuples, uint64_t lba,
+		uint32_t nr_blocks)
+{
+	return rbd_pi_io(pi, tcmur_cmd, (char *)tuples, true, lba, nr_blocks);
+}
+
+int rbd_pi_write(struct rbd_pi *pi, struct tcmur_cmd *tcmur_cmd,
+		 const struct tcmu_pi_tuple *tuples, uint64_t lba,
+		 uint32_t nr_blocks)
+{
+	return rbd_pi_io(pi, tcmur_cmd, (char *)tuples, false, lba,
+			 nr_blocks);
+}
+
+/*
+ * Drop the tuples of blocks the image no longer has, so they do not
+ * fail the zeroed blocks it gets back if it grows again.
+ */
+int rbd_pi_clear_sync(struct rbd_pi *pi, uint64_t lba, uint64_t nr_blocks)
+{
+	char oid[RBD_PI_OID_MAX];
+	rados_write_op_t write_op;
+	uint64_t off, nr;
+	int ret;
+
+	while (nr_blocks) {
+		off = lba % RBD_PI_OBJ_TUPLES;
+		nr = nr_blocks;
+		if (nr > RBD_PI_OBJ_TUPLES - off)
+			nr = RBD_PI_OBJ_TUPLES - off;
+
+		rbd_pi_oid(pi, lba / RBD_PI_OBJ_TUPLES, oid);
+		if (nr == RBD_PI_OBJ_TUPLES) {
+			ret = rados_remove(pi->io_ctx, oid);
+		} else {
+			write_op = rados_create_write_op();
+			if (!write_op)
+				return -ENOMEM;
+			rados_write_op_zero(write_op,
+					    off * sizeof(struct tcmu_pi_tuple),
+					    nr * sizeof(struct tcmu_pi_tuple));
+			ret = rados_write_op_operate(write_op, pi->io_ctx, oid,
+						     NULL, 0);
+			rados_release_write_op(write_op);
+		}
+		if (ret < 0 && ret != -ENOENT) {
+			tcmu_dev_err(pi->dev, "Could not clear PI object %s. Err %d.\n",
+				     oid, ret);
+			return ret;
+		}
+
+		lba += nr;
+		nr_blocks -= nr;
+	}
+	return 0;
+}
+
+int rbd_pi_open(struct tcmu_device *dev, rados_ioctx_t io_ctx,
+		const char *image_id, rbd_pi_err_fn_t err_fn,
+		struct rbd_pi **pip)
+{
+	struct rbd_pi *pi;
+
+	pi = calloc(1, sizeof(*pi));
+	if (!pi)
+		return -ENOMEM;
+
+	pi->dev = dev;
+	pi->io_ctx = io_ctx;
+	pi->err_fn = err_fn;
+	snprintf(pi->prefix, sizeof(pi->prefix), "rbd_pi.%s", image_id);
+
+	tcmu_dev_dbg(dev, "PI objects %s.*\n", pi->prefix);
+	*pip = pi;
+	return 0;
+}
+
+void rbd_pi_close(struct rbd_pi *pi)
+{
+	free(pi);
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __RBD_PI_H
+#define __RBD_PI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <rados/librados.h>
+
+struct tcmu_device;
+struct tcmur_cmd;
+struct tcmu_pi_tuple;
+struct rbd_pi;
+
+/*
+ * Map a failed rados op on the PI objects to a TCMU_STS code, like the
+ * handler does for its image IO.
+ */
+typedef int (*rbd_pi_err_fn_t)(struct tcmu_device *dev, int ret, bool read);
+
+int rbd_pi_open(struct tcmu_device *dev, rados_ioctx_t io_ctx,
+		const char *image_id, rbd_pi_err_fn_t err_fn,
+		struct rbd_pi **pip);
+void rbd_pi_close(struct rbd_pi *pi);
+
+int rbd_pi_read(struct rbd_pi *pi, struct tcmur_cmd *tcmur_cmd,
+		struct tcmu_pi_tuple *tuples, uint64_t lba,
+		uint32_t nr_blocks);
+int rbd_pi_write(struct rbd_pi *pi, struct tcmur_cmd *tcmur_cmd,
+		 const struct tcmu_pi_tuple *tuples, uint64_t lba,
+		 uint32_t nr_blocks);
+int rbd_pi_clear_sync(struct rbd_pi *pi, uint64_t lba, uint64_t nr_blocks);
+
+#endif
@@ -0,0 +1,1731 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Write-back log for the rbd handler.
+ *
+ * Writes are appended to a log on a local file or block device, normally
+ * on NVMe, and completed once they are stable there, instead of waiting
+ * for the replicated write to RADOS. A writer thread appends the writes
+ * queued by the handler, many per pwritev and fdatasync. A flusher thread
+ * later writes the log back to the image oldest first, in batches sorted
+ * by LBA, and frees the space.
+ *
+ * The log is a ring of records after a superblock. Each record is a
+ * RBD_WB_HDR_SIZE header, protected by a CRC32C like its data, followed
+ * by the data of one write. Positions in the log only ever grow, and the
+ * ring offset of a position is pos % area_size. A record never wraps:
+ * one that does not fit before the end of the ring starts the next lap.
+ * Every header stores its position and the log_id of the superblock, so
+ * a header left over from an earlier lap or an earlier use of the file
+ * is never taken for a new record. The superblock stores the position
+ * of the oldest record not written back yet. It is updated after every
+ * write back.
+ *
+ * For every block with data in the log, the dirty index gives the
+ * position of its newest copy. Reads found in the index are served from
+ * the log, merged with the image data for a partial hit. A block's entry
+ * is only removed once its copy is on the image, and only if no newer
+ * write came in meanwhile.
+ *
+ * Cmds that change the image without going through the log must not be
+ * overtaken by older log data. rbd_wb_defer() delays them until the log
+ * has been written back up to where it was when they arrived, and
+ * rbd_wb_drain() writes everything back and then sends new writes to the
+ * image directly. The handler drains before it gives up the exclusive
+ * lock, and keeps the lock if it cannot.
+ *
+ * Completed writes that are only in the log are lost to every other
+ * gateway, so the image itself records that they exist: before the
+ * first write is logged, the image is marked with the owner of the log,
+ * its log_id and an epoch, and the mark is only removed once the log is
+ * empty again. Other gateways do not take the lock of a marked image,
+ * whether this one crashed, was fenced or is still running. Every new
+ * mark bumps the epoch, which is also stored in the superblock and in
+ * each record header, and the log is only replayed if the image is still
+ * marked with its epoch. Otherwise someone removed the mark, for example
+ * to give up on a dead gateway and let another one take the image over,
+ * and the log is discarded instead of being written back over the
+ * writes since.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "ccan/list/list.h"
+
+#include "libtcmu.h"
+#include "libtcmu_log.h"
+#include "libtcmu_common.h"
+#include "tcmu-runner.h"
+#include "rbd_wb.h"
+
+#define RBD_WB_SUPER_MAGIC	0x54574253	/* "TWBS" */
+#define RBD_WB_HDR_MAGIC	0x54574252	/* "TWBR" */
+#define RBD_WB_VERSION		2
+#define RBD_WB_SUPER_SIZE	4096
+#define RBD_WB_HDR_SIZE		512
+#define RBD_WB_IDENT_LEN	256
+
+/* Most writes the writer thread puts under one fdatasync */
+#define RBD_WB_WRITE_BATCH	64
+/* Most data and records the flusher writes back at a time */
+#define RBD_WB_FLUSH_BATCH	(8 * 1024 * 1024)
+#define RBD_WB_FLUSH_RECS	1024
+/* How long data stays in the log, unless it fills up or is drained */
+#define RBD_WB_FLUSH_DELAY_MS	100
+#define RBD_WB_FLUSH_RETRY_MS	1000
+/* Failed write backs in a row after which a drain gives up */
+#define RBD_WB_DRAIN_RETRIES	3
+/* How long the log stays empty before the image's mark is removed */
+#define RBD_WB_UNMARK_DELAY_MS	1000
+
+#define RBD_WB_EMPTY_SLOT	UINT64_MAX
+
+/* On disk, little endian */
+struct rbd_wb_super {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t crc;
+	uint32_t block_size;
+	uint64_t area_size;
+	uint64_t num_lbas;
+	uint64_t log_id;
+	uint64_t tail;
+	uint64_t epoch;
+	char ident[RBD_WB_IDENT_LEN];
+} __attribute__((packed));
+
+struct rbd_wb_hdr {
+	uint32_t magic;
+	uint32_t hdr_crc;
+	uint32_t data_crc;
+	uint32_t nr_blocks;
+	uint64_t log_id;
+	uint64_t pos;
+	uint64_t lba;
+	uint64_t epoch;
+} __attribute__((packed));
+
+/* A record in the log, in log order on rbd_wb->recs */
+struct rbd_wb_rec {
+	struct list_node entry;
+	/* log space used, including any skip to the next lap before pos */
+	uint64_t start;
+	uint64_t end;
+	uint64_t pos;
+	uint64_t lba;
+	uint32_t nr_blocks;
+	/* on the log and in the index, set by the writer thread */
+	bool durable;
+	uint64_t durable_ms;
+};
+
+/* A write waiting for the writer thread */
+struct rbd_wb_io {
+	struct list_node entry;
+	struct tcmur_cmd *tcmur_cmd;
+	struct iovec *iov;
+	size_t iov_cnt;
+	size_t length;
+	off_t offset;
+	/* NULL if the write is too large for the log */
+	struct rbd_wb_rec *rec;
+};
+
+struct rbd_wb_slot {
+	uint64_t lba;
+	uint64_t data_pos;
+};
+
+/* A block the flusher writes back */
+struct rbd_wb_item {
+	uint64_t lba;
+	uint64_t data_pos;
+};
+
+struct rbd_wb_run {
+	size_t offset;
+	size_t length;
+};
+
+struct rbd_wb_overlay {
+	unsigned int nr_runs;
+	char *buf;
+	struct rbd_wb_run runs[];
+};
+
+struct rbd_wb {
+	struct tcmu_device *dev;
+	const struct rbd_wb_ops *ops;
+	char *path;
+	int fd;
+	char ident[RBD_WB_IDENT_LEN];
+	uint32_t block_size;
+	uint64_t num_lbas;
+	uint64_t area_size;
+	uint64_t log_id;
+
+	/*
+	 * mark_lock serializes marking the image and removing the mark,
+	 * super_lock superblock updates. Both are taken before lock.
+	 */
+	pthread_mutex_t mark_lock;
+	pthread_mutex_t super_lock;
+
+	/*
+	 * lock protects everything down to the threads. Positions are
+	 * only advanced by the writer (head) and the flusher (tail).
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t writer_cond;
+	pthread_cond_t flusher_cond;
+	pthread_cond_t drain_cond;
+	struct list_head pending;
+	struct list_head recs;
+	struct list_head waiters;
+	uint64_t head;
+	uint64_t tail;
+	/* new writes go straight to the image once the log is empty */
+	bool bypass;
+	/* the writer waits for the log to be written back */
+	bool space_wait;
+	unsigned int drainers;
+	unsigned int flush_failures;
+	/*
+	 * epoch of the current mark. marked is set while the image may
+	 * carry a mark of this log, mark_ok once it is known to carry the
+	 * current one. Writes are only logged while mark_ok is set, and
+	 * recs is empty while it is not.
+	 */
+	uint64_t epoch;
+	bool marked;
+	bool mark_ok;
+	uint64_t mark_retry_ms;
+	/* when the log last became empty */
+	uint64_t clean_ms;
+	bool stop;
+	pthread_t writer;
+	pthread_t flusher;
+	char *hdr_buf;
+
+	/* Dirty index, a linear probing hash of block to data position */
+	pthread_rwlock_t index_lock;
+	struct rbd_wb_slot *slots;
+	uint64_t slot_mask;
+	uint64_t nr_dirty;
+
+	uint64_t logged_writes;
+	uint64_t direct_writes;
+	uint64_t read_hits;
+	uint64_t written_back;
+};
+
+static uint32_t wb_iov_crc32c(struct iovec *iov, size_t iov_cnt, size_t len)
+{
+	uint32_t crc = ~0U;
+	size_t n;
+
+	for (; len && iov_cnt; iov++, iov_cnt--) {
+		n = iov->iov_len < len ? iov->iov_len : len;
+		crc = tcmu_crc32c(crc, iov->iov_base, n);
+		len -= n;
+	}
+	return ~crc;
+}
+
+/* Copy len bytes from buf into the iovec at offset, without consuming it */
+static void wb_iov_copy_in(struct iovec *iov, size_t iov_cnt, size_t offset,
+			   const char *buf, size_t len)
+{
+	size_t n;
+
+	for (; iov_cnt && offset >= iov->iov_len; iov++, iov_cnt--)
+		offset -= iov->iov_len;
+
+	for (; len && iov_cnt; iov++, iov_cnt--) {
+		n = iov->iov_len - offset;
+		if (n > len)
+			n = len;
+		memcpy((char *)iov->iov_base + offset, buf, n);
+		buf += n;
+		len -= n;
+		offset = 0;
+	}
+}
+
+static uint64_t wb_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void wb_timedwait_ms(pthread_cond_t *cond, pthread_mutex_t *lock,
+			    uint64_t ms)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(cond, lock, &ts);
+}
+
+static off_t wb_phys(struct rbd_wb *wb, uint64_t pos)
+{
+	return RBD_WB_SUPER_SIZE + pos % wb->area_size;
+}
+
+static int wb_pread_full(int fd, char *buf, size_t len, off_t off)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(fd, buf, len, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!ret)
+			return -EIO;
+		buf += ret;
+		len -= ret;
+		off += ret;
+	}
+	return 0;
+}
+
+/* Writes all of iov, which is consumed */
+static int wb_pwritev_full(int fd, struct iovec *iov, int iov_cnt, off_t off)
+{
+	ssize_t ret;
+
+	while (iov_cnt) {
+		ret = pwritev(fd, iov, iov_cnt < IOV_MAX ? iov_cnt : IOV_MAX,
+			      off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		off += ret;
+		while (iov_cnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iov_cnt--;
+		}
+		if (iov_cnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Dirty index
+ */
+static uint64_t wb_hash(struct rbd_wb *wb, uint64_t lba)
+{
+	uint64_t h = lba * 0x9e3779b97f4a7c15ULL;
+
+	return (h ^ (h >> 29)) & wb->slot_mask;
+}
+
+static struct rbd_wb_slot *wb_index_lookup(struct rbd_wb *wb, uint64_t lba)
+{
+	uint64_t i = wb_hash(wb, lba);
+
+	while (wb->slots[i].lba != RBD_WB_EMPTY_SLOT) {
+		if (wb->slots[i].lba == lba)
+			return &wb->slots[i];
+		i = (i + 1) & wb->slot_mask;
+	}
+	return NULL;
+}
+
+/* Must be called with index_lock held for writing */
+static void wb_index_set(struct rbd_wb *wb, uint64_t lba, uint64_t data_pos)
+{
+	uint64_t i = wb_hash(wb, lba);
+
+	while (wb->slots[i].lba != RBD_WB_EMPTY_SLOT) {
+		if (wb->slots[i].lba == lba) {
+			wb->slots[i].data_pos = data_pos;
+			return;
+		}
+		i = (i + 1) & wb->slot_mask;
+	}
+	wb->slots[i].lba = lba;
+	wb->slots[i].data_pos = data_pos;
+	__atomic_add_fetch(&wb->nr_dirty, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Must be called with index_lock held for writing. Entries after the
+ * removed one are shifted back, so lookups never need tombstones.
+ */
+static void wb_index_remove(struct rbd_wb *wb, struct rbd_wb_slot *slot)
+{
+	uint64_t i = slot - wb->slots, j = i, k;
+
+	while (1) {
+		j = (j + 1) & wb->slot_mask;
+		if (wb->slots[j].lba == RBD_WB_EMPTY_SLOT)
+			break;
+		k = wb_hash(wb, wb->slots[j].lba);
+		if ((j > i && (k <= i || k > j)) ||
+		    (j < i && k <= i && k > j)) {
+			wb->slots[i] = wb->slots[j];
+			i = j;
+		}
+	}
+	wb->slots[i].lba = RBD_WB_EMPTY_SLOT;
+	__atomic_sub_fetch(&wb->nr_dirty, 1, __ATOMIC_RELEASE);
+}
+
+static void wb_index_add_rec(struct rbd_wb *wb, struct rbd_wb_rec *rec)
+{
+	uint64_t data_pos = rec->pos + RBD_WB_HDR_SIZE;
+	uint32_t i;
+
+	for (i = 0; i < rec->nr_blocks; i++)
+		wb_index_set(wb, rec->lba + i, data_pos + i * wb->block_size);
+}
+
+/*
+ * Superblock and record headers
+ */
+static int wb_write_super(struct rbd_wb *wb, uint64_t tail, uint64_t epoch)
+{
+	char buf[RBD_WB_SUPER_SIZE] = { 0 };
+	struct rbd_wb_super *super = (struct rbd_wb_super *)buf;
+	ssize_t ret;
+
+	super->magic = htole32(RBD_WB_SUPER_MAGIC);
+	super->version = htole32(RBD_WB_VERSION);
+	super->block_size = htole32(wb->block_size);
+	super->area_size = htole64(wb->area_size);
+	super->num_lbas = htole64(wb->num_lbas);
+	super->log_id = htole64(wb->log_id);
+	super->tail = htole64(tail);
+	super->epoch = htole64(epoch);
+	memcpy(super->ident, wb->ident, RBD_WB_IDENT_LEN);
+	super->crc = htole32(~tcmu_crc32c(~0U, buf, sizeof(*super)));
+
+	ret = pwrite(wb->fd, buf, sizeof(buf), 0);
+	if (ret != sizeof(buf) || fdatasync(wb->fd)) {
+		ret = ret < 0 || ret == sizeof(buf) ? -errno : -EIO;
+		tcmu_dev_err(wb->dev, "Could not write write-back log superblock to %s. Err %zd.\n",
+			     wb->path, ret);
+		return ret;
+	}
+	return 0;
+}
+
+static bool wb_read_super(struct rbd_wb *wb, struct rbd_wb_super *super)
+{
+	uint32_t crc;
+
+	if (wb_pread_full(wb->fd, (char *)super, sizeof(*super), 0))
+		return false;
+
+	crc = le32toh(super->crc);
+	super->crc = 0;
+	if (le32toh(super->magic) != RBD_WB_SUPER_MAGIC ||
+	    le32toh(super->version) != RBD_WB_VERSION ||
+	    crc != ~tcmu_crc32c(~0U, super, sizeof(*super)))
+		return false;
+
+	super->block_size = le32toh(super->block_size);
+	super->area_size = le64toh(super->area_size);
+	super->num_lbas = le64toh(super->num_lbas);
+	super->log_id = le64toh(super->log_id);
+	super->tail = le64toh(super->tail);
+	super->epoch = le64toh(super->epoch);
+	super->ident[RBD_WB_IDENT_LEN - 1] = '\0';
+	return true;
+}
+
+/*
+ * Store the current tail and epoch. Done from more than one thread, and
+ * an older update must not overwrite a newer one.
+ */
+static int wb_update_super(struct rbd_wb *wb)
+{
+	uint64_t tail, epoch;
+	int ret;
+
+	pthread_mutex_lock(&wb->super_lock);
+	pthread_mutex_lock(&wb->lock);
+	tail = wb->tail;
+	epoch = wb->epoch;
+	pthread_mutex_unlock(&wb->lock);
+
+	ret = wb_write_super(wb, tail, epoch);
+	pthread_mutex_unlock(&wb->super_lock);
+	return ret;
+}
+
+static void wb_fill_hdr(struct rbd_wb *wb, struct rbd_wb_hdr *hdr,
+			struct rbd_wb_io *io)
+{
+	memset(hdr, 0, RBD_WB_HDR_SIZE);
+	hdr->magic = htole32(RBD_WB_HDR_MAGIC);
+	hdr->nr_blocks = htole32(io->rec->nr_blocks);
+	hdr->log_id = htole64(wb->log_id);
+	hdr->pos = htole64(io->rec->pos);
+	hdr->lba = htole64(io->rec->lba);
+	hdr->epoch = htole64(wb->epoch);
+	hdr->data_crc = htole32(wb_iov_crc32c(io->iov, io->iov_cnt,
+					      io->length));
+	hdr->hdr_crc = htole32(~tcmu_crc32c(~0U, hdr, sizeof(*hdr)));
+}
+
+/*
+ * Read and check the header at pos, with the geometry of the log in wb.
+ * Returns the record's data length, or 0 if there is no record there.
+ */
+static uint64_t wb_read_hdr(struct rbd_wb *wb, uint64_t pos,
+			    struct rbd_wb_hdr *hdr)
+{
+	uint64_t len;
+	uint32_t crc;
+
+	if (wb_pread_full(wb->fd, (char *)hdr, sizeof(*hdr),
+			  wb_phys(wb, pos)))
+		return 0;
+
+	crc = le32toh(hdr->hdr_crc);
+	hdr->hdr_crc = 0;
+	if (le32toh(hdr->magic) != RBD_WB_HDR_MAGIC ||
+	    crc != ~tcmu_crc32c(~0U, hdr, sizeof(*hdr)) ||
+	    le64toh(hdr->log_id) != wb->log_id ||
+	    le64toh(hdr->epoch) != wb->epoch ||
+	    le64toh(hdr->pos) != pos)
+		return 0;
+
+	hdr->data_crc = le32toh(hdr->data_crc);
+	hdr->nr_blocks = le32toh(hdr->nr_blocks);
+	hdr->lba = le64toh(hdr->lba);
+
+	len = (uint64_t)hdr->nr_blocks * wb->block_size;
+	if (!len || hdr->lba + hdr->nr_blocks > wb->num_lbas ||
+	    pos % wb->area_size + RBD_WB_HDR_SIZE + len > wb->area_size)
+		return 0;
+	return len;
+}
+
+/* Find the record at pos, or at the start of the next lap */
+static uint64_t wb_find_hdr(struct rbd_wb *wb, uint64_t *pos,
+			    struct rbd_wb_hdr *hdr)
+{
+	uint64_t len, lap_pos;
+
+	len = wb_read_hdr(wb, *pos, hdr);
+	if (len || !(*pos % wb->area_size))
+		return len;
+
+	lap_pos = *pos - *pos % wb->area_size + wb->area_size;
+	len = wb_read_hdr(wb, lap_pos, hdr);
+	if (len)
+		*pos = lap_pos;
+	return len;
+}
+
+/*
+ * Rebuild the records and the index from the log, starting at the tail
+ * stored in the superblock. The log ends at the first record that is
+ * missing, torn or fails its CRC. Records after it were never completed.
+ */
+static int wb_recover(struct rbd_wb *wb, uint64_t tail)
+{
+	struct rbd_wb_hdr hdr;
+	struct rbd_wb_rec *rec;
+	uint64_t start = tail, pos = tail, len, bytes = 0;
+	unsigned int nr_recs = 0;
+	char *data;
+	int ret;
+
+	wb->head = wb->tail = tail;
+
+	while (1) {
+		len = wb_find_hdr(wb, &pos, &hdr);
+		if (!len || pos + RBD_WB_HDR_SIZE + len - tail > wb->area_size)
+			break;
+
+		data = malloc(len);
+		if (!data)
+			return -ENOMEM;
+		ret = wb_pread_full(wb->fd, data, len,
+				    wb_phys(wb, pos) + RBD_WB_HDR_SIZE);
+		if (ret || ~tcmu_crc32c(~0U, data, len) != hdr.data_crc) {
+			free(data);
+			break;
+		}
+		free(data);
+
+		rec = calloc(1, sizeof(*rec));
+		if (!rec)
+			return -ENOMEM;
+		rec->start = start;
+		rec->pos = pos;
+		rec->end = pos + RBD_WB_HDR_SIZE + len;
+		rec->lba = hdr.lba;
+		rec->nr_blocks = hdr.nr_blocks;
+		rec->durable = true;
+		rec->durable_ms = wb_now_ms();
+		list_add_tail(&wb->recs, &rec->entry);
+		wb_index_add_rec(wb, rec);
+
+		nr_recs++;
+		bytes += len;
+		start = pos = rec->end;
+	}
+	wb->head = start;
+
+	if (nr_recs)
+		tcmu_dev_warn(wb->dev, "Recovered %u writes, %"PRIu64" KiB, from write-back log %s. They will be written back to the image.\n",
+			      nr_recs, bytes / 1024, wb->path);
+	return 0;
+}
+
+/*
+ * Image mark
+ */
+static void wb_fmt_owner(struct rbd_wb *wb, uint64_t epoch, char *owner)
+{
+	char host[64];
+
+	if (gethostname(host, sizeof(host)))
+		snprintf(host, sizeof(host), "unknown");
+	host[sizeof(host) - 1] = '\0';
+
+	snprintf(owner, RBD_WB_OWNER_LEN, "%016"PRIx64":%"PRIu64":%s",
+		 wb->log_id, epoch, host);
+}
+
+static bool wb_parse_owner(const char *owner, uint64_t *log_id,
+			   uint64_t *epoch)
+{
+	return sscanf(owner, "%"SCNx64":%"SCNu64":", log_id, epoch) == 2;
+}
+
+/*
+ * Look up the image's mark. Returns 0 and sets *ours if it is of this
+ * log, and *current if also of its current epoch, or -errno.
+ */
+static int wb_get_image_owner(struct rbd_wb *wb, bool *ours, bool *current)
+{
+	char owner[RBD_WB_OWNER_LEN];
+	uint64_t log_id, epoch;
+	int ret;
+
+	*ours = *current = false;
+
+	ret = wb->ops->get_owner(wb->dev, owner, sizeof(owner));
+	if (ret == -ENOENT)
+		return 0;
+	if (ret < 0) {
+		tcmu_dev_err(wb->dev, "Could not get the write-back log owner of the image. Err %d.\n",
+			     ret);
+		return ret;
+	}
+
+	if (wb_parse_owner(owner, &log_id, &epoch) && log_id == wb->log_id) {
+		*ours = true;
+		*current = epoch == wb->epoch;
+	}
+	return 0;
+}
+
+/*
+ * Mark the image with a new epoch of the log, from the writer thread
+ * before it logs writes. recs is empty, so the superblock can move to
+ * the new epoch before the image does. On failure writes go to the
+ * image directly for a while, then it is retried.
+ */
+static void wb_set_owner(struct rbd_wb *wb)
+{
+	char owner[RBD_WB_OWNER_LEN];
+	uint64_t epoch;
+	int ret;
+
+	pthread_mutex_lock(&wb->mark_lock);
+	pthread_mutex_lock(&wb->lock);
+	if (wb->mark_ok || wb->bypass) {
+		pthread_mutex_unlock(&wb->lock);
+		pthread_mutex_unlock(&wb->mark_lock);
+		return;
+	}
+	epoch = ++wb->epoch;
+	pthread_mutex_unlock(&wb->lock);
+
+	wb_fmt_owner(wb, epoch, owner);
+	ret = wb_update_super(wb);
+	if (!ret) {
+		/* Even a failed set may have stored it */
+		pthread_mutex_lock(&wb->lock);
+		wb->marked = true;
+		pthread_mutex_unlock(&wb->lock);
+
+		ret = wb->ops->set_owner(wb->dev, owner);
+	}
+
+	pthread_mutex_lock(&wb->lock);
+	if (!ret) {
+		wb->mark_ok = true;
+	} else {
+		tcmu_dev_err(wb->dev, "Could not mark the image as having data in write-back log %s. Err %d. Writing to the image directly.\n",
+			     wb->path, ret);
+		wb->mark_retry_ms = wb_now_ms() + RBD_WB_FLUSH_RETRY_MS;
+	}
+	pthread_mutex_unlock(&wb->lock);
+	pthread_mutex_unlock(&wb->mark_lock);
+}
+
+/*
+ * Remove the image's mark if the log is empty. The writer marks the
+ * image again before it logs anything else.
+ */
+static int wb_clear_owner(struct rbd_wb *wb)
+{
+	int ret;
+
+	pthread_mutex_lock(&wb->mark_lock);
+	pthread_mutex_lock(&wb->lock);
+	if (!wb->marked || !list_empty(&wb->recs)) {
+		pthread_mutex_unlock(&wb->lock);
+		pthread_mutex_unlock(&wb->mark_lock);
+		return 0;
+	}
+	wb->mark_ok = false;
+	pthread_mutex_unlock(&wb->lock);
+
+	ret = wb->ops->set_owner(wb->dev, NULL);
+
+	pthread_mutex_lock(&wb->lock);
+	if (!ret) {
+		wb->marked = false;
+	} else {
+		tcmu_dev_err(wb->dev, "Could not remove the write-back log mark of the image. Err %d. Other gateways cannot take it over until it is removed.\n",
+			     ret);
+		wb->clean_ms = wb_now_ms();
+	}
+	pthread_mutex_unlock(&wb->lock);
+	pthread_mutex_unlock(&wb->mark_lock);
+	return ret;
+}
+
+/*
+ * Writer thread
+ */
+
+/* Must be called with lock held */
+static bool wb_reserve(struct rbd_wb *wb, struct rbd_wb_rec *rec,
+		       uint64_t len)
+{
+	uint64_t need = RBD_WB_HDR_SIZE + len;
+	uint64_t pos = wb->head, lap_left;
+
+	lap_left = wb->area_size - pos % wb->area_size;
+	if (need > lap_left)
+		pos += lap_left;
+	if (pos + need - wb->tail > wb->area_size)
+		return false;
+
+	rec->start = wb->head;
+	rec->pos = pos;
+	rec->end = pos + need;
+	wb->head = rec->end;
+	return true;
+}
+
+static int wb_log_write(struct rbd_wb *wb, struct rbd_wb_io **ios, int nr)
+{
+	struct iovec *iov;
+	size_t cnt = 0, run = 0;
+	off_t run_off = 0;
+	int i, ret = 0;
+
+	for (i = 0; i < nr; i++)
+		cnt += 1 + ios[i]->iov_cnt;
+	iov = malloc(cnt * sizeof(*iov));
+	if (!iov)
+		return -ENOMEM;
+
+	/* Records that follow each other in the ring go in one pwritev */
+	cnt = 0;
+	for (i = 0; i < nr; i++) {
+		struct rbd_wb_hdr *hdr = (struct rbd_wb_hdr *)
+				(wb->hdr_buf + i * RBD_WB_HDR_SIZE);
+
+		if (i && ios[i]->rec->pos != ios[i - 1]->rec->end) {
+			ret = wb_pwritev_full(wb->fd, iov + run, cnt - run,
+					      run_off);
+			if (ret)
+				goto free_iov;
+			run = cnt;
+		}
+		if (run == cnt)
+			run_off = wb_phys(wb, ios[i]->rec->pos);
+
+		wb_fill_hdr(wb, hdr, ios[i]);
+		iov[cnt].iov_base = hdr;
+		iov[cnt].iov_len = RBD_WB_HDR_SIZE;
+		memcpy(&iov[cnt + 1], ios[i]->iov,
+		       ios[i]->iov_cnt * sizeof(*iov));
+		cnt += 1 + ios[i]->iov_cnt;
+	}
+
+	ret = wb_pwritev_full(wb->fd, iov + run, cnt - run, run_off);
+	if (!ret && fdatasync(wb->fd))
+		ret = -errno;
+
+free_iov:
+	free(iov);
+	return ret;
+}
+
+static void wb_write_direct(struct rbd_wb *wb, struct rbd_wb_io *io)
+{
+	int ret;
+
+	ret = wb->ops->write_direct(wb->dev, io->tcmur_cmd, io->iov,
+				    io->iov_cnt, io->length, io->offset);
+	if (ret != TCMU_STS_OK)
+		tcmur_cmd_complete(wb->dev, io->tcmur_cmd, ret);
+	free(io);
+}
+
+static void *wb_writer(void *arg)
+{
+	struct rbd_wb *wb = arg;
+	struct rbd_wb_io *ios[RBD_WB_WRITE_BATCH], *io;
+	struct rbd_wb_waiter *waiter;
+	uint64_t now;
+	int i, nr, ret;
+
+	tcmu_set_thread_name("wblog", wb->dev);
+
+	pthread_mutex_lock(&wb->lock);
+	while (!wb->stop) {
+		io = list_top(&wb->pending, struct rbd_wb_io, entry);
+		if (!io) {
+			pthread_cond_wait(&wb->writer_cond, &wb->lock);
+			continue;
+		}
+
+		if (!wb->bypass && io->rec && !wb->mark_ok &&
+		    wb_now_ms() >= wb->mark_retry_ms) {
+			pthread_mutex_unlock(&wb->lock);
+			wb_set_owner(wb);
+			pthread_mutex_lock(&wb->lock);
+			continue;
+		}
+
+		/*
+		 * Writes that bypass the log wait until nothing older in the
+		 * log can overwrite them on the image, and hold back the
+		 * writes behind them. Without the image's mark nothing is
+		 * logged, and the log is empty.
+		 */
+		if (wb->bypass || !io->rec || !wb->mark_ok) {
+			if (!list_empty(&wb->recs)) {
+				if (wb->bypass &&
+				    wb->flush_failures >= RBD_WB_DRAIN_RETRIES) {
+					list_del(&io->entry);
+					pthread_mutex_unlock(&wb->lock);
+					tcmur_cmd_complete(wb->dev, io->tcmur_cmd,
+							   TCMU_STS_BUSY);
+					free(io);
+					pthread_mutex_lock(&wb->lock);
+					continue;
+				}
+				wb->space_wait = true;
+				pthread_cond_signal(&wb->flusher_cond);
+				pthread_cond_wait(&wb->writer_cond, &wb->lock);
+				continue;
+			}
+
+			list_del(&io->entry);
+			wb->direct_writes++;
+			pthread_mutex_unlock(&wb->lock);
+			free(io->rec);
+			io->rec = NULL;
+			wb_write_direct(wb, io);
+			pthread_mutex_lock(&wb->lock);
+			continue;
+		}
+
+		nr = 0;
+		while (nr < RBD_WB_WRITE_BATCH &&
+		       (io = list_top(&wb->pending, struct rbd_wb_io, entry))) {
+			if (!io->rec || !wb_reserve(wb, io->rec, io->length))
+				break;
+			list_del(&io->entry);
+			list_add_tail(&wb->recs, &io->rec->entry);
+			ios[nr++] = io;
+		}
+		if (!nr) {
+			/* The log is full */
+			wb->space_wait = true;
+			pthread_cond_signal(&wb->flusher_cond);
+			pthread_cond_wait(&wb->writer_cond, &wb->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&wb->lock);
+
+		ret = wb_log_write(wb, ios, nr);
+		if (ret) {
+			tcmu_dev_err(wb->dev, "Could not write to write-back log %s. Err %d.\n",
+				     wb->path, ret);
+		} else {
+			pthread_rwlock_wrlock(&wb->index_lock);
+			for (i = 0; i < nr; i++)
+				wb_index_add_rec(wb, ios[i]->rec);
+			pthread_rwlock_unlock(&wb->index_lock);
+		}
+
+		pthread_mutex_lock(&wb->lock);
+		if (ret) {
+			/* Nothing was reserved after the batch, give it back */
+			for (i = 0; i < nr; i++) {
+				list_del(&ios[i]->rec->entry);
+				free(ios[i]->rec);
+			}
+			wb->head = ios[0]->rec->start;
+			list_for_each(&wb->waiters, waiter, entry) {
+				if (waiter->target > wb->head)
+					waiter->target = wb->head;
+			}
+		} else {
+			now = wb_now_ms();
+			for (i = 0; i < nr; i++) {
+				ios[i]->rec->durable = true;
+				ios[i]->rec->durable_ms = now;
+			}
+			wb->logged_writes += nr;
+		}
+		pthread_cond_signal(&wb->flusher_cond);
+		pthread_mutex_unlock(&wb->lock);
+
+		for (i = 0; i < nr; i++) {
+			tcmur_cmd_complete(wb->dev, ios[i]->tcmur_cmd,
+					   ret ? TCMU_STS_WR_ERR : TCMU_STS_OK);
+			free(ios[i]);
+		}
+
+		pthread_mutex_lock(&wb->lock);
+	}
+	pthread_mutex_unlock(&wb->lock);
+
+	return NULL;
+}
+
+/*
+ * Flusher thread
+ */
+static int wb_item_cmp(const void *p1, const void *p2)
+{
+	const struct rbd_wb_item *i1 = p1, *i2 = p2;
+
+	if (i1->lba < i2->lba)
+		return -1;
+	return i1->lba > i2->lba;
+}
+
+/*
+ * Write back the blocks of recs that still have their newest copy there.
+ * Older copies of blocks that were rewritten are skipped, the newer
+ * record is later in the log and is written back after this one.
+ */
+static int wb_flush_recs(struct rbd_wb *wb, struct rbd_wb_rec **recs, int nr)
+{
+	uint32_t bs = wb->block_size;
+	struct rbd_wb_extent *ext = NULL;
+	struct rbd_wb_item *items;
+	struct rbd_wb_slot *slot;
+	uint64_t nr_blocks = 0, nr_items = 0, data_pos, i, j;
+	int nr_ext = 0, r, ret = 0;
+	char *buf = NULL;
+
+	for (r = 0; r < nr; r++)
+		nr_blocks += recs[r]->nr_blocks;
+	items = malloc(nr_blocks * sizeof(*items));
+	if (!items)
+		return -ENOMEM;
+
+	pthread_rwlock_rdlock(&wb->index_lock);
+	for (r = 0; r < nr; r++) {
+		data_pos = recs[r]->pos + RBD_WB_HDR_SIZE;
+		for (i = 0; i < recs[r]->nr_blocks; i++, data_pos += bs) {
+			slot = wb_index_lookup(wb, recs[r]->lba + i);
+			if (!slot || slot->data_pos != data_pos)
+				continue;
+			items[nr_items].lba = recs[r]->lba + i;
+			items[nr_items].data_pos = data_pos;
+			nr_items++;
+		}
+	}
+	pthread_rwlock_unlock(&wb->index_lock);
+
+	if (!nr_items)
+		goto free_items;
+
+	qsort(items, nr_items, sizeof(*items), wb_item_cmp);
+
+	buf = malloc(nr_items * bs);
+	ext = malloc(nr_items * sizeof(*ext));
+	if (!buf || !ext) {
+		ret = -ENOMEM;
+		goto free_bufs;
+	}
+
+	/* One pread per run that is contiguous in the log and the image */
+	for (i = 0; i < nr_items; i = j) {
+		for (j = i + 1; j < nr_items; j++) {
+			if (items[j].lba != items[j - 1].lba + 1 ||
+			    items[j].data_pos != items[j - 1].data_pos + bs)
+				break;
+		}
+		ret = wb_pread_full(wb->fd, buf + i * bs, (j - i) * bs,
+				    wb_phys(wb, items[i].data_pos));
+		if (ret) {
+			tcmu_dev_err(wb->dev, "Could not read write-back log %s. Err %d.\n",
+				     wb->path, ret);
+			goto free_bufs;
+		}
+	}
+
+	/* buf follows the LBA order, so image runs are contiguous in it */
+	for (i = 0; i < nr_items; i = j) {
+		for (j = i + 1; j < nr_items; j++) {
+			if (items[j].lba != items[j - 1].lba + 1)
+				break;
+		}
+		ext[nr_ext].offset = items[i].lba * bs;
+		ext[nr_ext].length = (j - i) * bs;
+		ext[nr_ext].buf = buf + i * bs;
+		nr_ext++;
+	}
+
+	ret = wb->ops->write_sync(wb->dev, ext, nr_ext);
+	if (ret)
+		goto free_bufs;
+
+	pthread_rwlock_wrlock(&wb->index_lock);
+	for (i = 0; i < nr_items; i++) {
+		slot = wb_index_lookup(wb, items[i].lba);
+		if (slot && slot->data_pos == items[i].data_pos)
+			wb_index_remove(wb, slot);
+	}
+	pthread_rwlock_unlock(&wb->index_lock);
+
+	__atomic_add_fetch(&wb->written_back, nr_items * bs, __ATOMIC_RELAXED);
+
+free_bufs:
+	free(ext);
+	free(buf);
+free_items:
+	free(items);
+	return ret;
+}
+
+/* Must be called with lock held, which is dropped around the callouts */
+static void wb_run_waiters(struct rbd_wb *wb)
+{
+	struct rbd_wb_waiter *waiter;
+
+	while ((waiter = list_top(&wb->waiters, struct rbd_wb_waiter, entry))) {
+		if (waiter->target > wb->tail)
+			break;
+		list_del(&waiter->entry);
+
+		pthread_mutex_unlock(&wb->lock);
+		waiter->fn(waiter);
+		pthread_mutex_lock(&wb->lock);
+	}
+}
+
+static void *wb_flusher(void *arg)
+{
+	struct rbd_wb *wb = arg;
+	struct rbd_wb_rec *recs[RBD_WB_FLUSH_RECS], *rec;
+	uint64_t blocks, now;
+	bool urgent;
+	int nr, i, ret;
+
+	tcmu_set_thread_name("wbflush", wb->dev);
+
+	pthread_mutex_lock(&wb->lock);
+	while (!wb->stop) {
+		wb_run_waiters(wb);
+
+		rec = list_top(&wb->recs, struct rbd_wb_rec, entry);
+		if (!rec)
+			pthread_cond_broadcast(&wb->drain_cond);
+
+		/* Let other gateways take over once the log stays empty */
+		if (!rec && wb->marked) {
+			now = wb_now_ms();
+			if (now < wb->clean_ms + RBD_WB_UNMARK_DELAY_MS) {
+				wb_timedwait_ms(&wb->flusher_cond, &wb->lock,
+						wb->clean_ms +
+						RBD_WB_UNMARK_DELAY_MS - now);
+				continue;
+			}
+			pthread_mutex_unlock(&wb->lock);
+			wb_clear_owner(wb);
+			pthread_mutex_lock(&wb->lock);
+			continue;
+		}
+
+		if (!rec || !rec->durable) {
+			pthread_cond_wait(&wb->flusher_cond, &wb->lock);
+			continue;
+		}
+
+		urgent = wb->drainers || wb->space_wait ||
+			 !list_empty(&wb->waiters) ||
+			 wb->head - wb->tail >= wb->area_size / 4;
+		now = wb_now_ms();
+		if (!urgent && now < rec->durable_ms + RBD_WB_FLUSH_DELAY_MS) {
+			wb_timedwait_ms(&wb->flusher_cond, &wb->lock,
+					rec->durable_ms + RBD_WB_FLUSH_DELAY_MS - now);
+			continue;
+		}
+
+		nr = 0;
+		blocks = 0;
+		list_for_each(&wb->recs, rec, entry) {
+			if (!rec->durable || nr == RBD_WB_FLUSH_RECS ||
+			    (nr && (blocks + rec->nr_blocks) * wb->block_size >
+				   RBD_WB_FLUSH_BATCH))
+				break;
+			recs[nr++] = rec;
+			blocks += rec->nr_blocks;
+		}
+		pthread_mutex_unlock(&wb->lock);
+
+		ret = wb_flush_recs(wb, recs, nr);
+
+		pthread_mutex_lock(&wb->lock);
+		if (ret) {
+			if (!wb->flush_failures++)
+				tcmu_dev_err(wb->dev, "Could not write back the write-back log. Err %d. Retrying.\n",
+					     ret);
+			pthread_cond_broadcast(&wb->drain_cond);
+			pthread_cond_broadcast(&wb->writer_cond);
+			wb_timedwait_ms(&wb->flusher_cond, &wb->lock,
+					RBD_WB_FLUSH_RETRY_MS);
+			continue;
+		}
+		if (wb->flush_failures) {
+			tcmu_dev_info(wb->dev, "Write back of the write-back log resumed.\n");
+			wb->flush_failures = 0;
+		}
+
+		/* The batch is the oldest records, recs only grows at its end */
+		for (i = 0; i < nr; i++) {
+			list_del(&recs[i]->entry);
+			free(recs[i]);
+		}
+		rec = list_top(&wb->recs, struct rbd_wb_rec, entry);
+		wb->tail = rec ? rec->start : wb->head;
+		if (!rec)
+			wb->clean_ms = wb_now_ms();
+		wb->space_wait = false;
+		pthread_cond_broadcast(&wb->writer_cond);
+		pthread_mutex_unlock(&wb->lock);
+
+		/*
+		 * Must be stable before waiters write behind the log, or
+		 * recovery could replay older data over theirs.
+		 */
+		wb_update_super(wb);
+
+		pthread_mutex_lock(&wb->lock);
+	}
+	pthread_mutex_unlock(&wb->lock);
+
+	return NULL;
+}
+
+/*
+ * Handler entry points
+ */
+
+/*
+ * Queue a write to the log. Returns TCMU_STS_OK if the cmd will be
+ * completed with tcmur_cmd_complete, or TCMU_STS_NOT_HANDLED if the
+ * caller must send it to the image itself.
+ */
+int rbd_wb_write(struct rbd_wb *wb, struct tcmur_cmd *tcmur_cmd,
+		 struct iovec *iov, size_t iov_cnt, size_t length,
+		 off_t offset)
+{
+	struct rbd_wb_io *io;
+	bool kick;
+
+	io = calloc(1, sizeof(*io));
+	if (!io)
+		return TCMU_STS_NO_RESOURCE;
+	io->tcmur_cmd = tcmur_cmd;
+	io->iov = iov;
+	io->iov_cnt = iov_cnt;
+	io->length = length;
+	io->offset = offset;
+
+	if (RBD_WB_HDR_SIZE + length <= wb->area_size / 4) {
+		io->rec = calloc(1, sizeof(*io->rec));
+		if (!io->rec) {
+			free(io);
+			return TCMU_STS_NO_RESOURCE;
+		}
+		io->rec->lba = offset / wb->block_size;
+		io->rec->nr_blocks = length / wb->block_size;
+	}
+
+	pthread_mutex_lock(&wb->lock);
+	if ((wb->bypass || !io->rec) && list_empty(&wb->pending) &&
+	    list_empty(&wb->recs)) {
+		wb->direct_writes++;
+		pthread_mutex_unlock(&wb->lock);
+		free(io->rec);
+		free(io);
+		return TCMU_STS_NOT_HANDLED;
+	}
+
+	kick = list_empty(&wb->pending);
+	list_add_tail(&wb->pending, &io->entry);
+	if (kick)
+		pthread_cond_signal(&wb->writer_cond);
+	pthread_mutex_unlock(&wb->lock);
+
+	return TCMU_STS_OK;
+}
+
+/*
+ * Copy the newest log data of the blocks of a read. If every block was
+ * found, the cmd is completed and TCMU_STS_OK returned. Otherwise the
+ * caller must read the image and, if *overlay was set, apply it to the
+ * data read with rbd_wb_overlay_apply() before completing the cmd.
+ *
+ * The data is copied before the image is read, because once the index
+ * lock is dropped the blocks may be written back and their space reused.
+ */
+int rbd_wb_read(struct rbd_wb *wb, struct tcmur_cmd *tcmur_cmd,
+		struct iovec *iov, size_t iov_cnt, size_t length,
+		off_t offset, struct rbd_wb_overlay **overlay)
+{
+	uint32_t bs = wb->block_size;
+	uint64_t lba = offset / bs, nr_blocks = length / bs, i;
+	uint64_t nr_hits = 0, nr_runs = 0, prev_pos = 0;
+	struct rbd_wb_overlay *ov;
+	struct rbd_wb_slot *slot;
+	struct rbd_wb_run *run = NULL;
+	size_t buf_off = 0;
+	int ret = 0;
+
+	*overlay = NULL;
+	if (!__atomic_load_n(&wb->nr_dirty, __ATOMIC_ACQUIRE))
+		return TCMU_STS_NOT_HANDLED;
+
+	pthread_rwlock_rdlock(&wb->index_lock);
+	for (i = 0; i < nr_blocks; i++) {
+		slot = wb_index_lookup(wb, lba + i);
+		if (!slot) {
+			prev_pos = 0;
+			continue;
+		}
+		if (!prev_pos || slot->data_pos != prev_pos + bs)
+			nr_runs++;
+		prev_pos = slot->data_pos;
+		nr_hits++;
+	}
+	if (!nr_hits) {
+		pthread_rwlock_unlock(&wb->index_lock);
+		return TCMU_STS_NOT_HANDLED;
+	}
+
+	ov = malloc(sizeof(*ov) + nr_runs * sizeof(*run) + nr_hits * bs);
+	if (!ov) {
+		pthread_rwlock_unlock(&wb->index_lock);
+		return TCMU_STS_NO_RESOURCE;
+	}
+	ov->nr_runs = 0;
+	ov->buf = (char *)&ov->runs[nr_runs];
+
+	/* Same runs as above, the index cannot change under the lock */
+	prev_pos = 0;
+	for (i = 0; i <= nr_blocks; i++) {
+		slot = i < nr_blocks ? wb_index_lookup(wb, lba + i) : NULL;
+		if (run && (!slot || slot->data_pos != prev_pos + bs)) {
+			ret = wb_pread_full(wb->fd, ov->buf + buf_off,
+					    run->length,
+					    wb_phys(wb, prev_pos + bs -
+						    run->length));
+			if (ret)
+				break;
+			buf_off += run->length;
+			run = NULL;
+		}
+		if (!slot)
+			continue;
+		if (!run) {
+			run = &ov->runs[ov->nr_runs++];
+			run->offset = i * bs;
+			run->length = 0;
+		}
+		run->length += bs;
+		prev_pos = slot->data_pos;
+	}
+	pthread_rwlock_unlock(&wb->index_lock);
+
+	if (ret) {
+		tcmu_dev_err(wb->dev, "Could not read write-back log %s. Err %d.\n",
+			     wb->path, ret);
+		free(ov);
+		return TCMU_STS_RD_ERR;
+	}
+
+	__atomic_add_fetch(&wb->read_hits, 1, __ATOMIC_RELAXED);
+	if (nr_hits < nr_blocks) {
+		*overlay = ov;
+		return TCMU_STS_NOT_HANDLED;
+	}
+
+	rbd_wb_overlay_apply(ov, iov, iov_cnt);
+	rbd_wb_overlay_free(ov);
+	tcmur_cmd_complete(wb->dev, tcmur_cmd, TCMU_STS_OK);
+	return TCMU_STS_OK;
+}
+
+void rbd_wb_overlay_apply(struct rbd_wb_overlay *overlay, struct iovec *iov,
+			  size_t iov_cnt)
+{
+	size_t buf_off = 0;
+	unsigned int i;
+
+	for (i = 0; i < overlay->nr_runs; i++) {
+		wb_iov_copy_in(iov, iov_cnt, overlay->runs[i].offset,
+			       overlay->buf + buf_off, overlay->runs[i].length);
+		buf_off += overlay->runs[i].length;
+	}
+}
+
+void rbd_wb_overlay_free(struct rbd_wb_overlay *overlay)
+{
+	free(overlay);
+}
+
+/*
+ * Returns true if a write to the byte range may still be in the log. It
+ * also counts writes being logged, and copies that were rewritten since.
+ */
+bool rbd_wb_range_dirty(struct rbd_wb *wb, uint64_t offset, uint64_t length)
+{
+	uint64_t lba = offset / wb->block_size;
+	uint64_t end = (offset + length + wb->block_size - 1) / wb->block_size;
+	struct rbd_wb_rec *rec;
+	bool dirty = false;
+
+	pthread_mutex_lock(&wb->lock);
+	list_for_each(&wb->recs, rec, entry) {
+		if (rec->lba < end && rec->lba + rec->nr_blocks > lba) {
+			dirty = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&wb->lock);
+
+	return dirty;
+}
+
+/*
+ * Call waiter->fn, from the flusher thread, once everything in the log
+ * now is on the image.
+ */
+void rbd_wb_defer(struct rbd_wb *wb, struct rbd_wb_waiter *waiter)
+{
+	pthread_mutex_lock(&wb->lock);
+	waiter->target = wb->head;
+	list_add_tail(&wb->waiters, &waiter->entry);
+	pthread_cond_signal(&wb->flusher_cond);
+	pthread_mutex_unlock(&wb->lock);
+}
+
+/*
+ * Write the whole log back, remove the image's mark and send new writes
+ * straight to the image, until rbd_wb_resume(). Returns -EIO if the log
+ * could not be written back, and writes are then failed with BUSY until
+ * it can, or the error removing the mark.
+ */
+int rbd_wb_drain(struct rbd_wb *wb)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&wb->lock);
+	wb->bypass = true;
+	wb->drainers++;
+	pthread_cond_signal(&wb->flusher_cond);
+	while (!list_empty(&wb->recs) &&
+	       wb->flush_failures < RBD_WB_DRAIN_RETRIES)
+		pthread_cond_wait(&wb->drain_cond, &wb->lock);
+	if (!list_empty(&wb->recs))
+		ret = -EIO;
+	wb->drainers--;
+	pthread_mutex_unlock(&wb->lock);
+
+	if (ret) {
+		tcmu_dev_err(wb->dev, "Could not drain write-back log %s.\n",
+			     wb->path);
+		return ret;
+	}
+	return wb_clear_owner(wb);
+}
+
+void rbd_wb_resume(struct rbd_wb *wb)
+{
+	pthread_mutex_lock(&wb->lock);
+	wb->bypass = false;
+	pthread_cond_signal(&wb->writer_cond);
+	pthread_mutex_unlock(&wb->lock);
+}
+
+/* Returns true if owner, an image's mark, was set by this log */
+bool rbd_wb_owns(struct rbd_wb *wb, const char *owner)
+{
+	uint64_t log_id, epoch;
+
+	return wb_parse_owner(owner, &log_id, &epoch) && log_id == wb->log_id;
+}
+
+/* Returns true if the log in the file, whatever it is for, is empty */
+static bool wb_log_empty(struct rbd_wb *wb, struct rbd_wb_super *super)
+{
+	struct rbd_wb tmp = *wb;
+	struct rbd_wb_hdr hdr;
+	uint64_t pos = super->tail;
+
+	tmp.block_size = super->block_size;
+	tmp.area_size = super->area_size;
+	tmp.num_lbas = super->num_lbas;
+	tmp.log_id = super->log_id;
+	tmp.epoch = super->epoch;
+	if (!tmp.block_size || !tmp.area_size)
+		return true;
+
+	return !wb_find_hdr(&tmp, &pos, &hdr);
+}
+
+static uint64_t wb_new_log_id(struct rbd_wb *wb)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec ^
+	       ((uint64_t)getpid() << 16) ^ (uintptr_t)wb;
+}
+
+static int wb_open_file(struct rbd_wb *wb, uint64_t size_mb, uint64_t *size)
+{
+	struct stat st;
+	int ret;
+
+	wb->fd = open(wb->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (wb->fd < 0) {
+		ret = -errno;
+		tcmu_dev_err(wb->dev, "Could not open write-back log %s. Err %d.\n",
+			     wb->path, ret);
+		return ret;
+	}
+
+	if (fstat(wb->fd, &st)) {
+		ret = -errno;
+		goto close_fd;
+	}
+
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(wb->fd, BLKGETSIZE64, size)) {
+			ret = -errno;
+			goto close_fd;
+		}
+		return 0;
+	}
+
+	*size = size_mb << 20;
+	if ((uint64_t)st.st_size >= *size) {
+		*size = st.st_size;
+		return 0;
+	}
+
+	ret = -posix_fallocate(wb->fd, 0, *size);
+	if (ret) {
+		tcmu_dev_err(wb->dev, "Could not allocate %"PRIu64" MiB for write-back log %s. Err %d.\n",
+			     size_mb, wb->path, ret);
+		goto close_fd;
+	}
+	return 0;
+
+close_fd:
+	close(wb->fd);
+	return ret;
+}
+
+/*
+ * rbd_wb_open - open, or create, the write-back log of a device
+ * @dev: device the log is for
+ * @path: file or block device holding the log
+ * @size_mb: size of the log if path is a regular file
+ * @ident: name of the image, the log must not be replayed on another one
+ * @ops: how to write to the image
+ * @wbp: returns the log
+ *
+ * Writes found in the log are written back to the image, they are served
+ * from the log until they are. They are discarded if the image is no
+ * longer marked with the log's epoch. The image must be open, @ops are
+ * already used to look the mark up.
+ */
+int rbd_wb_open(struct tcmu_device *dev, const char *path, uint64_t size_mb,
+		const char *ident, const struct rbd_wb_ops *ops,
+		struct rbd_wb **wbp)
+{
+	struct rbd_wb_super super;
+	struct rbd_wb *wb;
+	uint64_t size, slots = 1, i;
+	bool have_super, ours, current;
+	int ret;
+
+	wb = calloc(1, sizeof(*wb));
+	if (!wb)
+		return -ENOMEM;
+	wb->dev = dev;
+	wb->ops = ops;
+	wb->block_size = tcmu_dev_get_block_size(dev);
+	wb->num_lbas = tcmu_dev_get_num_lbas(dev);
+	strncpy(wb->ident, ident, RBD_WB_IDENT_LEN - 1);
+	list_head_init(&wb->pending);
+	list_head_init(&wb->recs);
+	list_head_init(&wb->waiters);
+
+	wb->path = strdup(path);
+	if (!wb->path) {
+		ret = -ENOMEM;
+		goto free_wb;
+	}
+
+	ret = wb_open_file(wb, size_mb, &size);
+	if (ret)
+		goto free_path;
+
+	wb->area_size = (size - RBD_WB_SUPER_SIZE) & ~(uint64_t)4095;
+	if (size < RBD_WB_SUPER_SIZE ||
+	    wb->area_size < (RBD_WB_LOG_SIZE_MB_MIN << 20)) {
+		tcmu_dev_err(dev, "Write-back log %s must be at least %u MiB.\n",
+			     path, RBD_WB_LOG_SIZE_MB_MIN);
+		ret = -EINVAL;
+		goto close_fd;
+	}
+
+	/* Each block in the log has an entry, at most half the slots */
+	while (slots < 2 * (wb->area_size / wb->block_size))
+		slots <<= 1;
+	wb->slots = malloc(slots * sizeof(*wb->slots));
+	wb->hdr_buf = calloc(RBD_WB_WRITE_BATCH, RBD_WB_HDR_SIZE);
+	if (!wb->slots || !wb->hdr_buf) {
+		ret = -ENOMEM;
+		goto free_bufs;
+	}
+	for (i = 0; i < slots; i++)
+		wb->slots[i].lba = RBD_WB_EMPTY_SLOT;
+	wb->slot_mask = slots - 1;
+
+	have_super = wb_read_super(wb, &super);
+	if (have_super && super.block_size == wb->block_size &&
+	    super.area_size == wb->area_size &&
+	    super.num_lbas == wb->num_lbas &&
+	    !strcmp(super.ident, wb->ident)) {
+		wb->log_id = super.log_id;
+		wb->epoch = super.epoch;
+		ret = wb_get_image_owner(wb, &ours, &current);
+		if (ret)
+			goto free_bufs;
+
+		/* A stale mark of ours is removed once the log stays empty */
+		wb->marked = ours;
+		wb->clean_ms = wb_now_ms();
+		if (current) {
+			ret = wb_recover(wb, super.tail);
+			if (ret)
+				goto free_recs;
+			wb->mark_ok = true;
+		} else if (!wb_log_empty(wb, &super)) {
+			tcmu_dev_err(dev, "Write-back log %s has data for %s that was not written back, but the image is no longer marked as having data in it. It may have been taken over since. Discarding the log.\n",
+				     path, wb->ident);
+			wb->log_id = wb_new_log_id(wb);
+			wb->epoch = 0;
+			wb->marked = false;
+			ret = wb_write_super(wb, 0, 0);
+			if (ret)
+				goto free_bufs;
+		}
+	} else {
+		if (have_super && !wb_log_empty(wb, &super)) {
+			tcmu_dev_err(dev, "Write-back log %s has data for %s, %"PRIu64" blocks of %u bytes, that was not written back. Refusing to use it.\n",
+				     path, super.ident, super.num_lbas,
+				     super.block_size);
+			ret = -EBUSY;
+			goto free_bufs;
+		}
+		wb->log_id = wb_new_log_id(wb);
+		ret = wb_write_super(wb, 0, 0);
+		if (ret)
+			goto free_bufs;
+	}
+
+	ret = pthread_mutex_init(&wb->lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto free_recs;
+	}
+	ret = pthread_rwlock_init(&wb->index_lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto destroy_lock;
+	}
+	pthread_mutex_init(&wb->mark_lock, NULL);
+	pthread_mutex_init(&wb->super_lock, NULL);
+	pthread_cond_init(&wb->writer_cond, NULL);
+	pthread_cond_init(&wb->flusher_cond, NULL);
+	pthread_cond_init(&wb->drain_cond, NULL);
+
+	ret = pthread_create(&wb->writer, NULL, wb_writer, wb);
+	if (ret) {
+		ret = -ret;
+		goto destroy_conds;
+	}
+	ret = pthread_create(&wb->flusher, NULL, wb_flusher, wb);
+	if (ret) {
+		ret = -ret;
+		goto stop_writer;
+	}
+
+	tcmu_dev_info(dev, "Using write-back log %s, %"PRIu64" MiB.\n",
+		      path, wb->area_size >> 20);
+	*wbp = wb;
+	return 0;
+
+stop_writer:
+	pthread_mutex_lock(&wb->lock);
+	wb->stop = true;
+	pthread_cond_signal(&wb->writer_cond);
+	pthread_mutex_unlock(&wb->lock);
+	pthread_join(wb->writer, NULL);
+destroy_conds:
+	pthread_cond_destroy(&wb->writer_cond);
+	pthread_cond_destroy(&wb->flusher_cond);
+	pthread_cond_destroy(&wb->drain_cond);
+	pthread_mutex_destroy(&wb->super_lock);
+	pthread_mutex_destroy(&wb->mark_lock);
+	pthread_rwlock_destroy(&wb->index_lock);
+destroy_lock:
+	pthread_mutex_destroy(&wb->lock);
+free_recs:
+	while (!list_empty(&wb->recs))
+		free(list_pop(&wb->recs, struct rbd_wb_rec, entry));
+free_bufs:
+	free(wb->hdr_buf);
+	free(wb->slots);
+close_fd:
+	close(wb->fd);
+free_path:
+	free(wb->path);
+free_wb:
+	free(wb);
+	return ret;
+}
+
+/*
+ * rbd_wb_close - write back and close the log
+ * @wb: log to close
+ *
+ * Must be called before the image is closed, with no cmds in flight. If
+ * the log cannot be written back, its data is kept, and the image stays
+ * marked, so it is written back the next time the device is opened.
+ */
+void rbd_wb_close(struct rbd_wb *wb)
+{
+	struct rbd_wb_waiter *waiter;
+	struct rbd_wb_io *io;
+	uint64_t dirty;
+
+	if (rbd_wb_drain(wb)) {
+		pthread_mutex_lock(&wb->lock);
+		dirty = wb->head - wb->tail;
+		pthread_mutex_unlock(&wb->lock);
+		tcmu_dev_warn(wb->dev, "Keeping %"PRIu64" KiB in write-back log %s for the next open.\n",
+			      dirty / 1024, wb->path);
+	}
+
+	pthread_mutex_lock(&wb->lock);
+	wb->stop = true;
+	pthread_cond_broadcast(&wb->writer_cond);
+	pthread_cond_broadcast(&wb->flusher_cond);
+	pthread_mutex_unlock(&wb->lock);
+	pthread_join(wb->writer, NULL);
+	pthread_join(wb->flusher, NULL);
+
+	/* Only left behind if the drain failed */
+	while ((io = list_pop(&wb->pending, struct rbd_wb_io, entry))) {
+		tcmur_cmd_complete(wb->dev, io->tcmur_cmd, TCMU_STS_BUSY);
+		free(io->rec);
+		free(io);
+	}
+	while ((waiter = list_pop(&wb->waiters, struct rbd_wb_waiter, entry)))
+		waiter->fn(waiter);
+
+	tcmu_dev_info(wb->dev, "Write-back log: %"PRIu64" writes logged, %"PRIu64" sent to the image, %"PRIu64" reads hit, %"PRIu64" KiB written back.\n",
+		      wb->logged_writes, wb->direct_writes, wb->read_hits,
+		      wb->written_back / 1024);
+
+	while (!list_empty(&wb->recs))
+		free(list_pop(&wb->recs, struct rbd_wb_rec, entry));
+	pthread_cond_destroy(&wb->writer_cond);
+	pthread_cond_destroy(&wb->flusher_cond);
+	pthread_cond_destroy(&wb->drain_cond);
+	pthread_mutex_destroy(&wb->super_lock);
+	pthread_mutex_destroy(&wb->mark_lock);
+	pthread_rwlock_destroy(&wb->index_lock);
+	pthread_mutex_destroy(&wb->lock);
+	free(wb->hdr_buf);
+	free(wb->slots);
+	close(wb->fd);
+	free(wb->path);
+	free(wb);
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __RBD_WB_H
+#define __RBD_WB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "ccan/list/list.h"
+
+struct tcmu_device;
+struct tcmur_cmd;
+struct rbd_wb;
+
+/* Default and minimum size of a regular file log */
+#define RBD_WB_LOG_SIZE_MB_DEFAULT	1024
+#define RBD_WB_LOG_SIZE_MB_MIN		64
+/* Owner string the image is marked with, see rbd_wb_ops.set_owner */
+#define RBD_WB_OWNER_LEN		128
+
+/* A run of image data the flusher writes back */
+struct rbd_wb_extent {
+	uint64_t offset;
+	uint64_t length;
+	char *buf;
+};
+
+struct rbd_wb_ops {
+	/*
+	 * Write the extents to the image and return once they are stable
+	 * there. Called from the flusher thread. Returns 0 or -errno.
+	 */
+	int (*write_sync)(struct tcmu_device *dev, struct rbd_wb_extent *ext,
+			  int nr_ext);
+	/*
+	 * Send a write straight to the image, like the handler's write
+	 * callout. Used for writes that cannot go through the log, once
+	 * everything logged before them is on the image.
+	 */
+	int (*write_direct)(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			    struct iovec *iov, size_t iov_cnt, size_t length,
+			    off_t offset);
+	/*
+	 * Mark the image as having writes in this log, with owner, or
+	 * remove the mark if owner is NULL. The mark is stored before the
+	 * first write is logged and removed once they are all on the image,
+	 * so other gateways can see the image is not theirs to take over.
+	 * Returns 0 or -errno.
+	 */
+	int (*set_owner)(struct tcmu_device *dev, const char *owner);
+	/*
+	 * Copy the mark into owner. Returns 0, -ENOENT if the image is not
+	 * marked, or -errno.
+	 */
+	int (*get_owner)(struct tcmu_device *dev, char *owner, size_t len);
+};
+
+/*
+ * A cmd that writes to the image behind the log's back, like a discard.
+ * Once rbd_wb_defer() has queued it, fn is called from the flusher
+ * thread when everything logged before it is on the image.
+ */
+struct rbd_wb_waiter {
+	struct list_node entry;
+	uint64_t target;
+	void (*fn)(struct rbd_wb_waiter *waiter);
+};
+
+/* Dirty log data a read found, copied over the image data it read */
+struct rbd_wb_overlay;
+
+int rbd_wb_open(struct tcmu_device *dev, const char *path, uint64_t size_mb,
+		const char *ident, const struct rbd_wb_ops *ops,
+		struct rbd_wb **wbp);
+void rbd_wb_close(struct rbd_wb *wb);
+
+int rbd_wb_write(struct rbd_wb *wb, struct tcmur_cmd *tcmur_cmd,
+		 struct iovec *iov, size_t iov_cnt, size_t length,
+		 off_t offset);
+int rbd_wb_read(struct rbd_wb *wb, struct tcmur_cmd *tcmur_cmd,
+		struct iovec *iov, size_t iov_cnt, size_t length,
+		off_t offset, struct rbd_wb_overlay **overlay);
+void rbd_wb_overlay_apply(struct rbd_wb_overlay *overlay, struct iovec *iov,
+			  size_t iov_cnt);
+void rbd_wb_overlay_free(struct rbd_wb_overlay *overlay);
+
+bool rbd_wb_range_dirty(struct rbd_wb *wb, uint64_t offset, uint64_t length);
+void rbd_wb_defer(struct rbd_wb *wb, struct rbd_wb_waiter *waiter);
+
+int rbd_wb_drain(struct rbd_wb *wb);
+void rbd_wb_resume(struct rbd_wb *wb);
+bool rbd_wb_owns(struct rbd_wb *wb, const char *owner);
+
+#endif
@@ -207,6 +207,122 @@ fail:
 	return NULL;
 }
 
+/* Devices of a tpg being reopened by up to recovery_max_reopens threads */
+struct tgt_port_grp_reopen {
+	struct tcmur_device **rdevs;
+	int nr_rdevs;
+	int next;		/* next rdevs index to reopen */
+	bool enable_tpg;
+};
+
+static void tgt_port_grp_reopen_dev(struct tcmur_device *rdev,
+				    bool *enable_tpg)
+{
+	int ret;
+
+	ret = __tcmu_reopen_dev(rdev->dev, -1);
+	if (ret) {
+		tcmu_dev_err(rdev->dev, "Could not reinitialize device. (err %d).\n",
+			     ret);
+		if (!(rdev->flags & TCMUR_DEV_FLAG_STOPPING))
+			/* assume fatal error so do not enable tpg */
+			__atomic_store_n(enable_tpg, false, __ATOMIC_RELAXED);
+	}
+}
+
+static void *tgt_port_grp_reopen_fn(void *arg)
+{
+	struct tgt_port_grp_reopen *reopen = arg;
+	int i;
+
+	/*
+	 * Like the recovery work itself, we must not wait on the event
+	 * work of the devices we reopen, since one of them runs us.
+	 */
+	tcmu_set_thread_name("ework-thread", NULL);
+
+	while ((i = __atomic_fetch_add(&reopen->next, 1, __ATOMIC_RELAXED)) <
+	       reopen->nr_rdevs)
+		tgt_port_grp_reopen_dev(reopen->rdevs[i], &reopen->enable_tpg);
+	return NULL;
+}
+
+/* Devices that were running IO most recently are reopened first */
+static int tgt_port_grp_reopen_cmp(const void *a, const void *b)
+{
+	uint64_t a_ns = (*(struct tcmur_device **)a)->last_cmd_ns;
+	uint64_t b_ns = (*(struct tcmur_device **)b)->last_cmd_ns;
+
+	if (a_ns == b_ns)
+		return 0;
+	return a_ns > b_ns ? -1 : 1;
+}
+
+/*
+ * Reopen the tpg's devices. Returns false if a device could not be
+ * reopened and the tpg should stay disabled.
+ */
+static bool tgt_port_grp_reopen_devs(struct tgt_port_grp *tpg,
+				     bool enable_tpg)
+{
+	struct tgt_port_grp_reopen reopen;
+	struct tcmur_device *rdev, *tmp_rdev;
+	unsigned int nr_threads, nr_started = 0;
+	pthread_t *threads = NULL;
+	int i = 0;
+
+	memset(&reopen, 0, sizeof(reopen));
+	reopen.enable_tpg = enable_tpg;
+
+	list_for_each(&tpg->devs, rdev, recovery_entry)
+		reopen.nr_rdevs++;
+
+	reopen.rdevs = calloc(reopen.nr_rdevs ? reopen.nr_rdevs : 1,
+			      sizeof(*reopen.rdevs));
+	if (!reopen.rdevs) {
+		tcmu_err("Could not allocate reopen list for %s/%s/tpgt_%hu. Reopening devices one at a time.\n",
+			 tpg->fabric, tpg->wwn, tpg->tpgt);
+		list_for_each_safe(&tpg->devs, rdev, tmp_rdev, recovery_entry) {
+			list_del(&rdev->recovery_entry);
+			tgt_port_grp_reopen_dev(rdev, &reopen.enable_tpg);
+		}
+		return reopen.enable_tpg;
+	}
+
+	list_for_each_safe(&tpg->devs, rdev, tmp_rdev, recovery_entry) {
+		list_del(&rdev->recovery_entry);
+		reopen.rdevs[i++] = rdev;
+	}
+	qsort(reopen.rdevs, reopen.nr_rdevs, sizeof(*reopen.rdevs),
+	      tgt_port_grp_reopen_cmp);
+
+	/*
+	 * The transport is stopped, so reopen the devices in parallel.
+	 * The recovery scheduler bounds how many handler opens run at a
+	 * time over all tpgs.
+	 */
+	nr_threads = tcmur_recovery_get_max_reopens();
+	if (nr_threads > reopen.nr_rdevs)
+		nr_threads = reopen.nr_rdevs;
+	if (nr_threads > 1) {
+		threads = calloc(nr_threads - 1, sizeof(*threads));
+		for (; threads && nr_started < nr_threads - 1; nr_started++) {
+			if (pthread_create(&threads[nr_started], NULL,
+					   tgt_port_grp_reopen_fn, &reopen))
+				break;
+		}
+	}
+
+	tgt_port_grp_reopen_fn(&reopen);
+
+	while (nr_started)
+		pthread_join(threads[--nr_started], NULL);
+	free(threads);
+	free(reopen.rdevs);
+
+	return reopen.enable_tpg;
+}
+
 /*
  * Disable the target tpg to avoid flip flopping between paths
  * (transport path is ok so multipath layer switches to it, but
@@ -216,7 +332,6 @@ fail:
 static void tgt_port_grp_recovery_work_fn(void *arg)
 {
 	struct tgt_port_grp *tpg = arg;
-	struct tcmur_device *rdev, *tmp_rdev;
 	bool enable_tpg = false;
 	int ret;
 
@@ -246,21 +361,7 @@ static void tgt_port_grp_recovery_work_fn(void *arg)
 		  tpg->tpgt);
 
 done:
-	/*
-	 * TODO - the transport is stopped, so we should use the
-	 * cmdproc thread to reopen all these in parallel.
-	 */
-	list_for_each_safe(&tpg->devs, rdev, tmp_rdev, recovery_entry) {
-		list_del(&rdev->recovery_entry);
-		ret = __tcmu_reopen_dev(rdev->dev, -1);
-		if (ret) {
-			tcmu_dev_err(rdev->dev, "Could not reinitialize device. (err %d).\n",
-				     ret);
-			if (!(rdev->flags & TCMUR_DEV_FLAG_STOPPING))
-				/* assume fatal error so do not enable tpg */
-				enable_tpg = false;
-		}
-	}
+	enable_tpg = tgt_port_grp_reopen_devs(tpg, enable_tpg);
 
 	if (enable_tpg) {
 		ret = tcmu_set_tpg_int(tpg, "enable", 1);
@@ -287,6 +388,11 @@ int tcmu_add_dev_to_recovery_list(struct tcmu_device *dev)
 
 	pthread_mutex_lock(&tpg_recovery_lock);
 
+	/*
+	 * The kernel is disabling the port, so read it directly and have
+	 * INQUIRY and RTPG rescan too.
+	 */
+	tcmu_invalidate_alua_grps(dev);
 	list_head_init(&alua_list);
 	ret = tcmu_get_alua_grps(dev, &alua_list);
 	if (ret) {
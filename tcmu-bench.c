@@ -0,0 +1,1192 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * tcmu-bench plays the kernel side of the TCMU ring in memory, so a
+ * handler can be benchmarked through the runner's normal command path
+ * without target_core_user, configfs or an initiator.
+ *
+ * It builds a mailbox, command ring and data area, fills the ring with
+ * synthetic READ, WRITE, UNMAP, COMPARE AND WRITE and EXTENDED COPY
+ * cmds, runs them through tcmur_generic_handle_cmd and the handler .so
+ * like the cmdproc thread does, and reaps the completions off the ring.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <dlfcn.h>
+#include <poll.h>
+#include <pthread.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <scsi/scsi.h>
+
+#include "darray.h"
+#include "libtcmu.h"
+#include "libtcmu_log.h"
+#include "libtcmu_priv.h"
+#include "libtcmu_common.h"
+#include "target_core_user_local.h"
+#include "scsi_defs.h"
+#include "scsi.h"
+#include "tcmu-runner.h"
+#include "tcmur_aio.h"
+#include "tcmur_device.h"
+#include "tcmur_cmd_handler.h"
+#include "tcmur_work.h"
+#include "tcmur_stats.h"
+#include "tcmur_affinity.h"
+#include "version.h"
+
+enum bench_op {
+	BENCH_READ,
+	BENCH_WRITE,
+	BENCH_UNMAP,
+	BENCH_CAW,
+	BENCH_XCOPY,
+	BENCH_NR_OPS,
+};
+
+static const char *bench_op_names[BENCH_NR_OPS] = {
+	[BENCH_READ]	= "read",
+	[BENCH_WRITE]	= "write",
+	[BENCH_UNMAP]	= "unmap",
+	[BENCH_CAW]	= "caw",
+	[BENCH_XCOPY]	= "xcopy",
+};
+
+/* EXTENDED COPY parameter list: header, 2 target descs and a B2B seg desc */
+#define BENCH_XCOPY_PARAM_LEN	(16 + 2 * 32 + 28)
+#define BENCH_UNMAP_PARAM_LEN	24
+#define BENCH_CDB_SIZE		32
+#define BENCH_MAX_QUEUE_DEPTH	4096
+/* Max cmds pulled off the ring at a time, like the cmdproc thread */
+#define BENCH_CMD_BATCH		32
+/* The runner's default XCOPY read/write window */
+#define BENCH_XCOPY_WINDOW	4
+#define BENCH_MAX_JOBS		256
+
+static char *handler_file;
+static char *cfgstring;
+static char *tcm_hba_name;
+static char *tcm_dev_name;
+static uint64_t dev_size = 1024ULL * 1024 * 1024;
+static uint32_t block_size = 512;
+static uint32_t xfer_size = 4096;
+static unsigned int queue_depth = 32;
+static unsigned int run_secs = 10;
+static uint64_t max_ops;
+static bool sequential;
+static unsigned int nr_jobs = 1;
+/* Set by --jobs: run every device on its own thread, pinned to a cpu */
+static bool pin_jobs;
+static unsigned int op_mix[BENCH_NR_OPS] = { [BENCH_READ] = 70,
+					     [BENCH_WRITE] = 30 };
+
+/* Completions reaped for one op */
+struct bench_op_stats {
+	uint64_t cmds;
+	uint64_t bytes;
+	uint64_t errors;
+	struct tcmur_latency_hist lat;
+};
+
+/* State of the cmd using a ring cmd_id */
+struct bench_slot {
+	enum bench_op op;
+	uint64_t bytes;
+	uint64_t submit_ns;
+};
+
+struct bench {
+	struct tcmulib_context ctx;
+	struct tcmulib_handler lib_handler;
+	struct tcmu_device dev;
+
+	unsigned int job;
+	/* cpu the job and its device's threads run on, or -1 */
+	int cpu;
+	pthread_t thread;
+	int run_ret;
+	uint64_t elapsed_ns;
+
+	/* Kernel side of the ring */
+	uint32_t entry_size;
+	uint32_t cdb_off;
+	uint32_t data_off;
+	uint32_t data_slot_size;
+	uint32_t head;
+	uint32_t reap_tail;
+
+	struct bench_slot *slots;
+	uint16_t *free_ids;
+	unsigned int nr_free;
+	unsigned int inflight;
+	uint64_t submitted;
+
+	unsigned int mix_total;
+	uint64_t next_lba;
+	unsigned int seed;
+	uint8_t wwn[16];
+
+	struct bench_op_stats stats[BENCH_NR_OPS];
+};
+
+static struct tcmur_handler *bench_handler;
+
+struct tcmur_handler *tcmu_get_runner_handler(struct tcmu_device *dev)
+{
+	struct tcmulib_handler *handler = tcmu_dev_get_handler(dev);
+
+	return handler->hm_private;
+}
+
+int tcmur_register_handler(struct tcmur_handler *handler)
+{
+	int ret;
+
+	if (bench_handler) {
+		tcmu_err("Handler %s is already loaded, ignoring %s\n",
+			 bench_handler->subtype, handler->subtype);
+		return -1;
+	}
+
+	if (handler->init) {
+		ret = handler->init();
+		if (ret) {
+			tcmu_err("Failed to init handler %s, ret = %d\n",
+				 handler->subtype, ret);
+			return ret;
+		}
+	}
+
+	bench_handler = handler;
+	return 0;
+}
+
+bool tcmur_unregister_handler(struct tcmur_handler *handler)
+{
+	if (bench_handler != handler)
+		return false;
+
+	bench_handler = NULL;
+	return true;
+}
+
+static int bench_load_handler(const char *path)
+{
+	int (*handler_init)(void);
+	void *handle;
+	char *error;
+
+	handle = dlopen(path, RTLD_NOW|RTLD_LOCAL);
+	if (!handle) {
+		tcmu_err("Could not open handler at %s: %s\n", path, dlerror());
+		return -1;
+	}
+
+	dlerror();
+	handler_init = dlsym(handle, "handler_init");
+	if ((error = dlerror())) {
+		tcmu_err("dlsym failure on %s: (%s)\n", path, error);
+		return -1;
+	}
+
+	if (handler_init() || !bench_handler) {
+		tcmu_err("handler init failed on path %s\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Same NAA IEEE Registered Extended designator the runner's XCOPY uses */
+static int bench_get_wwn(struct bench *b)
+{
+	char *buf, *p;
+	bool next = true;
+	int ind = 0;
+
+	buf = tcmu_cfgfs_dev_get_wwn(&b->dev);
+	if (!buf)
+		return -1;
+
+	b->wwn[ind++] = 0x60;
+	b->wwn[ind++] = 0x01;
+	b->wwn[ind++] = 0x40;
+	b->wwn[ind] = 0x50;
+
+	for (p = buf; *p && ind < sizeof(b->wwn); p++) {
+		uint8_t val;
+
+		if (!char_to_hex(&val, *p))
+			continue;
+
+		if (next) {
+			next = false;
+			b->wwn[ind++] |= val;
+		} else {
+			next = true;
+			b->wwn[ind] = val << 4;
+		}
+	}
+
+	free(buf);
+	return 0;
+}
+
+static int bench_setup_ring(struct bench *b)
+{
+	struct tcmu_mailbox *mb;
+	uint32_t cmdr_size;
+	size_t map_len;
+	unsigned int i;
+
+	/*
+	 * Every entry has one iovec and carries its cdb right after it, so
+	 * they are all the same size. The ring holds a whole number of them
+	 * and never has to be padded at the wrap like the kernel does.
+	 */
+	b->cdb_off = offsetof(struct tcmu_cmd_entry, req.iov) +
+		     sizeof(struct iovec);
+	if (b->cdb_off < sizeof(struct tcmu_cmd_entry))
+		b->cdb_off = sizeof(struct tcmu_cmd_entry);
+	b->entry_size = round_up(b->cdb_off + BENCH_CDB_SIZE,
+				 TCMU_OP_ALIGN_SIZE);
+
+	/* One spare entry, so a full ring does not look empty */
+	cmdr_size = b->entry_size * (queue_depth + 1);
+
+	b->data_slot_size = xfer_size;
+	if (b->data_slot_size < 2 * block_size)
+		b->data_slot_size = 2 * block_size;
+	if (b->data_slot_size < BENCH_XCOPY_PARAM_LEN)
+		b->data_slot_size = BENCH_XCOPY_PARAM_LEN;
+	b->data_slot_size = round_up(b->data_slot_size, 4096);
+
+	b->data_off = round_up(4096 + cmdr_size, 4096);
+	map_len = (size_t)b->data_off +
+		  (size_t)b->data_slot_size * queue_depth;
+
+	mb = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mb == MAP_FAILED)
+		return -errno;
+
+	mb->version = TCMU_MAILBOX_VERSION;
+	mb->flags = TCMU_MAILBOX_FLAG_CAP_OOOC;
+	mb->cmdr_off = 4096;
+	mb->cmdr_size = cmdr_size;
+
+	b->dev.map = mb;
+	b->dev.map_len = map_len;
+
+	b->slots = calloc(queue_depth, sizeof(*b->slots));
+	b->free_ids = calloc(queue_depth, sizeof(*b->free_ids));
+	if (!b->slots || !b->free_ids)
+		return -ENOMEM;
+
+	for (i = 0; i < queue_depth; i++)
+		b->free_ids[i] = queue_depth - 1 - i;
+	b->nr_free = queue_depth;
+	return 0;
+}
+
+static void bench_cleanup_ring(struct bench *b)
+{
+	if (b->dev.map)
+		munmap(b->dev.map, b->dev.map_len);
+	free(b->slots);
+	free(b->free_ids);
+}
+
+static uint64_t bench_pick_lba(struct bench *b, uint32_t nlbas)
+{
+	uint64_t nr_chunks = b->dev.num_lbas / nlbas, lba;
+
+	if (sequential) {
+		if (b->next_lba + nlbas > b->dev.num_lbas)
+			b->next_lba = 0;
+		lba = b->next_lba;
+		b->next_lba += nlbas;
+		return lba;
+	}
+
+	lba = ((uint64_t)rand_r(&b->seed) << 31) | rand_r(&b->seed);
+	return (lba % nr_chunks) * nlbas;
+}
+
+static enum bench_op bench_pick_op(struct bench *b)
+{
+	unsigned int val = rand_r(&b->seed) % b->mix_total;
+	int op;
+
+	for (op = 0; op < BENCH_NR_OPS - 1; op++) {
+		if (val < op_mix[op])
+			break;
+		val -= op_mix[op];
+	}
+	return op;
+}
+
+/*
+ * Fill in cdb and the data out buffer for op. Returns the length of the
+ * data buffer and sets *bytes to the amount of device data it covers.
+ */
+static uint32_t bench_build_cmd(struct bench *b, enum bench_op op,
+				uint8_t *cdb, uint8_t *data, uint64_t *bytes)
+{
+	uint32_t nlbas = xfer_size / block_size;
+	uint64_t lba, dst_lba;
+	uint8_t *desc;
+	int i;
+
+	*bytes = (uint64_t)nlbas * block_size;
+
+	switch (op) {
+	case BENCH_READ:
+	case BENCH_WRITE:
+		cdb[0] = op == BENCH_READ ? READ_16 : WRITE_16;
+		*(uint64_t *)&cdb[2] = htobe64(bench_pick_lba(b, nlbas));
+		*(uint32_t *)&cdb[10] = htobe32(nlbas);
+		return *bytes;
+	case BENCH_UNMAP:
+		cdb[0] = UNMAP;
+		*(uint16_t *)&cdb[7] = htobe16(BENCH_UNMAP_PARAM_LEN);
+
+		memset(data, 0, BENCH_UNMAP_PARAM_LEN);
+		*(uint16_t *)&data[0] = htobe16(BENCH_UNMAP_PARAM_LEN - 2);
+		*(uint16_t *)&data[2] = htobe16(16);
+		*(uint64_t *)&data[8] = htobe64(bench_pick_lba(b, nlbas));
+		*(uint32_t *)&data[16] = htobe32(nlbas);
+		return BENCH_UNMAP_PARAM_LEN;
+	case BENCH_CAW:
+		cdb[0] = COMPARE_AND_WRITE;
+		*(uint64_t *)&cdb[2] = htobe64(bench_pick_lba(b, 1));
+		cdb[13] = 1;
+
+		/*
+		 * Compare against and write zeros, so CAWs only miscompare
+		 * if the device had data on it before the run.
+		 */
+		memset(data, 0, 2 * block_size);
+		*bytes = block_size;
+		return 2 * block_size;
+	case BENCH_XCOPY:
+		lba = bench_pick_lba(b, nlbas);
+		dst_lba = bench_pick_lba(b, nlbas);
+
+		cdb[0] = EXTENDED_COPY;
+		*(uint32_t *)&cdb[10] = htobe32(BENCH_XCOPY_PARAM_LEN);
+
+		memset(data, 0, BENCH_XCOPY_PARAM_LEN);
+		data[1] = 0x18;		/* LIST ID USAGE 11b */
+		*(uint16_t *)&data[2] = htobe16(2 * 32);
+		*(uint32_t *)&data[8] = htobe32(28);
+
+		/* source and destination are both this device */
+		for (i = 0; i < 2; i++) {
+			desc = data + 16 + i * 32;
+			desc[0] = XCOPY_TARGET_DESC_TYPE_CODE_ID;
+			desc[4] = 0x01;	/* binary code set */
+			desc[5] = 0x03;	/* LUN association, NAA designator */
+			desc[7] = sizeof(b->wwn);
+			memcpy(&desc[8], b->wwn, sizeof(b->wwn));
+		}
+
+		desc = data + 16 + 2 * 32;
+		desc[0] = XCOPY_SEG_DESC_TYPE_CODE_B2B;
+		*(uint16_t *)&desc[2] = htobe16(0x18);
+		*(uint16_t *)&desc[4] = htobe16(0);
+		*(uint16_t *)&desc[6] = htobe16(1);
+		*(uint16_t *)&desc[10] = htobe16(nlbas);
+		*(uint64_t *)&desc[12] = htobe64(lba);
+		*(uint64_t *)&desc[20] = htobe64(dst_lba);
+		return BENCH_XCOPY_PARAM_LEN;
+	default:
+		return 0;
+	}
+}
+
+/* Queue cmds on the ring until queue_depth are outstanding */
+static void bench_submit(struct bench *b)
+{
+	struct tcmu_mailbox *mb = b->dev.map;
+	struct tcmu_cmd_entry *ent;
+	struct bench_slot *slot;
+	uint8_t *cdb, *data;
+	uint16_t id;
+	uint32_t len;
+	uint64_t now;
+	bool queued = false;
+
+	now = tcmur_now_ns();
+	while (b->nr_free && (!max_ops || b->submitted < max_ops)) {
+		id = b->free_ids[--b->nr_free];
+		slot = &b->slots[id];
+
+		ent = (struct tcmu_cmd_entry *)((char *)mb + mb->cmdr_off +
+						b->head);
+		cdb = (uint8_t *)ent + b->cdb_off;
+		data = (uint8_t *)mb + b->data_off +
+		       (size_t)id * b->data_slot_size;
+
+		memset(ent, 0, b->entry_size);
+		slot->op = bench_pick_op(b);
+		len = bench_build_cmd(b, slot->op, cdb, data, &slot->bytes);
+		slot->submit_ns = now;
+
+		/* entry_size is TCMU_OP_ALIGN_SIZE aligned, so the op fits */
+		ent->hdr.len_op = b->entry_size | TCMU_OP_CMD;
+		ent->hdr.cmd_id = id;
+		ent->req.iov_cnt = 1;
+		ent->req.cdb_off = (char *)cdb - (char *)mb;
+		ent->req.iov[0].iov_base = (void *)(uintptr_t)
+						((char *)data - (char *)mb);
+		ent->req.iov[0].iov_len = len;
+
+		b->head = (b->head + b->entry_size) % mb->cmdr_size;
+		b->inflight++;
+		b->submitted++;
+		queued = true;
+	}
+
+	if (queued)
+		__atomic_store_n(&mb->cmd_head, b->head, __ATOMIC_RELEASE);
+}
+
+/* Account the completions the runner wrote back to the ring */
+static unsigned int bench_reap(struct bench *b)
+{
+	struct tcmu_mailbox *mb = b->dev.map;
+	struct tcmu_cmd_entry *ent;
+	struct bench_op_stats *stats;
+	struct bench_slot *slot;
+	unsigned int reaped = 0;
+	uint32_t tail;
+	uint64_t now;
+
+	tail = __atomic_load_n(&mb->cmd_tail, __ATOMIC_ACQUIRE);
+	if (tail == b->reap_tail)
+		return 0;
+
+	now = tcmur_now_ns();
+	while (b->reap_tail != tail) {
+		ent = (struct tcmu_cmd_entry *)((char *)mb + mb->cmdr_off +
+						b->reap_tail);
+		slot = &b->slots[ent->hdr.cmd_id];
+		stats = &b->stats[slot->op];
+
+		stats->cmds++;
+		if (ent->rsp.scsi_status != SAM_STAT_GOOD)
+			stats->errors++;
+		else
+			stats->bytes += slot->bytes;
+		tcmur_hist_record(&stats->lat, now - slot->submit_ns);
+
+		b->free_ids[b->nr_free++] = ent->hdr.cmd_id;
+		b->inflight--;
+		reaped++;
+
+		b->reap_tail = (b->reap_tail + b->entry_size) % mb->cmdr_size;
+	}
+
+	return reaped;
+}
+
+/* One pass of the cmdproc thread's loop. Returns true if it did work */
+static bool bench_cmdproc(struct bench *b)
+{
+	struct tcmu_device *dev = &b->dev;
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmulib_cmd *cmds[BENCH_CMD_BATCH], *cmd;
+	struct tcmur_cmd *tcmur_cmd;
+	bool busy = false;
+	int nr_cmds, i, ret;
+
+	while ((nr_cmds = tcmulib_get_next_commands(dev, cmds, BENCH_CMD_BATCH,
+					sizeof(struct tcmur_cmd))) > 0) {
+		busy = true;
+		for (i = 0; i < nr_cmds; i++) {
+			cmd = cmds[i];
+			tcmur_cmd = cmd->hm_private;
+
+			memset(tcmur_cmd, 0, sizeof(*tcmur_cmd));
+			tcmur_cmd->lib_cmd = cmd;
+			tcmur_cmd->start_ns = tcmur_now_ns();
+			list_node_init(&tcmur_cmd->cmds_list_entry);
+			tcmur_stats_cmd_start(dev, cmd);
+
+			if (rdev->passthrough_only)
+				ret = tcmur_cmd_passthrough_handler(dev, cmd);
+			else
+				ret = tcmur_generic_handle_cmd(dev, cmd);
+
+			if (ret != TCMU_STS_ASYNC_HANDLED)
+				tcmur_tcmulib_cmd_complete(dev, cmd, ret);
+		}
+	}
+
+	tcmur_merge_flush(dev);
+
+	if (tcmur_complete_queued_cmds(dev))
+		busy = true;
+
+	return busy;
+}
+
+static int bench_run(struct bench *b, uint64_t *elapsed_ns)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(&b->dev);
+	uint64_t start, deadline;
+	struct pollfd pfd;
+	bool stopping = false;
+	bool busy;
+
+	start = tcmur_now_ns();
+	deadline = run_secs ? start + run_secs * 1000000000ULL : 0;
+
+	while (!stopping || b->inflight) {
+		if (!stopping) {
+			if ((deadline && tcmur_now_ns() >= deadline) ||
+			    (max_ops && b->submitted >= max_ops))
+				stopping = true;
+			else
+				bench_submit(b);
+		}
+
+		busy = bench_cmdproc(b);
+		if (bench_reap(b) || busy || !b->inflight)
+			continue;
+
+		/* Everything outstanding is with the handler's threads */
+		pfd.fd = rdev->compl_efd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 100) < 0 && errno != EINTR) {
+			tcmu_err("poll() failed %d\n", errno);
+			return -errno;
+		}
+	}
+
+	*elapsed_ns = tcmur_now_ns() - start;
+	return 0;
+}
+
+/* The parts of the runner's dev_added() a device on our ring needs */
+static int bench_dev_open(struct bench *b)
+{
+	struct tcmu_device *dev = &b->dev;
+	struct tcmur_device *rdev;
+	char policy[16];
+	int ret;
+
+	if (posix_memalign((void **)&rdev, TCMUR_CACHELINE_SIZE,
+			   sizeof(*rdev)))
+		return -ENOMEM;
+	memset(rdev, 0, sizeof(*rdev));
+
+	tcmu_dev_set_private(dev, rdev);
+	list_node_init(&rdev->recovery_entry);
+	list_head_init(&rdev->cmds_list);
+	list_head_init(&rdev->timed_out_cmds);
+	list_head_init(&rdev->range_locks);
+	list_head_init(&rdev->range_waiters);
+	rdev->dev = dev;
+	rdev->nr_threads = bench_handler->nr_threads;
+	rdev->xcopy_window = BENCH_XCOPY_WINDOW;
+	rdev->write_epoch = 1;
+
+	tcmu_dev_set_block_size(dev, block_size);
+	tcmu_dev_set_num_lbas(dev, dev_size / block_size);
+	tcmu_dev_set_max_xfer_len(dev, xfer_size / block_size);
+	tcmu_dev_set_max_unmap_len(dev, VPD_MAX_UNMAP_LBA_COUNT);
+	tcmu_dev_set_opt_unmap_gran(dev, xfer_size / block_size, true);
+	tcmu_dev_set_unmap_gran_align(dev, 0);
+	tcmu_dev_set_opt_xcopy_rw_len(dev, xfer_size / block_size);
+	if (bench_handler->unmap || bench_handler->unmap_vec)
+		tcmu_dev_set_unmap_enabled(dev, true);
+
+	ret = tcmur_stats_init(dev);
+	if (ret)
+		goto free_rdev;
+
+	/* The io work queue threads bind themselves when they start */
+	if (b->cpu >= 0) {
+		snprintf(policy, sizeof(policy), "%d", b->cpu);
+		ret = tcmur_affinity_setup(dev, policy);
+		if (ret)
+			goto free_rdev;
+	}
+
+	pthread_spin_init(&rdev->lock, 0);
+	pthread_mutex_init(&rdev->range_lock, NULL);
+	pthread_mutex_init(&rdev->format_lock, NULL);
+	pthread_mutex_init(&rdev->state_lock, NULL);
+	pthread_mutex_init(&rdev->flush_lock, NULL);
+	pthread_mutex_init(&rdev->alua_lock, NULL);
+	list_head_init(&rdev->alua_grps);
+
+	ret = tcmur_state_pool_init(dev);
+	if (ret)
+		goto destroy_locks;
+
+	rdev->compl_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rdev->compl_efd < 0) {
+		ret = -errno;
+		goto cleanup_state_pool;
+	}
+
+	ret = setup_io_work_queue(dev);
+	if (ret < 0)
+		goto close_compl_efd;
+
+	ret = setup_aio_tracking(rdev);
+	if (ret < 0)
+		goto cleanup_io_work_queue;
+
+	ret = bench_handler->open(dev, false);
+	if (ret) {
+		tcmu_err("Could not open %s: %d\n", cfgstring, ret);
+		goto cleanup_aio_tracking;
+	}
+	tcmur_dev_build_cmd_ops(dev);
+	rdev->flags |= TCMUR_DEV_FLAG_IS_OPEN;
+
+	rdev->event_work = tcmur_create_work();
+	if (!rdev->event_work) {
+		ret = -ENOMEM;
+		goto close_dev;
+	}
+
+	return 0;
+
+close_dev:
+	bench_handler->close(dev);
+cleanup_aio_tracking:
+	cleanup_aio_tracking(rdev);
+cleanup_io_work_queue:
+	cleanup_io_work_queue(dev, true);
+close_compl_efd:
+	close(rdev->compl_efd);
+cleanup_state_pool:
+	tcmur_state_pool_cleanup(dev);
+destroy_locks:
+	pthread_mutex_destroy(&rdev->alua_lock);
+	pthread_mutex_destroy(&rdev->flush_lock);
+	pthread_mutex_destroy(&rdev->state_lock);
+	pthread_mutex_destroy(&rdev->format_lock);
+	pthread_mutex_destroy(&rdev->range_lock);
+	pthread_spin_destroy(&rdev->lock);
+free_rdev:
+	tcmur_affinity_cleanup(dev);
+	tcmur_stats_cleanup(dev);
+	free(rdev);
+	return ret;
+}
+
+static void bench_dev_close(struct bench *b)
+{
+	struct tcmu_device *dev = &b->dev;
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	pthread_mutex_lock(&rdev->state_lock);
+	rdev->flags |= TCMUR_DEV_FLAG_STOPPING;
+	pthread_mutex_unlock(&rdev->state_lock);
+
+	cleanup_io_work_queue_threads(dev);
+	if (aio_wait_for_empty_queue(rdev))
+		tcmu_err("could not flush queue.\n");
+	tcmur_flush_work(rdev->event_work);
+
+	bench_handler->close(dev);
+	rdev->flags &= ~TCMUR_DEV_FLAG_IS_OPEN;
+
+	cleanup_io_work_queue(dev, false);
+	cleanup_aio_tracking(rdev);
+	tcmur_destroy_work(rdev->event_work);
+	close(rdev->compl_efd);
+	tcmur_state_pool_cleanup(dev);
+
+	tcmu_release_alua_grps(&rdev->alua_grps);
+	pthread_mutex_destroy(&rdev->alua_lock);
+	pthread_mutex_destroy(&rdev->flush_lock);
+	pthread_mutex_destroy(&rdev->state_lock);
+	pthread_mutex_destroy(&rdev->format_lock);
+	pthread_mutex_destroy(&rdev->range_lock);
+	pthread_spin_destroy(&rdev->lock);
+
+	tcmur_affinity_cleanup(dev);
+	tcmur_stats_cleanup(dev);
+	free(rdev);
+}
+
+/* The job'th cpu we are allowed to run on, wrapping around, or -1 */
+static int bench_pick_cpu(unsigned int job)
+{
+	cpu_set_t avail;
+	unsigned int n = 0;
+	int cpu;
+
+	if (sched_getaffinity(0, sizeof(avail), &avail))
+		return -1;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &avail))
+			continue;
+		if (n++ == job % CPU_COUNT(&avail))
+			return cpu;
+	}
+	return -1;
+}
+
+/* Plays the device's kernel side and cmdproc thread on the job's cpu */
+static void *bench_thread(void *arg)
+{
+	struct bench *b = arg;
+
+	tcmur_affinity_bind_thread(&b->dev);
+	b->run_ret = bench_run(b, &b->elapsed_ns);
+	return NULL;
+}
+
+static void bench_print_line(const char *name, struct bench_op_stats *stats,
+			     double secs)
+{
+	struct tcmur_latency_hist *lat = &stats->lat;
+
+	printf("%-6s %10"PRIu64" %8"PRIu64" %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+	       name, stats->cmds, stats->errors, stats->cmds / secs,
+	       stats->bytes / secs / (1024 * 1024),
+	       lat->count ? lat->sum_ns / lat->count / 1e3 : 0.0,
+	       tcmur_hist_percentile(lat, 50) / 1e3,
+	       tcmur_hist_percentile(lat, 99) / 1e3,
+	       tcmur_hist_percentile(lat, 99.9) / 1e3,
+	       lat->max_ns / 1e3);
+}
+
+static void bench_add_stats(struct bench_op_stats *dst,
+			    struct bench_op_stats *src)
+{
+	unsigned int i;
+
+	dst->cmds += src->cmds;
+	dst->bytes += src->bytes;
+	dst->errors += src->errors;
+	dst->lat.count += src->lat.count;
+	dst->lat.sum_ns += src->lat.sum_ns;
+	if (src->lat.max_ns > dst->lat.max_ns)
+		dst->lat.max_ns = src->lat.max_ns;
+	for (i = 0; i < TCMUR_HIST_BUCKETS; i++)
+		dst->lat.buckets[i] += src->lat.buckets[i];
+}
+
+/* Report the jobs' completions as one device, then each job's IOPS */
+static void bench_report(struct bench **benches, uint64_t elapsed_ns)
+{
+	struct bench_op_stats stats[BENCH_NR_OPS], total;
+	double secs = elapsed_ns / 1e9, job_secs;
+	uint64_t submitted = 0, cmds;
+	unsigned int job;
+	int op;
+
+	if (secs <= 0)
+		secs = 1e-9;
+
+	memset(stats, 0, sizeof(stats));
+	memset(&total, 0, sizeof(total));
+
+	for (job = 0; job < nr_jobs; job++) {
+		submitted += benches[job]->submitted;
+		for (op = 0; op < BENCH_NR_OPS; op++)
+			bench_add_stats(&stats[op], &benches[job]->stats[op]);
+	}
+
+	printf("%s: %"PRIu64" cmds in %.2f secs, %u job%s, queue depth %u, %u byte %s cmds\n\n",
+	       bench_handler->subtype, submitted, secs, nr_jobs,
+	       nr_jobs > 1 ? "s" : "", queue_depth, xfer_size,
+	       sequential ? "sequential" : "random");
+	printf("%-6s %10s %8s %10s %9s %9s %9s %9s %9s %9s\n", "op", "cmds",
+	       "errors", "IOPS", "MiB/s", "avg_us", "p50_us", "p99_us",
+	       "p99.9_us", "max_us");
+
+	for (op = 0; op < BENCH_NR_OPS; op++) {
+		if (!op_mix[op])
+			continue;
+		bench_print_line(bench_op_names[op], &stats[op], secs);
+		bench_add_stats(&total, &stats[op]);
+	}
+	bench_print_line("total", &total, secs);
+
+	if (nr_jobs == 1)
+		return;
+
+	printf("\n%-6s %6s %10s\n", "job", "cpu", "IOPS");
+	for (job = 0; job < nr_jobs; job++) {
+		job_secs = benches[job]->elapsed_ns / 1e9;
+		if (job_secs <= 0)
+			job_secs = 1e-9;
+
+		cmds = 0;
+		for (op = 0; op < BENCH_NR_OPS; op++)
+			cmds += benches[job]->stats[op].cmds;
+		printf("%-6u %6d %10.0f\n", job, benches[job]->cpu,
+		       cmds / job_secs);
+	}
+	printf("%-6s %6s %10.0f\n", "perjob", "", total.cmds / secs / nr_jobs);
+}
+
+/* Set up job's device on its own in memory ring */
+static struct bench *bench_create(unsigned int job)
+{
+	struct tcmu_device *dev;
+	struct bench *b;
+	int op;
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return NULL;
+	b->job = job;
+	b->cpu = pin_jobs ? bench_pick_cpu(job) : -1;
+	b->seed = getpid() + job;
+	for (op = 0; op < BENCH_NR_OPS; op++)
+		b->mix_total += op_mix[op];
+
+	dev = &b->dev;
+	darray_init(b->ctx.devices);
+	darray_append(b->ctx.devices, dev);
+	b->lib_handler.name = bench_handler->name;
+	b->lib_handler.subtype = bench_handler->subtype;
+	b->lib_handler.ctx = &b->ctx;
+	b->lib_handler.hm_private = bench_handler;
+
+	dev->fd = -1;
+	dev->ctx = &b->ctx;
+	dev->handler = &b->lib_handler;
+	snprintf(dev->dev_name, sizeof(dev->dev_name), "bench%u", job);
+	snprintf(dev->cfgstring, sizeof(dev->cfgstring), "%s", cfgstring);
+	if (tcm_hba_name)
+		snprintf(dev->tcm_hba_name, sizeof(dev->tcm_hba_name), "%s",
+			 tcm_hba_name);
+	if (tcm_dev_name)
+		snprintf(dev->tcm_dev_name, sizeof(dev->tcm_dev_name), "%s",
+			 tcm_dev_name);
+
+	if (op_mix[BENCH_XCOPY] &&
+	    (!tcm_hba_name || !tcm_dev_name || bench_get_wwn(b))) {
+		fprintf(stderr, "XCOPY cmds need --tcm-hba and --tcm-dev of an existing user backstore\n");
+		goto free_ctx;
+	}
+
+	if (bench_setup_ring(b))
+		goto cleanup_ring;
+
+	if (bench_dev_open(b))
+		goto cleanup_ring;
+
+	return b;
+
+cleanup_ring:
+	bench_cleanup_ring(b);
+free_ctx:
+	darray_free(b->ctx.devices);
+	free(b);
+	return NULL;
+}
+
+static void bench_destroy(struct bench *b)
+{
+	bench_dev_close(b);
+	bench_cleanup_ring(b);
+	darray_free(b->ctx.devices);
+	free(b);
+}
+
+/* Parse a size with an optional k, m, g or t suffix */
+static int parse_size(const char *str, uint64_t *size)
+{
+	char *end;
+	uint64_t val;
+
+	errno = 0;
+	val = strtoull(str, &end, 0);
+	if (errno || end == str)
+		return -EINVAL;
+
+	switch (*end) {
+	case 't': case 'T':
+		val <<= 10;
+		/* fall through */
+	case 'g': case 'G':
+		val <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		val <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		val <<= 10;
+		end++;
+		break;
+	}
+
+	if (*end)
+		return -EINVAL;
+	*size = val;
+	return 0;
+}
+
+/* Parse a mix like "read=70,write=20,unmap=10" */
+static int parse_mix(char *str)
+{
+	char *tok, *save, *val;
+	int op;
+
+	memset(op_mix, 0, sizeof(op_mix));
+
+	for (tok = strtok_r(str, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		val = strchr(tok, '=');
+		if (!val)
+			return -EINVAL;
+		*val++ = '\0';
+
+		for (op = 0; op < BENCH_NR_OPS; op++) {
+			if (!strcmp(tok, bench_op_names[op]))
+				break;
+		}
+		if (op == BENCH_NR_OPS)
+			return -EINVAL;
+
+		op_mix[op] = strtoul(val, NULL, 0);
+	}
+
+	return 0;
+}
+
+static void usage(void) {
+	printf("\nusage:\n");
+	printf("\ttcmu-bench [options] -H <handler.so> -c <cfgstring>\n");
+	printf("\noptions:\n");
+	printf("\t-h, --help: print this message and exit\n");
+	printf("\t-V, --version: print version and exit\n");
+	printf("\t-d, --debug: enable debug messages\n");
+	printf("\t-H, --handler=<path>: handler .so to load\n");
+	printf("\t-c, --cfgstring=<string>: handler cfgstring, e.g. file//tmp/bench.img\n");
+	printf("\t-s, --size=<bytes>: device size (default 1G)\n");
+	printf("\t-b, --block-size=<bytes>: logical block size (default 512)\n");
+	printf("\t-x, --xfer-size=<bytes>: bytes per cmd (default 4k)\n");
+	printf("\t-q, --queue-depth=<N>: cmds kept on the ring (default 32)\n");
+	printf("\t-t, --time=<secs>: run time, 0 to only stop after --ops (default 10)\n");
+	printf("\t-n, --ops=<N>: stop after N cmds\n");
+	printf("\t-m, --mix=<op=weight,...>: weights for read, write, unmap, caw\n");
+	printf("\t                           and xcopy cmds (default read=70,write=30)\n");
+	printf("\t-S, --sequential: sequential instead of random LBAs\n");
+	printf("\t-j, --jobs=<N>: run N devices on the same cfgstring, each driven\n");
+	printf("\t                           by its own thread pinned to a cpu\n");
+	printf("\t--tcm-hba=<name> --tcm-dev=<name>: configfs backstore to take the\n");
+	printf("\t                           WWN XCOPY cmds are sent to, e.g. user_1 and disk0\n");
+	printf("\n");
+}
+
+enum {
+	OPT_TCM_HBA = 256,
+	OPT_TCM_DEV,
+};
+
+static struct option long_options[] = {
+	{"debug", no_argument, 0, 'd'},
+	{"handler", required_argument, 0, 'H'},
+	{"cfgstring", required_argument, 0, 'c'},
+	{"size", required_argument, 0, 's'},
+	{"block-size", required_argument, 0, 'b'},
+	{"xfer-size", required_argument, 0, 'x'},
+	{"queue-depth", required_argument, 0, 'q'},
+	{"time", required_argument, 0, 't'},
+	{"ops", required_argument, 0, 'n'},
+	{"mix", required_argument, 0, 'm'},
+	{"sequential", no_argument, 0, 'S'},
+	{"jobs", required_argument, 0, 'j'},
+	{"tcm-hba", required_argument, 0, OPT_TCM_HBA},
+	{"tcm-dev", required_argument, 0, OPT_TCM_DEV},
+	{"help", no_argument, 0, 'h'},
+	{"version", no_argument, 0, 'V'},
+	{0, 0, 0, 0},
+};
+
+int main(int argc, char **argv)
+{
+	struct bench **benches;
+	unsigned int job, nr_open = 0, nr_started, mix_total = 0;
+	uint64_t val, elapsed_ns = 0;
+	int op, ret = 1;
+
+	while (1) {
+		int option_index = 0;
+		int c;
+
+		c = getopt_long(argc, argv, "dH:c:s:b:x:q:t:n:m:Sj:hV",
+				long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'd':
+			tcmu_set_log_level(TCMU_LOG_DEBUG);
+			break;
+		case 'H':
+			handler_file = optarg;
+			break;
+		case 'c':
+			cfgstring = optarg;
+			break;
+		case 's':
+			if (parse_size(optarg, &dev_size))
+				goto bad_arg;
+			break;
+		case 'b':
+			if (parse_size(optarg, &val) || val < 512 ||
+			    val & (val - 1) || val > 65536)
+				goto bad_arg;
+			block_size = val;
+			break;
+		case 'x':
+			if (parse_size(optarg, &val) || !val ||
+			    val > 64 * 1024 * 1024)
+				goto bad_arg;
+			xfer_size = val;
+			break;
+		case 'q':
+			queue_depth = strtoul(optarg, NULL, 0);
+			if (!queue_depth || queue_depth > BENCH_MAX_QUEUE_DEPTH)
+				goto bad_arg;
+			break;
+		case 't':
+			run_secs = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			max_ops = strtoull(optarg, NULL, 0);
+			break;
+		case 'm':
+			if (parse_mix(optarg))
+				goto bad_arg;
+			break;
+		case 'S':
+			sequential = true;
+			break;
+		case 'j':
+			nr_jobs = strtoul(optarg, NULL, 0);
+			if (!nr_jobs || nr_jobs > BENCH_MAX_JOBS)
+				goto bad_arg;
+			pin_jobs = true;
+			break;
+		case OPT_TCM_HBA:
+			tcm_hba_name = optarg;
+			break;
+		case OPT_TCM_DEV:
+			tcm_dev_name = optarg;
+			break;
+		case 'V':
+			printf("tcmu-bench %s\n", TCMUR_VERSION);
+			exit(0);
+		default:
+		case 'h':
+			usage();
+			exit(0);
+		}
+	}
+
+	if (!handler_file || !cfgstring) {
+		usage();
+		exit(1);
+	}
+
+	if (xfer_size % block_size || xfer_size / block_size > UINT16_MAX ||
+	    dev_size / block_size < xfer_size / block_size) {
+		fprintf(stderr, "xfer size must be a multiple of the block size, up to 65535 blocks and fit on the device\n");
+		exit(1);
+	}
+	if (!run_secs && !max_ops) {
+		fprintf(stderr, "--time or --ops is needed to stop the run\n");
+		exit(1);
+	}
+
+	for (op = 0; op < BENCH_NR_OPS; op++)
+		mix_total += op_mix[op];
+	if (!mix_total) {
+		fprintf(stderr, "--mix has no cmds in it\n");
+		exit(1);
+	}
+
+	benches = calloc(nr_jobs, sizeof(*benches));
+	if (!benches)
+		exit(1);
+
+	if (bench_load_handler(handler_file))
+		goto free_benches;
+
+	if (strncmp(cfgstring, bench_handler->subtype,
+		    strlen(bench_handler->subtype)) ||
+	    cfgstring[strlen(bench_handler->subtype)] != '/') {
+		fprintf(stderr, "cfgstring must start with %s/\n",
+			bench_handler->subtype);
+		goto free_benches;
+	}
+
+	for (nr_open = 0; nr_open < nr_jobs; nr_open++) {
+		benches[nr_open] = bench_create(nr_open);
+		if (!benches[nr_open])
+			goto destroy_benches;
+	}
+
+	if (!pin_jobs) {
+		benches[0]->run_ret = bench_run(benches[0],
+						&benches[0]->elapsed_ns);
+	} else {
+		for (nr_started = 0; nr_started < nr_jobs; nr_started++) {
+			if (pthread_create(&benches[nr_started]->thread, NULL,
+					   bench_thread, benches[nr_started])) {
+				tcmu_err("Could not start job %u\n",
+					 nr_started);
+				break;
+			}
+		}
+		for (job = 0; job < nr_started; job++)
+			pthread_join(benches[job]->thread, NULL);
+		if (nr_started < nr_jobs)
+			goto destroy_benches;
+	}
+
+	for (job = 0; job < nr_jobs; job++) {
+		if (benches[job]->run_ret)
+			goto destroy_benches;
+		if (benches[job]->elapsed_ns > elapsed_ns)
+			elapsed_ns = benches[job]->elapsed_ns;
+	}
+	bench_report(benches, elapsed_ns);
+	ret = 0;
+
+destroy_benches:
+	for (job = 0; job < nr_open; job++)
+		bench_destroy(benches[job]);
+free_benches:
+	free(benches);
+	return ret;
+
+bad_arg:
+	fprintf(stderr, "Invalid argument %s\n", optarg);
+	exit(1);
+}
@@ -0,0 +1,525 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Microbenchmarks for the per command helpers in api.c and libtcmu: cdb
+ * decoding, iovec walking, comparing and copying, completing a cmd on
+ * the ring and queueing a log message.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <scsi/scsi.h>
+
+#include "libtcmu.h"
+#include "libtcmu_log.h"
+#include "libtcmu_priv.h"
+#include "libtcmu_common.h"
+#include "target_core_user_local.h"
+#include "scsi_defs.h"
+#include "version.h"
+
+static unsigned int run_msecs = 200;
+static const char *filter;
+static char *log_dir;
+
+/* Keeps the helpers' results live so they are not optimized away */
+static volatile uint64_t sink;
+
+/* One iovec shape: iov_cnt equal segments covering size bytes */
+struct mb_buf {
+	size_t iov_cnt;
+	size_t size;
+	struct iovec *iov;
+	struct iovec *work;	/* consumed by the seek and copy helpers */
+	char *data;
+	char *flat;
+	struct tcmu_pi_tuple *pi;	/* one per 512 byte block of data */
+};
+
+static const size_t mb_segs[] = { 1, 16, 256 };
+static const size_t mb_sizes[] = { 512, 4096, 65536, 262144, 1048576 };
+
+static uint64_t mb_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Call fn in growing batches until run_msecs have passed and print the
+ * time per call. bytes is the data each call touches, 0 if none.
+ */
+static void mb_run(const char *name, uint64_t (*fn)(void *), void *arg,
+		   size_t iov_cnt, size_t bytes)
+{
+	uint64_t start, elapsed, iters = 0, batch = 1, i;
+	double ns;
+
+	if (filter && !strstr(name, filter))
+		return;
+
+	/* warm up caches and the branch predictor */
+	for (i = 0; i < 16; i++)
+		sink += fn(arg);
+
+	start = mb_now_ns();
+	do {
+		for (i = 0; i < batch; i++)
+			sink += fn(arg);
+		iters += batch;
+		if (batch < (1 << 16))
+			batch *= 2;
+		elapsed = mb_now_ns() - start;
+	} while (elapsed < run_msecs * 1000000ULL);
+
+	ns = (double)elapsed / iters;
+	if (bytes)
+		printf("%-24s %6zu %8zu %12.1f %10.1f\n", name, iov_cnt, bytes,
+		       ns, bytes / ns * 1e9 / (1024 * 1024));
+	else
+		printf("%-24s %6s %8s %12.1f %10s\n", name, "-", "-", ns, "-");
+}
+
+/* CDBs of the common commands, cycled through by the cdb benchmarks */
+static uint8_t mb_cdbs[][16] = {
+	{ READ_10, 0, 0, 0, 0x10, 0, 0, 0, 8, 0 },
+	{ WRITE_10, 0, 0, 0, 0x20, 0, 0, 0, 8, 0 },
+	{ READ_16, 0, 0, 0, 0, 0, 0, 0, 0x10, 0, 0, 0, 0, 8, 0, 0 },
+	{ WRITE_16, 0, 0, 0, 0, 0, 0, 0, 0x20, 0, 0, 0, 1, 0, 0, 0 },
+	{ COMPARE_AND_WRITE, 0, 0, 0, 0, 0, 0, 0, 0x30, 0, 0, 0, 0, 1, 0, 0 },
+	{ WRITE_SAME_16, 0x08, 0, 0, 0, 0, 0, 0, 0x40, 0, 0, 0, 0x10, 0, 0, 0 },
+	{ SYNCHRONIZE_CACHE, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+	{ READ_6, 0, 0x10, 0, 8, 0 },
+};
+#define MB_NR_CDBS (sizeof(mb_cdbs) / sizeof(mb_cdbs[0]))
+static unsigned int mb_cdb_idx;
+
+static uint8_t *mb_next_cdb(void)
+{
+	return mb_cdbs[mb_cdb_idx++ % MB_NR_CDBS];
+}
+
+static uint64_t mb_cdb_get_length(void *arg)
+{
+	return tcmu_cdb_get_length(mb_next_cdb());
+}
+
+static uint64_t mb_cdb_get_lba(void *arg)
+{
+	return tcmu_cdb_get_lba(mb_next_cdb());
+}
+
+static uint64_t mb_cdb_get_xfer_length(void *arg)
+{
+	return tcmu_cdb_get_xfer_length(mb_next_cdb());
+}
+
+static int mb_buf_init(struct mb_buf *buf, size_t iov_cnt, size_t size)
+{
+	size_t seg = size / iov_cnt, i;
+
+	memset(buf, 0, sizeof(*buf));
+	buf->iov_cnt = iov_cnt;
+	buf->size = size;
+
+	buf->iov = calloc(iov_cnt, sizeof(*buf->iov));
+	buf->work = calloc(iov_cnt, sizeof(*buf->work));
+	if (!buf->iov || !buf->work)
+		return -ENOMEM;
+
+	/* zeroed, like a freshly mapped data area */
+	buf->data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (buf->data == MAP_FAILED) {
+		buf->data = NULL;
+		return -errno;
+	}
+
+	buf->flat = calloc(1, size);
+	buf->pi = calloc(size / 512, sizeof(*buf->pi));
+	if (!buf->flat || !buf->pi)
+		return -ENOMEM;
+
+	for (i = 0; i < iov_cnt; i++) {
+		buf->iov[i].iov_base = buf->data + i * seg;
+		buf->iov[i].iov_len = seg;
+	}
+	return 0;
+}
+
+static void mb_buf_free(struct mb_buf *buf)
+{
+	if (buf->data)
+		munmap(buf->data, buf->size);
+	free(buf->flat);
+	free(buf->pi);
+	free(buf->iov);
+	free(buf->work);
+}
+
+/* Reset the iovec a consuming helper will walk, like a fresh cmd has */
+static struct iovec *mb_buf_work(struct mb_buf *buf)
+{
+	memcpy(buf->work, buf->iov, buf->iov_cnt * sizeof(*buf->iov));
+	return buf->work;
+}
+
+static uint64_t mb_iovec_length(void *arg)
+{
+	struct mb_buf *buf = arg;
+
+	return tcmu_iovec_length(buf->iov, buf->iov_cnt);
+}
+
+static uint64_t mb_iovec_seek(void *arg)
+{
+	struct mb_buf *buf = arg;
+
+	return tcmu_iovec_seek(mb_buf_work(buf), buf->size / 2 + 1);
+}
+
+static uint64_t mb_iovec_compare(void *arg)
+{
+	struct mb_buf *buf = arg;
+
+	return tcmu_iovec_compare(buf->flat, buf->iov, buf->size);
+}
+
+static uint64_t mb_iovec_zeroed(void *arg)
+{
+	struct mb_buf *buf = arg;
+
+	return tcmu_iovec_zeroed(buf->iov, buf->iov_cnt);
+}
+
+static uint64_t mb_memcpy_into_iovec(void *arg)
+{
+	struct mb_buf *buf = arg;
+
+	return tcmu_memcpy_into_iovec(mb_buf_work(buf), buf->iov_cnt,
+				      buf->flat, buf->size);
+}
+
+static uint64_t mb_memcpy_from_iovec(void *arg)
+{
+	struct mb_buf *buf = arg;
+
+	return tcmu_memcpy_from_iovec(buf->flat, buf->size, mb_buf_work(buf),
+				      buf->iov_cnt);
+}
+
+static uint64_t mb_crc32c(void *arg)
+{
+	struct mb_buf *buf = arg;
+
+	return tcmu_crc32c(~0U, buf->flat, buf->size);
+}
+
+static uint64_t mb_crc_t10dif(void *arg)
+{
+	struct mb_buf *buf = arg;
+
+	return tcmu_crc_t10dif(0, buf->flat, buf->size);
+}
+
+#define MB_PI_LBA	0x1000
+
+static uint64_t mb_pi_generate(void *arg)
+{
+	struct mb_buf *buf = arg;
+
+	tcmu_pi_generate(buf->pi, buf->iov, buf->iov_cnt, 512, MB_PI_LBA,
+			 buf->size / 512);
+	return buf->pi[0].guard;
+}
+
+static uint64_t mb_pi_verify(void *arg)
+{
+	struct mb_buf *buf = arg;
+	uint32_t bad_block;
+
+	return tcmu_pi_verify(buf->pi, buf->iov, buf->iov_cnt, 512,
+			      MB_PI_LBA, buf->size / 512, &bad_block);
+}
+
+static void mb_run_iovecs(void)
+{
+	struct mb_buf buf;
+	size_t s, z;
+	int ret;
+
+	for (s = 0; s < sizeof(mb_segs) / sizeof(mb_segs[0]); s++) {
+		for (z = 0; z < sizeof(mb_sizes) / sizeof(mb_sizes[0]); z++) {
+			/* segments are at least a sector, like the kernel's */
+			if (mb_sizes[z] < mb_segs[s] * 512)
+				continue;
+
+			ret = mb_buf_init(&buf, mb_segs[s], mb_sizes[z]);
+			if (ret) {
+				fprintf(stderr, "Could not allocate %zu byte buffer: %d\n",
+					mb_sizes[z], ret);
+				mb_buf_free(&buf);
+				continue;
+			}
+
+#define MB_RUN_IOVEC(fn, bytes) \
+	mb_run(#fn, mb_##fn, &buf, buf.iov_cnt, bytes)
+
+			MB_RUN_IOVEC(iovec_length, 0);
+			MB_RUN_IOVEC(iovec_seek, 0);
+			MB_RUN_IOVEC(iovec_compare, buf.size);
+			MB_RUN_IOVEC(iovec_zeroed, buf.size);
+			MB_RUN_IOVEC(memcpy_into_iovec, buf.size);
+			MB_RUN_IOVEC(memcpy_from_iovec, buf.size);
+			/* flat checksums only once, they ignore the iovec */
+			if (s == 0) {
+				MB_RUN_IOVEC(crc32c, buf.size);
+				MB_RUN_IOVEC(crc_t10dif, buf.size);
+			}
+			MB_RUN_IOVEC(pi_generate, buf.size);
+			/* checks every tuple, as generated above */
+			MB_RUN_IOVEC(pi_verify, buf.size);
+#undef MB_RUN_IOVEC
+
+			mb_buf_free(&buf);
+		}
+	}
+}
+
+/*
+ * tcmu_sts_to_scsi is private to libtcmu, so it is measured where it
+ * runs: completing a cmd on the ring. Each call queues one entry as the
+ * kernel would, fetches it and completes it with the next status.
+ */
+struct mb_ring {
+	struct tcmu_device dev;
+	struct tcmu_cmd_entry *tmpl;
+	uint32_t entry_size;
+	const int *sts;
+	unsigned int nr_sts;
+	unsigned int sts_idx;
+};
+
+static const int mb_sts_ok[] = { TCMU_STS_OK };
+static const int mb_sts_err[] = {
+	TCMU_STS_RANGE, TCMU_STS_MISCOMPARE, TCMU_STS_WR_ERR,
+	TCMU_STS_INVALID_CDB, TCMU_STS_NO_RESOURCE, TCMU_STS_BUSY,
+};
+
+static int mb_ring_init(struct mb_ring *ring)
+{
+	struct tcmu_mailbox *mb;
+	size_t map_len = 3 * 4096;
+
+	memset(ring, 0, sizeof(*ring));
+
+	mb = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (mb == MAP_FAILED)
+		return -errno;
+
+	ring->entry_size = round_up(sizeof(struct tcmu_cmd_entry),
+				    TCMU_OP_ALIGN_SIZE);
+	mb->version = TCMU_MAILBOX_VERSION;
+	mb->flags = TCMU_MAILBOX_FLAG_CAP_OOOC;
+	mb->cmdr_off = 4096;
+	/* a whole number of entries, so the ring never needs padding */
+	mb->cmdr_size = 4096 / ring->entry_size * ring->entry_size;
+
+	ring->dev.fd = -1;
+	ring->dev.map = mb;
+	ring->dev.map_len = map_len;
+
+	/* The cdb lives in the data area and all entries point to it */
+	memcpy((char *)mb + 2 * 4096, mb_cdbs[2], 16);
+
+	ring->tmpl = calloc(1, ring->entry_size);
+	if (!ring->tmpl) {
+		munmap(mb, map_len);
+		return -ENOMEM;
+	}
+	ring->tmpl->hdr.len_op = ring->entry_size | TCMU_OP_CMD;
+	ring->tmpl->req.cdb_off = 2 * 4096;
+	return 0;
+}
+
+static void mb_ring_free(struct mb_ring *ring)
+{
+	munmap(ring->dev.map, ring->dev.map_len);
+	free(ring->tmpl);
+}
+
+static uint64_t mb_ring_complete(void *arg)
+{
+	struct mb_ring *ring = arg;
+	struct tcmu_mailbox *mb = ring->dev.map;
+	struct tcmulib_cmd *cmd;
+	uint32_t head = mb->cmd_head;
+
+	memcpy((char *)mb + mb->cmdr_off + head, ring->tmpl, ring->entry_size);
+	__atomic_store_n(&mb->cmd_head, (head + ring->entry_size) % mb->cmdr_size,
+			 __ATOMIC_RELEASE);
+
+	cmd = tcmulib_get_next_command(&ring->dev, 0);
+	if (!cmd)
+		return 0;
+
+	tcmulib_command_complete(&ring->dev, cmd,
+				 ring->sts[ring->sts_idx++ % ring->nr_sts]);
+	return mb->cmd_tail;
+}
+
+static void mb_run_ring(void)
+{
+	struct mb_ring ring;
+
+	if (mb_ring_init(&ring)) {
+		fprintf(stderr, "Could not set up the ring\n");
+		return;
+	}
+
+	ring.sts = mb_sts_ok;
+	ring.nr_sts = 1;
+	mb_run("ring_complete_good", mb_ring_complete, &ring, 0, 0);
+
+	ring.sts = mb_sts_err;
+	ring.nr_sts = sizeof(mb_sts_err) / sizeof(mb_sts_err[0]);
+	mb_run("ring_complete_error", mb_ring_complete, &ring, 0, 0);
+
+	mb_ring_free(&ring);
+}
+
+static uint64_t mb_log_dbg(void *arg)
+{
+	tcmu_dbg("microbench log message %u\n", mb_cdb_idx++);
+	return 0;
+}
+
+/*
+ * Debug messages only go to the log file, so with the debug level on
+ * this times queueing a message for the log thread, and with it off the
+ * level check every log call pays.
+ */
+static void mb_run_log(void)
+{
+	char tmpl[] = "/tmp/tcmu-microbench.XXXXXX";
+	char *dir = log_dir;
+	int level = tcmu_get_log_level();
+
+	if (filter && !strstr("log_enqueue log_filtered", filter))
+		return;
+
+	if (!dir) {
+		dir = mkdtemp(tmpl);
+		if (!dir) {
+			fprintf(stderr, "Could not create log dir: %d\n", errno);
+			return;
+		}
+	}
+
+	if (tcmu_setup_log(dir)) {
+		fprintf(stderr, "Could not set up logging in %s\n", dir);
+		goto rm_dir;
+	}
+
+	tcmu_set_log_level(TCMU_LOG_DEBUG);
+	mb_run("log_enqueue", mb_log_dbg, NULL, 0, 0);
+	tcmu_set_log_level(TCMU_LOG_INFO);
+	mb_run("log_filtered", mb_log_dbg, NULL, 0, 0);
+	tcmu_set_log_level(level);
+
+	tcmu_destroy_log();
+
+rm_dir:
+	if (!log_dir) {
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "%s/tcmu-runner.log", dir);
+		unlink(path);
+		rmdir(dir);
+	}
+}
+
+static void usage(void) {
+	printf("\nusage:\n");
+	printf("\ttcmu-microbench [options]\n");
+	printf("\noptions:\n");
+	printf("\t-h, --help: print this message and exit\n");
+	printf("\t-V, --version: print version and exit\n");
+	printf("\t-t, --time=<msecs>: time to run each benchmark for (default 200)\n");
+	printf("\t-f, --filter=<string>: only run benchmarks with string in their name\n");
+	printf("\t-l, --tcmu_log_dir=<path>: log dir for the log benchmarks\n");
+	printf("\t                           (default a temporary dir)\n");
+	printf("\n");
+}
+
+static struct option long_options[] = {
+	{"time", required_argument, 0, 't'},
+	{"filter", required_argument, 0, 'f'},
+	{"tcmu_log_dir", required_argument, 0, 'l'},
+	{"help", no_argument, 0, 'h'},
+	{"version", no_argument, 0, 'V'},
+	{0, 0, 0, 0},
+};
+
+int main(int argc, char **argv)
+{
+	while (1) {
+		int option_index = 0;
+		int c;
+
+		c = getopt_long(argc, argv, "t:f:l:hV",
+				long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 't':
+			run_msecs = strtoul(optarg, NULL, 0);
+			if (!run_msecs)
+				run_msecs = 1;
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'l':
+			log_dir = optarg;
+			break;
+		case 'V':
+			printf("tcmu-microbench %s\n", TCMUR_VERSION);
+			exit(0);
+		default:
+		case 'h':
+			usage();
+			exit(0);
+		}
+	}
+
+	printf("%-24s %6s %8s %12s %10s\n", "benchmark", "iovs", "bytes",
+	       "ns/op", "MiB/s");
+
+	mb_run("cdb_get_length", mb_cdb_get_length, NULL, 0, 0);
+	mb_run("cdb_get_lba", mb_cdb_get_lba, NULL, 0, 0);
+	mb_run("cdb_get_xfer_length", mb_cdb_get_xfer_length, NULL, 0, 0);
+	mb_run_iovecs();
+	mb_run_ring();
+	mb_run_log();
+
+	return 0;
+}
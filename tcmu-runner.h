@@ -50,12 +50,58 @@ struct tcmur_cmd {
 	/* Bytes to read/write from iovec */
 	size_t requested;
 
+	/*
+	 * Written by the cmdproc thread only: the timeout list link and,
+	 * in CLOCK_MONOTONIC nsecs, when the cmd was fetched from the ring
+	 * and handed to the handler. data_bytes is the data area space the
+	 * cmd's buffers take up.
+	 */
 	struct list_node cmds_list_entry;
 	struct timespec start_time;
 	bool timed_out;
+	uint64_t start_ns;
+	uint64_t dispatch_ns;
+	uint64_t data_bytes;
+
+	/* Work item used while the cmd is queued on an io work queue */
+	struct tcmu_device *work_dev;
+	int (*work_fn)(struct tcmu_device *dev, void *data);
+	void (*work_done_fn)(struct tcmu_device *dev, void *data, int rc);
+	struct list_node work_entry;
+
+	/* Link while deferred by the QoS limits. Only used by the runner. */
+	struct list_node qos_entry;
 
 	/* callback to finish/continue command processing */
 	void (*done)(struct tcmu_device *dev, struct tcmur_cmd *cmd, int ret);
+
+	/*
+	 * Written by the completing thread. Link and status while queued on
+	 * tcmur_device->compl_list, and when, in CLOCK_MONOTONIC nsecs, the
+	 * handler completed the cmd. The link is also used while a flush
+	 * waits on another one in flight, and for range lock waiters being
+	 * granted.
+	 */
+	struct tcmur_cmd *compl_next;
+	int compl_status;
+	uint64_t done_ns;
+
+	/*
+	 * LBA range lock held or waited on by the cmd, and the work to
+	 * schedule once a waiting lock is granted. Only used by the runner.
+	 */
+	struct list_node range_entry;
+	uint64_t range_lba;
+	uint64_t range_nlbas;
+	int range_state;
+	int (*range_work_fn)(struct tcmu_device *dev, void *data);
+
+	/*
+	 * The data and PI halves of a read or write on a device with
+	 * protection information, while both are in flight. Only used by
+	 * the runner.
+	 */
+	void *pi_io;
 };
 
 enum tcmur_event {
@@ -66,6 +112,15 @@ enum tcmur_event {
 
 struct tcmulib_cfg_info;
 
+/* Max length, with the terminating NUL, of a get_conn_key key */
+#define TCMUR_CONN_KEY_LEN 256
+
+/* A byte range passed to the unmap_vec callout */
+struct tcmur_unmap_range {
+	uint64_t offset;
+	uint64_t length;
+};
+
 struct tcmur_handler {
 	const char *name;	/* Human-friendly name */
 	const char *subtype;	/* Name for cfgstring matching */
@@ -96,12 +151,23 @@ struct tcmur_handler {
 
 	/*
 	 * If > 0, runner will execute up to nr_threads IO callouts from
-	 * threads.
+	 * threads. This is the default, users can override it per device
+	 * or in tcmu.conf.
 	 * if 0, runner will call IO callouts from the cmd proc thread or
 	 * completion context for compound commands.
 	 */
 	int nr_threads;
 
+	/*
+	 * Set if the handler has its own async engine that devices can opt
+	 * in to with tcmur_async_io. Those devices run without worker
+	 * threads, as if nr_threads was 0, and the handler checks
+	 * tcmur_dev_async_io to pick the engine in its callouts. If the
+	 * engine cannot be set up and the callouts block, open must call
+	 * tcmur_dev_set_blocking_io.
+	 */
+	bool async_io;
+
 	/*
 	 * handle_cmd only handlers return:
 	 *
@@ -148,6 +214,17 @@ struct tcmur_handler {
 		    struct iovec *iovec, size_t iov_cnt, size_t len, off_t off);
 	int (*write)(struct tcmu_device *dev, struct tcmur_cmd *cmd,
 		     struct iovec *iovec, size_t iov_cnt, size_t len, off_t off);
+	/*
+	 * Optional. Called from the cmdproc thread, when the device has
+	 * tcmur_read_nowait enabled, before a READ is queued to the IO
+	 * threads. It must not block: return a TCMU_STS code if the read was
+	 * completed inline, or TCMU_STS_NOT_HANDLED to have the runner queue
+	 * the read to ->read as usual. Only used when the device has worker
+	 * threads.
+	 */
+	int (*read_nowait)(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			   struct iovec *iovec, size_t iov_cnt, size_t len,
+			   off_t off);
 	int (*flush)(struct tcmu_device *dev, struct tcmur_cmd *cmd);
 	int (*unmap)(struct tcmu_device *dev, struct tcmur_cmd *cmd,
 		     uint64_t off, uint64_t len);
@@ -155,6 +232,82 @@ struct tcmur_handler {
 			 uint64_t len, struct iovec *iovec, size_t iov_cnt);
 	int (*caw)(struct tcmu_device *dev, struct tcmur_cmd *cmd, uint64_t off,
 		   uint64_t len, struct iovec *iovec, size_t iov_cnt);
+	/*
+	 * Optional. Zero len bytes at off without transferring data. Used
+	 * for WRITE SAME with an all zero pattern. TCMU_STS_NOT_HANDLED can be
+	 * returned, or completed with, to have the runner fall back to
+	 * writesame or its own emulation.
+	 */
+	int (*write_zeroes)(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			    uint64_t off, uint64_t len);
+
+	/*
+	 * Optional vectored unmap. If set, it is used instead of unmap and
+	 * is passed every range of an UNMAP or WRITE SAME with UNMAP cmd in
+	 * one call. The ranges are sorted by offset, overlapping and adjacent
+	 * ranges are merged, and they are only split up if the handler asked
+	 * for split unmaps. The cmd is completed once for the whole list.
+	 */
+	int (*unmap_vec)(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			 struct tcmur_unmap_range *ranges,
+			 unsigned int nr_ranges);
+
+	/*
+	 * Optional EXTENDED COPY offload. Copy len bytes from src_off to
+	 * dst_off within the device without the data passing through
+	 * the runner. TCMU_STS_NOT_HANDLED can be returned, or completed
+	 * with, if the backend cannot do the copy, and the runner will copy
+	 * the data with read and write instead.
+	 */
+	int (*copy)(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+		    uint64_t src_off, uint64_t dst_off, uint64_t len);
+
+	/*
+	 * Optional WRITE AND VERIFY offload. Write len bytes at off and
+	 * complete the cmd once the backend has verified they are stored,
+	 * without the runner reading them back. A miscompare is completed
+	 * with TCMU_STS_MISCOMPARE and the sense info set. TCMU_STS_NOT_HANDLED
+	 * can be returned, or completed with before anything was written,
+	 * and the runner will write and read back the data itself.
+	 */
+	int (*write_verify)(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			    struct iovec *iovec, size_t iov_cnt, size_t len,
+			    off_t off);
+
+	/*
+	 * Optional T10-PI tuple store. If both are set and the device is
+	 * opened with tcmur_pi enabled, the runner generates a tuple for
+	 * every block it writes and checks the tuples of every block it
+	 * reads, and passes them to these callouts alongside the read and
+	 * write of the data. The tuples are stored big endian, 8 bytes per
+	 * block, and blocks never written must read back as all zeros. A
+	 * NULL pi to write_pi clears the range, which the runner does for
+	 * unmapped and zeroed blocks. Open can clear tcmu_dev_set_pi_enabled
+	 * if the store is not usable.
+	 *
+	 * On these devices the read_nowait, writesame, caw, unmap_vec, copy
+	 * and write_verify callouts are not used, since they move data the
+	 * runner would not see, and the cmds are emulated with read and
+	 * write instead.
+	 */
+	int (*read_pi)(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+		       struct tcmu_pi_tuple *pi, uint64_t lba,
+		       uint32_t nr_blocks);
+	int (*write_pi)(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			const struct tcmu_pi_tuple *pi, uint64_t lba,
+			uint32_t nr_blocks);
+
+	/*
+	 * Optional. Copy a string identifying the backend connection the
+	 * device uses, like the cluster and client it logs in with, to key.
+	 * Called on an open device before it is closed for recovery. Devices
+	 * with the same key are reopened as a group: one at a time while
+	 * the connection is down, and with a shared backoff between tries.
+	 *
+	 * Return 0 on success and a -Exyz error code if the device does not
+	 * share its connection.
+	 */
+	int (*get_conn_key)(struct tcmu_device *dev, char *key, size_t len);
 
 	/*
 	 * Notify the handler of an event.
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * CPU/NUMA placement of a device's cmdproc and io worker threads.
+ *
+ * The threads bind themselves when they start. When a device is on a
+ * NUMA node they also prefer that node for the memory they fault in, so
+ * the cmd pool, io rings and handler buffers they first touch are local.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "libtcmu.h"
+#include "libtcmu_log.h"
+#include "tcmur_device.h"
+#include "tcmur_affinity.h"
+
+#define TCMUR_MAX_NUMA_NODES 1024
+#define NODE_ONLINE_PATH "/sys/devices/system/node/online"
+#define NODE_CPULIST_FMT "/sys/devices/system/node/node%d/cpulist"
+
+struct tcmur_affinity {
+	cpu_set_t cpus;
+	int node;
+};
+
+static unsigned int next_node;
+
+/*
+ * Parse a kernel style list ("0-3,8,10-11") into set. Stops at the
+ * end of the string, a ';' or a newline.
+ */
+static int parse_list(const char *str, cpu_set_t *set)
+{
+	unsigned long first, last;
+	char *end;
+
+	CPU_ZERO(set);
+
+	while (*str && *str != ';' && *str != '\n') {
+		errno = 0;
+		first = strtoul(str, &end, 10);
+		if (errno || end == str)
+			return -EINVAL;
+
+		last = first;
+		if (*end == '-') {
+			str = end + 1;
+			last = strtoul(str, &end, 10);
+			if (errno || end == str || last < first)
+				return -EINVAL;
+		}
+
+		if (last >= CPU_SETSIZE)
+			return -ERANGE;
+
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+
+		str = end;
+		if (*str == ',')
+			str++;
+	}
+
+	return CPU_COUNT(set) ? 0 : -EINVAL;
+}
+
+static int read_list(const char *path, cpu_set_t *set)
+{
+	char buf[4096];
+	size_t len;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	len = fread(buf, 1, sizeof(buf) - 1, fp);
+	fclose(fp);
+	buf[len] = '\0';
+
+	return parse_list(buf, set);
+}
+
+/* Pick the next online node, or -1 if there is only one */
+static int spread_node(void)
+{
+	cpu_set_t nodes;
+	int nr_nodes, idx, node;
+
+	if (read_list(NODE_ONLINE_PATH, &nodes))
+		return -1;
+
+	nr_nodes = CPU_COUNT(&nodes);
+	if (nr_nodes < 2)
+		return -1;
+
+	idx = __atomic_fetch_add(&next_node, 1, __ATOMIC_RELAXED) % nr_nodes;
+	for (node = 0; node < CPU_SETSIZE; node++) {
+		if (!CPU_ISSET(node, &nodes))
+			continue;
+		if (!idx--)
+			return node;
+	}
+
+	return -1;
+}
+
+int tcmur_affinity_setup(struct tcmu_device *dev, const char *policy)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_affinity *affinity;
+	char path[64];
+	char *end;
+	int ret;
+
+	if (!policy || !*policy || !strncmp(policy, "none", 4))
+		return 0;
+
+	affinity = calloc(1, sizeof(*affinity));
+	if (!affinity)
+		return -ENOMEM;
+	affinity->node = -1;
+
+	if (!strncmp(policy, "spread", 6)) {
+		affinity->node = spread_node();
+		if (affinity->node < 0) {
+			/* Nothing to spread over, leave it to the scheduler */
+			free(affinity);
+			return 0;
+		}
+	} else if (!strncmp(policy, "node:", 5)) {
+		errno = 0;
+		affinity->node = strtol(policy + 5, &end, 10);
+		if (errno || end == policy + 5 || affinity->node < 0 ||
+		    affinity->node >= TCMUR_MAX_NUMA_NODES) {
+			ret = -EINVAL;
+			goto fail;
+		}
+	} else {
+		ret = parse_list(policy, &affinity->cpus);
+		if (ret)
+			goto fail;
+	}
+
+	if (affinity->node >= 0) {
+		snprintf(path, sizeof(path), NODE_CPULIST_FMT, affinity->node);
+		ret = read_list(path, &affinity->cpus);
+		if (ret)
+			goto fail;
+	}
+
+	tcmu_dev_dbg(dev, "Binding to %d CPUs on node %d\n",
+		     CPU_COUNT(&affinity->cpus), affinity->node);
+	rdev->affinity = affinity;
+	return 0;
+
+fail:
+	tcmu_dev_err(dev, "Invalid affinity policy %s (%d)\n", policy, ret);
+	free(affinity);
+	return ret;
+}
+
+void tcmur_affinity_cleanup(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	free(rdev->affinity);
+	rdev->affinity = NULL;
+}
+
+/* Called by the device's threads on startup */
+void tcmur_affinity_bind_thread(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_affinity *affinity = rdev->affinity;
+	unsigned long nodemask[TCMUR_MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+	int ret;
+
+	if (!affinity)
+		return;
+
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(affinity->cpus),
+				     &affinity->cpus);
+	if (ret)
+		tcmu_dev_warn(dev, "Could not set thread affinity %d\n", ret);
+
+	if (affinity->node < 0)
+		return;
+
+	memset(nodemask, 0, sizeof(nodemask));
+	nodemask[affinity->node / (8 * sizeof(unsigned long))] |=
+		1UL << (affinity->node % (8 * sizeof(unsigned long)));
+
+	if (syscall(__NR_set_mempolicy, MPOL_PREFERRED, nodemask,
+		    TCMUR_MAX_NUMA_NODES + 1) < 0)
+		tcmu_dev_dbg(dev, "Could not set memory policy: %m\n");
+}
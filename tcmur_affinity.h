@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_AFFINITY_H
+#define __TCMUR_AFFINITY_H
+
+struct tcmu_device;
+
+/*
+ * Affinity policies, used for the "affinity" tcmu.conf option and the
+ * tcmur_affinity cfgstring argument:
+ *
+ *   none       - do not pin
+ *   spread     - pin each device to a NUMA node, round robin (default)
+ *   node:N     - pin to the CPUs of NUMA node N
+ *   <cpu list> - pin to a list of CPUs, e.g. "0-3,8"
+ *
+ * The policy string ends at the end of the string or at a ';'.
+ */
+
+int tcmur_affinity_setup(struct tcmu_device *dev, const char *policy);
+void tcmur_affinity_cleanup(struct tcmu_device *dev);
+void tcmur_affinity_bind_thread(struct tcmu_device *dev);
+
+#endif
@@ -11,24 +11,24 @@
 #include <assert.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <scsi/scsi.h>
 
 #include "ccan/list/list.h"
 
+#include "scsi_defs.h"
 #include "libtcmu.h"
+#include "libtcmu_common.h"
 #include "libtcmu_priv.h"
+#include "libtcmu_trace.h"
 #include "tcmur_device.h"
 #include "tcmur_aio.h"
+#include "tcmur_affinity.h"
+#include "tcmur_stats.h"
 #include "tcmu_runner_priv.h"
 #include "tcmu-runner.h"
 
-struct tcmu_work {
-	struct tcmu_device *dev;
-	void *data;
-	tcmu_work_fn_t work_fn;
-	tcmu_done_fn_t done_fn;
-	struct list_node entry;
-};
-
 static void _cleanup_mutex_lock(void *arg)
 {
 	pthread_mutex_unlock(arg);
@@ -41,13 +41,14 @@ void track_aio_request_start(struct tcmur_device *rdev)
 	pthread_cleanup_push(_cleanup_mutex_lock, (void *)&aio_track->track_lock);
 	pthread_mutex_lock(&aio_track->track_lock);
 
-	++aio_track->tracked_aio_ops;
+	if (++aio_track->tracked_aio_ops > aio_track->tracked_aio_max)
+		aio_track->tracked_aio_max = aio_track->tracked_aio_ops;
 
 	pthread_mutex_unlock(&aio_track->track_lock);
 	pthread_cleanup_pop(0);
 }
 
-void track_aio_request_finish(struct tcmur_device *rdev, int *wake_up)
+void track_aio_request_finish(struct tcmur_device *rdev)
 {
 	struct tcmu_track_aio *aio_track = &rdev->track_queue;
 	pthread_cond_t *cond;
@@ -58,11 +59,6 @@ void track_aio_request_finish(struct tcmur_device *rdev, int *wake_up)
 	assert(aio_track->tracked_aio_ops > 0);
 	--aio_track->tracked_aio_ops;
 
-	if (wake_up) {
-		++aio_track->pending_wakeups;
-		*wake_up = (aio_track->pending_wakeups == 1) ? 1 : 0;
-	}
-
 	if (!aio_track->tracked_aio_ops && aio_track->is_empty_cond) {
 		cond = aio_track->is_empty_cond;
 		aio_track->is_empty_cond = NULL;
@@ -73,26 +69,6 @@ void track_aio_request_finish(struct tcmur_device *rdev, int *wake_up)
 	pthread_cleanup_pop(0);
 }
 
-void track_aio_wakeup_finish(struct tcmur_device *rdev, int *wake_up)
-{
-	struct tcmu_track_aio *aio_track = &rdev->track_queue;
-
-	pthread_cleanup_push(_cleanup_mutex_lock, (void *)&aio_track->track_lock);
-	pthread_mutex_lock(&aio_track->track_lock);
-
-	if (aio_track->pending_wakeups > 1) {
-		aio_track->pending_wakeups = 1;
-		*wake_up = 1;
-	} else {
-		assert(aio_track->pending_wakeups > 0);
-		aio_track->pending_wakeups = 0;
-		*wake_up = 0;
-	}
-
-	pthread_mutex_unlock(&aio_track->track_lock);
-	pthread_cleanup_pop(0);
-}
-
 static void cleanup_empty_queue_wait(void *arg)
 {
 	struct tcmu_track_aio *aio_track = arg;
@@ -133,94 +109,395 @@ unlock:
 	return ret;
 }
 
-static void _cleanup_io_work(void *arg)
+static void tcmu_io_ring_init(struct tcmu_io_ring *ring,
+			      struct tcmu_io_ring_cell *cells)
 {
-	free(arg);
+	uint32_t i;
+
+	ring->cells = cells;
+	for (i = 0; i < TCMU_IO_RING_SIZE; i++)
+		ring->cells[i].seq = i;
+	ring->enq_pos = 0;
+	ring->deq_pos = 0;
 }
 
-static void *io_work_queue(void *arg)
+/*
+ * Each cell's seq tells producers and consumers whose turn it is: seq ==
+ * pos means the cell is free for the enqueuer at pos, seq == pos + 1 means
+ * it holds the cmd queued at pos.
+ */
+static bool tcmu_io_ring_push(struct tcmu_io_ring *ring,
+			      struct tcmur_cmd *tcmur_cmd)
 {
-	struct tcmu_device *dev = arg;
-	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
-	struct tcmu_io_queue *io_wq = &rdev->work_queue;
-	int ret;
-
-	tcmu_set_thread_name("aio", dev);
+	struct tcmu_io_ring_cell *cell;
+	uint32_t pos, seq;
+	int32_t dif;
 
+	pos = __atomic_load_n(&ring->enq_pos, __ATOMIC_RELAXED);
 	while (1) {
-		struct tcmu_work *work;
-		void *data;
+		cell = &ring->cells[pos & (TCMU_IO_RING_SIZE - 1)];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (int32_t)(seq - pos);
+		if (!dif) {
+			if (__atomic_compare_exchange_n(&ring->enq_pos, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return false;
+		} else {
+			pos = __atomic_load_n(&ring->enq_pos, __ATOMIC_RELAXED);
+		}
+	}
 
-		pthread_cleanup_push(_cleanup_mutex_lock, &io_wq->io_lock);
-		pthread_mutex_lock(&io_wq->io_lock);
+	cell->cmd = tcmur_cmd;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static struct tcmur_cmd *tcmu_io_ring_pop(struct tcmu_io_ring *ring)
+{
+	struct tcmu_io_ring_cell *cell;
+	struct tcmur_cmd *tcmur_cmd;
+	uint32_t pos, seq;
+	int32_t dif;
 
-		while (list_empty(&io_wq->io_queue)) {
-			pthread_cond_wait(&io_wq->io_cond,
-					  &io_wq->io_lock);
+	pos = __atomic_load_n(&ring->deq_pos, __ATOMIC_RELAXED);
+	while (1) {
+		cell = &ring->cells[pos & (TCMU_IO_RING_SIZE - 1)];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (int32_t)(seq - (pos + 1));
+		if (!dif) {
+			if (__atomic_compare_exchange_n(&ring->deq_pos, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&ring->deq_pos, __ATOMIC_RELAXED);
 		}
+	}
 
-		work = list_first_entry(&io_wq->io_queue, struct tcmu_work,
-					entry);
-		list_del(&work->entry);
+	tcmur_cmd = cell->cmd;
+	__atomic_store_n(&cell->seq, pos + TCMU_IO_RING_SIZE, __ATOMIC_RELEASE);
+	return tcmur_cmd;
+}
 
-		pthread_mutex_unlock(&io_wq->io_lock);
-		pthread_cleanup_pop(0);
+static const unsigned int io_prio_weights[TCMU_IO_NR_PRIOS] = {
+	[TCMU_IO_PRIO_HIGH]	= TCMU_IO_PRIO_HIGH_WEIGHT,
+	[TCMU_IO_PRIO_NORMAL]	= TCMU_IO_PRIO_NORMAL_WEIGHT,
+	[TCMU_IO_PRIO_BG]	= TCMU_IO_PRIO_BG_WEIGHT,
+};
 
-		/* kick start I/O request */
-		data = work->data;
-		pthread_cleanup_push(_cleanup_io_work, work);
+/*
+ * The class comes from the cmd the initiator sent, so the chunks and
+ * steps of emulated cmds, which share their parent's lib_cmd, end up in
+ * the same class as the parent.
+ */
+static int io_prio_classify(struct tcmu_device *dev,
+			    struct tcmur_cmd *tcmur_cmd)
+{
+	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+	uint64_t length;
+
+	if (!cmd)
+		return TCMU_IO_PRIO_NORMAL;
+
+	switch (cmd->cdb[0]) {
+	case COMPARE_AND_WRITE:
+	case SYNCHRONIZE_CACHE:
+	case SYNCHRONIZE_CACHE_16:
+		return TCMU_IO_PRIO_HIGH;
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+	case EXTENDED_COPY:
+	case FORMAT_UNIT:
+	case UNMAP:
+		return TCMU_IO_PRIO_BG;
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+		/* merged requests carry the length of the whole run */
+		length = tcmur_cmd->requested;
+		if (!length)
+			length = tcmu_lba_to_byte(dev,
+					tcmu_cdb_get_xfer_length(cmd->cdb));
+		if (length <= TCMU_IO_PRIO_SMALL_IO)
+			return TCMU_IO_PRIO_HIGH;
+		return TCMU_IO_PRIO_NORMAL;
+	default:
+		return TCMU_IO_PRIO_NORMAL;
+	}
+}
+
+/* Must be called with io_lock held */
+static struct tcmur_cmd *io_overflow_pop(struct tcmu_io_queue *io_wq, int prio)
+{
+	struct tcmur_cmd *tcmur_cmd;
+
+	tcmur_cmd = list_pop(&io_wq->io_queue[prio], struct tcmur_cmd,
+			     work_entry);
+	if (tcmur_cmd)
+		__atomic_sub_fetch(&io_wq->nr_overflow[prio], 1,
+				   __ATOMIC_SEQ_CST);
+	return tcmur_cmd;
+}
+
+/*
+ * Cmds only overflow when every ring of their class is full, so they are
+ * older than anything in those rings and are picked up first.
+ */
+static struct tcmur_cmd *io_prio_pop(struct tcmu_io_queue *io_wq,
+				     unsigned int idx, int prio, bool locked)
+{
+	struct tcmur_cmd *tcmur_cmd = NULL;
+	int i;
+
+	if (__atomic_load_n(&io_wq->nr_overflow[prio], __ATOMIC_RELAXED)) {
+		if (locked) {
+			tcmur_cmd = io_overflow_pop(io_wq, prio);
+		} else {
+			pthread_cleanup_push(_cleanup_mutex_lock,
+					     &io_wq->io_lock);
+			pthread_mutex_lock(&io_wq->io_lock);
+
+			tcmur_cmd = io_overflow_pop(io_wq, prio);
 
-		ret = work->work_fn(work->dev, data);
-		work->done_fn(dev, data, ret);
+			pthread_mutex_unlock(&io_wq->io_lock);
+			pthread_cleanup_pop(0);
+		}
+		if (tcmur_cmd)
+			return tcmur_cmd;
+	}
 
-		pthread_cleanup_pop(1); /* cleanup work */
+	/* Take work from our own ring first, then steal from the others */
+	for (i = 0; i < io_wq->nr_workers; i++) {
+		tcmur_cmd = tcmu_io_ring_pop(
+			&io_wq->workers[(idx + i) % io_wq->nr_workers].rings[prio]);
+		if (tcmur_cmd)
+			return tcmur_cmd;
 	}
 
 	return NULL;
 }
 
-static int aio_queue(struct tcmu_device *dev, void *data, tcmu_work_fn_t work_fn,
-		     tcmu_done_fn_t done_fn)
+/*
+ * Weighted round robin over the classes. The first pass only looks at
+ * classes with credits left this round. If none of them has work, the
+ * round is over and the second pass looks at everything, so a class is
+ * never kept waiting while its worker has nothing else to do.
+ *
+ * A worker only takes a TCMU_IO_PRIO_BG cmd while fewer than bg_max of
+ * them run, which it gives back with io_bg_put() when work_fn returns.
+ */
+static struct tcmur_cmd *io_dequeue(struct tcmu_io_queue *io_wq,
+				    struct tcmu_io_worker *worker, bool locked,
+				    int *prio_out)
 {
-	struct tcmu_work *work;
+	struct tcmur_cmd *tcmur_cmd;
+	int pass, prio;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (prio = 0; prio < TCMU_IO_NR_PRIOS; prio++) {
+			if (!pass && !worker->credits[prio])
+				continue;
+
+			if (prio == TCMU_IO_PRIO_BG &&
+			    __atomic_add_fetch(&io_wq->bg_running, 1,
+					       __ATOMIC_SEQ_CST) > io_wq->bg_max) {
+				__atomic_sub_fetch(&io_wq->bg_running, 1,
+						   __ATOMIC_SEQ_CST);
+				continue;
+			}
+
+			tcmur_cmd = io_prio_pop(io_wq, worker->idx, prio,
+						locked);
+			if (tcmur_cmd) {
+				if (worker->credits[prio])
+					worker->credits[prio]--;
+				*prio_out = prio;
+				return tcmur_cmd;
+			}
+
+			if (prio == TCMU_IO_PRIO_BG)
+				__atomic_sub_fetch(&io_wq->bg_running, 1,
+						   __ATOMIC_SEQ_CST);
+		}
+
+		if (!pass)
+			memcpy(worker->credits, io_prio_weights,
+			       sizeof(worker->credits));
+	}
+
+	return NULL;
+}
+
+/*
+ * Another worker may have left a background cmd queued because we held
+ * the last slot, so let an idle one look again.
+ */
+static void io_bg_put(struct tcmu_io_queue *io_wq)
+{
+	__atomic_sub_fetch(&io_wq->bg_running, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&io_wq->nr_idle, __ATOMIC_SEQ_CST))
+		return;
+
+	pthread_cleanup_push(_cleanup_mutex_lock, &io_wq->io_lock);
+	pthread_mutex_lock(&io_wq->io_lock);
+
+	pthread_cond_signal(&io_wq->io_cond);
+
+	pthread_mutex_unlock(&io_wq->io_lock);
+	pthread_cleanup_pop(0);
+}
+
+static struct tcmur_cmd *io_work_wait(struct tcmu_io_queue *io_wq,
+				      struct tcmu_io_worker *worker,
+				      int *prio)
+{
+	struct tcmur_cmd *tcmur_cmd;
+
+	pthread_cleanup_push(_cleanup_mutex_lock, &io_wq->io_lock);
+	pthread_mutex_lock(&io_wq->io_lock);
+
+	/*
+	 * Producers check nr_idle after queueing, so once we are counted
+	 * as idle either they will signal us or we will see their cmd here.
+	 */
+	__atomic_add_fetch(&io_wq->nr_idle, 1, __ATOMIC_SEQ_CST);
+	while (1) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		tcmur_cmd = io_dequeue(io_wq, worker, true, prio);
+		if (tcmur_cmd)
+			break;
+		pthread_cond_wait(&io_wq->io_cond, &io_wq->io_lock);
+	}
+	__atomic_sub_fetch(&io_wq->nr_idle, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_unlock(&io_wq->io_lock);
+	pthread_cleanup_pop(0);
+
+	return tcmur_cmd;
+}
+
+static void *io_work_queue(void *arg)
+{
+	struct tcmu_io_worker *worker = arg;
+	struct tcmu_device *dev = worker->dev;
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	struct tcmu_io_queue *io_wq = &rdev->work_queue;
+	int (*work_fn)(struct tcmu_device *dev, void *data);
+	void (*done_fn)(struct tcmu_device *dev, void *data, int rc);
+	struct tcmur_cmd *tcmur_cmd;
+	int ret, prio;
+
+	tcmu_set_thread_name("aio", dev);
+	tcmur_affinity_bind_thread(dev);
+
+	while (1) {
+		tcmur_cmd = io_dequeue(io_wq, worker, false, &prio);
+		if (!tcmur_cmd)
+			tcmur_cmd = io_work_wait(io_wq, worker, &prio);
+		TCMU_TRACE3(aio_dequeue, dev, tcmur_cmd->lib_cmd, worker->idx);
 
-	work = malloc(sizeof(*work));
-	if (!work)
-		return TCMU_STS_NO_RESOURCE;
+		/*
+		 * done_fn may requeue the cmd, so do not touch its work
+		 * fields after the callouts.
+		 */
+		work_fn = tcmur_cmd->work_fn;
+		done_fn = tcmur_cmd->work_done_fn;
 
-	work->work_fn = work_fn;
-	work->done_fn = done_fn;
-	work->dev = dev;
-	work->data = data;
-	list_node_init(&work->entry);
+		if (!tcmur_cmd->dispatch_ns)
+			tcmur_cmd->dispatch_ns = tcmur_now_ns();
 
-	/* cleanup push/pop not _really_ required here atm */
+		/* kick start I/O request */
+		TCMU_TRACE2(handler_submit, dev, tcmur_cmd->lib_cmd);
+		ret = work_fn(tcmur_cmd->work_dev, tcmur_cmd);
+		if (prio == TCMU_IO_PRIO_BG)
+			io_bg_put(io_wq);
+		done_fn(dev, tcmur_cmd, ret);
+	}
+
+	return NULL;
+}
+
+static int aio_queue(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+		     tcmu_work_fn_t work_fn, tcmu_done_fn_t done_fn)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmu_io_queue *io_wq = &rdev->work_queue;
+	unsigned int idx;
+	int i, prio;
+
+	tcmur_cmd->work_fn = work_fn;
+	tcmur_cmd->work_done_fn = done_fn;
+	tcmur_cmd->work_dev = dev;
+
+	prio = io_prio_classify(dev, tcmur_cmd);
+	idx = __atomic_fetch_add(&io_wq->next_worker, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < io_wq->nr_workers; i++) {
+		if (tcmu_io_ring_push(
+			&io_wq->workers[(idx + i) % io_wq->nr_workers].rings[prio],
+			tcmur_cmd)) {
+			TCMU_TRACE4(aio_enqueue, dev, tcmur_cmd->lib_cmd, 0, prio);
+			goto queued;
+		}
+	}
+
+	/* All rings of the class are full */
+	TCMU_TRACE4(aio_enqueue, dev, tcmur_cmd->lib_cmd, 1, prio);
 	pthread_cleanup_push(_cleanup_mutex_lock, &io_wq->io_lock);
 	pthread_mutex_lock(&io_wq->io_lock);
 
-	list_add_tail(&io_wq->io_queue, &work->entry);
-	pthread_cond_signal(&io_wq->io_cond); // TODO: conditional
+	list_add_tail(&io_wq->io_queue[prio], &tcmur_cmd->work_entry);
+	__atomic_add_fetch(&io_wq->nr_overflow[prio], 1, __ATOMIC_SEQ_CST);
+	pthread_cond_signal(&io_wq->io_cond);
 
 	pthread_mutex_unlock(&io_wq->io_lock);
 	pthread_cleanup_pop(0);
 
+	return TCMU_STS_ASYNC_HANDLED;
+
+queued:
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&io_wq->nr_idle, __ATOMIC_SEQ_CST)) {
+		pthread_cleanup_push(_cleanup_mutex_lock, &io_wq->io_lock);
+		pthread_mutex_lock(&io_wq->io_lock);
+
+		pthread_cond_signal(&io_wq->io_cond);
+
+		pthread_mutex_unlock(&io_wq->io_lock);
+		pthread_cleanup_pop(0);
+	}
+
 	return TCMU_STS_ASYNC_HANDLED;
 }
 
-int aio_request_schedule(struct tcmu_device *dev, void *data,
+int aio_request_schedule(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
 			 tcmu_work_fn_t work_fn, tcmu_done_fn_t done_fn)
 {
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	int ret;
 
-	if (!rhandler->nr_threads) {
-		ret = work_fn(dev, data);
+	if (!rdev->nr_threads) {
+		if (!tcmur_cmd->dispatch_ns)
+			tcmur_cmd->dispatch_ns = tcmur_now_ns();
+
+		TCMU_TRACE2(handler_submit, dev, tcmur_cmd->lib_cmd);
+		ret = work_fn(dev, tcmur_cmd);
 		if (!ret)
 			ret = TCMU_STS_ASYNC_HANDLED;
 	} else {
-		ret = aio_queue(dev, data, work_fn, done_fn);
+		ret = aio_queue(dev, tcmur_cmd, work_fn, done_fn);
 	}
 
 	return ret;
@@ -231,7 +508,6 @@ int setup_aio_tracking(struct tcmur_device *rdev)
 	int ret;
 	struct tcmu_track_aio *aio_track = &rdev->track_queue;
 
-	aio_track->pending_wakeups = 0;
 	aio_track->tracked_aio_ops = 0;
 	ret = pthread_mutex_init(&aio_track->track_lock, NULL);
 	if (ret != 0) {
@@ -256,33 +532,42 @@ void cleanup_aio_tracking(struct tcmur_device *rdev)
 
 void cleanup_io_work_queue_threads(struct tcmu_device *dev)
 {
-	struct tcmur_handler *r_handler = tcmu_get_runner_handler(dev);
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	struct tcmu_io_queue *io_wq = &rdev->work_queue;
-	int i, nr_threads = r_handler->nr_threads;
+	int i;
 
-	if (!io_wq->io_wq_threads) {
+	if (!io_wq->workers) {
 		return;
 	}
 
-	for (i = 0; i < nr_threads; i++) {
-		if (io_wq->io_wq_threads[i]) {
-			tcmu_thread_cancel(io_wq->io_wq_threads[i]);
+	for (i = 0; i < io_wq->nr_workers; i++) {
+		if (io_wq->workers[i].thread) {
+			tcmu_thread_cancel(io_wq->workers[i].thread);
+			io_wq->workers[i].thread = 0;
 		}
 	}
 }
 
 int setup_io_work_queue(struct tcmu_device *dev)
 {
-	struct tcmur_handler *r_handler = tcmu_get_runner_handler(dev);
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	struct tcmu_io_queue *io_wq = &rdev->work_queue;
-	int ret, i, nr_threads = r_handler->nr_threads;
+	struct tcmu_io_ring_cell *cells;
+	int ret, i, prio, nr_threads = rdev->nr_threads;
 
 	if (!nr_threads)
 		return 0;
 
-	list_head_init(&io_wq->io_queue);
+	for (prio = 0; prio < TCMU_IO_NR_PRIOS; prio++) {
+		list_head_init(&io_wq->io_queue[prio]);
+		io_wq->nr_overflow[prio] = 0;
+	}
+	io_wq->nr_idle = 0;
+	io_wq->next_worker = 0;
+	io_wq->bg_running = 0;
+	io_wq->bg_max = nr_threads / TCMU_IO_BG_SHARE;
+	if (!io_wq->bg_max)
+		io_wq->bg_max = 1;
 
 	ret = pthread_mutex_init(&io_wq->io_lock, NULL);
 	if (ret != 0) {
@@ -293,17 +578,38 @@ int setup_io_work_queue(struct tcmu_device *dev)
 		goto cleanup_lock;
 	}
 
-	/* TODO: Allow user to override device defaults */
-	io_wq->io_wq_threads = calloc(nr_threads, sizeof(pthread_t));
-	if (!io_wq->io_wq_threads) {
-		ret = ENOMEM;
+	ret = posix_memalign((void **)&io_wq->workers, 64,
+			     nr_threads * sizeof(*io_wq->workers));
+	if (ret != 0) {
+		io_wq->workers = NULL;
 		goto cleanup_cond;
 	}
+	memset(io_wq->workers, 0, nr_threads * sizeof(*io_wq->workers));
+	io_wq->nr_workers = nr_threads;
+
+	cells = calloc(nr_threads * TCMU_IO_NR_PRIOS * TCMU_IO_RING_SIZE,
+		       sizeof(*cells));
+	if (!cells) {
+		ret = ENOMEM;
+		goto free_workers;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		io_wq->workers[i].dev = dev;
+		io_wq->workers[i].idx = i;
+		memcpy(io_wq->workers[i].credits, io_prio_weights,
+		       sizeof(io_wq->workers[i].credits));
+		for (prio = 0; prio < TCMU_IO_NR_PRIOS; prio++)
+			tcmu_io_ring_init(&io_wq->workers[i].rings[prio],
+				cells + (i * TCMU_IO_NR_PRIOS + prio) *
+					TCMU_IO_RING_SIZE);
+	}
 
 	for (i = 0; i < nr_threads; i++) {
-		ret = pthread_create(&io_wq->io_wq_threads[i], NULL,
-				      io_work_queue, dev);
+		ret = pthread_create(&io_wq->workers[i].thread, NULL,
+				      io_work_queue, &io_wq->workers[i]);
 		if (ret != 0) {
+			io_wq->workers[i].thread = 0;
 			goto cleanup_threads;
 		}
 	}
@@ -312,7 +618,10 @@ int setup_io_work_queue(struct tcmu_device *dev)
 
 cleanup_threads:
 	cleanup_io_work_queue_threads(dev);
-	free(io_wq->io_wq_threads);
+	free(cells);
+free_workers:
+	free(io_wq->workers);
+	io_wq->workers = NULL;
 cleanup_cond:
 	pthread_cond_destroy(&io_wq->io_cond);
 cleanup_lock:
@@ -327,7 +636,7 @@ void cleanup_io_work_queue(struct tcmu_device *dev, bool cancel)
 	struct tcmu_io_queue *io_wq = &rdev->work_queue;
 	int ret;
 
-	if (!io_wq->io_wq_threads) {
+	if (!io_wq->workers) {
 		return;
 	}
 
@@ -336,9 +645,9 @@ void cleanup_io_work_queue(struct tcmu_device *dev, bool cancel)
 	}
 
 	/*
-	 * Note that there's no need to drain ->io_queue at this point
-	 * as it _should_ be empty (target layer would call this path
-	 * when no commands are running - thanks Mike).
+	 * Note that there's no need to drain the rings or ->io_queue at
+	 * this point as they _should_ be empty (target layer would call
+	 * this path when no commands are running - thanks Mike).
 	 *
 	 * Out of tree handlers which do not use the aio code are not
 	 * supported in this path.
@@ -354,5 +663,8 @@ void cleanup_io_work_queue(struct tcmu_device *dev, bool cancel)
 		tcmu_err("failed to destroy io workqueue cond\n");
 	}
 
-	free(io_wq->io_wq_threads);
+	/* The cells of all rings are one allocation */
+	free(io_wq->workers[0].rings[0].cells);
+	free(io_wq->workers);
+	io_wq->workers = NULL;
 }
@@ -10,26 +10,87 @@
 #define __TCMUR_AIO_H
 
 #include <pthread.h>
+#include <stdint.h>
 
 #include "ccan/list/list.h"
 
+struct tcmur_cmd;
 struct tcmur_device;
 struct tcmu_device;
 struct tcmulib_cmd;
 
 struct tcmu_track_aio {
-	unsigned int pending_wakeups;
 	unsigned int tracked_aio_ops;
+	unsigned int tracked_aio_max;	/* high water mark of tracked_aio_ops */
 	pthread_mutex_t track_lock;
 	pthread_cond_t *is_empty_cond;
 };
 
+/* Must be a power of 2 */
+#define TCMU_IO_RING_SIZE 512
+
+struct tcmu_io_ring_cell {
+	uint32_t seq;
+	struct tcmur_cmd *cmd;
+};
+
+/* Bounded multi-producer/multi-consumer ring, one per worker thread */
+struct tcmu_io_ring {
+	struct tcmu_io_ring_cell *cells;
+	uint32_t enq_pos __attribute__((aligned(64)));
+	uint32_t deq_pos __attribute__((aligned(64)));
+};
+
+/*
+ * Priority classes of the io work queue. While more than one class has
+ * cmds queued, workers take them in proportion to the class weights, and
+ * at most a 1/TCMU_IO_BG_SHARE of the workers (but at least one) run
+ * background cmds at the same time.
+ */
+enum {
+	/* COMPARE AND WRITE, SYNCHRONIZE CACHE, small READs and WRITEs */
+	TCMU_IO_PRIO_HIGH,
+	TCMU_IO_PRIO_NORMAL,
+	/* WRITE SAME, EXTENDED COPY, FORMAT UNIT and UNMAP and their chunks */
+	TCMU_IO_PRIO_BG,
+	TCMU_IO_NR_PRIOS,
+};
+
+#define TCMU_IO_PRIO_HIGH_WEIGHT	8
+#define TCMU_IO_PRIO_NORMAL_WEIGHT	4
+#define TCMU_IO_PRIO_BG_WEIGHT		1
+#define TCMU_IO_BG_SHARE		4
+/* READs and WRITEs up to this many bytes are TCMU_IO_PRIO_HIGH */
+#define TCMU_IO_PRIO_SMALL_IO		(64 * 1024)
+
+struct tcmu_io_worker {
+	struct tcmu_device *dev;
+	unsigned int idx;
+	pthread_t thread;
+	/* cmds left for each class this round, only used by the worker */
+	unsigned int credits[TCMU_IO_NR_PRIOS];
+	struct tcmu_io_ring rings[TCMU_IO_NR_PRIOS];
+};
+
 struct tcmu_io_queue {
+	int nr_workers;
+	struct tcmu_io_worker *workers;
+	unsigned int next_worker;
+
+	/*
+	 * Idle workers sleep on io_cond. io_queue holds cmds that did not
+	 * fit in any ring of their class and is only used when all of the
+	 * class's rings are full.
+	 */
 	pthread_mutex_t io_lock;
 	pthread_cond_t io_cond;
+	unsigned int nr_idle;
+	unsigned int nr_overflow[TCMU_IO_NR_PRIOS];
+	struct list_head io_queue[TCMU_IO_NR_PRIOS];
 
-	pthread_t *io_wq_threads;
-	struct list_head io_queue;
+	/* workers running a TCMU_IO_PRIO_BG cmd, and the limit */
+	unsigned int bg_running;
+	unsigned int bg_max;
 };
 
 int setup_io_work_queue(struct tcmu_device *);
@@ -42,13 +103,12 @@ void cleanup_aio_tracking(struct tcmur_device *);
 typedef int (*tcmu_work_fn_t)(struct tcmu_device *dev, void *data);
 typedef void (*tcmu_done_fn_t)(struct tcmu_device *dev, void *data, int rc);
 
-int aio_request_schedule(struct tcmu_device *, void *, tcmu_work_fn_t,
-			 tcmu_done_fn_t);
+int aio_request_schedule(struct tcmu_device *, struct tcmur_cmd *,
+			 tcmu_work_fn_t, tcmu_done_fn_t);
 
 /* aio request tracking */
 void track_aio_request_start(struct tcmur_device *);
-void track_aio_request_finish(struct tcmur_device *, int *);
-void track_aio_wakeup_finish(struct tcmur_device *, int *);
+void track_aio_request_finish(struct tcmur_device *);
 int aio_wait_for_empty_queue(struct tcmur_device *rdev);
 
 #endif /* __TCMUR_AIO_H */
@@ -13,6 +13,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
 
 #include "ccan/list/list.h"
 
@@ -20,12 +22,15 @@
 #include "libtcmu.h"
 #include "libtcmu_log.h"
 #include "libtcmu_priv.h"
+#include "libtcmu_trace.h"
 #include "libtcmu_common.h"
 #include "tcmur_aio.h"
 #include "tcmur_device.h"
 #include "tcmu-runner.h"
 #include "tcmu_runner_priv.h"
 #include "tcmur_cmd_handler.h"
+#include "tcmur_stats.h"
+#include "tcmur_work.h"
 #include "alua.h"
 
 static void _cleanup_spin_lock(void *arg)
@@ -33,55 +38,460 @@ static void _cleanup_spin_lock(void *arg)
 	pthread_spin_unlock(arg);
 }
 
-void tcmur_tcmulib_cmd_complete(struct tcmu_device *dev,
-				struct tcmulib_cmd *cmd, int rc)
+int tcmur_get_time(struct tcmu_device *dev, struct timespec *time)
 {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	int ret;
+
+	ret = clock_gettime(CLOCK_MONOTONIC_COARSE, time);
+	if (!ret) {
+		tcmu_dev_dbg(dev, "Current time %lu.%09ld secs.\n",
+			     time->tv_sec, time->tv_nsec);
+		return 0;
+	}
+
+	tcmu_dev_err(dev, "Could not get time. Error %d. Command timeout feature disabled.\n",
+		     ret);
+	rdev->cmd_time_out = 0;
+	return ret;
+}
+
+int64_t tcmur_time_diff_ms(const struct timespec *end,
+			   const struct timespec *start)
+{
+	return (int64_t)(end->tv_sec - start->tv_sec) * 1000 +
+	       (end->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Max cmds tcmur_complete_queued_cmds passes to libtcmu per call */
+#define TCMUR_COMPL_BATCH 32
+
+/* Runner side accounting done before a cmd is handed back to libtcmu */
+static void tcmur_cmd_done_account(struct tcmu_device *dev,
+				   struct tcmulib_cmd *cmd, int rc)
+{
 	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
 	struct timespec curr_time;
 
-	pthread_cleanup_push(_cleanup_spin_lock, (void *)&rdev->lock);
-	pthread_spin_lock(&rdev->lock);
-
 	if (tcmur_cmd->timed_out) {
 		if (tcmur_get_time(dev, &curr_time)) {
 			tcmu_dev_info(dev, "Timed out command id %hu completed with status %d.\n",
 				      cmd->cmd_id, rc);
 		} else {
-			tcmu_dev_info(dev, "Timed out command id %hu completed after %f seconds with status %d.\n",
+			tcmu_dev_info(dev, "Timed out command id %hu completed after %.3f seconds with status %d.\n",
 				      cmd->cmd_id,
-				      difftime(curr_time.tv_sec,
-					       tcmur_cmd->start_time.tv_sec),
+				      tcmur_time_diff_ms(&curr_time,
+						&tcmur_cmd->start_time) / 1000.0,
 				      rc);
 		}
 	}
 
 	list_del(&tcmur_cmd->cmds_list_entry);
 
+	tcmur_stats_cmd_done(dev, cmd, rc);
+}
+
+static void __tcmur_tcmulib_cmd_complete(struct tcmu_device *dev,
+					 struct tcmulib_cmd *cmd, int rc)
+{
+	tcmur_cmd_done_account(dev, cmd, rc);
 	tcmulib_command_complete(dev, cmd, rc);
+}
+
+void tcmur_tcmulib_cmd_complete(struct tcmu_device *dev,
+				struct tcmulib_cmd *cmd, int rc)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	pthread_cleanup_push(_cleanup_spin_lock, (void *)&rdev->lock);
+	pthread_spin_lock(&rdev->lock);
+
+	__tcmur_tcmulib_cmd_complete(dev, cmd, rc);
 
 	pthread_spin_unlock(&rdev->lock);
 	pthread_cleanup_pop(0);
 }
 
+/*
+ * tcmur_complete_queued_cmds - write queued completions to the ring
+ * @dev: device to complete cmds for
+ *
+ * Must be called from the cmdproc thread, or after it has exited. Returns
+ * the number of cmds completed. The caller must kick the kernel with
+ * tcmulib_processing_complete if it is non-zero.
+ */
+int tcmur_complete_queued_cmds(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cmd *tcmur_cmd, *next, *fifo = NULL;
+	struct tcmulib_cmd *cmds[TCMUR_COMPL_BATCH];
+	int results[TCMUR_COMPL_BATCH];
+	uint64_t cnt;
+	int completed = 0, nr_cmds = 0;
+
+	/* Reset the wakeup before we take the list so we do not miss one */
+	if (read(rdev->compl_efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		tcmu_dev_err(dev, "Could not read completion eventfd %d\n",
+			     errno);
+
+	tcmur_cmd = __atomic_exchange_n(&rdev->compl_list, NULL,
+					__ATOMIC_ACQUIRE);
+	if (!tcmur_cmd)
+		return 0;
+
+	/* The list was built LIFO, so complete in submission order */
+	while (tcmur_cmd) {
+		next = tcmur_cmd->compl_next;
+		tcmur_cmd->compl_next = fifo;
+		fifo = tcmur_cmd;
+		tcmur_cmd = next;
+	}
+
+	pthread_cleanup_push(_cleanup_spin_lock, (void *)&rdev->lock);
+	pthread_spin_lock(&rdev->lock);
+
+	for (tcmur_cmd = fifo; tcmur_cmd; tcmur_cmd = next) {
+		/* tcmur_cmd is freed with its lib_cmd */
+		next = tcmur_cmd->compl_next;
+		tcmur_cmd_done_account(dev, tcmur_cmd->lib_cmd,
+				       tcmur_cmd->compl_status);
+		cmds[nr_cmds] = tcmur_cmd->lib_cmd;
+		results[nr_cmds] = tcmur_cmd->compl_status;
+		if (++nr_cmds == TCMUR_COMPL_BATCH) {
+			tcmulib_commands_complete(dev, cmds, results, nr_cmds);
+			nr_cmds = 0;
+		}
+		completed++;
+	}
+	tcmulib_commands_complete(dev, cmds, results, nr_cmds);
+
+	pthread_spin_unlock(&rdev->lock);
+	pthread_cleanup_pop(0);
+
+	return completed;
+}
+
+static void tcmur_queue_cmd_completion(struct tcmu_device *dev,
+				       struct tcmulib_cmd *cmd, int rc)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
+	struct tcmur_cmd *head;
+	uint64_t cnt = 1;
+
+	tcmur_cmd->compl_status = rc;
+	tcmur_cmd->done_ns = tcmur_now_ns();
+
+	head = __atomic_load_n(&rdev->compl_list, __ATOMIC_RELAXED);
+	do {
+		tcmur_cmd->compl_next = head;
+	} while (!__atomic_compare_exchange_n(&rdev->compl_list, &head,
+					      tcmur_cmd, true,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+
+	/*
+	 * The cmdproc thread drains the list before it polls again, and
+	 * if the list was not empty someone else has already woken it up.
+	 */
+	if (head || tcmur_dev_in_cmdproc(rdev))
+		return;
+
+	if (write(rdev->compl_efd, &cnt, sizeof(cnt)) < 0)
+		tcmu_dev_err(dev, "Could not write completion eventfd %d\n",
+			     errno);
+}
+
+static bool tcmur_cmd_modifies_data(struct tcmulib_cmd *cmd)
+{
+	switch (cmd->cdb[0]) {
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case UNMAP:
+	case COMPARE_AND_WRITE:
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_16:
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+	case FORMAT_UNIT:
+		return true;
+	default:
+		/* EXTENDED_COPY marks its destination in the write callback */
+		return false;
+	}
+}
+
+/*
+ * LBA range locks
+ *
+ * Cmds that must not overlap with others, like emulated COMPARE AND WRITE,
+ * take an exclusive lock on their range, and writes take a shared one. On
+ * devices with PI writes are exclusive too, and reads take a shared lock.
+ * Nothing ever blocks: a cmd that cannot get its lock is queued in FIFO
+ * order and its range_work_fn is scheduled, from the context releasing
+ * the conflicting lock, when it is granted. Each cmd holds at most one
+ * lock, which is dropped by aio_command_finish.
+ *
+ * Writes normally only bump the range_shared counters of the regions they
+ * touch. If an exclusive lock is held or waiting in one of those regions
+ * they back off, and are tracked on range_locks with their exact range so
+ * only real overlaps make them wait. An exclusive lock is granted once no
+ * overlapping lock is on range_locks and the fast path writes in its
+ * regions have drained.
+ */
+enum {
+	TCMUR_RANGE_UNLOCKED,
+	TCMUR_RANGE_SHARED_FAST,
+	TCMUR_RANGE_SHARED,
+	TCMUR_RANGE_EXCL,
+	TCMUR_RANGE_WAIT_SHARED,
+	TCMUR_RANGE_WAIT_EXCL,
+};
+
+static void range_regions(struct tcmur_cmd *tcmur_cmd, uint64_t *first,
+			  unsigned int *cnt)
+{
+	uint64_t last;
+
+	*first = tcmur_cmd->range_lba >> TCMUR_RANGE_LOCK_SHIFT;
+	last = (tcmur_cmd->range_lba + tcmur_cmd->range_nlbas - 1) >>
+							TCMUR_RANGE_LOCK_SHIFT;
+	*cnt = min(last - *first + 1, (uint64_t)TCMUR_RANGE_LOCK_BUCKETS);
+}
+
+#define range_bucket(region) ((region) % TCMUR_RANGE_LOCK_BUCKETS)
+
+static bool range_overlaps(struct tcmur_cmd *c1, struct tcmur_cmd *c2)
+{
+	return c1->range_lba < c2->range_lba + c2->range_nlbas &&
+	       c2->range_lba < c1->range_lba + c1->range_nlbas;
+}
+
+static bool range_is_excl(struct tcmur_cmd *tcmur_cmd)
+{
+	return tcmur_cmd->range_state == TCMUR_RANGE_EXCL ||
+	       tcmur_cmd->range_state == TCMUR_RANGE_WAIT_EXCL;
+}
+
+/* Called with range_lock held */
+static bool range_grantable(struct tcmur_device *rdev,
+			    struct tcmur_cmd *tcmur_cmd, bool excl)
+{
+	struct tcmur_cmd *other;
+	unsigned int i, cnt;
+	uint64_t first;
+
+	list_for_each(&rdev->range_locks, other, range_entry) {
+		if ((excl || range_is_excl(other)) &&
+		    range_overlaps(tcmur_cmd, other))
+			return false;
+	}
+
+	/* Do not overtake an earlier waiter we conflict with */
+	list_for_each(&rdev->range_waiters, other, range_entry) {
+		if (other == tcmur_cmd)
+			break;
+		if ((excl || range_is_excl(other)) &&
+		    range_overlaps(tcmur_cmd, other))
+			return false;
+	}
+
+	if (!excl)
+		return true;
+
+	range_regions(tcmur_cmd, &first, &cnt);
+	for (i = 0; i < cnt; i++) {
+		if (__atomic_load_n(&rdev->range_shared[range_bucket(first + i)],
+				    __ATOMIC_SEQ_CST))
+			return false;
+	}
+	return true;
+}
+
+/* Grant every waiter that can run now and schedule its work */
+static void range_kick(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cmd *tcmur_cmd, *next, *granted = NULL, **tail = &granted;
+	bool excl;
+	int ret;
+
+	pthread_mutex_lock(&rdev->range_lock);
+	list_for_each_safe(&rdev->range_waiters, tcmur_cmd, next, range_entry) {
+		excl = tcmur_cmd->range_state == TCMUR_RANGE_WAIT_EXCL;
+		if (!range_grantable(rdev, tcmur_cmd, excl))
+			continue;
+
+		list_del(&tcmur_cmd->range_entry);
+		list_add_tail(&rdev->range_locks, &tcmur_cmd->range_entry);
+		tcmur_cmd->range_state = excl ? TCMUR_RANGE_EXCL :
+						TCMUR_RANGE_SHARED;
+		tcmur_cmd->compl_next = NULL;
+		*tail = tcmur_cmd;
+		tail = &tcmur_cmd->compl_next;
+	}
+	pthread_mutex_unlock(&rdev->range_lock);
+
+	while ((tcmur_cmd = granted)) {
+		granted = tcmur_cmd->compl_next;
+
+		ret = aio_request_schedule(dev, tcmur_cmd,
+					   tcmur_cmd->range_work_fn,
+					   tcmur_cmd_complete);
+		if (ret != TCMU_STS_ASYNC_HANDLED)
+			tcmur_cmd->done(dev, tcmur_cmd, ret);
+	}
+}
+
+/* Drop fast path shared counts, returns true if an exclusive lock waits */
+static bool range_shared_put(struct tcmur_device *rdev,
+			     struct tcmur_cmd *tcmur_cmd)
+{
+	unsigned int i, cnt, bucket;
+	bool kick = false;
+	uint64_t first;
+
+	range_regions(tcmur_cmd, &first, &cnt);
+	for (i = 0; i < cnt; i++) {
+		bucket = range_bucket(first + i);
+		if (!__atomic_sub_fetch(&rdev->range_shared[bucket], 1,
+					__ATOMIC_SEQ_CST) &&
+		    __atomic_load_n(&rdev->range_excl[bucket], __ATOMIC_SEQ_CST))
+			kick = true;
+	}
+	return kick;
+}
+
+/*
+ * Take a shared or exclusive lock on nlbas blocks at lba for the cmd.
+ * Returns true if it was taken. Otherwise the cmd waits for it and
+ * work_fn will be scheduled for the cmd when it is granted, after which
+ * any error is passed to the cmd's done callback.
+ */
+static bool tcmur_range_lock(struct tcmu_device *dev,
+			     struct tcmur_cmd *tcmur_cmd, uint64_t lba,
+			     uint64_t nlbas, bool excl, tcmu_work_fn_t work_fn)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	unsigned int i, cnt;
+	uint64_t first;
+	bool granted;
+
+	if (!nlbas)
+		return true;
+
+	tcmur_cmd->range_lba = lba;
+	tcmur_cmd->range_nlbas = nlbas;
+	tcmur_cmd->range_work_fn = work_fn;
+	range_regions(tcmur_cmd, &first, &cnt);
+
+	if (!excl) {
+		for (i = 0; i < cnt; i++)
+			__atomic_add_fetch(&rdev->range_shared[range_bucket(first + i)],
+					   1, __ATOMIC_SEQ_CST);
+		for (i = 0; i < cnt; i++) {
+			if (__atomic_load_n(&rdev->range_excl[range_bucket(first + i)],
+					    __ATOMIC_SEQ_CST))
+				break;
+		}
+		if (i == cnt) {
+			tcmur_cmd->range_state = TCMUR_RANGE_SHARED_FAST;
+			return true;
+		}
+
+		/* Someone may have been waiting for this region to drain */
+		if (range_shared_put(rdev, tcmur_cmd))
+			range_kick(dev);
+	}
+
+	pthread_mutex_lock(&rdev->range_lock);
+	if (excl) {
+		for (i = 0; i < cnt; i++)
+			__atomic_add_fetch(&rdev->range_excl[range_bucket(first + i)],
+					   1, __ATOMIC_SEQ_CST);
+	}
+
+	granted = range_grantable(rdev, tcmur_cmd, excl);
+	if (granted) {
+		tcmur_cmd->range_state = excl ? TCMUR_RANGE_EXCL :
+						TCMUR_RANGE_SHARED;
+		list_add_tail(&rdev->range_locks, &tcmur_cmd->range_entry);
+	} else {
+		tcmur_cmd->range_state = excl ? TCMUR_RANGE_WAIT_EXCL :
+						TCMUR_RANGE_WAIT_SHARED;
+		list_add_tail(&rdev->range_waiters, &tcmur_cmd->range_entry);
+	}
+	pthread_mutex_unlock(&rdev->range_lock);
+
+	return granted;
+}
+
+static void tcmur_range_unlock(struct tcmu_device *dev,
+			       struct tcmur_cmd *tcmur_cmd)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	unsigned int i, cnt;
+	uint64_t first;
+	bool kick;
+
+	switch (tcmur_cmd->range_state) {
+	case TCMUR_RANGE_UNLOCKED:
+		return;
+	case TCMUR_RANGE_SHARED_FAST:
+		kick = range_shared_put(rdev, tcmur_cmd);
+		break;
+	default:
+		pthread_mutex_lock(&rdev->range_lock);
+		list_del(&tcmur_cmd->range_entry);
+		if (range_is_excl(tcmur_cmd)) {
+			range_regions(tcmur_cmd, &first, &cnt);
+			for (i = 0; i < cnt; i++)
+				__atomic_sub_fetch(&rdev->range_excl[range_bucket(first + i)],
+						   1, __ATOMIC_SEQ_CST);
+		}
+		kick = !list_empty(&rdev->range_waiters);
+		pthread_mutex_unlock(&rdev->range_lock);
+	}
+
+	tcmur_cmd->range_state = TCMUR_RANGE_UNLOCKED;
+	if (kick)
+		range_kick(dev);
+}
+
 static void aio_command_finish(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 			       int rc)
 {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
-	int wake_up;
 
-	tcmur_tcmulib_cmd_complete(dev, cmd, rc);
-	track_aio_request_finish(rdev, &wake_up);
-	while (wake_up) {
-		tcmulib_processing_complete(dev);
-		track_aio_wakeup_finish(rdev, &wake_up);
-	}
+	/*
+	 * Must be done before the completion can reach the initiator, so a
+	 * flush sent after it sees the new epoch. Failed cmds count too,
+	 * since they may have partially written.
+	 */
+	if (tcmur_cmd_modifies_data(cmd))
+		tcmur_dev_mark_dirty(dev);
+
+	tcmur_range_unlock(dev, cmd->hm_private);
+	tcmur_queue_cmd_completion(dev, cmd, rc);
+	track_aio_request_finish(rdev);
 }
 
+static bool tcmur_pi_io_put(struct tcmu_device *dev, void *pi_io,
+			    bool tuples, int *ret);
+
 void tcmur_cmd_complete(struct tcmu_device *dev, void *data, int rc)
 {
 	struct tcmur_cmd *tcmur_cmd = data;
 
+	TCMU_TRACE3(handler_done, dev, tcmur_cmd->lib_cmd, rc);
+
+	/* The data half of a PI io, which may not be the last to finish */
+	if (tcmur_cmd->pi_io &&
+	    !tcmur_pi_io_put(dev, tcmur_cmd->pi_io, false, &rc))
+		return;
+
 	tcmur_cmd->done(dev, tcmur_cmd, rc);
 }
 
@@ -92,12 +502,146 @@ static void tcmur_cmd_iovec_reset(struct tcmur_cmd *tcmur_cmd,
 	tcmur_cmd->iovec->iov_len = data_length;
 }
 
+/*
+ * In front of every emulated cmd state allocation, so it can be given back
+ * without the device. class is -1 for heap allocations.
+ */
+struct tcmur_state_hdr {
+	struct tcmur_state_pool *pool;
+	struct tcmur_state_hdr *next;
+	int class;
+} __attribute__((aligned(16)));
+
+static int tcmur_state_class(size_t len)
+{
+	int shift = TCMUR_STATE_MIN_SHIFT;
+
+	while (shift <= TCMUR_STATE_MAX_SHIFT && ((size_t)1 << shift) < len)
+		shift++;
+	return shift - TCMUR_STATE_MIN_SHIFT;
+}
+
+static unsigned int tcmur_state_cache_max(int class)
+{
+	unsigned int nr;
+
+	nr = TCMUR_STATE_CACHE_BYTES >> (class + TCMUR_STATE_MIN_SHIFT);
+	return min(max(nr, 1U), (unsigned int)TCMUR_STATE_CACHE_MAX);
+}
+
+int tcmur_state_pool_init(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_state_pool *pool = &rdev->state_pool;
+	size_t max_len;
+	int ret;
+
+	/* Emulations work in chunks of at least 1M, plus their state */
+	max_len = max((size_t)tcmu_lba_to_byte(dev, tcmu_dev_get_max_xfer_len(dev)),
+		      (size_t)(1024 * 1024));
+	pool->max_class = min(tcmur_state_class(max_len + 4096),
+			      TCMUR_STATE_NR_CLASSES - 1);
+
+	ret = pthread_mutex_init(&pool->lock, NULL);
+	if (ret)
+		return -ret;
+	return 0;
+}
+
+void tcmur_state_pool_cleanup(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_state_pool *pool = &rdev->state_pool;
+	struct tcmur_state_hdr *hdr;
+	int i;
+
+	if (pool->misses)
+		tcmu_dev_dbg(dev, "%"PRIu64" cmd state allocations missed the pool\n",
+			     pool->misses);
+
+	for (i = 0; i < TCMUR_STATE_NR_CLASSES; i++) {
+		while ((hdr = pool->free[i])) {
+			pool->free[i] = hdr->next;
+			free(hdr);
+		}
+		pool->nr_free[i] = 0;
+	}
+	pthread_mutex_destroy(&pool->lock);
+}
+
+/*
+ * Allocate len zeroed bytes of emulated cmd state from the device's pool.
+ * Must be released with tcmur_state_free(), before the device is removed.
+ */
+static void *tcmur_state_zalloc(struct tcmu_device *dev, size_t len)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_state_pool *pool = &rdev->state_pool;
+	struct tcmur_state_hdr *hdr = NULL;
+	int class = tcmur_state_class(len + sizeof(*hdr));
+
+	if (class > pool->max_class) {
+		__atomic_add_fetch(&pool->misses, 1, __ATOMIC_RELAXED);
+		hdr = malloc(sizeof(*hdr) + len);
+		if (!hdr)
+			return NULL;
+		class = -1;
+		goto init;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	hdr = pool->free[class];
+	if (hdr) {
+		pool->free[class] = hdr->next;
+		pool->nr_free[class]--;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!hdr) {
+		hdr = malloc((size_t)1 << (class + TCMUR_STATE_MIN_SHIFT));
+		if (!hdr)
+			return NULL;
+	}
+
+init:
+	hdr->pool = pool;
+	hdr->next = NULL;
+	hdr->class = class;
+	memset(hdr + 1, 0, len);
+	return hdr + 1;
+}
+
+static void tcmur_state_free(void *ptr)
+{
+	struct tcmur_state_hdr *hdr;
+	struct tcmur_state_pool *pool;
+
+	if (!ptr)
+		return;
+
+	hdr = (struct tcmur_state_hdr *)ptr - 1;
+	pool = hdr->pool;
+	if (hdr->class >= 0) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->nr_free[hdr->class] < tcmur_state_cache_max(hdr->class)) {
+			hdr->next = pool->free[hdr->class];
+			pool->free[hdr->class] = hdr;
+			pool->nr_free[hdr->class]++;
+			hdr = NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	free(hdr);
+}
+
 static void tcmur_cmd_state_free(struct tcmur_cmd *tcmur_cmd)
 {
-	free(tcmur_cmd->cmd_state);
+	tcmur_state_free(tcmur_cmd->cmd_state);
 }
 
-static int tcmur_cmd_state_init(struct tcmur_cmd *tcmur_cmd, int state_length,
+static int tcmur_cmd_state_init(struct tcmu_device *dev,
+				struct tcmur_cmd *tcmur_cmd, int state_length,
 				size_t data_length)
 {
 	void *state;
@@ -106,7 +650,7 @@ static int tcmur_cmd_state_init(struct tcmur_cmd *tcmur_cmd, int state_length,
 	if (data_length)
 		iov_length = data_length + sizeof(struct iovec);
 
-	state = calloc(1, state_length + iov_length);
+	state = tcmur_state_zalloc(dev, state_length + iov_length);
 	if (!state)
 		return -ENOMEM;
 
@@ -127,6 +671,272 @@ static int tcmur_cmd_state_init(struct tcmur_cmd *tcmur_cmd, int state_length,
 	return 0;
 }
 
+/*
+ * T10-PI
+ *
+ * On devices with protection information every read, write, unmap and
+ * write_zeroes of data is paired with a read, write or clear of the
+ * tuples of its blocks through the handler's read_pi and write_pi
+ * callouts. The tuples of a write are generated before it is sent, and a
+ * read is checked against its tuples once both halves are done. Handlers
+ * using IO threads run the halves one after the other. Async ones get
+ * both at once, the tuples with a tcmur_cmd of their own, and the
+ * caller's cmd completes when the last half does.
+ */
+enum {
+	TCMUR_PI_READ,
+	TCMUR_PI_WRITE,
+	TCMUR_PI_UNMAP,
+	TCMUR_PI_ZEROES,
+};
+
+struct tcmur_pi_io {
+	struct tcmur_cmd pi_cmd;	/* the tuple half the handler sees */
+	struct tcmur_cmd *tcmur_cmd;
+	int op;
+	int pending;
+	int data_status;
+	int pi_status;
+	uint64_t lba;
+	uint32_t nr_blocks;
+	struct iovec *iov;
+	size_t iov_cnt;
+	uint64_t len;
+	uint64_t off;
+	/* Copy of a read's iovec, which the handler may consume */
+	struct iovec *check_iov;
+	struct tcmu_pi_tuple *pi;
+};
+
+/*
+ * The offload callouts move data the runner does not see, so devices with
+ * PI emulate those cmds with reads and writes instead.
+ */
+static bool tcmur_can_offload(struct tcmu_device *dev, const void *callout)
+{
+	return callout && !tcmu_dev_get_pi_enabled(dev);
+}
+
+static int tcmur_pi_io_data(struct tcmu_device *dev, struct tcmur_pi_io *pio)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+
+	switch (pio->op) {
+	case TCMUR_PI_READ:
+		return rhandler->read(dev, pio->tcmur_cmd, pio->iov,
+				      pio->iov_cnt, pio->len, pio->off);
+	case TCMUR_PI_WRITE:
+		return rhandler->write(dev, pio->tcmur_cmd, pio->iov,
+				       pio->iov_cnt, pio->len, pio->off);
+	case TCMUR_PI_UNMAP:
+		return rhandler->unmap(dev, pio->tcmur_cmd, pio->off, pio->len);
+	default:
+		return rhandler->write_zeroes(dev, pio->tcmur_cmd, pio->off,
+					      pio->len);
+	}
+}
+
+static int tcmur_pi_io_tuples(struct tcmu_device *dev, struct tcmur_pi_io *pio)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+
+	if (pio->op == TCMUR_PI_READ)
+		return rhandler->read_pi(dev, &pio->pi_cmd, pio->pi, pio->lba,
+					 pio->nr_blocks);
+	/* pi is NULL for unmaps and zeroes, which clears the tuples */
+	return rhandler->write_pi(dev, &pio->pi_cmd, pio->pi, pio->lba,
+				  pio->nr_blocks);
+}
+
+/* Both halves are done: check a read and release the io */
+static int tcmur_pi_io_finish(struct tcmu_device *dev, struct tcmur_pi_io *pio)
+{
+	struct tcmur_cmd *tcmur_cmd = pio->tcmur_cmd;
+	uint8_t *sense = tcmur_cmd->lib_cmd->sense_buf;
+	uint64_t lba;
+	uint32_t bad;
+	int ret;
+
+	ret = pio->data_status;
+	if (ret == TCMU_STS_OK)
+		ret = pio->pi_status;
+
+	if (ret == TCMU_STS_OK && pio->op == TCMUR_PI_READ) {
+		ret = tcmu_pi_verify(pio->pi, pio->check_iov, pio->iov_cnt,
+				     tcmu_dev_get_block_size(dev), pio->lba,
+				     pio->nr_blocks, &bad);
+		if (ret != TCMU_STS_OK) {
+			lba = pio->lba + bad;
+			tcmu_dev_err(dev, "PI %s check failed at lba %"PRIu64"\n",
+				     ret == TCMU_STS_PI_GUARD_ERR ? "guard" :
+				     "reference tag", lba);
+			if (lba <= UINT32_MAX)
+				tcmu_sense_set_info(sense, lba);
+			else
+				memset(sense, 0, SENSE_BUFFERSIZE);
+		}
+	}
+
+	tcmur_cmd->pi_io = NULL;
+	tcmur_state_free(pio);
+	return ret;
+}
+
+/*
+ * Record the status of one half. Returns true, with the cmd's status in
+ * ret, if it was the last one.
+ */
+static bool tcmur_pi_io_put(struct tcmu_device *dev, void *pi_io,
+			    bool tuples, int *ret)
+{
+	struct tcmur_pi_io *pio = pi_io;
+
+	if (tuples)
+		pio->pi_status = *ret;
+	else
+		pio->data_status = *ret;
+
+	if (__atomic_sub_fetch(&pio->pending, 1, __ATOMIC_ACQ_REL))
+		return false;
+
+	*ret = tcmur_pi_io_finish(dev, pio);
+	return true;
+}
+
+static void tcmur_pi_cmd_done(struct tcmu_device *dev,
+			      struct tcmur_cmd *pi_cmd, int ret)
+{
+	struct tcmur_pi_io *pio = container_of(pi_cmd, struct tcmur_pi_io,
+					       pi_cmd);
+	struct tcmur_cmd *tcmur_cmd = pio->tcmur_cmd;
+
+	if (tcmur_pi_io_put(dev, pio, true, &ret))
+		tcmur_cmd->done(dev, tcmur_cmd, ret);
+}
+
+static int tcmur_pi_io(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+		       int op, struct iovec *iov, size_t iov_cnt, uint64_t len,
+		       uint64_t off)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	size_t pi_len = 0, iov_len = 0;
+	struct tcmur_pi_io *pio;
+	int ret;
+
+	if (op == TCMUR_PI_READ || op == TCMUR_PI_WRITE)
+		pi_len = tcmu_byte_to_lba(dev, len) *
+					sizeof(struct tcmu_pi_tuple);
+	if (op == TCMUR_PI_READ)
+		iov_len = iov_cnt * sizeof(*iov);
+
+	pio = tcmur_state_zalloc(dev, sizeof(*pio) + pi_len + iov_len);
+	if (!pio)
+		return TCMU_STS_NO_RESOURCE;
+
+	pio->tcmur_cmd = tcmur_cmd;
+	pio->op = op;
+	pio->pending = 2;
+	pio->lba = tcmu_byte_to_lba(dev, off);
+	pio->nr_blocks = tcmu_byte_to_lba(dev, len);
+	pio->iov = iov;
+	pio->iov_cnt = iov_cnt;
+	pio->len = len;
+	pio->off = off;
+	if (pi_len)
+		pio->pi = (struct tcmu_pi_tuple *)(pio + 1);
+
+	if (op == TCMUR_PI_READ) {
+		pio->check_iov = (struct iovec *)(pio->pi + pio->nr_blocks);
+		memcpy(pio->check_iov, iov, iov_len);
+	} else if (op == TCMUR_PI_WRITE) {
+		tcmu_pi_generate(pio->pi, iov, iov_cnt,
+				 tcmu_dev_get_block_size(dev), pio->lba,
+				 pio->nr_blocks);
+	}
+
+	pio->pi_cmd.lib_cmd = tcmur_cmd->lib_cmd;
+	pio->pi_cmd.done = tcmur_pi_cmd_done;
+
+	if (rdev->nr_threads) {
+		/*
+		 * Tuples are not touched if the data failed, or if the
+		 * handler wants a zeroing emulated.
+		 */
+		pio->data_status = tcmur_pi_io_data(dev, pio);
+		if (pio->data_status == TCMU_STS_OK)
+			pio->pi_status = tcmur_pi_io_tuples(dev, pio);
+		return tcmur_pi_io_finish(dev, pio);
+	}
+
+	tcmur_cmd->pi_io = pio;
+	ret = tcmur_pi_io_data(dev, pio);
+	if (ret != TCMU_STS_OK) {
+		tcmur_cmd->pi_io = NULL;
+		tcmur_state_free(pio);
+		return ret;
+	}
+
+	ret = tcmur_pi_io_tuples(dev, pio);
+	if (ret != TCMU_STS_OK)
+		tcmur_cmd_complete(dev, &pio->pi_cmd, ret);
+	return TCMU_STS_OK;
+}
+
+/*
+ * Wrappers for the handler's data callouts, which add the PI half on
+ * devices that have it. They return like the callouts do.
+ */
+static int tcmur_dev_read(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			  struct iovec *iov, size_t iov_cnt, size_t len,
+			  off_t off)
+{
+	if (tcmu_dev_get_pi_enabled(dev))
+		return tcmur_pi_io(dev, tcmur_cmd, TCMUR_PI_READ, iov, iov_cnt,
+				   len, off);
+	return tcmu_get_runner_handler(dev)->read(dev, tcmur_cmd, iov, iov_cnt,
+						  len, off);
+}
+
+static int tcmur_dev_write(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			   struct iovec *iov, size_t iov_cnt, size_t len,
+			   off_t off)
+{
+	if (tcmu_dev_get_pi_enabled(dev))
+		return tcmur_pi_io(dev, tcmur_cmd, TCMUR_PI_WRITE, iov, iov_cnt,
+				   len, off);
+	return tcmu_get_runner_handler(dev)->write(dev, tcmur_cmd, iov,
+						   iov_cnt, len, off);
+}
+
+static int tcmur_dev_unmap(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			   uint64_t off, uint64_t len)
+{
+	if (tcmu_dev_get_pi_enabled(dev))
+		return tcmur_pi_io(dev, tcmur_cmd, TCMUR_PI_UNMAP, NULL, 0, len,
+				   off);
+	return tcmu_get_runner_handler(dev)->unmap(dev, tcmur_cmd, off, len);
+}
+
+static int tcmur_dev_write_zeroes(struct tcmu_device *dev,
+				  struct tcmur_cmd *tcmur_cmd, uint64_t off,
+				  uint64_t len)
+{
+	if (tcmu_dev_get_pi_enabled(dev))
+		return tcmur_pi_io(dev, tcmur_cmd, TCMUR_PI_ZEROES, NULL, 0, len,
+				   off);
+	return tcmu_get_runner_handler(dev)->write_zeroes(dev, tcmur_cmd, off,
+							  len);
+}
+
+/*
+ * Writes on devices with PI lock their range exclusively, so the data and
+ * tuples of a block are always from the same write.
+ */
+static bool tcmur_write_excl(struct tcmu_device *dev)
+{
+	return tcmu_dev_get_pi_enabled(dev);
+}
+
 static inline int check_iovec_length(struct tcmu_device *dev,
 				     struct tcmulib_cmd *cmd, uint32_t sectors)
 {
@@ -180,24 +990,22 @@ static void handle_generic_cbk(struct tcmu_device *dev,
 
 static int read_work_fn(struct tcmu_device *dev, void *data)
 {
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	struct tcmur_cmd *tcmur_cmd = data;
 	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
 
-	return rhandler->read(dev, tcmur_cmd, cmd->iovec, cmd->iov_cnt,
+	return tcmur_dev_read(dev, tcmur_cmd, cmd->iovec, cmd->iov_cnt,
 			      tcmu_iovec_length(cmd->iovec, cmd->iov_cnt),
 			      tcmu_cdb_to_byte(dev, cmd->cdb));
 }
 
 static int write_work_fn(struct tcmu_device *dev, void *data)
 {
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	struct tcmur_cmd *tcmur_cmd = data;
 	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
 
-	return rhandler->write(dev, tcmur_cmd, cmd->iovec, cmd->iov_cnt,
-				tcmu_iovec_length(cmd->iovec, cmd->iov_cnt),
-				tcmu_cdb_to_byte(dev, cmd->cdb));
+	return tcmur_dev_write(dev, tcmur_cmd, cmd->iovec, cmd->iov_cnt,
+			       tcmu_iovec_length(cmd->iovec, cmd->iov_cnt),
+			       tcmu_cdb_to_byte(dev, cmd->cdb));
 }
 
 struct unmap_state {
@@ -217,7 +1025,7 @@ static int unmap_init(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	struct unmap_state *state;
 	int ret;
 
-	if (tcmur_cmd_state_init(tcmur_cmd, sizeof(*state), 0))
+	if (tcmur_cmd_state_init(dev, tcmur_cmd, sizeof(*state), 0))
 		return TCMU_STS_NO_RESOURCE;
 	state = tcmur_cmd->cmd_state;
 
@@ -269,20 +1077,19 @@ static void handle_unmap_cbk(struct tcmu_device *dev,
 	struct unmap_descriptor *desc = tcmur_ucmd->cmd_state;
 	struct tcmulib_cmd *cmd = tcmur_ucmd->lib_cmd;
 
-	free(desc);
-	free(tcmur_ucmd);
+	tcmur_state_free(desc);
+	tcmur_state_free(tcmur_ucmd);
 
 	unmap_put(dev, cmd, ret);
 }
 
 static int unmap_work_fn(struct tcmu_device *dev, void *data)
 {
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	struct tcmur_cmd *tcmur_ucmd = data;
 	struct unmap_descriptor *desc = tcmur_ucmd->cmd_state;
 	uint64_t offset = desc->offset, length = desc->length;
 
-	return rhandler->unmap(dev, tcmur_ucmd, offset, length);
+	return tcmur_dev_unmap(dev, tcmur_ucmd, offset, length);
 }
 
 static int align_and_split_unmap(struct tcmu_device *dev,
@@ -332,7 +1139,7 @@ static int align_and_split_unmap(struct tcmu_device *dev,
 		     opt_unmap_gran, mask, lbas);
 
 	while (nlbas) {
-		desc = calloc(1, sizeof(*desc));
+		desc = tcmur_state_zalloc(dev, sizeof(*desc));
 		if (!desc) {
 			tcmu_dev_err(dev, "Failed to calloc desc!\n");
 			return TCMU_STS_NO_RESOURCE;
@@ -340,7 +1147,7 @@ static int align_and_split_unmap(struct tcmu_device *dev,
 		desc->offset = tcmu_lba_to_byte(dev, lba);
 		desc->length = tcmu_lba_to_byte(dev, lbas);
 
-		tcmur_ucmd = calloc(1, sizeof(*tcmur_ucmd));
+		tcmur_ucmd = tcmur_state_zalloc(dev, sizeof(*tcmur_ucmd));
 		if (!tcmur_ucmd) {
 			tcmu_dev_err(dev, "Failed to calloc unmap cmd!\n");
 			ret = TCMU_STS_NO_RESOURCE;
@@ -382,9 +1189,243 @@ free_ucmd:
 	pthread_mutex_lock(&state->lock);
 	state->refcount--;
 	pthread_mutex_unlock(&state->lock);
-	free(tcmur_ucmd);
+	tcmur_state_free(tcmur_ucmd);
 free_desc:
-	free(desc);
+	tcmur_state_free(desc);
+	return ret;
+}
+
+/*
+ * Vectored unmap support.
+ *
+ * For handlers that implement unmap_vec, the UNMAP block descriptors are
+ * collected, sorted by offset and merged when they overlap or are adjacent,
+ * so the handler gets the whole list in one call instead of one callout
+ * per descriptor or split.
+ */
+struct unmap_vec_state {
+	struct tcmur_unmap_range *ranges;
+	unsigned int nr_ranges;
+};
+
+static int unmap_range_cmp(const void *p1, const void *p2)
+{
+	const struct tcmur_unmap_range *r1 = p1;
+	const struct tcmur_unmap_range *r2 = p2;
+
+	if (r1->offset < r2->offset)
+		return -1;
+	return r1->offset > r2->offset;
+}
+
+static unsigned int unmap_ranges_merge(struct tcmur_unmap_range *ranges,
+				       unsigned int nr_ranges)
+{
+	unsigned int i, j = 0;
+	uint64_t end;
+
+	if (!nr_ranges)
+		return 0;
+
+	qsort(ranges, nr_ranges, sizeof(*ranges), unmap_range_cmp);
+
+	for (i = 1; i < nr_ranges; i++) {
+		end = ranges[j].offset + ranges[j].length;
+		if (ranges[i].offset > end) {
+			ranges[++j] = ranges[i];
+			continue;
+		}
+
+		if (ranges[i].offset + ranges[i].length > end)
+			ranges[j].length = ranges[i].offset + ranges[i].length -
+						ranges[j].offset;
+	}
+
+	return j + 1;
+}
+
+/*
+ * Split the merged ranges the same way align_and_split_unmap does for
+ * devices that asked for split unmaps. Returns a new array or NULL.
+ */
+static struct tcmur_unmap_range *
+unmap_ranges_split(struct tcmu_device *dev, struct tcmur_unmap_range *ranges,
+		   unsigned int *nr_ranges)
+{
+	uint64_t opt_unmap_gran = tcmu_dev_get_opt_unmap_gran(dev);
+	uint32_t align = tcmu_dev_get_unmap_gran_align(dev);
+	uint64_t mask = align ? align - 1 : 0;
+	struct tcmur_unmap_range *split;
+	uint64_t lba, nlbas, lbas;
+	unsigned int i, cnt = 0, pass;
+
+	/* First pass counts the splits, second one fills them in */
+	for (pass = 0; pass < 2; pass++) {
+		if (pass) {
+			split = tcmur_state_zalloc(dev, cnt * sizeof(*split));
+			if (!split)
+				return NULL;
+			cnt = 0;
+		}
+
+		for (i = 0; i < *nr_ranges; i++) {
+			lba = tcmu_byte_to_lba(dev, ranges[i].offset);
+			nlbas = tcmu_byte_to_lba(dev, ranges[i].length);
+			lbas = min(opt_unmap_gran - (lba & mask), nlbas);
+
+			while (nlbas) {
+				if (pass) {
+					split[cnt].offset = tcmu_lba_to_byte(dev, lba);
+					split[cnt].length = tcmu_lba_to_byte(dev, lbas);
+				}
+				cnt++;
+
+				nlbas -= lbas;
+				lba += lbas;
+				lbas = min(opt_unmap_gran, nlbas);
+			}
+		}
+	}
+
+	tcmu_dev_dbg(dev, "Split %u unmap ranges into %u\n", *nr_ranges, cnt);
+	*nr_ranges = cnt;
+	return split;
+}
+
+static void unmap_vec_state_free(struct tcmur_cmd *tcmur_cmd)
+{
+	struct unmap_vec_state *state = tcmur_cmd->cmd_state;
+
+	tcmur_state_free(state->ranges);
+	tcmur_cmd_state_free(tcmur_cmd);
+}
+
+static int writesame_write(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			   bool zeroed);
+
+static void handle_unmap_vec_cbk(struct tcmu_device *dev,
+				 struct tcmur_cmd *tcmur_cmd, int ret)
+{
+	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+
+	unmap_vec_state_free(tcmur_cmd);
+
+	/*
+	 * Unmapped blocks read back zeroes, so a WRITE SAME the handler
+	 * could not unmap still has to write them.
+	 */
+	if (ret == TCMU_STS_NOT_HANDLED && cmd->cdb[0] != UNMAP) {
+		tcmu_dev_dbg(dev, "Handler did not unmap, writing WRITE SAME data.\n");
+		ret = writesame_write(dev, tcmur_cmd,
+				      tcmu_iovec_zeroed(cmd->iovec,
+							cmd->iov_cnt));
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return;
+	}
+
+	aio_command_finish(dev, cmd, ret);
+}
+
+static int unmap_vec_work_fn(struct tcmu_device *dev, void *data)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_cmd *tcmur_cmd = data;
+	struct unmap_vec_state *state = tcmur_cmd->cmd_state;
+
+	return rhandler->unmap_vec(dev, tcmur_cmd, state->ranges,
+				   state->nr_ranges);
+}
+
+/*
+ * Merge, split if needed and submit the ranges. The ranges array is always
+ * consumed.
+ */
+static int unmap_vec_submit(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			    struct tcmur_unmap_range *ranges,
+			    unsigned int nr_ranges)
+{
+	struct tcmur_unmap_range *split;
+	struct unmap_vec_state *state;
+	int ret;
+
+	nr_ranges = unmap_ranges_merge(ranges, nr_ranges);
+	if (!nr_ranges) {
+		tcmur_state_free(ranges);
+		return TCMU_STS_OK;
+	}
+
+	if (dev->split_unmaps && tcmu_dev_get_opt_unmap_gran(dev)) {
+		split = unmap_ranges_split(dev, ranges, &nr_ranges);
+		tcmur_state_free(ranges);
+		if (!split)
+			return TCMU_STS_NO_RESOURCE;
+		ranges = split;
+	}
+
+	if (tcmur_cmd_state_init(dev, tcmur_cmd, sizeof(*state), 0)) {
+		tcmur_state_free(ranges);
+		return TCMU_STS_NO_RESOURCE;
+	}
+	state = tcmur_cmd->cmd_state;
+	state->ranges = ranges;
+	state->nr_ranges = nr_ranges;
+
+	tcmur_cmd->done = handle_unmap_vec_cbk;
+	ret = aio_request_schedule(dev, tcmur_cmd, unmap_vec_work_fn,
+				   tcmur_cmd_complete);
+	if (ret != TCMU_STS_ASYNC_HANDLED)
+		unmap_vec_state_free(tcmur_cmd);
+	return ret;
+}
+
+static int handle_unmap_vec(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			    uint16_t bddl, uint8_t *par)
+{
+	struct tcmur_unmap_range *ranges;
+	unsigned int nr_ranges = 0;
+	uint16_t offset = 0;
+	uint64_t lba, nlbas;
+	int ret, i = 0;
+
+	ranges = tcmur_state_zalloc(dev, (bddl / 16) * sizeof(*ranges));
+	if (!ranges)
+		return TCMU_STS_NO_RESOURCE;
+
+	/* The first descriptor list offset is 8 in Data-Out buffer */
+	par += 8;
+	while (bddl) {
+		lba = be64toh(*((uint64_t *)&par[offset]));
+		nlbas = be32toh(*((uint32_t *)&par[offset + 8]));
+
+		tcmu_dev_dbg(dev, "Parameter list %d, start lba: %"PRIu64", end lba: %"PRIu64", nlbas: %"PRIu64"\n",
+			     i++, lba, lba + nlbas - 1, nlbas);
+
+		if (nlbas > tcmu_dev_get_max_unmap_len(dev)) {
+			tcmu_dev_err(dev, "Illegal parameter list LBA count %"PRIu64" exceeds:%u\n",
+				     nlbas, tcmu_dev_get_max_unmap_len(dev));
+			ret = TCMU_STS_INVALID_PARAM_LIST;
+			goto free_ranges;
+		}
+
+		ret = check_lbas(dev, lba, nlbas);
+		if (ret)
+			goto free_ranges;
+
+		if (nlbas) {
+			ranges[nr_ranges].offset = tcmu_lba_to_byte(dev, lba);
+			ranges[nr_ranges].length = tcmu_lba_to_byte(dev, nlbas);
+			nr_ranges++;
+		}
+
+		/* The unmap block descriptor data length is 16 */
+		offset += 16;
+		bddl -= 16;
+	}
+
+	return unmap_vec_submit(dev, cmd->hm_private, ranges, nr_ranges);
+
+free_ranges:
+	tcmur_state_free(ranges);
 	return ret;
 }
 
@@ -396,6 +1437,9 @@ static int handle_unmap_internal(struct tcmu_device *dev, struct tcmulib_cmd *cm
 	uint16_t offset = 0;
 	int ret = TCMU_STS_OK, i = 0;
 
+	if (tcmur_can_offload(dev, tcmu_get_runner_handler(dev)->unmap_vec))
+		return handle_unmap_vec(dev, cmd, bddl, par);
+
 	ret = unmap_init(dev, cmd);
 	if (ret)
 		return ret;
@@ -461,7 +1505,8 @@ static int handle_unmap(struct tcmu_device *dev, struct tcmulib_cmd *origcmd)
 	uint16_t dl, bddl;
 	int ret;
 
-	if (!rhandler->unmap)
+	if (!tcmu_dev_get_unmap_enabled(dev) ||
+	    (!rhandler->unmap && !tcmur_can_offload(dev, rhandler->unmap_vec)))
 		return TCMU_STS_INVALID_CMD;
 
 	/*
@@ -501,7 +1546,7 @@ static int handle_unmap(struct tcmu_device *dev, struct tcmulib_cmd *origcmd)
 		return TCMU_STS_INVALID_PARAM_LIST_LEN;
 	}
 
-	par = calloc(1, data_length);
+	par = tcmur_state_zalloc(dev, data_length);
 	if (!par) {
 		tcmu_dev_err(dev, "The state parameter is NULL!\n");
 		return TCMU_STS_NO_RESOURCE;
@@ -534,94 +1579,356 @@ static int handle_unmap(struct tcmu_device *dev, struct tcmulib_cmd *origcmd)
 	 */
 	bddl &= ~0xF;
 
-	/*
-	 * If the UNMAP BLOCK DESCRIPTOR DATA LENGTH is set to zero, then
-	 * no unmap block descriptors are included in the UNMAP parameter
-	 * list.
-	 */
-	if (!bddl) {
-		ret = TCMU_STS_OK;
-		goto out_free_par;
-	}
+	/*
+	 * If the UNMAP BLOCK DESCRIPTOR DATA LENGTH is set to zero, then
+	 * no unmap block descriptors are included in the UNMAP parameter
+	 * list.
+	 */
+	if (!bddl) {
+		ret = TCMU_STS_OK;
+		goto out_free_par;
+	}
+
+	if (bddl / 16 > VPD_MAX_UNMAP_BLOCK_DESC_COUNT) {
+		tcmu_dev_err(dev, "Illegal parameter list count %hu exceeds :%u\n",
+			     bddl / 16, VPD_MAX_UNMAP_BLOCK_DESC_COUNT);
+		ret = TCMU_STS_INVALID_PARAM_LIST;
+		goto out_free_par;
+	}
+
+	ret = handle_unmap_internal(dev, origcmd, bddl, par);
+
+out_free_par:
+	tcmur_state_free(par);
+	return ret;
+}
+
+/*
+ * Windowed fan-out
+ *
+ * WRITE SAME, FORMAT UNIT and EXTENDED COPY are emulated by splitting the
+ * cmd into chunks, up to a window of which are in flight at once. Each
+ * chunk is a tcmur_cmd of its own, whose cmd_state starts with a struct
+ * tcmur_window_chunk. When a chunk is done with its range it claims the
+ * next one, until nothing is left or a chunk failed, and the cmd is
+ * completed with the first error once the last chunk is released.
+ */
+struct tcmur_window;
+
+struct tcmur_window_ops {
+	/*
+	 * Called with the window's lock held while no chunk has failed.
+	 * Hand the chunk its next range, or return false if there is none.
+	 */
+	bool (*claim)(struct tcmur_window *win, struct tcmur_cmd *tcmur_ucmd);
+	/* Start the claimed range, TCMU_STS_ASYNC_HANDLED or an error */
+	int (*issue)(struct tcmur_window *win, struct tcmur_cmd *tcmur_ucmd);
+	/* Complete the cmd, called once after the last chunk is released */
+	void (*finish)(struct tcmur_window *win, int ret);
+};
+
+struct tcmur_window {
+	struct tcmu_device *dev;
+	struct tcmur_cmd *tcmur_cmd;
+	const struct tcmur_window_ops *ops;
+	/* Optional buffer shared, read only, by the chunks */
+	void *buf;
+	size_t buf_len;
+
+	pthread_mutex_t lock;
+	unsigned int inflight;
+	int status;
+};
+
+struct tcmur_window_chunk {
+	struct tcmur_window *win;
+	struct iovec iov;
+};
+
+static int tcmur_window_init(struct tcmur_window *win, struct tcmu_device *dev,
+			     struct tcmur_cmd *tcmur_cmd,
+			     const struct tcmur_window_ops *ops)
+{
+	win->dev = dev;
+	win->tcmur_cmd = tcmur_cmd;
+	win->ops = ops;
+	win->status = TCMU_STS_OK;
+	/* released by tcmur_window_start when done submitting */
+	win->inflight = 1;
+
+	return pthread_mutex_init(&win->lock, NULL);
+}
+
+/* Called with win->lock held */
+static bool __tcmur_window_claim(struct tcmur_window *win,
+				 struct tcmur_cmd *tcmur_ucmd, int ret)
+{
+	if (ret != TCMU_STS_OK && win->status == TCMU_STS_OK)
+		win->status = ret;
+	if (win->status != TCMU_STS_OK)
+		return false;
+
+	return win->ops->claim(win, tcmur_ucmd);
+}
+
+static void tcmur_window_put(struct tcmur_window *win, int ret)
+{
+	bool last;
+
+	pthread_mutex_lock(&win->lock);
+	if (ret != TCMU_STS_OK && win->status == TCMU_STS_OK)
+		win->status = ret;
+	last = !--win->inflight;
+	pthread_mutex_unlock(&win->lock);
+
+	if (!last)
+		return;
+
+	pthread_mutex_destroy(&win->lock);
+	win->ops->finish(win, win->status);
+}
+
+/*
+ * A chunk finished, or failed, its current range. Move it on to the next
+ * one or release it.
+ */
+static void tcmur_window_chunk_done(struct tcmur_cmd *tcmur_ucmd, int ret)
+{
+	struct tcmur_window_chunk *chunk = tcmur_ucmd->cmd_state;
+	struct tcmur_window *win = chunk->win;
+	bool claimed;
+
+	for (;;) {
+		pthread_mutex_lock(&win->lock);
+		claimed = __tcmur_window_claim(win, tcmur_ucmd, ret);
+		pthread_mutex_unlock(&win->lock);
 
-	if (bddl / 16 > VPD_MAX_UNMAP_BLOCK_DESC_COUNT) {
-		tcmu_dev_err(dev, "Illegal parameter list count %hu exceeds :%u\n",
-			     bddl / 16, VPD_MAX_UNMAP_BLOCK_DESC_COUNT);
-		ret = TCMU_STS_INVALID_PARAM_LIST;
-		goto out_free_par;
+		if (!claimed)
+			break;
+
+		ret = win->ops->issue(win, tcmur_ucmd);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return;
 	}
 
-	ret = handle_unmap_internal(dev, origcmd, bddl, par);
+	tcmur_cmd_state_free(tcmur_ucmd);
+	tcmur_state_free(tcmur_ucmd);
+	tcmur_window_put(win, TCMU_STS_OK);
+}
 
-out_free_par:
-	free(par);
-	return ret;
+/*
+ * Start up to nr_chunks chunks with a chunk_len cmd_state each, and a
+ * data_len buffer of their own if data_len is set. The caller's reference
+ * on the window is dropped when done, so the cmd may be completed by the
+ * time this returns.
+ */
+static void tcmur_window_start(struct tcmur_window *win,
+			       unsigned int nr_chunks, int chunk_len,
+			       size_t data_len)
+{
+	struct tcmur_window_chunk *chunk;
+	struct tcmur_cmd *tcmur_ucmd;
+	int ret = TCMU_STS_OK;
+	unsigned int i;
+	bool claimed;
+
+	for (i = 0; i < nr_chunks; i++) {
+		tcmur_ucmd = tcmur_state_zalloc(win->dev, sizeof(*tcmur_ucmd));
+		if (!tcmur_ucmd)
+			goto no_resource;
+
+		if (tcmur_cmd_state_init(win->dev, tcmur_ucmd, chunk_len,
+					 data_len)) {
+			tcmur_state_free(tcmur_ucmd);
+			goto no_resource;
+		}
+		tcmur_ucmd->lib_cmd = win->tcmur_cmd->lib_cmd;
+		chunk = tcmur_ucmd->cmd_state;
+		chunk->win = win;
+		if (win->buf) {
+			chunk->iov.iov_base = win->buf;
+			chunk->iov.iov_len = win->buf_len;
+			tcmur_ucmd->iovec = &chunk->iov;
+			tcmur_ucmd->iov_cnt = 1;
+			tcmur_ucmd->iov_base_copy = win->buf;
+		}
+
+		pthread_mutex_lock(&win->lock);
+		claimed = __tcmur_window_claim(win, tcmur_ucmd, TCMU_STS_OK);
+		if (claimed)
+			win->inflight++;
+		pthread_mutex_unlock(&win->lock);
+
+		if (!claimed) {
+			tcmur_cmd_state_free(tcmur_ucmd);
+			tcmur_state_free(tcmur_ucmd);
+			break;
+		}
+
+		ret = win->ops->issue(win, tcmur_ucmd);
+		if (ret != TCMU_STS_ASYNC_HANDLED) {
+			/* records the error, there is no point starting more */
+			tcmur_window_chunk_done(tcmur_ucmd, ret);
+			ret = TCMU_STS_OK;
+			break;
+		}
+		ret = TCMU_STS_OK;
+	}
+	goto put;
+
+no_resource:
+	/* A smaller window is fine, as long as something is running */
+	tcmu_dev_err(win->dev, "Failed to allocate chunk %u\n", i);
+	if (!i)
+		ret = TCMU_STS_NO_RESOURCE;
+put:
+	tcmur_window_put(win, ret);
 }
 
+/*
+ * WRITE SAME emulation. The pattern is expanded into one buffer that all
+ * the chunks write.
+ */
+#define WRITE_SAME_MAX_CHUNKS 8
+
 struct write_same {
+	struct tcmur_window win;
 	uint64_t cur_lba;
 	uint64_t lba_cnt;
+	uint64_t write_lbas;
 };
 
+struct write_same_chunk {
+	struct tcmur_window_chunk wc;
+	uint64_t lba;
+};
+
+static void writesame_finish(struct tcmur_window *win, int ret)
+{
+	struct tcmur_cmd *tcmur_cmd = win->tcmur_cmd;
+	struct tcmu_device *dev = win->dev;
+
+	tcmur_cmd_state_free(tcmur_cmd);
+	aio_command_finish(dev, tcmur_cmd->lib_cmd, ret);
+}
+
+static bool writesame_claim(struct tcmur_window *win,
+			    struct tcmur_cmd *tcmur_ucmd)
+{
+	struct write_same *write_same = container_of(win, struct write_same,
+						     win);
+	struct write_same_chunk *chunk = tcmur_ucmd->cmd_state;
+	uint64_t lbas;
+
+	if (!write_same->lba_cnt)
+		return false;
+
+	lbas = min(write_same->write_lbas, write_same->lba_cnt);
+	chunk->lba = write_same->cur_lba;
+	tcmur_ucmd->requested = tcmu_lba_to_byte(win->dev, lbas);
+
+	tcmu_dev_dbg(win->dev, "Next lba: %"PRIu64", write lbas: %"PRIu64"\n",
+		     chunk->lba, lbas);
+
+	write_same->cur_lba += lbas;
+	write_same->lba_cnt -= lbas;
+	return true;
+}
+
 static int writesame_work_fn(struct tcmu_device *dev, void *data)
 {
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
-	struct tcmur_cmd *tcmur_cmd = data;
-	struct write_same *write_same = tcmur_cmd->cmd_state;
+	struct tcmur_cmd *tcmur_ucmd = data;
+	struct write_same_chunk *chunk = tcmur_ucmd->cmd_state;
 
-	tcmur_cmd_iovec_reset(tcmur_cmd, tcmur_cmd->requested);
+	tcmur_cmd_iovec_reset(tcmur_ucmd, tcmur_ucmd->requested);
 	/*
 	 * Write contents of the logical block data(from the Data-Out Buffer)
 	 * to each LBA in the specified LBA range.
 	 */
-	return rhandler->write(dev, tcmur_cmd, tcmur_cmd->iovec,
-			       tcmur_cmd->iov_cnt, tcmur_cmd->requested,
-			       tcmu_lba_to_byte(dev, write_same->cur_lba));
+	return tcmur_dev_write(dev, tcmur_ucmd, tcmur_ucmd->iovec,
+			       tcmur_ucmd->iov_cnt, tcmur_ucmd->requested,
+			       tcmu_lba_to_byte(dev, chunk->lba));
 }
 
 static void handle_writesame_cbk(struct tcmu_device *dev,
-				  struct tcmur_cmd *tcmur_cmd, int ret)
+				  struct tcmur_cmd *tcmur_ucmd, int ret)
 {
-	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
-	struct write_same *write_same = tcmur_cmd->cmd_state;
-	uint64_t write_lbas = tcmu_byte_to_lba(dev, tcmur_cmd->requested);
-	uint64_t left_lbas;
-	int rc;
+	struct write_same_chunk *chunk = tcmur_ucmd->cmd_state;
 
 	/* write failed - bail out */
 	if (ret != TCMU_STS_OK)
-		goto finish_err;
+		tcmu_dev_err(dev, "Write same chunk at lba %"PRIu64" failed\n",
+			     chunk->lba);
 
-	write_same->cur_lba += write_lbas;
-	write_same->lba_cnt -= write_lbas;
-	left_lbas = write_same->lba_cnt;
+	tcmur_window_chunk_done(tcmur_ucmd, ret);
+}
 
-	if (!left_lbas)
-		goto finish_err;
+static int writesame_issue(struct tcmur_window *win,
+			   struct tcmur_cmd *tcmur_ucmd)
+{
+	tcmur_ucmd->done = handle_writesame_cbk;
 
-	if (left_lbas <= write_lbas) {
-		tcmu_dev_dbg(dev, "Last lba: %"PRIu64", write lbas: %"PRIu64"\n",
-			     write_same->cur_lba, left_lbas);
+	return aio_request_schedule(win->dev, tcmur_ucmd, writesame_work_fn,
+				    tcmur_cmd_complete);
+}
 
-		tcmur_cmd->requested = tcmu_lba_to_byte(dev, left_lbas);
-	} else {
-		tcmu_dev_dbg(dev, "Next lba: %"PRIu64", write lbas: %"PRIu64"\n",
-			     write_same->cur_lba, write_lbas);
+static const struct tcmur_window_ops writesame_window_ops = {
+	.claim = writesame_claim,
+	.issue = writesame_issue,
+	.finish = writesame_finish,
+};
+
+/*
+ * Emulate WRITE SAME with writes. Returns TCMU_STS_ASYNC_HANDLED if the
+ * cmd will be completed, or a sense code if nothing was started.
+ */
+static int writesame_emulate(struct tcmu_device *dev,
+			     struct tcmur_cmd *tcmur_cmd)
+{
+	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+	uint8_t *cdb = cmd->cdb;
+	uint32_t lba_cnt = tcmu_cdb_get_xfer_length(cdb);
+	uint32_t block_size = tcmu_dev_get_block_size(dev);
+	size_t max_xfer_length, length = 1024 * 1024;
+	struct write_same *write_same;
+	uint64_t write_lbas;
+	void *pattern;
+	int i;
+
+	max_xfer_length = tcmu_dev_get_max_xfer_len(dev) * block_size;
+	length = round_up(length, max_xfer_length);
+	length = min(length, tcmu_lba_to_byte(dev, lba_cnt));
+
+	if (tcmur_cmd_state_init(dev, tcmur_cmd, sizeof(*write_same), length)) {
+		tcmu_dev_err(dev, "Failed to calloc write_same data!\n");
+		return TCMU_STS_NO_RESOURCE;
 	}
+	pattern = tcmur_cmd->iov_base_copy;
 
-	rc = aio_request_schedule(dev, tcmur_cmd, writesame_work_fn,
-				  tcmur_cmd_complete);
-	if (rc != TCMU_STS_ASYNC_HANDLED) {
-		tcmu_dev_err(dev, "Write same async handle cmd failure\n");
-		ret = TCMU_STS_WR_ERR;
-		goto finish_err;
+	write_lbas = tcmu_byte_to_lba(dev, length);
+	for (i = 0; i < write_lbas; i++)
+		memcpy(pattern + i * block_size, cmd->iovec->iov_base,
+		       block_size);
+
+	write_same = tcmur_cmd->cmd_state;
+	write_same->cur_lba = tcmu_cdb_get_lba(cdb);
+	write_same->lba_cnt = lba_cnt;
+	write_same->write_lbas = write_lbas;
+
+	if (tcmur_window_init(&write_same->win, dev, tcmur_cmd,
+			      &writesame_window_ops)) {
+		tcmur_cmd_state_free(tcmur_cmd);
+		return TCMU_STS_NO_RESOURCE;
 	}
+	write_same->win.buf = pattern;
+	write_same->win.buf_len = length;
 
-	return;
+	tcmu_dev_dbg(dev, "First lba: %"PRIu64", write lbas: %"PRIu64"\n",
+		     write_same->cur_lba, write_lbas);
 
-finish_err:
-	tcmur_cmd_state_free(tcmur_cmd);
-	aio_command_finish(dev, cmd, ret);
+	tcmur_window_start(&write_same->win, WRITE_SAME_MAX_CHUNKS,
+			   sizeof(struct write_same_chunk), 0);
+	return TCMU_STS_ASYNC_HANDLED;
 }
 
 static int handle_writesame_check(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
@@ -680,7 +1987,7 @@ static int handle_unmap_in_writesame(struct tcmu_device *dev,
 	uint8_t *cdb = cmd->cdb;
 	uint64_t lba = tcmu_cdb_get_lba(cdb);
 	uint64_t nlbas = tcmu_cdb_get_xfer_length(cdb);
-	uint32_t align = tcmu_dev_get_unmap_gran_align(dev);
+	uint32_t align = tcmu_dev_get_unmap_gran_align(dev) ? : 1;
 	struct unmap_state *state;
 	int ret;
 
@@ -695,6 +2002,17 @@ static int handle_unmap_in_writesame(struct tcmu_device *dev,
 
 	tcmu_dev_dbg(dev, "Do UNMAP in WRITE_SAME cmd!\n");
 
+	if (tcmur_can_offload(dev, tcmu_get_runner_handler(dev)->unmap_vec)) {
+		struct tcmur_unmap_range *range;
+
+		range = tcmur_state_zalloc(dev, sizeof(*range));
+		if (!range)
+			return TCMU_STS_NO_RESOURCE;
+		range->offset = tcmu_lba_to_byte(dev, lba);
+		range->length = tcmu_lba_to_byte(dev, nlbas);
+		return unmap_vec_submit(dev, tcmur_cmd, range, 1);
+	}
+
 	ret = unmap_init(dev, cmd);
 	if (ret)
 		return ret;
@@ -728,18 +2046,68 @@ static int tcmur_writesame_work_fn(struct tcmu_device *dev, void *data)
 			     cmd->iov_cnt);
 }
 
+static int tcmur_write_zeroes_work_fn(struct tcmu_device *dev, void *data)
+{
+	struct tcmur_cmd *tcmur_cmd = data;
+	uint8_t *cdb = tcmur_cmd->lib_cmd->cdb;
+
+	return tcmur_dev_write_zeroes(dev, tcmur_cmd,
+				      tcmu_cdb_to_byte(dev, cdb),
+				      tcmu_lba_to_byte(dev, tcmu_cdb_get_xfer_length(cdb)));
+}
+
+/* Completion for the handler's write_zeroes and writesame callouts */
+static void handle_writesame_offload_cbk(struct tcmu_device *dev,
+					 struct tcmur_cmd *tcmur_cmd, int ret)
+{
+	if (ret == TCMU_STS_NOT_HANDLED) {
+		tcmu_dev_dbg(dev, "Handler did not take WRITE SAME, emulating it.\n");
+		ret = writesame_emulate(dev, tcmur_cmd);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return;
+	}
+
+	aio_command_finish(dev, tcmur_cmd->lib_cmd, ret);
+}
+
+/*
+ * Write the WRITE SAME pattern, with the handler's write_zeroes or
+ * writesame callouts if it has them.
+ */
+static int writesame_write(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			   bool zeroed)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	int ret;
+
+	if (zeroed && rhandler->write_zeroes) {
+		tcmur_cmd->done = handle_writesame_offload_cbk;
+		ret = aio_request_schedule(dev, tcmur_cmd,
+					   tcmur_write_zeroes_work_fn,
+					   tcmur_cmd_complete);
+		if (ret != TCMU_STS_NOT_HANDLED)
+			return ret;
+	}
+
+	if (tcmur_can_offload(dev, rhandler->writesame)) {
+		tcmur_cmd->cmd_state = rhandler->writesame;
+		tcmur_cmd->done = handle_writesame_offload_cbk;
+		ret = aio_request_schedule(dev, tcmur_cmd,
+					   tcmur_writesame_work_fn,
+					   tcmur_cmd_complete);
+		if (ret != TCMU_STS_NOT_HANDLED)
+			return ret;
+	}
+
+	return writesame_emulate(dev, tcmur_cmd);
+}
+
 static int handle_writesame(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
-	uint8_t *cdb = cmd->cdb;
-	uint32_t lba_cnt = tcmu_cdb_get_xfer_length(cdb);
-	uint32_t block_size = tcmu_dev_get_block_size(dev);
-	uint64_t start_lba = tcmu_cdb_get_lba(cdb);
-	uint64_t write_lbas;
-	size_t max_xfer_length, length = 1024 * 1024;
-	struct write_same *write_same;
-	int i, ret;
+	bool zeroed, unmap;
+	int ret;
 
 	if (tcmu_dev_in_recovery(dev))
 		return TCMU_STS_BUSY;
@@ -752,88 +2120,93 @@ static int handle_writesame(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	if (ret)
 		return ret;
 
-	if (rhandler->unmap && (cmd->cdb[1] & 0x08)) {
+	/*
+	 * LBPRZ is always reported, so a zero pattern can be unmapped like
+	 * the UNMAP bit asks for, if the handler cannot write zeroes more
+	 * cheaply itself.
+	 */
+	zeroed = tcmu_iovec_zeroed(cmd->iovec, cmd->iov_cnt);
+	unmap = cmd->cdb[1] & 0x08 || (zeroed && !rhandler->write_zeroes);
+
+	if (tcmu_dev_get_unmap_enabled(dev) &&
+	    (rhandler->unmap || tcmur_can_offload(dev, rhandler->unmap_vec)) &&
+	    unmap) {
 		ret = handle_unmap_in_writesame(dev, cmd);
 		if (ret != TCMU_STS_NOT_HANDLED)
 			return ret;
 	}
 
-	if (rhandler->writesame) {
-		tcmur_cmd->cmd_state = rhandler->writesame;
-		tcmur_cmd->done = handle_generic_cbk;
-		return aio_request_schedule(dev, tcmur_cmd,
-					    tcmur_writesame_work_fn,
-					    tcmur_cmd_complete);
-	}
-
-	max_xfer_length = tcmu_dev_get_max_xfer_len(dev) * block_size;
-	length = round_up(length, max_xfer_length);
-	length = min(length, tcmu_lba_to_byte(dev, lba_cnt));
-
-	if (tcmur_cmd_state_init(tcmur_cmd, sizeof(*write_same), length)) {
-		tcmu_dev_err(dev, "Failed to calloc write_same data!\n");
-		return TCMU_STS_NO_RESOURCE;
-	}
-	tcmur_cmd->done = handle_writesame_cbk;
-
-	write_lbas = tcmu_byte_to_lba(dev, length);
-	for (i = 0; i < write_lbas; i++)
-		memcpy(tcmur_cmd->iovec->iov_base + i * block_size,
-		       cmd->iovec->iov_base, block_size);
-
-	write_same = tcmur_cmd->cmd_state;
-	write_same->cur_lba = start_lba;
-	write_same->lba_cnt = lba_cnt;
-
-	tcmu_dev_dbg(dev, "First lba: %"PRIu64", write lbas: %"PRIu64"\n",
-		     start_lba, write_lbas);
-
-	return aio_request_schedule(dev, tcmur_cmd, writesame_work_fn,
-				    tcmur_cmd_complete);
+	return writesame_write(dev, tcmur_cmd, zeroed);
 }
 
 /* async write verify */
+
+/* Data read back at a time to verify a WRITE AND VERIFY */
+#define WRITE_VERIFY_CHUNK_SIZE		(1024 * 1024)
+
 struct write_verify_state {
+	/* Data-Out not verified yet */
 	struct iovec *w_iovec;
 	size_t w_iov_cnt;
+	size_t length;
+	size_t verified;
 };
 
+static int write_verify_read_work_fn(struct tcmu_device *dev, void *data)
+{
+	struct tcmur_cmd *tcmur_cmd = data;
+	struct write_verify_state *state = tcmur_cmd->cmd_state;
+	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+
+	tcmur_cmd_iovec_reset(tcmur_cmd, tcmur_cmd->requested);
+	return tcmur_dev_read(dev, tcmur_cmd, tcmur_cmd->iovec,
+			      tcmur_cmd->iov_cnt, tcmur_cmd->requested,
+			      tcmu_cdb_to_byte(dev, cmd->cdb) + state->verified);
+}
+
 static void handle_write_verify_read_cbk(struct tcmu_device *dev,
 					 struct tcmur_cmd *tcmur_cmd, int ret)
 {
 	struct write_verify_state *state = tcmur_cmd->cmd_state;
 	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
-	uint32_t cmp_offset;
+	size_t consumed;
+	off_t cmp_offset;
 
 	/* failed read - bail out */
 	if (ret != TCMU_STS_OK)
 		goto done;
 
-	ret = TCMU_STS_OK;
 	cmp_offset = tcmu_iovec_compare(tcmur_cmd->iov_base_copy,
 					state->w_iovec, tcmur_cmd->requested);
 	if (cmp_offset != -1) {
-		tcmu_dev_err(dev, "Verify failed at offset %u\n", cmp_offset);
+		cmp_offset += state->verified;
+		tcmu_dev_err(dev, "Verify failed at offset %u\n",
+			     (uint32_t)cmp_offset);
 		ret =  TCMU_STS_MISCOMPARE;
 		tcmu_sense_set_info(cmd->sense_buf, cmp_offset);
+		goto done;
 	}
 
+	state->verified += tcmur_cmd->requested;
+	if (state->verified == state->length)
+		goto done;
+
+	consumed = tcmu_iovec_seek(state->w_iovec, tcmur_cmd->requested);
+	state->w_iovec += consumed;
+	state->w_iov_cnt -= consumed;
+
+	tcmur_cmd->requested = min(state->length - state->verified,
+				   (size_t)WRITE_VERIFY_CHUNK_SIZE);
+	ret = aio_request_schedule(dev, tcmur_cmd, write_verify_read_work_fn,
+				   tcmur_cmd_complete);
+	if (ret == TCMU_STS_ASYNC_HANDLED)
+		return;
+
 done:
 	tcmur_cmd_state_free(tcmur_cmd);
 	aio_command_finish(dev, cmd, ret);
 }
 
-static int write_verify_read_work_fn(struct tcmu_device *dev, void *data)
-{
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
-	struct tcmur_cmd *tcmur_cmd = data;
-	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
-
-	return rhandler->read(dev, tcmur_cmd, tcmur_cmd->iovec,
-			      tcmur_cmd->iov_cnt, tcmur_cmd->requested,
-			      tcmu_cdb_to_byte(dev, cmd->cdb));
-}
-
 static void handle_write_verify_write_cbk(struct tcmu_device *dev,
 					  struct tcmur_cmd *tcmur_cmd,
 					  int ret)
@@ -852,50 +2225,133 @@ static void handle_write_verify_write_cbk(struct tcmu_device *dev,
 		goto finish_err;
 	return;
 
-finish_err:
-	tcmur_cmd_state_free(tcmur_cmd);
-	aio_command_finish(dev, cmd, ret);
+finish_err:
+	tcmur_cmd_state_free(tcmur_cmd);
+	aio_command_finish(dev, cmd, ret);
+}
+
+/*
+ * Set up the cmd to be written and then read back and compared, a chunk
+ * at a time so only one chunk of data has to be held for the read.
+ */
+static int write_verify_init(struct tcmu_device *dev,
+			     struct tcmur_cmd *tcmur_cmd)
+{
+	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+	size_t length = tcmu_lba_to_byte(dev, tcmu_cdb_get_xfer_length(cmd->cdb));
+	struct write_verify_state *state;
+	int i, state_len;
+
+	state_len = sizeof(*state) + (cmd->iov_cnt * sizeof(struct iovec));
+
+	if (tcmur_cmd_state_init(dev, tcmur_cmd, state_len,
+				 min(length, (size_t)WRITE_VERIFY_CHUNK_SIZE)))
+		return TCMU_STS_NO_RESOURCE;
+	tcmur_cmd->done = handle_write_verify_write_cbk;
+
+	state = tcmur_cmd->cmd_state;
+	state->length = length;
+	/*
+	 * Copy cmd iovec for later comparision in case handler modifies
+	 * pointers/lens.
+	 */
+	state->w_iovec = (void *)state + sizeof(*state);
+	state->w_iov_cnt = cmd->iov_cnt;
+	for (i = 0; i < cmd->iov_cnt; i++) {
+		state->w_iovec[i].iov_base = cmd->iovec[i].iov_base;
+		state->w_iovec[i].iov_len = cmd->iovec[i].iov_len;
+	}
+
+	return TCMU_STS_OK;
+}
+
+/*
+ * Emulate WRITE AND VERIFY with a write and reads. Returns
+ * TCMU_STS_ASYNC_HANDLED if the cmd will be completed, or a sense code if
+ * nothing was started.
+ */
+static int write_verify_emulate(struct tcmu_device *dev,
+				struct tcmur_cmd *tcmur_cmd)
+{
+	int ret;
+
+	ret = write_verify_init(dev, tcmur_cmd);
+	if (ret)
+		return ret;
+
+	ret = aio_request_schedule(dev, tcmur_cmd, write_work_fn,
+				   tcmur_cmd_complete);
+	if (ret != TCMU_STS_ASYNC_HANDLED)
+		tcmur_cmd_state_free(tcmur_cmd);
+	return ret;
+}
+
+static int write_verify_work_fn(struct tcmu_device *dev, void *data)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_cmd *tcmur_cmd = data;
+	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+
+	return rhandler->write_verify(dev, tcmur_cmd, cmd->iovec, cmd->iov_cnt,
+				      tcmu_iovec_length(cmd->iovec, cmd->iov_cnt),
+				      tcmu_cdb_to_byte(dev, cmd->cdb));
+}
+
+/* Completion for the handler's write_verify callout */
+static void handle_write_verify_offload_cbk(struct tcmu_device *dev,
+					    struct tcmur_cmd *tcmur_cmd,
+					    int ret)
+{
+	if (ret == TCMU_STS_NOT_HANDLED) {
+		tcmu_dev_dbg(dev, "Handler did not take WRITE AND VERIFY, emulating it.\n");
+		ret = write_verify_emulate(dev, tcmur_cmd);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return;
+	}
+
+	aio_command_finish(dev, tcmur_cmd->lib_cmd, ret);
 }
 
 static int handle_write_verify(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
 	uint8_t *cdb = cmd->cdb;
-	size_t length = tcmu_lba_to_byte(dev, tcmu_cdb_get_xfer_length(cdb));
-	struct write_verify_state *state;
-	int i, ret, state_len;
+	tcmu_work_fn_t work_fn;
+	bool offload;
+	int ret;
 
 	ret = check_lba_and_length(dev, cmd, tcmu_cdb_get_xfer_length(cdb));
 	if (ret)
 		return ret;
 
-	state_len = sizeof(*state) + (cmd->iov_cnt * sizeof(struct iovec));
-
-	if (tcmur_cmd_state_init(tcmur_cmd, state_len, length))
-		return TCMU_STS_NO_RESOURCE;
-	tcmur_cmd->done = handle_write_verify_write_cbk;
-
-	state = tcmur_cmd->cmd_state;
-	/*
-	 * Copy cmd iovec for later comparision in case handler modifies
-	 * pointers/lens.
-	 */
-	state->w_iovec = (void *)state + sizeof(*state);
-	state->w_iov_cnt = cmd->iov_cnt;
-	for (i = 0; i < cmd->iov_cnt; i++) {
-		state->w_iovec[i].iov_base = cmd->iovec[i].iov_base;
-		state->w_iovec[i].iov_len = cmd->iovec[i].iov_len;
+	offload = tcmur_can_offload(dev, rhandler->write_verify);
+	if (offload) {
+		tcmur_cmd->done = handle_write_verify_offload_cbk;
+		work_fn = write_verify_work_fn;
+	} else {
+		ret = write_verify_init(dev, tcmur_cmd);
+		if (ret)
+			return ret;
+		work_fn = write_work_fn;
 	}
 
-	ret = aio_request_schedule(dev, tcmur_cmd, write_work_fn,
-				   tcmur_cmd_complete);
-	if (ret != TCMU_STS_ASYNC_HANDLED)
-		goto free_state;
+	/* Keep other writes out until the data has been verified */
+	if (!tcmur_range_lock(dev, tcmur_cmd, tcmu_cdb_get_lba(cdb),
+			      tcmu_cdb_get_xfer_length(cdb), true, work_fn))
+		return TCMU_STS_ASYNC_HANDLED;
 
-	return TCMU_STS_ASYNC_HANDLED;
+	ret = aio_request_schedule(dev, tcmur_cmd, work_fn, tcmur_cmd_complete);
+	if (ret == TCMU_STS_ASYNC_HANDLED)
+		return ret;
 
-free_state:
-	tcmur_cmd_state_free(tcmur_cmd);
+	if (!offload)
+		tcmur_cmd_state_free(tcmur_cmd);
+	else if (ret == TCMU_STS_NOT_HANDLED)
+		ret = write_verify_emulate(dev, tcmur_cmd);
+
+	if (ret != TCMU_STS_ASYNC_HANDLED)
+		tcmur_range_unlock(dev, tcmur_cmd);
 	return ret;
 }
 
@@ -917,6 +2373,14 @@ struct xcopy {
 	uint32_t dtdi;
 	uint32_t lba_cnt;
 	uint32_t copy_lbas;
+
+	/*
+	 * Up to window chunks of copy_lbas are copied at the same time.
+	 * issued_lbas have been handed out to chunks so far.
+	 */
+	struct tcmur_window win;
+	unsigned int window;
+	uint32_t issued_lbas;
 };
 
 /* For now only supports block -> block type */
@@ -1237,7 +2701,7 @@ static int xcopy_parse_parameter_list(struct tcmu_device *dev,
 	 * of the parameter data that shall be contained in the Data-Out
 	 * Buffer.
 	*/
-	par = calloc(1, data_length);
+	par = tcmur_state_zalloc(dev, data_length);
 	if (!par) {
 		tcmu_dev_err(dev, "calloc parameter list buffer error\n");
 		return TCMU_STS_NO_RESOURCE;
@@ -1400,116 +2864,196 @@ static int xcopy_parse_parameter_list(struct tcmu_device *dev,
 		goto err;
 	}
 
-	free(par);
+	tcmur_state_free(par);
 	return TCMU_STS_OK;
 
 err:
-	free(par);
+	tcmur_state_free(par);
 
 	return ret;
 }
 
+/*
+ * Each chunk of the copy has its own copy_lbas sized buffer. It reads its
+ * range from the src dev and then writes it to the dst dev.
+ */
+struct xcopy_chunk {
+	struct tcmur_window_chunk wc;
+	struct xcopy *xcopy;
+	uint64_t src_lba;
+	uint64_t dst_lba;
+	uint32_t lbas;
+};
+
+static void xcopy_finish(struct tcmur_window *win, int ret)
+{
+	struct tcmur_cmd *tcmur_cmd = win->tcmur_cmd;
+
+	aio_command_finish(win->dev, tcmur_cmd->lib_cmd, ret);
+	tcmur_cmd_state_free(tcmur_cmd);
+}
+
+static bool xcopy_chunk_claim(struct tcmur_window *win,
+			      struct tcmur_cmd *tcmur_ucmd)
+{
+	struct xcopy *xcopy = container_of(win, struct xcopy, win);
+	struct xcopy_chunk *chunk = tcmur_ucmd->cmd_state;
+
+	if (xcopy->issued_lbas == xcopy->lba_cnt)
+		return false;
+
+	chunk->xcopy = xcopy;
+	chunk->src_lba = xcopy->src_lba + xcopy->issued_lbas;
+	chunk->dst_lba = xcopy->dst_lba + xcopy->issued_lbas;
+	chunk->lbas = min(xcopy->copy_lbas,
+			  xcopy->lba_cnt - xcopy->issued_lbas);
+	xcopy->issued_lbas += chunk->lbas;
+	return true;
+}
+
 static int xcopy_read_work_fn(struct tcmu_device *src_dev, void *data);
 static void handle_xcopy_read_cbk(struct tcmu_device *src_dev,
-				  struct tcmur_cmd *tcmur_cmd, int ret);
+				  struct tcmur_cmd *tcmur_ucmd, int ret);
 
-static void handle_xcopy_write_cbk(struct tcmu_device *dst_dev,
-				  struct tcmur_cmd *tcmur_cmd, int ret)
+static int xcopy_chunk_start(struct tcmur_window *win,
+			     struct tcmur_cmd *tcmur_ucmd)
 {
-	struct xcopy *xcopy = tcmur_cmd->cmd_state;
-	struct tcmu_device *src_dev = xcopy->src_dev;
+	struct xcopy_chunk *chunk = tcmur_ucmd->cmd_state;
+	struct xcopy *xcopy = chunk->xcopy;
 
-	/* write failed - bail out */
-	if (ret != TCMU_STS_OK) {
-		tcmu_dev_err(src_dev, "Failed to write to dst device!\n");
-		goto out;
-	}
+	tcmur_ucmd->requested = tcmu_lba_to_byte(xcopy->src_dev, chunk->lbas);
+	tcmur_ucmd->done = handle_xcopy_read_cbk;
 
-	xcopy->lba_cnt -= xcopy->copy_lbas;
-	if (!xcopy->lba_cnt)
-		goto out;
+	return aio_request_schedule(xcopy->src_dev, tcmur_ucmd,
+				    xcopy_read_work_fn, tcmur_cmd_complete);
+}
 
-	xcopy->src_lba += xcopy->copy_lbas;
-	xcopy->dst_lba += xcopy->copy_lbas;
-	xcopy->copy_lbas = min(xcopy->lba_cnt, xcopy->copy_lbas);
-	tcmur_cmd->requested = tcmu_lba_to_byte(src_dev, xcopy->copy_lbas);
+static const struct tcmur_window_ops xcopy_window_ops = {
+	.claim = xcopy_chunk_claim,
+	.issue = xcopy_chunk_start,
+	.finish = xcopy_finish,
+};
 
-	tcmur_cmd->done = handle_xcopy_read_cbk;
-	ret = aio_request_schedule(xcopy->src_dev, tcmur_cmd,
-				   xcopy_read_work_fn, tcmur_cmd_complete);
-	if (ret != TCMU_STS_ASYNC_HANDLED)
-		goto out;
+static void handle_xcopy_write_cbk(struct tcmu_device *dst_dev,
+				   struct tcmur_cmd *tcmur_ucmd, int ret)
+{
+	tcmur_range_unlock(dst_dev, tcmur_ucmd);
+	tcmur_dev_mark_dirty(dst_dev);
 
-	return;
+	/* write failed - bail out */
+	if (ret != TCMU_STS_OK)
+		tcmu_dev_err(dst_dev, "Failed to write to dst device!\n");
 
-out:
-	aio_command_finish(xcopy->origdev, tcmur_cmd->lib_cmd, ret);
-	tcmur_cmd_state_free(tcmur_cmd);
+	tcmur_window_chunk_done(tcmur_ucmd, ret);
 }
 
 static int xcopy_write_work_fn(struct tcmu_device *dst_dev, void *data)
 {
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dst_dev);
-	struct tcmur_cmd *tcmur_cmd = data;
-	struct xcopy *xcopy = tcmur_cmd->cmd_state;
+	struct tcmur_cmd *tcmur_ucmd = data;
+	struct xcopy_chunk *chunk = tcmur_ucmd->cmd_state;
 
-	tcmur_cmd_iovec_reset(tcmur_cmd, tcmur_cmd->requested);
+	tcmur_cmd_iovec_reset(tcmur_ucmd, tcmur_ucmd->requested);
 
-	return rhandler->write(dst_dev, tcmur_cmd, tcmur_cmd->iovec,
-			       tcmur_cmd->iov_cnt, tcmur_cmd->requested,
-			       tcmu_lba_to_byte(dst_dev, xcopy->dst_lba));
+	return tcmur_dev_write(dst_dev, tcmur_ucmd, tcmur_ucmd->iovec,
+			       tcmur_ucmd->iov_cnt, tcmur_ucmd->requested,
+			       tcmu_lba_to_byte(dst_dev, chunk->dst_lba));
 }
 
 static void handle_xcopy_read_cbk(struct tcmu_device *src_dev,
-				  struct tcmur_cmd *tcmur_cmd,
+				  struct tcmur_cmd *tcmur_ucmd,
 				  int ret)
 {
-	struct xcopy *xcopy = tcmur_cmd->cmd_state;
+	struct xcopy_chunk *chunk = tcmur_ucmd->cmd_state;
 
 	/* read failed - bail out */
 	if (ret != TCMU_STS_OK) {
 		tcmu_dev_err(src_dev, "Failed to read from src device!\n");
-		goto err;
+		goto done;
 	}
 
-	tcmur_cmd->done = handle_xcopy_write_cbk;
+	tcmur_ucmd->done = handle_xcopy_write_cbk;
+
+	if (!tcmur_range_lock(chunk->xcopy->dst_dev, tcmur_ucmd,
+			      chunk->dst_lba, chunk->lbas,
+			      tcmur_write_excl(chunk->xcopy->dst_dev),
+			      xcopy_write_work_fn))
+		return;
 
-	ret = aio_request_schedule(xcopy->dst_dev, tcmur_cmd,
+	ret = aio_request_schedule(chunk->xcopy->dst_dev, tcmur_ucmd,
 				   xcopy_write_work_fn, tcmur_cmd_complete);
-	if (ret != TCMU_STS_ASYNC_HANDLED)
-		goto err;
+	if (ret == TCMU_STS_ASYNC_HANDLED)
+		return;
 
-	return;
+	tcmur_range_unlock(chunk->xcopy->dst_dev, tcmur_ucmd);
 
-err:
-	aio_command_finish(xcopy->origdev, tcmur_cmd->lib_cmd, ret);
-	tcmur_cmd_state_free(tcmur_cmd);
+done:
+	tcmur_window_chunk_done(tcmur_ucmd, ret);
 }
 
 static int xcopy_read_work_fn(struct tcmu_device *src_dev, void *data)
 {
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(src_dev);
-	struct tcmur_cmd *tcmur_cmd = data;
-	struct xcopy *xcopy = tcmur_cmd->cmd_state;
+	struct tcmur_cmd *tcmur_ucmd = data;
+	struct xcopy_chunk *chunk = tcmur_ucmd->cmd_state;
 
 	tcmu_dev_dbg(src_dev,
 		     "Copying %u sectors from src (lba:%"PRIu64") to dst (lba:%"PRIu64")\n",
-		     xcopy->copy_lbas, xcopy->src_lba, xcopy->dst_lba);
+		     chunk->lbas, chunk->src_lba, chunk->dst_lba);
 
-	tcmur_cmd_iovec_reset(tcmur_cmd, tcmur_cmd->requested);
+	tcmur_cmd_iovec_reset(tcmur_ucmd, tcmur_ucmd->requested);
 
-	return rhandler->read(src_dev, tcmur_cmd, tcmur_cmd->iovec,
-			      tcmur_cmd->iov_cnt, tcmur_cmd->requested,
-			      tcmu_lba_to_byte(src_dev, xcopy->src_lba));
+	return tcmur_dev_read(src_dev, tcmur_ucmd, tcmur_ucmd->iovec,
+			      tcmur_ucmd->iov_cnt, tcmur_ucmd->requested,
+			      tcmu_lba_to_byte(src_dev, chunk->src_lba));
+}
+
+/* The caller's reference on the xcopy is dropped when done */
+static void xcopy_pipeline_start(struct xcopy *xcopy)
+{
+	tcmur_window_start(&xcopy->win, xcopy->window,
+			   sizeof(struct xcopy_chunk),
+			   tcmu_lba_to_byte(xcopy->src_dev, xcopy->copy_lbas));
+}
+
+static void handle_xcopy_copy_cbk(struct tcmu_device *dev,
+				  struct tcmur_cmd *tcmur_cmd, int ret)
+{
+	struct xcopy *xcopy = tcmur_cmd->cmd_state;
+
+	if (ret == TCMU_STS_NOT_HANDLED) {
+		tcmu_dev_dbg(dev, "Handler could not offload copy, using read/write.\n");
+		xcopy_pipeline_start(xcopy);
+		return;
+	}
+
+	tcmur_dev_mark_dirty(xcopy->dst_dev);
+	tcmur_window_put(&xcopy->win, ret);
+}
+
+static int xcopy_copy_work_fn(struct tcmu_device *dev, void *data)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_cmd *tcmur_cmd = data;
+	struct xcopy *xcopy = tcmur_cmd->cmd_state;
+
+	tcmu_dev_dbg(dev,
+		     "Offloading copy of %u sectors from lba %"PRIu64" to lba %"PRIu64"\n",
+		     xcopy->lba_cnt, xcopy->src_lba, xcopy->dst_lba);
+
+	return rhandler->copy(dev, tcmur_cmd,
+			      tcmu_lba_to_byte(dev, xcopy->src_lba),
+			      tcmu_lba_to_byte(dev, xcopy->dst_lba),
+			      tcmu_lba_to_byte(dev, xcopy->lba_cnt));
 }
 
 /* async xcopy */
 static int handle_xcopy(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
 	uint8_t *cdb = cmd->cdb;
 	size_t data_length = tcmu_cdb_get_xfer_length(cdb);
 	uint32_t max_sectors, src_max_sectors, dst_max_sectors;
+	struct tcmur_handler *rhandler;
 	struct xcopy *xcopy, xcopy_parse;
 	int ret;
 
@@ -1554,25 +3098,42 @@ static int handle_xcopy(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	max_sectors = min(src_max_sectors, dst_max_sectors);
 	xcopy_parse.copy_lbas = min(max_sectors, xcopy_parse.lba_cnt);
 
-	if (tcmur_cmd_state_init(tcmur_cmd, sizeof(*xcopy),
-				 tcmu_lba_to_byte(xcopy_parse.src_dev,
-						  xcopy_parse.copy_lbas))) {
+	if (tcmur_cmd_state_init(dev, tcmur_cmd, sizeof(*xcopy), 0)) {
 		tcmu_dev_err(dev, "calloc xcopy data error\n");
 		return TCMU_STS_NO_RESOURCE;
 	}
-	tcmur_cmd->done = handle_xcopy_read_cbk;
 
 	xcopy = tcmur_cmd->cmd_state;
 	memcpy(xcopy, &xcopy_parse, sizeof(*xcopy));
 	xcopy->origdev = dev;
+	xcopy->window = rdev->xcopy_window;
 
-	ret = aio_request_schedule(xcopy->src_dev, tcmur_cmd,
-				   xcopy_read_work_fn, tcmur_cmd_complete);
-	if (ret == TCMU_STS_ASYNC_HANDLED)
-		return ret;
+	ret = tcmur_window_init(&xcopy->win, dev, tcmur_cmd,
+				&xcopy_window_ops);
+	if (ret) {
+		tcmur_cmd_state_free(tcmur_cmd);
+		return TCMU_STS_NO_RESOURCE;
+	}
 
-	tcmur_cmd_state_free(tcmur_cmd);
-	return ret;
+	rhandler = tcmu_get_runner_handler(xcopy->src_dev);
+	if (tcmur_can_offload(xcopy->src_dev, rhandler->copy) &&
+	    xcopy->src_dev == xcopy->dst_dev) {
+		tcmur_cmd->done = handle_xcopy_copy_cbk;
+		ret = aio_request_schedule(xcopy->src_dev, tcmur_cmd,
+					   xcopy_copy_work_fn,
+					   tcmur_cmd_complete);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return ret;
+
+		if (ret != TCMU_STS_NOT_HANDLED) {
+			pthread_mutex_destroy(&xcopy->win.lock);
+			tcmur_cmd_state_free(tcmur_cmd);
+			return ret;
+		}
+	}
+
+	xcopy_pipeline_start(xcopy);
+	return TCMU_STS_ASYNC_HANDLED;
 }
 
 /* async compare_and_write */
@@ -1580,36 +3141,32 @@ static int handle_xcopy(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 static void handle_caw_write_cbk(struct tcmu_device *dev,
 				 struct tcmur_cmd *tcmur_cmd, int ret)
 {
-	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
 
-	pthread_mutex_unlock(&rdev->caw_lock);
 	tcmur_cmd_state_free(tcmur_cmd);
 	aio_command_finish(dev, cmd, ret);
 }
 
 static int caw_work_fn(struct tcmu_device *dev, void *data)
 {
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	struct tcmur_cmd *tcmur_cmd = data;
 	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
 
 	if (tcmur_cmd->done == handle_caw_write_cbk) {
-		return rhandler->write(dev, tcmur_cmd, cmd->iovec, cmd->iov_cnt,
+		return tcmur_dev_write(dev, tcmur_cmd, cmd->iovec, cmd->iov_cnt,
 				       tcmur_cmd->requested,
 				       tcmu_cdb_to_byte(dev, cmd->cdb));
 
 	} else {
-		return rhandler->read(dev, tcmur_cmd, tcmur_cmd->iovec,
-				       tcmur_cmd->iov_cnt, tcmur_cmd->requested,
-				       tcmu_cdb_to_byte(dev, cmd->cdb));
+		return tcmur_dev_read(dev, tcmur_cmd, tcmur_cmd->iovec,
+				      tcmur_cmd->iov_cnt, tcmur_cmd->requested,
+				      tcmu_cdb_to_byte(dev, cmd->cdb));
 	}
 }
 
 static void handle_caw_read_cbk(struct tcmu_device *dev,
 				struct tcmur_cmd *tcmur_cmd, int ret)
 {
-	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
 	uint32_t cmp_offset;
 
@@ -1638,7 +3195,6 @@ static void handle_caw_read_cbk(struct tcmu_device *dev,
 	return;
 
 finish_err:
-	pthread_mutex_unlock(&rdev->caw_lock);
 	tcmur_cmd_state_free(tcmur_cmd);
 	aio_command_finish(dev, cmd, ret);
 }
@@ -1689,7 +3245,6 @@ static int handle_caw(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
 	size_t half = (tcmu_iovec_length(cmd->iovec, cmd->iov_cnt)) / 2;
-	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	uint8_t sectors = cmd->cdb[13];
 	int ret;
 
@@ -1716,31 +3271,81 @@ static int handle_caw(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	if (ret)
 		return ret;
 
-	if (rhandler->caw) {
+	/* The handler may hand the cmd back for emulation */
+	if (tcmur_can_offload(dev, rhandler->caw)) {
 		tcmur_cmd->cmd_state = rhandler->caw;
 		tcmur_cmd->done = handle_generic_cbk;
-		return aio_request_schedule(dev, tcmur_cmd, tcmur_caw_fn,
-					    tcmur_cmd_complete);
+		ret = aio_request_schedule(dev, tcmur_cmd, tcmur_caw_fn,
+					   tcmur_cmd_complete);
+		if (ret != TCMU_STS_NOT_HANDLED)
+			return ret;
+		tcmur_cmd->cmd_state = NULL;
 	}
 
-	if (tcmur_cmd_state_init(tcmur_cmd, 0, half))
+	if (tcmur_cmd_state_init(dev, tcmur_cmd, 0, half))
 		return TCMU_STS_NO_RESOURCE;
 
 	tcmur_cmd->done = handle_caw_read_cbk;
 
-	pthread_mutex_lock(&rdev->caw_lock);
+	/* The lock is dropped when the cmd is finished */
+	if (!tcmur_range_lock(dev, tcmur_cmd, tcmu_cdb_get_lba(cmd->cdb),
+			      sectors, true, caw_work_fn))
+		return TCMU_STS_ASYNC_HANDLED;
 
 	ret = aio_request_schedule(dev, tcmur_cmd, caw_work_fn,
 				   tcmur_cmd_complete);
 	if (ret == TCMU_STS_ASYNC_HANDLED)
 		return TCMU_STS_ASYNC_HANDLED;
 
-	pthread_mutex_unlock(&rdev->caw_lock);
+	tcmur_range_unlock(dev, tcmur_cmd);
 	tcmur_cmd_state_free(tcmur_cmd);
 	return ret;
 }
 
-/* async flush */
+/*
+ * async flush
+ *
+ * SYNCHRONIZE CACHE only has to cover writes that completed before it was
+ * received. If none completed since the last successful flush it is done
+ * right away, and if the newest flush in flight was sent after the last
+ * write completed, the cmd waits for that flush instead of sending another.
+ */
+struct flush_state {
+	uint64_t epoch;
+	/* flushes waiting on this one, linked through compl_next */
+	struct tcmur_cmd *waiters;
+};
+
+static void flush_finish(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			 int ret)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct flush_state *state = tcmur_cmd->cmd_state;
+	struct tcmur_cmd *waiter, *next;
+
+	pthread_mutex_lock(&rdev->flush_lock);
+	if (rdev->flush_leader == tcmur_cmd)
+		rdev->flush_leader = NULL;
+	if (ret == TCMU_STS_OK && state->epoch > rdev->flushed_epoch)
+		rdev->flushed_epoch = state->epoch;
+	waiter = state->waiters;
+	pthread_mutex_unlock(&rdev->flush_lock);
+
+	for (; waiter; waiter = next) {
+		next = waiter->compl_next;
+		aio_command_finish(dev, waiter->lib_cmd, ret);
+	}
+
+	tcmur_cmd_state_free(tcmur_cmd);
+}
+
+static void handle_flush_cbk(struct tcmu_device *dev,
+			     struct tcmur_cmd *tcmur_cmd, int ret)
+{
+	flush_finish(dev, tcmur_cmd, ret);
+	aio_command_finish(dev, tcmur_cmd->lib_cmd, ret);
+}
+
 static int flush_work_fn(struct tcmu_device *dev, void *data)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
@@ -1751,14 +3356,51 @@ static int flush_work_fn(struct tcmu_device *dev, void *data)
 static int handle_flush(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
+	struct flush_state *state;
+	uint64_t epoch;
+	int ret;
 
+	/* Only after alua_check_state, a standby path must not ack it */
 	if (!rhandler->flush)
-		return TCMU_STS_INVALID_CMD;
+		return TCMU_STS_NOT_HANDLED;
 
-	tcmur_cmd->done = handle_generic_cbk;
-	return aio_request_schedule(dev, tcmur_cmd, flush_work_fn,
-				    tcmur_cmd_complete);
+	pthread_mutex_lock(&rdev->flush_lock);
+	epoch = __atomic_load_n(&rdev->write_epoch, __ATOMIC_SEQ_CST);
+	if (epoch == rdev->flushed_epoch) {
+		rdev->flushes_elided++;
+		pthread_mutex_unlock(&rdev->flush_lock);
+		return TCMU_STS_OK;
+	}
+
+	if (rdev->flush_leader) {
+		state = rdev->flush_leader->cmd_state;
+		if (state->epoch == epoch) {
+			tcmur_cmd->compl_next = state->waiters;
+			state->waiters = tcmur_cmd;
+			rdev->flushes_coalesced++;
+			pthread_mutex_unlock(&rdev->flush_lock);
+			return TCMU_STS_ASYNC_HANDLED;
+		}
+	}
+
+	if (tcmur_cmd_state_init(dev, tcmur_cmd, sizeof(*state), 0)) {
+		pthread_mutex_unlock(&rdev->flush_lock);
+		tcmu_dev_err(dev, "Failed to calloc flush_state.\n");
+		return TCMU_STS_NO_RESOURCE;
+	}
+	state = tcmur_cmd->cmd_state;
+	state->epoch = epoch;
+	rdev->flush_leader = tcmur_cmd;
+	pthread_mutex_unlock(&rdev->flush_lock);
+
+	tcmur_cmd->done = handle_flush_cbk;
+	ret = aio_request_schedule(dev, tcmur_cmd, flush_work_fn,
+				   tcmur_cmd_complete);
+	if (ret != TCMU_STS_ASYNC_HANDLED)
+		flush_finish(dev, tcmur_cmd, ret);
+	return ret;
 }
 
 static int handle_recv_copy_result(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
@@ -1876,6 +3518,190 @@ static int handle_recv_copy_result(struct tcmu_device *dev, struct tcmulib_cmd *
 	return TCMU_STS_OK;
 }
 
+/*
+ * Sequential READ/WRITE merging
+ *
+ * Cmds fetched in one ring drain that continue the previous cmd's LBA
+ * range in the same direction are held back and sent to the handler as
+ * one vectored request when the run ends. A successful completion is
+ * then fanned back out to every cmd in the run, through each cmd's own
+ * ->done. The handler only sees the first cmd's lib_cmd, so it could
+ * only set sense info, like a failing LBA, there. A failed run is
+ * therefore sent again as separate cmds, which then fail or succeed
+ * with their own status and sense. Only cmds completed by
+ * handle_generic_cbk are merged.
+ */
+struct merge_state {
+	struct tcmur_cmd tcmur_cmd;	/* the request the handler sees */
+	bool is_write;
+	off_t offset;
+	size_t length;
+	int nr_cmds;
+	struct tcmur_cmd *cmds[TCMUR_MERGE_MAX_CMDS];
+	size_t iov_cnt;
+	struct iovec iov[];
+};
+
+static int merge_work_fn(struct tcmu_device *dev, void *data)
+{
+	struct merge_state *merge = container_of((struct tcmur_cmd *)data,
+						 struct merge_state, tcmur_cmd);
+
+	if (merge->is_write)
+		return tcmur_dev_write(dev, &merge->tcmur_cmd, merge->iov,
+				       merge->iov_cnt, merge->length,
+				       merge->offset);
+	return tcmur_dev_read(dev, &merge->tcmur_cmd, merge->iov,
+			      merge->iov_cnt, merge->length, merge->offset);
+}
+
+/* Send a cmd that was held back, but ended up not being merged */
+static void merge_submit_one(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			     bool is_write)
+{
+	int ret;
+
+	ret = aio_request_schedule(dev, tcmur_cmd,
+				   is_write ? write_work_fn : read_work_fn,
+				   tcmur_cmd_complete);
+	if (ret != TCMU_STS_ASYNC_HANDLED)
+		tcmur_cmd->done(dev, tcmur_cmd, ret);
+}
+
+static void handle_merge_cbk(struct tcmu_device *dev,
+			     struct tcmur_cmd *tcmur_cmd, int ret)
+{
+	struct merge_state *merge = container_of(tcmur_cmd, struct merge_state,
+						 tcmur_cmd);
+	int i;
+
+	if (ret == TCMU_STS_OK) {
+		for (i = 0; i < merge->nr_cmds; i++) {
+			tcmur_cmd = merge->cmds[i];
+			tcmur_cmd->done(dev, tcmur_cmd, ret);
+		}
+	} else {
+		tcmu_dev_dbg(dev, "Merged %s of %d cmds failed %d, resending them one by one.\n",
+			     merge->is_write ? "write" : "read", merge->nr_cmds,
+			     ret);
+		/* The handler may have left sense info for the run there */
+		memset(merge->cmds[0]->lib_cmd->sense_buf, 0,
+		       sizeof(merge->cmds[0]->lib_cmd->sense_buf));
+		for (i = 0; i < merge->nr_cmds; i++)
+			merge_submit_one(dev, merge->cmds[i], merge->is_write);
+	}
+	free(merge);
+}
+
+/*
+ * tcmur_merge_flush - send the pending run of sequential cmds
+ * @dev: device to flush
+ *
+ * Must be called from the cmdproc thread before it completes queued cmds
+ * and goes back to sleep, so cmds are never held across a ring drain.
+ */
+void tcmur_merge_flush(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cmd *tcmur_cmd;
+	struct tcmulib_cmd *cmd;
+	struct merge_state *merge;
+	int nr_cmds = rdev->merge_nr_cmds;
+	bool is_write = rdev->merge_is_write;
+	uint64_t now;
+	int i, ret;
+
+	if (!nr_cmds)
+		return;
+	rdev->merge_nr_cmds = 0;
+
+	if (nr_cmds == 1) {
+		merge_submit_one(dev, rdev->merge_cmds[0], is_write);
+		return;
+	}
+
+	merge = calloc(1, sizeof(*merge) +
+			  rdev->merge_iov_cnt * sizeof(struct iovec));
+	if (!merge) {
+		for (i = 0; i < nr_cmds; i++)
+			merge_submit_one(dev, rdev->merge_cmds[i], is_write);
+		return;
+	}
+
+	now = tcmur_now_ns();
+	for (i = 0; i < nr_cmds; i++) {
+		tcmur_cmd = rdev->merge_cmds[i];
+		cmd = tcmur_cmd->lib_cmd;
+
+		memcpy(&merge->iov[merge->iov_cnt], cmd->iovec,
+		       cmd->iov_cnt * sizeof(struct iovec));
+		merge->iov_cnt += cmd->iov_cnt;
+		merge->cmds[i] = tcmur_cmd;
+		tcmur_cmd->dispatch_ns = now;
+	}
+	merge->nr_cmds = nr_cmds;
+	merge->is_write = is_write;
+	merge->length = rdev->merge_length;
+	merge->offset = tcmu_cdb_to_byte(dev, rdev->merge_cmds[0]->lib_cmd->cdb);
+
+	/* Handlers may look at lib_cmd, so give them the first one */
+	merge->tcmur_cmd.lib_cmd = rdev->merge_cmds[0]->lib_cmd;
+	merge->tcmur_cmd.iovec = merge->iov;
+	merge->tcmur_cmd.iov_cnt = merge->iov_cnt;
+	merge->tcmur_cmd.requested = merge->length;
+	merge->tcmur_cmd.dispatch_ns = now;
+	merge->tcmur_cmd.done = handle_merge_cbk;
+
+	rdev->merge_reqs++;
+	rdev->merged_cmds += nr_cmds;
+
+	ret = aio_request_schedule(dev, &merge->tcmur_cmd, merge_work_fn,
+				   tcmur_cmd_complete);
+	if (ret != TCMU_STS_ASYNC_HANDLED)
+		handle_merge_cbk(dev, &merge->tcmur_cmd, ret);
+}
+
+/*
+ * Returns true if the cmd was added to the pending run. The caller must
+ * then report it as TCMU_STS_ASYNC_HANDLED.
+ */
+static bool tcmur_merge_add(struct tcmu_device *dev,
+			    struct tcmur_cmd *tcmur_cmd, bool is_write)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+	uint64_t lba = tcmu_cdb_get_lba(cmd->cdb);
+	uint32_t lba_cnt = tcmu_cdb_get_xfer_length(cmd->cdb);
+	size_t length = tcmu_lba_to_byte(dev, lba_cnt);
+
+	if (!rdev->merge_max_bytes || !tcmur_dev_in_cmdproc(rdev) ||
+	    tcmur_cmd->done != handle_generic_cbk)
+		return false;
+
+	if (rdev->merge_nr_cmds &&
+	    (rdev->merge_is_write != is_write ||
+	     rdev->merge_next_lba != lba ||
+	     rdev->merge_nr_cmds == TCMUR_MERGE_MAX_CMDS ||
+	     rdev->merge_length + length > rdev->merge_max_bytes ||
+	     rdev->merge_iov_cnt + cmd->iov_cnt > IOV_MAX))
+		tcmur_merge_flush(dev);
+
+	if (length >= rdev->merge_max_bytes || cmd->iov_cnt > IOV_MAX)
+		return false;
+
+	if (!rdev->merge_nr_cmds) {
+		rdev->merge_is_write = is_write;
+		rdev->merge_length = 0;
+		rdev->merge_iov_cnt = 0;
+	}
+
+	rdev->merge_cmds[rdev->merge_nr_cmds++] = tcmur_cmd;
+	rdev->merge_next_lba = lba + lba_cnt;
+	rdev->merge_length += length;
+	rdev->merge_iov_cnt += cmd->iov_cnt;
+	return true;
+}
+
 /* async write */
 static int handle_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
@@ -1886,9 +3712,50 @@ static int handle_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	if (ret)
 		return ret;
 
-	tcmur_cmd->done = handle_generic_cbk;
-	return aio_request_schedule(dev, tcmur_cmd, write_work_fn,
-				    tcmur_cmd_complete);
+	tcmur_cmd->done = handle_generic_cbk;
+	if (!tcmur_range_lock(dev, tcmur_cmd, tcmu_cdb_get_lba(cmd->cdb),
+			      tcmu_cdb_get_xfer_length(cmd->cdb),
+			      tcmur_write_excl(dev), write_work_fn))
+		return TCMU_STS_ASYNC_HANDLED;
+
+	if (tcmur_merge_add(dev, tcmur_cmd, true))
+		return TCMU_STS_ASYNC_HANDLED;
+
+	return aio_request_schedule(dev, tcmur_cmd, write_work_fn,
+				    tcmur_cmd_complete);
+}
+
+/*
+ * Let the handler complete the read from the cmdproc thread if it can do
+ * so without blocking. Returns TCMU_STS_NOT_HANDLED if the read must be
+ * queued.
+ */
+static int tcmur_read_nowait(struct tcmu_device *dev,
+			     struct tcmur_cmd *tcmur_cmd)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+	int ret;
+
+	if (!rdev->read_nowait ||
+	    !tcmur_can_offload(dev, rhandler->read_nowait) ||
+	    !rdev->nr_threads ||
+	    !tcmur_dev_in_cmdproc(rdev))
+		return TCMU_STS_NOT_HANDLED;
+
+	tcmur_cmd->dispatch_ns = tcmur_now_ns();
+	ret = rhandler->read_nowait(dev, tcmur_cmd, cmd->iovec, cmd->iov_cnt,
+				    tcmu_iovec_length(cmd->iovec, cmd->iov_cnt),
+				    tcmu_cdb_to_byte(dev, cmd->cdb));
+	if (ret == TCMU_STS_NOT_HANDLED) {
+		tcmur_cmd->dispatch_ns = 0;
+		rdev->nowait_deferred++;
+	} else {
+		rdev->nowait_reads++;
+	}
+
+	return ret;
 }
 
 /* async read */
@@ -1901,90 +3768,188 @@ static int handle_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	if (ret)
 		return ret;
 
+	ret = tcmur_read_nowait(dev, tcmur_cmd);
+	if (ret != TCMU_STS_NOT_HANDLED)
+		return ret;
+
 	tcmur_cmd->done = handle_generic_cbk;
+
+	/*
+	 * With PI a read must not see a write's data without its tuples.
+	 * Reads are not merged either, so a failed check is reported on
+	 * the cmd that read the block.
+	 */
+	if (tcmu_dev_get_pi_enabled(dev)) {
+		if (!tcmur_range_lock(dev, tcmur_cmd,
+				      tcmu_cdb_get_lba(cmd->cdb),
+				      tcmu_cdb_get_xfer_length(cmd->cdb),
+				      false, read_work_fn))
+			return TCMU_STS_ASYNC_HANDLED;
+	} else if (tcmur_merge_add(dev, tcmur_cmd, false)) {
+		return TCMU_STS_ASYNC_HANDLED;
+	}
+
 	return aio_request_schedule(dev, tcmur_cmd, read_work_fn,
 				    tcmur_cmd_complete);
 }
 
-/* FORMAT UNIT */
+/*
+ * FORMAT UNIT
+ *
+ * A chunk zeroes its range with the handler's write_zeroes callout in
+ * one go, or by writing the shared zero buffer over it piece by piece.
+ */
+#define FORMAT_UNIT_MAX_CHUNKS 8
+#define FORMAT_UNIT_ZERO_LEN (64 * 1024 * 1024)
+
 struct format_unit_state {
-	size_t length;
-	off_t offset;
-	uint32_t done_blocks;
+	struct tcmur_window win;
+	uint64_t next_lba;
+	uint64_t done_blocks;
+	/* lbas covered by the zero buffer, and by one write_zeroes call */
+	uint64_t buf_lbas;
+	uint64_t zero_lbas;
+	bool write_zeroes;
+};
+
+struct format_unit_chunk {
+	struct tcmur_window_chunk wc;
+	/* remaining range owned by the chunk, and what is in flight */
+	uint64_t lba;
+	uint64_t lbas;
+	uint64_t step_lbas;
+	bool zeroes;
 };
 
+static void format_unit_finish(struct tcmur_window *win, int ret)
+{
+	struct format_unit_state *state = container_of(win,
+					struct format_unit_state, win);
+	struct tcmur_cmd *tcmur_cmd = win->tcmur_cmd;
+	struct tcmu_device *dev = win->dev;
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	tcmu_dev_dbg(dev, "format done, done_blocks:%"PRIu64" num_lbas:%"PRIu64"\n",
+		     state->done_blocks, dev->num_lbas);
+
+	tcmur_cmd_state_free(tcmur_cmd);
+	pthread_mutex_lock(&rdev->format_lock);
+	rdev->flags &= ~TCMUR_DEV_FLAG_FORMATTING;
+	pthread_mutex_unlock(&rdev->format_lock);
+	aio_command_finish(dev, tcmur_cmd->lib_cmd, ret);
+}
+
+/* Carry on with the rest of the chunk's range, or claim a new one */
+static bool format_unit_claim(struct tcmur_window *win,
+			      struct tcmur_cmd *tcmur_ucmd)
+{
+	struct format_unit_state *state = container_of(win,
+					struct format_unit_state, win);
+	struct format_unit_chunk *chunk = tcmur_ucmd->cmd_state;
+	struct tcmu_device *dev = win->dev;
+	uint64_t lbas;
+
+	if (chunk->lbas)
+		return true;
+	if (state->next_lba == dev->num_lbas)
+		return false;
+
+	lbas = state->write_zeroes ? state->zero_lbas : state->buf_lbas;
+	chunk->lba = state->next_lba;
+	chunk->lbas = min(lbas, dev->num_lbas - state->next_lba);
+	chunk->zeroes = state->write_zeroes;
+	state->next_lba += chunk->lbas;
+	return true;
+}
+
 static int format_unit_work_fn(struct tcmu_device *dev, void *data)
 {
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
-	struct tcmur_cmd *tcmur_cmd = data;
-	struct format_unit_state *state = tcmur_cmd->cmd_state;
+	struct tcmur_cmd *tcmur_ucmd = data;
+	struct format_unit_chunk *chunk = tcmur_ucmd->cmd_state;
 
-	return rhandler->write(dev, tcmur_cmd, tcmur_cmd->iovec,
-			       tcmur_cmd->iov_cnt, tcmur_cmd->requested,
-			       state->offset);
+	if (chunk->zeroes)
+		return tcmur_dev_write_zeroes(dev, tcmur_ucmd,
+					      tcmu_lba_to_byte(dev, chunk->lba),
+					      tcmu_lba_to_byte(dev, chunk->step_lbas));
+
+	return tcmur_dev_write(dev, tcmur_ucmd, tcmur_ucmd->iovec,
+			       tcmur_ucmd->iov_cnt, tcmur_ucmd->requested,
+			       tcmu_lba_to_byte(dev, chunk->lba));
 }
 
 static void handle_format_unit_cbk(struct tcmu_device *dev,
-				   struct tcmur_cmd *tcmur_cmd, int ret) {
+				   struct tcmur_cmd *tcmur_ucmd, int ret) {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
-	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
-	struct format_unit_state *state = tcmur_cmd->cmd_state;
-	uint32_t block_size = tcmu_dev_get_block_size(dev);
-	int rc;
+	struct format_unit_chunk *chunk = tcmur_ucmd->cmd_state;
+	struct format_unit_state *state = container_of(chunk->wc.win,
+					struct format_unit_state, win);
+	uint64_t step = chunk->step_lbas;
+	bool no_zeroes = false;
+
+	if (ret == TCMU_STS_NOT_HANDLED && chunk->zeroes) {
+		tcmu_dev_dbg(dev, "write_zeroes not supported, formatting with writes\n");
+		chunk->zeroes = false;
+		no_zeroes = true;
+		step = 0;
+		ret = TCMU_STS_OK;
+	}
+
+	if (ret != TCMU_STS_OK) {
+		tcmu_dev_err(dev, "format failed at lba %"PRIu64"\n",
+			     chunk->lba);
+		step = 0;
+	}
 
-	state->offset += tcmur_cmd->requested;
-	state->done_blocks += tcmu_byte_to_lba(dev, tcmur_cmd->requested);
+	pthread_mutex_lock(&state->win.lock);
+	if (no_zeroes)
+		state->write_zeroes = false;
+	state->done_blocks += step;
 	if (state->done_blocks < dev->num_lbas)
 		rdev->format_progress = (0x10000 * state->done_blocks) /
 				       dev->num_lbas;
+	chunk->lba += step;
+	chunk->lbas -= step;
+	pthread_mutex_unlock(&state->win.lock);
 
-	/* Check for last commmand */
-	if (state->done_blocks == dev->num_lbas) {
-		tcmu_dev_dbg(dev,
-			     "last format cmd, done_blocks:%u num_lbas:%"PRIu64" block_size:%u\n",
-			     state->done_blocks, dev->num_lbas, block_size);
-		goto free_state;
-	}
+	tcmur_window_chunk_done(tcmur_ucmd, ret);
+}
 
-	if (state->done_blocks < dev->num_lbas) {
-		size_t left = tcmu_lba_to_byte(dev,
-					       dev->num_lbas - state->done_blocks);
-		if (left < tcmur_cmd->requested)
-			tcmur_cmd->requested = left;
+static int format_unit_issue(struct tcmur_window *win,
+			     struct tcmur_cmd *tcmur_ucmd)
+{
+	struct format_unit_chunk *chunk = tcmur_ucmd->cmd_state;
+	struct format_unit_state *state = container_of(win,
+					struct format_unit_state, win);
+	struct tcmu_device *dev = win->dev;
 
+	if (chunk->zeroes) {
+		chunk->step_lbas = chunk->lbas;
+	} else {
+		chunk->step_lbas = min(state->buf_lbas, chunk->lbas);
+		tcmur_ucmd->requested = tcmu_lba_to_byte(dev, chunk->step_lbas);
 		/* Seek in handlers consume the iovec, thus we must reset */
-		tcmur_cmd_iovec_reset(tcmur_cmd, tcmur_cmd->requested);
-
-		tcmu_dev_dbg(dev,
-			     "next format cmd, done_blocks:%u num_lbas:%"PRIu64" block_size:%u\n",
-			     state->done_blocks, dev->num_lbas, block_size);
-
-		rc = aio_request_schedule(dev, tcmur_cmd, format_unit_work_fn,
-					  tcmur_cmd_complete);
-		if (rc != TCMU_STS_ASYNC_HANDLED) {
-			tcmu_dev_err(dev, " async handle cmd failure\n");
-			ret = TCMU_STS_WR_ERR;
-			goto free_state;
-		}
+		tcmur_cmd_iovec_reset(tcmur_ucmd, tcmur_ucmd->requested);
 	}
+	tcmur_ucmd->done = handle_format_unit_cbk;
 
-	return;
-
-free_state:
-	tcmur_cmd_state_free(tcmur_cmd);
-	pthread_mutex_lock(&rdev->format_lock);
-	rdev->flags &= ~TCMUR_DEV_FLAG_FORMATTING;
-	pthread_mutex_unlock(&rdev->format_lock);
-	aio_command_finish(dev, cmd, ret);
+	return aio_request_schedule(dev, tcmur_ucmd, format_unit_work_fn,
+				    tcmur_cmd_complete);
 }
 
+static const struct tcmur_window_ops format_unit_window_ops = {
+	.claim = format_unit_claim,
+	.issue = format_unit_issue,
+	.finish = format_unit_finish,
+};
+
 static int handle_format_unit(struct tcmu_device *dev, struct tcmulib_cmd *cmd) {
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
 	size_t max_xfer_length, length = 1024 * 1024;
 	uint32_t block_size = tcmu_dev_get_block_size(dev);
 	uint64_t num_lbas = tcmu_dev_get_num_lbas(dev);
-	int ret;
+	struct format_unit_state *state;
 
 	pthread_mutex_lock(&rdev->format_lock);
 	if (rdev->flags & TCMUR_DEV_FLAG_FORMATTING) {
@@ -2003,19 +3968,27 @@ static int handle_format_unit(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	if (tcmu_lba_to_byte(dev, num_lbas) < length)
 		length = tcmu_lba_to_byte(dev, num_lbas);
 
-	if (tcmur_cmd_state_init(tcmur_cmd, sizeof(struct format_unit_state),
-				 length))
+	if (tcmur_cmd_state_init(dev, tcmur_cmd, sizeof(*state), length))
 		goto clear_format;
-	tcmur_cmd->done = handle_format_unit_cbk;
 
-	tcmu_dev_dbg(dev, "start emulate format, num_lbas:%"PRIu64" block_size:%u\n",
-		     num_lbas, block_size);
+	state = tcmur_cmd->cmd_state;
+	state->buf_lbas = tcmu_byte_to_lba(dev, length);
+	state->zero_lbas = max(tcmu_byte_to_lba(dev, FORMAT_UNIT_ZERO_LEN),
+			       state->buf_lbas);
+	state->write_zeroes = !!rhandler->write_zeroes;
 
-	ret = aio_request_schedule(dev, tcmur_cmd, format_unit_work_fn,
-				   tcmur_cmd_complete);
-	if (ret != TCMU_STS_ASYNC_HANDLED)
+	if (tcmur_window_init(&state->win, dev, tcmur_cmd,
+			      &format_unit_window_ops))
 		goto free_state;
+	state->win.buf = tcmur_cmd->iov_base_copy;
+	state->win.buf_len = length;
 
+	tcmu_dev_dbg(dev, "start %s format, num_lbas:%"PRIu64" block_size:%u\n",
+		     state->write_zeroes ? "write_zeroes" : "emulate",
+		     num_lbas, block_size);
+
+	tcmur_window_start(&state->win, FORMAT_UNIT_MAX_CHUNKS,
+			   sizeof(struct format_unit_chunk), 0);
 	return TCMU_STS_ASYNC_HANDLED;
 
 free_state:
@@ -2028,33 +4001,101 @@ clear_format:
 }
 
 /* ALUA */
-static int handle_stpg(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+static int __handle_stpg(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	struct list_head group_list;
 	int ret;
 
+	/* The transition can block taking the lock, so use a copy */
 	list_head_init(&group_list);
-
-	if (tcmu_get_alua_grps(dev, &group_list))
+	if (tcmu_copy_alua_grps(dev, &group_list))
 		return TCMU_STS_HW_ERR;
 
 	ret = tcmu_emulate_set_tgt_port_grps(dev, &group_list, cmd);
+	tcmu_update_alua_grps(dev, &group_list);
 	tcmu_release_alua_grps(&group_list);
 	return ret;
 }
 
-static int handle_rtpg(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+struct stpg_state {
+	struct tcmu_device *dev;
+	struct tcmur_cmd *tcmur_cmd;
+};
+
+static void stpg_work_fn(void *data)
 {
-	struct list_head group_list;
+	struct stpg_state *state = data;
+	struct tcmu_device *dev = state->dev;
+	struct tcmur_cmd *tcmur_cmd = state->tcmur_cmd;
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	int ret;
 
-	list_head_init(&group_list);
+	/* The STPG stays in the ring until it is completed below */
+	tcmur_ring_cmd_rdev = rdev;
+	ret = __handle_stpg(dev, tcmur_cmd->lib_cmd);
+	tcmur_ring_cmd_rdev = NULL;
+
+	pthread_mutex_lock(&rdev->state_lock);
+	rdev->flags &= ~TCMUR_DEV_FLAG_IN_STPG;
+	pthread_mutex_unlock(&rdev->state_lock);
+
+	tcmur_cmd_state_free(tcmur_cmd);
+	tcmur_queue_cmd_completion(dev, tcmur_cmd->lib_cmd, ret);
+}
+
+/*
+ * Taking or dropping the lock for a transition can block in the handler
+ * for seconds. A reactor would stall all its devices meanwhile, so there
+ * the STPG is run from event work and completed from there, one at a
+ * time. It is not tracked as aio, since the lock acquire waits for the
+ * tracked cmds to drain.
+ */
+static int handle_stpg(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
+	struct stpg_state *state;
+	int ret = TCMU_STS_BUSY;
+
+	if (!rdev->reactor)
+		return __handle_stpg(dev, cmd);
+
+	pthread_mutex_lock(&rdev->state_lock);
+	if (rdev->flags & TCMUR_DEV_FLAG_IN_STPG)
+		goto unlock;
+
+	if (tcmur_cmd_state_init(dev, tcmur_cmd, sizeof(*state), 0)) {
+		ret = TCMU_STS_NO_RESOURCE;
+		goto unlock;
+	}
+	state = tcmur_cmd->cmd_state;
+	state->dev = dev;
+	state->tcmur_cmd = tcmur_cmd;
 
-	if (tcmu_get_alua_grps(dev, &group_list))
+	if (tcmur_run_work(rdev->event_work, state, stpg_work_fn)) {
+		tcmu_dev_err(dev, "Could not start STPG work\n");
+		tcmur_cmd_state_free(tcmur_cmd);
+		ret = TCMU_STS_NO_RESOURCE;
+		goto unlock;
+	}
+	rdev->flags |= TCMUR_DEV_FLAG_IN_STPG;
+	ret = TCMU_STS_ASYNC_HANDLED;
+unlock:
+	pthread_mutex_unlock(&rdev->state_lock);
+	return ret;
+}
+
+static int handle_rtpg(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct list_head *group_list;
+	int ret;
+
+	group_list = tcmu_lock_alua_grps(dev);
+	if (!group_list)
 		return TCMU_STS_HW_ERR;
 
-	ret = tcmu_emulate_report_tgt_port_grps(dev, &group_list, cmd);
-	tcmu_release_alua_grps(&group_list);
+	ret = tcmu_emulate_report_tgt_port_grps(dev, group_list, cmd);
+	tcmu_unlock_alua_grps(dev);
 	return ret;
 }
 
@@ -2097,7 +4138,7 @@ int tcmur_cmd_passthrough_handler(struct tcmu_device *dev,
 	 * Support handlers that implement their own threading/AIO
 	 * and only use runner's main event loop.
 	 */
-	if (!rhandler->nr_threads)
+	if (!rdev->nr_threads)
 		return rhandler->handle_cmd(dev, tcmur_cmd);
 	/*
 	 * Since we call ->handle_cmd via aio_request_schedule(), ->handle_cmd
@@ -2109,18 +4150,16 @@ int tcmur_cmd_passthrough_handler(struct tcmu_device *dev,
 	track_aio_request_start(rdev);
 	ret = handle_passthrough(dev, tcmur_cmd);
 	if (ret != TCMU_STS_ASYNC_HANDLED)
-		track_aio_request_finish(rdev, NULL);
+		track_aio_request_finish(rdev);
 
 	return ret;
 }
 
-static int tcmur_cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+static int tcmur_cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			     const struct tcmur_cmd_op *op)
 {
-	int ret = TCMU_STS_NOT_HANDLED;
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
-	uint8_t *cdb = cmd->cdb;
-	bool is_read = false;
+	int ret;
 
 	track_aio_request_start(rdev);
 
@@ -2129,96 +4168,37 @@ static int tcmur_cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 		goto untrack;
 	}
 
+	/* Keep other cmds from overtaking a pending run of reads/writes */
+	if (!(op->flags & TCMUR_CMD_OP_RW) &&
+	    tcmur_dev_in_cmdproc(rdev))
+		tcmur_merge_flush(dev);
+
 	/* Don't perform alua implicit transition if command is not supported */
-	switch(cdb[0]) {
-	/* Skip to grab the lock for reads */
-	case READ_6:
-	case READ_10:
-	case READ_12:
-	case READ_16:
-		is_read = true;
-	case WRITE_6:
-	case WRITE_10:
-	case WRITE_12:
-	case WRITE_16:
-	case UNMAP:
-	case SYNCHRONIZE_CACHE:
-	case SYNCHRONIZE_CACHE_16:
-	case EXTENDED_COPY:
-	case COMPARE_AND_WRITE:
-	case WRITE_VERIFY:
-	case WRITE_VERIFY_16:
-	case WRITE_SAME:
-	case WRITE_SAME_16:
-	case FORMAT_UNIT:
-		ret = alua_check_state(dev, cmd, is_read);
+	if (op->flags & TCMUR_CMD_OP_ALUA) {
+		ret = alua_check_state(dev, cmd, op->flags & TCMUR_CMD_OP_READ);
 		if (ret)
 			goto untrack;
-		break;
-	default:
-		break;
 	}
 
-	switch(cdb[0]) {
-	case READ_6:
-	case READ_10:
-	case READ_12:
-	case READ_16:
-		ret = handle_read(dev, cmd);
-		break;
-	case WRITE_6:
-	case WRITE_10:
-	case WRITE_12:
-	case WRITE_16:
-		ret = handle_write(dev, cmd);
-		break;
-	case UNMAP:
-		ret = handle_unmap(dev, cmd);
-		break;
-	case SYNCHRONIZE_CACHE:
-	case SYNCHRONIZE_CACHE_16:
-		if (rhandler->flush)
-			ret = handle_flush(dev, cmd);
-		break;
-	case EXTENDED_COPY:
-		ret = handle_xcopy(dev, cmd);
-		break;
-	case COMPARE_AND_WRITE:
-		ret = handle_caw(dev, cmd);
-		break;
-	case WRITE_VERIFY:
-	case WRITE_VERIFY_16:
-		ret = handle_write_verify(dev, cmd);
-		break;
-	case WRITE_SAME:
-	case WRITE_SAME_16:
-		ret = handle_writesame(dev, cmd);
-		break;
-	case FORMAT_UNIT:
-		ret = handle_format_unit(dev, cmd);
-		break;
-	default:
-		ret = TCMU_STS_NOT_HANDLED;
-	}
+	ret = op->fn(dev, cmd);
 
 untrack:
 	if (ret != TCMU_STS_ASYNC_HANDLED)
-		track_aio_request_finish(rdev, NULL);
+		track_aio_request_finish(rdev);
 	return ret;
 }
 
 static int handle_inquiry(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
-	struct list_head group_list;
+	struct list_head *group_list;
 	struct tgt_port *port;
 	int ret;
 
-	list_head_init(&group_list);
-
-	if (tcmu_get_alua_grps(dev, &group_list))
+	group_list = tcmu_lock_alua_grps(dev);
+	if (!group_list)
 		return TCMU_STS_HW_ERR;
 
-	port = tcmu_get_enabled_port(&group_list);
+	port = tcmu_get_enabled_port(group_list);
 	if (!port) {
 		tcmu_dev_dbg(dev, "no enabled ports found. Skipping ALUA support\n");
 	} else {
@@ -2227,63 +4207,146 @@ static int handle_inquiry(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 
 	ret = tcmu_emulate_inquiry(dev, port, cmd->cdb, cmd->iovec,
 				   cmd->iov_cnt);
-	tcmu_release_alua_grps(&group_list);
+	tcmu_unlock_alua_grps(dev);
 	return ret;
 }
 
-static int handle_sync_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+static int handle_test_unit_ready(struct tcmu_device *dev,
+				  struct tcmulib_cmd *cmd)
+{
+	return tcmu_emulate_test_unit_ready(cmd->cdb, cmd->iovec,
+					    cmd->iov_cnt);
+}
+
+static int handle_service_action_in_16(struct tcmu_device *dev,
+				       struct tcmulib_cmd *cmd)
 {
 	uint8_t *cdb = cmd->cdb;
-	struct iovec *iovec = cmd->iovec;
-	size_t iov_cnt = cmd->iov_cnt;
-	uint32_t block_size = tcmu_dev_get_block_size(dev);
-	uint64_t num_lbas = tcmu_dev_get_num_lbas(dev);
 
-	switch (cdb[0]) {
-	case INQUIRY:
-		return handle_inquiry(dev, cmd);
-	case TEST_UNIT_READY:
-		return tcmu_emulate_test_unit_ready(cdb, iovec, iov_cnt);
-	case SERVICE_ACTION_IN_16:
-		if (cdb[1] == READ_CAPACITY_16)
-			return tcmu_emulate_read_capacity_16(num_lbas,
-							     block_size,
-							     cdb, iovec,
-							     iov_cnt);
-		else
-			return TCMU_STS_NOT_HANDLED;
-	case READ_CAPACITY:
-		if ((cdb[1] & 0x01) || (cdb[8] & 0x01))
-			/* Reserved bits for MM logical units */
-			return TCMU_STS_INVALID_CDB;
-		else
-			return tcmu_emulate_read_capacity_10(num_lbas,
-							     block_size,
-							     cdb, iovec,
-							     iov_cnt);
-	case MODE_SENSE:
-	case MODE_SENSE_10:
-		return tcmu_emulate_mode_sense(dev, cdb, iovec, iov_cnt);
-	case START_STOP:
-		return tcmu_emulate_start_stop(dev, cdb);
-	case MODE_SELECT:
-	case MODE_SELECT_10:
-		return tcmu_emulate_mode_select(dev, cdb, iovec, iov_cnt);
-	case RECEIVE_COPY_RESULTS:
-		if ((cdb[1] & 0x1f) == RCR_SA_OPERATING_PARAMETERS)
-			return handle_recv_copy_result(dev, cmd);
-		return TCMU_STS_NOT_HANDLED;
-	case MAINTENANCE_OUT:
-		if (cdb[1] == MO_SET_TARGET_PGS)
-			return handle_stpg(dev, cmd);
-		return TCMU_STS_NOT_HANDLED;
-	case MAINTENANCE_IN:
-		if ((cdb[1] & 0x1f) == MI_REPORT_TARGET_PGS)
-			return handle_rtpg(dev, cmd);
-		return TCMU_STS_NOT_HANDLED;
-	default:
+	if (cdb[1] != READ_CAPACITY_16)
 		return TCMU_STS_NOT_HANDLED;
-	}
+
+	return tcmu_emulate_read_capacity_16(tcmu_dev_get_num_lbas(dev),
+					     tcmu_dev_get_block_size(dev),
+					     cdb, cmd->iovec, cmd->iov_cnt);
+}
+
+static int handle_read_capacity(struct tcmu_device *dev,
+				struct tcmulib_cmd *cmd)
+{
+	uint8_t *cdb = cmd->cdb;
+
+	if ((cdb[1] & 0x01) || (cdb[8] & 0x01))
+		/* Reserved bits for MM logical units */
+		return TCMU_STS_INVALID_CDB;
+
+	return tcmu_emulate_read_capacity_10(tcmu_dev_get_num_lbas(dev),
+					     tcmu_dev_get_block_size(dev),
+					     cdb, cmd->iovec, cmd->iov_cnt);
+}
+
+static int handle_mode_sense(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	return tcmu_emulate_mode_sense(dev, cmd->cdb, cmd->iovec,
+				       cmd->iov_cnt);
+}
+
+static int handle_start_stop(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	return tcmu_emulate_start_stop(dev, cmd->cdb);
+}
+
+static int handle_mode_select(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	return tcmu_emulate_mode_select(dev, cmd->cdb, cmd->iovec,
+					cmd->iov_cnt);
+}
+
+static int handle_receive_copy_results(struct tcmu_device *dev,
+				       struct tcmulib_cmd *cmd)
+{
+	if ((cmd->cdb[1] & 0x1f) == RCR_SA_OPERATING_PARAMETERS)
+		return handle_recv_copy_result(dev, cmd);
+	return TCMU_STS_NOT_HANDLED;
+}
+
+static int handle_maintenance_out(struct tcmu_device *dev,
+				  struct tcmulib_cmd *cmd)
+{
+	if (cmd->cdb[1] == MO_SET_TARGET_PGS)
+		return handle_stpg(dev, cmd);
+	return TCMU_STS_NOT_HANDLED;
+}
+
+static int handle_maintenance_in(struct tcmu_device *dev,
+				 struct tcmulib_cmd *cmd)
+{
+	if ((cmd->cdb[1] & 0x1f) == MI_REPORT_TARGET_PGS)
+		return handle_rtpg(dev, cmd);
+	return TCMU_STS_NOT_HANDLED;
+}
+
+static void tcmur_set_cmd_op(struct tcmur_cmd_op *ops, uint8_t opcode,
+			     tcmur_cmd_op_fn_t fn, uint8_t flags)
+{
+	ops[opcode].fn = fn;
+	ops[opcode].flags = flags;
+}
+
+/*
+ * Resolve which runner function executes each opcode for the device's
+ * handler. Called once when the device is added, before its cmdproc loop
+ * starts. None of the entries depend on what the handler does at open,
+ * reconfig or reopen, so the table is never rebuilt.
+ */
+void tcmur_dev_build_cmd_ops(struct tcmu_device *dev)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cmd_op *ops = rdev->cmd_ops;
+	const uint8_t rd = TCMUR_CMD_OP_ALUA | TCMUR_CMD_OP_RW |
+			   TCMUR_CMD_OP_READ;
+	const uint8_t wr = TCMUR_CMD_OP_ALUA | TCMUR_CMD_OP_RW;
+	const uint8_t io = TCMUR_CMD_OP_ALUA;
+	const uint8_t emul = TCMUR_CMD_OP_EMULATED;
+
+	rdev->passthrough_only = tcmur_handler_is_passthrough_only(rhandler);
+
+	/* Emulated in the cmdproc thread */
+	tcmur_set_cmd_op(ops, INQUIRY, handle_inquiry, emul);
+	tcmur_set_cmd_op(ops, TEST_UNIT_READY, handle_test_unit_ready, emul);
+	tcmur_set_cmd_op(ops, SERVICE_ACTION_IN_16,
+			 handle_service_action_in_16, emul);
+	tcmur_set_cmd_op(ops, READ_CAPACITY, handle_read_capacity, emul);
+	tcmur_set_cmd_op(ops, MODE_SENSE, handle_mode_sense, emul);
+	tcmur_set_cmd_op(ops, MODE_SENSE_10, handle_mode_sense, emul);
+	tcmur_set_cmd_op(ops, START_STOP, handle_start_stop, emul);
+	tcmur_set_cmd_op(ops, MODE_SELECT, handle_mode_select, emul);
+	tcmur_set_cmd_op(ops, MODE_SELECT_10, handle_mode_select, emul);
+	tcmur_set_cmd_op(ops, RECEIVE_COPY_RESULTS,
+			 handle_receive_copy_results, emul);
+	tcmur_set_cmd_op(ops, MAINTENANCE_OUT, handle_maintenance_out, emul);
+	tcmur_set_cmd_op(ops, MAINTENANCE_IN, handle_maintenance_in, emul);
+
+	/* Executed through the handler's IO callouts */
+	tcmur_set_cmd_op(ops, READ_6, handle_read, rd);
+	tcmur_set_cmd_op(ops, READ_10, handle_read, rd);
+	tcmur_set_cmd_op(ops, READ_12, handle_read, rd);
+	tcmur_set_cmd_op(ops, READ_16, handle_read, rd);
+	tcmur_set_cmd_op(ops, WRITE_6, handle_write, wr);
+	tcmur_set_cmd_op(ops, WRITE_10, handle_write, wr);
+	tcmur_set_cmd_op(ops, WRITE_12, handle_write, wr);
+	tcmur_set_cmd_op(ops, WRITE_16, handle_write, wr);
+	tcmur_set_cmd_op(ops, UNMAP, handle_unmap, io);
+	tcmur_set_cmd_op(ops, SYNCHRONIZE_CACHE, handle_flush, io);
+	tcmur_set_cmd_op(ops, SYNCHRONIZE_CACHE_16, handle_flush, io);
+	tcmur_set_cmd_op(ops, EXTENDED_COPY, handle_xcopy, io);
+	tcmur_set_cmd_op(ops, COMPARE_AND_WRITE, handle_caw, io);
+	tcmur_set_cmd_op(ops, WRITE_VERIFY, handle_write_verify, io);
+	tcmur_set_cmd_op(ops, WRITE_VERIFY_16, handle_write_verify, io);
+	tcmur_set_cmd_op(ops, WRITE_SAME, handle_writesame, io);
+	tcmur_set_cmd_op(ops, WRITE_SAME_16, handle_writesame, io);
+	tcmur_set_cmd_op(ops, FORMAT_UNIT, handle_format_unit, io);
 }
 
 static int handle_try_passthrough(struct tcmu_device *dev,
@@ -2301,7 +4364,7 @@ static int handle_try_passthrough(struct tcmu_device *dev,
 
 	ret = rhandler->handle_cmd(dev, tcmur_cmd);
 	if (ret != TCMU_STS_ASYNC_HANDLED)
-		track_aio_request_finish(rdev, NULL);
+		track_aio_request_finish(rdev);
 
 	return ret;
 }
@@ -2348,6 +4411,11 @@ static int handle_pending_ua(struct tcmur_device *rdev, struct tcmulib_cmd *cmd)
 		/* The kernel will handle REPORT_LUNS */
 		return TCMU_STS_NOT_HANDLED;
 	}
+
+	/* Set under state_lock, so a UA being set now is racing the cmd */
+	if (!__atomic_load_n(&rdev->pending_uas, __ATOMIC_RELAXED))
+		return TCMU_STS_NOT_HANDLED;
+
 	pthread_mutex_lock(&rdev->state_lock);
 
 	if (!rdev->pending_uas) {
@@ -2368,11 +4436,42 @@ unlock:
 	return ret;
 }
 
+/*
+ * Send cmd to the handler, or run the runner's emulation for it. Called
+ * for cmds that passed the QoS limits.
+ */
+int tcmur_generic_dispatch_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	const struct tcmur_cmd_op *op;
+	int ret;
+
+	/*
+	 * The handler want to handle some commands by itself,
+	 * try to passthrough it first
+	 */
+	ret = handle_try_passthrough(dev, cmd);
+	if (ret != TCMU_STS_NOT_HANDLED)
+		return ret;
+
+	/* Falls back to the runner's generic handle callout */
+	op = &rdev->cmd_ops[cmd->cdb[0]];
+	if (!op->fn)
+		return TCMU_STS_NOT_HANDLED;
+
+	if (op->flags & TCMUR_CMD_OP_EMULATED)
+		return op->fn(dev, cmd);
+
+	return tcmur_cmd_handler(dev, cmd, op);
+}
+
 int tcmur_generic_handle_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	int ret;
 
+	TCMU_TRACE3(cmd_dispatch, dev, cmd, cmd->cdb[0]);
+
 	ret = handle_pending_ua(rdev, cmd);
 	if (ret != TCMU_STS_NOT_HANDLED)
 		return ret;
@@ -2383,17 +4482,9 @@ int tcmur_generic_handle_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 		return TCMU_STS_FRMT_IN_PROGRESS;
 	}
 
-	/*
-	 * The handler want to handle some commands by itself,
-	 * try to passthrough it first
-	 */
-	ret = handle_try_passthrough(dev, cmd);
-	if (ret != TCMU_STS_NOT_HANDLED)
-		return ret;
+	/* Over the QoS limits, cmdproc dispatches it later */
+	if (tcmur_qos_throttle(dev, cmd))
+		return TCMU_STS_ASYNC_HANDLED;
 
-	/* Falls back to the runner's generic handle callout */
-	ret = handle_sync_cmd(dev, cmd);
-	if (ret == TCMU_STS_NOT_HANDLED)
-		ret = tcmur_cmd_handler(dev, cmd);
-	return ret;
+	return tcmur_generic_dispatch_cmd(dev, cmd);
 }
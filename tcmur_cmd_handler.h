@@ -17,13 +17,21 @@ struct tcmur_cmd;
 struct timespec;
 
 int tcmur_get_time(struct tcmu_device *dev, struct timespec *time);
+int64_t tcmur_time_diff_ms(const struct timespec *end,
+			   const struct timespec *start);
 int tcmur_dev_update_size(struct tcmu_device *dev, uint64_t new_size);
 void tcmur_set_pending_ua(struct tcmu_device *dev, int ua);
 int tcmur_generic_handle_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
+int tcmur_generic_dispatch_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
 int tcmur_cmd_passthrough_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
 bool tcmur_handler_is_passthrough_only(struct tcmur_handler *rhandler);
+void tcmur_dev_build_cmd_ops(struct tcmu_device *dev);
 void tcmur_tcmulib_cmd_complete(struct tcmu_device *dev,
 				struct tcmulib_cmd *cmd, int ret);
+int tcmur_complete_queued_cmds(struct tcmu_device *dev);
+void tcmur_merge_flush(struct tcmu_device *dev);
+int tcmur_state_pool_init(struct tcmu_device *dev);
+void tcmur_state_pool_cleanup(struct tcmu_device *dev);
 
 typedef int (*tcmur_writesame_fn_t)(struct tcmu_device *dev,
 				    struct tcmur_cmd *tcmur_cmd, uint64_t off,
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Data area sizing.
+ *
+ * When a device's data area has no room for the next cmd's buffers, LIO
+ * queues or fails the cmds, and from the runner that only shows up as
+ * throughput falling off. With a budget set, the main loop checks every
+ * TCMUR_DATA_AREA_INTERVAL secs how long each data area was full, see
+ * tcmur_stats.c, and grows it for devices that were full for at least
+ * TCMUR_DATA_AREA_SAT_PCT of TCMUR_DATA_AREA_SAT_CHECKS checks in a row.
+ * A data area is doubled at most, and the data areas of all devices
+ * together are kept within the budget.
+ *
+ * max_data_area_mb is set through the device's configfs control file.
+ * Most kernels only accept it before the device is enabled, so if it is
+ * refused it is not tried again for the device. The kernel's global data
+ * area limit, which all devices allocate their data blocks from, can
+ * be changed at any time, so it is also raised up to the budget, to cover
+ * the data areas of all devices.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "libtcmu.h"
+#include "libtcmu_log.h"
+#include "libtcmu_common.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+#include "tcmur_stats.h"
+#include "tcmur_data_area.h"
+
+#define TCMUR_DATA_AREA_SAT_PCT 50
+#define TCMUR_DATA_AREA_SAT_CHECKS 3
+
+#define TCMUR_GLOBAL_MAX_DATA_AREA "global_max_data_area_mb"
+
+static unsigned int data_area_budget_mb;
+
+/* 0 disables the checks */
+void tcmur_data_area_set_budget_mb(unsigned int budget_mb)
+{
+	data_area_budget_mb = budget_mb;
+}
+
+unsigned int tcmur_data_area_get_budget_mb(void)
+{
+	return data_area_budget_mb;
+}
+
+static void data_area_raise_global(uint64_t total_mb)
+{
+	int cur_mb;
+	int ret;
+
+	if (total_mb > data_area_budget_mb)
+		total_mb = data_area_budget_mb;
+
+	cur_mb = tcmu_cfgfs_get_int(CFGFS_MOD_PARAM"/"TCMUR_GLOBAL_MAX_DATA_AREA);
+	if (cur_mb < 0 || (uint64_t)cur_mb >= total_mb)
+		return;
+
+	ret = tcmu_cfgfs_mod_param_set_u32(TCMUR_GLOBAL_MAX_DATA_AREA,
+					   total_mb);
+	if (ret) {
+		tcmu_warn("Could not raise %s from %d to %"PRIu64": %d\n",
+			  TCMUR_GLOBAL_MAX_DATA_AREA, cur_mb, total_mb, ret);
+		return;
+	}
+	tcmu_info("Raised %s from %d to %"PRIu64"\n",
+		  TCMUR_GLOBAL_MAX_DATA_AREA, cur_mb, total_mb);
+}
+
+/* Returns the MiB the device's data area was grown by */
+static uint64_t data_area_grow(struct tcmu_device *dev,
+			       struct tcmur_dev_stats *stats,
+			       uint64_t total_mb)
+{
+	uint64_t grow_mb = stats->data_area_mb;
+	int ret;
+
+	if (stats->data_resize_refused)
+		return 0;
+
+	if (total_mb >= data_area_budget_mb) {
+		tcmu_dev_dbg(dev, "Data area is saturated, but the %u MiB budget is used up.\n",
+			     data_area_budget_mb);
+		return 0;
+	}
+	if (grow_mb > data_area_budget_mb - total_mb)
+		grow_mb = data_area_budget_mb - total_mb;
+
+	ret = tcmu_cfgfs_dev_set_ctrl_u64(dev, "max_data_area_mb",
+					  stats->data_area_mb + grow_mb);
+	if (ret) {
+		tcmu_dev_info(dev, "Data area is saturated, but the kernel refused max_data_area_mb=%"PRIu64": %d. It can be set when the device is created.\n",
+			      stats->data_area_mb + grow_mb, ret);
+		stats->data_resize_refused = true;
+		return 0;
+	}
+
+	tcmu_dev_info(dev, "Data area is saturated, grew max_data_area_mb from %"PRIu64" to %"PRIu64".\n",
+		      stats->data_area_mb, stats->data_area_mb + grow_mb);
+	stats->data_area_mb += grow_mb;
+	return grow_mb;
+}
+
+/*
+ * Called from the main loop every TCMUR_DATA_AREA_INTERVAL secs. Only the
+ * main loop adds and removes devices, so devs stays valid.
+ */
+void tcmur_data_area_check(struct tcmu_device **devs, unsigned int nr_devs)
+{
+	uint64_t interval_ns = TCMUR_DATA_AREA_INTERVAL * 1000000000ULL;
+	uint64_t now = tcmur_now_ns();
+	struct tcmur_dev_stats *stats;
+	struct tcmur_device *rdev;
+	uint64_t full_ns, total_mb = 0;
+	bool saturated = false;
+	unsigned int i;
+
+	if (!data_area_budget_mb)
+		return;
+
+	for (i = 0; i < nr_devs; i++) {
+		rdev = tcmu_dev_get_private(devs[i]);
+		if (rdev->stats)
+			total_mb += rdev->stats->data_area_mb;
+	}
+
+	for (i = 0; i < nr_devs; i++) {
+		rdev = tcmu_dev_get_private(devs[i]);
+		stats = rdev->stats;
+		if (!stats || !stats->data_area_size)
+			continue;
+
+		full_ns = tcmur_stats_data_full_ns(stats, now);
+		if ((full_ns - stats->data_full_ns_seen) * 100 >=
+		    interval_ns * TCMUR_DATA_AREA_SAT_PCT)
+			stats->data_saturated++;
+		else
+			stats->data_saturated = 0;
+		stats->data_full_ns_seen = full_ns;
+
+		if (stats->data_saturated < TCMUR_DATA_AREA_SAT_CHECKS)
+			continue;
+		stats->data_saturated = 0;
+		saturated = true;
+
+		total_mb += data_area_grow(devs[i], stats, total_mb);
+	}
+
+	if (saturated)
+		data_area_raise_global(total_mb);
+}
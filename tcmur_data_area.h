@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_DATA_AREA_H
+#define __TCMUR_DATA_AREA_H
+
+struct tcmu_device;
+
+/* secs between data area checks */
+#define TCMUR_DATA_AREA_INTERVAL 10
+
+void tcmur_data_area_set_budget_mb(unsigned int budget_mb);
+unsigned int tcmur_data_area_get_budget_mb(void);
+void tcmur_data_area_check(struct tcmu_device **devs, unsigned int nr_devs);
+
+#endif
@@ -14,6 +14,8 @@
 #include <pthread.h>
 #include <errno.h>
 #include <unistd.h>
+#include <string.h>
+#include <time.h>
 
 #include "libtcmu_log.h"
 #include "libtcmu_common.h"
@@ -21,19 +23,254 @@
 #include "tcmur_device.h"
 #include "tcmur_cmd_handler.h"
 #include "tcmur_work.h"
+#include "tcmur_stats.h"
 #include "tcmu_runner_priv.h"
 #include "target.h"
 
+__thread struct tcmur_device *tcmur_cmdproc_rdev;
+__thread struct tcmur_device *tcmur_ring_cmd_rdev;
+
+/*
+ * Must be called with state_lock held after lock_state or
+ * TCMUR_DEV_FLAG_IN_RECOVERY has been changed.
+ */
+static void tcmur_dev_publish_io_state(struct tcmur_device *rdev)
+{
+	uint32_t io_state = rdev->lock_state;
+
+	if (rdev->flags & TCMUR_DEV_FLAG_IN_RECOVERY)
+		io_state |= TCMUR_DEV_IO_IN_RECOVERY;
+
+	__atomic_store_n(&rdev->io_state, io_state, __ATOMIC_RELEASE);
+}
+
+/*
+ * Must be called with state_lock held.
+ */
+void tcmur_dev_set_lock_state(struct tcmur_device *rdev, uint8_t state)
+{
+	rdev->lock_state = state;
+	tcmur_dev_publish_io_state(rdev);
+}
+
+/*
+ * Lockless read of lock_state for the IO path. The value can change right
+ * after it is returned, so only use it where a stale state is handled
+ * like a state change racing with the cmd.
+ */
+uint8_t tcmur_dev_peek_lock_state(struct tcmur_device *rdev)
+{
+	return __atomic_load_n(&rdev->io_state, __ATOMIC_ACQUIRE) &
+	       TCMUR_DEV_IO_LOCK_STATE_MASK;
+}
+
 bool tcmu_dev_in_recovery(struct tcmu_device *dev)
 {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
-	int in_recov = false;
 
-	pthread_mutex_lock(&rdev->state_lock);
-	if (rdev->flags & TCMUR_DEV_FLAG_IN_RECOVERY)
-		in_recov = true;
-	pthread_mutex_unlock(&rdev->state_lock);
-	return in_recov;
+	return __atomic_load_n(&rdev->io_state, __ATOMIC_ACQUIRE) &
+	       TCMUR_DEV_IO_IN_RECOVERY;
+}
+
+/*
+ * Recovery scheduler for reopens that retry until they succeed (retries
+ * -1), which is what every device does when a cluster goes away.
+ *
+ * At most recovery_max_reopens handler open calls run at a time over all
+ * devices, and waiters get a slot in order of how recently their device
+ * saw IO. Devices whose handler returns the same get_conn_key share a
+ * tcmur_recovery_grp: only one of them tries to open at a time, and after
+ * a failure all of them wait out the same jittered exponential backoff,
+ * so a dead cluster sees one reconnect per backoff period instead of one
+ * per device.
+ */
+#define TCMUR_RECOVERY_BACKOFF_MIN_MS	500
+#define TCMUR_RECOVERY_BACKOFF_MAX_MS	30000
+#define TCMUR_RECOVERY_DEF_MAX_REOPENS	8
+
+struct tcmur_recovery_grp {
+	struct list_node entry;
+	char key[TCMUR_CONN_KEY_LEN];
+	int refcnt;
+	bool busy;		/* a member is in the handler open call */
+	unsigned int failures;	/* consecutive failed opens */
+	uint64_t next_try_ns;	/* do not open before this time */
+};
+
+struct tcmur_recovery_waiter {
+	struct list_node entry;
+	struct tcmur_device *rdev;
+	struct tcmur_recovery_grp *grp;
+	uint64_t prio;
+};
+
+static pthread_mutex_t recovery_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t recovery_cond = PTHREAD_COND_INITIALIZER;
+static struct list_head recovery_grps = LIST_HEAD_INIT(recovery_grps);
+/* waiters for an open slot, most recently active device first */
+static struct list_head recovery_waiters = LIST_HEAD_INIT(recovery_waiters);
+static unsigned int recovery_max_reopens = TCMUR_RECOVERY_DEF_MAX_REOPENS;
+static unsigned int recovery_nr_reopens;
+static unsigned int recovery_seed;
+
+void tcmur_recovery_set_max_reopens(unsigned int max_reopens)
+{
+	pthread_mutex_lock(&recovery_lock);
+	recovery_max_reopens = max_reopens ? max_reopens : 1;
+	pthread_cond_broadcast(&recovery_cond);
+	pthread_mutex_unlock(&recovery_lock);
+}
+
+unsigned int tcmur_recovery_get_max_reopens(void)
+{
+	return __atomic_load_n(&recovery_max_reopens, __ATOMIC_RELAXED);
+}
+
+/* Must be called with recovery_lock held */
+static struct tcmur_recovery_grp *tcmur_recovery_grp_get(const char *key)
+{
+	struct tcmur_recovery_grp *grp;
+
+	list_for_each(&recovery_grps, grp, entry) {
+		if (!strcmp(grp->key, key)) {
+			grp->refcnt++;
+			return grp;
+		}
+	}
+
+	grp = calloc(1, sizeof(*grp));
+	if (!grp)
+		return NULL;
+	snprintf(grp->key, sizeof(grp->key), "%s", key);
+	grp->refcnt = 1;
+	list_add_tail(&recovery_grps, &grp->entry);
+	return grp;
+}
+
+/* Must be called with recovery_lock held */
+static void tcmur_recovery_grp_put(struct tcmur_recovery_grp *grp)
+{
+	if (--grp->refcnt)
+		return;
+
+	list_del(&grp->entry);
+	free(grp);
+}
+
+/*
+ * Must be called with recovery_lock held. Returns the first waiter that
+ * could open now, and sets *wait_ns to how long until a backoff expires
+ * if there is none.
+ */
+static struct tcmur_recovery_waiter *
+tcmur_recovery_next_waiter(uint64_t now, uint64_t *wait_ns)
+{
+	struct tcmur_recovery_waiter *waiter;
+
+	*wait_ns = 1000000000ULL;
+	if (recovery_nr_reopens >= recovery_max_reopens)
+		return NULL;
+
+	list_for_each(&recovery_waiters, waiter, entry) {
+		if (waiter->grp->busy)
+			continue;
+		if (waiter->grp->next_try_ns > now) {
+			if (waiter->grp->next_try_ns - now < *wait_ns)
+				*wait_ns = waiter->grp->next_try_ns - now;
+			continue;
+		}
+		return waiter;
+	}
+	return NULL;
+}
+
+/*
+ * Wait until the device may call the handler's open. Returns false,
+ * without a slot, if the device is being removed.
+ */
+static bool tcmur_recovery_begin(struct tcmur_recovery_waiter *waiter)
+{
+	struct tcmur_recovery_waiter *pos, *before = NULL;
+	struct timespec ts;
+	uint64_t now, wait_ns;
+	bool ok = true;
+
+	pthread_mutex_lock(&recovery_lock);
+
+	list_for_each(&recovery_waiters, pos, entry) {
+		if (pos->prio < waiter->prio) {
+			before = pos;
+			break;
+		}
+	}
+	if (before)
+		list_add_before(&recovery_waiters, &before->entry,
+				&waiter->entry);
+	else
+		list_add_tail(&recovery_waiters, &waiter->entry);
+
+	while (1) {
+		if (__atomic_load_n(&waiter->rdev->flags, __ATOMIC_RELAXED) &
+		    TCMUR_DEV_FLAG_STOPPING) {
+			ok = false;
+			break;
+		}
+
+		now = tcmur_now_ns();
+		if (tcmur_recovery_next_waiter(now, &wait_ns) == waiter)
+			break;
+
+		/* recovery_cond uses CLOCK_REALTIME */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		wait_ns += ts.tv_nsec;
+		ts.tv_sec += wait_ns / 1000000000ULL;
+		ts.tv_nsec = wait_ns % 1000000000ULL;
+		pthread_cond_timedwait(&recovery_cond, &recovery_lock, &ts);
+	}
+
+	list_del(&waiter->entry);
+	if (ok) {
+		waiter->grp->busy = true;
+		recovery_nr_reopens++;
+	}
+	/* Someone behind us may be runnable now */
+	pthread_cond_broadcast(&recovery_cond);
+	pthread_mutex_unlock(&recovery_lock);
+	return ok;
+}
+
+static void tcmur_recovery_end(struct tcmur_recovery_waiter *waiter, int ret)
+{
+	struct tcmur_recovery_grp *grp = waiter->grp;
+	uint64_t backoff_ms;
+
+	pthread_mutex_lock(&recovery_lock);
+	grp->busy = false;
+	recovery_nr_reopens--;
+
+	if (!ret) {
+		/* Let the rest of the group at the now working connection */
+		grp->failures = 0;
+		grp->next_try_ns = 0;
+	} else {
+		backoff_ms = TCMUR_RECOVERY_BACKOFF_MIN_MS;
+		if (grp->failures < 16)
+			backoff_ms <<= grp->failures;
+		if (backoff_ms > TCMUR_RECOVERY_BACKOFF_MAX_MS)
+			backoff_ms = TCMUR_RECOVERY_BACKOFF_MAX_MS;
+		grp->failures++;
+
+		if (!recovery_seed)
+			recovery_seed = getpid() ^ tcmur_now_ns();
+		/* Spread the retries over the second half of the backoff */
+		backoff_ms = backoff_ms / 2 +
+			     rand_r(&recovery_seed) % (backoff_ms / 2 + 1);
+		grp->next_try_ns = tcmur_now_ns() +
+				   backoff_ms * 1000000ULL;
+	}
+
+	pthread_cond_broadcast(&recovery_cond);
+	pthread_mutex_unlock(&recovery_lock);
 }
 
 /*
@@ -43,6 +280,9 @@ int __tcmu_reopen_dev(struct tcmu_device *dev, int retries)
 {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_recovery_waiter waiter;
+	struct tcmur_recovery_grp private_grp;
+	char key[TCMUR_CONN_KEY_LEN];
 	int ret, attempt = 0;
 	bool needs_close = false;
 
@@ -66,7 +306,7 @@ int __tcmu_reopen_dev(struct tcmu_device *dev, int retries)
 	rdev->flags &= ~TCMUR_DEV_FLAG_IS_OPEN;
 	pthread_mutex_unlock(&rdev->state_lock);
 
-	if (pthread_self() != rdev->cmdproc_thread)
+	if (!tcmur_dev_holds_ring(rdev))
 		/*
 		 * The cmdproc thread could be starting to execute a new IO.
 		 * Make sure sync cmd handler callbacks for cmds like INQUIRY
@@ -81,6 +321,32 @@ int __tcmu_reopen_dev(struct tcmu_device *dev, int retries)
 		goto done;
 	}
 
+	/*
+	 * Only retried reopens go through the scheduler. The others are
+	 * one shot calls from the IO path that must not wait on a backoff.
+	 */
+	memset(&waiter, 0, sizeof(waiter));
+	if (retries < 0) {
+		waiter.rdev = rdev;
+		waiter.prio = __atomic_load_n(&rdev->last_cmd_ns,
+					      __ATOMIC_RELAXED);
+
+		key[0] = '\0';
+		if (needs_close && rhandler->get_conn_key &&
+		    rhandler->get_conn_key(dev, key, sizeof(key)))
+			key[0] = '\0';
+
+		if (key[0]) {
+			pthread_mutex_lock(&recovery_lock);
+			waiter.grp = tcmur_recovery_grp_get(key);
+			pthread_mutex_unlock(&recovery_lock);
+		}
+		if (!waiter.grp) {
+			memset(&private_grp, 0, sizeof(private_grp));
+			waiter.grp = &private_grp;
+		}
+	}
+
 	if (needs_close) {
 		tcmu_dev_dbg(dev, "Closing device.\n");
 		rhandler->close(dev);
@@ -92,9 +358,16 @@ int __tcmu_reopen_dev(struct tcmu_device *dev, int retries)
 	       (retries < 0 || attempt <= retries)) {
 		pthread_mutex_unlock(&rdev->state_lock);
 
+		if (waiter.grp && !tcmur_recovery_begin(&waiter)) {
+			pthread_mutex_lock(&rdev->state_lock);
+			continue;
+		}
+
 		tcmu_dev_dbg(dev, "Opening device. Attempt %d\n", attempt);
 		ret = rhandler->open(dev, true);
-		if (ret) {
+		if (waiter.grp) {
+			tcmur_recovery_end(&waiter, ret);
+		} else if (ret) {
 			/* Avoid busy loop ? */
 			sleep(1);
 		}
@@ -103,14 +376,25 @@ int __tcmu_reopen_dev(struct tcmu_device *dev, int retries)
 		if (!ret) {
 			rdev->flags |= TCMUR_DEV_FLAG_IS_OPEN;
 			rdev->lock_lost = false;
+			/* Writes from before the reopen may still be cached */
+			tcmur_dev_mark_dirty(dev);
 		}
 		attempt++;
 	}
 
+	if (waiter.grp && waiter.grp != &private_grp) {
+		pthread_mutex_lock(&recovery_lock);
+		tcmur_recovery_grp_put(waiter.grp);
+		pthread_mutex_unlock(&recovery_lock);
+	}
+
 done:
 	rdev->flags &= ~TCMUR_DEV_FLAG_IN_RECOVERY;
+	tcmur_dev_publish_io_state(rdev);
 	pthread_mutex_unlock(&rdev->state_lock);
 
+	/* Ports may have been disabled and re-enabled while we were down */
+	tcmu_invalidate_alua_grps(dev);
 	return ret;
 }
 
@@ -129,6 +413,7 @@ int tcmu_reopen_dev(struct tcmu_device *dev, int retries)
 		return -EBUSY;
 	}
 	rdev->flags |= TCMUR_DEV_FLAG_IN_RECOVERY;
+	tcmur_dev_publish_io_state(rdev);
 	pthread_mutex_unlock(&rdev->state_lock);
 
 	return __tcmu_reopen_dev(dev, retries);
@@ -215,6 +500,7 @@ static bool __tcmu_notify_conn_lost(struct tcmu_device *dev)
 
 	if (!tcmu_add_dev_to_recovery_list(dev)) {
 		rdev->flags |= TCMUR_DEV_FLAG_IN_RECOVERY;
+		tcmur_dev_publish_io_state(rdev);
 		rdev->conn_lost_cnt++;
 		return true;
 	}
@@ -249,7 +535,7 @@ static void __tcmu_notify_lock_lost(struct tcmu_device *dev)
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 
 	rdev->lock_lost = true;
-	rdev->lock_state = TCMUR_DEV_LOCK_UNLOCKED;
+	tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_UNLOCKED);
 	rdev->lock_lost_cnt++;
 
 	tcmu_report_event(dev);
@@ -293,7 +579,7 @@ void tcmu_release_dev_lock(struct tcmu_device *dev)
 
 	if (!(rdev->flags & TCMUR_DEV_FLAG_IS_OPEN)) {
 		tcmu_dev_dbg(dev, "Device is closed so unlock is not needed\n");
-		rdev->lock_state = TCMUR_DEV_LOCK_UNLOCKED;
+		tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_UNLOCKED);
 		pthread_mutex_unlock(&rdev->state_lock);
 		return;
 	}
@@ -310,7 +596,7 @@ void tcmu_release_dev_lock(struct tcmu_device *dev)
 	 * is in a state where it cannot be fenced.
 	 */
 	pthread_mutex_lock(&rdev->state_lock);
-	rdev->lock_state = TCMUR_DEV_LOCK_UNLOCKED;
+	tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_UNLOCKED);
 	pthread_mutex_unlock(&rdev->state_lock);
 }
 
@@ -470,28 +756,29 @@ done:
 	/*
 	 * Handle race where cmd could be in tcmur_generic_handle_cmd before
 	 * the aio handler. For explicit ALUA, we execute the lock call from
-	 * the main io processing thread, so we only flush here for implicit.
+	 * the main io processing thread or for its STPG, so we only flush
+	 * here for implicit.
 	 */
-	if (pthread_self() != rdev->cmdproc_thread)
+	if (!tcmur_dev_holds_ring(rdev))
 		tcmu_dev_flush_ring(dev);
 
 	/* TODO: set UA based on bgly's patches */
 	pthread_mutex_lock(&rdev->state_lock);
 	if (ret != TCMU_STS_OK) {
-		rdev->lock_state = TCMUR_DEV_LOCK_UNLOCKED;
+		tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_UNLOCKED);
 		tcmu_dev_info(dev, "Lock acquisition unsuccessful\n");
 	} else {
 		if (rdev->lock_state == TCMUR_DEV_LOCK_READ_LOCKING) {
-			rdev->lock_state = TCMUR_DEV_LOCK_READ_LOCKED;
+			tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_READ_LOCKED);
 			tcmu_dev_info(dev, "Read lock acquisition successful\n");
 		} else if (rdev->lock_state == TCMUR_DEV_LOCK_WRITE_LOCKING) {
-			rdev->lock_state = TCMUR_DEV_LOCK_WRITE_LOCKED;
+			tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_WRITE_LOCKED);
 			tcmu_dev_info(dev, "Write lock acquisition successful\n");
 		} else {
 			/*
 			 * For explicit transition it will always acquire the write lock.
 			 */
-			rdev->lock_state = TCMUR_DEV_LOCK_WRITE_LOCKED;
+			tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_WRITE_LOCKED);
 			tcmu_dev_info(dev, "Write lock acquisition successful\n");
 		}
 	}
@@ -531,6 +818,17 @@ check_state:
 	pthread_mutex_unlock(&rdev->state_lock);
 }
 
+/*
+ * Note that data on the device may have changed since the last flush, so
+ * the next SYNCHRONIZE CACHE must be sent to the handler.
+ */
+void tcmur_dev_mark_dirty(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	__atomic_add_fetch(&rdev->write_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
 void tcmur_dev_set_private(struct tcmu_device *dev, void *private)
 {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
@@ -545,6 +843,31 @@ void *tcmur_dev_get_private(struct tcmu_device *dev)
 	return rdev->hm_private;
 }
 
+/*
+ * Return true if the device was opened with tcmur_async_io, so the
+ * handler's callouts must queue to its own engine and complete with
+ * tcmur_cmd_complete.
+ */
+bool tcmur_dev_async_io(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	return rdev->async_io;
+}
+
+/*
+ * Called from the handler's open callout if it will do blocking I/O
+ * from the calling context, e.g. because its async engine could not be
+ * set up. The device then gets a cmdproc thread of its own instead of
+ * stalling the other devices on a shared reactor.
+ */
+void tcmur_dev_set_blocking_io(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	rdev->blocking_io = true;
+}
+
 void tcmu_notify_cmd_timed_out(struct tcmu_device *dev)
 {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
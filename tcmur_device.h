@@ -14,6 +14,7 @@
 #include "ccan/list/list.h"
 
 #include "tcmur_aio.h"
+#include "tcmur_qos.h"
 
 #define TCMU_INVALID_LOCK_TAG USHRT_MAX
 
@@ -22,9 +23,29 @@
 #define TCMUR_DEV_FLAG_IS_OPEN		(1 << 2)
 #define TCMUR_DEV_FLAG_STOPPING		(1 << 3)
 #define TCMUR_DEV_FLAG_STOPPED		(1 << 4)
+#define TCMUR_DEV_FLAG_IN_STPG		(1 << 5)
 
 #define TCMUR_UA_DEV_SIZE_CHANGED	0
 
+/* Max cmds the merge stage folds into one handler request */
+#define TCMUR_MERGE_MAX_CMDS		32
+
+/* LBA range locks are hashed on regions of 1 << SHIFT blocks */
+#define TCMUR_RANGE_LOCK_BUCKETS	256
+#define TCMUR_RANGE_LOCK_SHIFT		11
+
+/*
+ * Emulated cmd state comes from power of two size classes from 256 bytes
+ * up to the class that fits a max_xfer_len transfer, at most 16M. Each
+ * class keeps up to TCMUR_STATE_CACHE_BYTES worth of free buffers, and at
+ * least one.
+ */
+#define TCMUR_STATE_MIN_SHIFT		8
+#define TCMUR_STATE_MAX_SHIFT		24
+#define TCMUR_STATE_NR_CLASSES		(TCMUR_STATE_MAX_SHIFT - TCMUR_STATE_MIN_SHIFT + 1)
+#define TCMUR_STATE_CACHE_BYTES		(4 * 1024 * 1024)
+#define TCMUR_STATE_CACHE_MAX		32
+
 enum {
 	TCMUR_DEV_FAILOVER_ALL_ACTIVE,
 	TCMUR_DEV_FAILOVER_IMPLICIT,
@@ -40,7 +61,61 @@ enum {
 	TCMUR_DEV_LOCK_WRITE_LOCKED,
 };
 
+/* rdev->io_state layout */
+#define TCMUR_DEV_IO_LOCK_STATE_MASK	0xff
+#define TCMUR_DEV_IO_IN_RECOVERY	(1 << 8)
+
 struct tcmur_work;
+struct tcmur_affinity;
+struct tcmur_reactor;
+struct tcmulib_cmd;
+
+typedef int (*tcmur_cmd_op_fn_t)(struct tcmu_device *dev,
+				 struct tcmulib_cmd *cmd);
+
+/* tcmur_cmd_op flags */
+#define TCMUR_CMD_OP_EMULATED	(1 << 0) /* run in the cmdproc thread */
+#define TCMUR_CMD_OP_ALUA	(1 << 1) /* needs alua_check_state */
+#define TCMUR_CMD_OP_READ	(1 << 2) /* only needs the read lock */
+#define TCMUR_CMD_OP_RW		(1 << 3) /* READ/WRITE, can be merged */
+
+/* Per opcode dispatch entry, see tcmur_dev_build_cmd_ops() */
+struct tcmur_cmd_op {
+	tcmur_cmd_op_fn_t fn;	/* NULL if the runner does not handle it */
+	uint8_t flags;
+};
+struct tcmur_dev_stats;
+struct tcmur_state_hdr;
+
+/* Free lists for emulated cmd state, see tcmur_state_zalloc() */
+struct tcmur_state_pool {
+	pthread_mutex_t lock;
+	/* Largest class used, bigger allocations go to the heap */
+	int max_class;
+	struct tcmur_state_hdr *free[TCMUR_STATE_NR_CLASSES];
+	unsigned int nr_free[TCMUR_STATE_NR_CLASSES];
+	/* allocations that had to go to the heap */
+	uint64_t misses;
+};
+
+/*
+ * Fields are grouped by which threads write them, and every group that is
+ * written from more than one thread, or written by a thread other than the
+ * one reading it in the IO path, starts on its own cache line:
+ *
+ *  - read mostly config set before the cmdproc thread is started
+ *  - cmdproc private state
+ *  - the mailbox lock and completion list shared with completing threads
+ *  - range lock state, written by submitters and completers
+ *  - flush elision state, written on every modifying completion
+ *  - the emulated cmd state pool, written by submitters and completers
+ *  - the io work queue and aio tracking, written by workers
+ *  - cold device/lock state, only written on state changes and errors
+ *
+ * rdev must be allocated with TCMUR_CACHELINE_SIZE alignment.
+ */
+#define TCMUR_CACHELINE_SIZE	64
+#define __tcmur_cacheline_aligned __attribute__((aligned(TCMUR_CACHELINE_SIZE)))
 
 struct tcmur_device {
 	struct tcmu_device *dev;
@@ -48,43 +123,231 @@ struct tcmur_device {
 
 	pthread_t cmdproc_thread;
 
-	/* TCMUR_DEV flags */
-	uint32_t flags;
 	uint8_t failover_type;
 
-	struct list_node recovery_entry;
+	/*
+	 * Snapshot of lock_state and TCMUR_DEV_FLAG_IN_RECOVERY so the IO
+	 * path can check them without taking state_lock. It is republished,
+	 * with state_lock held, whenever either of them changes.
+	 */
+	uint32_t io_state;
 
-	/* tcmur_event counters */
-	uint64_t lock_lost_cnt;
-	uint64_t conn_lost_cnt;
-	uint64_t cmd_timed_out_cnt;
-	struct tcmur_work *event_work;
+	/*
+	 * The cfgstring from the kernel, before the tcmur_ arguments were
+	 * removed, to tell what a reconfig changes.
+	 */
+	char *orig_cfgstring;
 
-	bool lock_lost;
-	uint8_t lock_state;
+	/* Command timeout in msecs, 0 if disabled */
+	int cmd_time_out;
 
-	/* General lock for lock state, thread, dev state, etc */
-	pthread_mutex_t state_lock;
-	int pending_uas;
+	/*
+	 * Number of io work queue threads, 0 for async handlers and for
+	 * devices with async_io.
+	 */
+	int nr_threads;
+	/* CPUs/NUMA node the cmdproc and io threads run on, NULL if unset */
+	struct tcmur_affinity *affinity;
+
+	/* Busy poll window in usecs, 0 if disabled */
+	uint32_t poll_usecs;
+
+	/*
+	 * LBA contiguous READs or WRITEs fetched in one ring drain are
+	 * combined into one handler request of up to merge_max_bytes, 0 if
+	 * disabled.
+	 */
+	uint32_t merge_max_bytes;
+
+	/* Max number of XCOPY chunks copied at the same time */
+	unsigned int xcopy_window;
+
+	/*
+	 * Try the handler's read_nowait from cmdproc before queueing READs
+	 * to the IO threads.
+	 */
+	bool read_nowait;
+
+	/*
+	 * Use the handler's own async engine instead of the io work queue
+	 * threads, if it has one.
+	 */
+	bool async_io;
+
+	/* Run the cmdproc loop on its own thread even if reactors are used */
+	bool no_reactor;
+
+	/*
+	 * The handler does blocking I/O from the calling context, so the
+	 * device must not share a reactor. See tcmur_dev_set_blocking_io().
+	 */
+	bool blocking_io;
+
+	/* Store and check T10-PI tuples, if the handler can */
+	bool pi;
+
+	/* Resolved by tcmur_dev_build_cmd_ops() */
+	bool passthrough_only;
+	struct tcmur_cmd_op cmd_ops[256];
+
+	/*
+	 * Only touched by the cmdproc thread from here up to the mailbox
+	 * lock.
+	 */
+
+	/* Outstanding cmds in deadline order */
+	struct list_head cmds_list __tcmur_cacheline_aligned;
+	struct list_head timed_out_cmds;
+
+	/* Latency histograms */
+	struct tcmur_dev_stats *stats;
+
+	/* Current, adaptive, busy poll window */
+	uint32_t poll_window;
+	uint64_t poll_hits;
+	uint64_t poll_sleeps;
+
+	/* The pending merge batch */
+	struct tcmur_cmd *merge_cmds[TCMUR_MERGE_MAX_CMDS];
+	int merge_nr_cmds;
+	bool merge_is_write;
+	uint64_t merge_next_lba;
+	size_t merge_length;
+	size_t merge_iov_cnt;
+	/* handler requests built from, and cmds folded into, merges */
+	uint64_t merge_reqs;
+	uint64_t merged_cmds;
+
+	/* CLOCK_MONOTONIC nsecs the last cmd was fetched, recovery priority */
+	uint64_t last_cmd_ns;
+
+	/* READs completed inline by read_nowait, and ones it sent on */
+	uint64_t nowait_reads;
+	uint64_t nowait_deferred;
+
+	/*
+	 * The shared reactor running the cmdproc loop instead of
+	 * cmdproc_thread, see tcmur_reactor.c. Set before the device is
+	 * handed to it, and the rest is owned by the reactor.
+	 */
+	struct tcmur_reactor *reactor;
+	struct list_node reactor_entry;
+	uint8_t reactor_state;
+	bool reactor_ready;
+	/* CLOCK_MONOTONIC nsecs the loop must be run again at, 0 if never */
+	uint64_t reactor_deadline_ns;
+
+	/* IOPS and bandwidth limits, and the cmds waiting on them */
+	struct tcmur_qos qos;
+
+	/* protects concurrent updates to mailbox */
+	pthread_spinlock_t lock __tcmur_cacheline_aligned;
+
+	/*
+	 * Lockless LIFO of cmds completed by handler/aio threads. Only the
+	 * cmdproc thread pops it and writes the entries to the ring. compl_efd
+	 * is used to wake it up when the list goes from empty to non-empty.
+	 */
+	struct tcmur_cmd *compl_list;
+	int compl_efd;
+
+	/*
+	 * LBA range locks, see tcmur_range_lock(). Exclusive holders (CAW,
+	 * WRITE AND VERIFY) and everything that had to take the slow path
+	 * are on range_locks, or on range_waiters until granted. Fast path
+	 * shared holders (writes) are only counted in range_shared, per
+	 * hashed LBA region. range_excl counts the held or waiting exclusive
+	 * locks per region, which sends new writes to the slow path.
+	 */
+	pthread_mutex_t range_lock __tcmur_cacheline_aligned;
+	struct list_head range_locks;
+	struct list_head range_waiters;
+	uint32_t range_shared[TCMUR_RANGE_LOCK_BUCKETS] __tcmur_cacheline_aligned;
+	uint32_t range_excl[TCMUR_RANGE_LOCK_BUCKETS];
+
+	/*
+	 * Flush elision. write_epoch is bumped when a cmd that modifies data
+	 * completes. flushed_epoch is the write_epoch covered by the last
+	 * successful flush, and flush_leader is the newest flush sent to the
+	 * handler, which later flushes for the same epoch wait on.
+	 */
+	uint64_t write_epoch __tcmur_cacheline_aligned;
+	pthread_mutex_t flush_lock;
+	uint64_t flushed_epoch;
+	struct tcmur_cmd *flush_leader;
+	uint64_t flushes_elided;
+	uint64_t flushes_coalesced;
+
+	struct tcmur_state_pool state_pool __tcmur_cacheline_aligned;
 
 	/*
 	 * lock order:
 	 *  work_queue->aio_lock
 	 *    track_queue->track_lock
 	 */
-        struct tcmu_io_queue work_queue;
-        struct tcmu_track_aio track_queue;
+	struct tcmu_io_queue work_queue __tcmur_cacheline_aligned;
+	struct tcmu_track_aio track_queue __tcmur_cacheline_aligned;
+
+	/* General lock for lock state, thread, dev state, etc */
+	pthread_mutex_t state_lock __tcmur_cacheline_aligned;
 
-	pthread_spinlock_t lock; /* protects concurrent updates to mailbox */
-	pthread_mutex_t caw_lock; /* for atomic CAW operation */
+	/* TCMUR_DEV flags */
+	uint32_t flags;
+
+	bool lock_lost;
+	uint8_t lock_state;
+	int pending_uas;
+
+	struct list_node recovery_entry;
+
+	/* tcmur_event counters */
+	uint64_t lock_lost_cnt;
+	uint64_t conn_lost_cnt;
+	uint64_t cmd_timed_out_cnt;
+	struct tcmur_work *event_work;
 
 	uint32_t format_progress;
 	pthread_mutex_t format_lock; /* for atomic format operations */
 
-	int cmd_time_out;
-	struct list_head cmds_list;
+	/*
+	 * Snapshot of the ALUA groups in configfs, so INQUIRY, RTPG and
+	 * STPG do not have to rescan it. See tcmu_lock_alua_grps().
+	 */
+	pthread_mutex_t alua_lock;
+	struct list_head alua_grps;
+	bool alua_grps_valid;
+	uint64_t alua_grps_ns;
+	/* bumped without alua_lock by tcmu_invalidate_alua_grps() */
+	uint32_t alua_grps_gen;
+	uint32_t alua_grps_snap_gen;
 };
 
+/*
+ * The device whose cmdproc loop the calling thread is running, if any. Set
+ * once by a dedicated cmdproc thread, and around every pass by a reactor.
+ */
+extern __thread struct tcmur_device *tcmur_cmdproc_rdev;
+
+static inline bool tcmur_dev_in_cmdproc(struct tcmur_device *rdev)
+{
+	return tcmur_cmdproc_rdev == rdev;
+}
+
+/*
+ * The device the calling thread runs an emulated cmd for outside the
+ * cmdproc loop, like STPG from event work on reactor devices.
+ */
+extern __thread struct tcmur_device *tcmur_ring_cmd_rdev;
+
+/*
+ * True if the calling thread is executing a cmd that is still in the
+ * device's ring, so waiting for the ring to drain would never return.
+ */
+static inline bool tcmur_dev_holds_ring(struct tcmur_device *rdev)
+{
+	return tcmur_cmdproc_rdev == rdev || tcmur_ring_cmd_rdev == rdev;
+}
+
 bool tcmu_dev_in_recovery(struct tcmu_device *dev);
 void tcmu_cancel_recovery(struct tcmu_device *dev);
 
@@ -93,14 +356,22 @@ void tcmu_notify_lock_lost(struct tcmu_device *dev);
 void tcmu_notify_cmd_timed_out(struct tcmu_device *dev);
 
 int __tcmu_reopen_dev(struct tcmu_device *dev, int retries);
+void tcmur_recovery_set_max_reopens(unsigned int max_reopens);
+unsigned int tcmur_recovery_get_max_reopens(void);
 int tcmu_reopen_dev(struct tcmu_device *dev, int retries);
 
 int tcmu_acquire_dev_lock(struct tcmu_device *dev, uint16_t tag);
 void tcmu_release_dev_lock(struct tcmu_device *dev);
 int tcmu_get_lock_tag(struct tcmu_device *dev, uint16_t *tag);
 void tcmu_update_dev_lock_state(struct tcmu_device *dev);
+void tcmur_dev_set_lock_state(struct tcmur_device *rdev, uint8_t state);
+uint8_t tcmur_dev_peek_lock_state(struct tcmur_device *rdev);
+
+void tcmur_dev_mark_dirty(struct tcmu_device *dev);
 
 void tcmur_dev_set_private(struct tcmu_device *dev, void *private);
 void *tcmur_dev_get_private(struct tcmu_device *dev);
+bool tcmur_dev_async_io(struct tcmu_device *dev);
+void tcmur_dev_set_blocking_io(struct tcmu_device *dev);
 
 #endif
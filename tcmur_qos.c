@@ -0,0 +1,372 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Per device IOPS and bandwidth limits.
+ *
+ * READs and WRITEs each have an IOPS and a bytes token bucket, filled at
+ * the configured rate up to burst_ms worth of credits. tcmur_generic_handle_cmd
+ * checks them before a cmd is sent to the handler. A cmd that finds no
+ * credits, or other cmds of its direction already waiting, is put on the
+ * direction's deferred list, and the cmdproc thread sends it on with
+ * tcmur_qos_next_cmd once enough credits have come in. Cmds are never
+ * failed for being over the limit.
+ *
+ * A cmd only needs credits up to the bucket size to go, and then takes
+ * its full cost, so cmds larger than the burst still get through and the
+ * debt is paid back before the next one.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <scsi/scsi.h>
+
+#include "scsi_defs.h"
+#include "libtcmu.h"
+#include "libtcmu_log.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+#include "tcmur_stats.h"
+#include "tcmur_qos.h"
+
+static const char *const qos_dir_names[] = {
+	[TCMUR_QOS_READ]	= "read",
+	[TCMUR_QOS_WRITE]	= "write",
+};
+
+int tcmur_qos_init(struct tcmu_device *dev, struct tcmur_qos_limits *limits)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_qos *qos = &rdev->qos;
+	int i, ret;
+
+	for (i = 0; i < TCMUR_QOS_NR_DIRS; i++)
+		list_head_init(&qos->dirs[i].deferred);
+
+	ret = pthread_mutex_init(&qos->lock, NULL);
+	if (ret)
+		return -ret;
+
+	/* picked up by the cmdproc thread with the first cmd */
+	qos->new_limits = *limits;
+	qos->new_gen = 1;
+	return 0;
+}
+
+void tcmur_qos_cleanup(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	int ret;
+
+	ret = pthread_mutex_destroy(&rdev->qos.lock);
+	if (ret)
+		tcmu_err("could not cleanup qos lock %d\n", ret);
+}
+
+/*
+ * Parse one tcmur_qos_ cfgstring argument into limits. Returns false if
+ * arg is not one.
+ */
+bool tcmur_qos_parse_arg(struct tcmur_qos_limits *limits, const char *arg)
+{
+	uint64_t *rate;
+	long long val;
+
+	if (!strncmp(arg, "tcmur_qos_read_iops=", 20)) {
+		rate = &limits->iops[TCMUR_QOS_READ];
+		arg += 20;
+	} else if (!strncmp(arg, "tcmur_qos_write_iops=", 21)) {
+		rate = &limits->iops[TCMUR_QOS_WRITE];
+		arg += 21;
+	} else if (!strncmp(arg, "tcmur_qos_read_kibps=", 21)) {
+		rate = &limits->kibps[TCMUR_QOS_READ];
+		arg += 21;
+	} else if (!strncmp(arg, "tcmur_qos_write_kibps=", 22)) {
+		rate = &limits->kibps[TCMUR_QOS_WRITE];
+		arg += 22;
+	} else if (!strncmp(arg, "tcmur_qos_burst_ms=", 19)) {
+		val = atoll(arg + 19);
+		limits->burst_ms = val > 0 ? val : 0;
+		return true;
+	} else {
+		return false;
+	}
+
+	val = atoll(arg);
+	*rate = val > 0 ? val : 0;
+	return true;
+}
+
+/* Can be called from any thread, the cmdproc thread applies the limits */
+void tcmur_qos_set_limits(struct tcmu_device *dev,
+			  struct tcmur_qos_limits *limits)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_qos *qos = &rdev->qos;
+
+	pthread_mutex_lock(&qos->lock);
+	qos->new_limits = *limits;
+	__atomic_add_fetch(&qos->new_gen, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&qos->lock);
+
+	tcmu_dev_info(dev, "QoS limits read %"PRIu64" IOPS %"PRIu64" KiB/s, write %"PRIu64" IOPS %"PRIu64" KiB/s, burst %u msecs (0 is unlimited)\n",
+		      limits->iops[TCMUR_QOS_READ],
+		      limits->kibps[TCMUR_QOS_READ],
+		      limits->iops[TCMUR_QOS_WRITE],
+		      limits->kibps[TCMUR_QOS_WRITE], limits->burst_ms);
+}
+
+static void qos_bucket_set(struct tcmur_qos_bucket *bucket, double rate,
+			   unsigned int burst_ms)
+{
+	double burst = rate * burst_ms / 1000;
+
+	if (burst < 1)
+		burst = 1;
+
+	/*
+	 * Start out with full credits when a limit is set, and keep the
+	 * credits, or the debt, when one is changed.
+	 */
+	if (!bucket->rate || bucket->tokens > burst)
+		bucket->tokens = burst;
+
+	bucket->rate = rate;
+	bucket->burst = burst;
+}
+
+static void qos_update_limits(struct tcmur_qos *qos)
+{
+	struct tcmur_qos_limits limits;
+	struct tcmur_qos_dir *dir;
+	uint32_t gen;
+	int i;
+
+	gen = __atomic_load_n(&qos->new_gen, __ATOMIC_ACQUIRE);
+	if (gen == qos->gen)
+		return;
+
+	pthread_mutex_lock(&qos->lock);
+	limits = qos->new_limits;
+	qos->gen = qos->new_gen;
+	pthread_mutex_unlock(&qos->lock);
+
+	qos->enabled = false;
+	for (i = 0; i < TCMUR_QOS_NR_DIRS; i++) {
+		dir = &qos->dirs[i];
+
+		qos_bucket_set(&dir->iops, limits.iops[i], limits.burst_ms);
+		qos_bucket_set(&dir->bytes, limits.kibps[i] * 1024.0,
+			       limits.burst_ms);
+		if (dir->iops.rate || dir->bytes.rate)
+			qos->enabled = true;
+	}
+	qos->last_ns = tcmur_now_ns();
+}
+
+static void qos_refill(struct tcmur_qos *qos, uint64_t now)
+{
+	struct tcmur_qos_bucket *bucket;
+	double secs;
+	int i;
+
+	if (now <= qos->last_ns)
+		return;
+	secs = (now - qos->last_ns) / 1e9;
+	qos->last_ns = now;
+
+	for (i = 0; i < TCMUR_QOS_NR_DIRS; i++) {
+		bucket = &qos->dirs[i].iops;
+		bucket->tokens += bucket->rate * secs;
+		if (bucket->tokens > bucket->burst)
+			bucket->tokens = bucket->burst;
+
+		bucket = &qos->dirs[i].bytes;
+		bucket->tokens += bucket->rate * secs;
+		if (bucket->tokens > bucket->burst)
+			bucket->tokens = bucket->burst;
+	}
+}
+
+/* nsecs until the bucket has the credits for cost, 0 if it has them now */
+static uint64_t qos_bucket_wait_ns(struct tcmur_qos_bucket *bucket,
+				   double cost)
+{
+	double need = cost < bucket->burst ? cost : bucket->burst;
+
+	if (!bucket->rate || bucket->tokens >= need)
+		return 0;
+	/* round up so the wakeup does not come in just short of it */
+	return (need - bucket->tokens) / bucket->rate * 1e9 + 1;
+}
+
+static uint64_t qos_dir_wait_ns(struct tcmur_qos_dir *dir, uint64_t bytes)
+{
+	uint64_t iops_ns, bytes_ns;
+
+	iops_ns = qos_bucket_wait_ns(&dir->iops, 1);
+	bytes_ns = qos_bucket_wait_ns(&dir->bytes, bytes);
+	return iops_ns > bytes_ns ? iops_ns : bytes_ns;
+}
+
+static void qos_dir_charge(struct tcmur_qos_dir *dir, uint64_t bytes)
+{
+	if (dir->iops.rate)
+		dir->iops.tokens -= 1;
+	if (dir->bytes.rate)
+		dir->bytes.tokens -= bytes;
+}
+
+static int qos_cmd_dir(struct tcmulib_cmd *cmd)
+{
+	switch (cmd->cdb[0]) {
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		return TCMUR_QOS_READ;
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_16:
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+	case COMPARE_AND_WRITE:
+		return TCMUR_QOS_WRITE;
+	default:
+		return -1;
+	}
+}
+
+/* Bytes of the device the cmd reads or writes */
+static uint64_t qos_cmd_bytes(struct tcmu_device *dev,
+			      struct tcmulib_cmd *cmd)
+{
+	return tcmu_lba_to_byte(dev, tcmu_cdb_get_xfer_length(cmd->cdb));
+}
+
+/*
+ * Called by cmdproc before cmd is sent to the handler. Returns true if
+ * cmd was deferred, and will be returned by tcmur_qos_next_cmd later.
+ */
+bool tcmur_qos_throttle(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
+	struct tcmur_qos *qos = &rdev->qos;
+	struct tcmur_qos_dir *dir;
+	uint64_t bytes;
+	int dir_idx;
+
+	qos_update_limits(qos);
+	if (!qos->enabled)
+		return false;
+
+	dir_idx = qos_cmd_dir(cmd);
+	if (dir_idx < 0)
+		return false;
+	dir = &qos->dirs[dir_idx];
+	bytes = qos_cmd_bytes(dev, cmd);
+
+	/* Do not let a cmd pass the ones already waiting */
+	if (list_empty(&dir->deferred)) {
+		qos_refill(qos, tcmur_now_ns());
+		if (!qos_dir_wait_ns(dir, bytes)) {
+			qos_dir_charge(dir, bytes);
+			return false;
+		}
+	}
+
+	list_add_tail(&dir->deferred, &tcmur_cmd->qos_entry);
+	qos->nr_deferred++;
+	dir->throttled++;
+	dir->throttled_bytes += bytes;
+	return true;
+}
+
+/*
+ * Called by cmdproc to get the next deferred cmd that can be sent to the
+ * handler now, alternating between READs and WRITEs. With force, cmds are
+ * returned regardless of credits, to fail them when the device is going
+ * away.
+ */
+struct tcmulib_cmd *tcmur_qos_next_cmd(struct tcmu_device *dev, bool force)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_qos *qos = &rdev->qos;
+	struct tcmur_cmd *tcmur_cmd;
+	struct tcmur_qos_dir *dir;
+	uint64_t bytes;
+	int i;
+
+	if (!qos->nr_deferred)
+		return NULL;
+
+	qos_update_limits(qos);
+	qos_refill(qos, tcmur_now_ns());
+
+	for (i = 0; i < TCMUR_QOS_NR_DIRS; i++) {
+		dir = &qos->dirs[(qos->next_dir + i) % TCMUR_QOS_NR_DIRS];
+
+		tcmur_cmd = list_top(&dir->deferred, struct tcmur_cmd,
+				     qos_entry);
+		if (!tcmur_cmd)
+			continue;
+
+		bytes = qos_cmd_bytes(dev, tcmur_cmd->lib_cmd);
+		if (!force && qos->enabled && qos_dir_wait_ns(dir, bytes))
+			continue;
+
+		qos_dir_charge(dir, bytes);
+		list_del(&tcmur_cmd->qos_entry);
+		qos->nr_deferred--;
+		qos->next_dir = (qos->next_dir + i + 1) % TCMUR_QOS_NR_DIRS;
+		return tcmur_cmd->lib_cmd;
+	}
+	return NULL;
+}
+
+/* nsecs until the next deferred cmd can go, false if none are waiting */
+bool tcmur_qos_get_timeout(struct tcmu_device *dev, uint64_t *wait_ns)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_qos *qos = &rdev->qos;
+	struct tcmur_cmd *tcmur_cmd;
+	struct tcmur_qos_dir *dir;
+	uint64_t ns, min_ns = UINT64_MAX;
+	int i;
+
+	if (!qos->nr_deferred)
+		return false;
+
+	for (i = 0; i < TCMUR_QOS_NR_DIRS; i++) {
+		dir = &qos->dirs[i];
+
+		tcmur_cmd = list_top(&dir->deferred, struct tcmur_cmd,
+				     qos_entry);
+		if (!tcmur_cmd)
+			continue;
+
+		ns = qos_dir_wait_ns(dir, qos_cmd_bytes(dev, tcmur_cmd->lib_cmd));
+		if (ns < min_ns)
+			min_ns = ns;
+	}
+
+	*wait_ns = min_ns;
+	return true;
+}
+
+const char *tcmur_qos_dir_name(int dir)
+{
+	return qos_dir_names[dir];
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_QOS_H
+#define __TCMUR_QOS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "ccan/list/list.h"
+
+struct tcmu_device;
+struct tcmulib_cmd;
+
+enum {
+	TCMUR_QOS_READ,
+	TCMUR_QOS_WRITE,
+	TCMUR_QOS_NR_DIRS,
+};
+
+/* Rates are per second, 0 means unlimited */
+struct tcmur_qos_limits {
+	uint64_t iops[TCMUR_QOS_NR_DIRS];
+	uint64_t kibps[TCMUR_QOS_NR_DIRS];
+	/* how long the rates can be exceeded after being idle */
+	unsigned int burst_ms;
+};
+
+struct tcmur_qos_bucket {
+	double rate;
+	double burst;
+	double tokens;
+};
+
+struct tcmur_qos_dir {
+	struct tcmur_qos_bucket iops;
+	struct tcmur_qos_bucket bytes;
+	struct list_head deferred;
+
+	/* cmds, and their bytes, that had to wait for credits */
+	uint64_t throttled;
+	uint64_t throttled_bytes;
+};
+
+/*
+ * Per device token buckets. Everything is owned by the cmdproc thread
+ * except new_limits, which reconfig sets under lock and announces by
+ * bumping new_gen.
+ */
+struct tcmur_qos {
+	bool enabled;
+	uint64_t last_ns;
+	unsigned int next_dir;
+	unsigned int nr_deferred;
+	struct tcmur_qos_dir dirs[TCMUR_QOS_NR_DIRS];
+	uint32_t gen;
+
+	pthread_mutex_t lock;
+	struct tcmur_qos_limits new_limits;
+	uint32_t new_gen;
+};
+
+int tcmur_qos_init(struct tcmu_device *dev, struct tcmur_qos_limits *limits);
+void tcmur_qos_cleanup(struct tcmu_device *dev);
+bool tcmur_qos_parse_arg(struct tcmur_qos_limits *limits, const char *arg);
+void tcmur_qos_set_limits(struct tcmu_device *dev,
+			  struct tcmur_qos_limits *limits);
+
+bool tcmur_qos_throttle(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
+struct tcmulib_cmd *tcmur_qos_next_cmd(struct tcmu_device *dev, bool force);
+bool tcmur_qos_get_timeout(struct tcmu_device *dev, uint64_t *wait_ns);
+const char *tcmur_qos_dir_name(int dir);
+
+#endif
@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Shared cmdproc reactors.
+ *
+ * By default every device runs its cmdproc loop on a thread of its own.
+ * With reactor_threads set in tcmu.conf a fixed set of reactor threads,
+ * each bound to a CPU, runs the loop for all devices instead: a reactor
+ * epolls the uio and completion eventfds of its devices and runs a pass
+ * of a device's loop when one of them fires or the timeout the last pass
+ * returned expires.
+ *
+ * A new device goes to the reactor that was the least busy running
+ * passes over the last seconds, and stays there until it is removed.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "ccan/list/list.h"
+
+#include "libtcmu.h"
+#include "libtcmu_log.h"
+#include "tcmur_device.h"
+#include "tcmur_stats.h"
+#include "tcmur_reactor.h"
+
+#define TCMUR_REACTOR_MAX_EVENTS	64
+/* How often the busy time is folded into the load average */
+#define TCMUR_REACTOR_LOAD_NS		1000000000ULL
+/* Loads closer than this are a tie, broken by the number of devices */
+#define TCMUR_REACTOR_LOAD_STEP		(TCMUR_REACTOR_LOAD_NS / 100)
+
+enum {
+	TCMUR_REACTOR_DEV_ADDING,
+	TCMUR_REACTOR_DEV_RUNNING,
+	TCMUR_REACTOR_DEV_FAILED,
+	TCMUR_REACTOR_DEV_REMOVING,
+	TCMUR_REACTOR_DEV_REMOVED,
+};
+
+struct tcmur_reactor {
+	unsigned int idx;
+	pthread_t thread;
+	int epfd;
+	int wake_efd;
+
+	/* Protects adding, nr_removing, stop and the devs' reactor_state */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct list_head adding;
+	unsigned int nr_removing;
+	bool stop;
+
+	/* Under reactors_lock */
+	unsigned int nr_devs;
+
+	/* Only touched by the reactor thread */
+	struct list_head devs;
+	uint64_t busy_ns;
+	uint64_t load_start_ns;
+
+	/* nsecs per sec spent running passes, averaged */
+	uint64_t load;
+};
+
+static const struct tcmur_reactor_ops *reactor_ops;
+static struct tcmur_reactor *reactors;
+static unsigned int nr_reactors;
+static pthread_mutex_t reactors_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool tcmur_reactors_enabled(void)
+{
+	return nr_reactors > 0;
+}
+
+static void tcmur_reactor_wake(struct tcmur_reactor *r)
+{
+	uint64_t cnt = 1;
+
+	if (write(r->wake_efd, &cnt, sizeof(cnt)) < 0)
+		tcmu_err("Could not wake reactor %u: %d\n", r->idx, -errno);
+}
+
+static void tcmur_reactor_unwatch(struct tcmur_reactor *r,
+				  struct tcmur_device *rdev)
+{
+	/* The fds may already be gone from the set if they failed */
+	epoll_ctl(r->epfd, EPOLL_CTL_DEL, tcmu_dev_get_fd(rdev->dev), NULL);
+	epoll_ctl(r->epfd, EPOLL_CTL_DEL, rdev->compl_efd, NULL);
+}
+
+/*
+ * Pick up the devices that were added and let go of the ones being
+ * removed. Returns false once the reactor should exit.
+ */
+static bool tcmur_reactor_update(struct tcmur_reactor *r)
+{
+	struct tcmur_device *rdev, *tmp;
+	bool stop;
+
+	pthread_mutex_lock(&r->lock);
+	list_for_each_safe(&r->adding, rdev, tmp, reactor_entry) {
+		list_del(&rdev->reactor_entry);
+		if (rdev->reactor_state == TCMUR_REACTOR_DEV_ADDING)
+			rdev->reactor_state = TCMUR_REACTOR_DEV_RUNNING;
+		/* Cmds may have been queued before its fds were watched */
+		rdev->reactor_ready = true;
+		list_add_tail(&r->devs, &rdev->reactor_entry);
+	}
+
+	if (r->nr_removing) {
+		list_for_each_safe(&r->devs, rdev, tmp, reactor_entry) {
+			if (rdev->reactor_state != TCMUR_REACTOR_DEV_REMOVING)
+				continue;
+
+			tcmur_reactor_unwatch(r, rdev);
+			list_del(&rdev->reactor_entry);
+			rdev->reactor_state = TCMUR_REACTOR_DEV_REMOVED;
+			r->nr_removing--;
+		}
+		pthread_cond_broadcast(&r->cond);
+	}
+	stop = r->stop;
+	pthread_mutex_unlock(&r->lock);
+
+	return !stop;
+}
+
+/*
+ * Like the dedicated cmdproc thread exiting on an unexpected revent: the
+ * device is no longer run, and its fds are dropped so they do not keep
+ * waking us up.
+ */
+static void tcmur_reactor_dev_failed(struct tcmur_reactor *r,
+				     struct tcmur_device *rdev,
+				     uint32_t revents)
+{
+	tcmu_dev_err(rdev->dev, "epoll received unexpected revent: 0x%x\n",
+		     revents);
+
+	tcmur_reactor_unwatch(r, rdev);
+	rdev->reactor_ready = false;
+	rdev->reactor_deadline_ns = 0;
+
+	pthread_mutex_lock(&r->lock);
+	if (rdev->reactor_state == TCMUR_REACTOR_DEV_RUNNING)
+		rdev->reactor_state = TCMUR_REACTOR_DEV_FAILED;
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void tcmur_reactor_run_dev(struct tcmur_reactor *r,
+				  struct tcmur_device *rdev)
+{
+	uint64_t start, end;
+	int64_t tmo;
+
+	start = tcmur_now_ns();
+	rdev->reactor_ready = false;
+
+	tcmur_cmdproc_rdev = rdev;
+	tmo = reactor_ops->run(rdev->dev);
+	tcmur_cmdproc_rdev = NULL;
+
+	end = tcmur_now_ns();
+	r->busy_ns += end - start;
+	rdev->reactor_deadline_ns = tmo < 0 ? 0 : end + tmo;
+}
+
+static void tcmur_reactor_update_load(struct tcmur_reactor *r, uint64_t now)
+{
+	uint64_t elapsed = now - r->load_start_ns, load;
+
+	if (elapsed < TCMUR_REACTOR_LOAD_NS)
+		return;
+
+	load = (double)r->busy_ns * TCMUR_REACTOR_LOAD_NS / elapsed;
+	load = (r->load * 3 + load) / 4;
+	__atomic_store_n(&r->load, load, __ATOMIC_RELAXED);
+
+	r->busy_ns = 0;
+	r->load_start_ns = now;
+}
+
+/* Returns the epoll_wait timeout in msecs for the devices' deadlines */
+static int tcmur_reactor_timeout(struct tcmur_reactor *r, uint64_t now)
+{
+	struct tcmur_device *rdev;
+	uint64_t next = 0, ms;
+
+	list_for_each(&r->devs, rdev, reactor_entry) {
+		if (rdev->reactor_ready)
+			return 0;
+		if (rdev->reactor_deadline_ns &&
+		    (!next || rdev->reactor_deadline_ns < next))
+			next = rdev->reactor_deadline_ns;
+	}
+
+	/* Wake up once in a while to decay the load of an idle reactor */
+	if (r->load && (!next || next > now + TCMUR_REACTOR_LOAD_NS))
+		next = now + TCMUR_REACTOR_LOAD_NS;
+
+	if (!next)
+		return -1;
+	if (next <= now)
+		return 0;
+
+	ms = (next - now + 999999) / 1000000;
+	return ms > INT_MAX ? INT_MAX : ms;
+}
+
+static void tcmur_reactor_bind(struct tcmur_reactor *r)
+{
+	cpu_set_t avail, set;
+	unsigned int n = 0;
+	int cpu, ret;
+
+	if (sched_getaffinity(0, sizeof(avail), &avail))
+		return;
+
+	/* Spread the reactors over the cpus we are allowed to run on */
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &avail))
+			continue;
+		if (n++ == r->idx % CPU_COUNT(&avail))
+			break;
+	}
+	if (cpu == CPU_SETSIZE)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (ret)
+		tcmu_warn("Could not bind reactor %u to cpu %d: %d\n",
+			  r->idx, cpu, -ret);
+}
+
+static void *tcmur_reactor_thread(void *arg)
+{
+	struct tcmur_reactor *r = arg;
+	struct epoll_event events[TCMUR_REACTOR_MAX_EVENTS];
+	struct tcmur_device *rdev;
+	uint64_t now, cnt;
+	uint8_t state;
+	int i, n;
+
+	tcmu_set_thread_name("reactor", NULL);
+	tcmur_reactor_bind(r);
+	r->load_start_ns = tcmur_now_ns();
+
+	while (tcmur_reactor_update(r)) {
+		n = epoll_wait(r->epfd, events, TCMUR_REACTOR_MAX_EVENTS,
+			       tcmur_reactor_timeout(r, tcmur_now_ns()));
+		if (n < 0) {
+			if (errno != EINTR)
+				tcmu_err("Reactor %u epoll_wait failed: %d\n",
+					 r->idx, -errno);
+			n = 0;
+		}
+
+		for (i = 0; i < n; i++) {
+			rdev = events[i].data.ptr;
+			if (!rdev) {
+				if (read(r->wake_efd, &cnt, sizeof(cnt)) < 0 &&
+				    errno != EAGAIN)
+					tcmu_err("Could not read reactor %u wake fd: %d\n",
+						 r->idx, -errno);
+				continue;
+			}
+
+			if (events[i].events & ~EPOLLIN)
+				tcmur_reactor_dev_failed(r, rdev,
+							 events[i].events);
+			else
+				rdev->reactor_ready = true;
+		}
+
+		now = tcmur_now_ns();
+		list_for_each(&r->devs, rdev, reactor_entry) {
+			state = __atomic_load_n(&rdev->reactor_state,
+						__ATOMIC_RELAXED);
+			if (state != TCMUR_REACTOR_DEV_RUNNING &&
+			    state != TCMUR_REACTOR_DEV_REMOVING)
+				continue;
+
+			if (rdev->reactor_deadline_ns &&
+			    rdev->reactor_deadline_ns <= now) {
+				tcmur_cmdproc_rdev = rdev;
+				reactor_ops->timed_out(rdev->dev);
+				tcmur_cmdproc_rdev = NULL;
+				rdev->reactor_ready = true;
+			}
+
+			if (rdev->reactor_ready)
+				tcmur_reactor_run_dev(r, rdev);
+		}
+
+		tcmur_reactor_update_load(r, tcmur_now_ns());
+	}
+
+	return NULL;
+}
+
+int tcmur_reactor_add_dev(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_reactor *r, *best = NULL;
+	struct epoll_event ev;
+	uint64_t load, best_load = 0;
+	unsigned int i;
+	int ret;
+
+	pthread_mutex_lock(&reactors_lock);
+	for (i = 0; i < nr_reactors; i++) {
+		r = &reactors[i];
+		load = __atomic_load_n(&r->load, __ATOMIC_RELAXED) /
+			TCMUR_REACTOR_LOAD_STEP;
+		if (!best || load < best_load ||
+		    (load == best_load && r->nr_devs < best->nr_devs)) {
+			best = r;
+			best_load = load;
+		}
+	}
+	r = best;
+	r->nr_devs++;
+	pthread_mutex_unlock(&reactors_lock);
+
+	rdev->reactor = r;
+	rdev->reactor_ready = false;
+	rdev->reactor_deadline_ns = 0;
+	rdev->reactor_state = TCMUR_REACTOR_DEV_ADDING;
+
+	/*
+	 * The fds are watched from here, so a failure can fail the add.
+	 * Events before the reactor picked the device up just mark it
+	 * ready.
+	 */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = rdev;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, tcmu_dev_get_fd(dev), &ev)) {
+		ret = -errno;
+		goto put_reactor;
+	}
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, rdev->compl_efd, &ev)) {
+		ret = -errno;
+		epoll_ctl(r->epfd, EPOLL_CTL_DEL, tcmu_dev_get_fd(dev), NULL);
+		goto put_reactor;
+	}
+
+	pthread_mutex_lock(&r->lock);
+	list_add_tail(&r->adding, &rdev->reactor_entry);
+	pthread_mutex_unlock(&r->lock);
+	tcmur_reactor_wake(r);
+
+	tcmu_dev_dbg(dev, "Running on reactor %u\n", r->idx);
+	return 0;
+
+put_reactor:
+	tcmu_dev_err(dev, "Could not add device to reactor %u: %d\n",
+		     r->idx, ret);
+	pthread_mutex_lock(&reactors_lock);
+	r->nr_devs--;
+	pthread_mutex_unlock(&reactors_lock);
+	rdev->reactor = NULL;
+	return ret;
+}
+
+/*
+ * Stop running the device's cmdproc loop. Returns once the reactor no
+ * longer touches the device.
+ */
+void tcmur_reactor_remove_dev(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_reactor *r = rdev->reactor;
+
+	pthread_mutex_lock(&r->lock);
+	__atomic_store_n(&rdev->reactor_state, TCMUR_REACTOR_DEV_REMOVING,
+			 __ATOMIC_RELAXED);
+	r->nr_removing++;
+	tcmur_reactor_wake(r);
+	while (rdev->reactor_state != TCMUR_REACTOR_DEV_REMOVED)
+		pthread_cond_wait(&r->cond, &r->lock);
+	pthread_mutex_unlock(&r->lock);
+
+	pthread_mutex_lock(&reactors_lock);
+	r->nr_devs--;
+	pthread_mutex_unlock(&reactors_lock);
+	rdev->reactor = NULL;
+}
+
+static void tcmur_reactor_destroy(struct tcmur_reactor *r)
+{
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+	close(r->wake_efd);
+	close(r->epfd);
+}
+
+static int tcmur_reactor_create(struct tcmur_reactor *r, unsigned int idx)
+{
+	struct epoll_event ev;
+	int ret;
+
+	r->idx = idx;
+	list_head_init(&r->adding);
+	list_head_init(&r->devs);
+
+	r->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (r->epfd < 0)
+		return -errno;
+
+	r->wake_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (r->wake_efd < 0) {
+		ret = -errno;
+		goto close_epfd;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wake_efd, &ev)) {
+		ret = -errno;
+		goto close_wake_efd;
+	}
+
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+
+	ret = pthread_create(&r->thread, NULL, tcmur_reactor_thread, r);
+	if (ret) {
+		ret = -ret;
+		goto destroy_lock;
+	}
+	return 0;
+
+destroy_lock:
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+close_wake_efd:
+	close(r->wake_efd);
+close_epfd:
+	close(r->epfd);
+	return ret;
+}
+
+static void tcmur_reactor_stop(struct tcmur_reactor *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->stop = true;
+	pthread_mutex_unlock(&r->lock);
+	tcmur_reactor_wake(r);
+
+	pthread_join(r->thread, NULL);
+	tcmur_reactor_destroy(r);
+}
+
+int tcmur_reactors_init(unsigned int nr, const struct tcmur_reactor_ops *ops)
+{
+	unsigned int i;
+	int ret;
+
+	if (!nr)
+		return 0;
+
+	reactors = calloc(nr, sizeof(*reactors));
+	if (!reactors)
+		return -ENOMEM;
+
+	reactor_ops = ops;
+	for (i = 0; i < nr; i++) {
+		ret = tcmur_reactor_create(&reactors[i], i);
+		if (ret) {
+			tcmu_err("Could not start reactor %u: %d\n", i, ret);
+			goto stop_reactors;
+		}
+	}
+	nr_reactors = nr;
+
+	tcmu_info("Running the cmdproc loops on %u reactors\n", nr);
+	return 0;
+
+stop_reactors:
+	while (i--)
+		tcmur_reactor_stop(&reactors[i]);
+	free(reactors);
+	reactors = NULL;
+	return ret;
+}
+
+/* Called once all devices are removed */
+void tcmur_reactors_cleanup(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_reactors; i++)
+		tcmur_reactor_stop(&reactors[i]);
+	nr_reactors = 0;
+	free(reactors);
+	reactors = NULL;
+}
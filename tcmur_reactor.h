@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_REACTOR_H
+#define __TCMUR_REACTOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct tcmu_device;
+
+/* How a reactor runs the cmdproc loop of its devices */
+struct tcmur_reactor_ops {
+	/*
+	 * One pass over the device's ring and completions. Returns the
+	 * nsecs after which it must be run again even without an event on
+	 * its fds, or -1.
+	 */
+	int64_t (*run)(struct tcmu_device *dev);
+	/* The timeout returned by run expired */
+	void (*timed_out)(struct tcmu_device *dev);
+};
+
+int tcmur_reactors_init(unsigned int nr_reactors,
+			const struct tcmur_reactor_ops *ops);
+void tcmur_reactors_cleanup(void);
+bool tcmur_reactors_enabled(void);
+
+int tcmur_reactor_add_dev(struct tcmu_device *dev);
+void tcmur_reactor_remove_dev(struct tcmu_device *dev);
+
+#endif
@@ -0,0 +1,697 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Per device latency histograms and IO counters.
+ *
+ * Cmds are timestamped when cmdproc fetches them, when they are handed to
+ * the handler and when the handler completes them. The histograms and
+ * counters are only updated by the cmdproc thread, when it fetches a cmd
+ * and when it writes the completion to the ring, so there is a single
+ * writer and no locking or atomics. Readers (D-Bus, the stats file) may
+ * see a histogram mid update, which is fine for statistics.
+ *
+ * The data area use is tracked the same way, from the data buffers of the
+ * fetched cmds, and the cmd ring use is read from the mailbox.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <scsi/scsi.h>
+
+#include "target_core_user_local.h"
+#include "scsi_defs.h"
+#include "libtcmu.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+#include "tcmur_aio.h"
+#include "tcmur_stats.h"
+
+uint64_t tcmur_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t data_block_size;
+
+int tcmur_stats_init(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_dev_stats *stats;
+	struct tcmu_mailbox *mb;
+	uint64_t data_off;
+	char *mmap_name;
+	size_t len;
+
+	stats = calloc(1, sizeof(*stats));
+	if (!stats)
+		return -ENOMEM;
+
+	if (!data_block_size)
+		data_block_size = sysconf(_SC_PAGESIZE);
+
+	/* The data area follows the cmd ring up to the end of the mapping */
+	mmap_name = tcmu_dev_get_memory_info(dev, (void **)&mb, &len, NULL);
+	if (mmap_name) {
+		free(mmap_name);
+
+		data_off = (uint64_t)mb->cmdr_off + mb->cmdr_size;
+		if (mb->cmdr_size && len > data_off) {
+			stats->mb = mb;
+			stats->ring_size = mb->cmdr_size;
+			stats->data_area_size = len - data_off;
+			stats->data_area_mb = stats->data_area_size >> 20;
+		}
+	}
+
+	rdev->stats = stats;
+	return 0;
+}
+
+void tcmur_stats_cleanup(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	free(rdev->stats);
+	rdev->stats = NULL;
+}
+
+static const char *const stats_class_names[] = {
+	[TCMUR_STATS_READ]	= "read",
+	[TCMUR_STATS_WRITE]	= "write",
+	[TCMUR_STATS_FLUSH]	= "flush",
+	[TCMUR_STATS_UNMAP]	= "unmap",
+	[TCMUR_STATS_CAW]	= "caw",
+	[TCMUR_STATS_XCOPY]	= "xcopy",
+	[TCMUR_STATS_OTHER]	= "other",
+};
+
+static const char *const stats_stage_names[] = {
+	[TCMUR_STATS_QUEUE]	 = "queue",
+	[TCMUR_STATS_BACKEND]	 = "backend",
+	[TCMUR_STATS_COMPLETION] = "completion",
+	[TCMUR_STATS_TOTAL]	 = "total",
+};
+
+static const char *const stats_sts_names[TCMUR_STATS_NR_STS] = {
+	[TCMU_STS_OK]			  = "ok",
+	[TCMU_STS_NO_RESOURCE]		  = "no_resource",
+	[TCMU_STS_PASSTHROUGH_ERR]	  = "passthrough_err",
+	[TCMU_STS_BUSY]			  = "busy",
+	[TCMU_STS_WR_ERR]		  = "wr_err",
+	[TCMU_STS_RD_ERR]		  = "rd_err",
+	[TCMU_STS_MISCOMPARE]		  = "miscompare",
+	[TCMU_STS_INVALID_CMD]		  = "invalid_cmd",
+	[TCMU_STS_INVALID_CDB]		  = "invalid_cdb",
+	[TCMU_STS_INVALID_PARAM_LIST]	  = "invalid_param_list",
+	[TCMU_STS_INVALID_PARAM_LIST_LEN] = "invalid_param_list_len",
+	[TCMU_STS_TIMEOUT]		  = "timeout",
+	[TCMU_STS_FENCED]		  = "fenced",
+	[TCMU_STS_HW_ERR]		  = "hw_err",
+	[TCMU_STS_RANGE]		  = "range",
+	[TCMU_STS_FRMT_IN_PROGRESS]	  = "frmt_in_progress",
+	[TCMU_STS_CAPACITY_CHANGED]	  = "capacity_changed",
+	[TCMU_STS_NOTSUPP_SAVE_PARAMS]	  = "notsupp_save_params",
+	[TCMU_STS_WR_ERR_INCOMPAT_FRMT]	  = "wr_err_incompat_frmt",
+	[TCMU_STS_TRANSITION]		  = "transition",
+	[TCMU_STS_IMPL_TRANSITION_ERR]	  = "impl_transition_err",
+	[TCMU_STS_EXPL_TRANSITION_ERR]	  = "expl_transition_err",
+	[TCMU_STS_NO_LOCK_HOLDERS]	  = "no_lock_holders",
+	[TCMU_STS_NOTSUPP_SEG_DESC_TYPE]  = "notsupp_seg_desc_type",
+	[TCMU_STS_NOTSUPP_TGT_DESC_TYPE]  = "notsupp_tgt_desc_type",
+	[TCMU_STS_CP_TGT_DEV_NOTCONN]	  = "cp_tgt_dev_notconn",
+	[TCMU_STS_INVALID_CP_TGT_DEV_TYPE] = "invalid_cp_tgt_dev_type",
+	[TCMU_STS_TOO_MANY_SEG_DESC]	  = "too_many_seg_desc",
+	[TCMU_STS_TOO_MANY_TGT_DESC]	  = "too_many_tgt_desc",
+	[TCMU_STS_PI_GUARD_ERR]		  = "pi_guard_err",
+	[TCMU_STS_PI_REF_ERR]		  = "pi_ref_err",
+};
+
+const char *tcmur_stats_sts_name(int sts)
+{
+	if (sts < 0)
+		return "not_handled";
+	if (sts >= TCMUR_STATS_NR_STS || !stats_sts_names[sts])
+		return "unknown";
+	return stats_sts_names[sts];
+}
+
+const char *tcmur_stats_class_name(enum tcmur_stats_class cls)
+{
+	return stats_class_names[cls];
+}
+
+const char *tcmur_stats_stage_name(enum tcmur_stats_stage stage)
+{
+	return stats_stage_names[stage];
+}
+
+static enum tcmur_stats_class stats_cdb_class(uint8_t *cdb)
+{
+	switch (cdb[0]) {
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		return TCMUR_STATS_READ;
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_16:
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+		return TCMUR_STATS_WRITE;
+	case SYNCHRONIZE_CACHE:
+	case SYNCHRONIZE_CACHE_16:
+		return TCMUR_STATS_FLUSH;
+	case UNMAP:
+		return TCMUR_STATS_UNMAP;
+	case COMPARE_AND_WRITE:
+		return TCMUR_STATS_CAW;
+	case EXTENDED_COPY:
+		return TCMUR_STATS_XCOPY;
+	default:
+		return TCMUR_STATS_OTHER;
+	}
+}
+
+static unsigned int hist_bucket(uint64_t ns)
+{
+	unsigned int msb, group;
+
+	if (ns < TCMUR_HIST_SUB)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	group = msb - TCMUR_HIST_SUB_BITS + 1;
+	if (group > TCMUR_HIST_GROUPS)
+		return TCMUR_HIST_BUCKETS - 1;
+
+	return group * TCMUR_HIST_SUB +
+	       ((ns >> (msb - TCMUR_HIST_SUB_BITS)) & (TCMUR_HIST_SUB - 1));
+}
+
+/* Smallest value that lands in bucket */
+static uint64_t hist_bucket_start(unsigned int bucket)
+{
+	unsigned int group = bucket / TCMUR_HIST_SUB;
+
+	if (!group)
+		return bucket;
+
+	return (uint64_t)(TCMUR_HIST_SUB + bucket % TCMUR_HIST_SUB) <<
+		(group - 1);
+}
+
+void tcmur_hist_record(struct tcmur_latency_hist *hist, uint64_t ns)
+{
+	hist->count++;
+	hist->sum_ns += ns;
+	if (ns > hist->max_ns)
+		hist->max_ns = ns;
+	hist->buckets[hist_bucket(ns)]++;
+}
+
+/* Returns the upper bound of the bucket the pct percentile is in */
+uint64_t tcmur_hist_percentile(struct tcmur_latency_hist *hist, double pct)
+{
+	uint64_t count = hist->count, seen = 0, rank;
+	unsigned int i;
+
+	if (!count)
+		return 0;
+
+	rank = count * pct / 100;
+	if (rank < 1)
+		rank = 1;
+
+	for (i = 0; i < TCMUR_HIST_BUCKETS - 1; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+
+	if (i == TCMUR_HIST_BUCKETS - 1)
+		return hist->max_ns;
+
+	rank = hist_bucket_start(i + 1) - 1;
+	return rank < hist->max_ns ? rank : hist->max_ns;
+}
+
+uint32_t tcmur_stats_ring_bytes(struct tcmur_dev_stats *stats)
+{
+	uint32_t head, tail;
+
+	if (!stats->mb)
+		return 0;
+
+	head = __atomic_load_n(&stats->mb->cmd_head, __ATOMIC_RELAXED);
+	tail = __atomic_load_n(&stats->mb->cmd_tail, __ATOMIC_RELAXED);
+	return (head + stats->ring_size - tail) % stats->ring_size;
+}
+
+/* Time the data area has been full, including the current period */
+uint64_t tcmur_stats_data_full_ns(struct tcmur_dev_stats *stats, uint64_t now)
+{
+	uint64_t start = stats->data_full_start_ns;
+	uint64_t full_ns = stats->data_full_ns;
+
+	if (start && now > start)
+		full_ns += now - start;
+	return full_ns;
+}
+
+static void stats_data_full_update(struct tcmur_dev_stats *stats,
+				   uint64_t now)
+{
+	bool full = stats->data_bytes * 100 >=
+			stats->data_area_size * TCMUR_DATA_AREA_FULL_PCT;
+
+	if (full && !stats->data_full_start_ns) {
+		stats->data_full_start_ns = now;
+		stats->data_full_cnt++;
+	} else if (!full && stats->data_full_start_ns) {
+		if (now > stats->data_full_start_ns)
+			stats->data_full_ns += now - stats->data_full_start_ns;
+		stats->data_full_start_ns = 0;
+	}
+}
+
+/* Called by cmdproc when it fetches cmd from the ring */
+void tcmur_stats_cmd_start(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
+	struct tcmur_dev_stats *stats = rdev->stats;
+	struct tcmur_op_stats *op;
+	uint32_t ring_bytes;
+	size_t len;
+
+	if (!stats)
+		return;
+
+	len = tcmu_iovec_length(cmd->iovec, cmd->iov_cnt);
+	op = &stats->ops[cmd->cdb[0]];
+	op->cmds++;
+	op->bytes += len;
+
+	if (++stats->queue_depth > stats->queue_depth_max)
+		stats->queue_depth_max = stats->queue_depth;
+
+	if (!stats->data_area_size)
+		return;
+
+	tcmur_cmd->data_bytes = (len + data_block_size - 1) /
+					data_block_size * data_block_size;
+	stats->data_bytes += tcmur_cmd->data_bytes;
+	if (stats->data_bytes > stats->data_bytes_max)
+		stats->data_bytes_max = stats->data_bytes;
+	stats_data_full_update(stats, tcmur_cmd->start_ns);
+
+	ring_bytes = tcmur_stats_ring_bytes(stats);
+	if (ring_bytes > stats->ring_bytes_max)
+		stats->ring_bytes_max = ring_bytes;
+}
+
+/* Called by cmdproc when it completes cmd on the ring */
+void tcmur_stats_cmd_done(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			  int rc)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
+	struct tcmur_dev_stats *stats = rdev->stats;
+	struct tcmur_latency_hist *lat;
+	uint64_t now;
+
+	if (!stats || !tcmur_cmd->start_ns)
+		return;
+
+	now = tcmur_now_ns();
+
+	if (stats->queue_depth)
+		stats->queue_depth--;
+	if (rc != TCMU_STS_OK)
+		stats->ops[cmd->cdb[0]].errors++;
+	if (rc < 0)
+		stats->not_handled++;
+	else if (rc < TCMUR_STATS_NR_STS)
+		stats->sts[rc]++;
+
+	if (tcmur_cmd->data_bytes) {
+		if (stats->data_bytes >= tcmur_cmd->data_bytes)
+			stats->data_bytes -= tcmur_cmd->data_bytes;
+		else
+			stats->data_bytes = 0;
+		tcmur_cmd->data_bytes = 0;
+		stats_data_full_update(stats, now);
+	}
+
+	lat = rdev->stats->lat[stats_cdb_class(cmd->cdb)];
+
+	tcmur_hist_record(&lat[TCMUR_STATS_TOTAL], now - tcmur_cmd->start_ns);
+
+	/* Emulated cmds never reach the handler or the completion list */
+	if (!tcmur_cmd->done_ns)
+		return;
+
+	tcmur_hist_record(&lat[TCMUR_STATS_COMPLETION],
+			  now - tcmur_cmd->done_ns);
+
+	if (tcmur_cmd->dispatch_ns >= tcmur_cmd->start_ns &&
+	    tcmur_cmd->dispatch_ns <= tcmur_cmd->done_ns) {
+		tcmur_hist_record(&lat[TCMUR_STATS_QUEUE],
+				  tcmur_cmd->dispatch_ns - tcmur_cmd->start_ns);
+		tcmur_hist_record(&lat[TCMUR_STATS_BACKEND],
+				  tcmur_cmd->done_ns - tcmur_cmd->dispatch_ns);
+	}
+}
+
+static void prom_header(FILE *fp, const char *name, const char *type,
+			const char *help)
+{
+	fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void prom_print_dev_u64(FILE *fp, struct tcmu_device **devs,
+			       unsigned int nr_devs, const char *name,
+			       const char *type, const char *help,
+			       uint64_t (*get)(struct tcmur_device *rdev))
+{
+	struct tcmur_device *rdev;
+	unsigned int i;
+
+	prom_header(fp, name, type, help);
+	for (i = 0; i < nr_devs; i++) {
+		rdev = tcmu_dev_get_private(devs[i]);
+		fprintf(fp, "%s{dev=\"%s\"} %"PRIu64"\n", name,
+			tcmu_dev_get_uio_name(devs[i]), get(rdev));
+	}
+}
+
+static uint64_t get_queue_depth(struct tcmur_device *rdev)
+{
+	return rdev->stats ? rdev->stats->queue_depth : 0;
+}
+
+static uint64_t get_queue_depth_max(struct tcmur_device *rdev)
+{
+	return rdev->stats ? rdev->stats->queue_depth_max : 0;
+}
+
+static uint64_t get_data_area_size(struct tcmur_device *rdev)
+{
+	return rdev->stats ? rdev->stats->data_area_size : 0;
+}
+
+static uint64_t get_data_area_used(struct tcmur_device *rdev)
+{
+	return rdev->stats ? rdev->stats->data_bytes : 0;
+}
+
+static uint64_t get_data_area_used_max(struct tcmur_device *rdev)
+{
+	return rdev->stats ? rdev->stats->data_bytes_max : 0;
+}
+
+static uint64_t get_data_area_full(struct tcmur_device *rdev)
+{
+	return rdev->stats ? rdev->stats->data_full_cnt : 0;
+}
+
+static uint64_t get_ring_size(struct tcmur_device *rdev)
+{
+	return rdev->stats ? rdev->stats->ring_size : 0;
+}
+
+static uint64_t get_ring_used(struct tcmur_device *rdev)
+{
+	return rdev->stats ? tcmur_stats_ring_bytes(rdev->stats) : 0;
+}
+
+static uint64_t get_ring_used_max(struct tcmur_device *rdev)
+{
+	return rdev->stats ? rdev->stats->ring_bytes_max : 0;
+}
+
+static uint64_t get_qos_deferred(struct tcmur_device *rdev)
+{
+	return rdev->qos.nr_deferred;
+}
+
+static uint64_t get_aio_depth(struct tcmur_device *rdev)
+{
+	return rdev->track_queue.tracked_aio_ops;
+}
+
+static uint64_t get_aio_depth_max(struct tcmur_device *rdev)
+{
+	return rdev->track_queue.tracked_aio_max;
+}
+
+static uint64_t get_lock_lost(struct tcmur_device *rdev)
+{
+	return rdev->lock_lost_cnt;
+}
+
+static uint64_t get_conn_lost(struct tcmur_device *rdev)
+{
+	return rdev->conn_lost_cnt;
+}
+
+static uint64_t get_cmd_timed_out(struct tcmur_device *rdev)
+{
+	return rdev->cmd_timed_out_cnt;
+}
+
+enum {
+	PROM_OP_CMDS,
+	PROM_OP_BYTES,
+	PROM_OP_ERRORS,
+};
+
+static void prom_print_ops(FILE *fp, struct tcmu_device **devs,
+			   unsigned int nr_devs, int field, const char *name,
+			   const char *help)
+{
+	struct tcmur_op_stats *op;
+	struct tcmur_device *rdev;
+	unsigned int i, opcode;
+	uint64_t val;
+
+	prom_header(fp, name, "counter", help);
+	for (i = 0; i < nr_devs; i++) {
+		rdev = tcmu_dev_get_private(devs[i]);
+		if (!rdev->stats)
+			continue;
+
+		for (opcode = 0; opcode < 256; opcode++) {
+			op = &rdev->stats->ops[opcode];
+			if (!op->cmds)
+				continue;
+
+			if (field == PROM_OP_CMDS)
+				val = op->cmds;
+			else if (field == PROM_OP_BYTES)
+				val = op->bytes;
+			else
+				val = op->errors;
+
+			fprintf(fp, "%s{dev=\"%s\",opcode=\"0x%02x\"} %"PRIu64"\n",
+				name, tcmu_dev_get_uio_name(devs[i]), opcode,
+				val);
+		}
+	}
+}
+
+static void prom_print_sts(FILE *fp, struct tcmu_device **devs,
+			   unsigned int nr_devs)
+{
+	const char *name = "tcmur_cmd_status_total";
+	struct tcmur_device *rdev;
+	unsigned int i;
+	int sts;
+
+	prom_header(fp, name, "counter", "Completed cmds by TCMU status.");
+	for (i = 0; i < nr_devs; i++) {
+		rdev = tcmu_dev_get_private(devs[i]);
+		if (!rdev->stats)
+			continue;
+
+		for (sts = -1; sts < TCMUR_STATS_NR_STS; sts++) {
+			uint64_t val = sts < 0 ? rdev->stats->not_handled :
+						 rdev->stats->sts[sts];
+
+			if (!val)
+				continue;
+
+			fprintf(fp, "%s{dev=\"%s\",status=\"%s\"} %"PRIu64"\n",
+				name, tcmu_dev_get_uio_name(devs[i]),
+				tcmur_stats_sts_name(sts), val);
+		}
+	}
+}
+
+static void prom_print_data_full_secs(FILE *fp, struct tcmu_device **devs,
+				     unsigned int nr_devs)
+{
+	const char *name = "tcmur_data_area_full_seconds_total";
+	struct tcmur_device *rdev;
+	uint64_t now = tcmur_now_ns();
+	unsigned int i;
+
+	prom_header(fp, name, "counter", "Time the data area was full.");
+	for (i = 0; i < nr_devs; i++) {
+		rdev = tcmu_dev_get_private(devs[i]);
+		if (!rdev->stats)
+			continue;
+
+		fprintf(fp, "%s{dev=\"%s\"} %.9f\n", name,
+			tcmu_dev_get_uio_name(devs[i]),
+			tcmur_stats_data_full_ns(rdev->stats, now) / 1e9);
+	}
+}
+
+static void prom_print_qos(FILE *fp, struct tcmu_device **devs,
+			   unsigned int nr_devs, bool bytes, const char *name,
+			   const char *help)
+{
+	struct tcmur_qos_dir *qos_dir;
+	struct tcmur_device *rdev;
+	unsigned int i;
+	int dir;
+
+	prom_header(fp, name, "counter", help);
+	for (i = 0; i < nr_devs; i++) {
+		rdev = tcmu_dev_get_private(devs[i]);
+
+		for (dir = 0; dir < TCMUR_QOS_NR_DIRS; dir++) {
+			qos_dir = &rdev->qos.dirs[dir];
+			fprintf(fp, "%s{dev=\"%s\",dir=\"%s\"} %"PRIu64"\n",
+				name, tcmu_dev_get_uio_name(devs[i]),
+				tcmur_qos_dir_name(dir),
+				bytes ? qos_dir->throttled_bytes :
+					qos_dir->throttled);
+		}
+	}
+}
+
+static void prom_print_latency(FILE *fp, struct tcmu_device **devs,
+			       unsigned int nr_devs)
+{
+	static const double quantiles[] = { 50, 99, 99.9 };
+	const char *name = "tcmur_cmd_latency_seconds";
+	struct tcmur_latency_hist *hist;
+	struct tcmur_device *rdev;
+	unsigned int i, q;
+	int cls, stage;
+	char labels[128];
+
+	prom_header(fp, name, "summary",
+		    "Cmd latency by opcode class and stage.");
+	for (i = 0; i < nr_devs; i++) {
+		rdev = tcmu_dev_get_private(devs[i]);
+		if (!rdev->stats)
+			continue;
+
+		for (cls = 0; cls < TCMUR_STATS_NR_CLASSES; cls++) {
+			for (stage = 0; stage < TCMUR_STATS_NR_STAGES; stage++) {
+				hist = &rdev->stats->lat[cls][stage];
+				if (!hist->count)
+					continue;
+
+				snprintf(labels, sizeof(labels),
+					 "dev=\"%s\",class=\"%s\",stage=\"%s\"",
+					 tcmu_dev_get_uio_name(devs[i]),
+					 tcmur_stats_class_name(cls),
+					 tcmur_stats_stage_name(stage));
+
+				for (q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+					fprintf(fp, "%s{%s,quantile=\"%g\"} %.9f\n",
+						name, labels, quantiles[q] / 100,
+						tcmur_hist_percentile(hist, quantiles[q]) / 1e9);
+				fprintf(fp, "%s_sum{%s} %.9f\n", name, labels,
+					hist->sum_ns / 1e9);
+				fprintf(fp, "%s_count{%s} %"PRIu64"\n", name,
+					labels, hist->count);
+			}
+		}
+	}
+}
+
+/* Print the stats of devs in the Prometheus text exposition format */
+void tcmur_stats_print_prom(FILE *fp, struct tcmu_device **devs,
+			    unsigned int nr_devs)
+{
+	prom_print_ops(fp, devs, nr_devs, PROM_OP_CMDS, "tcmur_cmds_total",
+		       "Cmds fetched from the ring by opcode.");
+	prom_print_ops(fp, devs, nr_devs, PROM_OP_BYTES, "tcmur_bytes_total",
+		       "Data buffer bytes of fetched cmds by opcode.");
+	prom_print_ops(fp, devs, nr_devs, PROM_OP_ERRORS,
+		       "tcmur_cmd_errors_total",
+		       "Cmds completed with an error by opcode.");
+	prom_print_sts(fp, devs, nr_devs);
+	prom_print_dev_u64(fp, devs, nr_devs, "tcmur_queue_depth", "gauge",
+			   "Cmds fetched from the ring and not completed.",
+			   get_queue_depth);
+	prom_print_dev_u64(fp, devs, nr_devs, "tcmur_queue_depth_max", "gauge",
+			   "Highest tcmur_queue_depth seen.",
+			   get_queue_depth_max);
+	prom_print_dev_u64(fp, devs, nr_devs, "tcmur_data_area_bytes", "gauge",
+			   "Size of the data area.", get_data_area_size);
+	prom_print_dev_u64(fp, devs, nr_devs, "tcmur_data_area_used_bytes",
+			   "gauge", "Data area space of the fetched cmds.",
+			   get_data_area_used);
+	prom_print_dev_u64(fp, devs, nr_devs, "tcmur_data_area_used_bytes_max",
+			   "gauge", "Highest tcmur_data_area_used_bytes seen.",
+			   get_data_area_used_max);
+	prom_print_dev_u64(fp, devs, nr_devs, "tcmur_data_area_full_total",
+			   "counter", "Times the data area became full.",
+			   get_data_area_full);
+	prom_print_data_full_secs(fp, devs, nr_devs);
+	prom_print_dev_u64(fp, devs, nr_devs, "tcmur_ring_bytes", "gauge",
+			   "Size of the cmd ring.", get_ring_size);
+	prom_print_dev_u64(fp, devs, nr_devs, "tcmur_ring_used_bytes", "gauge",
+			   "Cmd ring space of the cmds not completed.",
+			   get_ring_used);
+	prom_print_dev_u64(fp, devs, nr_devs, "tcmur_ring_used_bytes_max",
+			   "gauge", "Highest tcmur_ring_used_bytes seen at fetch.",
+			   get_ring_used_max);
+	prom_print_qos(fp, devs, nr_devs, false, "tcmur_qos_throttled_total",
+		       "Cmds held back by the QoS limits.");
+	prom_print_qos(fp, devs, nr_devs, true,
+		       "tcmur_qos_throttled_bytes_total",
+		       "Bytes of the cmds held back by the QoS limits.");
+	prom_print_dev_u64(fp, devs, nr_devs, "tcmur_qos_deferred", "gauge",
+			   "Cmds waiting on the QoS limits.",
+			   get_qos_deferred);
+	prom_print_dev_u64(fp, devs, nr_devs, "tcmur_aio_depth", "gauge",
+			   "Cmds being executed by the handler.",
+			   get_aio_depth);
+	prom_print_dev_u64(fp, devs, nr_devs, "tcmur_aio_depth_max", "gauge",
+			   "Highest tcmur_aio_depth seen.", get_aio_depth_max);
+	prom_print_dev_u64(fp, devs, nr_devs, "tcmur_lock_lost_total",
+			   "counter", "Times the device lock was lost.",
+			   get_lock_lost);
+	prom_print_dev_u64(fp, devs, nr_devs, "tcmur_conn_lost_total",
+			   "counter", "Times the backend connection was lost.",
+			   get_conn_lost);
+	prom_print_dev_u64(fp, devs, nr_devs, "tcmur_cmd_timed_out_total",
+			   "counter", "Cmds that exceeded the cmd timeout.",
+			   get_cmd_timed_out);
+	prom_print_latency(fp, devs, nr_devs);
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_STATS_H
+#define __TCMUR_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "libtcmu_common.h"
+
+struct tcmu_device;
+struct tcmu_mailbox;
+struct tcmulib_cmd;
+struct tcmur_cmd;
+
+enum tcmur_stats_class {
+	TCMUR_STATS_READ,
+	TCMUR_STATS_WRITE,
+	TCMUR_STATS_FLUSH,
+	TCMUR_STATS_UNMAP,
+	TCMUR_STATS_CAW,
+	TCMUR_STATS_XCOPY,
+	TCMUR_STATS_OTHER,
+	TCMUR_STATS_NR_CLASSES,
+};
+
+/*
+ * Where a cmd spent its time:
+ *   queue      - from being fetched off the ring to the handler callout
+ *   backend    - in the handler, until it completed the cmd
+ *   completion - waiting for cmdproc to write the completion to the ring
+ *   total      - from being fetched off the ring to the ring completion
+ */
+enum tcmur_stats_stage {
+	TCMUR_STATS_QUEUE,
+	TCMUR_STATS_BACKEND,
+	TCMUR_STATS_COMPLETION,
+	TCMUR_STATS_TOTAL,
+	TCMUR_STATS_NR_STAGES,
+};
+
+/*
+ * Log-linear (HDR style) latency histogram in nsecs. Each power of 2 is
+ * split into 2^TCMUR_HIST_SUB_BITS buckets, so values are kept within
+ * 12.5%.
+ */
+#define TCMUR_HIST_SUB_BITS 3
+#define TCMUR_HIST_SUB (1 << TCMUR_HIST_SUB_BITS)
+#define TCMUR_HIST_GROUPS 40
+#define TCMUR_HIST_BUCKETS ((TCMUR_HIST_GROUPS + 1) * TCMUR_HIST_SUB)
+
+struct tcmur_latency_hist {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t buckets[TCMUR_HIST_BUCKETS];
+};
+
+/* Number of TCMU_STS codes counted, TCMU_STS_OK and up */
+#define TCMUR_STATS_NR_STS (TCMU_STS_PI_REF_ERR + 1)
+
+struct tcmur_op_stats {
+	uint64_t cmds;
+	uint64_t bytes;		/* size of the data buffers */
+	uint64_t errors;	/* completed with anything but TCMU_STS_OK */
+};
+
+struct tcmur_dev_stats {
+	struct tcmur_latency_hist lat[TCMUR_STATS_NR_CLASSES][TCMUR_STATS_NR_STAGES];
+
+	struct tcmur_op_stats ops[256];
+	/* completions by TCMU_STS code, and those the runner did not handle */
+	uint64_t sts[TCMUR_STATS_NR_STS];
+	uint64_t not_handled;
+
+	/* cmds fetched from the ring and not completed yet */
+	uint32_t queue_depth;
+	uint32_t queue_depth_max;
+
+	/*
+	 * Data area and cmd ring use. The sizes are taken from the mapping
+	 * when the device is added, and are 0 if it could not be read.
+	 * data_bytes is the data area space of the cmds fetched and not
+	 * completed yet, rounded up to pages like the kernel allocates it.
+	 * The data area is full while data_bytes is at or above
+	 * TCMUR_DATA_AREA_FULL_PCT of data_area_size.
+	 */
+	struct tcmu_mailbox *mb;
+	uint64_t data_area_size;
+	uint32_t ring_size;
+	uint64_t data_bytes;
+	uint64_t data_bytes_max;
+	uint32_t ring_bytes_max;
+	uint64_t data_full_cnt;
+	uint64_t data_full_ns;		/* not counting the current period */
+	uint64_t data_full_start_ns;	/* when it became full, 0 if not */
+
+	/* Only used by the main loop, see tcmur_data_area.c */
+	uint64_t data_full_ns_seen;
+	unsigned int data_saturated;
+	uint64_t data_area_mb;
+	bool data_resize_refused;
+};
+
+#define TCMUR_DATA_AREA_FULL_PCT 90
+
+uint64_t tcmur_now_ns(void);
+
+int tcmur_stats_init(struct tcmu_device *dev);
+void tcmur_stats_cleanup(struct tcmu_device *dev);
+void tcmur_stats_cmd_start(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
+void tcmur_stats_cmd_done(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			  int rc);
+
+const char *tcmur_stats_class_name(enum tcmur_stats_class cls);
+const char *tcmur_stats_stage_name(enum tcmur_stats_stage stage);
+void tcmur_hist_record(struct tcmur_latency_hist *hist, uint64_t ns);
+uint64_t tcmur_hist_percentile(struct tcmur_latency_hist *hist, double pct);
+const char *tcmur_stats_sts_name(int sts);
+uint64_t tcmur_stats_data_full_ns(struct tcmur_dev_stats *stats, uint64_t now);
+uint32_t tcmur_stats_ring_bytes(struct tcmur_dev_stats *stats);
+void tcmur_stats_print_prom(FILE *fp, struct tcmu_device **devs,
+			    unsigned int nr_devs);
+
+#endif